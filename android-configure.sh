@@ -362,6 +362,27 @@ fi
 #
 feature_check_header HAVE_BYTESWAP_H "<byteswap.h>"
 
+# check whether we have <sys/timerfd.h>, used by the 'timerfd' alarm timer
+#
+feature_check_header HAVE_TIMERFD_H "<sys/timerfd.h>"
+
+# check whether we have <sys/eventfd.h>, used to signal AIO completions
+#
+feature_check_header HAVE_EVENTFD_H "<sys/eventfd.h>"
+
+# check whether we have preadv() and pwritev(), used by the AIO threads
+#
+cat > $TMPC << EOF
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+int main(void) {
+    struct iovec iov;
+    return preadv(0, &iov, 1, 0) + pwritev(0, &iov, 1, 0);
+}
+EOF
+feature_check_link HAVE_PREADV
+
 # Build the config.make file
 #
 
@@ -408,6 +429,15 @@ echo "#define HOST_LONG_BITS  $HOST_LONGBITS" >> $config_h
 if [ "$HAVE_BYTESWAP_H" = "yes" ] ; then
   echo "#define HAVE_BYTESWAP_H 1" >> $config_h
 fi
+if [ "$HAVE_TIMERFD_H" = "yes" ] ; then
+  echo "#define CONFIG_TIMERFD  1" >> $config_h
+fi
+if [ "$HAVE_EVENTFD_H" = "yes" ] ; then
+  echo "#define CONFIG_EVENTFD  1" >> $config_h
+fi
+if [ "$HAVE_PREADV" = "yes" ] ; then
+  echo "#define CONFIG_PREADV   1" >> $config_h
+fi
 echo "#define CONFIG_GDBSTUB  1" >> $config_h
 echo "#define CONFIG_SLIRP    1" >> $config_h
 echo "#define CONFIG_SKINS    1" >> $config_h
@@ -128,6 +128,8 @@ OPT_PARAM( keyset, "<name>", "specify keyset file name" )
 OPT_PARAM( shell_serial, "<device>", "specific character device for root shell" )
 OPT_FLAG ( old_system, "support old (pre 1.4) system images" )
 OPT_PARAM( tcpdump, "<file>", "capture network packets to file" )
+OPT_PARAM( frame_shm, "<name>", "publish screen frames in shared memory" )
+OPT_PARAM( frame_log, "<file>", "record screen updates to file" )
 
 OPT_PARAM( bootchart, "<timeout>", "enable bootcharting")
 
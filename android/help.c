@@ -1320,6 +1320,34 @@ help_tcpdump(stralloc_t  *out)
     );
 }
 
+static void
+help_frame_shm(stralloc_t  *out)
+{
+    PRINTF(
+    "  use '-frame-shm <name>' to publish the frames of the emulated screen in\n"
+    "  the POSIX shared memory object <name>, where an external program (e.g. a\n"
+    "  video encoder) can read them while the emulator runs. this works even\n"
+    "  with -no-window.\n\n"
+
+    "  the shared memory holds a ring of the last complete frames, see\n"
+    "  docs/ANDROID-FRAME-CAPTURE.TXT for a description of its layout.\n\n"
+    );
+}
+
+static void
+help_frame_log(stralloc_t  *out)
+{
+    PRINTF(
+    "  use '-frame-log <file>' to record all updates of the emulated screen to\n"
+    "  <file>, with timestamps from the emulated system's clock. only the pixels\n"
+    "  that changed are recorded for each frame. this works even with -no-window.\n\n"
+
+    "  the file is written in the background. if the disk cannot keep up, some\n"
+    "  frames are skipped instead of slowing down the emulated system. see\n"
+    "  docs/ANDROID-FRAME-CAPTURE.TXT for a description of the file format.\n\n"
+    );
+}
+
 static void
 help_charmap(stralloc_t  *out)
 {
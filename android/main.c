@@ -68,6 +68,7 @@
 
 #include "android/globals.h"
 #include "tcpdump.h"
+#include "framecapture.h"
 
 #include "android/qemulator.h"
 
@@ -277,6 +278,8 @@ sdl_resize(DisplayState *ds)
 }
 
 
+static DisplayChangeListener*  sdl_dcl;
+
 /* called periodically to poll for user input events */
 static void sdl_refresh(DisplayState *ds)
 {
@@ -289,6 +292,8 @@ static void sdl_refresh(DisplayState *ds)
     * has changed */
     qframebuffer_check_updates();
 
+    /* without a window, there is no input to poll while the guest is idle */
+    sdl_dcl->idle = (window == NULL);
     if (window == NULL)
         return;
 
@@ -575,6 +580,7 @@ void sdl_display_init(DisplayState *ds, int full_screen, int  no_frame)
     dcl->dpy_refresh     = sdl_refresh;
     dcl->dpy_text_cursor = NULL;
     register_displaychangelistener(ds, dcl);
+    sdl_dcl = dcl;
 
     skin_keyboard_enable( emulator->keyboard, 1 );
     skin_keyboard_on_command( emulator->keyboard, handle_key_command, emulator );
@@ -750,6 +756,19 @@ found_a_skin:
 
     android_skin_keycharmap = skin_keyboard_charmap_name(qemulator_get()->keyboard);
 
+    /* capture the frames of the main display, if needed */
+    if (opts->frame_shm || opts->frame_log) {
+        QFrameBuffer*  qfbuff = NULL;
+
+        SKIN_FILE_LOOP_PARTS( qemulator_get()->layout_file, part )
+            if (qfbuff == NULL && part->display->valid)
+                qfbuff = part->display->qfbuff;
+        SKIN_FILE_LOOP_END_PARTS
+
+        if (qframecapture_start(qfbuff, opts->frame_shm, opts->frame_log) < 0)
+            dwarning( "could not start frame capture: %s", strerror(errno));
+    }
+
     /* the default network speed and latency can now be specified by the device skin */
     n = aconfig_find(root, "network");
     if (n != NULL) {
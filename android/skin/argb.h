@@ -130,7 +130,104 @@ mmx_interp255( mmx_t  m1, mmx_t  m2, mmx_t  zero, int  alpha )
 #define   ARGB_DECL_SCALE(s2,s)   int   s2 = (int)((s)*(s)*(1 << ARGB_RESCALE_SHIFT))
 #define   ARGB_RESCALE(x,s2)      x = mmx_mulshift( x, s2, ARGB_RESCALE_SHIFT, _zero )
 
-#else /* !USE_MMX */
+#elif defined(__SSE2__)
+/* the scaler is template code instantiated once, so it uses SSE2 only
+ * when the compiler targets it anyway, e.g. on x86_64 hosts */
+#include <emmintrin.h>
+
+/* same as the MMX version, using the low 64 bits of a SSE2 register,
+ * which doesn't require _mm_empty() when done */
+typedef __m128i   sse2_t;
+typedef  sse2_t   argb_t;
+
+static inline sse2_t
+sse2_load8888( unsigned  value, sse2_t  zero )
+{
+    return _mm_unpacklo_epi8( _mm_cvtsi32_si128 (value), zero);
+}
+
+static inline unsigned
+sse2_save8888( sse2_t   argb, sse2_t  zero )
+{
+    return (unsigned) _mm_cvtsi128_si32( _mm_packus_epi16( argb, zero ) );
+}
+
+static inline sse2_t
+sse2_mulshift( sse2_t   argb, int  multiplier, int  rshift, sse2_t  zero )
+{
+    sse2_t   argb32 = _mm_unpacklo_epi16( argb, zero );
+    sse2_t   mult   = _mm_set1_epi32( multiplier & 0xffff );
+
+    argb32 = _mm_srli_epi32( _mm_madd_epi16( argb32, mult ), rshift );
+
+    return _mm_packs_epi32( argb32, zero );
+}
+
+static inline sse2_t
+sse2_interp255( sse2_t  m1, sse2_t  m2, sse2_t  zero, int  alpha )
+{
+    sse2_t  mult, t, r;
+
+    // m1 = [ a1 | r1 | g1 | b1 ]
+    // m2 = [ a2 | r2 | g2 | b2 ]
+    mult = _mm_set1_epi32( (alpha << 16) | (alpha ^ 255) );  // mult = [ a | 1-a | ... ]
+
+    t = _mm_unpacklo_epi16( m1, m2 );    // t = [ a2 | a1 | r2 | r1 | g2 | g1 | b2 | b1 ]
+    r = _mm_madd_epi16( t, mult );       // r = [   ra    |    rr   |    rg   |    rb   ]
+    r = _mm_srli_epi32( r, 8 );
+
+    return  _mm_packs_epi32( r, zero );
+}
+
+#define   ARGB_DECL_ZERO()      sse2_t   _zero = _mm_setzero_si128()
+#define   ARGB_DECL(x)          sse2_t   x
+#define   ARGB_DECL2(x1,x2)     sse2_t   x1, x2
+#define   ARGB_ZERO(x)          x = _zero
+#define   ARGB_UNPACK(x,v)      x =  sse2_load8888((v), _zero)
+#define   ARGB_PACK(x)          sse2_save8888(x, _zero)
+#define   ARGB_COPY(x,y)        x = y
+#define   ARGB_SUM(x1,x2,x3)    x1 = _mm_add_epi32(x2, x3)
+#define   ARGB_REDUCE(x,red)   \
+    ({ \
+        int  _red = (red) >> 8;  \
+        if (_red < 256) \
+            x = sse2_mulshift( x, _red, 8, _zero ); \
+    })
+
+#define  ARGB_INTERP255(x1,x2,x3,alpha)  \
+    x1 = sse2_interp255( x2, x3, _zero, (alpha))
+
+#define    ARGB_ADDW_11(x1,x2,x3)  \
+    ARGB_SUM(x1,x2,x3)
+
+#define    ARGB_ADDW_31(x1,x2,x3)  \
+    ({ \
+        sse2_t  _t1 = _mm_add_epi16(x2, x3);  \
+        sse2_t  _t2 = _mm_slli_epi16(x2, 1);  \
+        x1 = _mm_add_epi16(_t1, _t2);  \
+    })
+
+#define    ARGB_ADDW_13(x1,x2,x3)  \
+    ({ \
+        sse2_t  _t1 = _mm_add_epi16(x2, x3);  \
+        sse2_t  _t2 = _mm_slli_epi16(x3, 1);  \
+        x1 = _mm_add_epi16(_t1, _t2);  \
+    })
+
+#define    ARGB_SHR(x1,x2,s)   \
+    x1 = _mm_srli_epi16(x2, s)
+
+
+#define    ARGB_MULSHIFT(x1,x2,v,s)   \
+    x1 = sse2_mulshift(x2, v, s, _zero)
+
+#define   ARGB_DONE  ((void)0)
+
+#define   ARGB_RESCALE_SHIFT      10
+#define   ARGB_DECL_SCALE(s2,s)   int   s2 = (int)((s)*(s)*(1 << ARGB_RESCALE_SHIFT))
+#define   ARGB_RESCALE(x,s2)      x = sse2_mulshift( x, s2, ARGB_RESCALE_SHIFT, _zero )
+
+#else /* !USE_MMX && !__SSE2__ */
 
 typedef uint32_t    argb_t;
 
@@ -212,7 +309,7 @@ typedef uint32_t    argb_t;
 #define   ARGB_DECL_SCALE(s2,s)   int   s2 = (int)((s)*(s)*(1 << ARGB_RESCALE_SHIFT))
 #define   ARGB_RESCALE(x,scale2)  ARGB_MULSHIFT(x,x,scale2,ARGB_RESCALE_SHIFT)
 
-#endif /* !USE_MMX */
+#endif /* !USE_MMX && !__SSE2__ */
 
 #define   ARGB_ADD(x1,x2)     ARGB_SUM(x1,x1,x2)
 #define   ARGB_READ(x,p)      ARGB_UNPACK(x,*(uint32_t*)(p))
@@ -0,0 +1,538 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "android/skin/pixels.h"
+
+typedef struct {
+    void  (*rgb565_to_argb32)( uint32_t*  dst, const uint8_t*  src, int  src_step,
+                               int  count, const SkinBrightness*  brightness );
+    void  (*brightness_argb32)( uint32_t*  pixels, int  count,
+                                const SkinBrightness*  brightness );
+} SkinPixelFuncs;
+
+/** PORTABLE VERSION
+ **/
+
+static __inline__ uint32_t  rgb565_to_argb32( uint32_t  pix )
+{
+    uint32_t  r = ((pix & 0xf800) << 8) | ((pix & 0xe000) << 3);
+    uint32_t  g = ((pix & 0x07e0) << 5) | ((pix & 0x0600) >> 1);
+    uint32_t  b = ((pix & 0x001f) << 3) | ((pix & 0x001c) >> 2);
+
+    return 0xff000000 | r | g | b;
+}
+
+static __inline__ uint32_t
+brightness_argb32( uint32_t  c, const SkinBrightness*  brightness )
+{
+    unsigned  alpha = brightness->alpha;
+    unsigned  ag    = (c >> 8) & 0x00ff00ff;
+    unsigned  rb    = (c)      & 0x00ff00ff;
+
+    if (brightness->mode == SKIN_BRIGHTNESS_DIM) {
+        ag = (ag*alpha)        & 0xff00ff00;
+        rb = ((rb*alpha) >> 8) & 0x00ff00ff;
+    } else {
+        unsigned  ialpha = 255 - alpha;
+
+        /* interpolate towards bright white, i.e. 0x00ffffff */
+        ag = ((ag*ialpha + 0x00ff00ff*alpha)) & 0xff00ff00;
+        rb = ((rb*ialpha + 0x00ff00ff*alpha) >> 8) & 0x00ff00ff;
+    }
+    return (uint32_t)(ag | rb);
+}
+
+static void
+rgb565_to_argb32_c( uint32_t*  dst, const uint8_t*  src, int  src_step,
+                    int  count, const SkinBrightness*  brightness )
+{
+    int  nn;
+
+    if (brightness->mode == SKIN_BRIGHTNESS_NONE) {
+        for (nn = 0; nn < count; nn++) {
+            dst[nn] = rgb565_to_argb32(((const uint16_t*)src)[0]);
+            src    += src_step;
+        }
+    } else {
+        for (nn = 0; nn < count; nn++) {
+            dst[nn] = brightness_argb32(rgb565_to_argb32(((const uint16_t*)src)[0]),
+                                        brightness);
+            src    += src_step;
+        }
+    }
+}
+
+static void
+brightness_argb32_c( uint32_t*  pixels, int  count, const SkinBrightness*  brightness )
+{
+    int  nn;
+
+    if (brightness->mode == SKIN_BRIGHTNESS_NONE)
+        return;
+
+    for (nn = 0; nn < count; nn++)
+        pixels[nn] = brightness_argb32(pixels[nn], brightness);
+}
+
+static const SkinPixelFuncs  _pixels_c = {
+    rgb565_to_argb32_c,
+    brightness_argb32_c
+};
+
+/** X86 SIMD VERSIONS
+ **
+ ** all of them are built on every x86 host, each function being compiled
+ ** for its own instruction set, and the best one the CPU supports is
+ ** selected at runtime. pixels are processed 8 (SSE2, SSSE3) or 16 (AVX2)
+ ** at a time, with one 16-bit lane per color component. the arithmetic is
+ ** the same as in the portable version.
+ **/
+
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define  PIXELS_X86  1
+#endif
+
+#if PIXELS_X86
+#include <immintrin.h>
+#include <cpuid.h>
+
+#define  SSE2_FUNC   __attribute__((target("sse2")))
+#define  SSSE3_FUNC  __attribute__((target("ssse3")))
+#define  AVX2_FUNC   __attribute__((target("avx2")))
+
+/** SSE2
+ **/
+
+/* multiplier and addend applied to each 8-bit component by brightness_x8 */
+typedef struct {
+    __m128i  mult;
+    __m128i  add;
+} BrightnessSSE2;
+
+static __inline__ SSE2_FUNC void
+brightness_sse2_init( BrightnessSSE2*  b, const SkinBrightness*  brightness )
+{
+    unsigned  alpha = brightness->alpha;
+
+    if (brightness->mode == SKIN_BRIGHTNESS_DIM) {
+        b->mult = _mm_set1_epi16( alpha );
+        b->add  = _mm_setzero_si128();
+    } else {
+        b->mult = _mm_set1_epi16( 255 - alpha );
+        b->add  = _mm_set1_epi16( 255*alpha );
+    }
+}
+
+/* c*mult + add never exceeds 255*255, so 16-bit lanes are enough */
+static __inline__ SSE2_FUNC __m128i
+brightness_x8( __m128i  c, const BrightnessSSE2*  b )
+{
+    return _mm_srli_epi16( _mm_add_epi16( _mm_mullo_epi16( c, b->mult ), b->add ), 8 );
+}
+
+/* load 8 RGB565 pixels read from a column */
+static __inline__ SSE2_FUNC __m128i
+load_rgb565_column_x8( const uint8_t*  src, int  src_step )
+{
+    __m128i  v;
+
+#define  PIX(n)  ((const uint16_t*)(src + (n)*src_step))[0]
+    v = _mm_cvtsi32_si128( PIX(0) );
+    v = _mm_insert_epi16( v, PIX(1), 1 );
+    v = _mm_insert_epi16( v, PIX(2), 2 );
+    v = _mm_insert_epi16( v, PIX(3), 3 );
+    v = _mm_insert_epi16( v, PIX(4), 4 );
+    v = _mm_insert_epi16( v, PIX(5), 5 );
+    v = _mm_insert_epi16( v, PIX(6), 6 );
+    v = _mm_insert_epi16( v, PIX(7), 7 );
+#undef PIX
+    return v;
+}
+
+/* load 8 RGB565 pixels, see skin_pixels_rgb565_to_argb32() for 'src_step' */
+static __inline__ SSE2_FUNC __m128i
+load_rgb565_x8( const uint8_t*  src, int  src_step )
+{
+    __m128i  v;
+
+    if (src_step == 2)
+        return _mm_loadu_si128( (const __m128i*)src );
+
+    if (src_step == -2) {
+        v = _mm_loadu_si128( (const __m128i*)(src - 14) );
+        v = _mm_shuffle_epi32( v, _MM_SHUFFLE(0,1,2,3) );
+        v = _mm_shufflelo_epi16( v, _MM_SHUFFLE(2,3,0,1) );
+        return _mm_shufflehi_epi16( v, _MM_SHUFFLE(2,3,0,1) );
+    }
+    return load_rgb565_column_x8( src, src_step );
+}
+
+/* convert the 8 RGB565 pixels of 'p' and store them at 'dst'. 'a' is the
+ * alpha value, 'b' is NULL if no brightness adjustment is needed */
+static __inline__ SSE2_FUNC void
+convert_rgb565_x8( uint32_t*  dst, __m128i  p, __m128i  a, const BrightnessSSE2*  b )
+{
+    const __m128i  mask5 = _mm_set1_epi16( 0x1f );
+    const __m128i  mask6 = _mm_set1_epi16( 0x3f );
+    __m128i        r  = _mm_srli_epi16( p, 11 );
+    __m128i        g  = _mm_and_si128( _mm_srli_epi16( p, 5 ), mask6 );
+    __m128i        bl = _mm_and_si128( p, mask5 );
+    __m128i        bg, ar;
+
+    /* expand to 8 bits by replicating the high bits */
+    r  = _mm_or_si128( _mm_slli_epi16( r, 3 ),  _mm_srli_epi16( r, 2 ) );
+    g  = _mm_or_si128( _mm_slli_epi16( g, 2 ),  _mm_srli_epi16( g, 4 ) );
+    bl = _mm_or_si128( _mm_slli_epi16( bl, 3 ), _mm_srli_epi16( bl, 2 ) );
+
+    if (b) {
+        r  = brightness_x8( r, b );
+        g  = brightness_x8( g, b );
+        bl = brightness_x8( bl, b );
+    }
+
+    bg = _mm_or_si128( bl, _mm_slli_epi16( g, 8 ) );
+    ar = _mm_or_si128( r,  _mm_slli_epi16( a, 8 ) );
+    _mm_storeu_si128( (__m128i*)dst,       _mm_unpacklo_epi16( bg, ar ) );
+    _mm_storeu_si128( (__m128i*)(dst + 4), _mm_unpackhi_epi16( bg, ar ) );
+}
+
+static SSE2_FUNC void
+rgb565_to_argb32_sse2( uint32_t*  dst, const uint8_t*  src, int  src_step,
+                       int  count, const SkinBrightness*  brightness )
+{
+    __m128i         a  = _mm_set1_epi16( 0xff );
+    BrightnessSSE2  b, *pb = NULL;
+
+    if (brightness->mode != SKIN_BRIGHTNESS_NONE) {
+        brightness_sse2_init( &b, brightness );
+        a  = brightness_x8( a, &b );
+        pb = &b;
+    }
+
+    for ( ; count >= 8; count -= 8 ) {
+        convert_rgb565_x8( dst, load_rgb565_x8( src, src_step ), a, pb );
+        dst += 8;
+        src += 8*src_step;
+    }
+    rgb565_to_argb32_c( dst, src, src_step, count, brightness );
+}
+
+static SSE2_FUNC void
+brightness_argb32_sse2( uint32_t*  pixels, int  count, const SkinBrightness*  brightness )
+{
+    const __m128i   zero = _mm_setzero_si128();
+    BrightnessSSE2  b;
+
+    if (brightness->mode == SKIN_BRIGHTNESS_NONE)
+        return;
+
+    brightness_sse2_init( &b, brightness );
+    for ( ; count >= 4; count -= 4 ) {
+        __m128i  v  = _mm_loadu_si128( (const __m128i*)pixels );
+        __m128i  lo = brightness_x8( _mm_unpacklo_epi8( v, zero ), &b );
+        __m128i  hi = brightness_x8( _mm_unpackhi_epi8( v, zero ), &b );
+
+        _mm_storeu_si128( (__m128i*)pixels, _mm_packus_epi16( lo, hi ) );
+        pixels += 4;
+    }
+    brightness_argb32_c( pixels, count, brightness );
+}
+
+static const SkinPixelFuncs  _pixels_sse2 = {
+    rgb565_to_argb32_sse2,
+    brightness_argb32_sse2
+};
+
+/** SSSE3
+ **
+ ** mirrored rows, used by the 180 degree rotation, are reversed with a
+ ** single byte shuffle. the rest is the SSE2 code.
+ **/
+
+static SSSE3_FUNC void
+rgb565_to_argb32_ssse3( uint32_t*  dst, const uint8_t*  src, int  src_step,
+                        int  count, const SkinBrightness*  brightness )
+{
+    const __m128i   reverse = _mm_setr_epi8( 14,15, 12,13, 10,11, 8,9,
+                                             6,7,   4,5,   2,3,   0,1 );
+    __m128i         a  = _mm_set1_epi16( 0xff );
+    BrightnessSSE2  b, *pb = NULL;
+
+    if (src_step != -2) {
+        rgb565_to_argb32_sse2( dst, src, src_step, count, brightness );
+        return;
+    }
+
+    if (brightness->mode != SKIN_BRIGHTNESS_NONE) {
+        brightness_sse2_init( &b, brightness );
+        a  = brightness_x8( a, &b );
+        pb = &b;
+    }
+
+    for ( ; count >= 8; count -= 8 ) {
+        __m128i  p = _mm_loadu_si128( (const __m128i*)(src - 14) );
+
+        convert_rgb565_x8( dst, _mm_shuffle_epi8( p, reverse ), a, pb );
+        dst += 8;
+        src -= 16;
+    }
+    rgb565_to_argb32_c( dst, src, src_step, count, brightness );
+}
+
+static const SkinPixelFuncs  _pixels_ssse3 = {
+    rgb565_to_argb32_ssse3,
+    brightness_argb32_sse2
+};
+
+/** AVX2
+ **
+ ** same as SSE2 with 256-bit registers. most AVX2 instructions work on
+ ** each 128-bit half separately, which the loads and stores account for.
+ **/
+
+typedef struct {
+    __m256i  mult;
+    __m256i  add;
+} BrightnessAVX2;
+
+static __inline__ AVX2_FUNC void
+brightness_avx2_init( BrightnessAVX2*  b, const SkinBrightness*  brightness )
+{
+    unsigned  alpha = brightness->alpha;
+
+    if (brightness->mode == SKIN_BRIGHTNESS_DIM) {
+        b->mult = _mm256_set1_epi16( alpha );
+        b->add  = _mm256_setzero_si256();
+    } else {
+        b->mult = _mm256_set1_epi16( 255 - alpha );
+        b->add  = _mm256_set1_epi16( 255*alpha );
+    }
+}
+
+static __inline__ AVX2_FUNC __m256i
+brightness_x16( __m256i  c, const BrightnessAVX2*  b )
+{
+    return _mm256_srli_epi16( _mm256_add_epi16( _mm256_mullo_epi16( c, b->mult ), b->add ), 8 );
+}
+
+/* load 16 RGB565 pixels, see skin_pixels_rgb565_to_argb32() for 'src_step' */
+static __inline__ AVX2_FUNC __m256i
+load_rgb565_x16( const uint8_t*  src, int  src_step )
+{
+    __m256i  v;
+
+    if (src_step == 2)
+        return _mm256_loadu_si256( (const __m256i*)src );
+
+    if (src_step == -2) {
+        const __m256i  reverse = _mm256_setr_epi8( 14,15, 12,13, 10,11, 8,9,
+                                                   6,7,   4,5,   2,3,   0,1,
+                                                   14,15, 12,13, 10,11, 8,9,
+                                                   6,7,   4,5,   2,3,   0,1 );
+        /* swap the halves, then reverse the pixels of each one */
+        v = _mm256_loadu_si256( (const __m256i*)(src - 30) );
+        v = _mm256_permute4x64_epi64( v, _MM_SHUFFLE(1,0,3,2) );
+        return _mm256_shuffle_epi8( v, reverse );
+    }
+
+    v = _mm256_castsi128_si256( load_rgb565_column_x8( src, src_step ) );
+    return _mm256_inserti128_si256( v, load_rgb565_column_x8( src + 8*src_step,
+                                                              src_step ), 1 );
+}
+
+static AVX2_FUNC void
+rgb565_to_argb32_avx2( uint32_t*  dst, const uint8_t*  src, int  src_step,
+                       int  count, const SkinBrightness*  brightness )
+{
+    const __m256i   mask5 = _mm256_set1_epi16( 0x1f );
+    const __m256i   mask6 = _mm256_set1_epi16( 0x3f );
+    __m256i         a     = _mm256_set1_epi16( 0xff );
+    int             dim   = (brightness->mode != SKIN_BRIGHTNESS_NONE);
+    BrightnessAVX2  b;
+
+    if (dim) {
+        brightness_avx2_init( &b, brightness );
+        a = brightness_x16( a, &b );
+    }
+
+    for ( ; count >= 16; count -= 16 ) {
+        __m256i  p  = load_rgb565_x16( src, src_step );
+        __m256i  r  = _mm256_srli_epi16( p, 11 );
+        __m256i  g  = _mm256_and_si256( _mm256_srli_epi16( p, 5 ), mask6 );
+        __m256i  bl = _mm256_and_si256( p, mask5 );
+        __m256i  bg, ar, lo, hi;
+
+        r  = _mm256_or_si256( _mm256_slli_epi16( r, 3 ),  _mm256_srli_epi16( r, 2 ) );
+        g  = _mm256_or_si256( _mm256_slli_epi16( g, 2 ),  _mm256_srli_epi16( g, 4 ) );
+        bl = _mm256_or_si256( _mm256_slli_epi16( bl, 3 ), _mm256_srli_epi16( bl, 2 ) );
+
+        if (dim) {
+            r  = brightness_x16( r, &b );
+            g  = brightness_x16( g, &b );
+            bl = brightness_x16( bl, &b );
+        }
+
+        /* lo holds pixels 0-3 and 8-11, hi holds pixels 4-7 and 12-15 */
+        bg = _mm256_or_si256( bl, _mm256_slli_epi16( g, 8 ) );
+        ar = _mm256_or_si256( r,  _mm256_slli_epi16( a, 8 ) );
+        lo = _mm256_unpacklo_epi16( bg, ar );
+        hi = _mm256_unpackhi_epi16( bg, ar );
+        _mm256_storeu_si256( (__m256i*)dst,
+                             _mm256_permute2x128_si256( lo, hi, 0x20 ) );
+        _mm256_storeu_si256( (__m256i*)(dst + 8),
+                             _mm256_permute2x128_si256( lo, hi, 0x31 ) );
+
+        dst += 16;
+        src += 16*src_step;
+    }
+    rgb565_to_argb32_sse2( dst, src, src_step, count, brightness );
+}
+
+static AVX2_FUNC void
+brightness_argb32_avx2( uint32_t*  pixels, int  count, const SkinBrightness*  brightness )
+{
+    const __m256i   zero = _mm256_setzero_si256();
+    BrightnessAVX2  b;
+
+    if (brightness->mode == SKIN_BRIGHTNESS_NONE)
+        return;
+
+    brightness_avx2_init( &b, brightness );
+    for ( ; count >= 8; count -= 8 ) {
+        __m256i  v  = _mm256_loadu_si256( (const __m256i*)pixels );
+        __m256i  lo = brightness_x16( _mm256_unpacklo_epi8( v, zero ), &b );
+        __m256i  hi = brightness_x16( _mm256_unpackhi_epi8( v, zero ), &b );
+
+        /* the unpacks and the pack work within each half: order is kept */
+        _mm256_storeu_si256( (__m256i*)pixels, _mm256_packus_epi16( lo, hi ) );
+        pixels += 8;
+    }
+    brightness_argb32_sse2( pixels, count, brightness );
+}
+
+static const SkinPixelFuncs  _pixels_avx2 = {
+    rgb565_to_argb32_avx2,
+    brightness_argb32_avx2
+};
+
+/* return the best version supported by the host CPU and OS */
+static SkinPixelsVariant
+pixels_detect( void )
+{
+    unsigned  eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) || !(edx & (1 << 26)))
+        return SKIN_PIXELS_PORTABLE;
+    if (!(ecx & (1 << 9)))
+        return SKIN_PIXELS_SSE2;
+
+    /* AVX2 also needs the OS to save the upper halves of the registers,
+     * i.e. OSXSAVE and AVX set, and XCR0 enabling the SSE and AVX states */
+    if ((ecx & (3 << 27)) != (3 << 27))
+        return SKIN_PIXELS_SSSE3;
+    __asm__ __volatile__( ".byte 0x0f, 0x01, 0xd0"     /* xgetbv */
+                          : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0) );
+    if ((xcr0_lo & 6) != 6 || __get_cpuid_max( 0, NULL ) < 7)
+        return SKIN_PIXELS_SSSE3;
+    __cpuid_count( 7, 0, eax, ebx, ecx, edx );
+    if (!(ebx & (1 << 5)))
+        return SKIN_PIXELS_SSSE3;
+
+    return SKIN_PIXELS_AVX2;
+}
+
+static const SkinPixelFuncs*  _pixels_variants[SKIN_PIXELS_VARIANT_COUNT] = {
+    [SKIN_PIXELS_PORTABLE] = &_pixels_c,
+    [SKIN_PIXELS_SSE2]     = &_pixels_sse2,
+    [SKIN_PIXELS_SSSE3]    = &_pixels_ssse3,
+    [SKIN_PIXELS_AVX2]     = &_pixels_avx2,
+};
+
+#else /* !PIXELS_X86 */
+
+static SkinPixelsVariant
+pixels_detect( void )
+{
+    return SKIN_PIXELS_PORTABLE;
+}
+
+static const SkinPixelFuncs*  _pixels_variants[SKIN_PIXELS_VARIANT_COUNT] = {
+    [SKIN_PIXELS_PORTABLE] = &_pixels_c,
+};
+
+#endif /* !PIXELS_X86 */
+
+
+static SkinPixelsVariant  _pixels_best    = -1;   /* not detected yet */
+static SkinPixelsVariant  _pixels_variant = SKIN_PIXELS_PORTABLE;
+static const SkinPixelFuncs*  _pixels;
+
+static const char* const  _pixels_names[SKIN_PIXELS_VARIANT_COUNT] = {
+    [SKIN_PIXELS_PORTABLE] = "portable",
+    [SKIN_PIXELS_SSE2]     = "sse2",
+    [SKIN_PIXELS_SSSE3]    = "ssse3",
+    [SKIN_PIXELS_AVX2]     = "avx2",
+};
+
+int
+skin_pixels_use_simd( SkinPixelsVariant  variant )
+{
+    if (_pixels_best < 0)
+        _pixels_best = pixels_detect();
+
+    if (variant == SKIN_PIXELS_BEST)
+        variant = _pixels_best;
+    if (variant < 0 || variant > _pixels_best)
+        return -1;
+
+    _pixels_variant = variant;
+    _pixels         = _pixels_variants[variant];
+    return 0;
+}
+
+SkinPixelsVariant
+skin_pixels_get_variant( void )
+{
+    if (!_pixels)
+        skin_pixels_use_simd( SKIN_PIXELS_BEST );
+    return _pixels_variant;
+}
+
+const char*
+skin_pixels_variant_name( SkinPixelsVariant  variant )
+{
+    if (variant < 0 || variant >= SKIN_PIXELS_VARIANT_COUNT)
+        return "unknown";
+    return _pixels_names[variant];
+}
+
+void
+skin_pixels_rgb565_to_argb32( uint32_t*              dst,
+                              const uint8_t*         src,
+                              int                    src_step,
+                              int                    count,
+                              const SkinBrightness*  brightness )
+{
+    if (!_pixels)
+        skin_pixels_use_simd( SKIN_PIXELS_BEST );
+    _pixels->rgb565_to_argb32( dst, src, src_step, count, brightness );
+}
+
+void
+skin_pixels_brightness_argb32( uint32_t*              pixels,
+                               int                    count,
+                               const SkinBrightness*  brightness )
+{
+    if (!_pixels)
+        skin_pixels_use_simd( SKIN_PIXELS_BEST );
+    _pixels->brightness_argb32( pixels, count, brightness );
+}
@@ -0,0 +1,73 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _ANDROID_SKIN_PIXELS_H
+#define _ANDROID_SKIN_PIXELS_H
+
+#include <stdint.h>
+
+/* pixel conversion routines used to display the emulated framebuffer.
+ * on x86 hosts, SSE2, SSSE3 and AVX2 versions are built and the best one
+ * the host CPU supports is selected at startup. other hosts use portable
+ * C code. all versions give exactly the same results.
+ */
+
+/* brightness adjustment of ARGB32 pixels, see lcd_brightness_argb32() */
+typedef enum {
+    SKIN_BRIGHTNESS_NONE = 0,   /* keep colors unchanged */
+    SKIN_BRIGHTNESS_DIM,        /* interpolate towards black */
+    SKIN_BRIGHTNESS_BRIGHT      /* interpolate towards white */
+} SkinBrightnessMode;
+
+typedef struct {
+    SkinBrightnessMode  mode;
+    unsigned            alpha;  /* 0..255 */
+} SkinBrightness;
+
+/* convert 'count' RGB565 pixels to ARGB32 at 'dst', applying 'brightness'.
+ * source pixels are read from 'src', which is advanced by 'src_step' bytes
+ * for each pixel. use 2 for a normal row, -2 to mirror it, and plus or
+ * minus the framebuffer pitch to read a column for 90 and 270 degree
+ * rotations.
+ */
+extern void  skin_pixels_rgb565_to_argb32( uint32_t*              dst,
+                                           const uint8_t*         src,
+                                           int                    src_step,
+                                           int                    count,
+                                           const SkinBrightness*  brightness );
+
+/* apply 'brightness' to 'count' ARGB32 pixels in place */
+extern void  skin_pixels_brightness_argb32( uint32_t*              pixels,
+                                            int                    count,
+                                            const SkinBrightness*  brightness );
+
+/* versions of the routines above, each one requires the previous ones */
+typedef enum {
+    SKIN_PIXELS_PORTABLE = 0,
+    SKIN_PIXELS_SSE2,
+    SKIN_PIXELS_SSSE3,
+    SKIN_PIXELS_AVX2,
+    SKIN_PIXELS_VARIANT_COUNT,
+
+    SKIN_PIXELS_BEST = -1       /* best one supported by the host */
+} SkinPixelsVariant;
+
+/* select the version used by the routines above. the best one is used by
+ * default, selecting another one is useful to check that they all give
+ * the same results. returns 0 on success, or -1 if the host does not
+ * support 'variant', in which case the current one is kept. */
+extern int          skin_pixels_use_simd( SkinPixelsVariant  variant );
+
+/* return the version currently used, and the name of a version */
+extern SkinPixelsVariant  skin_pixels_get_variant( void );
+extern const char*        skin_pixels_variant_name( SkinPixelsVariant  variant );
+
+#endif /* _ANDROID_SKIN_PIXELS_H */
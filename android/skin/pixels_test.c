@@ -0,0 +1,166 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check that each SIMD version of the routines in pixels.c supported by
+ * the host gives exactly the same results as the portable one, for all
+ * RGB565 values, brightness modes and levels, and source steps. run with
+ * 'make check'.
+ */
+#include "android/skin/pixels.h"
+#include <stdio.h>
+#include <string.h>
+
+/* all RGB565 values, as a 256x256 framebuffer */
+#define  FB_WIDTH   256
+#define  FB_HEIGHT  256
+#define  FB_PITCH   (FB_WIDTH*2)
+#define  FB_PIXELS  (FB_WIDTH*FB_HEIGHT)
+
+static uint16_t  fb[FB_PIXELS];
+static uint32_t  argb[FB_PIXELS];
+static uint32_t  out_c[FB_PIXELS];
+static uint32_t  out_simd[FB_PIXELS];
+
+static int                errors;
+static SkinPixelsVariant  variant;   /* the version being checked */
+
+static void
+compare( const char*  what, const SkinBrightness*  brightness, int  step, int  count )
+{
+    int  nn;
+
+    for (nn = 0; nn < count; nn++) {
+        if (out_c[nn] != out_simd[nn]) {
+            fprintf(stderr, "%s %s: mode %d alpha %u step %d pixel %d: "
+                    "got %08x, expected %08x\n",
+                    what, skin_pixels_variant_name(variant), brightness->mode, brightness->alpha, step, nn,
+                    out_simd[nn], out_c[nn]);
+            errors++;
+            return;
+        }
+    }
+}
+
+/* convert 'count' pixels starting at 'src' with both versions */
+static void
+check_convert( const uint8_t*  src, int  step, int  count,
+               const SkinBrightness*  brightness )
+{
+    skin_pixels_use_simd(SKIN_PIXELS_PORTABLE);
+    skin_pixels_rgb565_to_argb32(out_c, src, step, count, brightness);
+    skin_pixels_use_simd(variant);
+    skin_pixels_rgb565_to_argb32(out_simd, src, step, count, brightness);
+    compare("rgb565_to_argb32", brightness, step, count);
+}
+
+static void
+check_brightness( const uint32_t*  src, int  count,
+                  const SkinBrightness*  brightness )
+{
+    memcpy(out_c, src, count*sizeof(uint32_t));
+    memcpy(out_simd, src, count*sizeof(uint32_t));
+    skin_pixels_use_simd(SKIN_PIXELS_PORTABLE);
+    skin_pixels_brightness_argb32(out_c, count, brightness);
+    skin_pixels_use_simd(variant);
+    skin_pixels_brightness_argb32(out_simd, count, brightness);
+    compare("brightness_argb32", brightness, 0, count);
+}
+
+static void
+check_all( const SkinBrightness*  brightness )
+{
+    const uint8_t*  base = (const uint8_t*)fb;
+    int             x, count;
+
+    /* rows, in both directions, then columns in both directions */
+    check_convert(base, 2, FB_PIXELS, brightness);
+    check_convert(base + (FB_PIXELS-1)*2, -2, FB_PIXELS, brightness);
+    for (x = 0; x < FB_WIDTH; x++) {
+        check_convert(base + x*2, FB_PITCH, FB_HEIGHT, brightness);
+        check_convert(base + (FB_PIXELS-FB_WIDTH+x)*2, -FB_PITCH, FB_HEIGHT,
+                      brightness);
+    }
+
+    /* lengths that are not a multiple of the SIMD width */
+    for (count = 0; count <= 33; count++) {
+        check_convert(base + 2*1001, 2, count, brightness);
+        check_convert(base + 2*1001, -2, count, brightness);
+    }
+
+    check_brightness(argb, FB_PIXELS, brightness);
+    for (count = 0; count <= 17; count++)
+        check_brightness(argb + 3, count, brightness);
+}
+
+static void
+check_variant( void )
+{
+    SkinBrightness  brightness;
+    int             alpha;
+
+    brightness.mode  = SKIN_BRIGHTNESS_NONE;
+    brightness.alpha = 0;
+    check_all(&brightness);
+
+    for (alpha = 0; alpha <= 255 && errors < 10; alpha++) {
+        brightness.alpha = alpha;
+        brightness.mode  = SKIN_BRIGHTNESS_DIM;
+        check_all(&brightness);
+        brightness.mode  = SKIN_BRIGHTNESS_BRIGHT;
+        check_all(&brightness);
+    }
+}
+
+int
+main( void )
+{
+    uint32_t  seed = 1;
+    int       nn, checked = 0;
+
+    for (nn = 0; nn < FB_PIXELS; nn++)
+        fb[nn] = (uint16_t)nn;
+
+    /* arbitrary ARGB32 pixels for the brightness routine, every channel
+     * value appears in the first 256 ones */
+    for (nn = 0; nn < FB_PIXELS; nn++) {
+        if (nn < 256) {
+            argb[nn] = nn * 0x01010101U;
+        } else {
+            seed = seed*1103515245 + 12345;
+            argb[nn] = seed;
+        }
+    }
+
+    for (variant = SKIN_PIXELS_PORTABLE + 1;
+         variant < SKIN_PIXELS_VARIANT_COUNT; variant++) {
+        if (skin_pixels_use_simd(variant) < 0) {
+            printf("pixels_test: %s: not supported by this host, skipped\n",
+                   skin_pixels_variant_name(variant));
+            continue;
+        }
+        check_variant();
+        checked++;
+        printf("pixels_test: %s: %s\n", skin_pixels_variant_name(variant),
+               errors ? "FAILED" : "OK");
+    }
+
+    skin_pixels_use_simd(SKIN_PIXELS_BEST);
+    printf("pixels_test: %d version(s) checked, %s used by default\n",
+           checked, skin_pixels_variant_name(skin_pixels_get_variant()));
+
+    if (errors > 0) {
+        fprintf(stderr, "pixels_test: FAILED\n");
+        return 1;
+    }
+    printf("pixels_test: OK\n");
+    return 0;
+}
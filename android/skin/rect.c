@@ -185,7 +185,7 @@ int
 skin_rect_equals( SkinRect*  r1, SkinRect*  r2 )
 {
     return (r1->pos.x  == r2->pos.x  && r1->pos.y  == r2->pos.y &&
-            r1->size.w == r2->size.w && r2->size.h == r2->size.h);
+            r1->size.w == r2->size.w && r1->size.h == r2->size.h);
 }
 
 /** SKIN BOXES
@@ -144,7 +144,7 @@ runstore_unrefp( RunStore*  *ps )
 {
     RunStore*  s = *ps;
     if (s != NULL) {
-        if (s->refcount <= 0)
+        if (--s->refcount <= 0)
             runstore_free(s);
         *ps = NULL;
     }
@@ -295,6 +295,8 @@ runs_coalesce_band( Run*  *psrc_spans, Run*  *pdst_spans, SkinBox*  minmax )
             dspan[0] = (Run) pleft;
             dspan[1] = (Run) pright;
             dspan   += 2;
+            pleft    = xleft;
+            pright   = xright;
         }
         sspan += 2;
         xleft = sspan[0];
@@ -609,6 +611,7 @@ skin_region_test_intersect( SkinRegion*  r1,
                             SkinRegion*  r2 )
 {
     Run  *runs1, *runs2;
+    Run   run1_tmp[ RUNS_RECT_COUNT ];
     Run   run2_tmp[ RUNS_RECT_COUNT ];
     SkinRect  r;
 
@@ -618,17 +621,18 @@ skin_region_test_intersect( SkinRegion*  r1,
     if ( !skin_rect_intersect( &r, &r1->bounds, &r2->bounds) )
         return SKIN_OUTSIDE;
 
+    if (region_isRect(r1) && region_isRect(r2))
+        return skin_rect_contains_rect(&r1->bounds, &r2->bounds);
+
+    /* here at least one region is complex. don't swap them, the
+     * result isn't symmetric */
     if (region_isRect(r1)) {
-        if (region_isRect(r2)) {
-            return skin_rect_contains_rect(&r1->bounds, &r2->bounds);
-        } else {
-            SkinRegion*  tmp = r1;
-            r1 = r2;
-            r2 = tmp;
-        }
+        runs1 = run1_tmp;
+        runs_set_rect(runs1, &r1->bounds);
+    }
+    else {
+        runs1 = r1->runs;
     }
-    /* here r1 is guaranteed to be complex, r2 is either rect of complex */
-    runs1 = r1->runs;
     if (region_isRect(r2)) {
         runs2 = run2_tmp;
         runs_set_rect(runs2, &r2->bounds);
@@ -639,12 +643,13 @@ skin_region_test_intersect( SkinRegion*  r1,
 
     {
         int   flags = 0;
+        int   ydone = INT_MIN;   /* the bands were compared above this */
 
         while (runs1[0] != YSENTINEL && runs2[0] != YSENTINEL)
         {
-            int  ytop1 = runs1[0];
+            int  ytop1 = (runs1[0] > ydone) ? runs1[0] : ydone;
             int  ybot1 = runs1[1];
-            int  ytop2 = runs2[0];
+            int  ytop2 = (runs2[0] > ydone) ? runs2[0] : ydone;
             int  ybot2 = runs2[1];
 
             if (ybot1 <= ytop2)
@@ -726,6 +731,7 @@ skin_region_test_intersect( SkinRegion*  r1,
                     flags |= FLAG_REGION_2;
                 }
 
+                ydone = ybot;
                 if (ybot == ybot1)
                     runs1 = runs_next_scanline( runs1 );
 
@@ -774,7 +780,7 @@ region_operator_init( RegionOperator*  o,
                       Region*          r2 )
 {
     int  run1_count, run2_count;
-    int  maxruns;
+    int  maxbands, maxruns;
 
     RASSERT( !region_isEmpty(r1) );
     RASSERT( !region_isEmpty(r2) );
@@ -797,8 +803,11 @@ region_operator_init( RegionOperator*  o,
         run2_count = runs_get_count(r2->runs);
     }
 
-    maxruns  = run1_count < run2_count ? run2_count : run1_count;
-    o->store = runstore_alloc( 3*maxruns );
+    /* each band of the result starts at a band edge of either region,
+     * and contains at most the spans of both (a band uses 5 runs or more) */
+    maxbands = 2*((run1_count + run2_count)/5 + 1);
+    maxruns  = maxbands*(run1_count + run2_count + 3) + 1;
+    o->store = runstore_alloc( maxruns );
     o->runs_base = runstore_to_runs(o->store);
 }
 
@@ -995,6 +1004,7 @@ region_operator_done( RegionOperator*  o )
     if (src <= o->runs_base + 1) {
         /* result is empty */
         skin_region_init_empty( o->result );
+        runstore_unrefp( &o->store );
         return 0;
     }
 
@@ -1038,11 +1048,9 @@ skin_region_intersect( SkinRegion*  r, SkinRegion*  r2 )
     if (region_isEmpty(r))
         return 0;
 
-    if (region_isEmpty(r2))
-        return 1;
-
-    if ( skin_rect_contains_rect( &r->bounds, &r2->bounds ) == SKIN_OUTSIDE ) {
-        skin_region_init_empty(r);
+    if (region_isEmpty(r2) ||
+        skin_rect_contains_rect( &r->bounds, &r2->bounds ) == SKIN_OUTSIDE) {
+        skin_region_reset(r);
         return 0;
     }
 
@@ -1053,7 +1061,7 @@ skin_region_intersect( SkinRegion*  r, SkinRegion*  r2 )
     skin_region_swap( r, oper->result );
     skin_region_reset( oper->result );
 
-    return region_isEmpty( r );
+    return !region_isEmpty( r );
 }
 
 
@@ -1108,10 +1116,9 @@ skin_region_substract( SkinRegion*  r, SkinRegion*  r2 )
     if (region_isEmpty(r) || region_isEmpty(r2))
         return;
 
-    if ( skin_rect_contains_rect( &r->bounds, &r2->bounds ) == SKIN_OUTSIDE ) {
-        skin_region_init_empty(r);
+    /* nothing to remove */
+    if ( skin_rect_contains_rect( &r->bounds, &r2->bounds ) == SKIN_OUTSIDE )
         return;
-    }
 
     region_operator_init( oper, r, r2 );
     region_operator_do( oper, FLAG_REGION_1 );
@@ -1144,13 +1151,9 @@ skin_region_xor( SkinRegion*  r, SkinRegion*  r2 )
     if (region_isEmpty(r2))
         return;
 
-    if ( skin_rect_contains_rect( &r->bounds, &r2->bounds ) == SKIN_OUTSIDE ) {
-        skin_region_init_empty(r);
-        return;
-    }
-
+    /* the parts that are in only one of the regions */
     region_operator_init( oper, r, r2 );
-    region_operator_do( oper, FLAG_REGION_1 );
+    region_operator_do( oper, FLAG_REGION_1|FLAG_REGION_2 );
     region_operator_done( oper );
 
     skin_region_swap( r, oper->result );
@@ -0,0 +1,362 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the operations of region.c against a bitmap model: random
+ * rectangles and regions are added, removed, intersected, xor-ed and
+ * translated, and after each operation the rectangles returned by the
+ * region iterator must cover exactly the pixels of the model, once.
+ * run with 'make check'.
+ */
+#include "android/skin/region.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* all regions stay within this area */
+#define  AREA_W   96
+#define  AREA_H   96
+#define  NB_OPS   20000
+
+typedef struct {
+    SkinRegion  region[1];
+    uint8_t     bits[AREA_H][AREA_W];
+} Model;
+
+static Model     regions[4];
+static int       errors;
+static uint32_t  rand_state = 1;
+
+static uint32_t
+next_rand( void )
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/* a random rectangle, which may stick out of the area or be empty */
+static void
+random_rect( SkinRect*  rect )
+{
+    int  x = (int)(next_rand() % (AREA_W + 16)) - 8;
+    int  y = (int)(next_rand() % (AREA_H + 16)) - 8;
+    int  w = (int)(next_rand() % 48);
+    int  h = (int)(next_rand() % 48);
+
+    skin_rect_init(rect, x, y, w, h);
+}
+
+static int
+rect_has( SkinRect*  rect, int  x, int  y )
+{
+    return x >= rect->pos.x && x < rect->pos.x + rect->size.w &&
+           y >= rect->pos.y && y < rect->pos.y + rect->size.h;
+}
+
+/* apply 'op' to every pixel of a model: 0 and, 1 or, 2 and-not, 3 xor */
+static void
+model_apply( Model*  m, int  op, uint8_t  (*bits)[AREA_W] )
+{
+    int  x, y;
+
+    for (y = 0; y < AREA_H; y++) {
+        for (x = 0; x < AREA_W; x++) {
+            uint8_t  a = m->bits[y][x], b = bits[y][x];
+            switch (op) {
+            case 0:  m->bits[y][x] = a & b; break;
+            case 1:  m->bits[y][x] = a | b; break;
+            case 2:  m->bits[y][x] = a & !b; break;
+            default: m->bits[y][x] = a ^ b; break;
+            }
+        }
+    }
+}
+
+static void
+rect_bits( SkinRect*  rect, uint8_t  (*bits)[AREA_W] )
+{
+    int  x, y;
+
+    for (y = 0; y < AREA_H; y++)
+        for (x = 0; x < AREA_W; x++)
+            bits[y][x] = rect_has(rect, x, y);
+}
+
+static int
+model_is_empty( Model*  m )
+{
+    int  x, y;
+
+    for (y = 0; y < AREA_H; y++)
+        for (x = 0; x < AREA_W; x++)
+            if (m->bits[y][x])
+                return 0;
+    return 1;
+}
+
+/* compare a region with its model, through the iterator, the bounds
+ * and point queries */
+static void
+check( int  op, Model*  m )
+{
+    static uint8_t      seen[AREA_H][AREA_W];
+    SkinRegionIterator  iter[1];
+    SkinRect            rect, bounds;
+    int                 x, y, count = 0;
+    int                 x1 = AREA_W, y1 = AREA_H, x2 = 0, y2 = 0;
+
+    memset(seen, 0, sizeof(seen));
+    skin_region_iterator_init(iter, m->region);
+    while (skin_region_iterator_next(iter, &rect)) {
+        if (rect.size.w <= 0 || rect.size.h <= 0 ||
+            rect.pos.x < 0 || rect.pos.x + rect.size.w > AREA_W ||
+            rect.pos.y < 0 || rect.pos.y + rect.size.h > AREA_H) {
+            fprintf(stderr, "op %d: bad rectangle %d,%d %dx%d\n", op,
+                    rect.pos.x, rect.pos.y, rect.size.w, rect.size.h);
+            errors++;
+            return;
+        }
+        for (y = rect.pos.y; y < rect.pos.y + rect.size.h; y++) {
+            for (x = rect.pos.x; x < rect.pos.x + rect.size.w; x++) {
+                if (seen[y][x]++) {
+                    fprintf(stderr, "op %d: rectangles overlap at %d,%d\n",
+                            op, x, y);
+                    errors++;
+                    return;
+                }
+            }
+        }
+        count++;
+    }
+
+    for (y = 0; y < AREA_H; y++) {
+        for (x = 0; x < AREA_W; x++) {
+            if (seen[y][x] != m->bits[y][x]) {
+                fprintf(stderr, "op %d: pixel %d,%d is %d, expected %d\n",
+                        op, x, y, seen[y][x], m->bits[y][x]);
+                errors++;
+                return;
+            }
+            if (m->bits[y][x]) {
+                if (x < x1) x1 = x;
+                if (y < y1) y1 = y;
+                if (x >= x2) x2 = x + 1;
+                if (y >= y2) y2 = y + 1;
+            }
+            if ((skin_region_contains(m->region, x, y) != SKIN_OUTSIDE) !=
+                m->bits[y][x]) {
+                fprintf(stderr, "op %d: contains(%d,%d) is wrong\n", op, x, y);
+                errors++;
+                return;
+            }
+        }
+    }
+
+    if (skin_region_is_empty(m->region) != (count == 0) ||
+        skin_region_is_rect(m->region) != (count == 1)) {
+        fprintf(stderr, "op %d: region of %d rectangles has wrong type\n",
+                op, count);
+        errors++;
+        return;
+    }
+    if (count > 0) {
+        skin_region_get_bounds(m->region, &bounds);
+        if (bounds.pos.x != x1 || bounds.pos.y != y1 ||
+            bounds.size.w != x2 - x1 || bounds.size.h != y2 - y1) {
+            fprintf(stderr, "op %d: bounds %d,%d %dx%d, expected "
+                    "%d,%d %dx%d\n", op, bounds.pos.x, bounds.pos.y,
+                    bounds.size.w, bounds.size.h, x1, y1, x2 - x1, y2 - y1);
+            errors++;
+        }
+    }
+}
+
+/* check skin_region_contains_rect() against the model */
+static void
+check_contains_rect( int  op, Model*  m, SkinRect*  rect )
+{
+    SkinOverlap  expected, result;
+    int          x, y, in = 0, out = 0;
+
+    for (y = 0; y < AREA_H; y++) {
+        for (x = 0; x < AREA_W; x++) {
+            if (rect_has(rect, x, y)) {
+                if (m->bits[y][x])
+                    in++;
+                else
+                    out++;
+            }
+        }
+    }
+    /* rectangles are clipped to the area, and regions never leave it */
+    if (in == 0)
+        expected = SKIN_OUTSIDE;
+    else if (out == 0 && rect->pos.x >= 0 && rect->pos.y >= 0 &&
+             rect->pos.x + rect->size.w <= AREA_W &&
+             rect->pos.y + rect->size.h <= AREA_H)
+        expected = SKIN_INSIDE;
+    else
+        expected = SKIN_OVERLAP;
+
+    result = skin_region_contains_rect(m->region, rect);
+    if (result != expected) {
+        fprintf(stderr, "op %d: contains_rect(%d,%d %dx%d) is %d, "
+                "expected %d\n", op, rect->pos.x, rect->pos.y,
+                rect->size.w, rect->size.h, result, expected);
+        errors++;
+    }
+}
+
+/* check skin_region_test_intersect() against the models: is m2 inside m1 ? */
+static void
+check_test_intersect( int  op, Model*  m1, Model*  m2 )
+{
+    SkinOverlap  expected, result;
+    int          x, y, in = 0, out = 0;
+
+    for (y = 0; y < AREA_H; y++) {
+        for (x = 0; x < AREA_W; x++) {
+            if (m2->bits[y][x]) {
+                if (m1->bits[y][x])
+                    in++;
+                else
+                    out++;
+            }
+        }
+    }
+    if (in == 0)
+        expected = SKIN_OUTSIDE;
+    else if (out == 0)
+        expected = SKIN_INSIDE;
+    else
+        expected = SKIN_OVERLAP;
+
+    result = skin_region_test_intersect(m1->region, m2->region);
+    if (result != expected) {
+        fprintf(stderr, "op %d: test_intersect is %d, expected %d\n", op,
+                result, expected);
+        errors++;
+    }
+}
+
+int
+main( void )
+{
+    static uint8_t  bits[AREA_H][AREA_W];
+    SkinRect        area, rect;
+    int             op, nn;
+
+    skin_rect_init(&area, 0, 0, AREA_W, AREA_H);
+    for (nn = 0; nn < 4; nn++)
+        skin_region_init_empty(regions[nn].region);
+
+    for (op = 0; op < NB_OPS && errors < 10; op++) {
+        Model*  m = &regions[next_rand() % 4];
+        Model*  m2 = &regions[next_rand() % 4];
+        int     r = next_rand() % 12;
+
+        random_rect(&rect);
+        skin_rect_intersect(&rect, &rect, &area);
+        rect_bits(&rect, bits);
+
+        switch (r) {
+        case 0: case 1: case 2:
+            skin_region_union_rect(m->region, &rect);
+            model_apply(m, 1, bits);
+            break;
+        case 3: case 4:
+            skin_region_substract_rect(m->region, &rect);
+            model_apply(m, 2, bits);
+            break;
+        case 5:
+            {
+                int  result = skin_region_intersect_rect(m->region, &rect);
+
+                model_apply(m, 0, bits);
+                if (result != !model_is_empty(m)) {
+                    fprintf(stderr, "op %d: wrong intersect result\n", op);
+                    errors++;
+                }
+            }
+            break;
+        case 6:
+            if (m == m2)
+                break;
+            skin_region_union(m->region, m2->region);
+            model_apply(m, 1, m2->bits);
+            break;
+        case 7:
+            if (m == m2)
+                break;
+            skin_region_substract(m->region, m2->region);
+            model_apply(m, 2, m2->bits);
+            break;
+        case 8:
+            if (m == m2)
+                break;
+            skin_region_intersect(m->region, m2->region);
+            model_apply(m, 0, m2->bits);
+            break;
+        case 9:
+            if (m == m2)
+                break;
+            skin_region_xor(m->region, m2->region);
+            model_apply(m, 3, m2->bits);
+            break;
+        case 10:
+            {
+                /* translate, then clip back to the area */
+                int  dx = (int)(next_rand() % 17) - 8;
+                int  dy = (int)(next_rand() % 17) - 8;
+                int  x, y;
+
+                skin_region_translate(m->region, dx, dy);
+                skin_region_intersect_rect(m->region, &area);
+                for (y = 0; y < AREA_H; y++)
+                    for (x = 0; x < AREA_W; x++) {
+                        int  sx = x - dx, sy = y - dy;
+                        bits[y][x] = (sx >= 0 && sx < AREA_W &&
+                                      sy >= 0 && sy < AREA_H) ?
+                                     m->bits[sy][sx] : 0;
+                    }
+                memcpy(m->bits, bits, sizeof(bits));
+            }
+            break;
+        default:
+            if (m == m2)
+                break;
+            skin_region_copy(m->region, m2->region);
+            memcpy(m->bits, m2->bits, sizeof(bits));
+            if (!skin_region_equals(m->region, m2->region)) {
+                fprintf(stderr, "op %d: copy differs\n", op);
+                errors++;
+            }
+            break;
+        }
+        check(op, m);
+
+        random_rect(&rect);
+        check_contains_rect(op, m, &rect);
+        check_test_intersect(op, m, m2);
+        check_test_intersect(op, m2, m);
+    }
+
+    for (nn = 0; nn < 4; nn++)
+        skin_region_reset(regions[nn].region);
+
+    if (errors > 0) {
+        fprintf(stderr, "region_test: FAILED\n");
+        return 1;
+    }
+    printf("region_test: %d ops checked against the bitmap model: OK\n",
+           NB_OPS);
+    return 0;
+}
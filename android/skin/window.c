@@ -11,7 +11,9 @@
 */
 #include "android/skin/window.h"
 #include "android/skin/image.h"
+#include "android/skin/region.h"
 #include "android/skin/scaler.h"
+#include "android/skin/pixels.h"
 #include "android/charmap.h"
 #include "android/utils/debug.h"
 #include "android/utils/system.h"
@@ -86,8 +88,7 @@ typedef struct ADisplay {
     SkinPos        origin;
     SkinRotation   rotation;
     SkinSize       datasize;  /* framebuffer size */
-    void*          data;      /* framebuffer pixels */
-    QFrameBuffer*  qfbuff;
+    QFrameBuffer*  qfbuff;    /* framebuffer, its pixels can move */
     SkinImage*     onion;       /* onion image */
     SkinRect       onion_rect;  /* onion rect, if any */
     int            brightness;
@@ -96,7 +97,6 @@ typedef struct ADisplay {
 static void
 display_done( ADisplay*  disp )
 {
-    disp->data   = NULL;
     disp->qfbuff = NULL;
     skin_image_unref( &disp->onion );
 }
@@ -138,24 +138,13 @@ display_init( ADisplay*  disp, SkinDisplay*  sdisp, SkinLocation*  loc, SkinRect
                     disp->datasize.w, disp->datasize.h);
 #endif
     disp->qfbuff = sdisp->qfbuff;
-    disp->data   = sdisp->qfbuff->pixels;
     disp->onion  = NULL;
 
     disp->brightness = LCD_BRIGHTNESS_DEFAULT;
 
-    return (disp->data == NULL) ? -1 : 0;
+    return (disp->qfbuff->pixels == NULL) ? -1 : 0;
 }
 
-static __inline__ uint32_t  rgb565_to_argb32( uint32_t  pix )
-{
-    uint32_t  r = ((pix & 0xf800) << 8) | ((pix & 0xe000) << 3);
-    uint32_t  g = ((pix & 0x07e0) << 5) | ((pix & 0x0600) >> 1);
-    uint32_t  b = ((pix & 0x001f) << 3) | ((pix & 0x001c) >> 2);
-
-    return 0xff000000 | r | g | b;
-}
-
-
 static void
 display_set_onion( ADisplay*  disp, SkinImage*  onion, SkinRotation  rotation, int  blend )
 {
@@ -277,8 +266,9 @@ dotmatrix_dither_argb32( unsigned char*  pixels, int  x, int  y, int  w, int  h,
 /* treat as special value to turn screen off */
 #define  LCD_BRIGHTNESS_OFF   LCD_BRIGHTNESS_MIN
 
+/* compute the pixel transform corresponding to a given brightness level */
 static void
-lcd_brightness_argb32( unsigned char*  pixels, SkinRect*  r, int  pitch, int  brightness )
+lcd_brightness_get( SkinBrightness*  b, int  brightness )
 {
     const unsigned  b_min  = LCD_BRIGHTNESS_MIN;
     const unsigned  b_max  = LCD_BRIGHTNESS_MAX;
@@ -286,68 +276,54 @@ lcd_brightness_argb32( unsigned char*  pixels, SkinRect*  r, int  pitch, int  br
     const unsigned  b_high = LCD_BRIGHTNESS_HIGH;
 
     unsigned        alpha = brightness;
-    int             w     = r->size.w;
-    int             h     = r->size.h;
 
     if (alpha <= b_min)
         alpha = b_min;
     else if (alpha > b_max)
         alpha = b_max;
 
-    pixels += 4*r->pos.x + r->pos.y*pitch;
-
     if (alpha < b_low)
     {
         const unsigned  alpha_min   = (255*LCD_ALPHA_LOW_MIN);
         const unsigned  alpha_range = (255 - alpha_min);
 
-        alpha = alpha_min + ((alpha - b_min)*alpha_range) / (b_low - b_min);
-
-        for ( ; h > 0; h-- ) {
-            unsigned*  line = (unsigned*) pixels;
-            int        nn;
-
-            for (nn = 0; nn < w; nn++) {
-                unsigned  c  = line[nn];
-                unsigned  ag = (c >> 8) & 0x00ff00ff;
-                unsigned  rb = (c)      & 0x00ff00ff;
-
-                ag = (ag*alpha)        & 0xff00ff00;
-                rb = ((rb*alpha) >> 8) & 0x00ff00ff;
-
-                line[nn] = (unsigned)(ag | rb);
-            }
-            pixels += pitch;
-        }
+        b->mode  = SKIN_BRIGHTNESS_DIM;
+        b->alpha = alpha_min + ((alpha - b_min)*alpha_range) / (b_low - b_min);
     }
     else if (alpha > LCD_BRIGHTNESS_HIGH) /* 'superluminous' mode */
     {
         const unsigned  alpha_max   = (255*LCD_ALPHA_HIGH_MAX);
         const unsigned  alpha_range = (255-alpha_max);
-        unsigned        ialpha;
 
-        alpha  = ((alpha - b_high)*alpha_range) / (b_max - b_high);
-        ialpha = 255-alpha;
+        b->mode  = SKIN_BRIGHTNESS_BRIGHT;
+        b->alpha = ((alpha - b_high)*alpha_range) / (b_max - b_high);
+    }
+    else
+    {
+        b->mode  = SKIN_BRIGHTNESS_NONE;
+        b->alpha = 0;
+    }
+}
 
-        for ( ; h > 0; h-- ) {
-            unsigned*  line = (unsigned*) pixels;
-            int        nn;
+#if DOT_MATRIX
+static void
+lcd_brightness_argb32( unsigned char*  pixels, SkinRect*  r, int  pitch, int  brightness )
+{
+    SkinBrightness  b;
+    int             h = r->size.h;
 
-            for (nn = 0; nn < w; nn++) {
-                unsigned  c  = line[nn];
-                unsigned  ag = (c >> 8) & 0x00ff00ff;
-                unsigned  rb = (c)      & 0x00ff00ff;
+    lcd_brightness_get( &b, brightness );
+    if (b.mode == SKIN_BRIGHTNESS_NONE)
+        return;
 
-                /* interpolate towards bright white, i.e. 0x00ffffff */
-                ag = ((ag*ialpha + 0x00ff00ff*alpha)) & 0xff00ff00;
-                rb = ((rb*ialpha + 0x00ff00ff*alpha) >> 8) & 0x00ff00ff;
+    pixels += 4*r->pos.x + r->pos.y*pitch;
 
-                line[nn] = (unsigned)(ag | rb);
-            }
-            pixels += pitch;
-        }
+    for ( ; h > 0; h-- ) {
+        skin_pixels_brightness_argb32( (uint32_t*)pixels, r->size.w, &b );
+        pixels += pitch;
     }
 }
+#endif /* DOT_MATRIX */
 
 
 /* this is called when the LCD framebuffer is off */
@@ -383,8 +359,8 @@ display_redraw( ADisplay*  disp, SkinRect*  rect, SDL_Surface*  surface )
         int           dst_pitch = surface->pitch;
         uint8_t*      dst_line  = (uint8_t*)surface->pixels + r.pos.x*4 + r.pos.y*dst_pitch;
         int           src_pitch = disp->datasize.w*2;
-        uint8_t*      src_line  = (uint8_t*)disp->data;
-        int           yy, xx;
+        uint8_t*      src_line  = (uint8_t*)disp->qfbuff->pixels;
+        int           yy;
 #if 0
         fprintf(stderr, "--- display redraw r.pos(%d,%d) r.size(%d,%d) "
                         "disp.pos(%d,%d) disp.size(%d,%d) datasize(%d,%d) rect.pos(%d,%d) rect.size(%d,%d)\n",
@@ -400,84 +376,56 @@ display_redraw( ADisplay*  disp, SkinRect*  rect, SDL_Surface*  surface )
         }
         else
         {
+            SkinBrightness  b;
+            int             src_step;  /* source offset between two pixels */
+            int             src_next;  /* source offset between two lines  */
+
             switch ( disp->rotation & 3 )
             {
             case ANDROID_ROTATION_0:
                 src_line += x*2 + y*src_pitch;
-
-                for (yy = h; yy > 0; yy--)
-                {
-                    uint32_t*  dst = (uint32_t*)dst_line;
-                    uint16_t*  src = (uint16_t*)src_line;
-
-                    for (xx = 0; xx < w; xx++) {
-                        dst[xx] = rgb565_to_argb32(src[xx]);
-                    }
-                    src_line += src_pitch;
-                    dst_line += dst_pitch;
-                }
+                src_step  = 2;
+                src_next  = src_pitch;
                 break;
 
             case ANDROID_ROTATION_90:
                 src_line += y*2 + (disp_w - x - 1)*src_pitch;
-
-                for (yy = h; yy > 0; yy--)
-                {
-                    uint32_t*  dst = (uint32_t*)dst_line;
-                    uint8_t*   src = src_line;
-
-                    for (xx = w; xx > 0; xx--)
-                    {
-                        dst[0] = rgb565_to_argb32(((uint16_t*)src)[0]);
-                        src -= src_pitch;
-                        dst += 1;
-                    }
-                    src_line += 2;
-                    dst_line += dst_pitch;
-                }
+                src_step  = -src_pitch;
+                src_next  = 2;
                 break;
 
             case ANDROID_ROTATION_180:
                 src_line += (disp_w -1 - x)*2 + (disp_h-1-y)*src_pitch;
-
-                for (yy = h; yy > 0; yy--)
-                {
-                    uint16_t*  src = (uint16_t*)src_line;
-                    uint32_t*  dst = (uint32_t*)dst_line;
-
-                    for (xx = w; xx > 0; xx--) {
-                        dst[0] = rgb565_to_argb32(src[0]);
-                        src -= 1;
-                        dst += 1;
-                    }
-
-                    src_line -= src_pitch;
-                    dst_line += dst_pitch;
-            }
-            break;
+                src_step  = -2;
+                src_next  = -src_pitch;
+                break;
 
             default:  /* ANDROID_ROTATION_270 */
                 src_line += (disp_h-1-y)*2 + x*src_pitch;
+                src_step  = src_pitch;
+                src_next  = -2;
+            }
 
-                for (yy = h; yy > 0; yy--)
-                {
-                    uint32_t*  dst = (uint32_t*)dst_line;
-                    uint8_t*   src = src_line;
-
-                    for (xx = w; xx > 0; xx--) {
-                        dst[0] = rgb565_to_argb32(((uint16_t*)src)[0]);
-                        dst   += 1;
-                        src   += src_pitch;
-                    }
-                    src_line -= 2;
-                    dst_line += dst_pitch;
-                }
+            /* convert and apply lightness in a single pass, unless the
+             * dot matrix effect must be applied in between */
+#if DOT_MATRIX
+            b.mode  = SKIN_BRIGHTNESS_NONE;
+            b.alpha = 0;
+#else
+            lcd_brightness_get( &b, disp->brightness );
+#endif
+            for (yy = h; yy > 0; yy--)
+            {
+                skin_pixels_rgb565_to_argb32( (uint32_t*)dst_line, src_line,
+                                              src_step, w, &b );
+                src_line += src_next;
+                dst_line += dst_pitch;
             }
 #if DOT_MATRIX
             dotmatrix_dither_argb32( surface->pixels, r.pos.x, r.pos.y, r.size.w, r.size.h, surface->pitch );
-#endif
             /* apply lightness */
             lcd_brightness_argb32( surface->pixels, &r, surface->pitch, disp->brightness );
+#endif
         }
         SDL_UnlockSurface( surface );
 
@@ -842,6 +790,8 @@ struct SkinWindow {
     unsigned*     shrink_pixels;
     SDL_Surface*  shrink_surface;
 
+    SDL_Surface*  skin_layer;  /* color and backgrounds, composed once */
+
     double        effective_scale;
     double        effective_x;
     double        effective_y;
@@ -1088,6 +1038,13 @@ skin_window_set_title( SkinWindow*  window, const char*  title )
 static void
 skin_window_resize( SkinWindow*  window )
 {
+    /* the layout or scale changed, the skin layer is rebuilt on the next
+     * redraw */
+    if (window->skin_layer) {
+        SDL_FreeSurface(window->skin_layer);
+        window->skin_layer = NULL;
+    }
+
     /* now resize window */
     if (window->surface) {
         SDL_FreeSurface(window->surface);
@@ -1268,6 +1225,10 @@ skin_window_free  ( SkinWindow*  window )
             qemu_free(window->shrink_pixels);
             window->shrink_pixels = NULL;
         }
+        if (window->skin_layer) {
+            SDL_FreeSurface(window->skin_layer);
+            window->skin_layer = NULL;
+        }
         if (window->onion) {
             skin_image_unref( &window->onion );
             window->onion_rotation = SKIN_ROTATION_0;
@@ -1319,65 +1280,189 @@ skin_window_set_scale( SkinWindow*  window, double  scale )
     skin_window_redraw( window, NULL );
 }
 
+#define  STATS  0
+
+#if STATS
+#include <sys/time.h>
+
+static int      stats_counter;
+static int64_t  stats_skin_pixels;     /* skin pixels copied to the window */
+static int64_t  stats_display_pixels;  /* display pixels converted */
+static int64_t  stats_redraw_us;       /* time spent in skin_window_redraw() */
+
+static int64_t
+stats_now_us( void )
+{
+    struct timeval  tv;
+    gettimeofday( &tv, NULL );
+    return (int64_t)tv.tv_sec*1000000 + tv.tv_usec;
+}
+#endif
+
+/* the color and backgrounds of the skin only change with the layout, so
+ * they're composed once in a surface that has the format of the window's
+ * one, and is freed by skin_window_resize(). returns NULL if it cannot be
+ * allocated */
+static SDL_Surface*
+skin_window_get_layer( SkinWindow*  window )
+{
+    Layout*  layout = &window->layout;
+
+    if (window->skin_layer == NULL) {
+        SDL_PixelFormat*  format = window->surface->format;
+        SDL_Surface*      layer;
+        SDL_Rect          rd;
+
+        layer = SDL_CreateRGBSurface( SDL_SWSURFACE,
+                                      layout->rect.size.w,
+                                      layout->rect.size.h,
+                                      format->BitsPerPixel,
+                                      format->Rmask, format->Gmask,
+                                      format->Bmask, format->Amask );
+        if (layer == NULL)
+            return NULL;
+
+        /* its pixels are copied as is to the window */
+        SDL_SetAlpha( layer, 0, SDL_ALPHA_OPAQUE );
+
+        rd.x = 0;
+        rd.y = 0;
+        rd.w = layout->rect.size.w;
+        rd.h = layout->rect.size.h;
+
+        SDL_FillRect( layer, &rd, layout->color );
+        {
+            Background*  back = layout->backgrounds;
+            Background*  end  = back + layout->num_backgrounds;
+            for ( ; back < end; back++ )
+                background_redraw( back, &layout->rect, layer );
+        }
+        window->skin_layer = layer;
+    }
+    return window->skin_layer;
+}
+
+/* redraw the color and backgrounds of the skin in 'rect' */
+static void
+skin_window_redraw_skin( SkinWindow*  window, SkinRect*  rect )
+{
+    SDL_Surface*  layer = skin_window_get_layer( window );
+    SDL_Rect      rd;
+
+    rd.x = rect->pos.x;
+    rd.y = rect->pos.y;
+    rd.w = rect->size.w;
+    rd.h = rect->size.h;
+
+    if (layer != NULL) {
+        SDL_Rect  rs = rd;
+
+        SDL_BlitSurface( layer, &rs, window->surface, &rd );
+    }
+    else
+    {
+        Layout*      layout = &window->layout;
+        Background*  back   = layout->backgrounds;
+        Background*  end    = back + layout->num_backgrounds;
+
+        SDL_FillRect( window->surface, &rd, layout->color );
+        for ( ; back < end; back++ )
+            background_redraw( back, rect, window->surface );
+    }
+}
+
 void
 skin_window_redraw( SkinWindow*  window, SkinRect*  rect )
 {
     if (window != NULL && window->surface != NULL) {
-        Layout*  layout = &window->layout;
+        Layout*   layout = &window->layout;
+        SkinRect  r;
+#if STATS
+        int64_t   redraw_start = stats_now_us();
+#endif
 
         if (rect == NULL)
             rect = &layout->rect;
 
-        {
-            SkinRect  r;
-
-            if ( skin_rect_intersect( &r, rect, &layout->rect ) ) {
-                SDL_Rect  rd;
-                rd.x = r.pos.x;
-                rd.y = r.pos.y;
-                rd.w = r.size.w;
-                rd.h = r.size.h;
-
-                SDL_FillRect( window->surface, &rd, layout->color );
-            }
-        }
+        if ( !skin_rect_intersect( &r, rect, &layout->rect ) )
+            return;
 
+        /* the displays are opaque, so only redraw the skin around them.
+         * this way, a display update doesn't touch the skin at all */
         {
-            Background*  back = layout->backgrounds;
-            Background*  end  = back + layout->num_backgrounds;
-            for ( ; back < end; back++ )
-                background_redraw( back, rect, window->surface );
+            SkinRegion          region[1];
+            SkinRegionIterator  iter[1];
+            SkinRect            r2;
+
+            skin_region_init_rect( region, &r );
+
+            LAYOUT_LOOP_DISPLAYS(layout,disp)
+                if (skin_rect_contains_rect( &disp->rect, &r ) == SKIN_INSIDE)
+                    skin_region_reset( region );
+                else
+                    skin_region_substract_rect( region, &disp->rect );
+            LAYOUT_LOOP_END_DISPLAYS
+
+            skin_region_iterator_init( iter, region );
+            while ( skin_region_iterator_next( iter, &r2 ) ) {
+                skin_window_redraw_skin( window, &r2 );
+#if STATS
+                stats_skin_pixels += r2.size.w * r2.size.h;
+#endif
+            }
+            skin_region_reset( region );
         }
 
         {
             ADisplay*  disp = layout->displays;
             ADisplay*  end  = disp + layout->num_displays;
-            for ( ; disp < end; disp++ )
-                display_redraw( disp, rect, window->surface );
+            for ( ; disp < end; disp++ ) {
+#if STATS
+                SkinRect  r2;
+                if (skin_rect_intersect( &r2, &r, &disp->rect ))
+                    stats_display_pixels += r2.size.w * r2.size.h;
+#endif
+                display_redraw( disp, &r, window->surface );
+            }
         }
 
         {
             Button*  button = layout->buttons;
             Button*  end    = button + layout->num_buttons;
             for ( ; button < end; button++ )
-                button_redraw( button, rect, window->surface );
+                button_redraw( button, &r, window->surface );
         }
 
         if ( window->ball.tracking )
-            ball_state_redraw( &window->ball, rect, window->surface );
+            ball_state_redraw( &window->ball, &r, window->surface );
 
         if (window->effective_scale != 1.0)
-            skin_window_update_shrink( window, rect );
+            skin_window_update_shrink( window, &r );
         else
         {
             SDL_Rect  rd;
-            rd.x = rect->pos.x;
-            rd.y = rect->pos.y;
-            rd.w = rect->size.w;
-            rd.h = rect->size.h;
+            rd.x = r.pos.x;
+            rd.y = r.pos.y;
+            rd.w = r.size.w;
+            rd.h = r.size.h;
 
             SDL_UpdateRects( window->surface, 1, &rd );
         }
+
+#if STATS
+        stats_redraw_us += stats_now_us() - redraw_start;
+        if (++stats_counter == 120) {
+            printf( "skin redraw per call:  %lld skin pixels  %lld display pixels in %lld us\n",
+                    (long long)(stats_skin_pixels/stats_counter),
+                    (long long)(stats_display_pixels/stats_counter),
+                    (long long)(stats_redraw_us/stats_counter) );
+
+            stats_counter        = 0;
+            stats_skin_pixels    = 0;
+            stats_display_pixels = 0;
+            stats_redraw_us      = 0;
+        }
+#endif
     }
 }
 
@@ -1403,7 +1488,7 @@ skin_window_get_display( SkinWindow*  window, ADisplayInfo  *info )
         info->width    = disp->datasize.w;
         info->height   = disp->datasize.h;
         info->rotation = disp->rotation;
-        info->data     = disp->data;
+        info->data     = disp->qfbuff->pixels;
     } else {
         info->width    = 0;
         info->height   = 0;
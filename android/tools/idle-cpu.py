@@ -0,0 +1,91 @@
+#!/usr/bin/env python
+#
+# This software is licensed under the terms of the GNU General Public
+# License version 2, as published by the Free Software Foundation, and
+# may be copied, distributed, and modified under those terms.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# this script measures the host CPU usage and wakeup rate of a running
+# emulator process on Linux, e.g. to compare idle instances before and
+# after a change:
+#
+#   emulator -avd <name> -no-window &
+#   (wait until the system has booted and the screen is off)
+#   android/tools/idle-cpu.py -t 60 $(pidof emulator-arm)
+#
+# the wakeups are the voluntary context switches of all the threads of
+# the process, i.e. the number of times they blocked, which is roughly
+# the number of main loop iterations. 'info idle' in the monitor gives
+# the same CPU figures from inside the emulator.
+#
+import  sys, os, time, getopt
+
+def usage():
+    print("usage: idle-cpu.py [-t <seconds>] [-n <samples>] <pid>")
+    print("")
+    print("  -t <seconds>  duration of each sample (default 10)")
+    print("  -n <samples>  number of samples (default 1)")
+    sys.exit(1)
+
+def readCpuTicks(pid):
+    """return the user+system CPU time of a process, in clock ticks"""
+    f = open("/proc/%d/stat" % pid)
+    stat = f.read()
+    f.close()
+    # the command name can contain spaces, skip it
+    fields = stat[stat.rfind(')')+2:].split()
+    return int(fields[11]) + int(fields[12])
+
+def readWakeups(pid):
+    """return the number of voluntary context switches of all threads"""
+    total = 0
+    taskdir = "/proc/%d/task" % pid
+    for tid in os.listdir(taskdir):
+        try:
+            f = open(os.path.join(taskdir, tid, "status"))
+        except IOError:
+            continue    # thread exited
+        for line in f:
+            if line.startswith("voluntary_ctxt_switches:"):
+                total += int(line.split()[1])
+        f.close()
+    return total
+
+def main():
+    duration = 10.0
+    samples = 1
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], "t:n:h")
+    except getopt.GetoptError:
+        usage()
+    for opt, val in opts:
+        if opt == "-t":
+            duration = float(val)
+        elif opt == "-n":
+            samples = int(val)
+        else:
+            usage()
+    if len(args) != 1:
+        usage()
+    pid = int(args[0])
+    hz = os.sysconf(os.sysconf_names['SC_CLK_TCK'])
+
+    for n in range(samples):
+        t0 = time.time()
+        cpu0 = readCpuTicks(pid)
+        wake0 = readWakeups(pid)
+        time.sleep(duration)
+        cpu1 = readCpuTicks(pid)
+        wake1 = readWakeups(pid)
+        elapsed = time.time() - t0
+
+        print("host CPU: %.1f%%, %.0f wakeups/s" % (
+              (cpu1 - cpu0) * 100.0 / hz / elapsed,
+              (wake1 - wake0) / elapsed))
+
+main()
@@ -0,0 +1,127 @@
+#!/usr/bin/env python
+#
+# This software is licensed under the terms of the GNU General Public
+# License version 2, as published by the Free Software Foundation, and
+# may be copied, distributed, and modified under those terms.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# this script converts a raw NAND partition image (e.g. system.img) into
+# the compressed read-only format understood by hw/goldfish_nand_image.c,
+# see the description in hw/goldfish_nand_image.h
+#
+# usage: mknandimage.py [-c <chunk-size>] [-l <level>] <input> <output>
+#        mknandimage.py -d <input> <output>
+#
+import  sys, os, struct, zlib, getopt
+
+MAGIC        = b"ANDNANDZ"
+VERSION      = 1
+HEADER_SIZE  = 40
+HEADER_FMT   = "<8sIIQIIQ"
+
+# 64 KB is a good trade-off between compression ratio and the cost of
+# decompressing a whole chunk to read a single 2 KB page
+DEFAULT_CHUNK_SIZE = 65536
+
+def usage():
+    print("usage: %s [-c <chunk-size>] [-l <level>] <input> <output>" % sys.argv[0])
+    print("       %s -d <input> <output>" % sys.argv[0])
+    print("")
+    print("  compress a raw NAND image, or decompress one with -d")
+    sys.exit(1)
+
+def compress(src, dst, chunk_size, level):
+    image_size  = os.fstat(src.fileno()).st_size
+    chunk_count = (image_size + chunk_size - 1) // chunk_size
+
+    # the header is written last, once the index offset is known
+    dst.write(b"\0" * HEADER_SIZE)
+    index  = []
+    offset = HEADER_SIZE
+    while True:
+        data = src.read(chunk_size)
+        if not data:
+            break
+        zdata = zlib.compress(data, level)
+        if len(zdata) >= len(data):
+            zdata = data
+        index.append(offset)
+        dst.write(zdata)
+        offset += len(zdata)
+    index.append(offset)
+
+    if len(index) != chunk_count + 1:
+        raise IOError("input file changed while reading it")
+
+    dst.write(struct.pack("<%dQ" % len(index), *index))
+    dst.seek(0)
+    dst.write(struct.pack(HEADER_FMT, MAGIC, VERSION, chunk_size,
+                          image_size, chunk_count, 0, offset))
+    return image_size, offset + 8 * len(index)
+
+def decompress(src, dst):
+    header = src.read(HEADER_SIZE)
+    if len(header) != HEADER_SIZE:
+        raise IOError("file is too small")
+    magic, version, chunk_size, image_size, chunk_count, reserved, \
+        index_offset = struct.unpack(HEADER_FMT, header)
+    if magic != MAGIC or version != VERSION:
+        raise IOError("not a compressed NAND image")
+
+    src.seek(index_offset)
+    index = struct.unpack("<%dQ" % (chunk_count + 1),
+                          src.read(8 * (chunk_count + 1)))
+    for n in range(chunk_count):
+        length = min(chunk_size, image_size - n * chunk_size)
+        src.seek(index[n])
+        data = src.read(index[n+1] - index[n])
+        if len(data) != length:
+            data = zlib.decompress(data)
+        if len(data) != length:
+            raise IOError("chunk %d is corrupted" % n)
+        dst.write(data)
+    return os.fstat(src.fileno()).st_size, image_size
+
+def main():
+    chunk_size = DEFAULT_CHUNK_SIZE
+    level      = 9
+    unpack     = False
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], "c:l:dh")
+    except getopt.GetoptError:
+        usage()
+
+    for opt, value in opts:
+        if opt == "-c":
+            chunk_size = int(value, 0)
+            if chunk_size < 512 or chunk_size > 4*1024*1024:
+                print("chunk size must be between 512 and 4194304 bytes")
+                sys.exit(1)
+        elif opt == "-l":
+            level = int(value)
+        elif opt == "-d":
+            unpack = True
+        else:
+            usage()
+
+    if len(args) != 2:
+        usage()
+
+    src = open(args[0], "rb")
+    dst = open(args[1], "wb")
+    if unpack:
+        insize, outsize = decompress(src, dst)
+    else:
+        insize, outsize = compress(src, dst, chunk_size, level)
+    dst.close()
+    src.close()
+
+    print("%s: %d bytes -> %d bytes" % (args[1], insize, outsize))
+
+if __name__ == "__main__":
+    main()
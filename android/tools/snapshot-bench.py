@@ -0,0 +1,133 @@
+#!/usr/bin/env python
+#
+# This software is licensed under the terms of the GNU General Public
+# License version 2, as published by the Free Software Foundation, and
+# may be copied, distributed, and modified under those terms.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# this script saves many snapshots in a row through the monitor of a
+# running emulator, and reports the time and space they take, e.g.:
+#
+#   emulator -avd <name> -no-window -qemu -monitor tcp::4444,server,nowait &
+#   (wait until the system has booted)
+#   android/tools/snapshot-bench.py -n 100 -i <snapshot image> localhost:4444
+#
+# consecutive snapshots are saved as deltas of the previous one, with a
+# full one whenever the chain would get too long. with -k <count>, the
+# snapshot names are reused in a ring of <count> names, so that each save
+# after the first <count> ones replaces an older snapshot, and the
+# snapshots based on it are rewritten to become independent of it. with
+# -d, the snapshots are deleted at the end, oldest first, which also
+# rewrites their children.
+#
+import  sys, os, time, getopt, socket, re
+
+def usage():
+    print("usage: snapshot-bench.py [options] <host>:<port>")
+    print("")
+    print("  -n <count>   number of snapshots to save (default 100)")
+    print("  -k <count>   reuse snapshot names in a ring of <count> (default: never)")
+    print("  -p <prefix>  snapshot name prefix (default 'bench')")
+    print("  -i <image>   image holding the snapshots, to report its size")
+    print("  -d           delete the snapshots at the end")
+    sys.exit(1)
+
+class Monitor:
+    """a connection to the human monitor, which prompts with '(qemu) '"""
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port))
+        self.read()
+
+    def read(self):
+        data = b""
+        while not data.endswith(b"(qemu) "):
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise IOError("monitor connection closed")
+            data += chunk
+        return data.decode("latin-1")
+
+    def command(self, cmd):
+        self.sock.sendall((cmd + "\n").encode("latin-1"))
+        return self.read()
+
+def imageSize(path):
+    if not path:
+        return 0
+    return os.stat(path).st_size
+
+def main():
+    count = 100
+    ring = 0
+    prefix = "bench"
+    image = None
+    delete = False
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], "n:k:p:i:dh")
+    except getopt.GetoptError:
+        usage()
+    for opt, val in opts:
+        if opt == "-n":
+            count = int(val)
+        elif opt == "-k":
+            ring = int(val)
+        elif opt == "-p":
+            prefix = val
+        elif opt == "-i":
+            image = val
+        elif opt == "-d":
+            delete = True
+        else:
+            usage()
+    if len(args) != 1 or ":" not in args[0]:
+        usage()
+    host, port = args[0].rsplit(":", 1)
+
+    mon = Monitor(host, int(port))
+    saved = re.compile(r"VM state saved in (\d+) ms: (\d+) KB of RAM stored as (\d+) KB")
+    compacted = re.compile(r"(\d+) snapshot\(s\) based on .* made independent in (\d+) ms")
+
+    size0 = imageSize(image)
+    times = []
+    stored = 0
+    rewritten = 0
+    rewrite_ms = 0
+    names = []
+
+    for n in range(count):
+        name = "%s%d" % (prefix, (n % ring) if ring else n)
+        if name not in names:
+            names.append(name)
+        t0 = time.time()
+        out = mon.command("savevm " + name)
+        times.append(time.time() - t0)
+        m = saved.search(out)
+        if not m:
+            sys.stderr.write("savevm %s failed:\n%s\n" % (name, out))
+            sys.exit(1)
+        stored += int(m.group(3))
+        for c in compacted.finditer(out):
+            rewritten += int(c.group(1))
+            rewrite_ms += int(c.group(2))
+
+    total = sum(times)
+    print("%d snapshots saved in %.2f s: %.0f ms average, %.0f ms max" % (
+          count, total, total * 1000 / count, max(times) * 1000))
+    print("RAM stored: %d KB, %.0f KB per snapshot" % (stored, float(stored) / count))
+    if ring:
+        print("%d snapshots rewritten in %d ms" % (rewritten, rewrite_ms))
+    if image:
+        print("image size: %d KB -> %d KB" % (size0 >> 10, imageSize(image) >> 10))
+
+    if delete:
+        t0 = time.time()
+        for name in names:
+            mon.command("delvm " + name)
+        print("%d snapshots deleted in %.2f s" % (len(names), time.time() - t0))
+
+main()
@@ -61,6 +61,8 @@ static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
 
 BlockDriverState *bdrv_first;
 
+int64_t bdrv_metadata_cache_size;
+
 static BlockDriver *first_drv;
 
 int _path_is_absolute(const char *path)
@@ -483,6 +485,17 @@ void bdrv_close(BlockDriverState *bs)
     }
 }
 
+/* write back everything the drivers still cache and close all devices,
+   on exit */
+void bdrv_close_all(void)
+{
+    BlockDriverState *bs;
+
+    qemu_aio_flush();
+    for (bs = bdrv_first; bs != NULL; bs = bs->next)
+        bdrv_close(bs);
+}
+
 void bdrv_delete(BlockDriverState *bs)
 {
     BlockDriverState **pbs;
@@ -1101,16 +1114,28 @@ void bdrv_info_stats(Monitor *mon)
 {
     BlockDriverState *bs;
 
+    BlockDriverInfo bdi;
+
     for (bs = bdrv_first; bs != NULL; bs = bs->next) {
         monitor_printf(mon, "%s:"
                        " rd_bytes=%" PRIu64
                        " wr_bytes=%" PRIu64
                        " rd_operations=%" PRIu64
-                       " wr_operations=%" PRIu64
-                       "\n",
+                       " wr_operations=%" PRIu64,
                        bs->device_name,
                        bs->rd_bytes, bs->wr_bytes,
                        bs->rd_ops, bs->wr_ops);
+        if (bdrv_get_info(bs, &bdi) == 0 &&
+            bdi.l2_cache_hits + bdi.l2_cache_misses > 0) {
+            monitor_printf(mon,
+                           " l2_cache_hits=%" PRIu64
+                           " l2_cache_misses=%" PRIu64
+                           " refcount_cache_hits=%" PRIu64
+                           " refcount_cache_misses=%" PRIu64,
+                           bdi.l2_cache_hits, bdi.l2_cache_misses,
+                           bdi.refcount_cache_hits, bdi.refcount_cache_misses);
+        }
+        monitor_printf(mon, "\n");
     }
 }
 
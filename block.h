@@ -13,6 +13,11 @@ typedef struct BlockDriverInfo {
     int cluster_size;
     /* offset at which the VM state can be saved (0 if not possible) */
     int64_t vm_state_offset;
+    /* metadata cache lookups, 0 if irrelevant */
+    uint64_t l2_cache_hits;
+    uint64_t l2_cache_misses;
+    uint64_t refcount_cache_hits;
+    uint64_t refcount_cache_misses;
 } BlockDriverInfo;
 
 typedef struct QEMUSnapshotInfo {
@@ -24,6 +29,8 @@ typedef struct QEMUSnapshotInfo {
     uint32_t date_sec; /* UTC date of the snapshot */
     uint32_t date_nsec;
     uint64_t vm_clock_nsec; /* VM clock relative to boot */
+    char parent_id[128]; /* for a delta snapshot, id of the snapshot it is
+                            based on, empty otherwise */
 } QEMUSnapshotInfo;
 
 #define BDRV_O_RDONLY      0x0000
@@ -41,6 +48,10 @@ typedef struct QEMUSnapshotInfo {
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_CACHE_DEF)
 
+/* bytes of metadata (e.g. qcow2 L2 and refcount tables) that image formats
+   may cache for each opened image, 0 for their default */
+extern int64_t bdrv_metadata_cache_size;
+
 void bdrv_info(Monitor *mon);
 void bdrv_info_stats(Monitor *mon);
 
@@ -59,6 +70,7 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags);
 int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
                BlockDriver *drv);
 void bdrv_close(BlockDriverState *bs);
+void bdrv_close_all(void);
 int bdrv_check(BlockDriverState *bs);
 int bdrv_read(BlockDriverState *bs, int64_t sector_num,
               uint8_t *buf, int nb_sectors);
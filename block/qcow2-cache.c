@@ -0,0 +1,300 @@
+/*
+ * L2 and refcount table cache for the QCOW version 2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+/*
+ * Each cache holds a fixed number of cluster-sized metadata tables. They
+ * are found through a hash of their offset in the image, and evicted in
+ * least recently used order.
+ *
+ * Modified tables are only marked dirty, and written back when evicted or
+ * when the cache is flushed. If a cache depends on another one, the latter
+ * is flushed before any table of the former is written, e.g. refcounts
+ * reach the disk before the L2 entries that reference the new clusters,
+ * so that a crash can only leak clusters.
+ *
+ * Dirty tables are also written back at most QCOW2_CACHE_FLUSH_DELAY_MS
+ * after the first of them was modified, which bounds what is lost if the
+ * emulator dies without closing the image.
+ */
+
+#define QCOW2_CACHE_FLUSH_DELAY_MS  1000
+
+typedef struct Qcow2CachedTable Qcow2CachedTable;
+
+struct Qcow2CachedTable {
+    int64_t offset;             /* offset of the table in the image, 0 if unused */
+    void *table;
+    int dirty;
+    Qcow2CachedTable *hash_next;
+    Qcow2CachedTable *lru_prev; /* more recently used entry */
+    Qcow2CachedTable *lru_next; /* less recently used entry */
+};
+
+struct Qcow2Cache {
+    Qcow2CachedTable *entries;
+    int size;
+    int table_bits;
+    uint8_t *tables;
+    Qcow2CachedTable **buckets;
+    int hash_mask;
+    Qcow2CachedTable lru;       /* list head, lru.lru_next is the MRU entry */
+    Qcow2Cache *depends;
+    BlockDriverState *bs;
+    QEMUTimer *flush_timer;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static void lru_unlink(Qcow2CachedTable *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_insert_head(Qcow2Cache *c, Qcow2CachedTable *e)
+{
+    e->lru_prev = &c->lru;
+    e->lru_next = c->lru.lru_next;
+    c->lru.lru_next->lru_prev = e;
+    c->lru.lru_next = e;
+}
+
+static void lru_insert_tail(Qcow2Cache *c, Qcow2CachedTable *e)
+{
+    e->lru_next = &c->lru;
+    e->lru_prev = c->lru.lru_prev;
+    c->lru.lru_prev->lru_next = e;
+    c->lru.lru_prev = e;
+}
+
+static Qcow2CachedTable **hash_bucket(Qcow2Cache *c, int64_t offset)
+{
+    return &c->buckets[(offset >> c->table_bits) & c->hash_mask];
+}
+
+static void hash_remove(Qcow2Cache *c, Qcow2CachedTable *e)
+{
+    Qcow2CachedTable **pnode = hash_bucket(c, e->offset);
+
+    while (*pnode != e)
+        pnode = &(*pnode)->hash_next;
+    *pnode = e->hash_next;
+    e->hash_next = NULL;
+}
+
+static void cache_flush_timer(void *opaque)
+{
+    Qcow2Cache *c = opaque;
+
+    /* try again later if the image can't be written right now */
+    if (qcow2_cache_flush(c->bs, c) < 0)
+        qemu_mod_timer(c->flush_timer,
+                       qemu_get_clock(rt_clock) + QCOW2_CACHE_FLUSH_DELAY_MS);
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
+    int i, nb_buckets;
+
+    c = qemu_mallocz(sizeof(*c));
+    c->size = num_tables;
+    c->table_bits = s->cluster_bits;
+    c->entries = qemu_mallocz(num_tables * sizeof(Qcow2CachedTable));
+    c->tables = qemu_malloc((size_t)num_tables << c->table_bits);
+
+    for (nb_buckets = 1; nb_buckets < 2 * num_tables; nb_buckets <<= 1)
+        ;
+    c->buckets = qemu_mallocz(nb_buckets * sizeof(Qcow2CachedTable *));
+    c->hash_mask = nb_buckets - 1;
+    c->bs = bs;
+    c->flush_timer = qemu_new_timer(rt_clock, cache_flush_timer, c);
+
+    c->lru.lru_prev = c->lru.lru_next = &c->lru;
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].table = c->tables + ((size_t)i << c->table_bits);
+        lru_insert_tail(c, &c->entries[i]);
+    }
+    return c;
+}
+
+void qcow2_cache_destroy(Qcow2Cache *c)
+{
+    if (c == NULL)
+        return;
+    qemu_del_timer(c->flush_timer);
+    qemu_free_timer(c->flush_timer);
+    qemu_free(c->buckets);
+    qemu_free(c->tables);
+    qemu_free(c->entries);
+    qemu_free(c);
+}
+
+void qcow2_cache_set_dependency(Qcow2Cache *c, Qcow2Cache *dependency)
+{
+    c->depends = dependency;
+}
+
+static int cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c,
+                             Qcow2CachedTable *e)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!e->dirty)
+        return 0;
+
+    if (c->depends) {
+        ret = qcow2_cache_flush(bs, c->depends);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (bdrv_pwrite(s->hd, e->offset, e->table, s->cluster_size) !=
+        s->cluster_size)
+        return -EIO;
+
+    e->dirty = 0;
+    return 0;
+}
+
+static int compare_entry_offsets(const void *a, const void *b)
+{
+    const Qcow2CachedTable *e1 = *(Qcow2CachedTable * const *)a;
+    const Qcow2CachedTable *e2 = *(Qcow2CachedTable * const *)b;
+
+    return (e1->offset > e2->offset) - (e1->offset < e2->offset);
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    Qcow2CachedTable **dirty;
+    int i, n, ret;
+
+    for (i = n = 0; i < c->size; i++) {
+        if (c->entries[i].dirty)
+            n++;
+    }
+    if (n == 0)
+        return 0;
+
+    if (c->depends) {
+        ret = qcow2_cache_flush(bs, c->depends);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* write the tables in file order, so that a batch of them allocated
+       together goes to disk sequentially */
+    dirty = qemu_malloc(n * sizeof(Qcow2CachedTable *));
+    for (i = n = 0; i < c->size; i++) {
+        if (c->entries[i].dirty)
+            dirty[n++] = &c->entries[i];
+    }
+    qsort(dirty, n, sizeof(Qcow2CachedTable *), compare_entry_offsets);
+
+    ret = 0;
+    for (i = 0; i < n; i++) {
+        if (cache_entry_flush(bs, c, dirty[i]) < 0)
+            ret = -EIO;
+    }
+    qemu_free(dirty);
+    return ret;
+}
+
+void qcow2_cache_reset(Qcow2Cache *c)
+{
+    int i;
+
+    memset(c->buckets, 0, (c->hash_mask + 1) * sizeof(Qcow2CachedTable *));
+    for (i = 0; i < c->size; i++) {
+        Qcow2CachedTable *e = &c->entries[i];
+        e->offset = 0;
+        e->dirty = 0;
+        e->hash_next = NULL;
+        lru_unlink(e);
+        lru_insert_tail(c, e);
+    }
+}
+
+static int cache_do_get(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+                        void **table, int read_from_disk)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *e;
+    int ret;
+
+    for (e = *hash_bucket(c, offset); e != NULL; e = e->hash_next) {
+        if (e->offset == offset) {
+            if (read_from_disk)
+                c->hits++;
+            goto found;
+        }
+    }
+
+    /* not found: evict the least recently used table */
+    e = c->lru.lru_prev;
+    if (e->offset) {
+        ret = cache_entry_flush(bs, c, e);
+        if (ret < 0)
+            return ret;
+        hash_remove(c, e);
+        e->offset = 0;
+    }
+
+    if (read_from_disk) {
+        c->misses++;
+        if (bdrv_pread(s->hd, offset, e->table, s->cluster_size) !=
+            s->cluster_size)
+            return -EIO;
+    }
+
+    e->offset = offset;
+    e->hash_next = *hash_bucket(c, offset);
+    *hash_bucket(c, offset) = e;
+
+ found:
+    lru_unlink(e);
+    lru_insert_head(c, e);
+    *table = e->table;
+    return 0;
+}
+
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+                    void **table)
+{
+    return cache_do_get(bs, c, offset, table, 1);
+}
+
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+                          void **table)
+{
+    return cache_do_get(bs, c, offset, table, 0);
+}
+
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
+{
+    int i = ((uint8_t *)table - c->tables) >> c->table_bits;
+
+    assert(i >= 0 && i < c->size && c->entries[i].offset != 0);
+    c->entries[i].dirty = 1;
+    if (!qemu_timer_pending(c->flush_timer))
+        qemu_mod_timer(c->flush_timer,
+                       qemu_get_clock(rt_clock) + QCOW2_CACHE_FLUSH_DELAY_MS);
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
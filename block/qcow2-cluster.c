@@ -61,7 +61,9 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size)
     for(i = 0; i < s->l1_size; i++)
         new_l1_table[i] = be64_to_cpu(new_l1_table[i]);
 
-    /* set new table */
+    /* set new table, once its refcount is on disk */
+    if (qcow2_cache_flush(bs, s->refcount_block_cache) < 0)
+        goto fail;
     cpu_to_be32w((uint32_t*)data, new_l1_size);
     cpu_to_be64w((uint64_t*)(data + 4), new_l1_table_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, l1_size), data,
@@ -78,61 +80,19 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size)
     return -EIO;
 }
 
-void qcow2_l2_cache_reset(BlockDriverState *bs)
+/* write back and forget all the cached L2 tables, for callers that access
+   them directly in the image. Nothing is forgotten if they can't be
+   written. */
+int qcow2_l2_cache_reset(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    int ret;
 
-    memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
-}
-
-static inline int l2_cache_new_entry(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-    uint32_t min_count;
-    int min_index, i;
-
-    /* find a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    return min_index;
-}
-
-/*
- * seek_l2_table
- *
- * seek l2_offset in the l2_cache table
- * if not found, return NULL,
- * if found,
- *   increments the l2 cache hit count of the entry,
- *   if counter overflow, divide by two all counters
- *   return the pointer to the l2 cache entry
- *
- */
-
-static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
-{
-    int i, j;
-
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
-            }
-            return s->l2_cache + (i << s->l2_bits);
-        }
-    }
-    return NULL;
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0)
+        return ret;
+    qcow2_cache_reset(s->l2_table_cache);
+    return 0;
 }
 
 /*
@@ -148,24 +108,10 @@ static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
 static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
-    uint64_t *l2_table;
-
-    /* seek if the table for the given offset is in the cache */
-
-    l2_table = seek_l2_table(s, l2_offset);
-    if (l2_table != NULL)
-        return l2_table;
-
-    /* not found: load a new entry in the least used one */
+    void *l2_table;
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
-    if (bdrv_pread(s->hd, l2_offset, l2_table, s->l2_size * sizeof(uint64_t)) !=
-        s->l2_size * sizeof(uint64_t))
+    if (qcow2_cache_get(bs, s->l2_table_cache, l2_offset, &l2_table) < 0)
         return NULL;
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
 
     return l2_table;
 }
@@ -208,7 +154,6 @@ static int write_l1_entry(BDRVQcowState *s, int l1_index)
 static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
     uint64_t old_l2_offset;
     uint64_t *l2_table, l2_offset;
 
@@ -218,17 +163,11 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 
     l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
 
-    /* update the L1 entry */
-
-    s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
-    if (write_l1_entry(s, l1_index) < 0) {
-        return NULL;
-    }
-
     /* allocate a new entry in the l2 cache */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
+    if (qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset,
+                              (void **)&l2_table) < 0)
+        return NULL;
 
     if (old_l2_offset == 0) {
         /* if there was no old l2 table, clear the new table */
@@ -240,16 +179,19 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
             s->l2_size * sizeof(uint64_t))
             return NULL;
     }
-    /* write the l2 table to the file */
-    if (bdrv_pwrite(s->hd, l2_offset,
-                    l2_table, s->l2_size * sizeof(uint64_t)) !=
-        s->l2_size * sizeof(uint64_t))
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+
+    /* the new table and its refcount must be on disk before the L1 entry
+       points to it */
+    if (qcow2_cache_flush(bs, s->l2_table_cache) < 0)
         return NULL;
 
-    /* update the l2 cache entry */
+    /* update the L1 entry */
 
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
+    s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+    if (write_l1_entry(s, l1_index) < 0) {
+        return NULL;
+    }
 
     return l2_table;
 }
@@ -543,7 +485,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 {
     BDRVQcowState *s = bs->opaque;
     int l2_index, ret;
-    uint64_t l2_offset, *l2_table, cluster_offset;
+    uint64_t l2_offset, *l2_table, cluster_offset, old_cluster;
     int nb_csectors;
 
     ret = get_cluster_table(bs, offset, &l2_table, &l2_offset, &l2_index);
@@ -554,8 +496,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     if (cluster_offset & QCOW_OFLAG_COPIED)
         return cluster_offset & ~QCOW_OFLAG_COPIED;
 
-    if (cluster_offset)
-        qcow2_free_any_clusters(bs, cluster_offset, 1);
+    old_cluster = cluster_offset;
 
     cluster_offset = qcow2_alloc_bytes(bs, compressed_size);
     nb_csectors = ((cluster_offset + compressed_size - 1) >> 9) -
@@ -569,35 +510,14 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     /* compressed clusters never have the copied flag */
 
     l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    if (bdrv_pwrite(s->hd,
-                    l2_offset + l2_index * sizeof(uint64_t),
-                    l2_table + l2_index,
-                    sizeof(uint64_t)) != sizeof(uint64_t))
-        return 0;
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
 
-    return cluster_offset;
-}
+    /* the L2 table must stop referencing the old cluster before it can
+       be reused, leak it if the table can't be written now */
+    if (old_cluster && qcow2_cache_flush(bs, s->l2_table_cache) == 0)
+        qcow2_free_any_clusters(bs, old_cluster, 1);
 
-/*
- * Write L2 table updates to disk, writing whole sectors to avoid a
- * read-modify-write in bdrv_pwrite
- */
-#define L2_ENTRIES_PER_SECTOR (512 / 8)
-static int write_l2_entries(BDRVQcowState *s, uint64_t *l2_table,
-    uint64_t l2_offset, int l2_index, int num)
-{
-    int l2_start_index = l2_index & ~(L1_ENTRIES_PER_SECTOR - 1);
-    int start_offset = (8 * l2_index) & ~511;
-    int end_offset = (8 * (l2_index + num) + 511) & ~511;
-    size_t len = end_offset - start_offset;
-
-    if (bdrv_pwrite(s->hd, l2_offset + start_offset, &l2_table[l2_start_index],
-        len) != len)
-    {
-        return -1;
-    }
-
-    return 0;
+    return cluster_offset;
 }
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, uint64_t cluster_offset,
@@ -647,10 +567,12 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, uint64_t cluster_offset,
                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
      }
 
-    if (write_l2_entries(s, l2_table, l2_offset, l2_index, m->nb_clusters) < 0) {
-        ret = -1;
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+
+    /* the L2 table must stop referencing the old clusters before they
+       can be reused */
+    if (j > 0 && qcow2_cache_flush(bs, s->l2_table_cache) < 0)
         goto err;
-    }
 
     for (i = 0; i < j; i++)
         qcow2_free_any_clusters(bs,
@@ -39,7 +39,6 @@ int qcow2_refcount_init(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret, refcount_table_size2, i;
 
-    s->refcount_block_cache = qemu_malloc(s->cluster_size);
     refcount_table_size2 = s->refcount_table_size * sizeof(uint64_t);
     s->refcount_table = qemu_malloc(refcount_table_size2);
     if (s->refcount_table_size > 0) {
@@ -58,29 +57,16 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    qemu_free(s->refcount_block_cache);
     qemu_free(s->refcount_table);
 }
 
 
-static int load_refcount_block(BlockDriverState *bs,
-                               int64_t refcount_block_offset)
-{
-    BDRVQcowState *s = bs->opaque;
-    int ret;
-    ret = bdrv_pread(s->hd, refcount_block_offset, s->refcount_block_cache,
-                     s->cluster_size);
-    if (ret != s->cluster_size)
-        return -EIO;
-    s->refcount_block_cache_offset = refcount_block_offset;
-    return 0;
-}
-
 static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
 {
     BDRVQcowState *s = bs->opaque;
     int refcount_table_index, block_index;
     int64_t refcount_block_offset;
+    uint16_t *refcount_block;
 
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
     if (refcount_table_index >= s->refcount_table_size)
@@ -88,14 +74,13 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     refcount_block_offset = s->refcount_table[refcount_table_index];
     if (!refcount_block_offset)
         return 0;
-    if (refcount_block_offset != s->refcount_block_cache_offset) {
-        /* better than nothing: return allocated if read error */
-        if (load_refcount_block(bs, refcount_block_offset) < 0)
-            return 1;
-    }
+    /* better than nothing: return allocated if read error */
+    if (qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+                        (void **)&refcount_block) < 0)
+        return 1;
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    return be16_to_cpu(s->refcount_block_cache[block_index]);
+    return be16_to_cpu(refcount_block[block_index]);
 }
 
 static int grow_refcount_table(BlockDriverState *bs, int min_size)
@@ -155,7 +140,7 @@ static int grow_refcount_table(BlockDriverState *bs, int min_size)
 
     update_refcount(bs, table_offset, new_table_size2, 1);
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t));
-    return 0;
+    return qcow2_cache_flush(bs, s->refcount_block_cache);
  fail:
     qcow2_free_clusters(bs, table_offset, new_table_size2);
     qemu_free(new_table);
@@ -169,6 +154,7 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
     int64_t offset, refcount_block_offset;
     int ret, refcount_table_index;
     uint64_t data64;
+    uint16_t *refcount_block;
 
     /* Find L1 index and grow refcount table if needed */
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
@@ -184,10 +170,16 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
         /* create a new refcount block */
         /* Note: we cannot update the refcount now to avoid recursion */
         offset = alloc_clusters_noref(bs, s->cluster_size);
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        ret = bdrv_pwrite(s->hd, offset, s->refcount_block_cache, s->cluster_size);
-        if (ret != s->cluster_size)
-            return -EINVAL;
+        ret = qcow2_cache_get_empty(bs, s->refcount_block_cache, offset,
+                                    (void **)&refcount_block);
+        if (ret < 0)
+            return ret;
+        memset(refcount_block, 0, s->cluster_size);
+        qcow2_cache_entry_mark_dirty(s->refcount_block_cache, refcount_block);
+        /* the block must be on disk before the table points to it */
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0)
+            return ret;
         s->refcount_table[refcount_table_index] = offset;
         data64 = cpu_to_be64(offset);
         ret = bdrv_pwrite(s->hd, s->refcount_table_offset +
@@ -197,49 +189,24 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
             return -EINVAL;
 
         refcount_block_offset = offset;
-        s->refcount_block_cache_offset = offset;
         update_refcount(bs, offset, s->cluster_size, 1);
-    } else {
-        if (refcount_block_offset != s->refcount_block_cache_offset) {
-            if (load_refcount_block(bs, refcount_block_offset) < 0)
-                return -EIO;
-        }
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0)
+            return ret;
     }
 
     return refcount_block_offset;
 }
 
-#define REFCOUNTS_PER_SECTOR (512 >> REFCOUNT_SHIFT)
-static int write_refcount_block_entries(BDRVQcowState *s,
-    int64_t refcount_block_offset, int first_index, int last_index)
-{
-    size_t size;
-
-    first_index &= ~(REFCOUNTS_PER_SECTOR - 1);
-    last_index = (last_index + REFCOUNTS_PER_SECTOR)
-        & ~(REFCOUNTS_PER_SECTOR - 1);
-
-    size = (last_index - first_index) << REFCOUNT_SHIFT;
-    if (bdrv_pwrite(s->hd,
-        refcount_block_offset + (first_index << REFCOUNT_SHIFT),
-        &s->refcount_block_cache[first_index], size) != size)
-    {
-        return -EIO;
-    }
-
-    return 0;
-}
-
-/* XXX: cache several refcount block clusters ? */
 static int update_refcount(BlockDriverState *bs,
                             int64_t offset, int64_t length,
                             int addend)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t start, last, cluster_offset;
-    int64_t refcount_block_offset = 0;
-    int64_t table_index = -1, old_table_index;
-    int first_index = -1, last_index = -1;
+    int64_t refcount_block_offset;
+    uint16_t *refcount_block;
+    int ret;
 
 #ifdef DEBUG_ALLOC2
     printf("update_refcount: offset=%lld size=%lld addend=%d\n",
@@ -255,54 +222,29 @@ static int update_refcount(BlockDriverState *bs,
         int block_index, refcount;
         int64_t cluster_index = cluster_offset >> s->cluster_bits;
 
-        /* Only write refcount block to disk when we are done with it */
-        old_table_index = table_index;
-        table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
-        if ((old_table_index >= 0) && (table_index != old_table_index)) {
-
-            if (write_refcount_block_entries(s, refcount_block_offset,
-                first_index, last_index) < 0)
-            {
-                return -EIO;
-            }
-
-            first_index = -1;
-            last_index = -1;
-        }
-
         /* Load the refcount block and allocate it if needed */
         refcount_block_offset = alloc_refcount_block(bs, cluster_index);
         if (refcount_block_offset < 0) {
             return refcount_block_offset;
         }
+        ret = qcow2_cache_get(bs, s->refcount_block_cache,
+                              refcount_block_offset, (void **)&refcount_block);
+        if (ret < 0) {
+            return ret;
+        }
 
-        /* we can update the count and save it */
+        /* we can update the count, it is written back with the block */
         block_index = cluster_index &
             ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-        if (first_index == -1 || block_index < first_index) {
-            first_index = block_index;
-        }
-        if (block_index > last_index) {
-            last_index = block_index;
-        }
-
-        refcount = be16_to_cpu(s->refcount_block_cache[block_index]);
+        refcount = be16_to_cpu(refcount_block[block_index]);
         refcount += addend;
         if (refcount < 0 || refcount > 0xffff)
             return -EINVAL;
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
-        s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
-    }
-
-    /* Write last changed block to disk */
-    if (refcount_block_offset != 0) {
-        if (write_refcount_block_entries(s, refcount_block_offset,
-            first_index, last_index) < 0)
-        {
-            return -EIO;
-        }
+        refcount_block[block_index] = cpu_to_be16(refcount);
+        qcow2_cache_entry_mark_dirty(s->refcount_block_cache, refcount_block);
     }
 
     return 0;
@@ -470,7 +412,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t old_offset, old_l2_offset;
     int l2_size, i, j, l1_modified, l2_modified, nb_csectors, refcount;
 
-    qcow2_l2_cache_reset(bs);
+    /* the L2 tables are accessed directly below */
+    if (qcow2_l2_cache_reset(bs) < 0)
+        return -EIO;
 
     l2_table = NULL;
     l1_table = NULL;
@@ -563,7 +507,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     if (l1_allocated)
         qemu_free(l1_table);
     qemu_free(l2_table);
-    return 0;
+    return qcow2_cache_flush(bs, s->refcount_block_cache);
  fail:
     if (l1_allocated)
         qemu_free(l1_table);
@@ -46,6 +46,46 @@ typedef struct __attribute__((packed)) QCowSnapshotHeader {
     /* name follows  */
 } QCowSnapshotHeader;
 
+/* The extra data starts with the fields defined by the qcow2 format:
+   a be64 VM state size and a be64 disk size. For a delta snapshot, they
+   are followed by a record of the id of its parent, made of a be32 magic,
+   a be32 size, and the parent id_str. Other readers ignore what follows
+   the fields they know. */
+typedef struct __attribute__((packed)) QCowSnapshotExtraData {
+    uint64_t vm_state_size_large;
+    uint64_t disk_size;
+} QCowSnapshotExtraData;
+
+#define QCOW_SNAPSHOT_EXTRA_PARENT 0x50524e54 /* "PRNT" */
+
+static char *qcow_read_snapshot_parent(BlockDriverState *bs, int64_t offset,
+                                       uint32_t extra_data_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint32_t h[2], size;
+    char *parent_id;
+
+    if (extra_data_size < sizeof(QCowSnapshotExtraData) + sizeof(h))
+        return NULL;
+    offset += sizeof(QCowSnapshotExtraData);
+    extra_data_size -= sizeof(QCowSnapshotExtraData);
+
+    if (bdrv_pread(s->hd, offset, h, sizeof(h)) != sizeof(h))
+        return NULL;
+    size = be32_to_cpu(h[1]);
+    if (be32_to_cpu(h[0]) != QCOW_SNAPSHOT_EXTRA_PARENT ||
+        size > extra_data_size - sizeof(h) || size >= 128)
+        return NULL;
+
+    parent_id = qemu_malloc(size + 1);
+    if (bdrv_pread(s->hd, offset + sizeof(h), parent_id, size) != size) {
+        qemu_free(parent_id);
+        return NULL;
+    }
+    parent_id[size] = '\0';
+    return parent_id;
+}
+
 void qcow2_free_snapshots(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -54,6 +94,7 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     for(i = 0; i < s->nb_snapshots; i++) {
         qemu_free(s->snapshots[i].name);
         qemu_free(s->snapshots[i].id_str);
+        qemu_free(s->snapshots[i].parent_id);
     }
     qemu_free(s->snapshots);
     s->snapshots = NULL;
@@ -94,6 +135,7 @@ int qcow2_read_snapshots(BlockDriverState *bs)
         id_str_size = be16_to_cpu(h.id_str_size);
         name_size = be16_to_cpu(h.name_size);
 
+        sn->parent_id = qcow_read_snapshot_parent(bs, offset, extra_data_size);
         offset += extra_data_size;
 
         sn->id_str = qemu_malloc(id_str_size + 1);
@@ -121,7 +163,8 @@ static int qcow_write_snapshots(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     QCowSnapshot *sn;
     QCowSnapshotHeader h;
-    int i, name_size, id_str_size, snapshots_size;
+    QCowSnapshotExtraData extra;
+    int i, name_size, id_str_size, snapshots_size, extra_size;
     uint64_t data64;
     uint32_t data32;
     int64_t offset, snapshots_offset;
@@ -131,7 +174,9 @@ static int qcow_write_snapshots(BlockDriverState *bs)
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
         offset = align_offset(offset, 8);
-        offset += sizeof(h);
+        offset += sizeof(h) + sizeof(QCowSnapshotExtraData);
+        if (sn->parent_id)
+            offset += 8 + strlen(sn->parent_id);
         offset += strlen(sn->id_str);
         offset += strlen(sn->name);
     }
@@ -154,10 +199,33 @@ static int qcow_write_snapshots(BlockDriverState *bs)
         name_size = strlen(sn->name);
         h.id_str_size = cpu_to_be16(id_str_size);
         h.name_size = cpu_to_be16(name_size);
+        extra_size = sizeof(extra);
+        if (sn->parent_id)
+            extra_size += 8 + strlen(sn->parent_id);
+        h.extra_data_size = cpu_to_be32(extra_size);
         offset = align_offset(offset, 8);
         if (bdrv_pwrite(s->hd, offset, &h, sizeof(h)) != sizeof(h))
             goto fail;
         offset += sizeof(h);
+        extra.vm_state_size_large = cpu_to_be64(sn->vm_state_size);
+        extra.disk_size = cpu_to_be64(bs->total_sectors * 512);
+        if (bdrv_pwrite(s->hd, offset, &extra, sizeof(extra)) != sizeof(extra))
+            goto fail;
+        offset += sizeof(extra);
+        if (sn->parent_id) {
+            uint32_t parent[2];
+            int parent_id_size = strlen(sn->parent_id);
+
+            parent[0] = cpu_to_be32(QCOW_SNAPSHOT_EXTRA_PARENT);
+            parent[1] = cpu_to_be32(parent_id_size);
+            if (bdrv_pwrite(s->hd, offset, parent, sizeof(parent)) != sizeof(parent))
+                goto fail;
+            offset += sizeof(parent);
+            if (bdrv_pwrite(s->hd, offset, sn->parent_id, parent_id_size) !=
+                parent_id_size)
+                goto fail;
+            offset += parent_id_size;
+        }
         if (bdrv_pwrite(s->hd, offset, sn->id_str, id_str_size) != id_str_size)
             goto fail;
         offset += id_str_size;
@@ -166,7 +234,10 @@ static int qcow_write_snapshots(BlockDriverState *bs)
         offset += name_size;
     }
 
-    /* update the various header fields */
+    /* update the various header fields, once the refcount of the new
+       table is on disk */
+    if (qcow2_cache_flush(bs, s->refcount_block_cache) < 0)
+        goto fail;
     data64 = cpu_to_be64(snapshots_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, snapshots_offset),
                     &data64, sizeof(data64)) != sizeof(data64))
@@ -257,6 +328,8 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     sn->date_sec = sn_info->date_sec;
     sn->date_nsec = sn_info->date_nsec;
     sn->vm_clock_nsec = sn_info->vm_clock_nsec;
+    if (sn_info->parent_id[0] != '\0')
+        sn->parent_id = qemu_strdup(sn_info->parent_id);
 
     ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1);
     if (ret < 0)
@@ -293,6 +366,7 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     return 0;
  fail:
     qemu_free(sn->name);
+    qemu_free(sn->parent_id);
     qemu_free(l1_table);
     return -1;
 }
@@ -361,6 +435,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
 
     qemu_free(sn->id_str);
     qemu_free(sn->name);
+    qemu_free(sn->parent_id);
     memmove(sn, sn + 1, (s->nb_snapshots - snapshot_index - 1) * sizeof(*sn));
     s->nb_snapshots--;
     ret = qcow_write_snapshots(bs);
@@ -398,6 +473,9 @@ int qcow2_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab)
         sn_info->date_sec = sn->date_sec;
         sn_info->date_nsec = sn->date_nsec;
         sn_info->vm_clock_nsec = sn->vm_clock_nsec;
+        if (sn->parent_id)
+            pstrcpy(sn_info->parent_id, sizeof(sn_info->parent_id),
+                    sn->parent_id);
     }
     *psn_tab = sn_tab;
     return s->nb_snapshots;
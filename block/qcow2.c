@@ -142,6 +142,35 @@ static int qcow_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 }
 
 
+/* Size the metadata caches from bdrv_metadata_cache_size, giving 1/5 of it
+   to refcount blocks, or use the defaults if it is 0. No more L2 tables
+   are cached than the image can have. */
+static void qcow_alloc_caches(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t l2_cache_size, refcount_cache_size;
+    int l2_tables, refcount_tables;
+
+    if (bdrv_metadata_cache_size > 0) {
+        l2_cache_size = bdrv_metadata_cache_size - bdrv_metadata_cache_size / 5;
+        refcount_cache_size = bdrv_metadata_cache_size / 5;
+    } else {
+        l2_cache_size = L2_CACHE_DEFAULT_SIZE;
+        refcount_cache_size = L2_CACHE_DEFAULT_SIZE / 4;
+    }
+
+    l2_tables = MIN(l2_cache_size >> s->cluster_bits, s->l1_size);
+    l2_tables = MAX(l2_tables, L2_CACHE_MIN_TABLES);
+    refcount_tables = refcount_cache_size >> s->cluster_bits;
+    refcount_tables = MAX(refcount_tables, REFCOUNT_CACHE_MIN_TABLES);
+
+    s->l2_table_cache = qcow2_cache_create(bs, l2_tables);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_tables);
+
+    /* refcounts are written before the L2 entries using the clusters */
+    qcow2_cache_set_dependency(s->l2_table_cache, s->refcount_block_cache);
+}
+
 static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -219,8 +248,8 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     for(i = 0;i < s->l1_size; i++) {
         be64_to_cpus(&s->l1_table[i]);
     }
-    /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
+    /* alloc L2 and refcount caches */
+    qcow_alloc_caches(bs);
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
     s->cluster_data = qemu_malloc(QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
@@ -259,7 +288,8 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    qcow2_cache_destroy(s->l2_table_cache);
+    qcow2_cache_destroy(s->refcount_block_cache);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     bdrv_delete(s->hd);
@@ -620,8 +650,11 @@ static BlockDriverAIOCB *qcow_aio_writev(BlockDriverState *bs,
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow2_cache_flush(bs, s->l2_table_cache);
+    qcow2_cache_flush(bs, s->refcount_block_cache);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    qcow2_cache_destroy(s->l2_table_cache);
+    qcow2_cache_destroy(s->refcount_block_cache);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     qcow2_refcount_close(bs);
@@ -898,6 +931,8 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 static void qcow_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow2_cache_flush(bs, s->l2_table_cache);
+    qcow2_cache_flush(bs, s->refcount_block_cache);
     bdrv_flush(s->hd);
 }
 
@@ -907,12 +942,20 @@ static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = (int64_t)s->l1_vm_state_index <<
         (s->cluster_bits + s->l2_bits);
+    qcow2_cache_get_stats(s->l2_table_cache,
+                          &bdi->l2_cache_hits, &bdi->l2_cache_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          &bdi->refcount_cache_hits, &bdi->refcount_cache_misses);
     return 0;
 }
 
 
 static int qcow_check(BlockDriverState *bs)
 {
+    BDRVQcowState *s = bs->opaque;
+
+    /* the check reads L2 tables from the image */
+    qcow2_cache_flush(bs, s->l2_table_cache);
     return qcow2_check_refcounts(bs);
 }
 
@@ -45,7 +45,13 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 16
 
-#define L2_CACHE_SIZE 16
+/* default size of the L2 table cache, and minimum number of tables in
+   each metadata cache */
+#define L2_CACHE_DEFAULT_SIZE (1024 * 1024)
+#define L2_CACHE_MIN_TABLES 16
+#define REFCOUNT_CACHE_MIN_TABLES 4
+
+typedef struct Qcow2Cache Qcow2Cache;
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -72,6 +78,7 @@ typedef struct QCowSnapshot {
     uint32_t date_sec;
     uint32_t date_nsec;
     uint64_t vm_clock_nsec;
+    char *parent_id;  /* NULL unless this is a delta snapshot */
 } QCowSnapshot;
 
 typedef struct BDRVQcowState {
@@ -88,9 +95,8 @@ typedef struct BDRVQcowState {
     uint64_t cluster_offset_mask;
     uint64_t l1_table_offset;
     uint64_t *l1_table;
-    uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    Qcow2Cache *l2_table_cache;
+    Qcow2Cache *refcount_block_cache;
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -98,8 +104,6 @@ typedef struct BDRVQcowState {
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
-    uint64_t refcount_block_cache_offset;
-    uint16_t *refcount_block_cache;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
@@ -171,7 +175,7 @@ int qcow2_check_refcounts(BlockDriverState *bs);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size);
-void qcow2_l2_cache_reset(BlockDriverState *bs);
+int qcow2_l2_cache_reset(BlockDriverState *bs);
 int qcow2_decompress_cluster(BDRVQcowState *s, uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
@@ -191,6 +195,24 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, uint64_t cluster_offset,
     QCowL2Meta *m);
 
+/* qcow2-cache.c functions */
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+void qcow2_cache_destroy(Qcow2Cache *c);
+void qcow2_cache_set_dependency(Qcow2Cache *c, Qcow2Cache *dependency);
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
+void qcow2_cache_reset(Qcow2Cache *c);
+
+/* Return in '*table' the cached copy of the table at 'offset', reading it
+   from the image first if needed. qcow2_cache_get_empty() does not read
+   it, for newly allocated tables. The pointer is valid until the next
+   call that loads a table in the same cache. */
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+    void **table);
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+    void **table);
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
+
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
@@ -26,8 +26,10 @@
 #include "qemu-char.h"
 #include "block_int.h"
 #include "module.h"
-#ifdef CONFIG_AIO
-#include "posix-aio-compat.h"
+#ifdef __linux__
+/* asynchronous I/O on worker threads */
+#define CONFIG_THREAD_AIO
+#include "thread-pool.h"
 #endif
 
 #ifdef CONFIG_COCOA
@@ -114,8 +116,6 @@ typedef struct BDRVRawState {
     uint8_t* aligned_buf;
 } BDRVRawState;
 
-static int posix_aio_init(void);
-
 static int fd_open(BlockDriverState *bs);
 
 #if defined(__FreeBSD__)
@@ -128,8 +128,6 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
     BDRVRawState *s = bs->opaque;
     int fd, ret;
 
-    posix_aio_init();
-
     s->lseek_err_cnt = 0;
 
     s->open_flags = open_flags | O_BINARY;
@@ -473,170 +471,319 @@ static int raw_write(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-#ifdef CONFIG_AIO
-/***********************************************************/
-/* Unix AIO using POSIX AIO */
+#ifdef CONFIG_THREAD_AIO
+/*
+ * Asynchronous I/O is performed by a pool of worker threads issuing plain
+ * preadv/pwritev calls. Requests submitted during one main loop iteration
+ * are only queued, and handed to the workers from a bottom half: this lets
+ * requests to contiguous sectors of the same file be merged first, so that
+ * e.g. the readahead of a guest filesystem costs a single system call.
+ * Workers signal completions through the pool's notification descriptor.
+ */
+
+#define RAW_AIO_THREADS   8
+#define RAW_AIO_MAX_IOV   1024      /* IOV_MAX on Linux */
+
+enum {
+    RAW_AIO_READ,
+    RAW_AIO_WRITE,
+    RAW_AIO_IOCTL,
+};
+
+typedef struct RawAIOCB RawAIOCB;
 
-typedef struct RawAIOCB {
+struct RawAIOCB {
     BlockDriverAIOCB common;
-    struct qemu_paiocb aiocb;
-    struct RawAIOCB *next;
-    int ret;
-} RawAIOCB;
+    int fd;
+    int type;
+    int need_align;             /* file opened with O_DIRECT */
+    int cancelled;
+    int64_t offset;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    unsigned long int ioctl_cmd;
+    void *ioctl_buf;
+    RawAIOCB *queue_next;       /* next request waiting for submission */
+    RawAIOCB *merged_next;      /* next request merged into the same one */
+    RawAIOCB *merged_head;      /* first request of the set, which owns the job */
+
+    /* the following are only used by the first request of a merged set */
+    RawAIOCB *merged_tail;
+    struct iovec *iov;
+    int niov;
+    size_t total;               /* bytes transferred by the whole set */
+    uint8_t *bounce;            /* aligned copy of the data, for O_DIRECT */
+    ssize_t ret;
+    ThreadPoolJob job;
+};
+
+typedef struct RawAioState {
+    ThreadPool *pool;
+    QEMUBH *bh;
+    RawAIOCB *queue;
+    RawAIOCB **queue_tail;
+    int inflight;               /* queued or submitted requests */
+} RawAioState;
 
-typedef struct PosixAioState
+static RawAioState *raw_aio_state;
+
+static ssize_t raw_aio_rw(RawAIOCB *acb, struct iovec *iov, int niov,
+                          int64_t offset)
 {
-    int rfd, wfd;
-    RawAIOCB *first_aio;
-} PosixAioState;
+#ifdef CONFIG_PREADV
+    if (acb->type == RAW_AIO_WRITE)
+        return pwritev(acb->fd, iov, niov, offset);
+    return preadv(acb->fd, iov, niov, offset);
+#else
+    if (acb->type == RAW_AIO_WRITE)
+        return pwrite(acb->fd, iov->iov_base, iov->iov_len, offset);
+    return pread(acb->fd, iov->iov_base, iov->iov_len, offset);
+#endif
+}
 
-static void posix_aio_read(void *opaque)
+/* runs on a worker thread */
+static void raw_aio_run(void *opaque)
 {
-    PosixAioState *s = opaque;
-    RawAIOCB *acb, **pacb;
-    int ret;
+    RawAIOCB *acb = opaque;
+    struct iovec bounce_iov, *iov = acb->iov;
+    int niov = acb->niov;
+    int64_t offset = acb->offset;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
-    for (;;) {
-        char bytes[16];
+    if (acb->type == RAW_AIO_IOCTL) {
+        acb->ret = ioctl(acb->fd, acb->ioctl_cmd, acb->ioctl_buf);
+        if (acb->ret < 0)
+            acb->ret = -errno;
+        return;
+    }
 
-        len = read(s->rfd, bytes, sizeof(bytes));
-        if (len == -1 && errno == EINTR)
-            continue; /* try again */
-        if (len == sizeof(bytes))
-            continue; /* more to read */
-        break;
+    if (acb->bounce) {
+        bounce_iov.iov_base = acb->bounce;
+        bounce_iov.iov_len = acb->total;
+        iov = &bounce_iov;
+        niov = 1;
     }
 
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                goto the_end;
-            ret = qemu_paio_error(&acb->aiocb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(&acb->aiocb);
-                    if (ret == acb->aiocb.aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                break;
-            } else {
-                pacb = &acb->next;
+    while (niov > 0) {
+        len = raw_aio_rw(acb, iov, niov, offset);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            acb->ret = -errno;
+            return;
+        }
+        if (len == 0) {
+            if (acb->type == RAW_AIO_WRITE) {
+                acb->ret = -EIO;
+                return;
             }
+            /* end of file, the rest reads as zeroes */
+            for (; niov > 0; iov++, niov--)
+                memset(iov->iov_base, 0, iov->iov_len);
+            break;
+        }
+
+        /* skip what was transferred and retry with the rest */
+        offset += len;
+        while (niov > 0 && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (len > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + len;
+            iov->iov_len -= len;
         }
     }
- the_end: ;
+    acb->ret = 0;
 }
 
-static int posix_aio_flush(void *opaque)
+static int raw_aio_is_aligned(RawAIOCB *acb)
 {
-    PosixAioState *s = opaque;
-    return !!s->first_aio;
-}
+    int i;
 
-static PosixAioState *posix_aio_state;
+    for (i = 0; i < acb->niov; i++) {
+        if (((uintptr_t)acb->iov[i].iov_base | acb->iov[i].iov_len) & 511)
+            return 0;
+    }
+    return 1;
+}
 
-static void aio_signal_handler(int signum)
+static void raw_aio_start(RawAioState *s, RawAIOCB *acb)
 {
-    if (posix_aio_state) {
-        char byte = 0;
-
-        write(posix_aio_state->wfd, &byte, sizeof(byte));
+    RawAIOCB *a;
+    size_t left, len, pos;
+    int i, n;
+
+    if (acb->type != RAW_AIO_IOCTL) {
+        /* gather the buffers of all merged requests */
+        acb->iov = qemu_malloc(acb->niov * sizeof(struct iovec));
+        n = 0;
+        for (a = acb; a != NULL; a = a->merged_next) {
+            left = a->nbytes;
+            for (i = 0; i < a->qiov->niov && left > 0; i++) {
+                len = MIN(a->qiov->iov[i].iov_len, left);
+                if (len == 0)
+                    continue;
+                acb->iov[n].iov_base = a->qiov->iov[i].iov_base;
+                acb->iov[n].iov_len = len;
+                left -= len;
+                n++;
+            }
+        }
+        acb->niov = n;
+
+        if (acb->need_align && !raw_aio_is_aligned(acb)) {
+            acb->bounce = qemu_memalign(512, acb->total);
+            if (acb->type == RAW_AIO_WRITE) {
+                for (i = 0, pos = 0; i < acb->niov; i++) {
+                    memcpy(acb->bounce + pos, acb->iov[i].iov_base,
+                           acb->iov[i].iov_len);
+                    pos += acb->iov[i].iov_len;
+                }
+            }
+        }
     }
 
-    qemu_service_io();
+    thread_pool_submit(s->pool, &acb->job, raw_aio_run, acb);
 }
 
-static int posix_aio_init(void)
+static int raw_aio_can_merge(RawAIOCB *acb, RawAIOCB *next)
 {
-    struct sigaction act;
-    PosixAioState *s;
-    int fds[2];
-    struct qemu_paioinit ai;
-  
-    if (posix_aio_state)
-        return 0;
-
-    s = qemu_malloc(sizeof(PosixAioState));
-
-    sigfillset(&act.sa_mask);
-    act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
-    act.sa_handler = aio_signal_handler;
-    sigaction(SIGUSR2, &act, NULL);
+    return acb->type != RAW_AIO_IOCTL &&
+           next->type == acb->type &&
+           next->fd == acb->fd &&
+           next->offset == acb->offset + (int64_t)acb->total &&
+           acb->niov + next->niov <= RAW_AIO_MAX_IOV;
+}
 
-    s->first_aio = NULL;
-    if (pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
-        return -errno;
-    }
+static void raw_aio_submit_bh(void *opaque)
+{
+    RawAioState *s = opaque;
+    RawAIOCB *acb, *next, *a, *heads = NULL, **heads_tail = &heads;
 
-    s->rfd = fds[0];
-    s->wfd = fds[1];
+    acb = s->queue;
+    s->queue = NULL;
+    s->queue_tail = &s->queue;
 
-    fcntl(s->rfd, F_SETFL, O_NONBLOCK);
-    fcntl(s->wfd, F_SETFL, O_NONBLOCK);
+    for (; acb != NULL; acb = next) {
+        next = acb->queue_next;
 
-    qemu_aio_set_fd_handler(s->rfd, posix_aio_read, NULL, posix_aio_flush, s);
+        /* append to a request of this batch that ends where this one
+           starts, if any */
+        for (a = heads; a != NULL; a = a->queue_next) {
+            if (raw_aio_can_merge(a, acb))
+                break;
+        }
+        if (a != NULL) {
+            a->merged_tail->merged_next = acb;
+            a->merged_tail = acb;
+            acb->merged_head = a;
+            a->niov += acb->niov;
+            a->total += acb->total;
+        } else {
+            acb->queue_next = NULL;
+            *heads_tail = acb;
+            heads_tail = &acb->queue_next;
+        }
+    }
 
-    memset(&ai, 0, sizeof(ai));
-    ai.aio_threads = 64;
-    ai.aio_num = 64;
-    qemu_paio_init(&ai);
+    for (acb = heads; acb != NULL; acb = next) {
+        next = acb->queue_next;
+        raw_aio_start(s, acb);
+    }
+}
 
-    posix_aio_state = s;
+static void raw_aio_complete(void *opaque)
+{
+    RawAioState *s = opaque;
+    ThreadPoolJob *job, *next_job;
+    RawAIOCB *acb, *a, *next;
+    size_t pos;
+    int i;
+
+    for (job = thread_pool_get_completed(s->pool); job != NULL;
+         job = next_job) {
+        next_job = job->next;
+        acb = container_of(job, RawAIOCB, job);
+
+        if (acb->bounce) {
+            if (acb->type == RAW_AIO_READ && acb->ret == 0) {
+                for (i = 0, pos = 0; i < acb->niov; i++) {
+                    memcpy(acb->iov[i].iov_base, acb->bounce + pos,
+                           acb->iov[i].iov_len);
+                    pos += acb->iov[i].iov_len;
+                }
+            }
+            qemu_vfree(acb->bounce);
+        }
+        qemu_free(acb->iov);
+
+        /* every merged request gets the status of the whole set */
+        for (a = acb; a != NULL; a = next) {
+            next = a->merged_next;
+            s->inflight--;
+            if (!a->cancelled)
+                a->common.cb(a->common.opaque, acb->ret);
+            qemu_aio_release(a);
+        }
+    }
+}
 
-    return 0;
+static int raw_aio_flush(void *opaque)
+{
+    RawAioState *s = opaque;
+    return s->inflight > 0;
 }
 
-static void raw_aio_remove(RawAIOCB *acb)
+static int raw_aio_init(void)
 {
-    RawAIOCB **pacb;
+    RawAioState *s;
+    int fd;
 
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "raw_aio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &(*pacb)->next;
+    if (raw_aio_state)
+        return 0;
+
+    s = qemu_mallocz(sizeof(RawAioState));
+    s->pool = thread_pool_new(RAW_AIO_THREADS);
+    fd = thread_pool_get_notify_fd(s->pool);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create AIO notification descriptor\n");
+        thread_pool_free(s->pool);
+        qemu_free(s);
+        return -1;
     }
+    s->bh = qemu_bh_new(raw_aio_submit_bh, s);
+    s->queue_tail = &s->queue;
+    qemu_aio_set_fd_handler(fd, raw_aio_complete, NULL, raw_aio_flush, s);
+
+    raw_aio_state = s;
+    return 0;
 }
 
 static void raw_aio_cancel(BlockDriverAIOCB *blockacb)
 {
-    int ret;
+    RawAioState *s = raw_aio_state;
     RawAIOCB *acb = (RawAIOCB *)blockacb;
+    RawAIOCB **pacb;
 
-    ret = qemu_paio_cancel(acb->aiocb.aio_fildes, &acb->aiocb);
-    if (ret == QEMU_PAIO_NOTCANCELED) {
-        /* fail safe: if the aio could not be canceled, we wait for
-           it */
-        while (qemu_paio_error(&acb->aiocb) == EINPROGRESS);
+    /* not submitted yet, simply forget it */
+    for (pacb = &s->queue; *pacb != NULL; pacb = &(*pacb)->queue_next) {
+        if (*pacb == acb) {
+            *pacb = acb->queue_next;
+            if (s->queue_tail == &acb->queue_next)
+                s->queue_tail = pacb;
+            s->inflight--;
+            qemu_aio_release(acb);
+            return;
+        }
     }
 
-    raw_aio_remove(acb);
+    /* otherwise wait for the set it belongs to, whose job is the one of
+       its first request. Only this request is then completed without
+       calling back */
+    acb->cancelled = 1;
+    thread_pool_wait_job(s->pool, &acb->merged_head->job);
 }
 
 static AIOPool raw_aio_pool = {
@@ -644,77 +791,80 @@ static AIOPool raw_aio_pool = {
     .cancel             = raw_aio_cancel,
 };
 
-static RawAIOCB *raw_aio_setup(BlockDriverState *bs, int64_t sector_num,
-        QEMUIOVector *qiov, int nb_sectors,
+static RawAIOCB *raw_aio_get(BlockDriverState *bs, int type,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVRawState *s = bs->opaque;
     RawAIOCB *acb;
 
-    if (fd_open(bs) < 0)
+    if (fd_open(bs) < 0 || raw_aio_init() < 0)
         return NULL;
 
     acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
-    acb->aiocb.aio_fildes = s->fd;
-    acb->aiocb.ev_signo = SIGUSR2;
-    acb->aiocb.aio_iov = qiov->iov;
-    acb->aiocb.aio_niov = qiov->niov;
-    acb->aiocb.aio_nbytes = nb_sectors * 512;
-    acb->aiocb.aio_offset = sector_num * 512;
-    acb->aiocb.aio_flags = 0;
+    acb->fd = s->fd;
+    acb->type = type;
+    acb->need_align = (s->aligned_buf != NULL);
+    acb->cancelled = 0;
+    acb->offset = 0;
+    acb->nbytes = 0;
+    acb->qiov = NULL;
+    acb->queue_next = NULL;
+    acb->merged_next = NULL;
+    acb->merged_head = acb;
+    acb->merged_tail = acb;
+    acb->iov = NULL;
+    acb->niov = 0;
+    acb->total = 0;
+    acb->bounce = NULL;
+    acb->ret = 0;
+    return acb;
+}
 
-    /*
-     * If O_DIRECT is used the buffer needs to be aligned on a sector
-     * boundary. Tell the low level code to ensure that in case it's
-     * not done yet.
-     */
-    if (s->aligned_buf)
-        acb->aiocb.aio_flags |= QEMU_AIO_SECTOR_ALIGNED;
+static void raw_aio_queue(RawAIOCB *acb)
+{
+    RawAioState *s = raw_aio_state;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-    return acb;
+    *s->queue_tail = acb;
+    s->queue_tail = &acb->queue_next;
+    s->inflight++;
+    qemu_bh_schedule(s->bh);
 }
 
-static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
+static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs, int type,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     RawAIOCB *acb;
 
-    acb = raw_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque);
+    acb = raw_aio_get(bs, type, cb, opaque);
     if (!acb)
         return NULL;
-    if (qemu_paio_read(&acb->aiocb) < 0) {
-        raw_aio_remove(acb);
-        return NULL;
-    }
+    acb->offset = sector_num * 512;
+    acb->nbytes = acb->total = (size_t)nb_sectors * 512;
+    acb->qiov = qiov;
+    acb->niov = qiov->niov;
+    raw_aio_queue(acb);
     return &acb->common;
 }
 
-static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
+static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
-    RawAIOCB *acb;
-
-    acb = raw_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque);
-    if (!acb)
-        return NULL;
-    if (qemu_paio_write(&acb->aiocb) < 0) {
-        raw_aio_remove(acb);
-        return NULL;
-    }
-    return &acb->common;
+    return raw_aio_submit(bs, RAW_AIO_READ, sector_num, qiov, nb_sectors,
+                          cb, opaque);
 }
-#else /* CONFIG_AIO */
-static int posix_aio_init(void)
+
+static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
 {
-    return 0;
+    return raw_aio_submit(bs, RAW_AIO_WRITE, sector_num, qiov, nb_sectors,
+                          cb, opaque);
 }
-#endif /* CONFIG_AIO */
+#endif /* CONFIG_THREAD_AIO */
 
 
 static void raw_close(BlockDriverState *bs)
@@ -883,7 +1033,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_create = raw_create,
     .bdrv_flush = raw_flush,
 
-#ifdef CONFIG_AIO
+#ifdef CONFIG_THREAD_AIO
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
 #endif
@@ -1003,7 +1153,7 @@ static int hdev_open(BlockDriverState *bs, const char *filename, int flags)
 #endif
 
     s->type = FTYPE_FILE;
-#if defined(__linux__) && defined(CONFIG_AIO)
+#ifdef CONFIG_THREAD_AIO
     if (strstart(filename, "/dev/sg", NULL)) {
         bs->sg = 1;
     }
@@ -1069,35 +1219,19 @@ static int hdev_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
     return ioctl(s->fd, req, buf);
 }
 
-#ifdef CONFIG_AIO
+#ifdef CONFIG_THREAD_AIO
 static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
-    BDRVRawState *s = bs->opaque;
     RawAIOCB *acb;
 
-    if (fd_open(bs) < 0)
-        return NULL;
-
-    acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
+    acb = raw_aio_get(bs, RAW_AIO_IOCTL, cb, opaque);
     if (!acb)
         return NULL;
-    acb->aiocb.aio_fildes = s->fd;
-    acb->aiocb.ev_signo = SIGUSR2;
-    acb->aiocb.aio_offset = 0;
-    acb->aiocb.aio_flags = 0;
-
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
-    acb->aiocb.aio_ioctl_buf = buf;
-    acb->aiocb.aio_ioctl_cmd = req;
-    if (qemu_paio_ioctl(&acb->aiocb) < 0) {
-        raw_aio_remove(acb);
-        return NULL;
-    }
-
+    acb->ioctl_cmd = req;
+    acb->ioctl_buf = buf;
+    raw_aio_queue(acb);
     return &acb->common;
 }
 #endif
@@ -1160,7 +1294,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_create        = hdev_create,
     .bdrv_flush		= raw_flush,
 
-#ifdef CONFIG_AIO
+#ifdef CONFIG_THREAD_AIO
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
 #endif
@@ -1172,7 +1306,7 @@ static BlockDriver bdrv_host_device = {
     /* generic scsi device */
 #ifdef __linux__
     .bdrv_ioctl         = hdev_ioctl,
-#ifdef CONFIG_AIO
+#ifdef CONFIG_THREAD_AIO
     .bdrv_aio_ioctl     = hdev_aio_ioctl,
 #endif
 #endif
@@ -1184,8 +1318,6 @@ static int floppy_open(BlockDriverState *bs, const char *filename, int flags)
     BDRVRawState *s = bs->opaque;
     int ret;
 
-    posix_aio_init();
-
     s->type = FTYPE_FD;
 
     /* open will not fail even if no floppy is inserted, so add O_NONBLOCK */
@@ -1260,7 +1392,7 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_create        = hdev_create,
     .bdrv_flush         = raw_flush,
 
-#ifdef CONFIG_AIO
+#ifdef CONFIG_THREAD_AIO
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
 #endif
@@ -1342,7 +1474,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_create        = hdev_create,
     .bdrv_flush         = raw_flush,
 
-#ifdef CONFIG_AIO
+#ifdef CONFIG_THREAD_AIO
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
 #endif
@@ -1358,7 +1490,7 @@ static BlockDriver bdrv_host_cdrom = {
 
     /* generic scsi device */
     .bdrv_ioctl         = hdev_ioctl,
-#ifdef CONFIG_AIO
+#ifdef CONFIG_THREAD_AIO
     .bdrv_aio_ioctl     = hdev_aio_ioctl,
 #endif
 };
@@ -1465,7 +1597,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_create        = hdev_create,
     .bdrv_flush         = raw_flush,
 
-#ifdef CONFIG_AIO
+#ifdef CONFIG_THREAD_AIO
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
 #endif
@@ -0,0 +1,616 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the thread pool AIO engine of raw-posix.c: scattered reads and
+ * writes, merging of contiguous requests, reads past the end of the file
+ * and cancellation. then measure the throughput of 4 KB reads and writes
+ * at several queue depths, with write-back caching and with O_DSYNC,
+ * against the synchronous raw_read() and raw_write() that bdrv_aio_readv()
+ * and bdrv_aio_writev() fell back to before. the main loop is modeled by
+ * running the scheduled bottom halves, then waiting on the completion
+ * descriptor, and completion callbacks submit the next requests, like a
+ * guest driver refilling its queue. this replaces the qemu-io benchmark,
+ * which does not build in this tree. run with 'make check'.
+ */
+#include "raw-posix.c"
+#include <poll.h>
+#include <sys/time.h>
+
+#define FILE_SECTORS    (64 * 2048)     /* 64 MB */
+#define REQ_SECTORS     8               /* 4 KB requests */
+#define NB_REQS         4096
+#define MAX_DEPTH       32
+
+static uint32_t rand_state = 1;
+static int errors;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/** the rest of the emulator
+ **/
+
+void*  qemu_malloc( size_t  size )                 { return malloc(size); }
+void*  qemu_mallocz( size_t  size )                { return calloc(1, size); }
+void*  qemu_realloc( void*  ptr, size_t  size )    { return realloc(ptr, size); }
+void   qemu_free( void*  ptr )                     { free(ptr); }
+void   qemu_vfree( void*  ptr )                    { free(ptr); }
+
+void*
+qemu_memalign( size_t  alignment, size_t  size )
+{
+    void*  ptr;
+
+    if (posix_memalign(&ptr, alignment, size))
+        abort();
+    return ptr;
+}
+
+void* qemu_blockalign( BlockDriverState*  bs, size_t  size ) { return qemu_memalign(512, size); }
+
+QEMUClock*  rt_clock;
+int64_t qemu_get_clock( QEMUClock*  clock ) { return 0; }
+
+void bdrv_register( BlockDriver*  bdrv ) {}
+void register_module_init( void (*fn)(void), module_init_type  type ) {}
+
+void*
+qemu_aio_get( AIOPool*  pool, BlockDriverState*  bs,
+              BlockDriverCompletionFunc*  cb, void*  opaque )
+{
+    BlockDriverAIOCB*  acb;
+
+    if (pool->free_aiocb) {
+        acb = pool->free_aiocb;
+        pool->free_aiocb = acb->next;
+    } else {
+        acb = qemu_mallocz(pool->aiocb_size);
+        acb->pool = pool;
+    }
+    acb->bs = bs;
+    acb->cb = cb;
+    acb->opaque = opaque;
+    return acb;
+}
+
+void
+qemu_aio_release( void*  p )
+{
+    BlockDriverAIOCB*  acb = p;
+
+    acb->next = acb->pool->free_aiocb;
+    acb->pool->free_aiocb = acb;
+}
+
+/* the main loop: raw-posix.c has a single bottom half and a single
+   completion descriptor */
+struct QEMUBH {
+    QEMUBHFunc*  cb;
+    void*        opaque;
+    int          scheduled;
+};
+
+static QEMUBH      main_bh;
+static int         aio_fd = -1;
+static IOHandler*  aio_read;
+static void*       aio_opaque;
+
+QEMUBH*
+qemu_bh_new( QEMUBHFunc*  cb, void*  opaque )
+{
+    main_bh.cb     = cb;
+    main_bh.opaque = opaque;
+    return &main_bh;
+}
+
+void qemu_bh_schedule( QEMUBH*  bh ) { bh->scheduled = 1; }
+
+int
+qemu_aio_set_fd_handler( int  fd, IOHandler*  io_read, IOHandler*  io_write,
+                         AioFlushHandler*  io_flush, void*  opaque )
+{
+    aio_fd     = fd;
+    aio_read   = io_read;
+    aio_opaque = opaque;
+    return 0;
+}
+
+static void
+main_loop_wait( void )
+{
+    struct pollfd  pfd;
+
+    if (main_bh.scheduled) {
+        main_bh.scheduled = 0;
+        main_bh.cb(main_bh.opaque);
+    }
+
+    pfd.fd     = aio_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) == 1)
+        aio_read(aio_opaque);
+}
+
+/** requests
+ **/
+
+/* each sector of the file holds its own number in every word */
+static void
+fill_sector( uint8_t*  buf, int64_t  sector, uint32_t  salt )
+{
+    uint32_t*  words = (uint32_t*)buf;
+    int        nn;
+
+    for (nn = 0; nn < 128; nn++)
+        words[nn] = (uint32_t)sector ^ salt;
+}
+
+static int
+check_sector( const uint8_t*  buf, int64_t  sector, uint32_t  salt )
+{
+    const uint32_t*  words = (const uint32_t*)buf;
+    int              nn;
+
+    for (nn = 0; nn < 128; nn++) {
+        if (words[nn] != ((uint32_t)sector ^ salt))
+            return 0;
+    }
+    return 1;
+}
+
+typedef struct {
+    QEMUIOVector       qiov;
+    struct iovec       iov[2];
+    uint8_t*           buf;
+    int64_t            sector;
+    int                nb_sectors;
+    int                is_write;
+    int                done;
+    int                ret;
+    BlockDriverAIOCB*  acb;
+} Request;
+
+static BlockDriverState*  bs;
+static int                nb_calls;     /* preadv/pwritev, one per merged set */
+
+static void
+request_cb( void*  opaque, int  ret )
+{
+    Request*  r = opaque;
+
+    if (((RawAIOCB*)r->acb)->merged_head == (RawAIOCB*)r->acb)
+        nb_calls++;
+    r->done = 1;
+    r->ret  = ret;
+}
+
+/* split the buffer of the request in two uneven pieces */
+static void
+request_submit( Request*  r, BlockDriverCompletionFunc*  cb )
+{
+    size_t  len   = (size_t)r->nb_sectors * 512;
+    size_t  first = (r->nb_sectors > 1) ? 512 + 256 : len;
+
+    r->iov[0].iov_base = r->buf;
+    r->iov[0].iov_len  = first;
+    r->iov[1].iov_base = r->buf + first;
+    r->iov[1].iov_len  = len - first;
+    r->qiov.iov    = r->iov;
+    r->qiov.niov   = (first < len) ? 2 : 1;
+    r->qiov.nalloc = -1;
+    r->qiov.size   = len;
+    r->done = 0;
+    r->ret  = -1;
+
+    if (r->is_write)
+        r->acb = raw_aio_writev(bs, r->sector, &r->qiov, r->nb_sectors, cb, r);
+    else
+        r->acb = raw_aio_readv(bs, r->sector, &r->qiov, r->nb_sectors, cb, r);
+    if (r->acb == NULL) {
+        printf("raw_aio_test: can't submit a request at sector %lld\n",
+               (long long)r->sector);
+        exit(1);
+    }
+}
+
+static void
+wait_requests( Request*  reqs, int  count )
+{
+    int  nn;
+
+    for (;;) {
+        for (nn = 0; nn < count && reqs[nn].done; nn++)
+            ;
+        if (nn == count)
+            return;
+        main_loop_wait();
+    }
+}
+
+static int
+open_file( const char*  filename, int  flags )
+{
+    memset(bs->opaque, 0, sizeof(BDRVRawState));
+    snprintf(bs->filename, sizeof(bs->filename), "%s", filename);
+    return raw_open(bs, filename, BDRV_O_RDWR | flags);
+}
+
+/** checks
+ **/
+
+/* a run of contiguous requests, then random ones, some of them past the
+   end of the file, all submitted in the same main loop iteration */
+static void
+check_reads( void )
+{
+    Request  reqs[48];
+    int      calls, nn, ss;
+
+    nb_calls = 0;
+    for (nn = 0; nn < 48; nn++) {
+        Request*  r = &reqs[nn];
+
+        r->is_write   = 0;
+        r->nb_sectors = 1 + next_rand() % 16;
+        if (nn < 16)
+            r->sector = (nn == 0) ? 1000 : reqs[nn-1].sector + reqs[nn-1].nb_sectors;
+        else if (nn < 40)
+            r->sector = next_rand() % (FILE_SECTORS - 16);
+        else
+            r->sector = FILE_SECTORS - 8 + next_rand() % 16;
+        r->buf = qemu_memalign(512, r->nb_sectors * 512);
+        memset(r->buf, 0xaa, r->nb_sectors * 512);
+        request_submit(r, request_cb);
+    }
+    wait_requests(reqs, 48);
+    calls = nb_calls;
+
+    for (nn = 0; nn < 48; nn++) {
+        Request*  r = &reqs[nn];
+
+        if (r->ret != 0) {
+            printf("raw_aio_test: read at sector %lld failed: %d\n",
+                   (long long)r->sector, r->ret);
+            errors++;
+        }
+        for (ss = 0; ss < r->nb_sectors; ss++) {
+            int64_t  sector = r->sector + ss;
+            int      ok;
+
+            if (sector < FILE_SECTORS) {
+                ok = check_sector(r->buf + ss*512, sector, 0);
+            } else {
+                static const uint8_t  zeroes[512];
+                ok = !memcmp(r->buf + ss*512, zeroes, 512);
+            }
+            if (!ok) {
+                printf("raw_aio_test: read of sector %lld returned bad data\n",
+                       (long long)sector);
+                errors++;
+                break;
+            }
+        }
+        qemu_free(r->buf);
+    }
+
+    /* the 16 contiguous requests must have been merged into one call */
+    if (calls > 48 - 15) {
+        printf("raw_aio_test: 48 reads took %d calls, contiguous ones were not merged\n",
+               calls);
+        errors++;
+    }
+}
+
+/* contiguous writes are merged, and land where they should */
+static void
+check_writes( void )
+{
+    BDRVRawState*  s = bs->opaque;
+    Request        reqs[16];
+    uint8_t        sector[512];
+    int64_t        start = 5000, end;
+    int            nn, ss;
+
+    nb_calls = 0;
+    for (nn = 0; nn < 16; nn++) {
+        Request*  r = &reqs[nn];
+
+        r->is_write   = 1;
+        r->nb_sectors = 1 + next_rand() % 16;
+        r->sector     = (nn == 0) ? start : reqs[nn-1].sector + reqs[nn-1].nb_sectors;
+        r->buf        = qemu_memalign(512, r->nb_sectors * 512);
+        for (ss = 0; ss < r->nb_sectors; ss++)
+            fill_sector(r->buf + ss*512, r->sector + ss, 0x5a5a5a5a);
+        request_submit(r, request_cb);
+    }
+    wait_requests(reqs, 16);
+    end = reqs[15].sector + reqs[15].nb_sectors;
+
+    if (nb_calls != 1) {
+        printf("raw_aio_test: 16 contiguous writes took %d calls\n", nb_calls);
+        errors++;
+    }
+    for (nn = 0; nn < 16; nn++) {
+        if (reqs[nn].ret != 0) {
+            printf("raw_aio_test: write at sector %lld failed: %d\n",
+                   (long long)reqs[nn].sector, reqs[nn].ret);
+            errors++;
+        }
+        qemu_free(reqs[nn].buf);
+    }
+
+    for (ss = start - 1; ss <= end; ss++) {
+        uint32_t  salt = (ss >= start && ss < end) ? 0x5a5a5a5a : 0;
+
+        if (pread(s->fd, sector, 512, ss * 512) != 512 ||
+            !check_sector(sector, ss, salt)) {
+            printf("raw_aio_test: sector %d was not written correctly\n", ss);
+            errors++;
+            break;
+        }
+    }
+
+    /* restore the file */
+    for (ss = start; ss < end; ss++) {
+        fill_sector(sector, ss, 0);
+        if (pwrite(s->fd, sector, 512, ss * 512) != 512)
+            errors++;
+    }
+}
+
+static void
+unexpected_cb( void*  opaque, int  ret )
+{
+    printf("raw_aio_test: a cancelled request was completed\n");
+    errors++;
+}
+
+/* requests cancelled before and after they were handed to the workers
+   are not completed, the others of their set are */
+static void
+check_cancel( void )
+{
+    Request  reqs[3];
+    int      nn;
+
+    for (nn = 0; nn < 3; nn++) {
+        reqs[nn].is_write   = 0;
+        reqs[nn].nb_sectors = 8;
+        reqs[nn].sector     = 2000 + nn * 8;
+        reqs[nn].buf        = qemu_memalign(512, 4096);
+    }
+
+    /* still queued */
+    request_submit(&reqs[0], unexpected_cb);
+    raw_aio_cancel(reqs[0].acb);
+
+    /* merged with a request that is not cancelled, and submitted */
+    request_submit(&reqs[1], unexpected_cb);
+    request_submit(&reqs[2], request_cb);
+    main_bh.cb(main_bh.opaque);
+    main_bh.scheduled = 0;
+    raw_aio_cancel(reqs[1].acb);
+
+    wait_requests(&reqs[2], 1);
+    if (reqs[2].ret != 0 || !check_sector(reqs[2].buf, reqs[2].sector, 0)) {
+        printf("raw_aio_test: the request merged with a cancelled one failed\n");
+        errors++;
+    }
+    if (raw_aio_state->inflight != 0) {
+        printf("raw_aio_test: %d requests still in flight after cancellation\n",
+               raw_aio_state->inflight);
+        errors++;
+    }
+    for (nn = 0; nn < 3; nn++)
+        qemu_free(reqs[nn].buf);
+}
+
+/** benchmarks
+ **/
+
+static int      bench_random;
+static int      bench_submitted;
+static int      bench_completed;
+static int64_t  bench_next_sector;
+
+static int64_t
+bench_sector( void )
+{
+    int64_t  sector;
+
+    if (bench_random)
+        return (next_rand() % (FILE_SECTORS / REQ_SECTORS)) * REQ_SECTORS;
+
+    sector = bench_next_sector;
+    bench_next_sector = (sector + REQ_SECTORS) % FILE_SECTORS;
+    return sector;
+}
+
+static void bench_cb( void*  opaque, int  ret );
+
+/* writes store what the file already holds, for the next checks */
+static void
+bench_submit( Request*  r )
+{
+    int  ss;
+
+    r->sector = bench_sector();
+    if (r->is_write) {
+        for (ss = 0; ss < REQ_SECTORS; ss++)
+            fill_sector(r->buf + ss*512, r->sector + ss, 0);
+    }
+    bench_submitted++;
+    request_submit(r, bench_cb);
+}
+
+static void
+bench_cb( void*  opaque, int  ret )
+{
+    request_cb(opaque, ret);
+    if (ret != 0)
+        errors++;
+    bench_completed++;
+    if (bench_submitted < NB_REQS)
+        bench_submit(opaque);
+}
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+bench_sync( Request*  r )
+{
+    int  nn, ss;
+
+    for (nn = 0; nn < NB_REQS; nn++) {
+        int64_t  sector = bench_sector();
+        int      ret;
+
+        if (r->is_write) {
+            for (ss = 0; ss < REQ_SECTORS; ss++)
+                fill_sector(r->buf + ss*512, sector + ss, 0);
+            ret = raw_write(bs, sector, r->buf, REQ_SECTORS);
+        } else {
+            ret = raw_read(bs, sector, r->buf, REQ_SECTORS);
+        }
+        if (ret != 0)
+            errors++;
+    }
+}
+
+static void
+bench( const char*  mode, const char*  name, int  is_write, int  random )
+{
+    static const int  depths[] = { 1, 4, 16, 32 };
+    Request           reqs[MAX_DEPTH];
+    double            start, secs;
+    int               dd, nn;
+
+    for (nn = 0; nn < MAX_DEPTH; nn++) {
+        reqs[nn].is_write   = is_write;
+        reqs[nn].nb_sectors = REQ_SECTORS;
+        reqs[nn].buf        = qemu_memalign(512, REQ_SECTORS * 512);
+        memset(reqs[nn].buf, 0, REQ_SECTORS * 512);
+    }
+
+    bench_random      = random;
+    bench_next_sector = 0;
+    start = now_secs();
+    bench_sync(&reqs[0]);
+    secs = now_secs() - start;
+    printf("raw_aio_test: %-8s %-12s synchronous: %8.1f MB/s\n",
+           mode, name, NB_REQS * REQ_SECTORS * 512 / secs / 1e6);
+
+    for (dd = 0; dd < (int)(sizeof(depths)/sizeof(depths[0])); dd++) {
+        int  depth = depths[dd];
+
+        bench_random      = random;
+        bench_next_sector = 0;
+        bench_submitted   = 0;
+        bench_completed   = 0;
+        nb_calls          = 0;
+
+        start = now_secs();
+        for (nn = 0; nn < depth; nn++)
+            bench_submit(&reqs[nn]);
+        while (bench_completed < NB_REQS)
+            main_loop_wait();
+        secs = now_secs() - start;
+
+        printf("raw_aio_test: %-8s %-12s QD %2d:       %8.1f MB/s, %5.2f requests per system call\n",
+               mode, name, depth, NB_REQS * REQ_SECTORS * 512 / secs / 1e6,
+               (double)NB_REQS / nb_calls);
+    }
+
+    for (nn = 0; nn < MAX_DEPTH; nn++)
+        qemu_free(reqs[nn].buf);
+}
+
+static void
+bench_all( const char*  mode )
+{
+    bench(mode, "seq read",    0, 0);
+    bench(mode, "random read", 0, 1);
+    bench(mode, "seq write",   1, 0);
+    bench(mode, "random write", 1, 1);
+}
+
+int main(void)
+{
+    char      filename[] = "/tmp/raw_aio_testXXXXXX";
+    uint8_t*  chunk;
+    int       fd, nn, ss;
+
+    fd = mkstemp(filename);
+    if (fd < 0) {
+        printf("raw_aio_test: can't create a temporary file\n");
+        return 1;
+    }
+    chunk = qemu_malloc(2048 * 512);
+    for (nn = 0; nn < FILE_SECTORS / 2048; nn++) {
+        for (ss = 0; ss < 2048; ss++)
+            fill_sector(chunk + ss*512, nn*2048 + ss, 0);
+        if (write(fd, chunk, 2048 * 512) != 2048 * 512) {
+            printf("raw_aio_test: can't write %s\n", filename);
+            unlink(filename);
+            return 1;
+        }
+    }
+    qemu_free(chunk);
+    close(fd);
+
+    bs = qemu_mallocz(sizeof(*bs));
+    bs->opaque = qemu_mallocz(sizeof(BDRVRawState));
+
+    if (open_file(filename, BDRV_O_CACHE_WB) < 0) {
+        printf("raw_aio_test: can't open %s\n", filename);
+        unlink(filename);
+        return 1;
+    }
+    check_reads();
+    check_writes();
+    check_cancel();
+    bench_all("cached");
+    raw_close(bs);
+
+    /* BDRV_O_NOCACHE asks for O_DIRECT, but <fcntl.h> only defines it with
+       _GNU_SOURCE, which the emulator is not built with. raw-posix.c then
+       falls back to O_DSYNC, as for write-through caching, so that is what
+       is measured: reads still come from the page cache, writes wait for
+       the disk */
+    if (open_file(filename, BDRV_O_NOCACHE) < 0) {
+        printf("raw_aio_test: can't reopen %s\n", filename);
+        errors++;
+    } else {
+        check_reads();
+        check_writes();
+        bench_all("O_DSYNC");
+        check_reads();
+        raw_close(bs);
+    }
+    unlink(filename);
+
+    if (errors) {
+        printf("raw_aio_test: FAILED, %d errors\n", errors);
+        return 1;
+    }
+    printf("raw_aio_test: OK\n");
+    return 0;
+}
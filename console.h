@@ -15,6 +15,8 @@
 #else
 #define GUI_REFRESH_INTERVAL 30
 #endif
+/* when the guest is idle and no listener needs to poll for input */
+#define GUI_IDLE_REFRESH_INTERVAL 250
 
 typedef void QEMUPutKBDEvent(void *opaque, int keycode);
 typedef void QEMUPutMouseEvent(void *opaque, int dx, int dy, int dz, int buttons_state);
@@ -737,6 +737,13 @@ extern unsigned long qemu_host_page_mask;
    code */
 #define PAGE_WRITE_ORG 0x0010
 #define PAGE_RESERVED  0x0020
+/* softmmu: the mapping is the same in all address spaces, so that its
+   TLB entry survives tlb_switch_asid() */
+#define PAGE_GLOBAL    0x0040
+/* softmmu: target defined tag of the mapping, from 0 to 15, which lets
+   tlb_flush_tag() flush a subset of the TLB */
+#define PAGE_TAG_SHIFT 8
+#define PAGE_TAG(tag)  ((tag) << PAGE_TAG_SHIFT)
 
 void page_dump(FILE *f);
 int walk_memory_regions(void *,
@@ -762,6 +769,7 @@ extern CPUState *first_cpu;
 extern CPUState *cpu_single_env;
 extern int64_t qemu_icount;
 extern int use_icount;
+extern int cpu_tlb_bits;
 
 #define CPU_INTERRUPT_HARD   0x02 /* hardware interrupt pending */
 #define CPU_INTERRUPT_EXITTB 0x04 /* exit the current TB (use for x86 a20 case) */
@@ -871,9 +879,71 @@ extern ram_addr_t last_ram_offset;
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
                         uint8_t *buf, int len, int is_write);
 
+/* Guest memory accesses of devices. A guest buffer is translated once
+   into spans of host RAM with cpu_dma_map_virt() or cpu_dma_map_phys(),
+   then transferred with cpu_dma_rw() as many times as needed, and
+   released with cpu_dma_unmap(). Writes to RAM mark it dirty and
+   invalidate the translated code it contains. */
+typedef struct CPUDMASpan {
+    uint8_t *host;              /* NULL if not RAM */
+    ram_addr_t ram_addr;
+    target_phys_addr_t phys;    /* only used when host is NULL */
+    uint32_t len;
+} CPUDMASpan;
+
+#define CPU_DMA_INLINE_SPANS  8
+
+typedef struct CPUDMA {
+    uint32_t len;               /* number of bytes mapped */
+    int nb_spans;
+    int max_spans;
+    CPUDMASpan *spans;
+    CPUDMASpan inline_spans[CPU_DMA_INLINE_SPANS];
+} CPUDMA;
+
+/* Map 'len' bytes at virtual address 'addr' of the current mode of 'env',
+   or at physical address 'addr'. Return the number of bytes mapped, which
+   is smaller than 'len' if a virtual page is not mapped. */
+uint32_t cpu_dma_map_virt(CPUDMA *dma, CPUState *env, target_ulong addr,
+                          uint32_t len);
+uint32_t cpu_dma_map_phys(CPUDMA *dma, target_phys_addr_t addr, uint32_t len);
+/* Copy 'len' bytes at 'offset' in the mapped range to 'buf', or from 'buf'
+   if 'is_write'. Returns -1 if the range is not entirely mapped. */
+int cpu_dma_rw(CPUDMA *dma, uint32_t offset, uint8_t *buf, uint32_t len,
+               int is_write);
+void cpu_dma_unmap(CPUDMA *dma);
+/* Same as cpu_memory_rw_debug(), for a single transfer */
+int cpu_dma_memory_rw(CPUState *env, target_ulong addr,
+                      uint8_t *buf, int len, int is_write);
+
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
+#define DEDUP_DIRTY_FLAG     0x10  /* see ram-dedup.c */
+/* cleared on pages discarded with cpu_physical_memory_discard(), which
+   are known to contain zeroes until this flag is set again */
+#define FREE_PAGE_DIRTY_FLAG 0x20
+/* cleared on pages holding guest page table descriptors cached by the
+   target MMU code, which must drop them once phys_ram_pgtable_gen[] of
+   their page changes */
+#define PGTABLE_DIRTY_FLAG   0x40
+
+/* In addition to the per-page flag bytes in phys_ram_dirty, the state
+   of each dirty flag that has a client is mirrored in a bitmap packed
+   into host words (one bit per target page), and the number of pages
+   with the flag set is maintained. This lets clients skip clean areas
+   one word at a time instead of probing every page. */
+#define DIRTY_MAP_VGA        0
+#define DIRTY_MAP_CODE       1
+#define DIRTY_MAP_MIGRATION  2
+#define DIRTY_MAP_COUNT      3
+
+#define DIRTY_MAP_WORD_BITS  (8 * sizeof(unsigned long))
+
+extern unsigned long *phys_ram_dirty_map[DIRTY_MAP_COUNT];
+extern ram_addr_t phys_ram_dirty_pages[DIRTY_MAP_COUNT];
+/* for each page, incremented each time its PGTABLE_DIRTY_FLAG is set */
+extern uint32_t *phys_ram_pgtable_gen;
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
@@ -887,13 +957,53 @@ static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
     return phys_ram_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
 }
 
+static inline void cpu_physical_memory_dirty_map_set(int map, ram_addr_t page)
+{
+    phys_ram_dirty_map[map][page / DIRTY_MAP_WORD_BITS] |=
+        1UL << (page % DIRTY_MAP_WORD_BITS);
+    phys_ram_dirty_pages[map]++;
+}
+
+/* set some dirty flags of a page. This must be used instead of writing
+   to phys_ram_dirty directly, to keep the dirty maps in sync. */
+static inline void cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
+                                                       int dirty_flags)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    int old_flags = phys_ram_dirty[page];
+    int new_flags = dirty_flags & ~old_flags;
+
+    if (!new_flags)
+        return;
+
+    phys_ram_dirty[page] = old_flags | new_flags;
+    if (new_flags & VGA_DIRTY_FLAG)
+        cpu_physical_memory_dirty_map_set(DIRTY_MAP_VGA, page);
+    if (new_flags & CODE_DIRTY_FLAG)
+        cpu_physical_memory_dirty_map_set(DIRTY_MAP_CODE, page);
+    if (new_flags & MIGRATION_DIRTY_FLAG)
+        cpu_physical_memory_dirty_map_set(DIRTY_MAP_MIGRATION, page);
+    if (new_flags & PGTABLE_DIRTY_FLAG)
+        phys_ram_pgtable_gen[page]++;
+}
+
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
-    phys_ram_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    cpu_physical_memory_set_dirty_flags(addr, 0xff);
 }
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+void cpu_physical_memory_reset_dirty_page(ram_addr_t addr, int dirty_flags);
+
+/* return the start address of the first page overlapping [start, end)
+   which has 'dirty_flag' set, or 'end' if there is none. 'dirty_flag' must be one
+   of VGA_DIRTY_FLAG, CODE_DIRTY_FLAG or MIGRATION_DIRTY_FLAG. */
+ram_addr_t cpu_physical_memory_find_dirty(ram_addr_t start, ram_addr_t end,
+                                          int dirty_flag);
+
+/* return the number of pages that have 'dirty_flag' set */
+ram_addr_t cpu_physical_memory_count_dirty(int dirty_flag);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
@@ -40,12 +40,46 @@ void qemu_ram_free(ram_addr_t addr);
 void *qemu_get_ram_ptr(ram_addr_t addr);
 /* This should not be used by devices.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
+/* Map a file over all guest RAM, pages are read from it on first access
+   and modified copy-on-write. Return 0, -ENOTSUP if RAM cannot be mapped
+   on this host, or another negative errno value on failure. */
+int qemu_ram_map_file(int fd);
+/* Give the host memory backing the guest RAM in [addr, addr + len) back
+   to the system, the guest no longer cares about its content. Return the
+   number of bytes reclaimed. */
+ram_addr_t cpu_physical_memory_discard(target_phys_addr_t addr,
+                                       target_phys_addr_t len);
 
 int cpu_register_io_memory(CPUReadMemoryFunc **mem_read,
                            CPUWriteMemoryFunc **mem_write,
                            void *opaque);
 void cpu_unregister_io_memory(int table_address);
 
+/* Statistics of the guest accesses to a region registered with
+   cpu_register_io_memory(). */
+typedef struct IOMemStats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t shadow_reads;  /* served from the shadow registers */
+    uint64_t posted_writes; /* queued, see cpu_io_memory_set_posted() */
+} IOMemStats;
+
+/* Make guest reads of the 32-bit registers selected by 'mask' (bit n for
+   the register at offset 4 * n) return regs[n], without calling the read
+   handler. The device must keep 'regs' up to date, and its read handler
+   must still support these registers. */
+void cpu_io_memory_set_shadow(int table_address, const uint32_t *regs,
+                              uint32_t mask);
+/* Make guest writes to the 32-bit registers selected by 'mask' be queued,
+   and passed to the write handler in order before any other access to
+   the same region, or at the latest at the next main loop iteration.
+   Only suitable for registers whose writes have no effect the guest
+   can see immediately, e.g. a console output register. */
+void cpu_io_memory_set_posted(int table_address, uint32_t mask);
+/* Pass all queued writes to their handlers. */
+void cpu_io_memory_flush_posted(void);
+void cpu_io_memory_get_stats(int table_address, IOMemStats *stats);
+
 void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write);
 static inline void cpu_physical_memory_read(target_phys_addr_t addr,
@@ -74,8 +74,15 @@ typedef uint64_t target_ulong;
 #define TB_JMP_ADDR_MASK (TB_JMP_PAGE_SIZE - 1)
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
-#define CPU_TLB_BITS 8
-#define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* The number of TLB entries per MMU mode is chosen at startup (see
+   -tlb-size), between 1 << CPU_TLB_MIN_BITS and 1 << CPU_TLB_MAX_BITS.
+   The tables have env->tlb_size entries. */
+#define CPU_TLB_MIN_BITS 8
+#define CPU_TLB_MAX_BITS 12
+#define CPU_TLB_DEFAULT_BITS 10
+
+/* number of entries of the fully associative victim TLB, per MMU mode */
+#define CPU_VTLB_SIZE 8
 
 #if TARGET_PHYS_ADDR_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -150,11 +157,19 @@ typedef struct CPUWatchpoint {
     uint32_t halted; /* Nonzero if the CPU is in suspend state */       \
     uint32_t stop;   /* Stop request */                                 \
     uint32_t stopped; /* Artificially stopped */                        \
+    uint32_t idle_loop; /* Halted in a guest idle loop, not by WFI */   \
     uint32_t interrupt_request;                                         \
     volatile sig_atomic_t exit_request;                                 \
-    /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    /* victim TLB of evicted entries, see tlb_victim_lookup() */       \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    uint8_t tlb_v_attr[NB_MMU_MODES][CPU_VTLB_SIZE];                    \
+    unsigned int vtlb_index;                                            \
+    /* address space of the entries, see tlb_switch_asid() */           \
+    uint64_t tlb_asid;                                                  \
+    /* range covering all the large pages in the TLB */                 \
+    target_ulong tlb_flush_addr;                                        \
+    target_ulong tlb_flush_mask;                                        \
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];           \
     /* buffer for temporaries in the code generator */                  \
     long temp_buf[CPU_TEMP_BUF_NLONGS];                                 \
@@ -179,6 +194,24 @@ typedef struct CPUWatchpoint {
                                                                         \
     struct GDBRegisterState *gdb_regs;                                  \
                                                                         \
+    /* number of entries of tlb_table in use, and the index mask used   \
+       by the generated code: (tlb_size - 1) << CPU_TLB_ENTRY_BITS */   \
+    uint32_t tlb_size;                                                  \
+    uint32_t tlb_mask;                                                  \
+                                                                        \
+    /* The meaning of the MMU modes is defined in the target code.     \
+       The tables are those of the current TLB set, see                 \
+       tlb_switch_asid(). tlb_attr holds the PAGE_GLOBAL flag and the   \
+       PAGE_TAG() of each entry. */                                     \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    target_phys_addr_t *iotlb[NB_MMU_MODES];                            \
+    uint8_t *tlb_attr[NB_MMU_MODES];                                    \
+                                                                        \
+    /* TLB entries of recently used address spaces */                   \
+    struct CPUTLBSet *tlb_sets;                                         \
+    struct CPUTLBSet *tlb_set; /* current one */                        \
+    unsigned int tlb_sets_use;                                          \
+                                                                        \
     /* Core interrupt code */                                           \
     jmp_buf jmp_env;                                                    \
     int exception_index;                                                \
@@ -594,6 +594,20 @@ int cpu_exec(CPUState *env1)
                 qemu_log_mask(CPU_LOG_EXEC, "Trace 0x%08lx [" TARGET_FMT_lx "] %s\n",
                              (long)tb->tc_ptr, tb->pc,
                              lookup_symbol(tb->pc));
+#endif
+#if !defined(CONFIG_USER_ONLY)
+                /* a TB jumping back to itself may be the guest idle
+                   loop: halt the CPU until the next event rather than
+                   chaining it. The main loop resumes it afterwards. */
+                if (unlikely((next_tb & ~3) == (long)tb) &&
+                    !env->singlestep_enabled &&
+                    cpu_is_idle_loop(env, tb)) {
+                    spin_unlock(&tb_lock);
+                    env->idle_loop = 1;
+                    env->halted = 1;
+                    env->exception_index = EXCP_HLT;
+                    cpu_loop_exit();
+                }
 #endif
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
@@ -0,0 +1,98 @@
+/*
+ *  word-packed dirty page bitmaps
+ *
+ *  Copyright (c) 2003 Fabrice Bellard
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DIRTY_MAP_H
+#define DIRTY_MAP_H
+
+/* Operations on the dirty maps of cpu-all.h, which hold one bit per
+   target page, DIRTY_MAP_WORD_BITS pages per host word.
+
+   This is only included by exec.c and its unit test, which define
+   ram_addr_t and DIRTY_MAP_WORD_BITS and include host-utils.h first. */
+
+/* set pages [first, first + count) in a dirty map, return the number of
+   pages that were clean before. */
+static inline ram_addr_t dirty_map_set(unsigned long *map, ram_addr_t first,
+                                       ram_addr_t count)
+{
+    ram_addr_t changed = 0;
+
+    while (count > 0) {
+        ram_addr_t bit = first % DIRTY_MAP_WORD_BITS;
+        ram_addr_t n = DIRTY_MAP_WORD_BITS - bit;
+        unsigned long mask, *word = &map[first / DIRTY_MAP_WORD_BITS];
+
+        if (n > count)
+            n = count;
+        mask = (n == DIRTY_MAP_WORD_BITS) ? ~0UL : ((1UL << n) - 1) << bit;
+        changed += ctpop64(mask & ~*word);
+        *word |= mask;
+        first += n;
+        count -= n;
+    }
+    return changed;
+}
+
+/* clear pages [first, first + count) in a dirty map, return the number
+   of pages that were dirty before. */
+static inline ram_addr_t dirty_map_clear(unsigned long *map, ram_addr_t first,
+                                         ram_addr_t count)
+{
+    ram_addr_t changed = 0;
+
+    while (count > 0) {
+        ram_addr_t bit = first % DIRTY_MAP_WORD_BITS;
+        ram_addr_t n = DIRTY_MAP_WORD_BITS - bit;
+        unsigned long mask, *word = &map[first / DIRTY_MAP_WORD_BITS];
+
+        if (n > count)
+            n = count;
+        mask = (n == DIRTY_MAP_WORD_BITS) ? ~0UL : ((1UL << n) - 1) << bit;
+        if (*word & mask) {
+            changed += ctpop64(*word & mask);
+            *word &= ~mask;
+        }
+        first += n;
+        count -= n;
+    }
+    return changed;
+}
+
+/* return the first page of [page, last) which is set in a dirty map, or
+   'last' if there is none. clean words are skipped as a whole. */
+static inline ram_addr_t dirty_map_find(const unsigned long *map,
+                                        ram_addr_t page, ram_addr_t last)
+{
+    ram_addr_t index = page / DIRTY_MAP_WORD_BITS;
+    unsigned long word;
+
+    if (page >= last)
+        return last;
+
+    /* ignore pages below 'page' in the first word */
+    word = map[index] & (~0UL << (page % DIRTY_MAP_WORD_BITS));
+    while (word == 0) {
+        if (++index * DIRTY_MAP_WORD_BITS >= last)
+            return last;
+        word = map[index];
+    }
+    page = index * DIRTY_MAP_WORD_BITS + ctz64(word);
+    return (page < last) ? page : last;
+}
+
+#endif /* DIRTY_MAP_H */
@@ -0,0 +1,219 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the dirty maps of dirty-map.h against a byte per page model,
+ * then measure a pass over the dirty pages of guest RAM, like the one
+ * of ram_save_block(), with the maps and with the per-page flag bytes
+ * scanned before them. run with 'make check'.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "host-utils.h"
+
+typedef unsigned long ram_addr_t;
+
+#define DIRTY_MAP_WORD_BITS  (8 * sizeof(unsigned long))
+
+#include "dirty-map.h"
+
+/* not a multiple of the word size, to check the last word */
+#define NB_PAGES    1000
+#define NB_OPS      200000
+
+/* 512 MB of guest RAM, in ARM target pages of 1 KB */
+#define RAM_PAGES   (512 * 1024)
+
+static uint32_t rand_state = 1;
+static int errors;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static void check_model(void)
+{
+    static unsigned long map[(NB_PAGES + 63) / 8 / sizeof(unsigned long) + 1];
+    static uint8_t model[NB_PAGES];
+    ram_addr_t count = 0;
+    int op;
+
+    for (op = 0; op < NB_OPS && errors < 10; op++) {
+        ram_addr_t first = next_rand() % NB_PAGES;
+        ram_addr_t n = next_rand() % 8 ? next_rand() % 8 : next_rand() % 200;
+        ram_addr_t i, changed, expected = 0;
+        uint32_t r = next_rand() % 3;
+
+        if (first + n > NB_PAGES)
+            n = NB_PAGES - first;
+
+        if (r == 0) {
+            for (i = first; i < first + n; i++) {
+                expected += !model[i];
+                model[i] = 1;
+            }
+            changed = dirty_map_set(map, first, n);
+            count += changed;
+        } else if (r == 1) {
+            for (i = first; i < first + n; i++) {
+                expected += model[i];
+                model[i] = 0;
+            }
+            changed = dirty_map_clear(map, first, n);
+            count -= changed;
+        } else {
+            ram_addr_t last = first + n;
+            for (i = first; i < last && !model[i]; i++)
+                ;
+            expected = i;
+            changed = dirty_map_find(map, first, last);
+        }
+        if (changed != expected) {
+            fprintf(stderr, "op %d: %s(%lu, %lu) is %lu, expected %lu\n", op,
+                    r == 0 ? "set" : r == 1 ? "clear" : "find",
+                    (unsigned long)first, (unsigned long)n,
+                    (unsigned long)changed, (unsigned long)expected);
+            errors++;
+        }
+
+        /* walking the whole map must give the model's pages */
+        if (op % 64 == 0) {
+            ram_addr_t page = 0, found = 0;
+
+            while ((page = dirty_map_find(map, page, NB_PAGES)) < NB_PAGES) {
+                if (!model[page])
+                    break;
+                found++;
+                page++;
+            }
+            if (page < NB_PAGES || found != count) {
+                fprintf(stderr, "op %d: %lu dirty pages found, expected %lu\n",
+                        op, (unsigned long)found, (unsigned long)count);
+                errors++;
+            }
+        }
+    }
+}
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* make 'dirty' random pages of RAM dirty, in both representations */
+static ram_addr_t dirty_ram(uint8_t *flags, unsigned long *map, int dirty)
+{
+    ram_addr_t changed = 0;
+    int i;
+
+    for (i = 0; i < dirty; i++) {
+        ram_addr_t page = next_rand() % RAM_PAGES;
+        flags[page] = 1;
+        changed += dirty_map_set(map, page, 1);
+    }
+    return changed;
+}
+
+/* one iteration of the migration: send all dirty pages, cleaning each,
+   then ask how many remain. before the maps, ram_save_block() probed the
+   flag byte of each page from where it stopped and ram_save_remaining()
+   probed all of them. returns the time per iteration, in seconds. */
+static double bench_bytes(uint8_t *flags, unsigned long *map, int dirty)
+{
+    double t0 = now_secs(), t;
+    int iterations = 0;
+
+    do {
+        ram_addr_t page, sent = 0, remaining = 0;
+
+        dirty_ram(flags, map, dirty);
+        for (page = 0; page < RAM_PAGES; page++) {
+            if (flags[page]) {
+                flags[page] = 0;
+                sent++;
+            }
+        }
+        for (page = 0; page < RAM_PAGES; page++)
+            remaining += flags[page];
+        if (sent > (ram_addr_t)dirty || remaining != 0)
+            errors++;
+        iterations++;
+    } while ((t = now_secs() - t0) < 0.2);
+
+    dirty_map_clear(map, 0, RAM_PAGES);
+    return t / iterations;
+}
+
+static double bench_map(uint8_t *flags, unsigned long *map, int dirty)
+{
+    double t0 = now_secs(), t;
+    int iterations = 0;
+
+    do {
+        ram_addr_t page = 0, sent = 0, remaining;
+
+        remaining = dirty_ram(flags, map, dirty);
+        while ((page = dirty_map_find(map, page, RAM_PAGES)) < RAM_PAGES) {
+            remaining -= dirty_map_clear(map, page, 1);
+            page++;
+            sent++;
+        }
+        if (sent > (ram_addr_t)dirty || remaining != 0)
+            errors++;
+        iterations++;
+    } while ((t = now_secs() - t0) < 0.2);
+
+    memset(flags, 0, RAM_PAGES);
+    return t / iterations;
+}
+
+static void bench_pass(int dirty)
+{
+    static uint8_t flags[RAM_PAGES];
+    static unsigned long map[RAM_PAGES / DIRTY_MAP_WORD_BITS];
+    double bytes, bits;
+
+    bytes = bench_bytes(flags, map, dirty);
+    bits = bench_map(flags, map, dirty);
+    printf("dirty_map_test: %d of %d pages dirty: %.1f us/iteration with "
+           "the maps, %.1f us before (%.1fx)\n", dirty, RAM_PAGES,
+           bits * 1e6, bytes * 1e6, bytes / bits);
+}
+
+int main(void)
+{
+    check_model();
+    if (errors > 0) {
+        fprintf(stderr, "dirty_map_test: FAILED\n");
+        return 1;
+    }
+
+    bench_pass(RAM_PAGES / 10000);
+    bench_pass(RAM_PAGES / 1000);
+    bench_pass(RAM_PAGES / 100);
+    bench_pass(RAM_PAGES / 10);
+    bench_pass(RAM_PAGES);
+
+    if (errors > 0) {
+        fprintf(stderr, "dirty_map_test: FAILED\n");
+        return 1;
+    }
+    printf("dirty_map_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,457 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the DMA helpers of exec.c against cpu_memory_rw_debug(), on a
+ * guest buffer mapped by ARMv6 page tables to scattered physical pages,
+ * with some of its pages unmapped and some of them in the TLB, then
+ * measure NAND reads into such a buffer, done like nand_dev_read_file()
+ * does now, and like it did with a cpu_memory_rw_debug() call for each
+ * erase unit. run with 'make check'.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "cpu.h"
+#include "exec-all.h"
+#include "qemu-common.h"
+#include "tcg.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "gdbstub.h"
+#include "gles2emulator_utils.h"
+
+#define RAM_SIZE        (64 << 20)
+
+/* physical memory: first level table, then second level tables, then
+   4 KB pages */
+#define L1_TABLE        0x00100000
+#define L2_TABLES_BASE  0x00400000
+#define PAGES_BASE      0x01000000
+
+#define USER_BASE       0x40000000
+#define BUFFER_PAGES    1024            /* a buffer of 4 MB */
+
+/* the erase unit of the default goldfish NAND device, 64 pages of
+   2048 + 64 bytes, which nand_dev_read_file() reads at a time */
+#define ERASE_SIZE      (64 * (2048 + 64))
+
+#define NB_CHECKS       20000
+
+static uint32_t rand_state = 1;
+static int errors;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/** the rest of the emulator
+ **/
+
+void*  qemu_malloc( size_t  size )                 { return malloc(size); }
+void*  qemu_mallocz( size_t  size )                { return calloc(1, size); }
+void*  qemu_realloc( void*  ptr, size_t  size )    { return realloc(ptr, size); }
+void   qemu_free( void*  ptr )                     { free(ptr); }
+void*  qemu_vmalloc( size_t  size )                { return qemu_memalign(4096, size); }
+
+void*
+qemu_memalign( size_t  alignment, size_t  size )
+{
+    void*  ptr;
+
+    if (posix_memalign(&ptr, alignment, size))
+        abort();
+    return ptr;
+}
+
+ram_addr_t  ram_size = RAM_SIZE;
+int         mem_merge;
+int         memcheck_instrument_mmu;
+int         tb_invalidated_flag;
+int         semihosting_enabled;
+int         tracing;
+uint64_t    sim_time;
+
+int  memcheck_is_checked( target_ulong  addr, uint32_t  size ) { return 0; }
+void memcheck_on_call( target_ulong  pc, target_ulong  ret ) {}
+void memcheck_on_ret( target_ulong  pc ) {}
+void ram_dedup_reset( void ) {}
+
+/* guest RAM. the TLB addends are only 32 bits wide, as
+   TARGET_PHYS_ADDR_BITS is 32, so it must be below 4 GB */
+void gles2emulator_utils_create_sharedmemory_file( struct hostSharedMemoryStruct*  s ) {}
+
+void
+gles2emulator_utils_map_sharedmemory_file( struct hostSharedMemoryStruct*  s )
+{
+    int  flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_32BIT
+    flags |= MAP_32BIT;
+#endif
+    s->actualAddress = mmap(NULL, s->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (s->actualAddress == MAP_FAILED) {
+        fprintf(stderr, "dma_test: can't map guest RAM\n");
+        exit(1);
+    }
+}
+
+unsigned long code_gen_max_block_size( void ) { return 1024; }
+void cpu_gen_init( void ) {}
+int  cpu_gen_code( CPUState*  env, struct TranslationBlock*  tb,
+                   int*  gen_code_size_ptr ) { abort(); }
+int  cpu_restore_state( struct TranslationBlock*  tb, CPUState*  env,
+                        unsigned long  searched_pc, void*  puc ) { return 0; }
+void cpu_resume_from_signal( CPUState*  env1, void*  puc ) { abort(); }
+void arm_translate_init( void ) {}
+void cpu_dump_state( CPUState*  env, FILE*  f,
+                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...),
+                     int  flags ) {}
+void tcg_dump_info( FILE*  f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...) ) {}
+
+void qemu_init_vcpu( void*  env ) {}
+void qemu_cpu_kick( void*  env ) {}
+int  qemu_cpu_self( void*  env ) { return 1; }
+
+void gdb_register_coprocessor( CPUState*  env,
+                               gdb_reg_cb  get_reg, gdb_reg_cb  set_reg,
+                               int  num_regs, const char*  xml, int  g_pos ) {}
+
+void armv7m_nvic_set_pending( void*  opaque, int  irq ) { abort(); }
+int  armv7m_nvic_acknowledge_irq( void*  opaque ) { abort(); }
+void armv7m_nvic_complete_irq( void*  opaque, int  irq ) { abort(); }
+uint32_t do_arm_semihosting( CPUState*  env ) { abort(); }
+
+void trace_exception( uint32_t  pc ) {}
+void trace_insn_helper( void ) {}
+void trace_bb_helper( uint64_t  bb_num, TranslationBlock*  tb ) {}
+
+int
+register_savevm( const char*  idstr, int  instance_id, int  version_id,
+                 SaveStateHandler*  save_state, LoadStateHandler*  load_state,
+                 void*  opaque )
+{
+    return 0;
+}
+
+void cpu_save( QEMUFile*  f, void*  opaque ) {}
+int  cpu_load( QEMUFile*  f, void*  opaque, int  version_id ) { return 0; }
+void qemu_put_be32( QEMUFile*  f, unsigned int  v ) {}
+unsigned int qemu_get_be32( QEMUFile*  f ) { return 0; }
+
+void
+tlb_fill( target_ulong  addr, int  is_write, int  mmu_idx, void*  retaddr )
+{
+    if (cpu_arm_handle_mmu_fault(cpu_single_env, addr, is_write, mmu_idx, 1)) {
+        fprintf(stderr, "dma_test: fault at 0x%08x\n", addr);
+        abort();
+    }
+}
+
+/** the guest buffer
+ **/
+
+static CPUState*  env;
+static uint32_t   buffer_pa[BUFFER_PAGES];     /* 0 if unmapped */
+
+static uint32_t
+buffer_va( int  page )
+{
+    return USER_BASE + (page << 12);
+}
+
+/* map the buffer to the pages at PAGES_BASE, in a random order, like the
+   pages of the buffers of a guest process */
+static void
+map_buffer( void )
+{
+    uint32_t  l1 = L1_TABLE + (USER_BASE >> 20) * 4;
+    int       nn;
+
+    memset(qemu_get_ram_ptr(L1_TABLE), 0, 0x4000);
+    memset(qemu_get_ram_ptr(L2_TABLES_BASE), 0, BUFFER_PAGES * 4);
+    for (nn = 0; nn < BUFFER_PAGES / 256; nn++)
+        stl_phys(l1 + nn * 4, (L2_TABLES_BASE + nn * 0x400) | 1);
+
+    for (nn = 0; nn < BUFFER_PAGES; nn++)
+        buffer_pa[nn] = PAGES_BASE + nn * 0x1000;
+    for (nn = BUFFER_PAGES - 1; nn > 0; nn--) {
+        int       mm = next_rand() % (nn + 1);
+        uint32_t  pa = buffer_pa[nn];
+
+        buffer_pa[nn] = buffer_pa[mm];
+        buffer_pa[mm] = pa;
+    }
+    /* read/write for all (AP=3), small pages */
+    for (nn = 0; nn < BUFFER_PAGES; nn++)
+        stl_phys(L2_TABLES_BASE + nn * 4, buffer_pa[nn] | (3 << 4) | 2);
+
+    env->cp15.c2_base0 = L1_TABLE;
+    tlb_flush(env, 1);
+}
+
+static void
+unmap_buffer_page( int  page )
+{
+    stl_phys(L2_TABLES_BASE + page * 4, 0);
+    buffer_pa[page] = 0;
+    tlb_flush(env, 1);
+}
+
+/* fill the TLB entries of the buffer at 'va', as guest accesses do */
+static void
+touch_buffer( uint32_t  va, uint32_t  len )
+{
+    uint32_t  end = va + len;
+
+    if (len == 0)
+        return;
+    for (va &= TARGET_PAGE_MASK; va < end; va += TARGET_PAGE_SIZE)
+        tlb_fill(va, 0, cpu_mmu_index(env), NULL);
+}
+
+/* the number of bytes of the buffer at 'va' that are mapped, up to
+   'len' */
+static uint32_t
+mapped_len( uint32_t  va, uint32_t  len )
+{
+    uint32_t  done = 0;
+
+    while (done < len) {
+        uint32_t  page = (va + done - USER_BASE) >> 12;
+
+        if (page >= BUFFER_PAGES || buffer_pa[page] == 0)
+            return done;
+        done += 0x1000 - ((va + done) & 0xfff);
+    }
+    return len;
+}
+
+/* clear the migration dirty flag of the pages of the buffer at 'va' */
+static void
+clean_buffer( uint32_t  va, uint32_t  len )
+{
+    uint32_t  end = va + len, pa;
+
+    if (len == 0)
+        return;
+    for (va &= ~0xfff; va < end; va += 0x1000) {
+        pa = buffer_pa[(va - USER_BASE) >> 12];
+        cpu_physical_memory_reset_dirty(pa, pa + 0x1000, MIGRATION_DIRTY_FLAG);
+    }
+}
+
+static void
+check_dirty( uint32_t  va, uint32_t  len )
+{
+    uint32_t  end = va + len, pa;
+
+    if (len == 0)
+        return;
+    for (va &= TARGET_PAGE_MASK; va < end; va += TARGET_PAGE_SIZE) {
+        pa = buffer_pa[(va - USER_BASE) >> 12] + (va & 0xfff);
+        if (!cpu_physical_memory_get_dirty(pa, MIGRATION_DIRTY_FLAG) &&
+            errors++ < 10)
+            fprintf(stderr, "dma_test: 0x%08x was written but isn't "
+                    "dirty\n", va);
+    }
+}
+
+/* random transfers of random parts of the buffer, each through a
+   mapping with cpu_dma_map_virt() and checked with
+   cpu_memory_rw_debug() */
+static void
+check_model( void )
+{
+    static uint8_t  src[256 * 1024], dst[256 * 1024];
+    int             op, nn;
+
+    map_buffer();
+    for (nn = 0; nn < 8; nn++)
+        unmap_buffer_page(next_rand() % BUFFER_PAGES);
+
+    for (op = 0; op < NB_CHECKS && errors < 10; op++) {
+        uint32_t  va = buffer_va(next_rand() % BUFFER_PAGES) +
+                       next_rand() % 4096;
+        uint32_t  len = next_rand() % 4 ? next_rand() % 8192
+                                        : next_rand() % sizeof(src);
+        uint32_t  mapped, off, l;
+        int       is_write = next_rand() % 2;
+        CPUDMA    dma;
+
+        if (va + len > buffer_va(BUFFER_PAGES))
+            len = buffer_va(BUFFER_PAGES) - va;
+        mapped = mapped_len(va, len);
+        if (next_rand() % 2)
+            touch_buffer(va, mapped);
+        else if (next_rand() % 8 == 0)
+            tlb_flush(env, 1);
+
+        if (cpu_dma_map_virt(&dma, env, va, len) != mapped) {
+            if (errors++ < 10)
+                fprintf(stderr, "dma_test: 0x%08x+%u maps %u bytes, "
+                        "expected %u\n", va, len, dma.len, mapped);
+            cpu_dma_unmap(&dma);
+            continue;
+        }
+
+        /* a transfer in pieces, like the erase units of a NAND read */
+        for (nn = 0; nn < (int)mapped; nn++)
+            src[nn] = next_rand();
+        if (is_write)
+            clean_buffer(va, mapped);
+        for (off = 0; off < mapped; off += l) {
+            l = next_rand() % 3 ? next_rand() % 4096 + 1 : mapped;
+            if (l > mapped - off)
+                l = mapped - off;
+            if (is_write) {
+                cpu_dma_rw(&dma, off, src + off, l, 1);
+            } else {
+                cpu_memory_rw_debug(env, va + off, src + off, l, 1);
+                cpu_dma_rw(&dma, off, dst + off, l, 0);
+            }
+        }
+        if (cpu_dma_rw(&dma, 0, dst, mapped + 1, 0) != -1 && errors++ < 10)
+            fprintf(stderr, "dma_test: 0x%08x+%u: transfer past the "
+                    "mapping\n", va, mapped);
+        cpu_dma_unmap(&dma);
+
+        if (is_write) {
+            check_dirty(va, mapped);
+            cpu_memory_rw_debug(env, va, dst, mapped, 0);
+        }
+        if (memcmp(src, dst, mapped) != 0 && errors++ < 10)
+            fprintf(stderr, "dma_test: 0x%08x+%u: %s doesn't match\n", va,
+                    mapped, is_write ? "write" : "read");
+
+        if (cpu_dma_memory_rw(env, va, dst, len, 0) != (mapped < len ? -1 : 0)
+            && errors++ < 10)
+            fprintf(stderr, "dma_test: 0x%08x+%u: wrong cpu_dma_memory_rw() "
+                    "status with %u bytes mapped\n", va, len, mapped);
+    }
+}
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint8_t  dev_data[ERASE_SIZE];
+
+/* a NAND read command of 'len' bytes into the buffer, like
+   nand_dev_read_file(): the guest buffer is mapped once, then each
+   erase unit read from the image is copied to it. the read() of the
+   image itself is left out, it is the same for both. */
+static void
+nand_read( uint32_t  len )
+{
+    uint32_t  data, l;
+    CPUDMA    dma;
+
+    if (cpu_dma_map_virt(&dma, env, USER_BASE, len) != len)
+        errors++;
+    for (data = 0; data < len; data += l) {
+        l = len - data < ERASE_SIZE ? len - data : ERASE_SIZE;
+        cpu_dma_rw(&dma, data, dev_data, l, 1);
+    }
+    cpu_dma_unmap(&dma);
+}
+
+/* the same, as it was done before, with a walk of the page tables for
+   each page and a copy for each target page */
+static void
+nand_read_debug( uint32_t  len )
+{
+    uint32_t  data, l;
+
+    for (data = 0; data < len; data += l) {
+        l = len - data < ERASE_SIZE ? len - data : ERASE_SIZE;
+        if (cpu_memory_rw_debug(env, USER_BASE + data, dev_data, l, 1) < 0)
+            errors++;
+    }
+}
+
+/* returns the time per read of 'len' bytes, in seconds */
+static double
+bench_read( void (*read)(uint32_t len), uint32_t  len )
+{
+    double  t0 = now_secs(), t;
+    int     iterations = 0;
+
+    do {
+        read(len);
+        iterations++;
+    } while ((t = now_secs() - t0) < 0.2);
+
+    return t / iterations;
+}
+
+static void
+bench_nand( uint32_t  len, int  warm )
+{
+    double  t_dma, t_debug;
+
+    map_buffer();
+    if (warm)
+        touch_buffer(USER_BASE, len);
+    t_dma = bench_read(nand_read, len);
+    t_debug = bench_read(nand_read_debug, len);
+
+    printf("dma_test: %7u-byte NAND read, TLB %s: %7.2f us with cpu_dma_rw(), "
+           "%7.2f us with cpu_memory_rw_debug() (%.1fx)\n", len,
+           warm ? "warm" : "cold", t_dma * 1e6, t_debug * 1e6,
+           t_debug / t_dma);
+}
+
+int main(void)
+{
+    ram_addr_t  offset;
+    uint32_t    nn;
+
+    cpu_exec_init_all(0);
+    offset = qemu_ram_alloc(RAM_SIZE);
+    cpu_register_physical_memory(0, RAM_SIZE, offset | IO_MEM_RAM);
+
+    env = cpu_arm_init("cortex-a8");
+    cpu_single_env = env;
+    /* MMU on, with ARMv6 descriptors, and domain 0 is a client */
+    env->cp15.c1_sys |= 1 | (1 << 23);
+    env->cp15.c3 = 1;
+
+    check_model();
+    if (errors > 0) {
+        fprintf(stderr, "dma_test: FAILED\n");
+        return 1;
+    }
+
+    for (nn = 0; nn < ERASE_SIZE; nn++)
+        dev_data[nn] = next_rand();
+    bench_nand(2048, 0);
+    bench_nand(ERASE_SIZE, 0);
+    bench_nand(7 * ERASE_SIZE, 0);
+    bench_nand(2048, 1);
+    bench_nand(ERASE_SIZE, 1);
+    bench_nand(7 * ERASE_SIZE, 1);
+
+    if (errors > 0) {
+        fprintf(stderr, "dma_test: FAILED\n");
+        return 1;
+    }
+    printf("dma_test: OK\n");
+    return 0;
+}
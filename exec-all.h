@@ -80,22 +80,32 @@ TranslationBlock *tb_gen_code(CPUState *env,
                               int cflags);
 void cpu_exec_init(CPUState *env);
 void QEMU_NORETURN cpu_loop_exit(void);
+/* Returns nonzero if 'tb', which has just jumped back to its own start,
+   is an idle loop that can only exit after an interrupt or a DMA write,
+   so that the CPU can be halted instead of spinning in it. */
+int cpu_is_idle_loop(CPUState *env, struct TranslationBlock *tb);
 int page_unprotect(target_ulong address, unsigned long pc, void *puc);
 void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t end,
                                    int is_cpu_write_access);
 void tb_invalidate_page_range(target_ulong start, target_ulong end);
 void tlb_flush_page(CPUState *env, target_ulong addr);
 void tlb_flush(CPUState *env, int flush_global);
+void tlb_switch_asid(CPUState *env, uint64_t asid, int keep_global);
+void tlb_flush_asid(CPUState *env, uint64_t asid, uint64_t mask);
+void tlb_flush_tag(CPUState *env, unsigned int mask);
+int tlb_victim_lookup(CPUState *env, int mmu_idx, int index,
+                      target_ulong addr, size_t elt_ofs);
 int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
                       target_phys_addr_t paddr, int prot,
-                      int mmu_idx, int is_softmmu);
+                      int mmu_idx, int is_softmmu, target_ulong size);
 static inline int tlb_set_page(CPUState *env1, target_ulong vaddr,
                                target_phys_addr_t paddr, int prot,
-                               int mmu_idx, int is_softmmu)
+                               int mmu_idx, int is_softmmu, target_ulong size)
 {
     if (prot & PAGE_READ)
         prot |= PAGE_EXEC;
-    return tlb_set_page_exec(env1, vaddr, paddr, prot, mmu_idx, is_softmmu);
+    return tlb_set_page_exec(env1, vaddr, paddr, prot, mmu_idx, is_softmmu,
+                             size);
 }
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -127,6 +137,10 @@ struct TranslationBlock {
     uint16_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+    uint8_t idle_loop;  /* see cpu_is_idle_loop() */
+#define TB_IDLE_UNKNOWN 0
+#define TB_IDLE_LOOP    1
+#define TB_IDLE_NONE    2
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -338,6 +352,23 @@ extern CPUWriteMemoryFunc *io_mem_write[IO_MEM_NB_ENTRIES][4];
 extern CPUReadMemoryFunc *io_mem_read[IO_MEM_NB_ENTRIES][4];
 extern void *io_mem_opaque[IO_MEM_NB_ENTRIES];
 
+/* number of registers covered by the masks of IOMemDispatch */
+#define IO_MEM_FAST_REGS 32
+
+/* per I/O memory index state of the softmmu I/O accessors */
+typedef struct IOMemDispatch {
+    const uint32_t *shadow;
+    uint32_t shadow_mask;
+    uint32_t posted_mask;
+    int posted_pending; /* number of queued writes */
+    IOMemStats stats;
+} IOMemDispatch;
+
+extern IOMemDispatch io_mem_dispatch[IO_MEM_NB_ENTRIES];
+
+void cpu_io_memory_post_write(int io_index, target_phys_addr_t addr,
+                              uint32_t val, int shift);
+
 #include "qemu-lock.h"
 
 extern spinlock_t tb_lock;
@@ -387,7 +418,7 @@ static inline target_ulong get_phys_addr_code(CPUState *env1, target_ulong addr)
     int mmu_idx, page_index, pd;
     void *p;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    page_index = (addr >> TARGET_PAGE_BITS) & (env1->tlb_size - 1);
     mmu_idx = cpu_mmu_index(env1);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
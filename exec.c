@@ -40,6 +40,8 @@
 #include "hw/hw.h"
 #include "osdep.h"
 #include "kvm.h"
+#include "host-utils.h"
+#include "dirty-map.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #endif
@@ -48,6 +50,8 @@
 #endif  // CONFIG_MEMCHECK
 
 #include "gles2emulator_utils.h"
+#include "sysemu.h"
+#include "ram-dedup.h"
 #include "qemu_debug.h"
 //#define DEBUG 1
 #if DEBUG
@@ -125,6 +129,9 @@ uint8_t *code_gen_ptr;
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
 uint8_t *phys_ram_dirty;
+uint32_t *phys_ram_pgtable_gen;
+unsigned long *phys_ram_dirty_map[DIRTY_MAP_COUNT];
+ram_addr_t phys_ram_dirty_pages[DIRTY_MAP_COUNT];
 static int in_migration;
 
 typedef struct RAMBlock {
@@ -152,6 +159,8 @@ int use_icount = 0;
 /* Current instruction counter.  While executing translated code this may
    include some instructions that have not yet been executed.  */
 int64_t qemu_icount;
+/* log2 of the number of TLB entries per MMU mode, see -tlb-size */
+int cpu_tlb_bits = CPU_TLB_DEFAULT_BITS;
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -196,11 +205,13 @@ static PhysPageDesc **l1_phys_map;
 
 #if !defined(CONFIG_USER_ONLY)
 static void io_mem_init(void);
+static void tlb_init_sets(CPUState *env);
 
 /* io memory support */
 CPUWriteMemoryFunc *io_mem_write[IO_MEM_NB_ENTRIES][4];
 CPUReadMemoryFunc *io_mem_read[IO_MEM_NB_ENTRIES][4];
 void *io_mem_opaque[IO_MEM_NB_ENTRIES];
+IOMemDispatch io_mem_dispatch[IO_MEM_NB_ENTRIES];
 static char io_mem_used[IO_MEM_NB_ENTRIES];
 static int io_mem_watch;
 #endif
@@ -217,6 +228,11 @@ static int log_append = 0;
 
 /* statistics */
 static int tlb_flush_count;
+static int tlb_fill_count;
+static int tlb_miss_count;
+static int tlb_victim_hit_count;
+static int tlb_asid_switch_count;
+static int tlb_asid_restore_count;
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
 
@@ -592,6 +608,11 @@ void cpu_exec_init(CPUState *env)
     }
     env->cpu_index = cpu_index;
     env->numa_node = 0;
+    env->tlb_size = 1 << cpu_tlb_bits;
+    env->tlb_mask = (env->tlb_size - 1) << CPU_TLB_ENTRY_BITS;
+#if !defined(CONFIG_USER_ONLY)
+    tlb_init_sets(env);
+#endif
     QTAILQ_INIT(&env->breakpoints);
     QTAILQ_INIT(&env->watchpoints);
     *penv = env;
@@ -1205,6 +1226,7 @@ TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tbs[nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->idle_loop = TB_IDLE_UNKNOWN;
 #ifdef CONFIG_MEMCHECK
     tb->tpc2gpc = NULL;
     tb->tpc2gpc_pairs = 0;
@@ -1775,29 +1797,174 @@ static inline void tlb_flush_jmp_cache(CPUState *env, target_ulong addr)
 	    TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
-/* NOTE: if flush_global is true, also flush global entries (not
-   implemented yet) */
-void tlb_flush(CPUState *env, int flush_global)
+/* TLB entries of recently used address spaces. Each set has its own
+   tables, and env->tlb_table, env->iotlb and env->tlb_attr point to
+   those of the current one, so switching to an address space that was
+   used recently only changes these pointers. The other sets are kept
+   until they are reused, and all TLB invalidations also apply to them. */
+#define CPU_TLB_SETS 16
+
+/* contents of env->tlb_attr and env->tlb_v_attr */
+#define TLB_ATTR_TAG_MASK  0x0f    /* PAGE_TAG() of the mapping */
+#define TLB_ATTR_GLOBAL    0x10    /* mapped with PAGE_GLOBAL */
+
+static inline void tlb_update_dirty(CPUTLBEntry *tlb_entry);
+
+typedef struct CPUTLBSet {
+    uint64_t asid;
+    int valid;          /* holds the entries of 'asid', if not current */
+    unsigned int last_use;
+    /* tlb_dirty_resets when the set was put aside */
+    unsigned int dirty_resets;
+    /* tags that the entries of the set may have, and the tags to flush
+       before it becomes current again */
+    unsigned int tags;
+    unsigned int flush_tags;
+    /* the tables have env->tlb_size entries */
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];
+    target_phys_addr_t *iotlb[NB_MMU_MODES];
+    uint8_t *tlb_attr[NB_MMU_MODES];
+} CPUTLBSet;
+
+/* incremented by cpu_physical_memory_reset_dirty(), which only updates
+   the entries of the current sets */
+static unsigned int tlb_dirty_resets;
+
+/* for each RAM page, the virtual address of the TLB entries (of any CPU,
+   current or put aside) that may write to it without setting its dirty
+   flags, TLB_VADDR_NONE if there are none, or TLB_VADDR_MANY if they do
+   not all have the same address. This lets
+   cpu_physical_memory_reset_dirty_page() update these entries only. */
+static target_ulong *phys_ram_tlb_vaddr;
+#define TLB_VADDR_NONE  1   /* not page aligned, never a virtual address */
+#define TLB_VADDR_MANY  3
+
+static inline void tlb_note_clean_write(ram_addr_t ram_addr,
+                                        target_ulong vaddr)
+{
+    target_ulong *p = &phys_ram_tlb_vaddr[ram_addr >> TARGET_PAGE_BITS];
+
+    if (*p == TLB_VADDR_NONE)
+        *p = vaddr;
+    else if (*p != vaddr)
+        *p = TLB_VADDR_MANY;
+}
+
+static void tlb_use_set(CPUState *env, CPUTLBSet *set)
+{
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        env->tlb_table[mmu_idx] = set->tlb_table[mmu_idx];
+        env->iotlb[mmu_idx] = set->iotlb[mmu_idx];
+        env->tlb_attr[mmu_idx] = set->tlb_attr[mmu_idx];
+    }
+    env->tlb_set = set;
+}
+
+static void tlb_init_sets(CPUState *env)
+{
+    CPUTLBSet *set;
+    int i, mmu_idx;
+
+    env->tlb_sets = qemu_mallocz(CPU_TLB_SETS * sizeof(CPUTLBSet));
+    for (i = 0; i < CPU_TLB_SETS; i++) {
+        set = &env->tlb_sets[i];
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            set->tlb_table[mmu_idx] =
+                qemu_malloc(env->tlb_size * sizeof(CPUTLBEntry));
+            memset(set->tlb_table[mmu_idx], -1,
+                   env->tlb_size * sizeof(CPUTLBEntry));
+            set->iotlb[mmu_idx] =
+                qemu_mallocz(env->tlb_size * sizeof(target_phys_addr_t));
+            set->tlb_attr[mmu_idx] = qemu_mallocz(env->tlb_size);
+        }
+    }
+    tlb_use_set(env, &env->tlb_sets[0]);
+}
+
+static inline void tlb_invalidate_entry(CPUState *env, int mmu_idx, int i)
+{
+    env->tlb_table[mmu_idx][i].addr_read = -1;
+    env->tlb_table[mmu_idx][i].addr_write = -1;
+    env->tlb_table[mmu_idx][i].addr_code = -1;
+    env->tlb_attr[mmu_idx][i] = 0;
+}
+
+static inline int tlb_entry_is_valid(const CPUTLBEntry *te)
+{
+    return te->addr_read != -1 || te->addr_write != -1 ||
+           te->addr_code != -1;
+}
+
+static inline int tlb_attr_has_tag(uint8_t attr, unsigned int mask)
+{
+    return (mask >> (attr & TLB_ATTR_TAG_MASK)) & 1;
+}
+
+/* flush the victim TLB, except global entries if !flush_global */
+static void tlb_flush_victims(CPUState *env, int flush_global)
+{
+    int i, mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            if (flush_global ||
+                !(env->tlb_v_attr[mmu_idx][i] & TLB_ATTR_GLOBAL)) {
+                CPUTLBEntry *ve = &env->tlb_v_table[mmu_idx][i];
+
+                ve->addr_read = -1;
+                ve->addr_write = -1;
+                ve->addr_code = -1;
+                env->tlb_v_attr[mmu_idx][i] = 0;
+            }
+        }
+    }
+}
+
+/* flush the current entries, except global ones if !flush_global */
+static void tlb_flush_table(CPUState *env, int flush_global)
 {
     int i;
 
-#if defined(DEBUG_TLB)
-    printf("tlb_flush:\n");
-#endif
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     env->current_tb = NULL;
 
-    for(i = 0; i < CPU_TLB_SIZE; i++) {
+    for(i = 0; i < env->tlb_size; i++) {
         int mmu_idx;
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            env->tlb_table[mmu_idx][i].addr_read = -1;
-            env->tlb_table[mmu_idx][i].addr_write = -1;
-            env->tlb_table[mmu_idx][i].addr_code = -1;
+            if (flush_global ||
+                !(env->tlb_attr[mmu_idx][i] & TLB_ATTR_GLOBAL))
+                tlb_invalidate_entry(env, mmu_idx, i);
         }
     }
+    tlb_flush_victims(env, flush_global);
+    if (flush_global)
+        env->tlb_set->tags = 0;
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+}
+
+/* NOTE: if flush_global is false, entries of pages mapped with
+   PAGE_GLOBAL are kept */
+void tlb_flush(CPUState *env, int flush_global)
+{
+    int i;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush:\n");
+#endif
+    tlb_flush_table(env, flush_global);
+
+    for (i = 0; i < CPU_TLB_SETS; i++) {
+        if (&env->tlb_sets[i] != env->tlb_set)
+            env->tlb_sets[i].valid = 0;
+    }
+    if (flush_global) {
+        env->tlb_flush_addr = -1;
+        env->tlb_flush_mask = 0;
+    }
 
 #ifdef CONFIG_KQEMU
     if (env->kqemu_enabled) {
@@ -1807,6 +1974,164 @@ void tlb_flush(CPUState *env, int flush_global)
     tlb_flush_count++;
 }
 
+/* Bring the entries of a set that was put aside up to date: flush those
+   with a tag in set->flush_tags, and make writes to the pages that were
+   cleaned meanwhile set their dirty flags again. */
+static void tlb_refresh_set(CPUState *env, CPUTLBSet *set)
+{
+    int update_dirty = set->dirty_resets != tlb_dirty_resets;
+    int i, mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < env->tlb_size; i++) {
+            CPUTLBEntry *te = &env->tlb_table[mmu_idx][i];
+
+            if (!tlb_entry_is_valid(te))
+                continue;
+            if (tlb_attr_has_tag(env->tlb_attr[mmu_idx][i],
+                                 set->flush_tags))
+                tlb_invalidate_entry(env, mmu_idx, i);
+            else if (update_dirty)
+                tlb_update_dirty(te);
+        }
+    }
+    set->tags &= ~set->flush_tags;
+    set->flush_tags = 0;
+}
+
+/* Make 'asid' the current address space. The current set is put aside,
+   and the set of 'asid' becomes the current one if it was used recently.
+   Otherwise, the least recently used set is emptied and reused. If
+   'keep_global' is false, global entries are not valid in the new
+   address space either. */
+void tlb_switch_asid(CPUState *env, uint64_t asid, int keep_global)
+{
+    CPUTLBSet *cur = env->tlb_set, *set, *next = NULL, *victim = NULL;
+    int i, mmu_idx;
+
+    if (asid == env->tlb_asid)
+        return;
+    tlb_asid_switch_count++;
+
+#ifdef CONFIG_MEMCHECK
+    /* the memory checker modifies TLB entries behind our back */
+    if (memcheck_instrument_mmu) {
+        env->tlb_asid = asid;
+        tlb_flush(env, !keep_global);
+        return;
+    }
+#endif
+
+    for (i = 0; i < CPU_TLB_SETS; i++) {
+        set = &env->tlb_sets[i];
+        if (set == cur)
+            continue;
+        if (set->valid && set->asid == asid)
+            next = set;
+        else if (!victim || !set->valid ||
+                 (victim->valid && set->last_use < victim->last_use))
+            victim = set;
+    }
+
+    /* put the current entries aside */
+    cur->asid = env->tlb_asid;
+    cur->valid = 1;
+    cur->last_use = ++env->tlb_sets_use;
+    cur->dirty_resets = tlb_dirty_resets;
+
+    env->tlb_asid = asid;
+    env->current_tb = NULL;
+    if (next) {
+        tlb_use_set(env, next);
+        if (next->flush_tags || next->dirty_resets != tlb_dirty_resets)
+            tlb_refresh_set(env, next);
+        tlb_asid_restore_count++;
+    } else {
+        /* start from the global entries of the previous address space,
+           or from an empty set */
+        next = victim;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            for (i = 0; i < env->tlb_size; i++) {
+                if (keep_global &&
+                    (cur->tlb_attr[mmu_idx][i] & TLB_ATTR_GLOBAL)) {
+                    next->tlb_table[mmu_idx][i] = cur->tlb_table[mmu_idx][i];
+                    next->iotlb[mmu_idx][i] = cur->iotlb[mmu_idx][i];
+                    next->tlb_attr[mmu_idx][i] = cur->tlb_attr[mmu_idx][i];
+                } else {
+                    memset(&next->tlb_table[mmu_idx][i], -1,
+                           sizeof(CPUTLBEntry));
+                    next->tlb_attr[mmu_idx][i] = 0;
+                }
+            }
+        }
+        next->tags = 0;
+        next->flush_tags = 0;
+        tlb_use_set(env, next);
+    }
+    next->valid = 0;
+    /* the global entries kept in the victim TLB come from 'cur' */
+    if (keep_global)
+        next->tags |= cur->tags;
+    tlb_flush_victims(env, !keep_global);
+    memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+}
+
+/* flush the non-global entries of the address spaces whose identifier
+   matches 'asid' in the bits of 'mask' */
+void tlb_flush_asid(CPUState *env, uint64_t asid, uint64_t mask)
+{
+    int i;
+
+    for (i = 0; i < CPU_TLB_SETS; i++) {
+        CPUTLBSet *set = &env->tlb_sets[i];
+
+        if (set != env->tlb_set && ((set->asid ^ asid) & mask) == 0)
+            set->valid = 0;
+    }
+    if (((env->tlb_asid ^ asid) & mask) == 0)
+        tlb_flush_table(env, 0);
+}
+
+/* flush the entries, global or not, whose PAGE_TAG() is in the bits of
+   'mask'. Only the current set is walked, the entries of the other ones
+   are flushed when they become current again. */
+void tlb_flush_tag(CPUState *env, unsigned int mask)
+{
+    CPUTLBSet *set;
+    int i, mmu_idx;
+
+    for (i = 0; i < CPU_TLB_SETS; i++) {
+        set = &env->tlb_sets[i];
+        if (set != env->tlb_set && set->valid)
+            set->flush_tags |= set->tags & mask;
+    }
+
+    set = env->tlb_set;
+    if (!(set->tags & mask))
+        return;
+
+    env->current_tb = NULL;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < env->tlb_size; i++) {
+            if (tlb_attr_has_tag(env->tlb_attr[mmu_idx][i], mask) &&
+                tlb_entry_is_valid(&env->tlb_table[mmu_idx][i]))
+                tlb_invalidate_entry(env, mmu_idx, i);
+        }
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            if (tlb_attr_has_tag(env->tlb_v_attr[mmu_idx][i], mask)) {
+                CPUTLBEntry *ve = &env->tlb_v_table[mmu_idx][i];
+
+                ve->addr_read = -1;
+                ve->addr_write = -1;
+                ve->addr_code = -1;
+                env->tlb_v_attr[mmu_idx][i] = 0;
+            }
+        }
+    }
+    set->tags &= ~mask;
+    memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
@@ -1823,24 +2148,64 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 
 void tlb_flush_page(CPUState *env, target_ulong addr)
 {
-    int i;
+    int i, j;
     int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
+    /* the page may be part of a large page, which is cached as several
+       entries of TARGET_PAGE_SIZE: flush everything in that case */
+    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
+        tlb_flush(env, 1);
+        return;
+    }
+
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     env->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    i = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (j = 0; j < CPU_VTLB_SIZE; j++)
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][j], addr);
+    }
+
+    for (j = 0; j < CPU_TLB_SETS; j++) {
+        CPUTLBSet *set = &env->tlb_sets[j];
+
+        if (set == env->tlb_set || !set->valid)
+            continue;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+            tlb_flush_entry(&set->tlb_table[mmu_idx][i], addr);
+    }
 
     tlb_flush_jmp_cache(env, addr);
 }
 
+/* Record that a page larger than TARGET_PAGE_SIZE is cached in the TLB.
+   Only a single range covering all large pages is kept, which is a
+   compromise between unnecessary flushes and the cost of tracking each
+   of them. */
+static void tlb_add_large_page(CPUState *env, target_ulong vaddr,
+                               target_ulong size)
+{
+    target_ulong mask = ~(size - 1);
+
+    if (env->tlb_flush_addr == (target_ulong)-1) {
+        env->tlb_flush_addr = vaddr & mask;
+        env->tlb_flush_mask = mask;
+        return;
+    }
+    mask &= env->tlb_flush_mask;
+    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0)
+        mask <<= 1;
+    env->tlb_flush_addr &= mask;
+    env->tlb_flush_mask = mask;
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 static void tlb_protect_code(ram_addr_t ram_addr)
@@ -1855,7 +2220,7 @@ static void tlb_protect_code(ram_addr_t ram_addr)
 static void tlb_unprotect_code_phys(CPUState *env, ram_addr_t ram_addr,
                                     target_ulong vaddr)
 {
-    phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] |= CODE_DIRTY_FLAG;
+    cpu_physical_memory_set_dirty_flags(ram_addr, CODE_DIRTY_FLAG);
 }
 
 static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
@@ -1870,14 +2235,75 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
     }
 }
 
+static int dirty_flag_to_map(int dirty_flag)
+{
+    switch (dirty_flag) {
+    case VGA_DIRTY_FLAG:
+        return DIRTY_MAP_VGA;
+    case CODE_DIRTY_FLAG:
+        return DIRTY_MAP_CODE;
+    case MIGRATION_DIRTY_FLAG:
+        return DIRTY_MAP_MIGRATION;
+    default:
+        abort();
+    }
+}
+
+ram_addr_t cpu_physical_memory_find_dirty(ram_addr_t start, ram_addr_t end,
+                                          int dirty_flag)
+{
+    int map = dirty_flag_to_map(dirty_flag);
+    ram_addr_t page, last, limit;
+
+    limit = (end > last_ram_offset) ? last_ram_offset : end;
+    if (start >= limit || phys_ram_dirty_pages[map] == 0)
+        return end;
+
+    last = TARGET_PAGE_ALIGN(limit) >> TARGET_PAGE_BITS;
+    page = dirty_map_find(phys_ram_dirty_map[map], start >> TARGET_PAGE_BITS,
+                          last);
+    if (page >= last)
+        return end;
+    return page << TARGET_PAGE_BITS;
+}
+
+ram_addr_t cpu_physical_memory_count_dirty(int dirty_flag)
+{
+    return phys_ram_dirty_pages[dirty_flag_to_map(dirty_flag)];
+}
+
 /* Note: start and end must be within the same ram block.  */
+/* clear 'dirty_flags' in the flag bytes and the dirty maps of pages
+   [first, first + count) */
+static void dirty_flags_clear(ram_addr_t first, ram_addr_t count,
+                              int dirty_flags)
+{
+    uint8_t *p = phys_ram_dirty + first;
+    int i, mask = ~dirty_flags;
+    ram_addr_t n;
+
+    for (n = 0; n < count; n++)
+        p[n] &= mask;
+
+    for (i = 0; i < DIRTY_MAP_COUNT; i++) {
+        static const int map_flags[DIRTY_MAP_COUNT] = {
+            [DIRTY_MAP_VGA]       = VGA_DIRTY_FLAG,
+            [DIRTY_MAP_CODE]      = CODE_DIRTY_FLAG,
+            [DIRTY_MAP_MIGRATION] = MIGRATION_DIRTY_FLAG,
+        };
+        if (dirty_flags & map_flags[i]) {
+            phys_ram_dirty_pages[i] -=
+                dirty_map_clear(phys_ram_dirty_map[i], first, count);
+        }
+    }
+}
+
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
 {
     CPUState *env;
     unsigned long length, start1;
-    int i, mask, len;
-    uint8_t *p;
+    int i;
 
     start &= TARGET_PAGE_MASK;
     end = TARGET_PAGE_ALIGN(end);
@@ -1885,11 +2311,8 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     length = end - start;
     if (length == 0)
         return;
-    len = length >> TARGET_PAGE_BITS;
-    mask = ~dirty_flags;
-    p = phys_ram_dirty + (start >> TARGET_PAGE_BITS);
-    for(i = 0; i < len; i++)
-        p[i] &= mask;
+    dirty_flags_clear(start >> TARGET_PAGE_BITS, length >> TARGET_PAGE_BITS,
+                      dirty_flags);
 
     /* we modify the TLB cache so that the dirty bit will be set again
        when accessing the range */
@@ -1904,11 +2327,77 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         int mmu_idx;
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            for(i = 0; i < CPU_TLB_SIZE; i++)
+            for(i = 0; i < env->tlb_size; i++)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
+            for(i = 0; i < CPU_VTLB_SIZE; i++)
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+        }
+    }
+    /* the sets put aside are updated when they become current again */
+    tlb_dirty_resets++;
+}
+
+/* Same as cpu_physical_memory_reset_dirty() for the single page at
+   'addr', for flags that are cleared often, like PGTABLE_DIRTY_FLAG.
+   The TLB entries that may write to the page without trapping usually
+   all map the same virtual address, so only the slots of that address
+   are updated, in every CPU and set, instead of walking whole TLBs.  */
+void cpu_physical_memory_reset_dirty_page(ram_addr_t addr, int dirty_flags)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    target_ulong vaddr = phys_ram_tlb_vaddr[page];
+    unsigned long start1;
+    CPUState *env;
+    int i, j, mmu_idx;
+
+    addr &= TARGET_PAGE_MASK;
+    start1 = (unsigned long)qemu_get_ram_ptr(addr);
+    if (vaddr == TLB_VADDR_MANY) {
+        /* walk everything once, including the sets put aside, so that the
+           page is tracked precisely again from now on */
+        cpu_physical_memory_reset_dirty(addr, addr + TARGET_PAGE_SIZE,
+                                        dirty_flags);
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            for (j = 0; j < CPU_TLB_SETS; j++) {
+                CPUTLBSet *set = &env->tlb_sets[j];
+                if (set == env->tlb_set || !set->valid)
+                    continue;
+                for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                    for (i = 0; i < env->tlb_size; i++)
+                        tlb_reset_dirty_range(&set->tlb_table[mmu_idx][i],
+                                              start1, TARGET_PAGE_SIZE);
+                }
+            }
+        }
+        phys_ram_tlb_vaddr[page] = TLB_VADDR_NONE;
+        return;
+    }
+
+    dirty_flags_clear(page, 1, dirty_flags);
+    if (vaddr == TLB_VADDR_NONE)
+        return;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        i = (vaddr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
+                                  start1, TARGET_PAGE_SIZE);
+            for (j = 0; j < CPU_VTLB_SIZE; j++)
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][j],
+                                      start1, TARGET_PAGE_SIZE);
+        }
+        for (j = 0; j < CPU_TLB_SETS; j++) {
+            CPUTLBSet *set = &env->tlb_sets[j];
+            if (set == env->tlb_set || !set->valid)
+                continue;
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+                tlb_reset_dirty_range(&set->tlb_table[mmu_idx][i],
+                                      start1, TARGET_PAGE_SIZE);
         }
     }
+    phys_ram_tlb_vaddr[page] = TLB_VADDR_NONE;
 }
 
 int cpu_physical_memory_set_dirty_tracking(int enable)
@@ -1956,8 +2445,10 @@ void cpu_tlb_update_dirty(CPUState *env)
     int i;
     int mmu_idx;
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        for(i = 0; i < CPU_TLB_SIZE; i++)
+        for(i = 0; i < env->tlb_size; i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for(i = 0; i < CPU_VTLB_SIZE; i++)
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
     }
 }
 
@@ -1967,17 +2458,92 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
         tlb_entry->addr_write = vaddr;
 }
 
-/* update the TLB corresponding to virtual page vaddr
-   so that it is no longer dirty */
-static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
+/* update the TLB corresponding to virtual page vaddr, which maps the
+   RAM page at ram_addr, so that it is no longer dirty */
+static inline void tlb_set_dirty(CPUState *env, ram_addr_t ram_addr,
+                                 target_ulong vaddr)
 {
-    int i;
+    int i, j;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    tlb_note_clean_write(ram_addr, vaddr);
+    i = (vaddr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (j = 0; j < CPU_VTLB_SIZE; j++)
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][j], vaddr);
+    }
+}
+
+/* Move entry 'index' of the TLB of 'mmu_idx' to the victim TLB before
+   it is replaced by an entry for 'vaddr'. */
+static void tlb_evict_entry(CPUState *env, int mmu_idx, int index,
+                            target_ulong vaddr)
+{
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+    int i;
+
+#ifdef CONFIG_MEMCHECK
+    if (memcheck_instrument_mmu)
+        return;
+#endif
+    /* previous entries for vaddr may have fewer rights than the new one */
+    for (i = 0; i < CPU_VTLB_SIZE; i++)
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][i], vaddr);
+
+    if (!tlb_entry_is_valid(te))
+        return;
+    if (vaddr == (te->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+        vaddr == (te->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+        vaddr == (te->addr_code & (TARGET_PAGE_MASK | TLB_INVALID_MASK)))
+        return;
+
+    i = env->vtlb_index++ % CPU_VTLB_SIZE;
+    env->tlb_v_table[mmu_idx][i] = *te;
+    env->iotlb_v[mmu_idx][i] = env->iotlb[mmu_idx][index];
+    env->tlb_v_attr[mmu_idx][i] = env->tlb_attr[mmu_idx][index];
+}
+
+/* Called on a TLB miss for 'addr' before filling the entry from the page
+   tables. 'elt_ofs' is the offset in CPUTLBEntry of the address compared
+   for this access. If the victim TLB has a matching entry, it is swapped
+   with the one of the main TLB and 1 is returned. */
+int tlb_victim_lookup(CPUState *env, int mmu_idx, int index,
+                      target_ulong addr, size_t elt_ofs)
+{
+    CPUTLBEntry tmp, *te, *ve;
+    target_phys_addr_t iotlb;
+    uint8_t attr;
+    int i;
+
+    tlb_miss_count++;
+#ifdef CONFIG_MEMCHECK
+    if (memcheck_instrument_mmu)
+        return 0;
+#endif
+    addr &= TARGET_PAGE_MASK;
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        ve = &env->tlb_v_table[mmu_idx][i];
+        if (addr == (*(target_ulong *)((uint8_t *)ve + elt_ofs) &
+                     (TARGET_PAGE_MASK | TLB_INVALID_MASK)))
+            break;
+    }
+    if (i == CPU_VTLB_SIZE)
+        return 0;
+
+    te = &env->tlb_table[mmu_idx][index];
+    tmp = *te;
+    *te = *ve;
+    *ve = tmp;
+    iotlb = env->iotlb[mmu_idx][index];
+    env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][i];
+    env->iotlb_v[mmu_idx][i] = iotlb;
+    attr = env->tlb_attr[mmu_idx][index];
+    env->tlb_attr[mmu_idx][index] = env->tlb_v_attr[mmu_idx][i];
+    env->tlb_v_attr[mmu_idx][i] = attr;
+    tlb_victim_hit_count++;
+    return 1;
 }
 
 /* add a new TLB entry. At most one entry for a given virtual address
@@ -1986,7 +2552,7 @@ static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
    conflicting with the host address space). */
 int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
                       target_phys_addr_t paddr, int prot,
-                      int mmu_idx, int is_softmmu)
+                      int mmu_idx, int is_softmmu, target_ulong size)
 {
     PhysPageDesc *p;
     unsigned long pd;
@@ -2010,6 +2576,10 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
            vaddr, (int)paddr, prot, mmu_idx, is_softmmu, pd);
 #endif
 
+    tlb_fill_count++;
+    if (size > TARGET_PAGE_SIZE)
+        tlb_add_large_page(env, vaddr, size);
+
     ret = 0;
     address = vaddr;
     if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM && !(pd & IO_MEM_ROMD)) {
@@ -2051,8 +2621,14 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
         }
     }
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = (vaddr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+    tlb_evict_entry(env, mmu_idx, index, vaddr);
     env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    env->tlb_attr[mmu_idx][index] = (prot >> PAGE_TAG_SHIFT) &
+                                    TLB_ATTR_TAG_MASK;
+    if (prot & PAGE_GLOBAL)
+        env->tlb_attr[mmu_idx][index] |= TLB_ATTR_GLOBAL;
+    env->tlb_set->tags |= 1 << ((prot >> PAGE_TAG_SHIFT) & TLB_ATTR_TAG_MASK);
     te = &env->tlb_table[mmu_idx][index];
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
@@ -2076,6 +2652,8 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
             te->addr_write = address | TLB_NOTDIRTY;
         } else {
             te->addr_write = address;
+            if ((pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM)
+                tlb_note_clean_write(pd & TARGET_PAGE_MASK, vaddr);
         }
     } else {
         te->addr_write = -1;
@@ -2124,9 +2702,21 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 {
 }
 
+void tlb_switch_asid(CPUState *env, uint64_t asid, int keep_global)
+{
+}
+
+void tlb_flush_asid(CPUState *env, uint64_t asid, uint64_t mask)
+{
+}
+
+void tlb_flush_tag(CPUState *env, unsigned int mask)
+{
+}
+
 int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
                       target_phys_addr_t paddr, int prot,
-                      int mmu_idx, int is_softmmu)
+                      int mmu_idx, int is_softmmu, target_ulong size)
 {
     return 0;
 }
@@ -2484,6 +3074,19 @@ ram_addr_t qemu_ram_alloc(ram_addr_t size)
     new_block->host = mmap((void*)0x1000000, size, PROT_EXEC|PROT_READ|PROT_WRITE,
                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 #else
+#ifndef _WIN32
+    if (mem_merge) {
+        /* private memory, so that identical pages can be merged */
+        new_block->host = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (new_block->host == MAP_FAILED) {
+            fprintf(stderr, "Failed to allocate %ld bytes of guest RAM\n",
+                    (long)size);
+            exit(1);
+        }
+    } else
+#endif
+    {
 //    	new_block->host = qemu_vmalloc(size);
 
 		DBGPRINT ("    (more) : Creating shared object...\n");
@@ -2496,7 +3099,7 @@ ram_addr_t qemu_ram_alloc(ram_addr_t size)
 		gles2emulator_utils_map_sharedmemory_file (&theSharedMemoryStruct);
 
     	new_block->host = theSharedMemoryStruct.actualAddress;
-
+    }
 #endif
 #ifdef MADV_MERGEABLE
     madvise(new_block->host, size, MADV_MERGEABLE);
@@ -2512,6 +3115,36 @@ ram_addr_t qemu_ram_alloc(ram_addr_t size)
     memset(phys_ram_dirty + (last_ram_offset >> TARGET_PAGE_BITS),
            0xff, size >> TARGET_PAGE_BITS);
 
+    {
+        ram_addr_t old_pages = last_ram_offset >> TARGET_PAGE_BITS;
+        ram_addr_t new_pages = (last_ram_offset + size) >> TARGET_PAGE_BITS;
+        ram_addr_t n;
+        ram_addr_t old_words = (old_pages + DIRTY_MAP_WORD_BITS - 1) /
+                               DIRTY_MAP_WORD_BITS;
+        ram_addr_t new_words = (new_pages + DIRTY_MAP_WORD_BITS - 1) /
+                               DIRTY_MAP_WORD_BITS;
+        int i;
+
+        for (i = 0; i < DIRTY_MAP_COUNT; i++) {
+            phys_ram_dirty_map[i] = qemu_realloc(phys_ram_dirty_map[i],
+                new_words * sizeof(unsigned long));
+            memset(phys_ram_dirty_map[i] + old_words, 0,
+                   (new_words - old_words) * sizeof(unsigned long));
+            phys_ram_dirty_pages[i] += dirty_map_set(phys_ram_dirty_map[i],
+                                                     old_pages,
+                                                     new_pages - old_pages);
+        }
+
+        phys_ram_pgtable_gen = qemu_realloc(phys_ram_pgtable_gen,
+                                            new_pages * sizeof(uint32_t));
+        phys_ram_tlb_vaddr = qemu_realloc(phys_ram_tlb_vaddr,
+                                          new_pages * sizeof(target_ulong));
+        for (n = old_pages; n < new_pages; n++) {
+            phys_ram_pgtable_gen[n] = 0;
+            phys_ram_tlb_vaddr[n] = TLB_VADDR_NONE;
+        }
+    }
+
     last_ram_offset += size;
 
     if (kvm_enabled())
@@ -2525,6 +3158,183 @@ void qemu_ram_free(ram_addr_t addr)
     /* TODO: implement this.  */
 }
 
+/* Back all guest RAM with a private mapping of 'fd', where the page at
+   ram offset 'addr' comes from file offset 'addr'. On failure, guest RAM
+   is left untouched. */
+int qemu_ram_map_file(int fd)
+{
+#ifdef _WIN32
+    return -ENOTSUP;
+#else
+    RAMBlock *block;
+    int ret = 0;
+
+    for (block = ram_blocks; block; block = block->next) {
+        if (((unsigned long)block->host | block->offset | block->length) &
+            (qemu_real_host_page_size - 1))
+            return -ENOTSUP;
+    }
+
+    /* Map every block somewhere first, so that any error is found before
+       guest RAM is replaced. Mapping over an existing range is atomic, so
+       the MAP_FIXED pass below can't fail for reasons the first one
+       wouldn't have caught. */
+    for (block = ram_blocks; block; block = block->next) {
+        void *p = mmap(NULL, block->length, PROT_READ, MAP_PRIVATE, fd,
+                       block->offset);
+        if (p == MAP_FAILED) {
+            ret = -errno;
+            break;
+        }
+        munmap(p, block->length);
+    }
+    if (ret < 0)
+        return ret;
+
+    for (block = ram_blocks; block; block = block->next) {
+        void *p = mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED, fd, block->offset);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Could not map RAM file over guest RAM: %s\n",
+                    strerror(errno));
+            abort();
+        }
+#ifdef MADV_MERGEABLE
+        madvise(block->host, block->length, MADV_MERGEABLE);
+#endif
+    }
+    ram_dedup_reset();
+    return 0;
+#endif
+}
+
+#ifndef _WIN32
+static int host_page_is_zero(const uint8_t *p)
+{
+    const unsigned long *w = (const unsigned long *)p;
+    size_t i;
+
+    for (i = 0; i < qemu_real_host_page_size / sizeof(unsigned long); i++) {
+        if (w[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* mark the discarded pages in [start, end) as free, and return the
+   number of bytes that were not already */
+static ram_addr_t ram_discard_mark(ram_addr_t start, ram_addr_t end)
+{
+    ram_addr_t addr, freed = 0;
+
+    if (start == end)
+        return 0;
+
+    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
+        if (!cpu_physical_memory_get_dirty(addr, CODE_DIRTY_FLAG))
+            tb_invalidate_phys_page_range(addr, addr + TARGET_PAGE_SIZE, 0);
+        if (cpu_physical_memory_get_dirty(addr, FREE_PAGE_DIRTY_FLAG))
+            freed += TARGET_PAGE_SIZE;
+        /* the content changed: snapshots must record it, pages merged
+           by ram-dedup.c are no longer mapped from the store, and cached
+           page table descriptors are stale */
+        cpu_physical_memory_set_dirty_flags(addr, MIGRATION_DIRTY_FLAG |
+                                                  DEDUP_DIRTY_FLAG |
+                                                  PGTABLE_DIRTY_FLAG);
+    }
+    /* this also makes the next guest write set the flag again */
+    cpu_physical_memory_reset_dirty(start, end, FREE_PAGE_DIRTY_FLAG);
+    return freed;
+}
+
+/* discard the whole host pages of [ram, ram + len), which are contiguous
+   in host memory */
+static ram_addr_t ram_discard_run(ram_addr_t ram, ram_addr_t len)
+{
+    unsigned long mask = qemu_real_host_page_size - 1;
+    uint8_t *host = qemu_get_ram_ptr(ram);
+    uint8_t *start = (uint8_t *)(((unsigned long)host + mask) & ~mask);
+    uint8_t *end = (uint8_t *)(((unsigned long)host + len) & ~mask);
+    ram_addr_t zero_start, freed = 0;
+    uint8_t *p;
+
+    if (start >= end)
+        return 0;
+    ram += start - host;
+
+#ifdef MADV_REMOVE
+    /* punch a hole in the shared memory object: only this releases the
+       memory of a shared mapping, and the pages then read as zeroes */
+    if (!mem_merge && madvise(start, end - start, MADV_REMOVE) == 0)
+        return ram_discard_mark(ram, ram + (end - start));
+#endif
+
+    if (madvise(start, end - start, MADV_DONTNEED) < 0)
+        return 0;
+
+    /* private anonymous pages now read as zeroes, without allocating
+       memory. Pages mapped from a file revert to the file content, and
+       are not marked. */
+    zero_start = ram;
+    for (p = start; p < end; p += qemu_real_host_page_size) {
+        ram_addr_t addr = ram + (p - start);
+
+        if (!host_page_is_zero(p)) {
+            freed += ram_discard_mark(zero_start, addr);
+            zero_start = addr + qemu_real_host_page_size;
+        }
+    }
+    freed += ram_discard_mark(zero_start, ram + (end - start));
+    return freed;
+}
+#endif
+
+ram_addr_t cpu_physical_memory_discard(target_phys_addr_t addr,
+                                       target_phys_addr_t len)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    target_phys_addr_t end = addr + len;
+    ram_addr_t run_ram = 0, run_len = 0, freed = 0;
+    uint8_t *run_host = NULL;
+
+    if (end < addr)
+        return 0;
+
+    /* gather the largest runs of RAM contiguous in host memory, since
+       only whole host pages can be released */
+    for (addr = TARGET_PAGE_ALIGN(addr); addr + TARGET_PAGE_SIZE <= end;
+         addr += TARGET_PAGE_SIZE) {
+        ram_addr_t pd = cpu_get_physical_page_desc(addr);
+        ram_addr_t ram = pd & TARGET_PAGE_MASK;
+        uint8_t *host;
+
+        if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
+            if (run_len)
+                freed += ram_discard_run(run_ram, run_len);
+            run_len = 0;
+            continue;
+        }
+
+        host = qemu_get_ram_ptr(ram);
+        if (run_len && ram == run_ram + run_len &&
+            host == run_host + run_len) {
+            run_len += TARGET_PAGE_SIZE;
+        } else {
+            if (run_len)
+                freed += ram_discard_run(run_ram, run_len);
+            run_ram = ram;
+            run_host = host;
+            run_len = TARGET_PAGE_SIZE;
+        }
+    }
+    if (run_len)
+        freed += ram_discard_run(run_ram, run_len);
+    return freed;
+#endif
+}
+
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
    With the exception of the softmmu code in this file, this should
    only be used for local memory (e.g. video ram) that the device owns,
@@ -2676,11 +3486,12 @@ static void notdirty_mem_writeb(void *opaque, target_phys_addr_t ram_addr,
     }
     stb_p(qemu_get_ram_ptr(ram_addr), val);
     dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] = dirty_flags;
+    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
     if (dirty_flags == 0xff)
-        tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
+        tlb_set_dirty(cpu_single_env, ram_addr,
+                      cpu_single_env->mem_io_vaddr);
 }
 
 static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
@@ -2696,11 +3507,12 @@ static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
     }
     stw_p(qemu_get_ram_ptr(ram_addr), val);
     dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] = dirty_flags;
+    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
     if (dirty_flags == 0xff)
-        tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
+        tlb_set_dirty(cpu_single_env, ram_addr,
+                      cpu_single_env->mem_io_vaddr);
 }
 
 static void notdirty_mem_writel(void *opaque, target_phys_addr_t ram_addr,
@@ -2716,11 +3528,12 @@ static void notdirty_mem_writel(void *opaque, target_phys_addr_t ram_addr,
     }
     stl_p(qemu_get_ram_ptr(ram_addr), val);
     dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] = dirty_flags;
+    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
     if (dirty_flags == 0xff)
-        tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
+        tlb_set_dirty(cpu_single_env, ram_addr,
+                      cpu_single_env->mem_io_vaddr);
 }
 
 static CPUReadMemoryFunc *error_mem_read[3] = {
@@ -3051,6 +3864,72 @@ void cpu_unregister_io_memory(int io_table_address)
     }
     io_mem_opaque[io_index] = NULL;
     io_mem_used[io_index] = 0;
+    if (io_mem_dispatch[io_index].posted_pending)
+        cpu_io_memory_flush_posted();
+    memset(&io_mem_dispatch[io_index], 0, sizeof(IOMemDispatch));
+}
+
+void cpu_io_memory_set_shadow(int io_table_address, const uint32_t *regs,
+                              uint32_t mask)
+{
+    IOMemDispatch *d = &io_mem_dispatch[io_table_address >> IO_MEM_SHIFT];
+
+    d->shadow = regs;
+    d->shadow_mask = mask;
+}
+
+void cpu_io_memory_set_posted(int io_table_address, uint32_t mask)
+{
+    io_mem_dispatch[io_table_address >> IO_MEM_SHIFT].posted_mask = mask;
+}
+
+void cpu_io_memory_get_stats(int io_table_address, IOMemStats *stats)
+{
+    *stats = io_mem_dispatch[io_table_address >> IO_MEM_SHIFT].stats;
+}
+
+/* Queue of posted writes, shared by all regions so that the writes to
+   different devices are also handled in order. */
+#define IO_MEM_POSTED_MAX 256
+
+typedef struct IOMemPostedWrite {
+    int io_index;
+    int shift;
+    target_phys_addr_t addr;
+    uint32_t val;
+} IOMemPostedWrite;
+
+static IOMemPostedWrite io_mem_posted[IO_MEM_POSTED_MAX];
+static int io_mem_posted_count;
+
+void cpu_io_memory_post_write(int io_index, target_phys_addr_t addr,
+                              uint32_t val, int shift)
+{
+    IOMemPostedWrite *w;
+
+    if (io_mem_posted_count == IO_MEM_POSTED_MAX)
+        cpu_io_memory_flush_posted();
+    w = &io_mem_posted[io_mem_posted_count++];
+    w->io_index = io_index;
+    w->shift = shift;
+    w->addr = addr;
+    w->val = val;
+    io_mem_dispatch[io_index].posted_pending++;
+    io_mem_dispatch[io_index].stats.posted_writes++;
+}
+
+void cpu_io_memory_flush_posted(void)
+{
+    int i;
+
+    for (i = 0; i < io_mem_posted_count; i++) {
+        IOMemPostedWrite *w = &io_mem_posted[i];
+
+        io_mem_dispatch[w->io_index].posted_pending--;
+        io_mem_write[w->io_index][w->shift](io_mem_opaque[w->io_index],
+                                            w->addr, w->val);
+    }
+    io_mem_posted_count = 0;
 }
 
 static void io_mem_init(void)
@@ -3168,8 +4047,8 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     /* invalidate code */
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
-                    phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
-                        (0xff & ~CODE_DIRTY_FLAG);
+                    cpu_physical_memory_set_dirty_flags(
+                        addr1, (0xff & ~CODE_DIRTY_FLAG));
                 }
             }
         } else {
@@ -3375,8 +4254,8 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                     /* invalidate code */
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
-                    phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
-                        (0xff & ~CODE_DIRTY_FLAG);
+                    cpu_physical_memory_set_dirty_flags(
+                        addr1, (0xff & ~CODE_DIRTY_FLAG));
                 }
                 addr1 += l;
                 access_len -= l;
@@ -3392,6 +4271,194 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
     cpu_notify_map_clients();
 }
 
+static void cpu_dma_init(CPUDMA *dma)
+{
+    dma->len = 0;
+    dma->nb_spans = 0;
+    dma->max_spans = CPU_DMA_INLINE_SPANS;
+    dma->spans = dma->inline_spans;
+}
+
+/* Append a page to the mapping, merging it with the previous span when
+   they are contiguous. */
+static void cpu_dma_add(CPUDMA *dma, uint8_t *host, ram_addr_t ram_addr,
+                        target_phys_addr_t phys, uint32_t len)
+{
+    CPUDMASpan *span;
+
+    dma->len += len;
+    if (dma->nb_spans > 0) {
+        span = dma->spans + dma->nb_spans - 1;
+        if (host != NULL && span->host + span->len == host &&
+            span->ram_addr + span->len == ram_addr) {
+            span->len += len;
+            return;
+        }
+        if (host == NULL && span->host == NULL &&
+            span->phys + span->len == phys) {
+            span->len += len;
+            return;
+        }
+    }
+    if (dma->nb_spans == dma->max_spans) {
+        CPUDMASpan *spans = qemu_malloc(2 * dma->max_spans * sizeof(*spans));
+
+        memcpy(spans, dma->spans, dma->nb_spans * sizeof(*spans));
+        if (dma->spans != dma->inline_spans)
+            qemu_free(dma->spans);
+        dma->spans = spans;
+        dma->max_spans *= 2;
+    }
+    span = dma->spans + dma->nb_spans++;
+    span->host = host;
+    span->ram_addr = ram_addr;
+    span->phys = phys;
+    span->len = len;
+}
+
+static void cpu_dma_add_phys(CPUDMA *dma, target_phys_addr_t addr,
+                             uint32_t len)
+{
+    PhysPageDesc *p = phys_page_find(addr >> TARGET_PAGE_BITS);
+    unsigned long pd = p ? p->phys_offset : IO_MEM_UNASSIGNED;
+    ram_addr_t ram_addr;
+
+    if ((pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+        ram_addr = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
+        cpu_dma_add(dma, qemu_get_ram_ptr(ram_addr), ram_addr, addr, len);
+    } else {
+        cpu_dma_add(dma, NULL, 0, addr, len);
+    }
+}
+
+uint32_t cpu_dma_map_virt(CPUDMA *dma, CPUState *env, target_ulong addr,
+                          uint32_t len)
+{
+    int mmu_idx = cpu_mmu_index(env);
+    target_phys_addr_t phys;
+    target_ulong page;
+    unsigned long iotlb;
+    uint32_t l;
+    int index;
+
+    cpu_dma_init(dma);
+    while (len > 0) {
+        page = addr & TARGET_PAGE_MASK;
+        l = (page + TARGET_PAGE_SIZE) - addr;
+        if (l > len)
+            l = len;
+        /* RAM pages present in the TLB need no page table walk */
+        index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+        iotlb = env->iotlb[mmu_idx][index] + page;
+        if (env->tlb_table[mmu_idx][index].addr_read == page &&
+            (iotlb & ~TARGET_PAGE_MASK) == IO_MEM_NOTDIRTY) {
+            cpu_dma_add(dma,
+                        (uint8_t *)(long)(env->tlb_table[mmu_idx][index].addend + addr),
+                        (iotlb & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK),
+                        0, l);
+        } else {
+            phys = cpu_get_phys_page_debug(env, page);
+            if (phys == -1)
+                break;
+            cpu_dma_add_phys(dma, phys + (addr & ~TARGET_PAGE_MASK), l);
+        }
+        len -= l;
+        addr += l;
+    }
+    return dma->len;
+}
+
+uint32_t cpu_dma_map_phys(CPUDMA *dma, target_phys_addr_t addr, uint32_t len)
+{
+    target_phys_addr_t page;
+    uint32_t l;
+
+    cpu_dma_init(dma);
+    while (len > 0) {
+        page = addr & TARGET_PAGE_MASK;
+        l = (page + TARGET_PAGE_SIZE) - addr;
+        if (l > len)
+            l = len;
+        cpu_dma_add_phys(dma, addr, l);
+        len -= l;
+        addr += l;
+    }
+    return dma->len;
+}
+
+/* Same as cpu_physical_memory_unmap() after a write */
+static void cpu_dma_set_dirty(ram_addr_t addr, uint32_t len)
+{
+    ram_addr_t end = addr + len, next;
+
+    while (addr < end) {
+        next = (addr & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+        if (next > end)
+            next = end;
+        if (!cpu_physical_memory_is_dirty(addr)) {
+            /* invalidate code */
+            tb_invalidate_phys_page_range(addr, next, 0);
+            /* set dirty bit */
+            cpu_physical_memory_set_dirty_flags(
+                addr, (0xff & ~CODE_DIRTY_FLAG));
+        }
+        addr = next;
+    }
+}
+
+int cpu_dma_rw(CPUDMA *dma, uint32_t offset, uint8_t *buf, uint32_t len,
+               int is_write)
+{
+    CPUDMASpan *span = dma->spans;
+    uint32_t l;
+
+    if (offset > dma->len || len > dma->len - offset)
+        return -1;
+    if (len == 0)
+        return 0;
+    while (offset >= span->len) {
+        offset -= span->len;
+        span++;
+    }
+    while (len > 0) {
+        l = span->len - offset;
+        if (l > len)
+            l = len;
+        if (span->host == NULL) {
+            cpu_physical_memory_rw(span->phys + offset, buf, l, is_write);
+        } else if (is_write) {
+            memcpy(span->host + offset, buf, l);
+            cpu_dma_set_dirty(span->ram_addr + offset, l);
+        } else {
+            memcpy(buf, span->host + offset, l);
+        }
+        buf += l;
+        len -= l;
+        offset = 0;
+        span++;
+    }
+    return 0;
+}
+
+void cpu_dma_unmap(CPUDMA *dma)
+{
+    if (dma->spans != dma->inline_spans)
+        qemu_free(dma->spans);
+    cpu_dma_init(dma);
+}
+
+int cpu_dma_memory_rw(CPUState *env, target_ulong addr,
+                      uint8_t *buf, int len, int is_write)
+{
+    CPUDMA dma;
+    int ret = -1;
+
+    if (cpu_dma_map_virt(&dma, env, addr, len) == (uint32_t)len)
+        ret = cpu_dma_rw(&dma, 0, buf, len, is_write);
+    cpu_dma_unmap(&dma);
+    return ret;
+}
+
 /* warning: addr must be aligned */
 uint32_t ldl_phys(target_phys_addr_t addr)
 {
@@ -3510,8 +4577,8 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
                 /* invalidate code */
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
-                phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
-                    (0xff & ~CODE_DIRTY_FLAG);
+                cpu_physical_memory_set_dirty_flags(
+                    addr1, (0xff & ~CODE_DIRTY_FLAG));
             }
         }
     }
@@ -3579,8 +4646,8 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
             /* invalidate code */
             tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
             /* set dirty bit */
-            phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
-                (0xff & ~CODE_DIRTY_FLAG);
+            cpu_physical_memory_set_dirty_flags(
+                addr1, (0xff & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -3748,6 +4815,17 @@ void dump_exec_info(FILE *f,
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB size            %d entries\n",
+                first_cpu ? first_cpu->tlb_size : 1 << cpu_tlb_bits);
+    cpu_fprintf(f, "TLB miss count      %d (%d victim hits, %d%%)\n",
+                tlb_miss_count, tlb_victim_hit_count,
+                tlb_miss_count ?
+                (tlb_victim_hit_count * 100) / tlb_miss_count : 0);
+    cpu_fprintf(f, "TLB fill count      %d\n", tlb_fill_count);
+    cpu_fprintf(f, "ASID switch count   %d (%d restored, %d%%)\n",
+                tlb_asid_switch_count, tlb_asid_restore_count,
+                tlb_asid_switch_count ?
+                (tlb_asid_restore_count * 100) / tlb_asid_switch_count : 0);
     tcg_dump_info(f, cpu_fprintf);
 }
 
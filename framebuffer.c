@@ -13,13 +13,22 @@
 #include <memory.h>
 #include <stdlib.h>
 
+/* client fields, these correspond to code that waits for updates before displaying them */
 typedef struct {
-    /* client fields, these correspond to code that waits for updates before displaying them */
-    /* at the moment, only one client is supported */
     void*                        fb_opaque;
     QFrameBufferUpdateFunc       fb_update;
     QFrameBufferRotateFunc       fb_rotate;
     QFrameBufferDoneFunc         fb_done;
+} QFrameBufferClient;
+
+#define  MAX_FRAME_BUFFER_CLIENTS  4
+
+typedef struct {
+    QFrameBufferClient           clients[ MAX_FRAME_BUFFER_CLIENTS ];
+    int                          num_clients;
+
+    /* the pixel buffer allocated by qframebuffer_init() */
+    void*                        own_pixels;
 
     void*                        pr_opaque;
     QFrameBufferCheckUpdateFunc  pr_check;
@@ -72,6 +81,8 @@ qframebuffer_init( QFrameBuffer*       qfbuff,
         return -1;
     }
 
+    ((QFrameBufferExtra*)qfbuff->extra)->own_pixels = qfbuff->pixels;
+
     qfbuff->width  = width;
     qfbuff->height = height;
     qfbuff->pitch  = pitch;
@@ -107,13 +118,26 @@ qframebuffer_set_mm( QFrameBuffer*   qfbuff,
     qfbuff->phys_height_mm = height_mm;
 }
 
+void
+qframebuffer_set_pixels( QFrameBuffer*  qfbuff, void*  pixels )
+{
+    QFrameBufferExtra*  extra = qfbuff->extra;
+
+    qfbuff->pixels = pixels ? pixels : extra->own_pixels;
+}
+
 void
 qframebuffer_update( QFrameBuffer*  qfbuff, int  x, int  y, int  w, int  h )
 {
     QFrameBufferExtra*  extra = qfbuff->extra;
+    int                 nn;
+
+    for (nn = 0; nn < extra->num_clients; nn++) {
+        QFrameBufferClient*  client = &extra->clients[nn];
 
-    if (extra->fb_update)
-        extra->fb_update( extra->fb_opaque, x, y, w, h );
+        if (client->fb_update)
+            client->fb_update( client->fb_opaque, x, y, w, h );
+    }
 }
 
 
@@ -124,12 +148,17 @@ qframebuffer_add_client( QFrameBuffer*           qfbuff,
                          QFrameBufferRotateFunc  fb_rotate,
                          QFrameBufferDoneFunc    fb_done )
 {
-    QFrameBufferExtra*  extra = qfbuff->extra;
+    QFrameBufferExtra*   extra = qfbuff->extra;
+    QFrameBufferClient*  client;
+
+    if (extra->num_clients >= MAX_FRAME_BUFFER_CLIENTS)
+        return;
 
-    extra->fb_opaque = fb_opaque;
-    extra->fb_update = fb_update;
-    extra->fb_rotate = fb_rotate;
-    extra->fb_done   = fb_done;
+    client = &extra->clients[ extra->num_clients++ ];
+    client->fb_opaque = fb_opaque;
+    client->fb_update = fb_update;
+    client->fb_rotate = fb_rotate;
+    client->fb_done   = fb_done;
 }
 
 void
@@ -152,6 +181,7 @@ void
 qframebuffer_rotate( QFrameBuffer*  qfbuff, int  rotation )
 {
     QFrameBufferExtra*  extra = qfbuff->extra;
+    int                 nn;
 
     if ((rotation ^ qfbuff->rotation) & 1) {
         /* swap width and height if new rotation requires it */
@@ -166,8 +196,12 @@ qframebuffer_rotate( QFrameBuffer*  qfbuff, int  rotation )
     }
     qfbuff->rotation = rotation;
 
-    if (extra->fb_rotate)
-        extra->fb_rotate( extra->fb_opaque, rotation );
+    for (nn = 0; nn < extra->num_clients; nn++) {
+        QFrameBufferClient*  client = &extra->clients[nn];
+
+        if (client->fb_rotate)
+            client->fb_rotate( client->fb_opaque, rotation );
+    }
 }
 
 
@@ -177,14 +211,20 @@ qframebuffer_done( QFrameBuffer*   qfbuff )
     QFrameBufferExtra*  extra = qfbuff->extra;
 
     if (extra) {
+        int  nn;
+
         if (extra->pr_detach)
             extra->pr_detach( extra->pr_opaque );
 
-        if (extra->fb_done)
-            extra->fb_done( extra->fb_opaque );
+        for (nn = 0; nn < extra->num_clients; nn++) {
+            QFrameBufferClient*  client = &extra->clients[nn];
+
+            if (client->fb_done)
+                client->fb_done( client->fb_opaque );
+        }
+        free( extra->own_pixels );
     }
 
-    free( qfbuff->pixels );
     free( qfbuff->extra );
     memset( qfbuff, 0, sizeof(*qfbuff) );
 }
@@ -32,6 +32,11 @@
  * phys_width_mm and phys_height_mm are physical dimensions expressed
  * in millimeters
  *
+ * 'pixels' normally points to a buffer allocated by qframebuffer_init(),
+ * but a Producer can also make it point directly to the emulated VRAM
+ * with qframebuffer_set_pixels(), to avoid copying each frame. Clients
+ * must thus always read it from the QFrameBuffer instead of caching it.
+ *
  * More about the client/producer relationships below.
  */
 typedef struct QFrameBuffer   QFrameBuffer;
@@ -90,6 +95,15 @@ qframebuffer_set_mm( QFrameBuffer*   qfbuff,
                      int             width_mm,
                      int             height_mm );
 
+/* make the framebuffer's pixels point to an external buffer, which must
+ * use the framebuffer's pitch and format, and remain valid until the next
+ * call. a NULL value restores the internal pixel buffer. this is called
+ * by a Producer, clients are told about the new content through
+ * qframebuffer_update() as usual.
+ */
+extern void
+qframebuffer_set_pixels( QFrameBuffer*  qfbuff, void*  pixels );
+
 /* the Client::Update method is called to instruct a client that a given
  * rectangle of the framebuffer pixels was updated and needs to be
  * redrawn.
@@ -112,9 +126,9 @@ typedef void (*QFrameBufferRotateFunc)( void*  opaque, int  rotation );
 typedef void (*QFrameBufferDoneFunc)  ( void*  opaque );
 
 /* add one client to a given framebuffer.
- * the current implementation only allows one client per frame-buffer,
- * but we could allow more for various reasons (e.g. displaying the
- * framebuffer + dispatching it through VNC at the same time)
+ * several clients can be added to the same framebuffer (e.g. to display
+ * it and capture its frames at the same time), each one receives all
+ * updates and only reads the rectangles it needs from the pixel buffer.
  */
 extern void
 qframebuffer_add_client( QFrameBuffer*           qfbuff,
@@ -0,0 +1,631 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "framecapture.h"
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* the log file is written by a separate thread when the host supports
+ * it, so that a slow disk never delays the emulation */
+#ifdef __linux__
+#include "qemu-thread.h"
+#define  FRAME_LOG_THREAD  1
+#else
+#define  FRAME_LOG_THREAD  0
+#endif
+
+/* make sure that readers of the shared memory see the writes in order */
+#define  FRAME_BARRIER()  __sync_synchronize()
+
+/** SHARED MEMORY RING
+ **/
+
+#define  FRAME_SHM_MAGIC    0x4d524641   /* 'AFRM' */
+#define  FRAME_SHM_VERSION  1
+#define  FRAME_SHM_SLOTS    8
+#define  FRAME_SHM_ALIGN    64
+
+typedef struct {
+    uint32_t           magic;
+    uint32_t           version;
+    uint32_t           header_size;  /* offset of the first slot */
+    uint32_t           slot_size;    /* offset between two slots */
+    uint32_t           num_slots;
+    uint32_t           format;       /* a QFrameBufferFormat */
+    uint32_t           max_size;     /* max bytes of pixels in a slot */
+    uint32_t           reserved;
+    volatile uint64_t  frame_count;  /* number of complete frames */
+} FrameShmHeader;
+
+typedef struct {
+    volatile uint64_t  sequence;   /* odd while the slot is written */
+    uint64_t           frame;      /* frame number, starting from 0 */
+    uint64_t           timestamp;  /* virtual time in nanoseconds */
+    uint32_t           width;
+    uint32_t           height;
+    uint32_t           pitch;
+    uint32_t           rotation;
+    uint32_t           dirty_y;    /* rows changed since the previous frame */
+    uint32_t           dirty_h;
+} FrameShmSlot;
+
+/** LOG FILE
+ **/
+
+#define  FRAME_LOG_MAGIC    0x474c4641   /* 'AFLG' */
+#define  FRAME_LOG_VERSION  1
+
+/* frames are dropped from the log when more than this amount of data
+ * is waiting to be written to disk */
+#define  FRAME_LOG_MAX_PENDING  (32*1024*1024)
+
+typedef struct {
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  format;
+    uint32_t  reserved;
+} FrameLogHeader;
+
+#define  FRAME_LOG_KEY  (1 << 0)  /* all rows of the frame follow */
+
+typedef struct {
+    uint32_t  size;       /* bytes of runs following this record */
+    uint16_t  width;
+    uint16_t  height;
+    uint16_t  flags;
+    uint16_t  rotation;
+    uint32_t  num_runs;
+    uint64_t  timestamp;  /* virtual time in nanoseconds */
+} FrameLogRecord;
+
+/* each run is followed by 'w' pixels */
+typedef struct {
+    uint16_t  y;
+    uint16_t  x;
+    uint16_t  w;
+} FrameLogRun;
+
+typedef struct FrameLogBuffer {
+    struct FrameLogBuffer*  next;
+    int                     size;
+    uint8_t                 data[1];
+} FrameLogBuffer;
+
+/** CAPTURE STATE
+ **/
+
+typedef struct {
+    QFrameBuffer*       qfbuff;
+    int                 active;
+    QFrameCaptureStats  stats;
+
+    /* shared memory ring */
+    char*               shm_name;
+    uint8_t*            shm_base;
+    size_t              shm_size;
+    int                 shm_slot_size;
+    int                 shm_max_size;
+    int                 shm_stale_y  [ FRAME_SHM_SLOTS ];  /* rows to copy */
+    int                 shm_stale_end[ FRAME_SHM_SLOTS ];  /* in each slot */
+
+    /* log file */
+    FILE*               log_file;
+    uint8_t*            log_frame;     /* last frame sent to the log */
+    int                 log_need_key;
+#if FRAME_LOG_THREAD
+    QemuThread          log_thread;
+    QemuMutex           log_lock;
+    QemuCond            log_cond;
+    FrameLogBuffer*     log_head;
+    FrameLogBuffer**    log_tail;
+    int                 log_pending;   /* bytes waiting in the queue */
+    int                 log_quit;
+    int                 log_done;
+#endif
+} FrameCapture;
+
+static FrameCapture  _capture[1];
+static QFrameBuffer* _capture_client;  /* framebuffer we're a client of */
+static int           _capture_init;
+
+static void
+frame_capture_atexit( void )
+{
+    qframecapture_stop();
+}
+
+static int
+frame_size( QFrameBuffer*  qfbuff )
+{
+    return qfbuff->pitch * qfbuff->height;
+}
+
+/* called when all pixels must be sent again */
+static void
+frame_capture_reset( FrameCapture*  c )
+{
+    int  nn;
+
+    for (nn = 0; nn < FRAME_SHM_SLOTS; nn++) {
+        c->shm_stale_y[nn]   = 0;
+        c->shm_stale_end[nn] = c->qfbuff->height;
+    }
+    c->log_need_key = 1;
+}
+
+/** SHARED MEMORY RING IMPLEMENTATION
+ **/
+
+#ifndef _WIN32
+static int
+frame_shm_open( FrameCapture*  c, const char*  name )
+{
+    FrameShmHeader*  h;
+    int              fd;
+
+    /* the frame dimensions can be swapped, but their product is fixed */
+    c->shm_max_size  = frame_size(c->qfbuff);
+    c->shm_slot_size = (FRAME_SHM_ALIGN + c->shm_max_size + FRAME_SHM_ALIGN-1) &
+                       ~(FRAME_SHM_ALIGN-1);
+    c->shm_size      = FRAME_SHM_ALIGN + FRAME_SHM_SLOTS*c->shm_slot_size;
+
+    fd = shm_open( name, O_RDWR | O_CREAT | O_TRUNC, 0600 );
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate( fd, c->shm_size ) < 0) {
+        int  err = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = err;
+        return -1;
+    }
+
+    c->shm_base = mmap( NULL, c->shm_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0 );
+    close(fd);
+    if (c->shm_base == MAP_FAILED) {
+        int  err = errno;
+        c->shm_base = NULL;
+        shm_unlink(name);
+        errno = err;
+        return -1;
+    }
+    c->shm_name = qemu_strdup(name);
+
+    h = (FrameShmHeader*) c->shm_base;
+    h->header_size = FRAME_SHM_ALIGN;
+    h->slot_size   = c->shm_slot_size;
+    h->num_slots   = FRAME_SHM_SLOTS;
+    h->format      = c->qfbuff->format;
+    h->max_size    = c->shm_max_size;
+    h->frame_count = 0;
+    h->version     = FRAME_SHM_VERSION;
+    FRAME_BARRIER();
+    h->magic       = FRAME_SHM_MAGIC;
+    return 0;
+}
+
+static void
+frame_shm_close( FrameCapture*  c )
+{
+    if (c->shm_base != NULL) {
+        munmap( c->shm_base, c->shm_size );
+        c->shm_base = NULL;
+    }
+    if (c->shm_name != NULL) {
+        shm_unlink( c->shm_name );
+        qemu_free( c->shm_name );
+        c->shm_name = NULL;
+    }
+}
+#else /* _WIN32 */
+static int
+frame_shm_open( FrameCapture*  c, const char*  name )
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static void
+frame_shm_close( FrameCapture*  c )
+{
+}
+#endif /* _WIN32 */
+
+/* write a new frame in the next slot of the ring. only the rows that
+ * changed since the slot was last written are copied */
+static void
+frame_shm_write( FrameCapture*  c, uint64_t  timestamp, int  y, int  h )
+{
+    QFrameBuffer*    q     = c->qfbuff;
+    FrameShmHeader*  hdr   = (FrameShmHeader*) c->shm_base;
+    uint64_t         frame = hdr->frame_count;
+    int              index = (int)(frame % FRAME_SHM_SLOTS);
+    uint8_t*         base  = c->shm_base + FRAME_SHM_ALIGN + index*c->shm_slot_size;
+    FrameShmSlot*    slot  = (FrameShmSlot*) base;
+    int              nn, first, end;
+
+    for (nn = 0; nn < FRAME_SHM_SLOTS; nn++) {
+        if (c->shm_stale_y[nn] >= c->shm_stale_end[nn]) {
+            c->shm_stale_y[nn]   = y;
+            c->shm_stale_end[nn] = y + h;
+        } else {
+            if (c->shm_stale_y[nn] > y)
+                c->shm_stale_y[nn] = y;
+            if (c->shm_stale_end[nn] < y + h)
+                c->shm_stale_end[nn] = y + h;
+        }
+    }
+    first = c->shm_stale_y[index];
+    end   = c->shm_stale_end[index];
+    c->shm_stale_y[index] = c->shm_stale_end[index] = 0;
+
+    slot->sequence = 2*frame + 1;
+    FRAME_BARRIER();
+
+    if (end > first) {
+        memcpy( base + FRAME_SHM_ALIGN + first*q->pitch,
+                (uint8_t*)q->pixels + first*q->pitch,
+                (end - first)*q->pitch );
+        c->stats.pixels += (uint64_t)(end - first) * q->width;
+    }
+    slot->frame     = frame;
+    slot->timestamp = timestamp;
+    slot->width     = q->width;
+    slot->height    = q->height;
+    slot->pitch     = q->pitch;
+    slot->rotation  = q->rotation;
+    slot->dirty_y   = y;
+    slot->dirty_h   = h;
+
+    FRAME_BARRIER();
+    slot->sequence   = 2*frame + 2;
+    hdr->frame_count = frame + 1;
+}
+
+/** LOG FILE IMPLEMENTATION
+ **/
+
+#if FRAME_LOG_THREAD
+static void*
+frame_log_thread( void*  opaque )
+{
+    FrameCapture*  c = opaque;
+
+    qemu_mutex_lock( &c->log_lock );
+    for (;;) {
+        FrameLogBuffer*  buf;
+
+        while (c->log_head == NULL && !c->log_quit)
+            qemu_cond_wait( &c->log_cond, &c->log_lock );
+
+        buf = c->log_head;
+        if (buf == NULL)  /* quit, and everything was written */
+            break;
+
+        c->log_head = buf->next;
+        if (c->log_head == NULL)
+            c->log_tail = &c->log_head;
+        c->log_pending -= buf->size;
+        qemu_mutex_unlock( &c->log_lock );
+
+        fwrite( buf->data, buf->size, 1, c->log_file );
+        qemu_free( buf );
+
+        qemu_mutex_lock( &c->log_lock );
+        if (c->log_head == NULL)
+            fflush( c->log_file );
+    }
+    c->log_done = 1;
+    qemu_cond_broadcast( &c->log_cond );
+    qemu_mutex_unlock( &c->log_lock );
+    return NULL;
+}
+#endif /* FRAME_LOG_THREAD */
+
+static int
+frame_log_open( FrameCapture*  c, const char*  path )
+{
+    FrameLogHeader  h;
+
+    c->log_file = fopen( path, "wb" );
+    if (c->log_file == NULL)
+        return -1;
+
+    h.magic    = FRAME_LOG_MAGIC;
+    h.version  = FRAME_LOG_VERSION;
+    h.format   = c->qfbuff->format;
+    h.reserved = 0;
+
+    if (fwrite( &h, sizeof(h), 1, c->log_file ) != 1) {
+        int  err = errno;
+        fclose( c->log_file );
+        c->log_file = NULL;
+        errno = err;
+        return -1;
+    }
+
+    c->log_frame = qemu_mallocz( frame_size(c->qfbuff) );
+
+#if FRAME_LOG_THREAD
+    qemu_mutex_init( &c->log_lock );
+    qemu_cond_init( &c->log_cond );
+    c->log_head    = NULL;
+    c->log_tail    = &c->log_head;
+    c->log_pending = 0;
+    c->log_quit    = 0;
+    c->log_done    = 0;
+    qemu_thread_create( &c->log_thread, frame_log_thread, c );
+#endif
+    return 0;
+}
+
+static void
+frame_log_close( FrameCapture*  c )
+{
+    if (c->log_file == NULL)
+        return;
+
+#if FRAME_LOG_THREAD
+    /* wait for the thread to write everything */
+    qemu_mutex_lock( &c->log_lock );
+    c->log_quit = 1;
+    qemu_cond_broadcast( &c->log_cond );
+    while (!c->log_done)
+        qemu_cond_wait( &c->log_cond, &c->log_lock );
+    qemu_mutex_unlock( &c->log_lock );
+#endif
+
+    fclose( c->log_file );
+    c->log_file = NULL;
+
+    qemu_free( c->log_frame );
+    c->log_frame = NULL;
+}
+
+/* send a record to the log file, without waiting for the disk */
+static void
+frame_log_send( FrameCapture*  c, FrameLogBuffer*  buf )
+{
+    c->stats.log_bytes += buf->size;
+#if FRAME_LOG_THREAD
+    buf->next = NULL;
+    qemu_mutex_lock( &c->log_lock );
+    *c->log_tail    = buf;
+    c->log_tail     = &buf->next;
+    c->log_pending += buf->size;
+    qemu_cond_broadcast( &c->log_cond );
+    qemu_mutex_unlock( &c->log_lock );
+#else
+    fwrite( buf->data, buf->size, 1, c->log_file );
+    qemu_free( buf );
+#endif
+}
+
+/* return 1 if too much data is waiting to be written */
+static int
+frame_log_is_full( FrameCapture*  c )
+{
+#if FRAME_LOG_THREAD
+    int  full;
+
+    qemu_mutex_lock( &c->log_lock );
+    full = (c->log_pending >= FRAME_LOG_MAX_PENDING);
+    qemu_mutex_unlock( &c->log_lock );
+    return full;
+#else
+    return 0;
+#endif
+}
+
+/* log the pixels that changed in rows [y, y+h) since the previous frame.
+ * each changed row is sent as a single run that covers all its changed
+ * pixels. */
+static void
+frame_log_write( FrameCapture*  c, uint64_t  timestamp, int  y, int  h )
+{
+    QFrameBuffer*    q     = c->qfbuff;
+    int              width = q->width;
+    int              key   = c->log_need_key;
+    FrameLogBuffer*  buf;
+    FrameLogRecord*  rec;
+    uint8_t*         out;
+    int              yy;
+
+    if (frame_log_is_full(c)) {
+        c->stats.log_dropped += 1;
+        c->log_need_key = 1;
+        return;
+    }
+
+    if (key) {
+        y = 0;
+        h = q->height;
+    }
+
+    buf = qemu_malloc( sizeof(*buf) + sizeof(*rec) +
+                       h*(sizeof(FrameLogRun) + width*2) );
+    rec = (FrameLogRecord*) buf->data;
+    out = (uint8_t*)(rec + 1);
+
+    rec->width     = (uint16_t) width;
+    rec->height    = (uint16_t) q->height;
+    rec->flags     = key ? FRAME_LOG_KEY : 0;
+    rec->rotation  = (uint16_t) q->rotation;
+    rec->num_runs  = 0;
+    rec->timestamp = timestamp;
+
+    for (yy = y; yy < y + h; yy++) {
+        const uint16_t*  src  = (const uint16_t*)((uint8_t*)q->pixels + yy*q->pitch);
+        uint16_t*        prev = (uint16_t*)(c->log_frame + yy*q->pitch);
+        int              x0 = 0, x1 = width;
+        FrameLogRun      run;
+
+        if (!key) {
+            while (x0 < width && src[x0] == prev[x0])
+                x0++;
+            if (x0 == width)
+                continue;
+            while (src[x1-1] == prev[x1-1])
+                x1--;
+        }
+        memcpy( prev + x0, src + x0, (x1 - x0)*2 );
+
+        run.y = (uint16_t) yy;
+        run.x = (uint16_t) x0;
+        run.w = (uint16_t)(x1 - x0);
+        memcpy( out, &run, sizeof(run) );
+        memcpy( out + sizeof(run), src + x0, run.w*2 );
+        out += sizeof(run) + run.w*2;
+        rec->num_runs += 1;
+    }
+    c->stats.pixels += (uint64_t)h * width;
+
+    if (rec->num_runs == 0) {
+        qemu_free( buf );
+        return;
+    }
+
+    rec->size = (uint32_t)(out - (uint8_t*)(rec + 1));
+    buf->size = (int)(out - buf->data);
+    c->log_need_key = 0;
+
+    frame_log_send( c, buf );
+}
+
+/** FRAMEBUFFER CLIENT
+ **/
+
+static void
+frame_capture_update( void*  opaque, int  x, int  y, int  w, int  h )
+{
+    FrameCapture*  c = opaque;
+    int64_t        start;
+    uint64_t       timestamp;
+
+    if (!c->active)
+        return;
+
+    if (y < 0) {
+        h += y;
+        y  = 0;
+    }
+    if (y + h > c->qfbuff->height)
+        h = c->qfbuff->height - y;
+    if (h <= 0)
+        return;
+
+    start     = qemu_get_clock_ns( rt_clock );
+    timestamp = qemu_get_clock_ns( vm_clock );
+
+    if (c->shm_base != NULL)
+        frame_shm_write( c, timestamp, y, h );
+
+    if (c->log_file != NULL)
+        frame_log_write( c, timestamp, y, h );
+
+    c->stats.frames  += 1;
+    c->stats.time_ns += qemu_get_clock_ns( rt_clock ) - start;
+}
+
+static void
+frame_capture_rotate( void*  opaque, int  rotation )
+{
+    FrameCapture*  c = opaque;
+
+    if (c->active)
+        frame_capture_reset( c );
+}
+
+static void
+frame_capture_done( void*  opaque )
+{
+    FrameCapture*  c = opaque;
+
+    if (c->active)
+        qframecapture_stop();
+
+    _capture_client = NULL;
+}
+
+int
+qframecapture_start( QFrameBuffer*  qfbuff,
+                     const char*    shm_name,
+                     const char*    log_path )
+{
+    FrameCapture*  c = _capture;
+
+    if (!_capture_init) {
+        _capture_init = 1;
+        atexit( frame_capture_atexit );
+    }
+
+    qframecapture_stop();
+
+    if (qfbuff == NULL || qfbuff->format != QFRAME_BUFFER_RGB565) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset( &c->stats, 0, sizeof(c->stats) );
+    c->qfbuff = qfbuff;
+    frame_capture_reset( c );
+
+    if (shm_name != NULL && frame_shm_open( c, shm_name ) < 0)
+        return -1;
+
+    if (log_path != NULL && frame_log_open( c, log_path ) < 0) {
+        int  err = errno;
+        frame_shm_close( c );
+        errno = err;
+        return -1;
+    }
+
+    /* framebuffer clients cannot be removed, register only once */
+    if (_capture_client != qfbuff) {
+        qframebuffer_add_client( qfbuff, c,
+                                 frame_capture_update,
+                                 frame_capture_rotate,
+                                 frame_capture_done );
+        _capture_client = qfbuff;
+    }
+    c->active = 1;
+    return 0;
+}
+
+void
+qframecapture_stop( void )
+{
+    FrameCapture*  c = _capture;
+
+    if (!c->active)
+        return;
+
+    c->active = 0;
+    frame_log_close( c );
+    frame_shm_close( c );
+}
+
+void
+qframecapture_stats( QFrameCaptureStats*  stats )
+{
+    *stats = _capture->stats;
+}
@@ -0,0 +1,56 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _QEMU_FRAMECAPTURE_H
+#define _QEMU_FRAMECAPTURE_H
+
+#include <stdint.h>
+#include "framebuffer.h"
+
+/* Headless capture of the frames of a QFrameBuffer, e.g. to record a
+ * video of the emulated screen without a window or a VNC connection.
+ *
+ * The capture is a framebuffer client: it only handles the rectangles
+ * reported by the producer, and can publish the frames in two ways:
+ *
+ * - a ring of complete frames in a shared memory object, for an external
+ *   encoder that reads them while the emulator runs.
+ *
+ * - a log file of the changed pixels of each frame, written from a
+ *   separate thread when possible.
+ *
+ * Both use timestamps from the virtual clock. See
+ * docs/ANDROID-FRAME-CAPTURE.TXT for the format of the data.
+ */
+
+/* start capturing the frames of 'qfbuff'. 'shm_name' is the name of the
+ * shared memory object to create, and 'log_path' the path of the log file
+ * to write. either of them can be NULL. this closes the current capture,
+ * if any. returns 0 on success, and -1 on failure (see errno then) */
+extern int   qframecapture_start( QFrameBuffer*  qfbuff,
+                                  const char*    shm_name,
+                                  const char*    log_path );
+
+/* stop the current capture, if any */
+extern void  qframecapture_stop( void );
+
+typedef struct {
+    uint64_t  frames;       /* number of frames captured */
+    uint64_t  pixels;       /* number of pixels copied or compared */
+    uint64_t  log_bytes;    /* number of bytes sent to the log file */
+    uint64_t  log_dropped;  /* number of frames missing from the log */
+    uint64_t  time_ns;      /* host time spent capturing frames */
+} QFrameCaptureStats;
+
+/* return statistics about the current capture */
+extern void  qframecapture_stats( QFrameCaptureStats*  stats );
+
+#endif /* _QEMU_FRAMECAPTURE_H */
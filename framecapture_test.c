@@ -0,0 +1,327 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* measure the cost of frame capture at 60 fps, and check what it
+ * produces: 600 frames of a 480x800 framebuffer are captured to both a
+ * shared memory ring and a log file, for several sizes of changes. each
+ * shared memory frame must match the framebuffer, and replaying the log
+ * must rebuild the frames at their virtual times. run with 'make check'.
+ */
+#include "framecapture.h"
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define  FB_WIDTH     480
+#define  FB_HEIGHT    800
+#define  NB_FRAMES    600
+#define  FRAME_NS     16666667   /* 60 fps */
+
+/* layouts of docs/ANDROID-FRAME-CAPTURE.TXT */
+#define  SHM_HEADER_FRAME_COUNT  0x20
+#define  SLOT_SEQUENCE           0x00
+#define  SLOT_FRAME              0x08
+#define  SLOT_PIXELS             0x40
+#define  LOG_HEADER_SIZE         16
+#define  LOG_RECORD_SIZE         24
+#define  LOG_RUN_SIZE            6
+
+static int  errors;
+
+/** what framecapture.c needs from the rest of the emulator
+ **/
+
+void*  qemu_malloc( size_t  size )  { return malloc(size); }
+void*  qemu_mallocz( size_t  size ) { return calloc(1, size); }
+void   qemu_free( void*  ptr )      { free(ptr); }
+char*  qemu_strdup( const char*  str ) { return strdup(str); }
+
+static int64_t  vm_now;    /* the virtual clock only moves between frames */
+
+/* only compared with each other */
+QEMUClock*  rt_clock;
+QEMUClock*  vm_clock = (QEMUClock*) &vm_now;
+
+int64_t
+qemu_get_clock_ns( QEMUClock*  clock )
+{
+    struct timespec  ts;
+
+    if (clock == vm_clock)
+        return vm_now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** synthetic frames
+ **/
+
+static uint32_t  rand_state = 1;
+
+static uint32_t
+next_rand( void )
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/* the area changed by each frame, to rebuild them when replaying the log */
+typedef struct {
+    int  x, y, w, h;
+} Change;
+
+static Change  changes[NB_FRAMES + 1];
+
+/* the value of a pixel changed by frame 'f' */
+static uint16_t
+pixel_value( int  f, int  x, int  y )
+{
+    return (uint16_t)(f*7919 + y*31 + x);
+}
+
+static void
+draw_frame( QFrameBuffer*  q, int  f, Change*  c )
+{
+    int  x, y;
+
+    for (y = c->y; y < c->y + c->h; y++) {
+        uint16_t*  row = (uint16_t*)((uint8_t*)q->pixels + y*q->pitch);
+        for (x = c->x; x < c->x + c->w; x++)
+            row[x] = pixel_value(f, x, y);
+    }
+}
+
+/* frame 0 fills the screen, the next ones change 'rows' rows at a random
+ * place, over a random part of their width */
+static void
+make_changes( int  rows )
+{
+    int  f;
+
+    changes[0].x = 0;
+    changes[0].y = 0;
+    changes[0].w = FB_WIDTH;
+    changes[0].h = FB_HEIGHT;
+
+    for (f = 1; f <= NB_FRAMES; f++) {
+        Change*  c = &changes[f];
+
+        c->h = rows;
+        c->y = (int)(next_rand() % (FB_HEIGHT - rows + 1));
+        if (rows == FB_HEIGHT) {
+            c->x = 0;
+            c->w = FB_WIDTH;
+        } else {
+            c->x = (int)(next_rand() % FB_WIDTH);
+            c->w = 1 + (int)(next_rand() % (FB_WIDTH - c->x));
+        }
+    }
+}
+
+/* bring 'out', which holds frame '*pf', to frame 'f' */
+static void
+expected_frame( uint16_t*  out, int*  pf, int  f )
+{
+    for (; *pf < f; *pf += 1) {
+        Change*  c = &changes[*pf + 1];
+        int      x, y;
+
+        for (y = c->y; y < c->y + c->h; y++)
+            for (x = c->x; x < c->x + c->w; x++)
+                out[y*FB_WIDTH + x] = pixel_value(*pf + 1, x, y);
+    }
+}
+
+/** checks
+ **/
+
+/* the newest slot of the shared memory ring must hold the framebuffer */
+static void
+check_shm( const char*  what, uint8_t*  shm, QFrameBuffer*  q, int  f )
+{
+    uint32_t  header_size = *(uint32_t*)(shm + 0x08);
+    uint32_t  slot_size   = *(uint32_t*)(shm + 0x0C);
+    uint32_t  num_slots   = *(uint32_t*)(shm + 0x10);
+    uint64_t  count       = *(uint64_t*)(shm + SHM_HEADER_FRAME_COUNT);
+    uint8_t*  slot        = shm + header_size + ((count - 1) % num_slots)*slot_size;
+
+    if (count != (uint64_t)f + 1 ||
+        *(uint64_t*)(slot + SLOT_SEQUENCE) != 2*count ||
+        *(uint64_t*)(slot + SLOT_FRAME) != count - 1 ||
+        memcmp(slot + SLOT_PIXELS, q->pixels, q->pitch*q->height) != 0) {
+        fprintf(stderr, "framecapture_test: %s: shared memory frame %d "
+                "differs\n", what, f);
+        errors++;
+    }
+}
+
+/* replay the log, checking each frame it rebuilds */
+static void
+check_log( const char*  what, const char*  path, int*  precords )
+{
+    static uint16_t  frame[FB_WIDTH*FB_HEIGHT];
+    static uint16_t  expected[FB_WIDTH*FB_HEIGHT];
+    uint8_t          header[LOG_RECORD_SIZE];
+    FILE*            f = fopen(path, "rb");
+    int              records = 0, have_key = 0, expected_f = -1;
+    int64_t          last = -1;
+
+    *precords = 0;
+    if (f == NULL || fread(header, LOG_HEADER_SIZE, 1, f) != 1 ||
+        *(uint32_t*)header != 0x474c4641) {
+        fprintf(stderr, "framecapture_test: %s: bad log header\n", what);
+        errors++;
+        if (f)
+            fclose(f);
+        return;
+    }
+
+    while (fread(header, LOG_RECORD_SIZE, 1, f) == 1) {
+        uint32_t  size     = *(uint32_t*)(header + 0x00);
+        uint16_t  flags    = *(uint16_t*)(header + 0x08);
+        uint32_t  num_runs = *(uint32_t*)(header + 0x0C);
+        int64_t   ts       = *(int64_t*) (header + 0x10);
+        int       nn, fnum;
+
+        /* frame N is captured at virtual time N*FRAME_NS */
+        fnum = (int)(ts / FRAME_NS);
+        if (ts % FRAME_NS != 0 || ts <= last || fnum > NB_FRAMES ||
+            (!have_key && !(flags & 1))) {
+            fprintf(stderr, "framecapture_test: %s: bad record at %lld\n",
+                    what, (long long)ts);
+            errors++;
+            break;
+        }
+        last = ts;
+        have_key |= (flags & 1);
+
+        for (nn = 0; nn < (int)num_runs; nn++) {
+            uint16_t  run[3];
+
+            if (fread(run, LOG_RUN_SIZE, 1, f) != 1 ||
+                run[0] >= FB_HEIGHT || run[1] + run[2] > FB_WIDTH ||
+                fread(frame + run[0]*FB_WIDTH + run[1], run[2]*2, 1, f) != 1) {
+                fprintf(stderr, "framecapture_test: %s: bad run\n", what);
+                errors++;
+                fclose(f);
+                return;
+            }
+            size -= LOG_RUN_SIZE + run[2]*2;
+        }
+        if (size != 0) {
+            fprintf(stderr, "framecapture_test: %s: bad record size\n", what);
+            errors++;
+            break;
+        }
+
+        expected_frame(expected, &expected_f, fnum);
+        if (memcmp(frame, expected, sizeof(frame)) != 0) {
+            fprintf(stderr, "framecapture_test: %s: log frame %d differs\n",
+                    what, fnum);
+            errors++;
+            break;
+        }
+        records++;
+    }
+    fclose(f);
+    *precords = records;
+}
+
+/** benchmark
+ **/
+
+static void
+run_capture( QFrameBuffer*  q, const char*  what, int  rows )
+{
+    char                shm_name[64], log_path[256];
+    const char*         tmpdir = getenv("TMPDIR");
+    QFrameCaptureStats  stats;
+    uint8_t*            shm;
+    size_t              shm_size;
+    int                 fd, f, records;
+
+    snprintf(shm_name, sizeof(shm_name), "/emulator-framecapture-test-%d",
+             (int)getpid());
+    snprintf(log_path, sizeof(log_path), "%s/emulator-framecapture-test-%d.log",
+             tmpdir ? tmpdir : "/tmp", (int)getpid());
+
+    make_changes(rows);
+    memset(q->pixels, 0, q->pitch*q->height);
+    vm_now = 0;
+
+    if (qframecapture_start(q, shm_name, log_path) < 0) {
+        fprintf(stderr, "framecapture_test: can't start the capture: %s\n",
+                strerror(errno));
+        errors++;
+        return;
+    }
+
+    /* map the ring like an external reader would */
+    fd       = shm_open(shm_name, O_RDONLY, 0);
+    shm_size = 64 + 8*(64 + ((q->pitch*q->height + 63) & ~63));
+    shm      = mmap(NULL, shm_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "framecapture_test: can't map %s\n", shm_name);
+        errors++;
+        qframecapture_stop();
+        return;
+    }
+
+    for (f = 0; f <= NB_FRAMES && errors < 10; f++) {
+        Change*  c = &changes[f];
+
+        vm_now = (int64_t)f * FRAME_NS;
+        draw_frame(q, f, c);
+        qframebuffer_update(q, c->x, c->y, c->w, c->h);
+        check_shm(what, shm, q, f);
+    }
+
+    qframecapture_stats(&stats);
+    qframecapture_stop();
+    munmap(shm, shm_size);
+
+    check_log(what, log_path, &records);
+    unlink(log_path);
+
+    printf("framecapture_test: %s: %.0f us/frame at 60 fps, %.2f%% of the "
+           "frame time, %d of %d frames logged\n", what,
+           stats.time_ns / 1e3 / stats.frames,
+           stats.time_ns * 100. / stats.frames / FRAME_NS,
+           records, NB_FRAMES + 1);
+}
+
+int
+main( void )
+{
+    QFrameBuffer  q[1];
+
+    if (qframebuffer_init(q, FB_WIDTH, FB_HEIGHT, 0, QFRAME_BUFFER_RGB565) < 0) {
+        fprintf(stderr, "framecapture_test: can't create framebuffer\n");
+        return 1;
+    }
+
+    run_capture(q, "16 rows", 16);
+    run_capture(q, "100 rows", 100);
+    run_capture(q, "full screen", FB_HEIGHT);
+
+    if (errors > 0) {
+        fprintf(stderr, "framecapture_test: FAILED\n");
+        return 1;
+    }
+    printf("framecapture_test: OK\n");
+    return 0;
+}
@@ -110,6 +110,8 @@ static void android_arm_init_(ram_addr_t ram_size,
                 smc_device->irq_count = 1;
                 goldfish_add_device_no_io(smc_device);
                 smc91c111_init(&nd_table[i], smc_device->base, goldfish_pic[smc_device->irq]);
+            } else if (strcmp(nd_table[i].model, "goldfish_net") == 0) {
+                goldfish_net_init(&nd_table[i], i);
             } else {
                 fprintf(stderr, "qemu: Unsupported NIC: %s\n", nd_table[0].model);
                 exit (1);
@@ -158,6 +160,8 @@ static void android_arm_init_(ram_addr_t ram_size,
     }
 #endif
 
+    goldfish_freepages_init();
+
 #if TEST_SWITCH
     {
         void *sw;
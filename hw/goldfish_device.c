@@ -11,6 +11,7 @@
 */
 #include "qemu_file.h"
 #include "arm_pic.h"
+#include "monitor.h"
 #include "goldfish_device.h"
 
 #define PDEV_BUS_OP_DONE        (0x00)
@@ -79,9 +80,28 @@ int goldfish_device_add(struct goldfish_device *dev,
     goldfish_add_device_no_io(dev);
     iomemtype = cpu_register_io_memory(mem_read, mem_write, opaque);
     cpu_register_physical_memory(dev->base, dev->size, iomemtype);
+    dev->iomemtype = iomemtype;
     return 0;
 }
 
+void do_info_mmio(Monitor *mon)
+{
+    struct goldfish_device *dev;
+    IOMemStats stats;
+
+    monitor_printf(mon, "%-32s %-10s %12s %12s %12s %12s\n", "device", "base",
+                   "reads", "shadowed", "writes", "posted");
+    for (dev = first_device; dev; dev = dev->next) {
+        if (!dev->iomemtype)
+            continue;
+        cpu_io_memory_get_stats(dev->iomemtype, &stats);
+        monitor_printf(mon, "%-32s 0x%08x %12" PRIu64 " %12" PRIu64
+                       " %12" PRIu64 " %12" PRIu64 "\n", dev->name, dev->base,
+                       stats.reads, stats.shadow_reads,
+                       stats.writes, stats.posted_writes);
+    }
+}
+
 static uint32_t goldfish_bus_read(void *opaque, target_phys_addr_t offset)
 {
     struct bus_state *s = (struct bus_state *)opaque;
@@ -149,7 +169,7 @@ static void goldfish_bus_write(void *opaque, target_phys_addr_t offset, uint32_t
             break;
         case PDEV_BUS_GET_NAME:
             if(s->current)
-                cpu_memory_rw_debug(cpu_single_env, value, (void*)s->current->name, strlen(s->current->name), 1);
+                cpu_dma_memory_rw(cpu_single_env, value, (void*)s->current->name, strlen(s->current->name), 1);
             break;
         default:
             cpu_abort (cpu_single_env, "goldfish_bus_write: Bad offset %x\n", offset);
@@ -24,6 +24,7 @@ struct goldfish_device {
     uint32_t size;
     uint32_t irq; // filled in by goldfish_device_add if 0
     uint32_t irq_count;
+    int iomemtype; // filled in by goldfish_device_add
 };
 
 
@@ -35,6 +36,8 @@ int goldfish_device_add(struct goldfish_device *dev,
 
 int goldfish_add_device_no_io(struct goldfish_device *dev);
 
+void do_info_mmio(Monitor *mon);
+
 void goldfish_device_init(qemu_irq *pic, uint32_t base, uint32_t size, uint32_t irq, uint32_t irq_count);
 int goldfish_device_bus_init(uint32_t base, uint32_t irq);
 
@@ -48,9 +51,12 @@ void goldfish_battery_init();
 void goldfish_battery_set_prop(int ac, int property, int value);
 void goldfish_battery_display(void (* callback)(void *data, const char* string), void *data);
 void goldfish_mmc_init(uint32_t base, int id, BlockDriverState* bs);
+void goldfish_net_init(NICInfo *nd, int id);
 void *goldfish_switch_add(char *name, uint32_t (*writefn)(void *opaque, uint32_t state), void *writeopaque, int id);
 void goldfish_switch_set_state(void *opaque, uint32_t state);
 void goldfish_virtualDevice_init (uint32_t base, int id);
+void goldfish_freepages_init(void);
+void do_info_freepages(Monitor *mon);
 
 // these do not add a device
 void trace_dev_init();
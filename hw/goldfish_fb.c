@@ -41,8 +41,19 @@ struct goldfish_fb_state {
     uint32_t int_status;
     uint32_t int_enable;
     int      rotation;   /* 0, 1, 2 or 3 */
+    uint32_t shown_base; /* base of the displayed pixels, 0 if not in VRAM */
 };
 
+/* on little-endian hosts, the framebuffer pixels point directly to the
+ * emulated VRAM, instead of a copy of it that must be updated each frame */
+#ifndef GOLDFISH_FB_DIRECT
+#if HOST_WORDS_BIGENDIAN
+#define  GOLDFISH_FB_DIRECT  0
+#else
+#define  GOLDFISH_FB_DIRECT  1
+#endif
+#endif
+
 #define  GOLDFISH_FB_SAVE_VERSION  1
 
 static void goldfish_fb_save(QEMUFile*  f, void*  opaque)
@@ -105,6 +116,7 @@ static int  goldfish_fb_load(QEMUFile*  f, void*  opaque, int  version_id)
 
     /* force a refresh */
     s->need_update = 1;
+    s->shown_base  = 0;
 
     ret = 0;
 Exit:
@@ -112,26 +124,114 @@ Exit:
 }
 
 
+#ifndef STATS
 #define  STATS  0
+#endif
 
 #if STATS
-static int   stats_counter;
-static long  stats_total;
-static int   stats_full_updates;
-static long  stats_total_full_updates;
+#include "qemu-timer.h"
+
+static int      stats_counter;
+static long     stats_total;
+static int      stats_full_updates;
+static long     stats_total_full_updates;
+static int64_t  stats_bytes;       /* bytes of pixels read or written here */
+static int64_t  stats_pixels;      /* pixels sent to the clients */
+static int64_t  stats_update_ns;   /* time spent in the clients */
+#  define  STATS_ADD_BYTES(n)  (stats_bytes += (n))
+#else
+#  define  STATS_ADD_BYTES(n)  ((void)0)
 #endif
 
+#if GOLDFISH_FB_DIRECT
+/* find the lines of the framebuffer at 'base' that must be redrawn. the
+ * clients read them directly from VRAM, so nothing needs to be copied */
+static void goldfish_fb_find_updates(struct goldfish_fb_state *s,
+                                     uint32_t base, int full_update,
+                                     int *first, int *last)
+{
+    int         height     = s->qfbuff->height;
+    int         len        = s->qfbuff->width*2;
+    ram_addr_t  fb_end     = base + height * len;
+    ram_addr_t  addr       = base;
+    ram_addr_t  dirty_addr = 0;
+    ram_addr_t  prev_addr  = 0, prev_end = 0;
+    uint8_t*    src_line   = qemu_get_ram_ptr( base );
+    uint8_t*    prev_line  = NULL;
+    int         y_first = -1, y_last = 0;
+    int         yy;
+
+    qframebuffer_set_pixels( s->qfbuff, src_line );
+
+    if (full_update) {
+        /* a new buffer is displayed, e.g. after a page flip. if the
+         * displayed pixels come from another buffer that was not modified
+         * since, only redraw the lines that differ between the two */
+        if (s->shown_base == 0 || s->shown_base == base) {
+            *first = 0;
+            *last  = height-1;
+            return;
+        }
+        prev_addr = s->shown_base;
+        prev_end  = prev_addr + height * len;
+        prev_line = qemu_get_ram_ptr( prev_addr );
+        dirty_addr = cpu_physical_memory_find_dirty(prev_addr, prev_end,
+                                                    VGA_DIRTY_FLAG);
+    } else {
+        dirty_addr = cpu_physical_memory_find_dirty(base, fb_end,
+                                                    VGA_DIRTY_FLAG);
+    }
+
+    for (yy = 0; yy < height; yy++, src_line += len, addr += len)
+    {
+        int  dirty;
+
+        if (prev_line != NULL) {
+            /* modified lines of the previous buffer, as below */
+            if (dirty_addr < (prev_addr & TARGET_PAGE_MASK))
+                dirty_addr = cpu_physical_memory_find_dirty(prev_addr, prev_end,
+                                                            VGA_DIRTY_FLAG);
+
+            dirty = (dirty_addr < prev_addr + len);
+            if (!dirty) {
+                dirty = memcmp( prev_line, src_line, len ) != 0;
+                STATS_ADD_BYTES( 2*len );
+            }
+            prev_addr += len;
+            prev_line += len;
+        } else {
+            /* 'dirty_addr' is the first dirty page at or after the one
+             * containing 'addr', look for the next one once we're past it */
+            if (dirty_addr < (addr & TARGET_PAGE_MASK))
+                dirty_addr = cpu_physical_memory_find_dirty(addr, fb_end,
+                                                            VGA_DIRTY_FLAG);
+
+            dirty = (dirty_addr < addr + len);
+        }
+
+        if (!dirty)
+            continue;
+
+        y_first = (y_first < 0) ? yy : y_first;
+        y_last  = yy;
+    }
+
+    *first = y_first;
+    *last  = y_last;
+}
+#endif /* GOLDFISH_FB_DIRECT */
+
 static void goldfish_fb_update_display(void *opaque)
 {
     struct goldfish_fb_state *s = (struct goldfish_fb_state *)opaque;
-    uint32_t addr;
     uint32_t base;
 
-    uint8_t*  dst_line;
-    uint8_t*  src_line;
     int y_first, y_last = 0;
     int full_update = 0;
     int    width, height, pitch;
+#if STATS
+    int64_t   update_start;
+#endif
 
     base = s->fb_base;
     if(base == 0)
@@ -143,7 +243,6 @@ static void goldfish_fb_update_display(void *opaque)
     }
 
     y_first = -1;
-    addr  = base;
     if(s->need_update) {
         full_update = 1;
         if(s->need_int) {
@@ -155,8 +254,6 @@ static void goldfish_fb_update_display(void *opaque)
         s->need_update = 0;
     }
 
-    src_line  = qemu_get_ram_ptr( base );
-    dst_line  = s->qfbuff->pixels;
     pitch     = s->qfbuff->pitch;
     width     = s->qfbuff->width;
     height    = s->qfbuff->height;
@@ -171,21 +268,49 @@ static void goldfish_fb_update_display(void *opaque)
         printf( "full update stats:  peak %.2f %%  total %.2f %%\n",
                 stats_full_updates*100.0/stats_counter,
                 stats_total_full_updates*100.0/stats_total );
+        printf( "per frame:  %lld bytes touched  %lld pixels updated in %lld us\n",
+                (long long)(stats_bytes/stats_counter),
+                (long long)(stats_pixels/stats_counter),
+                (long long)(stats_update_ns/stats_counter/1000) );
 
         stats_counter      = 0;
         stats_full_updates = 0;
+        stats_bytes        = 0;
+        stats_pixels       = 0;
+        stats_update_ns    = 0;
     }
 #endif /* STATS */
 
     if (s->blank)
     {
-        memset( dst_line, 0, height*pitch );
+        /* the screen stays blank until the next full update */
+        if (!full_update)
+            return;
+
+        qframebuffer_set_pixels( s->qfbuff, NULL );
+        memset( s->qfbuff->pixels, 0, height*pitch );
+        STATS_ADD_BYTES( height*pitch );
+        s->shown_base = 0;
         y_first = 0;
         y_last  = height-1;
     }
+#if GOLDFISH_FB_DIRECT
+    else
+    {
+        goldfish_fb_find_updates(s, base, full_update, &y_first, &y_last);
+
+        /* the displayed pixels now match the whole buffer */
+        if (y_first >= 0 || full_update)
+            cpu_physical_memory_reset_dirty(base, base + height * width * 2,
+                                            VGA_DIRTY_FLAG);
+        s->shown_base = base;
+    }
+#else /* !GOLDFISH_FB_DIRECT */
     else if (full_update)
     {
-        int  yy;
+        uint8_t*  src_line = qemu_get_ram_ptr( base );
+        uint8_t*  dst_line = s->qfbuff->pixels;
+        int       yy;
 
         for (yy = 0; yy < height; yy++, dst_line += pitch, src_line += width*2)
         {
@@ -204,6 +329,7 @@ static void goldfish_fb_update_display(void *opaque)
 #endif
             }
 
+            STATS_ADD_BYTES( nn*4 );
             if (nn == width)
                 continue;
 
@@ -215,6 +341,7 @@ static void goldfish_fb_update_display(void *opaque)
 #else
             memcpy( dst+nn, src+nn, (width-nn)*2 );
 #endif
+            STATS_ADD_BYTES( (width-nn)*4 );
 
             y_first = (y_first < 0) ? yy : y_first;
             y_last  = yy;
@@ -222,7 +349,13 @@ static void goldfish_fb_update_display(void *opaque)
     }
     else  /* not a full update, should not happen very often with Android */
     {
-        int  yy;
+        uint8_t*    src_line   = qemu_get_ram_ptr( base );
+        uint8_t*    dst_line   = s->qfbuff->pixels;
+        ram_addr_t  addr       = base;
+        int         yy;
+        ram_addr_t  fb_end     = base + height * width * 2;
+        ram_addr_t  dirty_addr = cpu_physical_memory_find_dirty(base, fb_end,
+                                                                VGA_DIRTY_FLAG);
 
         for (yy = 0; yy < height; yy++, dst_line += pitch, src_line += width*2)
         {
@@ -232,18 +365,16 @@ static void goldfish_fb_update_display(void *opaque)
 #if HOST_WORDS_BIGENDIAN
             int        nn;
 #endif
-            int        dirty = 0;
+            int        dirty;
 
-            while (len > 0) {
-                int  len2 = TARGET_PAGE_SIZE - (addr & (TARGET_PAGE_SIZE-1));
+            /* 'dirty_addr' is the first dirty page at or after the one
+             * containing 'addr', look for the next one once we're past it */
+            if (dirty_addr < (addr & TARGET_PAGE_MASK))
+                dirty_addr = cpu_physical_memory_find_dirty(addr, fb_end,
+                                                            VGA_DIRTY_FLAG);
 
-                if (len2 > len)
-                    len2 = len;
-
-                dirty |= cpu_physical_memory_get_dirty(addr, VGA_DIRTY_FLAG);
-                addr  += len2;
-                len   -= len2;
-            }
+            dirty = (dirty_addr < addr + len);
+            addr += len;
 
             if (!dirty)
                 continue;
@@ -256,23 +387,35 @@ static void goldfish_fb_update_display(void *opaque)
 #else
             memcpy( dst, src, width*2 );
 #endif
+            STATS_ADD_BYTES( width*4 );
 
             y_first = (y_first < 0) ? yy : y_first;
             y_last  = yy;
         }
     }
 
+#endif /* !GOLDFISH_FB_DIRECT */
+
     if (y_first < 0)
       return;
 
     y_last += 1;
     //printf("goldfish_fb_update_display %d %d, base %x\n", first, last, base);
 
+#if !GOLDFISH_FB_DIRECT
     cpu_physical_memory_reset_dirty(base + y_first * width * 2,
                                     base + y_last * width * 2,
                                     VGA_DIRTY_FLAG);
+#endif
 
+#if STATS
+    stats_pixels += width * (y_last - y_first);
+    update_start  = qemu_get_clock_ns(rt_clock);
+#endif
     qframebuffer_update( s->qfbuff, 0, y_first, width, y_last-y_first );
+#if STATS
+    stats_update_ns += qemu_get_clock_ns(rt_clock) - update_start;
+#endif
 }
 
 static void goldfish_fb_invalidate_display(void * opaque)
@@ -280,6 +423,7 @@ static void goldfish_fb_invalidate_display(void * opaque)
     // is this called?
     struct goldfish_fb_state *s = (struct goldfish_fb_state *)opaque;
     s->need_update = 1;
+    s->shown_base  = 0;
 }
 
 static void  goldfish_fb_detach_display(void*  opaque)
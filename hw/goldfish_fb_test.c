@@ -0,0 +1,378 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check that a framebuffer client sees what the guest drew in VRAM after
+ * each frame, and measure the bytes touched and the time spent per frame
+ * by goldfish_fb and a client that converts the updated rectangles to a
+ * 32-bit surface, like the skin window does. the guest draws with
+ * cpu_physical_memory_write(), so the VRAM dirty bits of exec.c are set
+ * like they are by the generated code. goldfish_fb.c is included with its
+ * STATS block enabled, to read the bytes it touches. it is built once with
+ * its default direct path and once with the copy path. run with 'make check'.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "cpu.h"
+#include "exec-all.h"
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "gles2emulator_utils.h"
+
+#define  STATS  1
+#include "goldfish_fb.c"
+
+#define RAM_SIZE        (16 << 20)
+
+#define FB_WIDTH        480
+#define FB_HEIGHT       800
+#define FB_SIZE         (FB_WIDTH * FB_HEIGHT * 2)
+
+/* the two buffers the guest flips between */
+#define FB_BASE0        0x00100000
+#define FB_BASE1        (FB_BASE0 + ((FB_SIZE + 4095) & ~4095))
+
+#define NB_FRAMES       100
+
+static int errors;
+
+/** the rest of the emulator
+ **/
+
+void*  qemu_malloc( size_t  size )                 { return malloc(size); }
+void*  qemu_mallocz( size_t  size )                { return calloc(1, size); }
+void*  qemu_realloc( void*  ptr, size_t  size )    { return realloc(ptr, size); }
+void   qemu_free( void*  ptr )                     { free(ptr); }
+void*  qemu_vmalloc( size_t  size )                { return qemu_memalign(4096, size); }
+
+void*
+qemu_memalign( size_t  alignment, size_t  size )
+{
+    void*  ptr;
+
+    if (posix_memalign(&ptr, alignment, size))
+        abort();
+    return ptr;
+}
+
+ram_addr_t  ram_size = RAM_SIZE;
+int         mem_merge;
+int         memcheck_instrument_mmu;
+int         tb_invalidated_flag;
+
+int  memcheck_is_checked( target_ulong  addr, uint32_t  size ) { return 0; }
+void ram_dedup_reset( void ) {}
+
+void gles2emulator_utils_create_sharedmemory_file( struct hostSharedMemoryStruct*  s ) {}
+
+void
+gles2emulator_utils_map_sharedmemory_file( struct hostSharedMemoryStruct*  s )
+{
+    s->actualAddress = mmap(NULL, s->size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s->actualAddress == MAP_FAILED) {
+        fprintf(stderr, "goldfish_fb_test: can't map guest RAM\n");
+        exit(1);
+    }
+}
+
+unsigned long code_gen_max_block_size( void ) { return 1024; }
+void cpu_gen_init( void ) {}
+int  cpu_gen_code( CPUState*  env, struct TranslationBlock*  tb,
+                   int*  gen_code_size_ptr ) { abort(); }
+int  cpu_restore_state( struct TranslationBlock*  tb, CPUState*  env,
+                        unsigned long  searched_pc, void*  puc ) { return 0; }
+void cpu_resume_from_signal( CPUState*  env1, void*  puc ) { abort(); }
+CPUARMState*  cpu_arm_init( const char*  cpu_model ) { abort(); }
+void cpu_dump_state( CPUState*  env, FILE*  f,
+                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...),
+                     int  flags ) {}
+target_phys_addr_t  cpu_get_phys_page_debug( CPUState*  env, target_ulong  addr ) { return -1; }
+void tcg_dump_info( FILE*  f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...) ) {}
+
+void tlb_fill( target_ulong  addr, int  is_write, int  mmu_idx, void*  retaddr ) { abort(); }
+
+void qemu_cpu_kick( void*  env ) {}
+int  qemu_cpu_self( void*  env ) { return 1; }
+
+int
+register_savevm( const char*  idstr, int  instance_id, int  version_id,
+                 SaveStateHandler*  save_state, LoadStateHandler*  load_state,
+                 void*  opaque )
+{
+    return 0;
+}
+
+void cpu_save( QEMUFile*  f, void*  opaque ) {}
+int  cpu_load( QEMUFile*  f, void*  opaque, int  version_id ) { return 0; }
+void qemu_put_be32( QEMUFile*  f, unsigned int  v ) {}
+unsigned int qemu_get_be32( QEMUFile*  f ) { return 0; }
+void qemu_put_byte( QEMUFile*  f, int  v ) {}
+int  qemu_get_byte( QEMUFile*  f ) { return 0; }
+
+QEMUClock*  rt_clock;
+
+int64_t
+qemu_get_clock_ns( QEMUClock*  clock )
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL;
+}
+
+/* the goldfish bus */
+static CPUWriteMemoryFunc**  fb_writefn;
+static void*                 fb_opaque;
+
+int
+goldfish_device_add( struct goldfish_device*  dev,
+                     CPUReadMemoryFunc**  mem_read,
+                     CPUWriteMemoryFunc**  mem_write,
+                     void*  opaque )
+{
+    fb_writefn = mem_write;
+    fb_opaque  = opaque;
+    return 0;
+}
+
+void goldfish_device_set_irq( struct goldfish_device*  dev, int  irq, int  level ) {}
+
+/** the client: converts the updated rectangles to a 32-bit surface
+ **/
+
+static QFrameBuffer  fb[1];
+static uint32_t      surface[FB_WIDTH * FB_HEIGHT];
+static int64_t       client_bytes;
+
+static uint32_t
+rgb565_to_argb( unsigned  pix )
+{
+    unsigned  r = (pix >> 11) & 31, g = (pix >> 5) & 63, b = pix & 31;
+
+    return 0xff000000 | (((r << 3) | (r >> 2)) << 16)
+                      | (((g << 2) | (g >> 4)) << 8)
+                      |  ((b << 3) | (b >> 2));
+}
+
+static void
+client_update( void*  opaque, int  x, int  y, int  w, int  h )
+{
+    QFrameBuffer*  q = opaque;
+    int            yy, xx;
+
+    for (yy = y; yy < y + h; yy++) {
+        const uint16_t*  src = (const uint16_t*)((uint8_t*)q->pixels + yy*q->pitch);
+        uint32_t*        dst = surface + yy*FB_WIDTH;
+
+        for (xx = x; xx < x + w; xx++)
+            dst[xx] = rgb565_to_argb(src[xx]);
+    }
+    client_bytes += (int64_t)w * h * (2 + 4);
+}
+
+static void
+client_rotate( void*  opaque, int  rotation )
+{
+    if (rotation != 0) {
+        printf("goldfish_fb_test: unexpected rotation %d\n", rotation);
+        errors++;
+    }
+}
+
+static void client_done( void*  opaque ) {}
+
+/** the guest
+ **/
+
+/* the guest draws a band of 'lines' lines over a fixed background, and the
+   band moves and changes color each frame */
+static int
+band_start( int  frame, int  lines )
+{
+    if (lines >= FB_HEIGHT)
+        return 0;
+    return (frame * 8) % (FB_HEIGHT - lines);
+}
+
+static void
+guest_draw_line( uint32_t  base, int  y, int  frame, int  lines )
+{
+    uint16_t  line[FB_WIDTH];
+    int       first = band_start(frame, lines);
+    int       in_band = (y >= first && y < first + lines);
+    int       x;
+
+    for (x = 0; x < FB_WIDTH; x++) {
+        if (in_band)
+            line[x] = ((x ^ y) + frame * 0x0841) & 0xffff;
+        else
+            line[x] = (x * 31 + y * 7) & 0xffff;
+    }
+    cpu_physical_memory_write(base + y * FB_WIDTH * 2, (uint8_t*)line,
+                              sizeof(line));
+}
+
+static void
+guest_draw_frame( uint32_t  base, int  frame, int  lines )
+{
+    int  y;
+
+    for (y = 0; y < FB_HEIGHT; y++)
+        guest_draw_line(base, y, frame, lines);
+}
+
+/* redraw the lines of the band of 'old_frame' and of 'frame' */
+static void
+guest_draw_bands( uint32_t  base, int  old_frame, int  frame, int  lines )
+{
+    int  y;
+
+    for (y = band_start(old_frame, lines); y < band_start(old_frame, lines) + lines; y++)
+        guest_draw_line(base, y, frame, lines);
+    for (y = band_start(frame, lines); y < band_start(frame, lines) + lines; y++)
+        guest_draw_line(base, y, frame, lines);
+}
+
+static void
+guest_set_base( uint32_t  base )
+{
+    fb_writefn[2](fb_opaque, FB_SET_BASE, base);
+}
+
+/* the surface must show the buffer at 'base' */
+static void
+check_surface( const char*  name, uint32_t  base, int  frame )
+{
+    const uint16_t*  vram = qemu_get_ram_ptr(base);
+    int              nn;
+
+    for (nn = 0; nn < FB_WIDTH * FB_HEIGHT; nn++) {
+        if (surface[nn] != rgb565_to_argb(vram[nn])) {
+            printf("goldfish_fb_test: %s: frame %d: pixel (%d,%d) is %08x instead of %08x\n",
+                   name, frame, nn % FB_WIDTH, nn / FB_WIDTH, surface[nn],
+                   rgb565_to_argb(vram[nn]));
+            errors++;
+            return;
+        }
+    }
+}
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** scenarios
+ **/
+
+typedef struct {
+    const char*  name;
+    int          flip;    /* flip between two buffers each frame */
+    int          lines;   /* lines of the moving band */
+} Scenario;
+
+static const Scenario  scenarios[] = {
+    { "flip, all lines change",     1, FB_HEIGHT },
+    { "flip, 48 lines change",      1, 48 },
+    { "flip, nothing changes",      1, 0 },
+    { "no flip, 48 lines change",   0, 48 },
+    { "no flip, nothing changes",   0, 0 },
+};
+
+static void
+run_scenario( const Scenario*  sc )
+{
+    const char*  mode = GOLDFISH_FB_DIRECT ? "direct" : "copy";
+    double       total = 0;
+    int          frame;
+    uint32_t     base = FB_BASE0;
+
+    /* two full frames, so that both buffers hold what the moving band
+       expects */
+    for (frame = 0; frame < 2; frame++) {
+        base = (sc->flip && (frame & 1)) ? FB_BASE1 : FB_BASE0;
+        guest_draw_frame(base, frame, sc->lines);
+        guest_set_base(base);
+        qframebuffer_check_updates();
+        check_surface(sc->name, base, frame);
+    }
+
+    stats_counter      = 0;
+    stats_full_updates = 0;
+    stats_bytes        = 0;
+    stats_pixels       = 0;
+    stats_update_ns    = 0;
+    client_bytes       = 0;
+
+    for ( ; frame < 2 + NB_FRAMES; frame++) {
+        double  start;
+
+        if (sc->flip) {
+            /* the back buffer holds the frame before the previous one */
+            base = (frame & 1) ? FB_BASE1 : FB_BASE0;
+            if (sc->lines >= FB_HEIGHT)
+                guest_draw_frame(base, frame, sc->lines);
+            else if (sc->lines > 0)
+                guest_draw_bands(base, frame - 2, frame, sc->lines);
+            guest_set_base(base);
+        } else if (sc->lines > 0) {
+            guest_draw_bands(base, frame - 1, frame, sc->lines);
+        }
+
+        start = now_secs();
+        qframebuffer_check_updates();
+        total += now_secs() - start;
+
+        check_surface(sc->name, base, frame);
+    }
+
+    printf("goldfish_fb_test: %-6s  %-26s %8lld bytes touched per frame"
+           " (%lld by goldfish_fb), %6.3f ms per frame (%.3f ms in the client)\n",
+           mode, sc->name,
+           (long long)((stats_bytes + client_bytes) / NB_FRAMES),
+           (long long)(stats_bytes / NB_FRAMES),
+           total * 1e3 / NB_FRAMES,
+           stats_update_ns / 1e6 / NB_FRAMES);
+}
+
+int main(void)
+{
+    ram_addr_t  offset;
+    int         nn;
+
+    cpu_exec_init_all(0);
+    offset = qemu_ram_alloc(RAM_SIZE);
+    cpu_register_physical_memory(0, RAM_SIZE, offset | IO_MEM_RAM);
+
+    qframebuffer_init(fb, FB_WIDTH, FB_HEIGHT, 0, QFRAME_BUFFER_RGB565);
+    qframebuffer_fifo_add(fb);
+    qframebuffer_add_client(fb, fb, client_update, client_rotate, client_done);
+    goldfish_fb_init(NULL, 0);
+
+    for (nn = 0; nn < (int)(sizeof(scenarios)/sizeof(scenarios[0])); nn++)
+        run_scenario(&scenarios[nn]);
+
+    if (errors) {
+        printf("goldfish_fb_test: FAILED, %d errors\n", errors);
+        return 1;
+    }
+    printf("goldfish_fb_test: OK\n");
+    return 0;
+}
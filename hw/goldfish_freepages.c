@@ -0,0 +1,228 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* A free page reporting device for the goldfish bus.
+ *
+ * Once a page has been touched by the guest, it stays resident in the
+ * emulator process even after the guest frees it. This device lets the
+ * guest kernel report ranges of free pages, whose host memory is then
+ * given back to the system with cpu_physical_memory_discard(). The pages
+ * read as zeroes until the guest writes them again, which also lets
+ * snapshots skip them.
+ *
+ * See docs/ANDROID-GOLDFISH-FREEPAGES.TXT for the guest driver contract.
+ */
+#include "qemu_file.h"
+#include "cpu.h"
+#include "monitor.h"
+#include "goldfish_device.h"
+
+enum {
+    /* device version, currently 1 */
+    FREEPAGES_VERSION       = 0x00,
+    /* size of the host pages, smaller ranges are never reclaimed */
+    FREEPAGES_PAGE_SIZE     = 0x04,
+    /* guest physical address of the range or list to report */
+    FREEPAGES_ADDR          = 0x08,
+    /* size of the range in bytes, or number of list entries */
+    FREEPAGES_SIZE          = 0x0C,
+    /* see FREEPAGES_CMD_XXX below */
+    FREEPAGES_COMMAND       = 0x10,
+    /* number of bytes reclaimed by the last command */
+    FREEPAGES_RECLAIMED     = 0x14,
+
+    FREEPAGES_CMD_RANGE     = 1,
+    FREEPAGES_CMD_LIST      = 2,
+
+    /* list entries are pairs of 32-bit little-endian address and size */
+    FREEPAGES_ENTRY_SIZE    = 8,
+};
+
+#define  FREEPAGES_DEVICE_VERSION  1
+#define  FREEPAGES_MAX_ENTRIES     512
+
+struct goldfish_freepages_state {
+    struct goldfish_device dev;
+
+    uint32_t addr;
+    uint32_t size;
+    uint32_t reclaimed;
+
+    /* statistics for 'info freepages', not saved */
+    uint64_t commands;
+    uint64_t reported_bytes;
+    uint64_t reclaimed_bytes;
+};
+
+static struct goldfish_freepages_state *freepages_state;
+
+#define  GOLDFISH_FREEPAGES_SAVE_VERSION  1
+#define  QFIELD_STRUCT  struct goldfish_freepages_state
+QFIELD_BEGIN(goldfish_freepages_fields)
+    QFIELD_INT32(addr),
+    QFIELD_INT32(size),
+    QFIELD_INT32(reclaimed),
+QFIELD_END
+
+static ram_addr_t freepages_report(struct goldfish_freepages_state *s,
+                                   target_phys_addr_t addr,
+                                   target_phys_addr_t size)
+{
+    s->reported_bytes += size;
+    return cpu_physical_memory_discard(addr, size);
+}
+
+static void freepages_command(struct goldfish_freepages_state *s, uint32_t cmd)
+{
+    uint8_t list[FREEPAGES_MAX_ENTRIES * FREEPAGES_ENTRY_SIZE];
+    ram_addr_t freed = 0;
+    uint32_t n;
+
+    switch (cmd) {
+    case FREEPAGES_CMD_RANGE:
+        freed = freepages_report(s, s->addr, s->size);
+        break;
+
+    case FREEPAGES_CMD_LIST:
+        if (s->size > FREEPAGES_MAX_ENTRIES) {
+            fprintf(stderr, "goldfish_freepages: too many list entries (%u)\n",
+                    s->size);
+            break;
+        }
+        cpu_physical_memory_read(s->addr, list, s->size * FREEPAGES_ENTRY_SIZE);
+        for (n = 0; n < s->size; n++) {
+            const uint8_t *e = list + n * FREEPAGES_ENTRY_SIZE;
+
+            freed += freepages_report(s, ldl_le_p(e), ldl_le_p(e + 4));
+        }
+        break;
+
+    default:
+        cpu_abort(cpu_single_env, "goldfish_freepages: Bad command %x\n", cmd);
+    }
+
+    s->commands++;
+    s->reclaimed_bytes += freed;
+    s->reclaimed = freed;
+}
+
+static uint32_t goldfish_freepages_read(void *opaque, target_phys_addr_t offset)
+{
+    struct goldfish_freepages_state *s = opaque;
+
+    switch (offset) {
+        case FREEPAGES_VERSION:
+            return FREEPAGES_DEVICE_VERSION;
+        case FREEPAGES_PAGE_SIZE:
+            return qemu_real_host_page_size;
+        case FREEPAGES_ADDR:
+            return s->addr;
+        case FREEPAGES_SIZE:
+            return s->size;
+        case FREEPAGES_RECLAIMED:
+            return s->reclaimed;
+        default:
+            cpu_abort(cpu_single_env, "goldfish_freepages_read: Bad offset %x\n", offset);
+            return 0;
+    }
+}
+
+static void goldfish_freepages_write(void *opaque, target_phys_addr_t offset, uint32_t val)
+{
+    struct goldfish_freepages_state *s = opaque;
+
+    switch (offset) {
+        case FREEPAGES_ADDR:
+            s->addr = val;
+            break;
+        case FREEPAGES_SIZE:
+            s->size = val;
+            break;
+        case FREEPAGES_COMMAND:
+            freepages_command(s, val);
+            break;
+        default:
+            cpu_abort(cpu_single_env, "goldfish_freepages_write: Bad offset %x\n", offset);
+    }
+}
+
+static CPUReadMemoryFunc *goldfish_freepages_readfn[] = {
+    goldfish_freepages_read,
+    goldfish_freepages_read,
+    goldfish_freepages_read
+};
+
+static CPUWriteMemoryFunc *goldfish_freepages_writefn[] = {
+    goldfish_freepages_write,
+    goldfish_freepages_write,
+    goldfish_freepages_write
+};
+
+static void goldfish_freepages_save(QEMUFile *f, void *opaque)
+{
+    struct goldfish_freepages_state *s = opaque;
+
+    qemu_put_struct(f, goldfish_freepages_fields, s);
+}
+
+static int goldfish_freepages_load(QEMUFile *f, void *opaque, int version_id)
+{
+    struct goldfish_freepages_state *s = opaque;
+
+    if (version_id != GOLDFISH_FREEPAGES_SAVE_VERSION)
+        return -1;
+
+    return qemu_get_struct(f, goldfish_freepages_fields, s);
+}
+
+void goldfish_freepages_init(void)
+{
+    struct goldfish_freepages_state *s;
+
+    s = (struct goldfish_freepages_state *)qemu_mallocz(sizeof(*s));
+    s->dev.name = "goldfish_freepages";
+    s->dev.id = 0;
+    s->dev.size = 0x1000;
+    s->dev.irq_count = 0;
+
+    goldfish_device_add(&s->dev, goldfish_freepages_readfn,
+                        goldfish_freepages_writefn, s);
+
+    register_savevm( "goldfish_freepages", 0, GOLDFISH_FREEPAGES_SAVE_VERSION,
+                     goldfish_freepages_save, goldfish_freepages_load, s);
+    freepages_state = s;
+}
+
+void do_info_freepages(Monitor *mon)
+{
+    struct goldfish_freepages_state *s = freepages_state;
+    ram_addr_t addr, free_pages = 0;
+
+    if (s == NULL) {
+        monitor_printf(mon, "free page reporting is not available\n");
+        return;
+    }
+
+    /* pages discarded and not written since */
+    for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
+        if (!cpu_physical_memory_get_dirty(addr, FREE_PAGE_DIRTY_FLAG))
+            free_pages++;
+    }
+
+    monitor_printf(mon, "reports: %" PRIu64 ", %" PRIu64 " KB reported\n",
+                   s->commands, s->reported_bytes >> 10);
+    monitor_printf(mon, "reclaimed: %" PRIu64 " KB in total\n",
+                   s->reclaimed_bytes >> 10);
+    monitor_printf(mon, "currently free: %" PRIu64 " KB of %" PRIu64 " KB\n",
+                   (uint64_t)(free_pages << TARGET_PAGE_BITS) >> 10,
+                   (uint64_t)last_ram_offset >> 10);
+}
@@ -30,6 +30,9 @@ struct goldfish_int_state {
     uint32_t fiq_enabled;
     qemu_irq parent_irq;
     qemu_irq parent_fiq;
+    /* INTERRUPT_STATUS and INTERRUPT_NUMBER, read by the guest without
+       calling goldfish_int_read(), see cpu_io_memory_set_shadow() */
+    uint32_t shadow[2];
 };
 
 #define  GOLDFISH_INT_SAVE_VERSION  1
@@ -49,20 +52,42 @@ static void goldfish_int_save(QEMUFile*  f, void*  opaque)
     qemu_put_struct(f, goldfish_int_fields, s);
 }
 
+static uint32_t goldfish_int_number(struct goldfish_int_state *s)
+{
+    int i;
+    uint32_t pending = s->level & s->irq_enabled;
+    for(i = 0; i < 32; i++) {
+        if(pending & (1U << i))
+            return i;
+    }
+    return 0;
+}
+
+static void goldfish_int_update_shadow(struct goldfish_int_state *s)
+{
+    s->shadow[INTERRUPT_STATUS >> 2] = s->pending_count;
+    s->shadow[INTERRUPT_NUMBER >> 2] = goldfish_int_number(s);
+}
+
 static int  goldfish_int_load(QEMUFile*  f, void*  opaque, int  version_id)
 {
     struct goldfish_int_state*  s = opaque;
+    int ret;
 
     if (version_id != GOLDFISH_INT_SAVE_VERSION)
         return -1;
 
-    return qemu_get_struct(f, goldfish_int_fields, s);
+    ret = qemu_get_struct(f, goldfish_int_fields, s);
+    goldfish_int_update_shadow(s);
+    return ret;
 }
 
 static void goldfish_int_update(struct goldfish_int_state *s)
 {
     uint32_t flags;
 
+    goldfish_int_update_shadow(s);
+
     flags = (s->level & s->irq_enabled);
     qemu_set_irq(s->parent_irq, flags != 0);
 
@@ -99,15 +124,8 @@ static uint32_t goldfish_int_read(void *opaque, target_phys_addr_t offset)
     switch (offset) {
     case INTERRUPT_STATUS: /* IRQ_STATUS */
         return s->pending_count;
-    case INTERRUPT_NUMBER: {
-        int i;
-        uint32_t pending = s->level & s->irq_enabled;
-        for(i = 0; i < 32; i++) {
-            if(pending & (1U << i))
-                return i;
-        }
-        return 0;
-    }
+    case INTERRUPT_NUMBER:
+        return goldfish_int_number(s);
     default:
         cpu_abort (cpu_single_env, "goldfish_int_read: Bad offset %x\n", offset);
         return 0;
@@ -180,6 +198,11 @@ qemu_irq*  goldfish_interrupt_init(uint32_t base, qemu_irq parent_irq, qemu_irq
         return NULL;
     }
 
+    /* the kernel reads these on every interrupt */
+    cpu_io_memory_set_shadow(s->dev.iomemtype, s->shadow,
+                             (1 << (INTERRUPT_STATUS >> 2)) |
+                             (1 << (INTERRUPT_NUMBER >> 2)));
+
     register_savevm( "goldfish_int", 0, GOLDFISH_INT_SAVE_VERSION,
                      goldfish_int_save, goldfish_int_load, s);
 
@@ -175,19 +175,23 @@ static int  goldfish_mmc_bdrv_read(struct goldfish_mmc_state *s,
                                    target_phys_addr_t         dst_address,
                                    int                        num_sectors)
 {
-    int  ret;
+    CPUDMA    dma;
+    uint32_t  offset = 0;
+    int       ret = 0;
 
+    cpu_dma_map_phys(&dma, dst_address, num_sectors * 512);
     while (num_sectors > 0) {
         ret = bdrv_read(s->bs, sector_number, s->buf, 1);
         if (ret < 0)
-            return ret;
+            break;
 
-        cpu_physical_memory_write(dst_address, s->buf, 512);
-        dst_address   += 512;
+        cpu_dma_rw(&dma, offset, s->buf, 512, 1);
+        offset        += 512;
         num_sectors   -= 1;
         sector_number += 1;
     }
-    return 0;
+    cpu_dma_unmap(&dma);
+    return ret < 0 ? ret : 0;
 }
 
 static int  goldfish_mmc_bdrv_write(struct goldfish_mmc_state *s,
@@ -195,20 +199,24 @@ static int  goldfish_mmc_bdrv_write(struct goldfish_mmc_state *s,
                                     target_phys_addr_t         dst_address,
                                     int                        num_sectors)
 {
-    int  ret;
+    CPUDMA    dma;
+    uint32_t  offset = 0;
+    int       ret = 0;
 
+    cpu_dma_map_phys(&dma, dst_address, num_sectors * 512);
     while (num_sectors > 0) {
-        cpu_physical_memory_read(dst_address, s->buf, 512);
+        cpu_dma_rw(&dma, offset, s->buf, 512, 0);
 
         ret = bdrv_write(s->bs, sector_number, s->buf, 1);
         if (ret < 0)
-            return ret;
+            break;
 
-        dst_address   += 512;
+        offset        += 512;
         num_sectors   -= 1;
         sector_number += 1;
     }
-    return 0;
+    cpu_dma_unmap(&dma);
+    return ret < 0 ? ret : 0;
 }
 
 
@@ -12,6 +12,7 @@
 #include "qemu_file.h"
 #include "goldfish_nand_reg.h"
 #include "goldfish_nand.h"
+#include "goldfish_nand_image.h"
 #include "android/utils/tempfile.h"
 #include "qemu_debug.h"
 #include "android/android.h"
@@ -54,6 +55,7 @@ typedef struct {
     size_t     devname_len;
     char*      data;
     int        fd;
+    NandImage* image;      /* non-NULL for compressed read-only images */
     uint32_t   flags;
     uint32_t   page_size;
     uint32_t   extra_size;
@@ -173,14 +175,42 @@ static int  do_write(int  fd, const void*  buf, size_t  size)
     return ret;
 }
 
-static uint32_t nand_dev_read_file(nand_dev *dev, uint32_t data, uint64_t addr, uint32_t total_len)
+static void nand_dev_read_image(nand_dev *dev, CPUDMA *dma, uint64_t addr, uint32_t len)
 {
-    uint32_t len = total_len;
+    uint32_t read_len, data = 0;
+    int ret;
+
+    while(len > 0) {
+        read_len = dev->erase_size;
+        if(len < read_len)
+            read_len = len;
+        ret = nand_image_read(dev->image, addr, dev->data, read_len);
+        if(ret < 0) {
+            XLOG("nand_dev_read_image, read failed at 0x%llx\n", addr);
+            ret = 0;
+        }
+        /* the device is padded to a full erase unit with erased pages */
+        memset(dev->data + ret, 0xff, read_len - ret);
+        cpu_dma_rw(dma, data, (uint8_t *)dev->data, read_len, 1);
+        data += read_len;
+        addr += read_len;
+        len -= read_len;
+    }
+}
+
+static uint32_t nand_dev_read_file(nand_dev *dev, CPUDMA *dma, uint64_t addr, uint32_t total_len)
+{
+    uint32_t len = total_len, data = 0;
     size_t read_len = dev->erase_size;
     int eof = 0;
 
     NAND_UPDATE_READ_THRESHOLD(total_len);
 
+    if(dev->image != NULL) {
+        nand_dev_read_image(dev, dma, addr, total_len);
+        return total_len;
+    }
+
     lseek(dev->fd, addr, SEEK_SET);
     while(len > 0) {
         if(read_len < dev->erase_size) {
@@ -193,16 +223,16 @@ static uint32_t nand_dev_read_file(nand_dev *dev, uint32_t data, uint64_t addr,
         if(!eof) {
             read_len = do_read(dev->fd, dev->data, read_len);
         }
-        cpu_memory_rw_debug(cpu_single_env, data, dev->data, read_len, 1);
+        cpu_dma_rw(dma, data, (uint8_t *)dev->data, read_len, 1);
         data += read_len;
         len -= read_len;
     }
     return total_len;
 }
 
-static uint32_t nand_dev_write_file(nand_dev *dev, uint32_t data, uint64_t addr, uint32_t total_len)
+static uint32_t nand_dev_write_file(nand_dev *dev, CPUDMA *dma, uint64_t addr, uint32_t total_len)
 {
-    uint32_t len = total_len;
+    uint32_t len = total_len, data = 0;
     size_t write_len = dev->erase_size;
     int ret;
 
@@ -212,7 +242,7 @@ static uint32_t nand_dev_write_file(nand_dev *dev, uint32_t data, uint64_t addr,
     while(len > 0) {
         if(len < write_len)
             write_len = len;
-        cpu_memory_rw_debug(cpu_single_env, data, dev->data, write_len, 0);
+        cpu_dma_rw(dma, data, (uint8_t *)dev->data, write_len, 0);
         ret = do_write(dev->fd, dev->data, write_len);
         if(ret < write_len) {
             XLOG("nand_dev_write_file, write failed: %s\n", strerror(errno));
@@ -263,6 +293,7 @@ uint32_t nand_dev_do_cmd(nand_dev_state *s, uint32_t cmd)
     uint32_t size;
     uint64_t addr;
     nand_dev *dev;
+    CPUDMA dma;
 
     addr = s->addr_low | ((uint64_t)s->addr_high << 32);
     size = s->transfer_size;
@@ -274,16 +305,22 @@ uint32_t nand_dev_do_cmd(nand_dev_state *s, uint32_t cmd)
     case NAND_CMD_GET_DEV_NAME:
         if(size > dev->devname_len)
             size = dev->devname_len;
-        cpu_memory_rw_debug(cpu_single_env, s->data, dev->devname, size, 1);
+        if(cpu_dma_memory_rw(cpu_single_env, s->data, (uint8_t *)dev->devname, size, 1) < 0)
+            return 0;
         return size;
     case NAND_CMD_READ:
         if(addr >= dev->size)
             return 0;
         if(size + addr > dev->size)
             size = dev->size - addr;
+        /* the guest buffer is translated once for the whole transfer,
+         * which stops at the first page that is not mapped */
+        size = cpu_dma_map_virt(&dma, cpu_single_env, s->data, size);
         if(dev->fd >= 0)
-            return nand_dev_read_file(dev, s->data, addr, size);
-        cpu_memory_rw_debug(cpu_single_env,s->data, &dev->data[addr], size, 1);
+            size = nand_dev_read_file(dev, &dma, addr, size);
+        else
+            cpu_dma_rw(&dma, 0, (uint8_t *)&dev->data[addr], size, 1);
+        cpu_dma_unmap(&dma);
         return size;
     case NAND_CMD_WRITE:
         if(dev->flags & NAND_DEV_FLAG_READ_ONLY)
@@ -292,9 +329,12 @@ uint32_t nand_dev_do_cmd(nand_dev_state *s, uint32_t cmd)
             return 0;
         if(size + addr > dev->size)
             size = dev->size - addr;
+        size = cpu_dma_map_virt(&dma, cpu_single_env, s->data, size);
         if(dev->fd >= 0)
-            return nand_dev_write_file(dev, s->data, addr, size);
-        cpu_memory_rw_debug(cpu_single_env,s->data, &dev->data[addr], size, 0);
+            size = nand_dev_write_file(dev, &dma, addr, size);
+        else
+            cpu_dma_rw(&dma, 0, (uint8_t *)&dev->data[addr], size, 0);
+        cpu_dma_unmap(&dma);
         return size;
     case NAND_CMD_ERASE:
         if(dev->flags & NAND_DEV_FLAG_READ_ONLY)
@@ -450,6 +490,9 @@ void nand_add_dev(const char *arg)
     char *rwfilename = NULL;
     int initfd = -1;
     int rwfd = -1;
+    NandImage *initimage = NULL;
+    NandImage *rwimage = NULL;
+    uint64_t initpos = 0;
     int read_only = 0;
     int pad;
     ssize_t read_size;
@@ -567,6 +610,20 @@ void nand_add_dev(const char *arg)
          */
         if (!read_only)
             atexit_close_fd(rwfd);
+
+        if(rwfd >= 0 && nand_image_probe(rwfd)) {
+            if(!read_only) {
+                XLOG("compressed NAND image %s can only be used read-only\n", rwfilename);
+                exit(1);
+            }
+            rwimage = nand_image_open(rwfd);
+            if(rwimage == NULL) {
+                XLOG("invalid compressed NAND image %s\n", rwfilename);
+                exit(1);
+            }
+            if(dev_size < nand_image_size(rwimage))
+                dev_size = nand_image_size(rwimage);
+        }
     }
 
     if(initfilename) {
@@ -575,7 +632,18 @@ void nand_add_dev(const char *arg)
             XLOG("could not open file %s, %s\n", initfilename, strerror(errno));
             exit(1);
         }
-        if(dev_size == 0) {
+        if(nand_image_probe(initfd)) {
+            /* decompressed into the read-write file below */
+            initimage = nand_image_open(initfd);
+            if(initimage == NULL) {
+                XLOG("invalid compressed NAND image %s\n", initfilename);
+                exit(1);
+            }
+            /* the size passed by the caller may be the compressed one */
+            if(dev_size < nand_image_size(initimage))
+                dev_size = nand_image_size(initimage);
+        }
+        else if(dev_size == 0) {
             dev_size = lseek(initfd, 0, SEEK_END);
             lseek(initfd, 0, SEEK_SET);
         }
@@ -605,7 +673,10 @@ void nand_add_dev(const char *arg)
 
     if (initfd >= 0) {
         do {
-            read_size = do_read(initfd, dev->data, dev->erase_size);
+            if(initimage != NULL)
+                read_size = nand_image_read(initimage, initpos, dev->data, dev->erase_size);
+            else
+                read_size = do_read(initfd, dev->data, dev->erase_size);
             if(read_size < 0) {
                 XLOG("could not read file %s, %s\n", initfilename, strerror(errno));
                 exit(1);
@@ -614,10 +685,13 @@ void nand_add_dev(const char *arg)
                 XLOG("could not write file %s, %s\n", initfilename, strerror(errno));
                 exit(1);
             }
+            initpos += read_size;
         } while(read_size == dev->erase_size);
+        nand_image_close(initimage);
         close(initfd);
     }
     dev->fd = rwfd;
+    dev->image = rwimage;
 
     nand_dev_count++;
 
@@ -0,0 +1,259 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "qemu-common.h"
+#include "goldfish_nand_image.h"
+#include <zlib.h>
+
+/* sanity limits, to reject corrupted headers early */
+#define  NAND_IMAGE_VERSION         1
+#define  NAND_IMAGE_MIN_CHUNK_SIZE  512
+#define  NAND_IMAGE_MAX_CHUNK_SIZE  (4 * 1024 * 1024)
+
+typedef struct {
+    int64_t    chunk;      /* index of cached chunk, -1 if unused */
+    uint32_t   last_use;
+    uint8_t*   data;
+} NandImageCacheEntry;
+
+struct NandImage {
+    int        fd;
+    uint32_t   chunk_size;
+    uint64_t   image_size;
+    uint32_t   chunk_count;
+    uint64_t*  index;
+    uint8_t*   zbuf;       /* compressed data of the chunk being loaded */
+    uint32_t   use_counter;
+    NandImageCacheEntry  cache[NAND_IMAGE_CACHE_CHUNKS];
+};
+
+static uint32_t
+get_le32( const uint8_t*  p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+get_le64( const uint8_t*  p )
+{
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static int
+read_at( int  fd, uint64_t  offset, void*  buf, size_t  size )
+{
+    uint8_t*  p = buf;
+
+    if (lseek(fd, offset, SEEK_SET) != (off_t)offset)
+        return -1;
+
+    while (size > 0) {
+        int  ret = read(fd, p, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p    += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+int
+nand_image_probe( int  fd )
+{
+    char  magic[8];
+
+    if (read_at(fd, 0, magic, sizeof(magic)) < 0)
+        return 0;
+    return !memcmp(magic, NAND_IMAGE_MAGIC, sizeof(magic));
+}
+
+NandImage*
+nand_image_open( int  fd )
+{
+    uint8_t     header[NAND_IMAGE_HEADER_SIZE];
+    uint8_t*    raw_index;
+    NandImage*  img;
+    uint64_t    index_offset, index_size, file_size;
+    off_t       end;
+    uint32_t    n;
+    int         i;
+
+    if (read_at(fd, 0, header, sizeof(header)) < 0 ||
+        memcmp(header, NAND_IMAGE_MAGIC, 8) != 0 ||
+        get_le32(header + 0x08) != NAND_IMAGE_VERSION)
+        return NULL;
+
+    end = lseek(fd, 0, SEEK_END);
+    if (end < 0)
+        return NULL;
+    file_size = end;
+
+    img = qemu_mallocz(sizeof(*img));
+    img->fd          = fd;
+    img->chunk_size  = get_le32(header + 0x0C);
+    img->image_size  = get_le64(header + 0x10);
+    img->chunk_count = get_le32(header + 0x18);
+    index_offset     = get_le64(header + 0x20);
+
+    /* the index has one more entry than there are chunks, and must be in
+     * the file, which bounds the size of what is allocated below */
+    index_size = ((uint64_t)img->chunk_count + 1) * 8;
+
+    if (img->chunk_size < NAND_IMAGE_MIN_CHUNK_SIZE ||
+        img->chunk_size > NAND_IMAGE_MAX_CHUNK_SIZE ||
+        img->chunk_count != img->image_size / img->chunk_size +
+                            (img->image_size % img->chunk_size != 0) ||
+        index_offset < NAND_IMAGE_HEADER_SIZE ||
+        index_offset > file_size ||
+        index_size > file_size - index_offset) {
+        qemu_free(img);
+        return NULL;
+    }
+
+    /* load the index, and check that chunks are in order, in the file,
+     * and not larger than the buffer used to read them */
+    raw_index  = qemu_malloc(index_size);
+    img->index = qemu_malloc(index_size);
+    if (read_at(fd, index_offset, raw_index, index_size) < 0)
+        goto fail;
+
+    for (n = 0; n <= img->chunk_count; n++) {
+        img->index[n] = get_le64(raw_index + 8*(uint64_t)n);
+        if (n > 0 && (img->index[n] < img->index[n-1] ||
+                      img->index[n] - img->index[n-1] > img->chunk_size))
+            goto fail;
+    }
+    if (img->index[img->chunk_count] > file_size)
+        goto fail;
+    qemu_free(raw_index);
+
+    img->zbuf = qemu_malloc(img->chunk_size);
+    for (i = 0; i < NAND_IMAGE_CACHE_CHUNKS; i++) {
+        img->cache[i].chunk = -1;
+        img->cache[i].data  = qemu_malloc(img->chunk_size);
+    }
+    return img;
+
+fail:
+    qemu_free(raw_index);
+    qemu_free(img->index);
+    qemu_free(img);
+    return NULL;
+}
+
+uint64_t
+nand_image_size( NandImage*  img )
+{
+    return img->image_size;
+}
+
+/* size of the uncompressed chunk 'n', only the last one can be partial */
+static uint32_t
+chunk_length( NandImage*  img, uint32_t  n )
+{
+    uint64_t  start = (uint64_t)n * img->chunk_size;
+
+    if (img->image_size - start < img->chunk_size)
+        return img->image_size - start;
+    return img->chunk_size;
+}
+
+static int
+load_chunk( NandImage*  img, uint32_t  n, uint8_t*  dst )
+{
+    uint32_t  zsize = img->index[n+1] - img->index[n];
+    uint32_t  size  = chunk_length(img, n);
+    uLongf    dsize = size;
+
+    if (zsize == size)
+        return read_at(img->fd, img->index[n], dst, size);
+
+    if (read_at(img->fd, img->index[n], img->zbuf, zsize) < 0)
+        return -1;
+    if (uncompress(dst, &dsize, img->zbuf, zsize) != Z_OK || dsize != size)
+        return -1;
+    return 0;
+}
+
+/* return the cached data of chunk 'n', loading it if needed */
+static uint8_t*
+get_chunk( NandImage*  img, uint32_t  n )
+{
+    NandImageCacheEntry*  victim = &img->cache[0];
+    int  i;
+
+    img->use_counter++;
+    for (i = 0; i < NAND_IMAGE_CACHE_CHUNKS; i++) {
+        NandImageCacheEntry*  e = &img->cache[i];
+        if (e->chunk == n) {
+            e->last_use = img->use_counter;
+            return e->data;
+        }
+        if (e->chunk < 0 ||
+            (victim->chunk >= 0 && e->last_use < victim->last_use))
+            victim = e;
+    }
+
+    victim->chunk = -1;
+    if (load_chunk(img, n, victim->data) < 0)
+        return NULL;
+
+    victim->chunk    = n;
+    victim->last_use = img->use_counter;
+    return victim->data;
+}
+
+int
+nand_image_read( NandImage*  img, uint64_t  offset, void*  buf, uint32_t  size )
+{
+    uint8_t*  dst = buf;
+    uint32_t  total = 0;
+
+    if (offset >= img->image_size)
+        return 0;
+    if (size > img->image_size - offset)
+        size = img->image_size - offset;
+
+    while (total < size) {
+        uint32_t  n     = offset / img->chunk_size;
+        uint32_t  start = offset % img->chunk_size;
+        uint32_t  len   = chunk_length(img, n) - start;
+        uint8_t*  data  = get_chunk(img, n);
+
+        if (data == NULL)
+            return -1;
+        if (len > size - total)
+            len = size - total;
+
+        memcpy(dst, data + start, len);
+        dst    += len;
+        offset += len;
+        total  += len;
+    }
+    return total;
+}
+
+void
+nand_image_close( NandImage*  img )
+{
+    int  i;
+
+    if (img == NULL)
+        return;
+
+    for (i = 0; i < NAND_IMAGE_CACHE_CHUNKS; i++)
+        qemu_free(img->cache[i].data);
+    qemu_free(img->zbuf);
+    qemu_free(img->index);
+    qemu_free(img);
+}
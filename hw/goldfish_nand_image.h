@@ -0,0 +1,66 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef NAND_IMAGE_H
+#define NAND_IMAGE_H
+
+#include <stdint.h>
+
+/* A compressed NAND image stores a read-only partition as a sequence of
+ * fixed-size chunks, each one compressed independently with zlib, followed
+ * by an index of their offsets. This allows random access to any byte of
+ * the image by decompressing a single chunk. Recently used chunks are kept
+ * in a small cache, since the guest usually reads a chunk in several
+ * page-sized commands.
+ *
+ * Such images are created from raw ones with android/tools/mknandimage.py.
+ *
+ * All integers are stored in little-endian order. The file layout is:
+ *
+ *   0x00  magic           "ANDNANDZ"
+ *   0x08  version         32-bit, currently 1
+ *   0x0C  chunk_size      32-bit, size of uncompressed chunks
+ *   0x10  image_size      64-bit, size of the uncompressed image
+ *   0x18  chunk_count     32-bit, (image_size + chunk_size - 1) / chunk_size
+ *   0x1C  reserved        32-bit, must be 0
+ *   0x20  index_offset    64-bit, file offset of the chunk index
+ *
+ * The index is made of (chunk_count + 1) 64-bit file offsets: chunk 'i'
+ * occupies the bytes between entries 'i' and 'i + 1'. A chunk whose stored
+ * size equals its uncompressed size is stored as-is.
+ */
+typedef struct NandImage  NandImage;
+
+#define  NAND_IMAGE_MAGIC        "ANDNANDZ"
+#define  NAND_IMAGE_HEADER_SIZE  40
+
+/* number of decompressed chunks kept in the cache */
+#define  NAND_IMAGE_CACHE_CHUNKS  8
+
+/* Return 1 if the file opened as 'fd' is a compressed NAND image */
+int         nand_image_probe( int  fd );
+
+/* Open the compressed NAND image at 'fd', which must remain open until
+ * nand_image_close() is called. Return NULL on error. */
+NandImage*  nand_image_open( int  fd );
+
+/* Return the uncompressed size of an image */
+uint64_t    nand_image_size( NandImage*  img );
+
+/* Read 'size' bytes at 'offset' in the uncompressed image into 'buf'.
+ * Return the number of bytes read, which is less than 'size' only at the
+ * end of the image, or -1 on error. */
+int         nand_image_read( NandImage*  img, uint64_t  offset,
+                             void*  buf, uint32_t  size );
+
+void        nand_image_close( NandImage*  img );
+
+#endif /* NAND_IMAGE_H */
@@ -0,0 +1,374 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* write a synthetic system partition both as a raw file and as a
+ * compressed NAND image, like android/tools/mknandimage.py does, check
+ * reads of the compressed image against the raw data and the rejection
+ * of corrupted headers, then measure sequential and random reads of
+ * 2 KB NAND pages from both files. run with 'make check'.
+ */
+#include "qemu-common.h"
+#include "goldfish_nand_image.h"
+#include <zlib.h>
+#include <sys/time.h>
+
+/* 32 MB partition, 64 KB chunks compressed at level 9, the defaults of
+   mknandimage.py, and the page size of the goldfish NAND device */
+#define  IMAGE_SIZE    (32 * 1024 * 1024 + 12345)
+#define  CHUNK_SIZE    65536
+#define  PAGE_SIZE     2048
+
+#define  NB_CHECKS     20000
+#define  NB_BURSTS     20000
+
+static uint32_t  rand_state = 1;
+static int       errors;
+static uint64_t  index_offset;   /* of the image written by write_image() */
+
+static uint32_t
+next_rand( void )
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+void*  qemu_malloc( size_t  size )  { return malloc(size); }
+void*  qemu_mallocz( size_t  size ) { return calloc(1, size); }
+void   qemu_free( void*  ptr )      { free(ptr); }
+
+static double
+now_secs( void )
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** images
+ **/
+
+/* fill 'data' like a system partition: about 60% code and text, 25%
+ * already compressed files, and 15% free space */
+static void
+make_data( uint8_t*  data, uint32_t  size )
+{
+    static const char  words[][8] = {
+        "the ", "and ", "data ", "init ", "system ", "0x0 ", "\n", "null ",
+        "java/", "lang/", "Object", "String", "; ", "libc.", "so ", "= ",
+    };
+    uint32_t  pos = 0;
+
+    while (pos < size) {
+        uint32_t  len  = 4096 * (1 + next_rand() % 16);
+        uint32_t  kind = next_rand() % 100;
+        uint32_t  i, n;
+
+        if (len > size - pos)
+            len = size - pos;
+
+        if (kind < 60) {
+            for (i = 0; i < len; i += n) {
+                const char*  w = words[next_rand() % 16];
+                n = strlen(w);
+                if (n > len - i)
+                    n = len - i;
+                memcpy(data + pos + i, w, n);
+            }
+            for (i = 0; i < len / 64; i++)
+                data[pos + next_rand() % len] = next_rand();
+        } else if (kind < 85) {
+            for (i = 0; i < len; i++)
+                data[pos + i] = next_rand();
+        } else {
+            memset(data + pos, 0, len);
+        }
+        pos += len;
+    }
+}
+
+static void
+put_le32( uint8_t*  p, uint32_t  v )
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void
+put_le64( uint8_t*  p, uint64_t  v )
+{
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static int
+make_file( void )
+{
+    char  path[] = "/tmp/nand-image-test.XXXXXX";
+    int   fd = mkstemp(path);
+
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(path);
+    return fd;
+}
+
+static void
+write_at( int  fd, uint64_t  offset, const void*  buf, size_t  size )
+{
+    if (pwrite(fd, buf, size, offset) != (ssize_t)size) {
+        perror("pwrite");
+        exit(1);
+    }
+}
+
+/* compress() of mknandimage.py, return the size of the file */
+static uint64_t
+write_image( int  fd, const uint8_t*  data, uint32_t  size )
+{
+    uint32_t  count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    uint8_t   header[NAND_IMAGE_HEADER_SIZE];
+    uint8_t*  index = malloc(8 * (count + 1));
+    uint8_t*  zbuf  = malloc(compressBound(CHUNK_SIZE));
+    uint64_t  offset = NAND_IMAGE_HEADER_SIZE;
+    uint32_t  n;
+
+    for (n = 0; n < count; n++) {
+        const uint8_t*  chunk = data + (uint64_t)n * CHUNK_SIZE;
+        uint32_t        len   = size - n * CHUNK_SIZE;
+        uLongf          zlen  = compressBound(CHUNK_SIZE);
+
+        if (len > CHUNK_SIZE)
+            len = CHUNK_SIZE;
+        compress2(zbuf, &zlen, chunk, len, 9);
+        put_le64(index + 8*n, offset);
+        if (zlen >= len) {
+            write_at(fd, offset, chunk, len);
+            offset += len;
+        } else {
+            write_at(fd, offset, zbuf, zlen);
+            offset += zlen;
+        }
+    }
+    put_le64(index + 8*count, offset);
+    write_at(fd, offset, index, 8 * (count + 1));
+    index_offset = offset;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, NAND_IMAGE_MAGIC, 8);
+    put_le32(header + 0x08, 1);
+    put_le32(header + 0x0C, CHUNK_SIZE);
+    put_le64(header + 0x10, size);
+    put_le32(header + 0x18, count);
+    put_le64(header + 0x20, offset);
+    write_at(fd, 0, header, sizeof(header));
+
+    free(zbuf);
+    free(index);
+    return offset + 8 * (count + 1);
+}
+
+/** checks
+ **/
+
+static void
+check_reads( NandImage*  img, const uint8_t*  data )
+{
+    static uint8_t  buf[3 * CHUNK_SIZE];
+    int  nn;
+
+    if (nand_image_size(img) != IMAGE_SIZE) {
+        fprintf(stderr, "nand_image_test: image size is %llu\n",
+                (unsigned long long)nand_image_size(img));
+        errors++;
+    }
+
+    for (nn = 0; nn < NB_CHECKS && errors < 10; nn++) {
+        uint64_t  offset = next_rand() % (IMAGE_SIZE + 1000);
+        uint32_t  size   = next_rand() % 8 ? next_rand() % 4096
+                                           : next_rand() % sizeof(buf);
+        int       expected = 0;
+        int       ret;
+
+        if (offset < IMAGE_SIZE)
+            expected = (size < IMAGE_SIZE - offset) ? size : IMAGE_SIZE - offset;
+
+        ret = nand_image_read(img, offset, buf, size);
+        if (ret != expected || memcmp(buf, data + offset, expected) != 0) {
+            fprintf(stderr, "nand_image_test: read(%llu, %u) returned %d, "
+                    "expected %d\n", (unsigned long long)offset, size, ret,
+                    expected);
+            errors++;
+        }
+    }
+}
+
+/* corrupt the header field at 'offset', and check that the image is
+ * rejected */
+static void
+check_corrupted( int  fd, int  offset, uint64_t  value, int  size,
+                 const char*  what )
+{
+    uint8_t     saved[8], field[8];
+    NandImage*  img;
+
+    if (pread(fd, saved, size, offset) != size)
+        exit(1);
+    if (size == 4)
+        put_le32(field, value);
+    else
+        put_le64(field, value);
+    write_at(fd, offset, field, size);
+
+    img = nand_image_open(fd);
+    if (img != NULL) {
+        fprintf(stderr, "nand_image_test: image with %s was accepted\n", what);
+        nand_image_close(img);
+        errors++;
+    }
+    write_at(fd, offset, saved, size);
+}
+
+/* corrupt the data of the first chunk, which is compressed: the image
+ * opens, but reads of that chunk fail */
+static void
+check_chunk_data( int  fd )
+{
+    static const uint8_t  garbage[16] = { 0xde, 0xad, 0xbe, 0xef };
+    uint8_t     saved[16], buf[16];
+    NandImage*  img;
+
+    if (pread(fd, saved, sizeof(saved), NAND_IMAGE_HEADER_SIZE) != 16)
+        exit(1);
+    write_at(fd, NAND_IMAGE_HEADER_SIZE, garbage, sizeof(garbage));
+
+    img = nand_image_open(fd);
+    if (img == NULL || nand_image_read(img, 0, buf, sizeof(buf)) != -1) {
+        fprintf(stderr, "nand_image_test: corrupted chunk was read\n");
+        errors++;
+    }
+    nand_image_close(img);
+    write_at(fd, NAND_IMAGE_HEADER_SIZE, saved, sizeof(saved));
+}
+
+/** benchmark
+ **/
+
+/* read 2 KB pages from the raw file like nand_dev_read_file(), or from
+ * the compressed image like nand_dev_read_image(). sequential reads go
+ * through the whole partition, random ones read 1 to 16 consecutive
+ * pages at random places, like the files opened during boot. returns
+ * the time taken in seconds */
+static uint32_t  pages_read;
+
+static double
+run_reads( int  raw_fd, NandImage*  img, int  random )
+{
+    static uint8_t  page[PAGE_SIZE];
+    uint32_t        pages = IMAGE_SIZE / PAGE_SIZE;
+    uint32_t        n, p;
+    double          t0 = now_secs();
+
+    rand_state = 1;
+    pages_read = 0;
+    for (n = 0; n < (random ? NB_BURSTS : 1); n++) {
+        uint32_t  first = random ? next_rand() % pages : 0;
+        uint32_t  count = random ? 1 + next_rand() % 16 : pages;
+
+        if (count > pages - first)
+            count = pages - first;
+
+        for (p = first; p < first + count; p++) {
+            uint64_t  offset = (uint64_t)p * PAGE_SIZE;
+
+            if (img != NULL) {
+                if (nand_image_read(img, offset, page, PAGE_SIZE) != PAGE_SIZE)
+                    errors++;
+            } else {
+                lseek(raw_fd, offset, SEEK_SET);
+                if (read(raw_fd, page, PAGE_SIZE) != PAGE_SIZE)
+                    errors++;
+            }
+            pages_read++;
+        }
+    }
+    return now_secs() - t0;
+}
+
+static void
+bench_reads( int  raw_fd, NandImage*  img, int  random )
+{
+    double  raw, compressed;
+
+    /* warm the host page cache with both files first */
+    run_reads(raw_fd, NULL, random);
+    raw = run_reads(raw_fd, NULL, random);
+    compressed = run_reads(raw_fd, img, random);
+
+    printf("nand_image_test: %s 2 KB reads: %.2f us/page compressed, "
+           "%.2f us/page raw (%.1fx)\n", random ? "random" : "sequential",
+           compressed * 1e6 / pages_read, raw * 1e6 / pages_read,
+           compressed / raw);
+}
+
+int
+main( void )
+{
+    uint8_t*    data = malloc(IMAGE_SIZE);
+    int         raw_fd = make_file();
+    int         img_fd = make_file();
+    uint64_t    img_size;
+    NandImage*  img;
+
+    make_data(data, IMAGE_SIZE);
+    write_at(raw_fd, 0, data, IMAGE_SIZE);
+    img_size = write_image(img_fd, data, IMAGE_SIZE);
+
+    img = nand_image_open(img_fd);
+    if (!nand_image_probe(img_fd) || nand_image_probe(raw_fd) || img == NULL) {
+        fprintf(stderr, "nand_image_test: compressed image not recognized\n");
+        return 1;
+    }
+    check_reads(img, data);
+
+    check_corrupted(img_fd, 0x08, 2, 4, "a bad version");
+    check_corrupted(img_fd, 0x0C, 256, 4, "a small chunk size");
+    check_corrupted(img_fd, 0x18, 0xffffffff, 4, "a bad chunk count");
+    check_corrupted(img_fd, 0x20, img_size, 8, "an index past the end");
+    check_corrupted(img_fd, 0x20, 0xfffffffffffffff0ULL, 8,
+                    "an index offset that overflows");
+    check_corrupted(img_fd, index_offset + 16, NAND_IMAGE_HEADER_SIZE, 8,
+                    "chunks out of order");
+    check_corrupted(img_fd, index_offset + 8 * (IMAGE_SIZE / CHUNK_SIZE + 1),
+                    img_size + 1, 8, "a chunk past the end");
+    check_chunk_data(img_fd);
+
+    if (errors == 0) {
+        printf("nand_image_test: %d MB partition stored in %.1f MB (%.2fx)\n",
+               IMAGE_SIZE >> 20, img_size / 1048576., (double)IMAGE_SIZE / img_size);
+        bench_reads(raw_fd, img, 0);
+        bench_reads(raw_fd, img, 1);
+    }
+
+    nand_image_close(img);
+    close(img_fd);
+    close(raw_fd);
+    free(data);
+
+    if (errors > 0) {
+        fprintf(stderr, "nand_image_test: FAILED\n");
+        return 1;
+    }
+    printf("nand_image_test: OK\n");
+    return 0;
+}
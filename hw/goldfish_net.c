@@ -0,0 +1,513 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* A paravirtual network device for the goldfish bus.
+ *
+ * Contrary to the emulated SMC91C111, packet data never goes through
+ * i/o registers: the guest driver places TX and RX descriptor rings in
+ * its own memory, and the device reads and writes packets directly
+ * from/to the buffers they point to. A single register write can thus
+ * send a whole batch of packets, and interrupts are moderated.
+ *
+ * See docs/ANDROID-GOLDFISH-NET.TXT for the guest driver contract.
+ */
+#include "qemu_file.h"
+#include "qemu-timer.h"
+#include "cpu.h"
+#include "net.h"
+#include "goldfish_device.h"
+
+enum {
+    /* pending interrupt bits. read to get them, write 1s to ack */
+    NET_INT_STATUS      = 0x00,
+    /* mask of interrupt bits that raise the IRQ */
+    NET_INT_ENABLE      = 0x04,
+    /* see NET_CONTROL_XXX below */
+    NET_CONTROL         = 0x08,
+    /* number of descriptors in each ring, must be a power of 2 */
+    NET_RING_SIZE       = 0x0C,
+    /* guest physical addresses of the descriptor rings */
+    NET_TX_RING_ADDR    = 0x10,
+    NET_RX_RING_ADDR    = 0x14,
+    /* guest producer index of the TX ring. writing it starts transmission */
+    NET_TX_HEAD         = 0x18,
+    /* device consumer index of the TX ring */
+    NET_TX_TAIL         = 0x1C,
+    /* guest producer index of the RX ring (number of buffers posted) */
+    NET_RX_HEAD         = 0x20,
+    /* device consumer index of the RX ring (number of buffers filled) */
+    NET_RX_TAIL         = 0x24,
+    /* MAC address, bytes 0..3 and 4..5 */
+    NET_MAC_LOW         = 0x28,
+    NET_MAC_HIGH        = 0x2C,
+    /* interrupt moderation: raise the IRQ once this many packets have
+     * completed, or NET_IRQ_DELAY_USECS after the first of them */
+    NET_IRQ_MAX_PACKETS = 0x30,
+    NET_IRQ_DELAY_USECS = 0x34,
+
+    /* NET_INT_STATUS bits */
+    NET_INT_RX          = 1U << 0,  /* packets received */
+    NET_INT_TX          = 1U << 1,  /* packets sent */
+    NET_INT_RX_NOBUF    = 1U << 2,  /* packet dropped, no RX buffer posted */
+    NET_INT_ERROR       = 1U << 3,  /* bad ring indices, device disabled */
+
+    /* NET_CONTROL bits */
+    NET_CONTROL_ENABLE  = 1U << 0,
+    NET_CONTROL_RESET   = 1U << 1,
+
+    /* descriptor layout, all fields are 32-bit little-endian */
+    NET_DESC_ADDR       = 0x00,
+    NET_DESC_LEN        = 0x04,
+    NET_DESC_FLAGS      = 0x08,
+    NET_DESC_SIZE       = 0x10,
+
+    /* descriptor flags */
+    NET_DESC_MORE       = 1U << 0,   /* TX: packet continues in next descriptor */
+    NET_DESC_ERROR      = 1U << 30,  /* set by device on malformed descriptors */
+    NET_DESC_DONE       = 1U << 31,  /* set by device when processed */
+};
+
+#define  NET_MAX_RING_SIZE   1024
+#define  NET_MAX_FRAGS       16
+#define  NET_MAX_PACKET      65536
+
+struct goldfish_net_state {
+    struct goldfish_device dev;
+    VLANClientState*  vc;
+    uint8_t           macaddr[6];
+
+    uint32_t int_status;
+    uint32_t int_enable;
+    uint32_t control;
+    uint32_t ring_size;
+    uint32_t tx_ring;
+    uint32_t rx_ring;
+    uint32_t tx_head;
+    uint32_t tx_tail;
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    uint32_t irq_max_packets;
+    uint32_t irq_delay_usecs;
+
+    /* number of completions not reported through the IRQ yet */
+    uint32_t    irq_pending_packets;
+    QEMUTimer*  irq_timer;
+
+    /* bounce buffer used when a TX packet can't be mapped directly */
+    uint8_t*    tx_buf;
+};
+
+#define  GOLDFISH_NET_SAVE_VERSION  1
+#define  QFIELD_STRUCT  struct goldfish_net_state
+QFIELD_BEGIN(goldfish_net_fields)
+    QFIELD_INT32(int_status),
+    QFIELD_INT32(int_enable),
+    QFIELD_INT32(control),
+    QFIELD_INT32(ring_size),
+    QFIELD_INT32(tx_ring),
+    QFIELD_INT32(rx_ring),
+    QFIELD_INT32(tx_head),
+    QFIELD_INT32(tx_tail),
+    QFIELD_INT32(rx_head),
+    QFIELD_INT32(rx_tail),
+    QFIELD_INT32(irq_max_packets),
+    QFIELD_INT32(irq_delay_usecs),
+    QFIELD_INT32(irq_pending_packets),
+QFIELD_END
+
+static void goldfish_net_update_irq(struct goldfish_net_state *s)
+{
+    goldfish_device_set_irq(&s->dev, 0, (s->int_status & s->int_enable) != 0);
+}
+
+/* Signal completion of 'count' packets, raising the IRQ now or later
+ * depending on the interrupt moderation settings. */
+static void goldfish_net_complete(struct goldfish_net_state *s, uint32_t bits,
+                                  uint32_t count)
+{
+    uint32_t pending = s->irq_pending_packets;
+
+    s->int_status |= bits;
+    s->irq_pending_packets += count;
+
+    if (s->irq_pending_packets >= s->irq_max_packets || s->irq_delay_usecs == 0) {
+        s->irq_pending_packets = 0;
+        qemu_del_timer(s->irq_timer);
+        goldfish_net_update_irq(s);
+    } else if (pending == 0) {
+        qemu_mod_timer(s->irq_timer, qemu_get_clock(vm_clock) +
+                       muldiv64(s->irq_delay_usecs, get_ticks_per_sec(), 1000000));
+    }
+}
+
+static void goldfish_net_irq_timer(void *opaque)
+{
+    struct goldfish_net_state *s = opaque;
+
+    s->irq_pending_packets = 0;
+    goldfish_net_update_irq(s);
+}
+
+static void goldfish_net_reset(struct goldfish_net_state *s)
+{
+    s->int_status = 0;
+    s->control = 0;
+    s->tx_head = s->tx_tail = 0;
+    s->rx_head = s->rx_tail = 0;
+    s->irq_pending_packets = 0;
+    qemu_del_timer(s->irq_timer);
+    goldfish_net_update_irq(s);
+}
+
+static target_phys_addr_t
+goldfish_net_desc(struct goldfish_net_state *s, uint32_t ring, uint32_t index)
+{
+    return ring + (index & (s->ring_size - 1)) * NET_DESC_SIZE;
+}
+
+static int goldfish_net_ring_valid(struct goldfish_net_state *s)
+{
+    return (s->control & NET_CONTROL_ENABLE) &&
+           s->ring_size != 0 && s->ring_size <= NET_MAX_RING_SIZE &&
+           (s->ring_size & (s->ring_size - 1)) == 0;
+}
+
+/* Returns true if the guest advanced 'head' more than a full ring
+ * past 'tail'. This can only be a driver bug, and trying to process
+ * such a ring would reuse descriptors that were never posted. */
+static int goldfish_net_ring_overrun(struct goldfish_net_state *s,
+                                     uint32_t head, uint32_t tail)
+{
+    return (uint32_t)(head - tail) > s->ring_size;
+}
+
+/* Stop all processing after a guest error, until the next reset or
+ * until the guest re-enables the device with sane indices. */
+static void goldfish_net_fail(struct goldfish_net_state *s)
+{
+    s->control &= ~NET_CONTROL_ENABLE;
+    s->int_status |= NET_INT_ERROR;
+    goldfish_net_update_irq(s);
+}
+
+/* Send one packet made of 'count' descriptors starting at 'first'.
+ * Buffers are mapped directly when possible, so that the packet is
+ * handed to the VLAN without any copy. Returns -1 if the packet is
+ * too large to be sent. */
+static int goldfish_net_send_packet(struct goldfish_net_state *s,
+                                     uint32_t first, int count)
+{
+    struct iovec        iov[NET_MAX_FRAGS];
+    target_phys_addr_t  addrs[NET_MAX_FRAGS];
+    int                 n, mapped;
+    size_t              total = 0;
+
+    for (n = 0; n < count; n++) {
+        target_phys_addr_t  desc = goldfish_net_desc(s, s->tx_ring, first + n);
+        addrs[n]         = ldl_phys(desc + NET_DESC_ADDR);
+        iov[n].iov_len   = ldl_phys(desc + NET_DESC_LEN);
+        total           += iov[n].iov_len;
+    }
+    if (total > NET_MAX_PACKET)
+        return -1;
+
+    for (mapped = 0; mapped < count; mapped++) {
+        target_phys_addr_t  len = iov[mapped].iov_len;
+
+        iov[mapped].iov_base = cpu_physical_memory_map(addrs[mapped], &len, 0);
+        if (iov[mapped].iov_base == NULL || len != iov[mapped].iov_len) {
+            if (iov[mapped].iov_base != NULL)
+                cpu_physical_memory_unmap(iov[mapped].iov_base, len, 0, 0);
+            break;
+        }
+    }
+
+    if (mapped == count) {
+        qemu_sendv_packet(s->vc, iov, count);
+    } else {
+        /* some buffer is not plain RAM, use the slow path */
+        size_t  offset = 0;
+
+        for (n = 0; n < count; n++) {
+            cpu_physical_memory_read(addrs[n], s->tx_buf + offset, iov[n].iov_len);
+            offset += iov[n].iov_len;
+        }
+        qemu_send_packet(s->vc, s->tx_buf, offset);
+    }
+
+    for (n = 0; n < mapped; n++)
+        cpu_physical_memory_unmap(iov[n].iov_base, iov[n].iov_len, 0, iov[n].iov_len);
+    return 0;
+}
+
+/* Send all packets posted by the guest since the last kick */
+static void goldfish_net_do_tx(struct goldfish_net_state *s)
+{
+    int sent = 0;
+
+    if (!goldfish_net_ring_valid(s))
+        return;
+
+    if (goldfish_net_ring_overrun(s, s->tx_head, s->tx_tail)) {
+        goldfish_net_fail(s);
+        return;
+    }
+
+    while (s->tx_tail != s->tx_head) {
+        uint32_t  first = s->tx_tail;
+        uint32_t  flags = 0;
+        int       count = 0;
+        int       n;
+
+        /* collect the descriptors of one packet, including those past
+         * NET_MAX_FRAGS, so that they are not sent as another packet */
+        do {
+            if (first + count == s->tx_head)
+                break;
+            flags = ldl_phys(goldfish_net_desc(s, s->tx_ring, first + count) + NET_DESC_FLAGS);
+            count++;
+        } while (flags & NET_DESC_MORE);
+
+        if (flags & NET_DESC_MORE) {
+            /* incomplete packet, wait for the next kick */
+            break;
+        }
+
+        if (count > NET_MAX_FRAGS ||
+            goldfish_net_send_packet(s, first, count) < 0) {
+            flags = NET_DESC_DONE | NET_DESC_ERROR;
+        } else {
+            flags = NET_DESC_DONE;
+        }
+
+        for (n = 0; n < count; n++)
+            stl_phys(goldfish_net_desc(s, s->tx_ring, first + n) + NET_DESC_FLAGS, flags);
+
+        s->tx_tail += count;
+        sent++;
+    }
+    if (sent)
+        goldfish_net_complete(s, NET_INT_TX, sent);
+}
+
+static int goldfish_net_can_receive(VLANClientState *vc)
+{
+    struct goldfish_net_state *s = vc->opaque;
+
+    return goldfish_net_ring_valid(s) && s->rx_tail != s->rx_head;
+}
+
+static ssize_t goldfish_net_receive(VLANClientState *vc, const uint8_t *buf, size_t size)
+{
+    struct goldfish_net_state *s = vc->opaque;
+    target_phys_addr_t  desc;
+    uint32_t            addr, len;
+
+    if (!goldfish_net_ring_valid(s))
+        return -1;
+
+    if (goldfish_net_ring_overrun(s, s->rx_head, s->rx_tail)) {
+        goldfish_net_fail(s);
+        return -1;
+    }
+
+    if (s->rx_tail == s->rx_head) {
+        s->int_status |= NET_INT_RX_NOBUF;
+        goldfish_net_update_irq(s);
+        return -1;
+    }
+
+    desc = goldfish_net_desc(s, s->rx_ring, s->rx_tail);
+    addr = ldl_phys(desc + NET_DESC_ADDR);
+    len  = ldl_phys(desc + NET_DESC_LEN);
+
+    if (size > len) {
+        stl_phys(desc + NET_DESC_LEN, 0);
+        stl_phys(desc + NET_DESC_FLAGS, NET_DESC_DONE | NET_DESC_ERROR);
+    } else {
+        cpu_physical_memory_write(addr, buf, size);
+        stl_phys(desc + NET_DESC_LEN, size);
+        stl_phys(desc + NET_DESC_FLAGS, NET_DESC_DONE);
+    }
+    s->rx_tail++;
+
+    goldfish_net_complete(s, NET_INT_RX, 1);
+    return size;
+}
+
+static uint32_t goldfish_net_read(void *opaque, target_phys_addr_t offset)
+{
+    struct goldfish_net_state *s = opaque;
+
+    switch (offset) {
+        case NET_INT_STATUS:
+            return s->int_status & s->int_enable;
+        case NET_INT_ENABLE:
+            return s->int_enable;
+        case NET_CONTROL:
+            return s->control;
+        case NET_RING_SIZE:
+            return s->ring_size;
+        case NET_TX_RING_ADDR:
+            return s->tx_ring;
+        case NET_RX_RING_ADDR:
+            return s->rx_ring;
+        case NET_TX_HEAD:
+            return s->tx_head;
+        case NET_TX_TAIL:
+            return s->tx_tail;
+        case NET_RX_HEAD:
+            return s->rx_head;
+        case NET_RX_TAIL:
+            return s->rx_tail;
+        case NET_MAC_LOW:
+            return s->macaddr[0] | (s->macaddr[1] << 8) |
+                   (s->macaddr[2] << 16) | ((uint32_t)s->macaddr[3] << 24);
+        case NET_MAC_HIGH:
+            return s->macaddr[4] | (s->macaddr[5] << 8);
+        case NET_IRQ_MAX_PACKETS:
+            return s->irq_max_packets;
+        case NET_IRQ_DELAY_USECS:
+            return s->irq_delay_usecs;
+        default:
+            cpu_abort(cpu_single_env, "goldfish_net_read: Bad offset %x\n", offset);
+            return 0;
+    }
+}
+
+static void goldfish_net_write(void *opaque, target_phys_addr_t offset, uint32_t val)
+{
+    struct goldfish_net_state *s = opaque;
+
+    switch (offset) {
+        case NET_INT_STATUS:
+            s->int_status &= ~val;
+            goldfish_net_update_irq(s);
+            break;
+        case NET_INT_ENABLE:
+            s->int_enable = val;
+            goldfish_net_update_irq(s);
+            break;
+        case NET_CONTROL:
+            if (val & NET_CONTROL_RESET) {
+                goldfish_net_reset(s);
+                break;
+            }
+            s->control = val;
+            if (goldfish_net_can_receive(s->vc))
+                qemu_flush_queued_packets(s->vc);
+            break;
+        case NET_RING_SIZE:
+            s->ring_size = val;
+            break;
+        case NET_TX_RING_ADDR:
+            s->tx_ring = val;
+            break;
+        case NET_RX_RING_ADDR:
+            s->rx_ring = val;
+            break;
+        case NET_TX_HEAD:
+            s->tx_head = val;
+            goldfish_net_do_tx(s);
+            break;
+        case NET_RX_HEAD:
+            s->rx_head = val;
+            if (goldfish_net_ring_valid(s) &&
+                goldfish_net_ring_overrun(s, s->rx_head, s->rx_tail)) {
+                goldfish_net_fail(s);
+                break;
+            }
+            /* new buffers were posted, deliver what the VLAN queued */
+            if (goldfish_net_can_receive(s->vc))
+                qemu_flush_queued_packets(s->vc);
+            break;
+        case NET_IRQ_MAX_PACKETS:
+            s->irq_max_packets = val ? val : 1;
+            break;
+        case NET_IRQ_DELAY_USECS:
+            s->irq_delay_usecs = val;
+            break;
+        default:
+            cpu_abort(cpu_single_env, "goldfish_net_write: Bad offset %x\n", offset);
+    }
+}
+
+static CPUReadMemoryFunc *goldfish_net_readfn[] = {
+    goldfish_net_read,
+    goldfish_net_read,
+    goldfish_net_read
+};
+
+static CPUWriteMemoryFunc *goldfish_net_writefn[] = {
+    goldfish_net_write,
+    goldfish_net_write,
+    goldfish_net_write
+};
+
+static void goldfish_net_save(QEMUFile *f, void *opaque)
+{
+    struct goldfish_net_state *s = opaque;
+
+    qemu_put_struct(f, goldfish_net_fields, s);
+    qemu_put_timer(f, s->irq_timer);
+}
+
+static int goldfish_net_load(QEMUFile *f, void *opaque, int version_id)
+{
+    struct goldfish_net_state *s = opaque;
+    int ret;
+
+    if (version_id != GOLDFISH_NET_SAVE_VERSION)
+        return -1;
+
+    ret = qemu_get_struct(f, goldfish_net_fields, s);
+    if (ret == 0) {
+        qemu_get_timer(f, s->irq_timer);
+        goldfish_net_update_irq(s);
+    }
+    return ret;
+}
+
+static void goldfish_net_cleanup(VLANClientState *vc)
+{
+    struct goldfish_net_state *s = vc->opaque;
+
+    qemu_free_timer(s->irq_timer);
+    qemu_free(s->tx_buf);
+    qemu_free(s);
+}
+
+void goldfish_net_init(NICInfo *nd, int id)
+{
+    struct goldfish_net_state *s;
+
+    s = (struct goldfish_net_state *)qemu_mallocz(sizeof(*s));
+    s->dev.name = "goldfish_net";
+    s->dev.id = id;
+    s->dev.size = 0x1000;
+    s->dev.irq_count = 1;
+    memcpy(s->macaddr, nd->macaddr, 6);
+
+    s->irq_max_packets = 1;
+    s->irq_timer = qemu_new_timer(vm_clock, goldfish_net_irq_timer, s);
+    s->tx_buf = qemu_malloc(NET_MAX_PACKET);
+
+    goldfish_device_add(&s->dev, goldfish_net_readfn, goldfish_net_writefn, s);
+
+    s->vc = qemu_new_vlan_client(nd->vlan, nd->model, nd->name,
+                                 goldfish_net_can_receive, goldfish_net_receive,
+                                 NULL, goldfish_net_cleanup, s);
+    qemu_format_nic_info_str(s->vc, s->macaddr);
+
+    register_savevm( "goldfish_net", id, GOLDFISH_NET_SAVE_VERSION,
+                     goldfish_net_save, goldfish_net_load, s);
+}
@@ -0,0 +1,926 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check goldfish_net against the contract of docs/ANDROID-GOLDFISH-NET.TXT,
+ * then stream packets through it and through the SMC91C111, both ways,
+ * with a model of each guest driver: the Linux smc91x driver with 32-bit
+ * accesses, and a goldfish_net driver with the default ring settings.
+ * every register access of a driver is an exit from translated code in
+ * the emulator, which is what limited the guest throughput, so they are
+ * counted along with the interrupts. guest memory, the VLAN, the timers
+ * and the buses are provided below. run with 'make check'.
+ */
+#include "qemu_file.h"
+#include "qemu-timer.h"
+#include "cpu.h"
+#include "net.h"
+#include "sysbus.h"
+#include "goldfish_device.h"
+#include <sys/time.h>
+
+/* from hw/goldfish_net.c */
+enum {
+    NET_INT_STATUS      = 0x00,
+    NET_INT_ENABLE      = 0x04,
+    NET_CONTROL         = 0x08,
+    NET_RING_SIZE       = 0x0C,
+    NET_TX_RING_ADDR    = 0x10,
+    NET_RX_RING_ADDR    = 0x14,
+    NET_TX_HEAD         = 0x18,
+    NET_TX_TAIL         = 0x1C,
+    NET_RX_HEAD         = 0x20,
+    NET_RX_TAIL         = 0x24,
+    NET_IRQ_MAX_PACKETS = 0x30,
+    NET_IRQ_DELAY_USECS = 0x34,
+
+    NET_INT_RX          = 1U << 0,
+    NET_INT_TX          = 1U << 1,
+    NET_INT_RX_NOBUF    = 1U << 2,
+    NET_INT_ERROR       = 1U << 3,
+
+    NET_CONTROL_ENABLE  = 1U << 0,
+    NET_CONTROL_RESET   = 1U << 1,
+
+    NET_DESC_ADDR       = 0x00,
+    NET_DESC_LEN        = 0x04,
+    NET_DESC_FLAGS      = 0x08,
+    NET_DESC_SIZE       = 0x10,
+
+    NET_DESC_MORE       = 1U << 0,
+    NET_DESC_ERROR      = 1U << 30,
+    NET_DESC_DONE       = 1U << 31,
+};
+
+static int errors;
+
+#define  CHECK(cond)  do { if (!(cond)) { \
+        fprintf(stderr, "goldfish_net_test:%d: %s\n", __LINE__, #cond); \
+        errors++; } } while (0)
+
+void*  qemu_malloc( size_t  size )  { return malloc(size); }
+void*  qemu_mallocz( size_t  size ) { return calloc(1, size); }
+void   qemu_free( void*  ptr )      { free(ptr); }
+
+/** guest memory: RAM at 0, and a buffer at IO_BASE which can't be mapped,
+ ** like device memory
+ **/
+
+#define  RAM_SIZE  (4 * 1024 * 1024)
+#define  IO_BASE   0x10000000
+#define  IO_SIZE   65536
+
+static uint8_t  ram[RAM_SIZE];
+static uint8_t  io_mem[IO_SIZE];
+
+static uint8_t*
+guest_ptr( target_phys_addr_t  addr, target_phys_addr_t  len )
+{
+    if (addr + len <= RAM_SIZE)
+        return ram + addr;
+    if (addr >= IO_BASE && addr + len <= IO_BASE + IO_SIZE)
+        return io_mem + addr - IO_BASE;
+    fprintf(stderr, "goldfish_net_test: access to 0x%x\n", (unsigned)addr);
+    abort();
+}
+
+uint32_t
+ldl_phys( target_phys_addr_t  addr )
+{
+    uint8_t*  p = guest_ptr(addr, 4);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void
+stl_phys( target_phys_addr_t  addr, uint32_t  val )
+{
+    uint8_t*  p = guest_ptr(addr, 4);
+    p[0] = val; p[1] = val >> 8; p[2] = val >> 16; p[3] = val >> 24;
+}
+
+void
+cpu_physical_memory_rw( target_phys_addr_t  addr, uint8_t*  buf, int  len,
+                        int  is_write )
+{
+    if (is_write)
+        memcpy(guest_ptr(addr, len), buf, len);
+    else
+        memcpy(buf, guest_ptr(addr, len), len);
+}
+
+void*
+cpu_physical_memory_map( target_phys_addr_t  addr, target_phys_addr_t*  plen,
+                         int  is_write )
+{
+    if (addr >= RAM_SIZE)
+        return NULL;
+    if (addr + *plen > RAM_SIZE)
+        *plen = RAM_SIZE - addr;
+    return ram + addr;
+}
+
+void
+cpu_physical_memory_unmap( void*  buffer, target_phys_addr_t  len,
+                           int  is_write, target_phys_addr_t  access_len )
+{
+}
+
+/** simulated timers, in ns of vm_clock
+ **/
+
+struct QEMUTimer {
+    QEMUTimerCB*  cb;
+    void*         opaque;
+    int64_t       expire_time;
+    int           pending;
+};
+
+static QEMUTimer  timers[2];
+static int        num_timers;
+static int64_t    sim_now;
+QEMUClock*        vm_clock;
+
+int64_t    qemu_get_clock( QEMUClock*  clock ) { return sim_now; }
+void       qemu_free_timer( QEMUTimer*  ts )   { ts->pending = 0; }
+void       qemu_del_timer( QEMUTimer*  ts )    { ts->pending = 0; }
+void       qemu_put_timer( QEMUFile*  f, QEMUTimer*  ts ) {}
+void       qemu_get_timer( QEMUFile*  f, QEMUTimer*  ts ) {}
+
+QEMUTimer*
+qemu_new_timer( QEMUClock*  clock, QEMUTimerCB*  cb, void*  opaque )
+{
+    QEMUTimer*  ts = &timers[num_timers++];
+
+    ts->cb      = cb;
+    ts->opaque  = opaque;
+    ts->pending = 0;
+    return ts;
+}
+
+void
+qemu_mod_timer( QEMUTimer*  ts, int64_t  expire_time )
+{
+    ts->expire_time = expire_time;
+    ts->pending     = 1;
+}
+
+uint64_t
+muldiv64( uint64_t  a, uint32_t  b, uint32_t  c )
+{
+    return a / c * b + (a % c) * b / c;
+}
+
+/* advance the clock by 'ns', running the expired timers */
+static void
+run_timers( int64_t  ns )
+{
+    int  nn;
+
+    sim_now += ns;
+    for (nn = 0; nn < num_timers; nn++) {
+        QEMUTimer*  ts = &timers[nn];
+        if (ts->pending && ts->expire_time <= sim_now) {
+            ts->pending = 0;
+            ts->cb(ts->opaque);
+        }
+    }
+}
+
+/** the rest of the emulator
+ **/
+
+CPUState*  cpu_single_env;
+
+void
+cpu_abort( CPUState*  env, const char*  fmt, ... )
+{
+    fprintf(stderr, "goldfish_net_test: cpu_abort: %s\n", fmt);
+    abort();
+}
+
+void
+hw_error( const char*  fmt, ... )
+{
+    fprintf(stderr, "goldfish_net_test: hw_error: %s\n", fmt);
+    abort();
+}
+
+int
+register_savevm( const char*  idstr, int  instance_id, int  version_id,
+                 SaveStateHandler*  save_state, LoadStateHandler*  load_state,
+                 void*  opaque )
+{
+    return 0;
+}
+
+void qemu_put_struct( QEMUFile*  f, const QField*  fields, const void*  s ) {}
+int  qemu_get_struct( QEMUFile*  f, const QField*  fields, void*  s ) { return 0; }
+
+/* interrupt lines, counting rising edges */
+struct IRQState {
+    int  level;
+};
+
+static struct IRQState  gf_irq, smc_irq;
+static int64_t          num_irqs;
+
+static void
+set_irq( struct IRQState*  irq, int  level )
+{
+    if (level && !irq->level)
+        num_irqs++;
+    irq->level = level;
+}
+
+void qemu_set_irq( qemu_irq  irq, int  level ) { set_irq(irq, level); }
+
+/* the goldfish bus */
+static CPUReadMemoryFunc**   gf_readfn;
+static CPUWriteMemoryFunc**  gf_writefn;
+static void*                 gf_opaque;
+
+int
+goldfish_device_add( struct goldfish_device*  dev,
+                     CPUReadMemoryFunc**  mem_read,
+                     CPUWriteMemoryFunc**  mem_write,
+                     void*  opaque )
+{
+    gf_readfn  = mem_read;
+    gf_writefn = mem_write;
+    gf_opaque  = opaque;
+    return 0;
+}
+
+void
+goldfish_device_set_irq( struct goldfish_device*  dev, int  irq, int  level )
+{
+    set_irq(&gf_irq, level);
+}
+
+/* the system bus, for the SMC91C111 */
+static sysbus_initfn         smc_initfn;
+static size_t                smc_size;
+static CPUReadMemoryFunc**   smc_readfn;
+static CPUWriteMemoryFunc**  smc_writefn;
+static void*                 smc_opaque;
+
+void
+register_module_init( void (*fn)(void), module_init_type  type )
+{
+    fn();
+}
+
+void
+sysbus_register_dev( const char*  name, size_t  size, sysbus_initfn  init )
+{
+    smc_initfn = init;
+    smc_size   = size;
+}
+
+void
+sysbus_init_mmio( SysBusDevice*  dev, target_phys_addr_t  size, int  iofunc )
+{
+}
+
+void
+sysbus_init_irq( SysBusDevice*  dev, qemu_irq*  p )
+{
+    *p = &smc_irq;
+}
+
+int
+cpu_register_io_memory( CPUReadMemoryFunc**  mem_read,
+                        CPUWriteMemoryFunc**  mem_write, void*  opaque )
+{
+    smc_readfn  = mem_read;
+    smc_writefn = mem_write;
+    smc_opaque  = opaque;
+    return 1;
+}
+
+void cpu_unregister_io_memory( int  table_address ) {}
+
+void
+qdev_get_macaddr( DeviceState*  dev, uint8_t*  macaddr )
+{
+    static const uint8_t  mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+    memcpy(macaddr, mac, 6);
+}
+
+/* only used by smc91c111_init(), which the test does not call */
+void qemu_check_nic_model( NICInfo*  nd, const char*  model ) {}
+DeviceState*  qdev_create( BusState*  bus, const char*  name ) { return NULL; }
+void qdev_set_netdev( DeviceState*  dev, NICInfo*  nd ) {}
+void qdev_init( DeviceState*  dev ) {}
+void sysbus_mmio_map( SysBusDevice*  dev, int  n, target_phys_addr_t  addr ) {}
+void sysbus_connect_irq( SysBusDevice*  dev, int  n, qemu_irq  irq ) {}
+
+/* the VLAN: packets sent by the NICs are checked against 'tx_expected' */
+static VLANClientState*  gf_vc;
+static VLANClientState*  smc_vc;
+static const uint8_t*  tx_expected;
+static int             tx_expected_size;
+static int64_t         tx_packets;
+static int64_t         tx_copied;       /* packets sent from a bounce buffer */
+
+static VLANClientState*
+new_client( NetCanReceive*  can_receive, NetReceive*  receive, void*  opaque )
+{
+    VLANClientState*  vc = qemu_mallocz(sizeof(*vc));
+
+    vc->can_receive = can_receive;
+    vc->receive     = receive;
+    vc->opaque      = opaque;
+    return vc;
+}
+
+VLANClientState*
+qemu_new_vlan_client( VLANState*  vlan, const char*  model, const char*  name,
+                      NetCanReceive*  can_receive, NetReceive*  receive,
+                      NetReceiveIOV*  receive_iov, NetCleanup*  cleanup,
+                      void*  opaque )
+{
+    gf_vc = new_client(can_receive, receive, opaque);
+    return gf_vc;
+}
+
+VLANClientState*
+qdev_get_vlan_client( DeviceState*  dev, NetCanReceive*  can_receive,
+                      NetReceive*  receive, NetReceiveIOV*  receive_iov,
+                      NetCleanup*  cleanup, void*  opaque )
+{
+    smc_vc = new_client(can_receive, receive, opaque);
+    return smc_vc;
+}
+
+void qemu_format_nic_info_str( VLANClientState*  vc, uint8_t  macaddr[6] ) {}
+void qemu_flush_queued_packets( VLANClientState*  vc ) {}
+
+static void
+check_sent( const uint8_t*  buf, int  size )
+{
+    if (tx_expected && (size != tx_expected_size ||
+                        memcmp(buf, tx_expected, size) != 0)) {
+        fprintf(stderr, "goldfish_net_test: wrong %d-byte packet sent\n", size);
+        errors++;
+    }
+    tx_packets++;
+}
+
+ssize_t
+qemu_sendv_packet( VLANClientState*  vc, const struct iovec*  iov, int  iovcnt )
+{
+    static uint8_t  buf[65536];
+    size_t          size = 0;
+    int             n;
+
+    for (n = 0; n < iovcnt; n++) {
+        if (tx_expected)
+            memcpy(buf + size, iov[n].iov_base, iov[n].iov_len);
+        size += iov[n].iov_len;
+    }
+    check_sent(buf, size);
+    return size;
+}
+
+void
+qemu_send_packet( VLANClientState*  vc, const uint8_t*  buf, int  size )
+{
+    check_sent(buf, size);
+    tx_copied++;
+}
+
+/** goldfish_net guest driver
+ **/
+
+#define  GF_RING_SIZE   256
+#define  GF_TX_RING     0x1000
+#define  GF_RX_RING     0x2000
+#define  GF_TX_BUFS     0x10000
+#define  GF_RX_BUFS     0x90000
+#define  GF_BUF_SIZE    2048
+
+static int64_t           mmio_exits;
+static uint32_t          gf_tx_head, gf_tx_clean;
+static uint32_t          gf_rx_head, gf_rx_clean;
+static int64_t           gf_rx_packets;
+static const uint8_t*    rx_expected;
+static int               rx_expected_size;
+
+static uint32_t
+gf_read( uint32_t  offset )
+{
+    mmio_exits++;
+    return gf_readfn[2](gf_opaque, offset);
+}
+
+static void
+gf_write( uint32_t  offset, uint32_t  val )
+{
+    mmio_exits++;
+    gf_writefn[2](gf_opaque, offset, val);
+}
+
+static target_phys_addr_t
+gf_desc( uint32_t  ring, uint32_t  index )
+{
+    return ring + (index & (GF_RING_SIZE - 1)) * NET_DESC_SIZE;
+}
+
+static void
+gf_post_rx( uint32_t  index, uint32_t  len )
+{
+    target_phys_addr_t  desc = gf_desc(GF_RX_RING, index);
+
+    stl_phys(desc + NET_DESC_ADDR, GF_RX_BUFS + (index & (GF_RING_SIZE-1)) * GF_BUF_SIZE);
+    stl_phys(desc + NET_DESC_LEN, len);
+    stl_phys(desc + NET_DESC_FLAGS, 0);
+}
+
+static void
+gf_open( uint32_t  max_packets, uint32_t  delay_usecs )
+{
+    gf_write(NET_CONTROL, NET_CONTROL_RESET);
+    gf_write(NET_RING_SIZE, GF_RING_SIZE);
+    gf_write(NET_TX_RING_ADDR, GF_TX_RING);
+    gf_write(NET_RX_RING_ADDR, GF_RX_RING);
+    gf_write(NET_IRQ_MAX_PACKETS, max_packets);
+    gf_write(NET_IRQ_DELAY_USECS, delay_usecs);
+    gf_write(NET_INT_ENABLE, NET_INT_RX | NET_INT_TX | NET_INT_RX_NOBUF |
+                             NET_INT_ERROR);
+    gf_write(NET_CONTROL, NET_CONTROL_ENABLE);
+
+    gf_tx_head = gf_tx_clean = 0;
+    for (gf_rx_head = 0; gf_rx_head < GF_RING_SIZE; gf_rx_head++)
+        gf_post_rx(gf_rx_head, GF_BUF_SIZE);
+    gf_rx_clean = 0;
+    gf_write(NET_RX_HEAD, gf_rx_head);
+}
+
+/* the interrupt handler: reclaim sent buffers, pass received packets up
+ * and post their buffers again */
+static void
+gf_interrupt( void )
+{
+    uint32_t  status = gf_read(NET_INT_STATUS);
+
+    gf_write(NET_INT_STATUS, status);
+
+    if (status & NET_INT_TX) {
+        uint32_t  tail = gf_read(NET_TX_TAIL);
+        for ( ; gf_tx_clean != tail; gf_tx_clean++) {
+            uint32_t  flags = ldl_phys(gf_desc(GF_TX_RING, gf_tx_clean) + NET_DESC_FLAGS);
+            if ((flags & (NET_DESC_DONE | NET_DESC_ERROR)) != NET_DESC_DONE)
+                errors++;
+        }
+    }
+    if (status & NET_INT_RX) {
+        uint32_t  tail = gf_read(NET_RX_TAIL);
+        for ( ; gf_rx_clean != tail; gf_rx_clean++) {
+            target_phys_addr_t  desc = gf_desc(GF_RX_RING, gf_rx_clean);
+            uint32_t  len   = ldl_phys(desc + NET_DESC_LEN);
+            uint32_t  flags = ldl_phys(desc + NET_DESC_FLAGS);
+
+            if (flags != NET_DESC_DONE || len != (uint32_t)rx_expected_size ||
+                (rx_expected &&
+                 memcmp(ram + ldl_phys(desc + NET_DESC_ADDR), rx_expected, len))) {
+                fprintf(stderr, "goldfish_net_test: wrong packet received\n");
+                errors++;
+            }
+            gf_rx_packets++;
+            gf_post_rx(gf_rx_head++, GF_BUF_SIZE);
+        }
+        gf_write(NET_RX_HEAD, gf_rx_head);
+    }
+}
+
+static void
+gf_poll_irq( void )
+{
+    while (gf_irq.level)
+        gf_interrupt();
+}
+
+/* ndo_start_xmit(): one descriptor per packet, and a TX_HEAD write */
+static void
+gf_xmit( const uint8_t*  pkt, int  size )
+{
+    target_phys_addr_t  desc;
+    uint32_t            buf;
+
+    while (gf_tx_head - gf_tx_clean == GF_RING_SIZE) {
+        /* queue stopped until the TX interrupt */
+        run_timers(1000);
+        gf_poll_irq();
+    }
+    desc = gf_desc(GF_TX_RING, gf_tx_head);
+    buf  = GF_TX_BUFS + (gf_tx_head & (GF_RING_SIZE-1)) * GF_BUF_SIZE;
+    memcpy(ram + buf, pkt, size);
+    stl_phys(desc + NET_DESC_ADDR, buf);
+    stl_phys(desc + NET_DESC_LEN, size);
+    stl_phys(desc + NET_DESC_FLAGS, 0);
+    gf_write(NET_TX_HEAD, ++gf_tx_head);
+    gf_poll_irq();
+}
+
+/** SMC91C111 guest driver: what the Linux smc91x driver does with 32-bit
+ ** accesses, with bank 2 selected between calls
+ **/
+
+static int64_t  smc_rx_packets;
+
+static uint32_t
+smc_read( int  size, uint32_t  offset )
+{
+    mmio_exits++;
+    return smc_readfn[size >> 1](smc_opaque, offset);
+}
+
+static void
+smc_write( int  size, uint32_t  offset, uint32_t  val )
+{
+    mmio_exits++;
+    smc_writefn[size >> 1](smc_opaque, offset, val);
+}
+
+static void
+smc_open( void )
+{
+    SysBusDevice*  dev = qemu_mallocz(smc_size);
+
+    smc_initfn(dev);
+
+    smc_write(2, 14, 0);
+    smc_write(2, 0, 0x0081);        /* TCR: TXEN | PAD_EN */
+    smc_write(2, 4, 0x0300);        /* RCR: RXEN | STRIP_CRC */
+    smc_write(2, 14, 1);
+    smc_write(2, 12, 0x0800 | 0x1210);  /* CTR: AUTO_RELEASE */
+    smc_write(2, 14, 2);
+    smc_write(1, 13, 0x01);         /* mask: RCV */
+}
+
+/* smc_hard_start_xmit() and smc_hardware_send_pkt() */
+static void
+smc_xmit( const uint8_t*  pkt, int  size )
+{
+    uint32_t  packet;
+    int       n;
+
+    smc_write(2, 0, 0x20);          /* MMU: allocate for TX */
+    if (!(smc_read(1, 12) & 0x08))  /* INT_ALLOC */
+        errors++;
+    packet = smc_read(1, 3);        /* allocation result */
+    smc_write(1, 12, 0x08);         /* ack INT_ALLOC */
+    smc_write(1, 2, packet);        /* packet number */
+    smc_write(2, 6, 0x4000);        /* pointer: auto-increment */
+    smc_write(4, 8, (size + 6) << 16);  /* status word, byte count */
+    for (n = 0; n + 4 <= size; n += 4)
+        smc_write(4, 8, pkt[n] | (pkt[n+1] << 8) | (pkt[n+2] << 16) |
+                        ((uint32_t)pkt[n+3] << 24));
+    if (size - n >= 2) {
+        smc_write(2, 8, pkt[n] | (pkt[n+1] << 8));
+        n += 2;
+    }
+    if (n < size)
+        smc_write(2, 8, pkt[n] | (0x20 << 8));  /* odd byte, control */
+    else
+        smc_write(2, 8, 0);                     /* control */
+    smc_write(2, 0, 0xc0);          /* MMU: enqueue */
+}
+
+/* smc_interrupt() and smc_rcv() */
+static void
+smc_interrupt( void )
+{
+    static uint8_t  buf[2048];
+    uint32_t  saved_bank = smc_read(2, 14);
+    uint32_t  saved_ptr, mask;
+
+    smc_write(2, 14, 2);
+    saved_ptr = smc_read(2, 6);
+    mask = smc_read(1, 13);
+    smc_write(1, 13, 0);
+
+    while (smc_read(1, 12) & mask & 0x01) {
+        uint32_t  fifo = smc_read(2, 4);
+        uint32_t  v, len;
+        int       n;
+
+        if (fifo & 0x8000)
+            break;
+        smc_write(2, 6, 0xe000);    /* pointer: RCV | AUTOINC | READ */
+        v   = smc_read(4, 8);
+        len = (v >> 16) - 6;
+        for (n = 0; n < (int)len + 2; n += 4) {
+            uint32_t  w = smc_read(4, 8);
+            memcpy(buf + n, &w, 4);
+        }
+        if (buf[len + 1] & 0x20)
+            len++;
+        if ((int)len != rx_expected_size ||
+            (rx_expected && memcmp(buf, rx_expected, len) != 0)) {
+            fprintf(stderr, "goldfish_net_test: wrong smc packet received\n");
+            errors++;
+        }
+        smc_rx_packets++;
+        smc_write(2, 0, 0x80);      /* MMU: remove and release */
+    }
+
+    smc_write(1, 13, mask);
+    smc_write(2, 6, saved_ptr);
+    smc_write(2, 14, saved_bank);
+}
+
+static void
+smc_poll_irq( void )
+{
+    while (smc_irq.level)
+        smc_interrupt();
+}
+
+/** contract checks
+ **/
+
+static uint8_t  packet[65536 + 1];
+
+static void
+make_packet( int  size )
+{
+    int  n;
+
+    for (n = 0; n < size; n++)
+        packet[n] = n * 7 + size;
+    tx_expected      = packet;
+    tx_expected_size = size;
+    rx_expected      = packet;
+    rx_expected_size = size;
+}
+
+static void
+put_tx_desc( uint32_t  index, uint32_t  addr, uint32_t  len, uint32_t  flags )
+{
+    target_phys_addr_t  desc = gf_desc(GF_TX_RING, index);
+
+    stl_phys(desc + NET_DESC_ADDR, addr);
+    stl_phys(desc + NET_DESC_LEN, len);
+    stl_phys(desc + NET_DESC_FLAGS, flags);
+}
+
+static void
+check_tx( void )
+{
+    uint32_t  n;
+
+    gf_open(1, 0);
+    make_packet(1514);
+
+    /* one packet, one interrupt */
+    tx_packets = num_irqs = 0;
+    gf_xmit(packet, 1514);
+    CHECK(tx_packets == 1 && tx_copied == 0 && num_irqs == 1);
+    CHECK(gf_tx_clean == 1 && !gf_irq.level);
+
+    /* a packet in 3 fragments is only sent once its last one is posted */
+    memcpy(ram + 0x100000, packet, 1000);
+    memcpy(ram + 0x110000, packet + 1000, 14);
+    memcpy(ram + 0x120000, packet + 1014, 500);
+    put_tx_desc(gf_tx_head,     0x100000, 1000, NET_DESC_MORE);
+    put_tx_desc(gf_tx_head + 1, 0x110000, 14,   NET_DESC_MORE);
+    put_tx_desc(gf_tx_head + 2, 0x120000, 500,  0);
+    gf_write(NET_TX_HEAD, gf_tx_head + 2);
+    CHECK(tx_packets == 1 && gf_read(NET_TX_TAIL) == gf_tx_head);
+    gf_tx_head += 3;
+    gf_write(NET_TX_HEAD, gf_tx_head);
+    CHECK(tx_packets == 2 && tx_copied == 0);
+    for (n = gf_tx_head - 3; n != gf_tx_head; n++)
+        CHECK(ldl_phys(gf_desc(GF_TX_RING, n) + NET_DESC_FLAGS) == NET_DESC_DONE);
+    gf_poll_irq();
+
+    /* a fragment that can't be mapped goes through the bounce buffer */
+    memcpy(io_mem, packet + 1000, 514);
+    put_tx_desc(gf_tx_head,     0x100000, 1000, NET_DESC_MORE);
+    put_tx_desc(gf_tx_head + 1, IO_BASE,  514,  0);
+    gf_tx_head += 2;
+    gf_write(NET_TX_HEAD, gf_tx_head);
+    CHECK(tx_packets == 3 && tx_copied == 1);
+    gf_poll_irq();
+
+    /* packets too large, or with too many fragments, are flagged */
+    put_tx_desc(gf_tx_head, 0x100000, 65537, 0);
+    gf_write(NET_TX_HEAD, ++gf_tx_head);
+    CHECK(tx_packets == 3);
+    CHECK(ldl_phys(gf_desc(GF_TX_RING, gf_tx_head - 1) + NET_DESC_FLAGS) ==
+          (NET_DESC_DONE | NET_DESC_ERROR));
+    for (n = 0; n < 17; n++)
+        put_tx_desc(gf_tx_head + n, 0x100000, 64, n < 16 ? NET_DESC_MORE : 0);
+    gf_tx_head += 17;
+    gf_write(NET_TX_HEAD, gf_tx_head);
+    CHECK(tx_packets == 3 && gf_read(NET_TX_TAIL) == gf_tx_head);
+    for (n = gf_tx_head - 17; n != gf_tx_head; n++)
+        CHECK(ldl_phys(gf_desc(GF_TX_RING, n) + NET_DESC_FLAGS) ==
+              (NET_DESC_DONE | NET_DESC_ERROR));
+    gf_write(NET_INT_STATUS, ~0U);
+    gf_tx_clean = gf_tx_head;
+
+    /* a head more than a ring past the tail disables the device */
+    gf_write(NET_TX_HEAD, gf_tx_head + GF_RING_SIZE + 1);
+    CHECK((gf_read(NET_INT_STATUS) & NET_INT_ERROR) && gf_irq.level);
+    CHECK(!(gf_read(NET_CONTROL) & NET_CONTROL_ENABLE));
+}
+
+static void
+check_rx( void )
+{
+    target_phys_addr_t  desc;
+
+    gf_open(1, 0);
+    make_packet(1514);
+
+    gf_rx_packets = 0;
+    CHECK(gf_vc->can_receive(gf_vc));
+    CHECK(gf_vc->receive(gf_vc, packet, 1514) == 1514);
+    gf_poll_irq();
+    CHECK(gf_rx_packets == 1 && gf_read(NET_RX_TAIL) == 1);
+
+    /* a packet larger than the posted buffer is dropped */
+    desc = gf_desc(GF_RX_RING, gf_rx_clean);
+    stl_phys(desc + NET_DESC_LEN, 1000);
+    gf_vc->receive(gf_vc, packet, 1514);
+    CHECK(ldl_phys(desc + NET_DESC_FLAGS) == (NET_DESC_DONE | NET_DESC_ERROR));
+    CHECK(ldl_phys(desc + NET_DESC_LEN) == 0);
+    gf_write(NET_INT_STATUS, ~0U);
+    gf_rx_clean++;
+    gf_post_rx(gf_rx_head++, GF_BUF_SIZE);
+    gf_write(NET_RX_HEAD, gf_rx_head);
+
+    /* without buffers, the device refuses packets */
+    gf_write(NET_CONTROL, NET_CONTROL_RESET);
+    gf_write(NET_CONTROL, NET_CONTROL_ENABLE);
+    CHECK(!gf_vc->can_receive(gf_vc));
+    CHECK(gf_vc->receive(gf_vc, packet, 1514) < 0);
+    CHECK(gf_read(NET_INT_STATUS) == NET_INT_RX_NOBUF && gf_irq.level);
+    gf_write(NET_INT_STATUS, NET_INT_RX_NOBUF);
+    CHECK(!gf_irq.level);
+
+    /* posting more than a ring of buffers disables the device */
+    gf_write(NET_RX_HEAD, GF_RING_SIZE + 1);
+    CHECK((gf_read(NET_INT_STATUS) & NET_INT_ERROR) && gf_irq.level);
+    CHECK(!gf_vc->can_receive(gf_vc));
+}
+
+static void
+check_moderation( void )
+{
+    int  n;
+
+    /* at most 4 packets per interrupt, or 100 us after the first one */
+    gf_open(4, 100);
+    make_packet(1514);
+    gf_rx_packets = 0;
+
+    for (n = 0; n < 3; n++)
+        gf_vc->receive(gf_vc, packet, 1514);
+    CHECK(!gf_irq.level);
+    gf_vc->receive(gf_vc, packet, 1514);
+    CHECK(gf_irq.level);
+    gf_poll_irq();
+    CHECK(gf_rx_packets == 4);
+
+    gf_vc->receive(gf_vc, packet, 1514);
+    run_timers(99999);
+    CHECK(!gf_irq.level);
+    run_timers(1);
+    CHECK(gf_irq.level);
+    gf_poll_irq();
+    CHECK(gf_rx_packets == 5);
+
+    /* a batch of TX packets counts once per packet */
+    for (n = 0; n < 4; n++)
+        put_tx_desc(gf_tx_head + n, 0x100000, 64, 0);
+    tx_expected = NULL;
+    gf_tx_head += 4;
+    gf_write(NET_TX_HEAD, gf_tx_head);
+    CHECK(gf_irq.level);
+    gf_poll_irq();
+}
+
+/** benchmark
+ **/
+
+#define  NB_PACKETS   100000
+#define  BURST        64
+
+static double
+now_secs( void )
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+typedef struct {
+    double  exits;
+    double  irqs;
+    double  ns;
+} PathCost;
+
+/* stream NB_PACKETS packets of 'size' bytes through a NIC, from the guest
+ * if 'tx' is set, to it otherwise. goldfish_net raises an interrupt every
+ * 32 packets, or 100 us after the first one. the link idles for 100 us
+ * after each burst of packets. */
+static void
+run_path( int  smc, int  tx, int  size, PathCost*  cost )
+{
+    double  t0;
+    int     n;
+
+    make_packet(size);
+    tx_expected = NULL;     /* only the contract checks compare packets */
+    rx_expected = NULL;
+    if (smc)
+        smc_open();
+    else
+        gf_open(32, 100);
+
+    mmio_exits = num_irqs = 0;
+    tx_packets = gf_rx_packets = smc_rx_packets = 0;
+
+    t0 = now_secs();
+    for (n = 0; n < NB_PACKETS; n++) {
+        if (smc) {
+            if (tx)
+                smc_xmit(packet, size);
+            else if (smc_vc->can_receive(smc_vc))
+                smc_vc->receive(smc_vc, packet, size);
+            smc_poll_irq();
+        } else {
+            if (tx)
+                gf_xmit(packet, size);
+            else if (gf_vc->can_receive(gf_vc))
+                gf_vc->receive(gf_vc, packet, size);
+            gf_poll_irq();
+            if ((n + 1) % BURST == 0) {
+                run_timers(100000);
+                gf_poll_irq();
+            }
+        }
+    }
+    cost->ns = (now_secs() - t0) * 1e9 / NB_PACKETS;
+
+    if ((tx ? tx_packets : smc ? smc_rx_packets : gf_rx_packets) != NB_PACKETS) {
+        fprintf(stderr, "goldfish_net_test: packets were lost\n");
+        errors++;
+    }
+    cost->exits = (double)mmio_exits / NB_PACKETS;
+    cost->irqs  = (double)num_irqs / NB_PACKETS;
+}
+
+static void
+bench_path( int  tx, int  size )
+{
+    PathCost  gf, smc;
+
+    run_path(0, tx, size, &gf);
+    run_path(1, tx, size, &smc);
+
+    printf("goldfish_net_test: %d-byte %s: %.2f exits, %.3f irqs, %.0f ns "
+           "per packet with goldfish_net; %.1f exits, %.3f irqs, %.0f ns "
+           "with smc91c111\n", size, tx ? "TX" : "RX",
+           gf.exits, gf.irqs, gf.ns, smc.exits, smc.irqs, smc.ns);
+}
+
+int
+main( void )
+{
+    NICInfo  nd;
+
+    memset(&nd, 0, sizeof(nd));
+    goldfish_net_init(&nd, 0);
+
+    check_tx();
+    check_rx();
+    check_moderation();
+
+    if (errors == 0) {
+        bench_path(1, 1514);
+        bench_path(0, 1514);
+        bench_path(1, 64);
+        bench_path(0, 64);
+    }
+
+    if (errors > 0) {
+        fprintf(stderr, "goldfish_net_test: FAILED\n");
+        return 1;
+    }
+    printf("goldfish_net_test: OK\n");
+    return 0;
+}
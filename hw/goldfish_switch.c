@@ -93,7 +93,7 @@ static void goldfish_switch_write(void *opaque, target_phys_addr_t offset, uint3
 
     switch(offset) {
         case SW_NAME_PTR:
-            cpu_memory_rw_debug(cpu_single_env, value, (void*)s->name, strlen(s->name), 1);
+            cpu_dma_memory_rw(cpu_single_env, value, (void*)s->name, strlen(s->name), 1);
             break;
 
         case SW_STATE:
@@ -31,6 +31,9 @@ struct timer_state {
     int64_t now;
     int     armed;
     QEMUTimer *timer;
+    /* TIMER_TIME_HIGH is read without calling goldfish_timer_read(),
+       see cpu_io_memory_set_shadow() */
+    uint32_t shadow[2];
 };
 
 #define  GOLDFISH_TIMER_SAVE_VERSION  1
@@ -56,6 +59,7 @@ static int  goldfish_timer_load(QEMUFile*  f, void*  opaque, int  version_id)
         return -1;
 
     s->now   = qemu_get_be64(f);
+    s->shadow[TIMER_TIME_HIGH >> 2] = s->now >> 32;
     s->armed = qemu_get_byte(f);
     if (s->armed) {
         int64_t  now   = qemu_get_clock(vm_clock);
@@ -78,6 +82,7 @@ static uint32_t goldfish_timer_read(void *opaque, target_phys_addr_t offset)
     switch(offset) {
         case TIMER_TIME_LOW:
             s->now = muldiv64(qemu_get_clock(vm_clock), 1000000000, get_ticks_per_sec());
+            s->shadow[TIMER_TIME_HIGH >> 2] = s->now >> 32;
             return s->now;
         case TIMER_TIME_HIGH:
             return s->now >> 32;
@@ -132,6 +137,9 @@ struct rtc_state {
     uint32_t alarm_low;
     int32_t alarm_high;
     int64_t now;
+    /* the high bits of the time are read without calling
+       goldfish_rtc_read(), see cpu_io_memory_set_shadow() */
+    uint32_t shadow[2];
 };
 
 /* we save the RTC for the case where the kernel is in the middle of a rtc_read
@@ -154,6 +162,7 @@ static int  goldfish_rtc_load(QEMUFile*  f, void*  opaque, int  version_id)
 
     /* this is an old value that is not correct. but that's ok anyway */
     s->now = qemu_get_be64(f);
+    s->shadow[1] = s->now >> 32;
     return 0;
 }
 
@@ -163,6 +172,7 @@ static uint32_t goldfish_rtc_read(void *opaque, target_phys_addr_t offset)
     switch(offset) {
         case 0x0:
             s->now = (int64_t)time(NULL) * 1000000000;
+            s->shadow[1] = s->now >> 32;
             return s->now;
         case 0x4:
             return s->now >> 32;
@@ -204,7 +214,7 @@ static struct timer_state timer_state = {
     }
 };
 
-static struct timer_state rtc_state = {
+static struct rtc_state rtc_state = {
     .dev = {
         .name = "goldfish_rtc",
         .id = -1,
@@ -243,10 +253,13 @@ void goldfish_timer_and_rtc_init(uint32_t timerbase, int timerirq)
     timer_state.dev.irq = timerirq;
     timer_state.timer = qemu_new_timer(vm_clock, goldfish_timer_tick, &timer_state);
     goldfish_device_add(&timer_state.dev, goldfish_timer_readfn, goldfish_timer_writefn, &timer_state);
+    cpu_io_memory_set_shadow(timer_state.dev.iomemtype, timer_state.shadow,
+                             1 << (TIMER_TIME_HIGH >> 2));
     register_savevm( "goldfish_timer", 0, GOLDFISH_TIMER_SAVE_VERSION,
                      goldfish_timer_save, goldfish_timer_load, &timer_state);
 
     goldfish_device_add(&rtc_state.dev, goldfish_rtc_readfn, goldfish_rtc_writefn, &rtc_state);
+    cpu_io_memory_set_shadow(rtc_state.dev.iomemtype, rtc_state.shadow, 1 << 1);
     register_savevm( "goldfish_rtc", 0, GOLDFISH_RTC_SAVE_VERSION,
                      goldfish_rtc_save, goldfish_rtc_load, &rtc_state);
 }
@@ -128,7 +128,7 @@ static void trace_dev_write(void *opaque, target_phys_addr_t offset, uint32_t va
         cmdlen = value;
         break;
     case TRACE_DEV_REG_CMDLINE:         // execve, process cmdline
-        cpu_memory_rw_debug(cpu_single_env, value, arg, cmdlen, 0);
+        cpu_dma_memory_rw(cpu_single_env, value, (uint8_t *)arg, cmdlen, 0);
         if (trace_filename != NULL) {
             trace_execve(arg, cmdlen);
         }
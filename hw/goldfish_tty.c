@@ -115,22 +115,23 @@ static void goldfish_tty_write(void *opaque, target_phys_addr_t offset, uint32_t
                 case TTY_CMD_WRITE_BUFFER:
                     if(s->cs) {
                         int len;
-                        target_phys_addr_t  buf;
+                        uint32_t  buf = 0;
+                        CPUDMA    dma;
 
-                        buf = s->ptr;
-                        len = s->ptr_len;
+                        len = cpu_dma_map_virt(&dma, cpu_single_env, s->ptr, s->ptr_len);
 
                         while (len) {
-                            char   temp[64];
-                            int    to_write = sizeof(temp);
+                            uint8_t  temp[64];
+                            int      to_write = sizeof(temp);
                             if (to_write > len)
                                 to_write = len;
 
-                            cpu_memory_rw_debug(cpu_single_env, buf, temp, to_write, 0);
+                            cpu_dma_rw(&dma, buf, temp, to_write, 0);
                             qemu_chr_write(s->cs, temp, to_write);
                             buf += to_write;
                             len -= to_write;
                         }
+                        cpu_dma_unmap(&dma);
                         //printf("goldfish_tty_write: got %d bytes from %x\n", s->ptr_len, s->ptr);
                     }
                     break;
@@ -138,7 +139,7 @@ static void goldfish_tty_write(void *opaque, target_phys_addr_t offset, uint32_t
                 case TTY_CMD_READ_BUFFER:
                     if(s->ptr_len > s->data_count)
                         cpu_abort (cpu_single_env, "goldfish_tty_write: reading more data than available %d %d\n", s->ptr_len, s->data_count);
-                    cpu_memory_rw_debug(cpu_single_env,s->ptr, s->data, s->ptr_len,1);
+                    cpu_dma_memory_rw(cpu_single_env, s->ptr, s->data, s->ptr_len, 1);
                     //printf("goldfish_tty_write: read %d bytes to %x\n", s->ptr_len, s->ptr);
                     if(s->data_count > s->ptr_len)
                         memmove(s->data, s->data + s->ptr_len, s->data_count - s->ptr_len);
@@ -217,6 +218,9 @@ int goldfish_tty_add(CharDriverState *cs, int id, uint32_t base, int irq)
     if(ret) {
         qemu_free(s);
     } else {
+        /* console output is written one character at a time, and can be
+           handled later in batches */
+        cpu_io_memory_set_posted(s->dev.iomemtype, 1 << (TTY_PUT_CHAR >> 2));
         register_savevm( "goldfish_tty", instance_id++, GOLDFISH_TTY_SAVE_VERSION,
                          goldfish_tty_save, goldfish_tty_load, s);
     }
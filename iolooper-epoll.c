@@ -0,0 +1,364 @@
+#include "iolooper.h"
+#include "qemu-common.h"
+
+/* An implementation of iolooper.h based on Linux epoll
+ *
+ * Contrary to the select() version, the cost of iolooper_wait() and
+ * of iterating over its results is proportional to the number of
+ * ready descriptors, not to the number of watched ones, and there
+ * is no FD_SETSIZE limit.
+ *
+ * epoll refuses regular files and some devices (e.g. /dev/null), which
+ * select() always reports as ready. These are kept in a separate list
+ * and reported as ready by every wait, which then doesn't block.
+ */
+#include <sys/epoll.h>
+
+/* maximum number of events returned by a single epoll_wait() */
+#define  MAX_EVENTS  256
+
+typedef struct {
+    int  flags;   /* IOLOOPER_XXX flags watched */
+    int  ready;   /* IOLOOPER_XXX flags reported by last wait */
+    int  always;  /* index+1 in 'always' if not watched by epoll, or 0 */
+} IoFd;
+
+struct IoLooper {
+    int                 epoll_fd;
+    IoFd*               fds;
+    int                 max_fds;
+    struct epoll_event  events[MAX_EVENTS];
+    int                 num_events;
+    int*                always;      /* descriptors epoll can't watch */
+    int                 num_always;
+    int                 max_always;
+};
+
+static IoFd*
+iolooper_fd( IoLooper*  iol, int  fd )
+{
+    if (fd >= iol->max_fds) {
+        int  new_max = iol->max_fds;
+
+        if (new_max < 64)
+            new_max = 64;
+        while (new_max <= fd)
+            new_max *= 2;
+
+        iol->fds = qemu_realloc(iol->fds, new_max * sizeof(IoFd));
+        memset(iol->fds + iol->max_fds, 0,
+               (new_max - iol->max_fds) * sizeof(IoFd));
+        iol->max_fds = new_max;
+    }
+    return &iol->fds[fd];
+}
+
+static unsigned
+iolooper_epoll_events( int  flags )
+{
+    unsigned  events = 0;
+
+    if (flags & IOLOOPER_READ)
+        events |= EPOLLIN;
+    if (flags & IOLOOPER_WRITE)
+        events |= EPOLLOUT;
+    if (flags & IOLOOPER_EXCEPT)
+        events |= EPOLLPRI;
+
+    return events;
+}
+
+/* returns 0 on success, or -1 with errno set */
+static int
+iolooper_ctl( IoLooper*  iol, int  fd, int  oldflags, int  newflags )
+{
+    struct epoll_event  ev;
+    int                 ret;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = iolooper_epoll_events(newflags);
+    ev.data.fd = fd;
+
+    if (newflags == 0) {
+        /* the descriptor may already have been closed, which removes
+         * it from the epoll set automatically, so ignore errors */
+        epoll_ctl(iol->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+        return 0;
+    }
+
+    if (oldflags == 0) {
+        ret = epoll_ctl(iol->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        if (ret < 0 && errno == EEXIST)
+            ret = epoll_ctl(iol->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    } else {
+        ret = epoll_ctl(iol->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        if (ret < 0 && errno == ENOENT)
+            ret = epoll_ctl(iol->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    return ret;
+}
+
+static void
+iolooper_add_always( IoLooper*  iol, int  fd )
+{
+    IoFd*  f = iolooper_fd(iol, fd);
+
+    if (f->always)
+        return;
+
+    if (iol->num_always >= iol->max_always) {
+        iol->max_always = iol->max_always ? 2*iol->max_always : 8;
+        iol->always = qemu_realloc(iol->always,
+                                   iol->max_always * sizeof(int));
+    }
+    iol->always[iol->num_always++] = fd;
+    f->always = iol->num_always;
+}
+
+static void
+iolooper_del_always( IoLooper*  iol, int  fd )
+{
+    IoFd*  f = &iol->fds[fd];
+    int    n = f->always - 1;
+    int    last;
+
+    /* move the last entry to the freed slot */
+    last = iol->always[--iol->num_always];
+    iol->always[n] = last;
+    iol->fds[last].always = n + 1;
+    f->always = 0;
+}
+
+IoLooper*
+iolooper_new(void)
+{
+    IoLooper*  iol = qemu_mallocz(sizeof(*iol));
+
+    iol->epoll_fd = epoll_create(MAX_EVENTS);
+    if (iol->epoll_fd < 0) {
+        fprintf(stderr, "%s: could not create epoll instance: %s\n",
+                __FUNCTION__, strerror(errno));
+        exit(1);
+    }
+    fcntl(iol->epoll_fd, F_SETFD, FD_CLOEXEC);
+    return iol;
+}
+
+void
+iolooper_free( IoLooper*  iol )
+{
+    close(iol->epoll_fd);
+    qemu_free(iol->always);
+    qemu_free(iol->fds);
+    qemu_free(iol);
+}
+
+void
+iolooper_reset( IoLooper*  iol )
+{
+    int  fd;
+
+    for (fd = 0; fd < iol->max_fds; fd++) {
+        IoFd*  f = &iol->fds[fd];
+        if (f->flags != 0 && !f->always)
+            iolooper_ctl(iol, fd, f->flags, 0);
+        f->flags  = 0;
+        f->ready  = 0;
+        f->always = 0;
+    }
+    iol->num_events = 0;
+    iol->num_always = 0;
+}
+
+void
+iolooper_modify( IoLooper*  iol, int  fd, int  oldflags, int  newflags )
+{
+    IoFd*  f;
+
+    if (fd < 0 || oldflags == newflags)
+        return;
+
+    f = iolooper_fd(iol, fd);
+
+    if (f->always) {
+        /* not known to epoll */
+        if (newflags == 0)
+            iolooper_del_always(iol, fd);
+    }
+    else if (iolooper_ctl(iol, fd, oldflags, newflags) < 0) {
+        if (errno == EPERM) {
+            iolooper_add_always(iol, fd);
+        } else {
+            fprintf(stderr, "%s: could not watch fd %d: %s\n", __FUNCTION__,
+                    fd, strerror(errno));
+        }
+    }
+
+    f->flags  = newflags;
+    f->ready &= newflags;
+}
+
+static void
+iolooper_set_flag( IoLooper*  iol, int  fd, int  flag, int  set )
+{
+    IoFd*  f;
+    int    flags;
+
+    if (fd < 0)
+        return;
+
+    f     = iolooper_fd(iol, fd);
+    flags = set ? (f->flags | flag) : (f->flags & ~flag);
+    iolooper_modify(iol, fd, f->flags, flags);
+}
+
+void
+iolooper_add_read( IoLooper*  iol, int  fd )
+{
+    iolooper_set_flag(iol, fd, IOLOOPER_READ, 1);
+}
+
+void
+iolooper_add_write( IoLooper*  iol, int  fd )
+{
+    iolooper_set_flag(iol, fd, IOLOOPER_WRITE, 1);
+}
+
+void
+iolooper_del_read( IoLooper*  iol, int  fd )
+{
+    iolooper_set_flag(iol, fd, IOLOOPER_READ, 0);
+}
+
+void
+iolooper_del_write( IoLooper*  iol, int  fd )
+{
+    iolooper_set_flag(iol, fd, IOLOOPER_WRITE, 0);
+}
+
+static int
+iolooper_epoll_wait( IoLooper*  iol, int  timeout )
+{
+    int  n, ret;
+
+    /* forget about the results of the previous wait */
+    for (n = 0; n < iol->num_events; n++) {
+        int  fd = iol->events[n].data.fd;
+        if (fd < iol->max_fds)
+            iol->fds[fd].ready = 0;
+    }
+    iol->num_events = 0;
+
+    /* don't block if some descriptors are always ready */
+    if (iol->num_always > 0)
+        timeout = 0;
+
+    do {
+        ret = epoll_wait(iol->epoll_fd, iol->events, MAX_EVENTS, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return ret;
+
+    for (n = 0; n < ret; n++) {
+        unsigned  ev    = iol->events[n].events;
+        int       fd    = iol->events[n].data.fd;
+        int       ready = 0;
+        IoFd*     f;
+
+        if (fd >= iol->max_fds)
+            continue;
+
+        f = &iol->fds[fd];
+
+        /* report errors and hang-ups the same way select() does,
+         * i.e. as readable/writable descriptors */
+        if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ready |= IOLOOPER_READ;
+        if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            ready |= IOLOOPER_WRITE;
+        if (ev & EPOLLPRI)
+            ready |= IOLOOPER_EXCEPT;
+
+        f->ready = ready & f->flags;
+    }
+    iol->num_events = ret;
+
+    for (n = 0; n < iol->num_always; n++) {
+        IoFd*  f = &iol->fds[iol->always[n]];
+        f->ready = f->flags & (IOLOOPER_READ | IOLOOPER_WRITE);
+    }
+
+    return ret + iol->num_always;
+}
+
+int
+iolooper_poll( IoLooper*  iol )
+{
+    return iolooper_epoll_wait(iol, 0);
+}
+
+int
+iolooper_wait( IoLooper*  iol, int64_t  duration )
+{
+    if (duration < 0)
+        return iolooper_epoll_wait(iol, -1);
+
+    if (duration > INT32_MAX)
+        duration = INT32_MAX;
+
+    return iolooper_epoll_wait(iol, (int)duration);
+}
+
+int
+iolooper_get_ready( IoLooper*  iol, int  fd )
+{
+    if (fd < 0 || fd >= iol->max_fds)
+        return 0;
+
+    return iol->fds[fd].ready;
+}
+
+int
+iolooper_is_read( IoLooper*  iol, int  fd )
+{
+    return (iolooper_get_ready(iol, fd) & IOLOOPER_READ) != 0;
+}
+
+int
+iolooper_is_write( IoLooper*  iol, int  fd )
+{
+    return (iolooper_get_ready(iol, fd) & IOLOOPER_WRITE) != 0;
+}
+
+void
+iolooper_clear_ready( IoLooper*  iol, int  fd, int  flags )
+{
+    if (fd < 0 || fd >= iol->max_fds)
+        return;
+
+    iol->fds[fd].ready &= ~flags;
+}
+
+int
+iolooper_next_ready( IoLooper*  iol, int  *piter )
+{
+    int  n;
+
+    /* the descriptors reported by epoll, then the 'always' ones */
+    for (n = *piter; n < iol->num_events + iol->num_always; n++) {
+        int  fd;
+
+        if (n < iol->num_events)
+            fd = iol->events[n].data.fd;
+        else
+            fd = iol->always[n - iol->num_events];
+
+        if (iolooper_get_ready(iol, fd) != 0) {
+            *piter = n + 1;
+            return fd;
+        }
+    }
+    *piter = n;
+    return -1;
+}
@@ -12,8 +12,10 @@
 struct IoLooper {
     fd_set   reads[1];
     fd_set   writes[1];
+    fd_set   excepts[1];
     fd_set   reads_result[1];
     fd_set   writes_result[1];
+    fd_set   excepts_result[1];
     int      max_fd;
     int      max_fd_valid;
 };
@@ -37,6 +39,10 @@ iolooper_reset( IoLooper*  iol )
 {
     FD_ZERO(iol->reads);
     FD_ZERO(iol->writes);
+    FD_ZERO(iol->excepts);
+    FD_ZERO(iol->reads_result);
+    FD_ZERO(iol->writes_result);
+    FD_ZERO(iol->excepts_result);
     iol->max_fd = -1;
     iol->max_fd_valid = 1;
 }
@@ -66,8 +72,10 @@ iolooper_fd_count( IoLooper*  iol )
         return max_fd + 1;
 
     /* recompute max fd */
+    max_fd = -1;
     for (fd = 0; fd < FD_SETSIZE; fd++) {
-        if (!FD_ISSET(fd, iol->reads) && !FD_ISSET(fd, iol->writes))
+        if (!FD_ISSET(fd, iol->reads) && !FD_ISSET(fd, iol->writes) &&
+            !FD_ISSET(fd, iol->excepts))
             continue;
 
         max_fd = fd;
@@ -110,56 +118,95 @@ iolooper_del_write( IoLooper*  iol, int  fd )
 {
     if (fd >= 0) {
         iolooper_del_fd(iol, fd);
-        FD_CLR(fd, iol->reads);
+        FD_CLR(fd, iol->writes);
     }
 }
 
-int
-iolooper_poll( IoLooper*  iol )
+void
+iolooper_modify( IoLooper*  iol, int  fd, int  oldflags, int  newflags )
+{
+    if (fd < 0 || oldflags == newflags)
+        return;
+
+    if (newflags == 0) {
+        iolooper_del_fd(iol, fd);
+    } else {
+        iolooper_add_fd(iol, fd);
+    }
+
+    if (newflags & IOLOOPER_READ)
+        FD_SET(fd, iol->reads);
+    else
+        FD_CLR(fd, iol->reads);
+
+    if (newflags & IOLOOPER_WRITE)
+        FD_SET(fd, iol->writes);
+    else
+        FD_CLR(fd, iol->writes);
+
+    if (newflags & IOLOOPER_EXCEPT)
+        FD_SET(fd, iol->excepts);
+    else
+        FD_CLR(fd, iol->excepts);
+}
+
+static int
+iolooper_select( IoLooper*  iol, struct timeval*  tv )
 {
-    int     count = iolooper_fd_count(iol);
-    int     ret;
-    fd_set  errs;
+    int  count = iolooper_fd_count(iol);
+    int  ret;
 
     if (count == 0)
         return 0;
 
-    FD_ZERO(&errs);
-
     do {
-        struct timeval  tv;
+        struct timeval  tv2;
+        struct timeval* ptv = NULL;
 
-        tv.tv_sec = tv.tv_usec = 0;
+        /* select() may modify the timeout on some platforms */
+        if (tv != NULL) {
+            tv2 = *tv;
+            ptv = &tv2;
+        }
 
-        iol->reads_result[0]  = iol->reads[0];
-        iol->writes_result[0] = iol->writes[0];
+        iol->reads_result[0]   = iol->reads[0];
+        iol->writes_result[0]  = iol->writes[0];
+        iol->excepts_result[0] = iol->excepts[0];
 
-        ret = select( count, iol->reads_result, iol->writes_result, &errs, &tv);
+        ret = select( count, iol->reads_result, iol->writes_result,
+                      iol->excepts_result, ptv);
     } while (ret < 0 && errno == EINTR);
 
+    if (ret <= 0) {
+        FD_ZERO(iol->reads_result);
+        FD_ZERO(iol->writes_result);
+        FD_ZERO(iol->excepts_result);
+    }
     return ret;
 }
 
 int
-iolooper_wait( IoLooper*  iol, int64_t  duration )
+iolooper_poll( IoLooper*  iol )
 {
-    int     count = iolooper_fd_count(iol);
-    int     ret;
-    fd_set  errs;
+    struct timeval  tv;
 
-    if (count == 0)
-        return 0;
+    tv.tv_sec = tv.tv_usec = 0;
 
-    FD_ZERO(&errs);
+    return iolooper_select(iol, &tv);
+}
 
-    do {
-        iol->reads_result[0]  = iol->reads[0];
-        iol->writes_result[0] = iol->writes[0];
+int
+iolooper_wait( IoLooper*  iol, int64_t  duration )
+{
+    struct timeval  tv;
 
-        ret = select( count, iol->reads_result, iol->writes_result, &errs, NULL);
-    } while (ret < 0 && errno == EINTR);
+    if (duration < 0)
+        return iolooper_select(iol, NULL);
 
-    return ret;
+    tv.tv_sec  = duration / 1000;
+    tv.tv_usec = (duration % 1000) * 1000;
+
+    return iolooper_select(iol, &tv);
 }
 
 
@@ -174,3 +221,51 @@ iolooper_is_write( IoLooper*  iol, int  fd )
 {
     return FD_ISSET(fd, iol->writes_result);
 }
+
+int
+iolooper_get_ready( IoLooper*  iol, int  fd )
+{
+    int  flags = 0;
+
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return 0;
+
+    if (FD_ISSET(fd, iol->reads_result))
+        flags |= IOLOOPER_READ;
+    if (FD_ISSET(fd, iol->writes_result))
+        flags |= IOLOOPER_WRITE;
+    if (FD_ISSET(fd, iol->excepts_result))
+        flags |= IOLOOPER_EXCEPT;
+
+    return flags;
+}
+
+void
+iolooper_clear_ready( IoLooper*  iol, int  fd, int  flags )
+{
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return;
+
+    if (flags & IOLOOPER_READ)
+        FD_CLR(fd, iol->reads_result);
+    if (flags & IOLOOPER_WRITE)
+        FD_CLR(fd, iol->writes_result);
+    if (flags & IOLOOPER_EXCEPT)
+        FD_CLR(fd, iol->excepts_result);
+}
+
+int
+iolooper_next_ready( IoLooper*  iol, int  *piter )
+{
+    int  count = iolooper_fd_count(iol);
+    int  fd;
+
+    for (fd = *piter; fd < count; fd++) {
+        if (iolooper_get_ready(iol, fd) != 0) {
+            *piter = fd + 1;
+            return fd;
+        }
+    }
+    *piter = count;
+    return -1;
+}
@@ -16,10 +16,51 @@ void       iolooper_add_write( IoLooper*  iol, int  fd );
 void       iolooper_del_read( IoLooper*  iol, int  fd );
 void       iolooper_del_write( IoLooper*  iol, int  fd );
 
+/* Event flags used by iolooper_modify() and iolooper_get_ready() */
+enum {
+    IOLOOPER_READ   = (1 << 0),
+    IOLOOPER_WRITE  = (1 << 1),
+    IOLOOPER_EXCEPT = (1 << 2),
+};
+
+/* Change the events watched for 'fd' from 'oldflags' to 'newflags'.
+ *
+ * Registrations are persistent: they stay in effect across calls to
+ * iolooper_wait() until modified again. The caller is responsible for
+ * remembering what it registered for each descriptor, and must pass
+ * newflags == 0 before closing a watched descriptor, so that a later
+ * descriptor with the same number is not confused with it.
+ *
+ * This does nothing (and costs no system call) if oldflags == newflags.
+ */
+void       iolooper_modify( IoLooper*  iol, int  fd, int  oldflags, int  newflags );
+
 int        iolooper_poll( IoLooper*  iol );
+
+/* Wait for at most 'duration' milliseconds for an event on any of the
+ * watched descriptors. A negative duration means wait forever.
+ * Returns the number of ready descriptors, 0 on timeout, or -1 on error.
+ */
 int        iolooper_wait( IoLooper*  iol, int64_t  duration );
 
 int        iolooper_is_read( IoLooper*  iol, int  fd );
 int        iolooper_is_write( IoLooper*  iol, int  fd );
 
+/* Return the IOLOOPER_XXX flags reported for 'fd' by the last
+ * iolooper_poll() or iolooper_wait() call. */
+int        iolooper_get_ready( IoLooper*  iol, int  fd );
+
+/* Forget some of the events reported for 'fd' by the last wait, e.g.
+ * because the descriptor was shut down while handling another event. */
+void       iolooper_clear_ready( IoLooper*  iol, int  fd, int  flags );
+
+/* Iterate over the descriptors reported by the last wait. '*piter'
+ * must be set to 0 before the first call. Returns the next ready
+ * descriptor, or -1 when there are no more. The cost of a full
+ * iteration is proportional to the number of ready descriptors with
+ * the epoll backend, and to the highest watched descriptor with the
+ * select() one.
+ */
+int        iolooper_next_ready( IoLooper*  iol, int  *piter );
+
 #endif /* IOLOOPER_H */
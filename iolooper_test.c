@@ -0,0 +1,432 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the events reported by an IoLooper backend, then measure the cost
+ * of a main loop wakeup with 1000 idle and 10 active connections, each a
+ * socket pair whose far end plays the guest. the wakeups of the IoLooper,
+ * with its persistent registrations, are compared with the loop used
+ * before it, which rebuilt its fd_sets, called select() and scanned every
+ * descriptor on each iteration. this file is built against both
+ * iolooper-epoll.c and iolooper-select.c. run with 'make check'.
+ */
+#include "iolooper.h"
+#include "qemu-common.h"
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef IOLOOPER_TEST_SELECT
+#  define  BACKEND  "select"
+#else
+#  define  BACKEND  "epoll"
+#endif
+
+#define  NB_IDLE      1000
+#define  NB_ACTIVE    10
+#define  NB_CONNS     (NB_IDLE + NB_ACTIVE)
+#define  NB_WAKEUPS   5000
+
+/* the far ends of the connections are moved above this, to keep the
+ * watched ones below FD_SETSIZE for select() */
+#define  PEER_FD_BASE  (FD_SETSIZE + 16)
+
+void*  qemu_malloc( size_t  size )  { return malloc(size); }
+void*  qemu_mallocz( size_t  size ) { return calloc(1, size); }
+void*  qemu_realloc( void*  ptr, size_t  size ) { return realloc(ptr, size); }
+void   qemu_free( void*  ptr )      { free(ptr); }
+
+static int  errors;
+
+typedef struct {
+    int  fd;      /* watched by the loop */
+    int  peer;    /* the guest's end */
+} Conn;
+
+static Conn  conns[NB_CONNS];
+
+static uint32_t  rand_state = 1;
+
+static uint32_t
+next_rand( void )
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static double
+now_secs( void )
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+open_conns( void )
+{
+    struct rlimit  rl;
+    int            nn;
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < PEER_FD_BASE + NB_CONNS + 16) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    for (nn = 0; nn < NB_CONNS; nn++) {
+        int  sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            fprintf(stderr, "iolooper_test: socketpair: %s\n", strerror(errno));
+            return -1;
+        }
+        conns[nn].fd   = sv[0];
+        conns[nn].peer = fcntl(sv[1], F_DUPFD, PEER_FD_BASE);
+        close(sv[1]);
+        if (conns[nn].peer < 0) {
+            fprintf(stderr, "iolooper_test: can't open %d connections: %s\n",
+                    NB_CONNS, strerror(errno));
+            return -1;
+        }
+        fcntl(conns[nn].fd, F_SETFL, O_NONBLOCK);
+        fcntl(conns[nn].peer, F_SETFL, O_NONBLOCK);
+    }
+    if (conns[NB_CONNS-1].fd >= FD_SETSIZE) {
+        fprintf(stderr, "iolooper_test: too many inherited descriptors\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+close_conns( void )
+{
+    int  nn;
+
+    for (nn = 0; nn < NB_CONNS; nn++) {
+        close(conns[nn].fd);
+        close(conns[nn].peer);
+    }
+}
+
+static void
+send_byte( int  fd )
+{
+    char  c = 'x';
+
+    if (write(fd, &c, 1) != 1) {
+        fprintf(stderr, "iolooper_test: write: %s\n", strerror(errno));
+        errors++;
+    }
+}
+
+static void
+drain( int  fd )
+{
+    char  buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/** events
+ **/
+
+/* the descriptors iterated over after a wait must be exactly those
+ * of the connections which are in 'expected', with the right flags */
+static void
+check_ready( IoLooper*  iol, const char*  what, const int*  expected )
+{
+    static int  seen[NB_CONNS];
+    int         iter = 0, fd, nn;
+
+    memset(seen, 0, sizeof(seen));
+    while ((fd = iolooper_next_ready(iol, &iter)) >= 0) {
+        for (nn = 0; nn < NB_CONNS && conns[nn].fd != fd; nn++)
+            ;
+        if (nn == NB_CONNS) {
+            fprintf(stderr, "iolooper_test: %s: unknown fd %d is ready\n",
+                    what, fd);
+            errors++;
+            return;
+        }
+        seen[nn] = iolooper_get_ready(iol, fd);
+    }
+    for (nn = 0; nn < NB_CONNS; nn++) {
+        if (seen[nn] != expected[nn] ||
+            iolooper_get_ready(iol, conns[nn].fd) != expected[nn] ||
+            iolooper_is_read(iol, conns[nn].fd) !=
+                !!(expected[nn] & IOLOOPER_READ) ||
+            iolooper_is_write(iol, conns[nn].fd) !=
+                !!(expected[nn] & IOLOOPER_WRITE)) {
+            fprintf(stderr, "iolooper_test: %s: connection %d has flags %d, "
+                    "expected %d\n", what, nn, seen[nn], expected[nn]);
+            errors++;
+            return;
+        }
+    }
+}
+
+static void
+check_events( void )
+{
+    static int  watched[NB_CONNS];
+    static int  expected[NB_CONNS];
+    IoLooper*   iol = iolooper_new();
+    double      t0;
+    int         nn, round, ret;
+
+    /* everything is registered once, for reading */
+    for (nn = 0; nn < NB_CONNS; nn++) {
+        iolooper_modify(iol, conns[nn].fd, 0, IOLOOPER_READ);
+        watched[nn] = IOLOOPER_READ;
+    }
+
+    /* nothing is ready: the timeout must be honoured */
+    t0  = now_secs();
+    ret = iolooper_wait(iol, 50);
+    if (ret != 0 || now_secs() - t0 < 0.04) {
+        fprintf(stderr, "iolooper_test: idle wait returned %d after %.0f ms\n",
+                ret, (now_secs() - t0) * 1e3);
+        errors++;
+    }
+    memset(expected, 0, sizeof(expected));
+    check_ready(iol, "idle", expected);
+
+    for (round = 0; round < 200 && errors == 0; round++) {
+        /* change the registrations of a few connections. a stream socket
+         * is always writable here, so few of them watch for writing, to
+         * keep the ready ones within what a single epoll_wait() returns */
+        for (nn = 0; nn < 8; nn++) {
+            Conn*  c     = &conns[next_rand() % NB_CONNS];
+            int    flags = next_rand() % 4;
+
+            if (flags & IOLOOPER_WRITE && next_rand() % 8 != 0)
+                flags &= ~IOLOOPER_WRITE;
+
+            iolooper_modify(iol, c->fd, watched[c - conns], flags);
+            watched[c - conns] = flags;
+        }
+
+        /* the guest sends to a few of them */
+        for (nn = 0; nn < NB_CONNS; nn++) {
+            expected[nn] = watched[nn] & IOLOOPER_WRITE;
+            if (next_rand() % 64 == 0) {
+                send_byte(conns[nn].peer);
+                expected[nn] |= watched[nn] & IOLOOPER_READ;
+            }
+        }
+
+        ret = iolooper_wait(iol, 1000);
+        if (ret < 0) {
+            fprintf(stderr, "iolooper_test: wait: %s\n", strerror(errno));
+            errors++;
+            break;
+        }
+        check_ready(iol, "wait", expected);
+
+        /* forgetting an event, e.g. when a handler closes a socket */
+        nn = next_rand() % NB_CONNS;
+        iolooper_clear_ready(iol, conns[nn].fd, IOLOOPER_WRITE);
+        expected[nn] &= ~IOLOOPER_WRITE;
+        check_ready(iol, "clear_ready", expected);
+
+        for (nn = 0; nn < NB_CONNS; nn++)
+            drain(conns[nn].fd);
+    }
+
+    /* when more descriptors are ready than a wait reports, the next
+     * waits must report the others */
+    {
+        static int  seen[NB_CONNS];
+        int         waits, count = 0, fd, iter;
+
+        memset(seen, 0, sizeof(seen));
+        for (nn = 0; nn < NB_CONNS; nn++) {
+            iolooper_modify(iol, conns[nn].fd, watched[nn], IOLOOPER_WRITE);
+            watched[nn] = IOLOOPER_WRITE;
+        }
+        for (waits = 0; waits < 8 && count < NB_CONNS; waits++) {
+            iolooper_wait(iol, 1000);
+            for (iter = 0; (fd = iolooper_next_ready(iol, &iter)) >= 0; ) {
+                for (nn = 0; nn < NB_CONNS && conns[nn].fd != fd; nn++)
+                    ;
+                if (nn < NB_CONNS && !seen[nn]++)
+                    count++;
+            }
+        }
+        if (count != NB_CONNS) {
+            fprintf(stderr, "iolooper_test: %d of %d writable connections "
+                    "reported after %d waits\n", count, NB_CONNS, waits);
+            errors++;
+        }
+    }
+
+    /* del_write must leave the read registration alone */
+    for (nn = 0; nn < NB_CONNS; nn++)
+        iolooper_modify(iol, conns[nn].fd, watched[nn], 0);
+    send_byte(conns[0].peer);
+    iolooper_add_read(iol, conns[0].fd);
+    iolooper_add_write(iol, conns[0].fd);
+    iolooper_del_write(iol, conns[0].fd);
+    iolooper_poll(iol);
+    if (iolooper_get_ready(iol, conns[0].fd) != IOLOOPER_READ) {
+        fprintf(stderr, "iolooper_test: del_write changed the read events\n");
+        errors++;
+    }
+    drain(conns[0].fd);
+
+#ifndef IOLOOPER_TEST_SELECT
+    /* regular files and some devices, which epoll refuses, are always
+     * ready, and so are descriptors above FD_SETSIZE */
+    {
+        int  devnull = open("/dev/null", O_RDONLY);
+        int  high    = fcntl(conns[1].peer, F_DUPFD, PEER_FD_BASE + NB_CONNS);
+
+        iolooper_reset(iol);
+        iolooper_modify(iol, devnull, 0, IOLOOPER_READ);
+        iolooper_modify(iol, high, 0, IOLOOPER_READ);
+        send_byte(conns[1].fd);
+        t0  = now_secs();
+        ret = iolooper_wait(iol, 1000);
+        if (ret != 2 || now_secs() - t0 > 0.5 ||
+            !iolooper_is_read(iol, devnull) || !iolooper_is_read(iol, high)) {
+            fprintf(stderr, "iolooper_test: /dev/null or fd %d not ready\n",
+                    high);
+            errors++;
+        }
+        drain(high);
+        iolooper_modify(iol, devnull, IOLOOPER_READ, 0);
+        iolooper_modify(iol, high, IOLOOPER_READ, 0);
+        close(devnull);
+        close(high);
+    }
+#endif
+
+    iolooper_free(iol);
+}
+
+/** benchmark
+ **/
+
+/* each wakeup, the active connections receive a byte from the guest,
+ * which the loop reads. returns the host time of a wakeup, in ns */
+static double
+bench_iolooper( void )
+{
+    IoLooper*  iol = iolooper_new();
+    double     t0, t1;
+    int        nn, wakeups, handled = 0;
+
+    for (nn = 0; nn < NB_CONNS; nn++)
+        iolooper_modify(iol, conns[nn].fd, 0, IOLOOPER_READ);
+
+    t0 = now_secs();
+    for (wakeups = 0; wakeups < NB_WAKEUPS; wakeups++) {
+        int  iter = 0, fd;
+
+        for (nn = NB_IDLE; nn < NB_CONNS; nn++)
+            send_byte(conns[nn].peer);
+
+        iolooper_wait(iol, 1000);
+        while ((fd = iolooper_next_ready(iol, &iter)) >= 0) {
+            char  c;
+            if (iolooper_is_read(iol, fd) && read(fd, &c, 1) == 1)
+                handled++;
+        }
+    }
+    t1 = now_secs();
+
+    for (nn = 0; nn < NB_CONNS; nn++)
+        iolooper_modify(iol, conns[nn].fd, IOLOOPER_READ, 0);
+    iolooper_free(iol);
+
+    if (handled != NB_WAKEUPS*NB_ACTIVE) {
+        fprintf(stderr, "iolooper_test: %d of %d events handled\n",
+                handled, NB_WAKEUPS*NB_ACTIVE);
+        errors++;
+    }
+    return (t1 - t0) * 1e9 / NB_WAKEUPS;
+}
+
+/* the same, with the main_loop_wait() and slirp_select_fill()/poll()
+ * loop used before the IoLooper */
+static double
+bench_select( void )
+{
+    fd_set  rfds, wfds, xfds;
+    double  t0, t1;
+    int     nn, wakeups, handled = 0;
+
+    t0 = now_secs();
+    for (wakeups = 0; wakeups < NB_WAKEUPS; wakeups++) {
+        int  nfds = -1;
+
+        for (nn = NB_IDLE; nn < NB_CONNS; nn++)
+            send_byte(conns[nn].peer);
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_ZERO(&xfds);
+        for (nn = 0; nn < NB_CONNS; nn++) {
+            FD_SET(conns[nn].fd, &rfds);
+            if (conns[nn].fd > nfds)
+                nfds = conns[nn].fd;
+        }
+        select(nfds + 1, &rfds, &wfds, &xfds, NULL);
+
+        for (nn = 0; nn < NB_CONNS; nn++) {
+            char  c;
+            if (FD_ISSET(conns[nn].fd, &rfds) && read(conns[nn].fd, &c, 1) == 1)
+                handled++;
+        }
+    }
+    t1 = now_secs();
+
+    if (handled != NB_WAKEUPS*NB_ACTIVE) {
+        fprintf(stderr, "iolooper_test: %d of %d events handled by select\n",
+                handled, NB_WAKEUPS*NB_ACTIVE);
+        errors++;
+    }
+    return (t1 - t0) * 1e9 / NB_WAKEUPS;
+}
+
+int
+main( void )
+{
+    if (open_conns() < 0) {
+        fprintf(stderr, "iolooper_test: FAILED\n");
+        return 1;
+    }
+
+    check_events();
+    if (errors == 0) {
+        double  after  = bench_iolooper();
+        double  before = bench_select();
+
+        printf("iolooper_test: %s: %d idle and %d active connections: "
+               "%.1f us/wakeup, %.1f us/wakeup before (%.2fx)\n", BACKEND,
+               NB_IDLE, NB_ACTIVE, after / 1e3, before / 1e3, before / after);
+    }
+    close_conns();
+
+    if (errors > 0) {
+        fprintf(stderr, "iolooper_test: %s: FAILED\n", BACKEND);
+        return 1;
+    }
+    printf("iolooper_test: %s: OK\n", BACKEND);
+    return 0;
+}
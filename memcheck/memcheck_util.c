@@ -188,8 +188,9 @@ memcheck_fail_query(target_ulong guest_address)
 void
 invalidate_tlb_cache(target_ulong start, target_ulong end)
 {
-    target_ulong index = (start >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    const target_ulong to = ((end - 1) >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE-1);
+    const target_ulong mask = cpu_single_env->tlb_size - 1;
+    target_ulong index = (start >> TARGET_PAGE_BITS) & mask;
+    const target_ulong to = ((end - 1) >> TARGET_PAGE_BITS) & mask;
     for (; index <= to; index++, start += TARGET_PAGE_SIZE) {
         target_ulong tlb_addr = cpu_single_env->tlb_table[1][index].addr_write;
         if ((start & TARGET_PAGE_MASK) ==
@@ -44,6 +44,9 @@
 #include "migration.h"
 #include "kvm.h"
 #include "acl.h"
+#include "ram-dedup.h"
+#include "hw/goldfish_device.h"
+#include "framecapture.h"
 
 //#define DEBUG
 //#define DEBUG_COMPLETION
@@ -1579,6 +1582,25 @@ static void do_info_balloon(Monitor *mon)
         monitor_printf(mon, "balloon: actual=%d\n", (int)(actual >> 20));
 }
 
+static void do_info_framecapture(Monitor *mon)
+{
+    QFrameCaptureStats stats;
+
+    qframecapture_stats(&stats);
+    if (stats.frames == 0) {
+        monitor_printf(mon, "No frame captured\n");
+        return;
+    }
+    monitor_printf(mon, "frames captured: %" PRIu64 ", %" PRIu64
+                   " us per frame\n", stats.frames,
+                   stats.time_ns / stats.frames / 1000);
+    monitor_printf(mon, "pixels copied or compared: %" PRIu64 "\n",
+                   stats.pixels);
+    monitor_printf(mon, "log: %" PRIu64 " KB written, %" PRIu64
+                   " frames dropped\n", stats.log_bytes >> 10,
+                   stats.log_dropped);
+}
+
 static void do_acl(Monitor *mon,
                    const char *command,
                    const char *aclname,
@@ -1739,6 +1761,16 @@ static const mon_cmd_t info_cmds[] = {
     { "migrate", "", do_info_migrate, "", "show migration status" },
     { "balloon", "", do_info_balloon,
       "", "show balloon information" },
+    { "ramshare", "", do_info_ramshare,
+      "", "show guest RAM pages shared through the page store" },
+    { "freepages", "", do_info_freepages,
+      "", "show guest RAM reclaimed through free page reporting" },
+    { "mmio", "", do_info_mmio,
+      "", "show guest accesses to the goldfish device registers" },
+    { "idle", "", do_info_idle,
+      "", "show guest idle time and host CPU usage while idle" },
+    { "framecapture", "", do_info_framecapture,
+      "", "show statistics of the current frame capture" },
     { "qtree", "", do_info_qtree,
       "", "show device tree" },
     { NULL, NULL, },
@@ -477,7 +477,8 @@ void qemu_flush_queued_packets(VLANClientState *vc)
 
         vc->vlan->send_queue = packet->next;
 
-        ret = qemu_deliver_packet(packet->sender, packet->data, packet->size);
+        ret = qemu_deliver_packet(packet->sender, packet->buf->data,
+                                  packet->buf->size);
         if (ret == 0 && packet->sent_cb != NULL) {
             packet->next = vc->vlan->send_queue;
             vc->vlan->send_queue = packet;
@@ -487,22 +488,22 @@ void qemu_flush_queued_packets(VLANClientState *vc)
         if (packet->sent_cb)
             packet->sent_cb(packet->sender);
 
+        netbuf_unref(packet->buf);
         qemu_free(packet);
     }
 }
 
-static void qemu_enqueue_packet(VLANClientState *sender,
-                                const uint8_t *buf, int size,
+/* takes over the caller's reference to 'buf' */
+static void qemu_enqueue_packet(VLANClientState *sender, NetBuf buf,
                                 NetPacketSent *sent_cb)
 {
     VLANPacket *packet;
 
-    packet = qemu_malloc(sizeof(VLANPacket) + size);
+    packet = qemu_malloc(sizeof(VLANPacket));
     packet->next = sender->vlan->send_queue;
     packet->sender = sender;
-    packet->size = size;
     packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
+    packet->buf = buf;
     sender->vlan->send_queue = packet;
 }
 
@@ -522,13 +523,13 @@ ssize_t qemu_send_packet_async(VLANClientState *sender,
 #endif
 
     if (sender->vlan->delivering) {
-        qemu_enqueue_packet(sender, buf, size, NULL);
+        qemu_enqueue_packet(sender, netbuf_copy(buf, size), NULL);
         return size;
     }
 
     ret = qemu_deliver_packet(sender, buf, size);
     if (ret == 0 && sent_cb != NULL) {
-        qemu_enqueue_packet(sender, buf, size, sent_cb);
+        qemu_enqueue_packet(sender, netbuf_copy(buf, size), sent_cb);
         return 0;
     }
 
@@ -542,6 +543,21 @@ void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size)
     qemu_send_packet_async(vc, buf, size, NULL);
 }
 
+void qemu_send_netbuf(VLANClientState *sender, NetBuf buf)
+{
+    if (sender->link_down) {
+        return;
+    }
+
+    if (sender->vlan->delivering) {
+        qemu_enqueue_packet(sender, netbuf_ref(buf), NULL);
+        return;
+    }
+
+    qemu_deliver_packet(sender, buf->data, buf->size);
+    qemu_flush_queued_packets(sender);
+}
+
 static ssize_t vc_sendv_compat(VLANClientState *vc, const struct iovec *iov,
                                int iovcnt)
 {
@@ -608,28 +624,11 @@ static ssize_t qemu_enqueue_packet_iov(VLANClientState *sender,
                                        const struct iovec *iov, int iovcnt,
                                        NetPacketSent *sent_cb)
 {
-    VLANPacket *packet;
-    size_t max_len = 0;
-    int i;
-
-    max_len = calc_iov_length(iov, iovcnt);
-
-    packet = qemu_malloc(sizeof(VLANPacket) + max_len);
-    packet->next = sender->vlan->send_queue;
-    packet->sender = sender;
-    packet->sent_cb = sent_cb;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
+    NetBuf buf = netbuf_copyv(iov, iovcnt);
+    ssize_t size = buf->size;
 
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
-
-    sender->vlan->send_queue = packet;
-
-    return packet->size;
+    qemu_enqueue_packet(sender, buf, sent_cb);
+    return size;
 }
 
 ssize_t qemu_sendv_packet_async(VLANClientState *sender,
@@ -733,36 +732,35 @@ NetShaper  slirp_shaper_out;
 NetDelay   slirp_delay_in;
 
 static void
-slirp_delay_in_cb( void*   data,
-                   size_t  size,
+slirp_delay_in_cb( NetBuf  buf,
                    void*   opaque )
 {
-    slirp_input( (const uint8_t*)data, (int)size );
+    slirp_input_netbuf( buf );
     opaque = opaque;
 }
 
 static void
-slirp_shaper_in_cb( void*   data,
-                    size_t  size,
+slirp_shaper_in_cb( NetBuf  buf,
                     void*   opaque )
 {
-    netdelay_send_aux( slirp_delay_in, data, size, opaque );
+    netdelay_send_aux( slirp_delay_in, buf, opaque );
 }
 
 static void
-slirp_shaper_out_cb( void*   data,
-                     size_t  size,
+slirp_shaper_out_cb( NetBuf  buf,
                      void*   opaque )
 {
-    qemu_send_packet( slirp_vc, (const uint8_t*)data, (int)size );
+    if (slirp_vc)
+        qemu_send_netbuf( slirp_vc, buf );
+    netbuf_unref( buf );
 }
 
 void
 slirp_init_shapers( void )
 {
     slirp_delay_in   = netdelay_create( slirp_delay_in_cb );
-    slirp_shaper_in  = netshaper_create( 1, slirp_shaper_in_cb );
-    slirp_shaper_out = netshaper_create( 1, slirp_shaper_out_cb );
+    slirp_shaper_in  = netshaper_create( slirp_shaper_in_cb );
+    slirp_shaper_out = netshaper_create( slirp_shaper_out_cb );
 
     netdelay_set_latency( slirp_delay_in, qemu_net_min_latency, qemu_net_max_latency );
     netshaper_set_rate( slirp_shaper_out, qemu_net_download_speed );
@@ -783,47 +781,71 @@ int slirp_can_output(void)
 #endif
 }
 
-void slirp_output(const uint8_t *pkt, int pkt_len)
+void slirp_output_netbuf(NetBuf buf)
 {
 #ifdef DEBUG_SLIRP
     printf("slirp output:\n");
-    hex_dump(stdout, pkt, pkt_len);
+    hex_dump(stdout, buf->data, buf->size);
 #endif
     if (qemu_tcpdump_active)
-        qemu_tcpdump_packet(pkt, pkt_len);
+        qemu_tcpdump_packet(buf->data, buf->size);
 
-    if (!slirp_vc)
+    if (!slirp_vc) {
+        netbuf_unref(buf);
         return;
+    }
 
 #ifdef CONFIG_SHAPER
-    netshaper_send(slirp_shaper_out, (void*)pkt, pkt_len);
+    netshaper_send(slirp_shaper_out, buf);
 #else
-    qemu_send_packet(slirp_vc, pkt, pkt_len);
+    qemu_send_netbuf(slirp_vc, buf);
+    netbuf_unref(buf);
 #endif
 }
 
+void slirp_output(const uint8_t *pkt, int pkt_len)
+{
+    slirp_output_netbuf(netbuf_copy(pkt, pkt_len));
+}
+
 int slirp_is_inited(void)
 {
     return slirp_inited;
 }
 
-static ssize_t slirp_receive(VLANClientState *vc, const uint8_t *buf, size_t size)
+/* the packet is copied once into a NetBuf, which is then passed by
+ * reference through the shaper and delayer, and used directly as the
+ * storage of the slirp mbuf */
+static ssize_t slirp_receive_netbuf(NetBuf buf)
 {
+    ssize_t size = buf->size;
+
 #ifdef DEBUG_SLIRP
     printf("slirp input:\n");
-    hex_dump(stdout, buf, size);
+    hex_dump(stdout, buf->data, buf->size);
 #endif
     if (qemu_tcpdump_active)
-        qemu_tcpdump_packet(buf, size);
+        qemu_tcpdump_packet(buf->data, buf->size);
 
 #ifdef CONFIG_SHAPER
-    netshaper_send(slirp_shaper_in, (char*)buf, size);
+    netshaper_send(slirp_shaper_in, buf);
 #else
-    slirp_input(buf, size);
+    slirp_input_netbuf(buf);
 #endif
     return size;
 }
 
+static ssize_t slirp_receive(VLANClientState *vc, const uint8_t *buf, size_t size)
+{
+    return slirp_receive_netbuf(netbuf_copy(buf, size));
+}
+
+static ssize_t slirp_receive_iov(VLANClientState *vc, const struct iovec *iov,
+                                 int iovcnt)
+{
+    return slirp_receive_netbuf(netbuf_copyv(iov, iovcnt));
+}
+
 static int slirp_in_use;
 
 static void net_slirp_cleanup(VLANClientState *vc)
@@ -858,7 +880,7 @@ static int net_slirp_init(VLANState *vlan, const char *model, const char *name,
     }
 
     slirp_vc = qemu_new_vlan_client(vlan, model, name, NULL, slirp_receive,
-                                    NULL, net_slirp_cleanup, NULL);
+                                    slirp_receive_iov, net_slirp_cleanup, NULL);
     slirp_vc->info_str[0] = '\0';
     slirp_in_use = 1;
     return 0;
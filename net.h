@@ -2,6 +2,7 @@
 #define QEMU_NET_H
 
 #include "qemu-common.h"
+#include "netbuf.h"
 
 /* VLANs support */
 
@@ -37,9 +38,8 @@ typedef void (NetPacketSent) (VLANClientState *);
 struct VLANPacket {
     struct VLANPacket *next;
     VLANClientState *sender;
-    int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    NetBuf buf;
 };
 
 struct VLANState {
@@ -68,6 +68,9 @@ ssize_t qemu_sendv_packet(VLANClientState *vc, const struct iovec *iov,
 ssize_t qemu_sendv_packet_async(VLANClientState *vc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
 void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size);
+/* same as qemu_send_packet(), but the packet is queued by reference if
+ * it can't be delivered immediately. the caller keeps its reference. */
+void qemu_send_netbuf(VLANClientState *vc, NetBuf buf);
 ssize_t qemu_send_packet_async(VLANClientState *vc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
 void qemu_flush_queued_packets(VLANClientState *vc);
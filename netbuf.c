@@ -0,0 +1,62 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "netbuf.h"
+#include "qemu-common.h"
+
+NetBuf
+netbuf_alloc( int  size )
+{
+    int     capacity = NETBUF_HEADROOM + size;
+    NetBuf  buf;
+
+    buf = qemu_malloc(offsetof(NetBufRec, storage) + capacity);
+    buf->refcount = 1;
+    buf->size     = size;
+    buf->data     = buf->storage + NETBUF_HEADROOM;
+    buf->capacity = capacity;
+
+    return buf;
+}
+
+NetBuf
+netbuf_copy( const void*  data, int  size )
+{
+    NetBuf  buf = netbuf_alloc(size);
+
+    memcpy(buf->data, data, size);
+    return buf;
+}
+
+NetBuf
+netbuf_copyv( const struct iovec*  iov, int  iovcnt )
+{
+    NetBuf  buf;
+    int     n, size = 0;
+
+    for (n = 0; n < iovcnt; n++)
+        size += iov[n].iov_len;
+
+    buf  = netbuf_alloc(size);
+    size = 0;
+    for (n = 0; n < iovcnt; n++) {
+        memcpy(buf->data + size, iov[n].iov_base, iov[n].iov_len);
+        size += iov[n].iov_len;
+    }
+    return buf;
+}
+
+void
+netbuf_unref( NetBuf  buf )
+{
+    if (buf && --buf->refcount == 0)
+        qemu_free(buf);
+}
@@ -0,0 +1,77 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _NETBUF_H_
+#define _NETBUF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct iovec;
+
+/* A NetBuf is a reference-counted network packet buffer.
+ *
+ * It allows the various stages of the user-mode network path (VLAN
+ * send queue, traffic shaper and delayer, slirp mbufs) to hold on to
+ * a packet without copying it: each holder owns one reference, and
+ * the buffer is freed when the last one is dropped.
+ *
+ * A NetBuf's contents must not be modified while it is shared, i.e.
+ * while netbuf_is_shared() returns true.
+ */
+typedef struct NetBufRec_  NetBufRec, *NetBuf;
+
+struct NetBufRec_ {
+    int       refcount;
+    int       size;       /* size of packet data */
+    uint8_t*  data;       /* start of packet data, within 'storage' */
+    int       capacity;   /* size of 'storage' */
+    uint8_t   storage[1];
+};
+
+/* Space reserved in front of packet data. This matches what slirp needs
+ * to keep the IP header that follows the 14-byte Ethernet one aligned. */
+#define  NETBUF_HEADROOM  2
+
+/* Create a new buffer holding 'size' bytes of uninitialized data.
+ * The caller owns the only reference to it. */
+NetBuf  netbuf_alloc( int  size );
+
+/* Create a new buffer holding a copy of 'data' */
+NetBuf  netbuf_copy( const void*  data, int  size );
+
+/* Create a new buffer holding the concatenation of an i/o vector */
+NetBuf  netbuf_copyv( const struct iovec*  iov, int  iovcnt );
+
+static __inline__ NetBuf
+netbuf_ref( NetBuf  buf )
+{
+    buf->refcount++;
+    return buf;
+}
+
+void    netbuf_unref( NetBuf  buf );
+
+static __inline__ int
+netbuf_is_shared( NetBuf  buf )
+{
+    return buf->refcount > 1;
+}
+
+/* Return the NetBuf whose storage starts at 'storage', used by slirp
+ * to find the buffer backing an mbuf. */
+static __inline__ NetBuf
+netbuf_from_storage( void*  storage )
+{
+    return (NetBuf)((char*)storage - offsetof(NetBufRec, storage));
+}
+
+#endif /* _NETBUF_H_ */
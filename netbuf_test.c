@@ -0,0 +1,297 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the NetBuf reference counting, then measure the copies and the
+ * throughput of the guest to slirp packet path: the NIC's scatter-gather
+ * frame goes through an active shaper and delayer, like in net-android.c,
+ * to the point where slirp adopts the buffer as an mbuf. the same path is
+ * also run with the copies that were made before NetBuf, for comparison.
+ * the shaper runs on a simulated clock, provided below in place of the
+ * QEMU timers. run with 'make check'.
+ */
+#include "netbuf.h"
+#include "shaper.h"
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include <sys/time.h>
+#include <sys/uio.h>
+
+static int  errors;
+
+/** memory and simulated timers, for shaper.c and netbuf.c
+ **/
+
+static int  num_allocs;
+
+void*  qemu_malloc( size_t  size )  { num_allocs++; return malloc(size); }
+void*  qemu_mallocz( size_t  size ) { num_allocs++; return calloc(1, size); }
+void   qemu_free( void*  ptr )      { if (ptr) num_allocs--; free(ptr); }
+
+struct QEMUTimer {
+    QEMUTimerCB*  cb;
+    void*         opaque;
+    int64_t       expire_time;
+    int           pending;
+};
+
+static QEMUTimer  timers[2];
+static int        num_timers;
+static int64_t    sim_now;      /* in ms, like rt_clock */
+QEMUClock*        rt_clock;
+
+int64_t
+qemu_get_clock( QEMUClock*  clock )
+{
+    return sim_now;
+}
+
+QEMUTimer*
+qemu_new_timer( QEMUClock*  clock, QEMUTimerCB*  cb, void*  opaque )
+{
+    QEMUTimer*  ts = &timers[num_timers++];
+
+    ts->cb      = cb;
+    ts->opaque  = opaque;
+    ts->pending = 0;
+    return ts;
+}
+
+void  qemu_free_timer( QEMUTimer*  ts ) { ts->pending = 0; }
+void  qemu_del_timer( QEMUTimer*  ts )  { ts->pending = 0; }
+
+void
+qemu_mod_timer( QEMUTimer*  ts, int64_t  expire_time )
+{
+    ts->expire_time = expire_time;
+    ts->pending     = 1;
+}
+
+/* advance the simulated clock by one ms, running the expired timers */
+static void
+run_timers( void )
+{
+    int  nn, again = 1;
+
+    sim_now += 1;
+    while (again) {
+        again = 0;
+        for (nn = 0; nn < num_timers; nn++) {
+            QEMUTimer*  ts = &timers[nn];
+            if (ts->pending && ts->expire_time <= sim_now) {
+                ts->pending = 0;
+                ts->cb(ts->opaque);
+                again = 1;
+            }
+        }
+    }
+}
+
+/** reference counting
+ **/
+
+static void
+check_refcount( void )
+{
+    static const char  head[] = "header";
+    static const char  body[] = "and body";
+    struct iovec       iov[2];
+    NetBuf             buf, buf2;
+
+    buf = netbuf_copy("packet", 6);
+    if (buf->size != 6 || memcmp(buf->data, "packet", 6) != 0 ||
+        buf->data != buf->storage + NETBUF_HEADROOM ||
+        netbuf_is_shared(buf) || netbuf_from_storage(buf->storage) != buf) {
+        fprintf(stderr, "netbuf_test: netbuf_copy() is wrong\n");
+        errors++;
+    }
+
+    buf2 = netbuf_ref(buf);
+    if (buf2 != buf || !netbuf_is_shared(buf)) {
+        fprintf(stderr, "netbuf_test: netbuf_ref() is wrong\n");
+        errors++;
+    }
+    netbuf_unref(buf2);
+    if (netbuf_is_shared(buf) || num_allocs != 1) {
+        fprintf(stderr, "netbuf_test: netbuf_unref() freed a shared buffer\n");
+        errors++;
+    }
+    netbuf_unref(buf);
+    netbuf_unref(NULL);
+
+    iov[0].iov_base = (void*) head;
+    iov[0].iov_len  = 6;
+    iov[1].iov_base = (void*) body;
+    iov[1].iov_len  = 8;
+    buf = netbuf_copyv(iov, 2);
+    if (buf->size != 14 || memcmp(buf->data, "headerand body", 14) != 0) {
+        fprintf(stderr, "netbuf_test: netbuf_copyv() is wrong\n");
+        errors++;
+    }
+    netbuf_unref(buf);
+
+    if (num_allocs != 0) {
+        fprintf(stderr, "netbuf_test: %d buffers leaked\n", num_allocs);
+        errors++;
+    }
+}
+
+/** packet path
+ **/
+
+#define  NB_PACKETS       1000000
+#define  PACKETS_PER_MS   64
+
+static int       copy_mode;     /* 1 to make the copies done before NetBuf */
+static int64_t   num_copies;
+static int64_t   delivered;
+static uint8_t   mbuf[2048];    /* where slirp would have copied a packet */
+
+/* what slirp_input_netbuf() sees */
+static void
+slirp_sink( NetBuf  buf, void*  opaque )
+{
+    uint8_t*  data = opaque;
+
+    if (copy_mode) {
+        memcpy(mbuf, buf->data, buf->size);
+        num_copies++;
+    } else if (buf->data != data || netbuf_is_shared(buf)) {
+        /* slirp can only adopt a buffer that isn't shared */
+        fprintf(stderr, "netbuf_test: packet was copied or is still shared\n");
+        errors++;
+    }
+    delivered++;
+    netbuf_unref(buf);
+}
+
+static NetDelay   path_delay;
+static NetShaper  path_shaper;
+
+/* slirp_shaper_in_cb() in net-android.c */
+static void
+shaper_out( NetBuf  buf, void*  opaque )
+{
+    netdelay_send_aux(path_delay, buf, opaque);
+}
+
+/* send NB_PACKETS frames of 'size' bytes, each a 14-byte Ethernet header
+ * and a payload as separate vectors, like a NIC would. returns the host
+ * time taken, in seconds */
+static double
+run_path( int  size )
+{
+    static uint8_t  frame[1514];
+    struct iovec    iov[2];
+    struct timeval  t0, t1;
+    int             nn;
+
+    /* an IPv4 TCP ACK packet, which the delayer never holds */
+    memset(frame, 0, sizeof(frame));
+    frame[12] = 0x08;
+    frame[14] = 0x45;
+    frame[22] = 64;
+    frame[23] = 6;
+    frame[26] = 10; frame[29] = 15;
+    frame[30] = 74;
+    frame[47] = 0x10;
+
+    iov[0].iov_base = frame;
+    iov[0].iov_len  = 14;
+    iov[1].iov_base = frame + 14;
+    iov[1].iov_len  = size - 14;
+
+    num_timers  = 0;
+    sim_now     = 0;
+    num_copies  = 0;
+    delivered   = 0;
+    path_shaper = netshaper_create(shaper_out);
+    path_delay  = netdelay_create(slirp_sink);
+
+    /* the shaper lets PACKETS_PER_MS packets through per ms, so that
+     * each of them waits in its queue */
+    netshaper_set_rate(path_shaper, PACKETS_PER_MS*size*8.*1000);
+    netdelay_set_latency(path_delay, 35, 200);
+
+    gettimeofday(&t0, NULL);
+    for (nn = 0; nn < NB_PACKETS; nn++) {
+        NetBuf    buf = netbuf_copyv(iov, 2);   /* the NIC's copy */
+        uint8_t*  data = buf->data;
+
+        num_copies++;
+
+        if (copy_mode) {
+            /* the shaper queued its own copy. the NIC's frame was
+             * flattened in a bounce buffer instead of a NetBuf, which
+             * costs the same as netbuf_copyv() */
+            NetBuf  copy = netbuf_copy(buf->data, buf->size);
+            netbuf_unref(buf);
+            buf = copy;
+            num_copies += 1;
+        }
+        netshaper_send_aux(path_shaper, buf, data);
+
+        if ((nn + 1) % PACKETS_PER_MS == 0)
+            run_timers();
+    }
+    while (delivered < NB_PACKETS)
+        run_timers();
+    gettimeofday(&t1, NULL);
+
+    netdelay_destroy(path_delay);
+    netshaper_destroy(path_shaper);
+
+    if (num_allocs != 0) {
+        fprintf(stderr, "netbuf_test: %d buffers leaked\n", num_allocs);
+        errors++;
+    }
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+}
+
+static void
+bench_path( int  size )
+{
+    double  secs[2];
+    double  copies[2];
+    int     mode;
+
+    for (mode = 1; mode >= 0; mode--) {
+        copy_mode    = mode;
+        secs[mode]   = run_path(size);
+        copies[mode] = (double)num_copies / NB_PACKETS;
+    }
+
+    printf("netbuf_test: %d-byte packets: %.0f copies, %.0f ns/packet, "
+           "%.0f MB/s with NetBuf; %.0f copies, %.0f ns/packet, %.0f MB/s "
+           "before (%.2fx)\n", size,
+           copies[0], secs[0] * 1e9 / NB_PACKETS,
+           (double)size * NB_PACKETS / secs[0] / 1e6,
+           copies[1], secs[1] * 1e9 / NB_PACKETS,
+           (double)size * NB_PACKETS / secs[1] / 1e6,
+           secs[1] / secs[0]);
+}
+
+int
+main( void )
+{
+    check_refcount();
+    if (errors == 0) {
+        bench_path(64);
+        bench_path(1514);
+    }
+
+    if (errors > 0) {
+        fprintf(stderr, "netbuf_test: FAILED\n");
+        return 1;
+    }
+    printf("netbuf_test: OK\n");
+    return 0;
+}
@@ -42,6 +42,9 @@ proxy_set_verbose(int  mode)
 
 static ProxyConnection  s_connections[1];
 
+/* the looper our connection sockets are registered with */
+static IoLooper*        s_looper;
+
 #define  MAX_HEX_DUMP  512
 
 static void
@@ -73,6 +76,8 @@ proxy_connection_init( ProxyConnection*           conn,
     conn->conn_select = conn_select;
     conn->conn_poll   = conn_poll;
 
+    conn->sel_count   = 0;
+
     socket_set_nonblock(socket);
 
     {
@@ -235,9 +240,75 @@ proxy_connection_insert( ProxyConnection*  conn, ProxyConnection*  after )
     conn->prev        = after;
 }
 
+static unsigned
+proxy_select_to_looper( unsigned  flags )
+{
+    unsigned  result = 0;
+
+    if (flags & PROXY_SELECT_READ)
+        result |= IOLOOPER_READ;
+    if (flags & PROXY_SELECT_WRITE)
+        result |= IOLOOPER_WRITE;
+    if (flags & PROXY_SELECT_ERROR)
+        result |= IOLOOPER_EXCEPT;
+
+    return result;
+}
+
+/* update the looper registrations of a connection from 'sel_count'
+ * old ones to those listed in 'sel'. a NULL 'sel' removes them all */
+static void
+proxy_connection_register( ProxyConnection*  conn, ProxySelect*  sel )
+{
+    int  count = sel ? sel->count : 0;
+    int  n, m;
+
+    if (s_looper == NULL)
+        return;
+
+    /* first, modify or remove old registrations */
+    for (n = 0; n < conn->sel_count; n++) {
+        int       fd    = conn->sel_fds[n];
+        unsigned  flags = 0;
+
+        for (m = 0; m < count; m++) {
+            if (sel->fds[m] == fd) {
+                flags = sel->flags[m];
+                break;
+            }
+        }
+        iolooper_modify( s_looper, fd,
+                         proxy_select_to_looper(conn->sel_flags[n]),
+                         proxy_select_to_looper(flags) );
+    }
+
+    /* then, add new ones */
+    for (m = 0; m < count; m++) {
+        int  fd = sel->fds[m];
+
+        for (n = 0; n < conn->sel_count; n++) {
+            if (conn->sel_fds[n] == fd)
+                break;
+        }
+        if (n == conn->sel_count)
+            iolooper_modify( s_looper, fd, 0,
+                             proxy_select_to_looper(sel->flags[m]) );
+    }
+
+    for (m = 0; m < count; m++) {
+        conn->sel_fds[m]   = sel->fds[m];
+        conn->sel_flags[m] = sel->flags[m];
+    }
+    conn->sel_count = count;
+}
+
 static void
 proxy_connection_remove( ProxyConnection*  conn )
 {
+    /* the connection's sockets are going to be closed or handed
+     * over to slirp, so stop watching them now */
+    proxy_connection_register(conn, NULL);
+
     conn->prev->next = conn->next;
     conn->next->prev = conn->prev;
 
@@ -374,26 +445,21 @@ proxy_select_set( ProxySelect*  sel,
                   int           fd,
                   unsigned      flags )
 {
+    int  n;
+
     if (fd < 0 || !flags)
         return;
 
-    if (*sel->pcount < fd+1)
-        *sel->pcount = fd+1;
-
-    if (flags & PROXY_SELECT_READ) {
-        FD_SET( fd, sel->reads );
-    } else {
-        FD_CLR( fd, sel->reads );
-    }
-    if (flags & PROXY_SELECT_WRITE) {
-        FD_SET( fd, sel->writes );
-    } else {
-        FD_CLR( fd, sel->writes );
+    for (n = 0; n < sel->count; n++) {
+        if (sel->fds[n] == fd) {
+            sel->flags[n] = flags;
+            return;
+        }
     }
-    if (flags & PROXY_SELECT_ERROR) {
-        FD_SET( fd, sel->errors );
-    } else {
-        FD_CLR( fd, sel->errors );
+    if (sel->count < PROXY_SELECT_MAX_FDS) {
+        sel->fds[sel->count]   = fd;
+        sel->flags[sel->count] = flags;
+        sel->count++;
     }
 }
 
@@ -403,20 +469,22 @@ proxy_select_poll( ProxySelect*  sel, int  fd )
     unsigned  flags = 0;
 
     if (fd >= 0) {
-        if ( FD_ISSET(fd, sel->reads) )
+        int  ready = iolooper_get_ready(sel->looper, fd);
+
+        if (ready & IOLOOPER_READ)
             flags |= PROXY_SELECT_READ;
-        if ( FD_ISSET(fd, sel->writes) )
+        if (ready & IOLOOPER_WRITE)
             flags |= PROXY_SELECT_WRITE;
-        if ( FD_ISSET(fd, sel->errors) )
+        if (ready & IOLOOPER_EXCEPT)
             flags |= PROXY_SELECT_ERROR;
     }
     return flags;
 }
 
-/* this function is called to update the select file descriptor sets
- * with those of the proxified connection sockets that are currently managed */
+/* this function is called to register with the looper the proxified
+ * connection sockets that are currently managed */
 void
-proxy_manager_select_fill( int  *pcount, fd_set*  read_fds, fd_set*  write_fds, fd_set*  err_fds)
+proxy_manager_select_fill( IoLooper*  looper )
 {
     ProxyConnection*  conn;
     ProxySelect       sel[1];
@@ -424,30 +492,28 @@ proxy_manager_select_fill( int  *pcount, fd_set*  read_fds, fd_set*  write_fds,
     if (!s_init)
         proxy_manager_init();
 
-    sel->pcount = pcount;
-    sel->reads  = read_fds;
-    sel->writes = write_fds;
-    sel->errors = err_fds;
+    s_looper    = looper;
+    sel->looper = looper;
 
     conn = s_connections->next;
     while (conn != s_connections) {
         ProxyConnection*  next = conn->next;
+        sel->count = 0;
         conn->conn_select(conn, sel);
+        proxy_connection_register(conn, sel);
         conn = next;
     }
 }
 
 /* this function is called to act on proxified connection sockets when network events arrive */
 void
-proxy_manager_poll( fd_set*  read_fds, fd_set*  write_fds, fd_set*  err_fds )
+proxy_manager_poll( IoLooper*  looper )
 {
     ProxyConnection*  conn = s_connections->next;
     ProxySelect       sel[1];
 
-    sel->pcount = NULL;
-    sel->reads  = read_fds;
-    sel->writes = write_fds;
-    sel->errors = err_fds;
+    sel->looper = looper;
+    sel->count  = 0;
 
     while (conn != s_connections) {
         ProxyConnection*  next  = conn->next;
@@ -13,12 +13,7 @@
 #define _PROXY_COMMON_H_
 
 #include "sockets.h"
-
-#ifdef _WIN32
-#include <winsock2.h>
-#else
-#include <sys/select.h>
-#endif
+#include "iolooper.h"
 
 /* types and definitions used by all proxy connections */
 
@@ -73,16 +68,11 @@ extern int   proxy_manager_add( SockAddress*         address,
  */
 extern void  proxy_manager_del( void*  ev_opaque );
 
-/* this function is called to update the select file descriptor sets
- * with those of the proxified connection sockets that are currently managed */
-extern void  proxy_manager_select_fill( int     *pcount, 
-                                        fd_set*  read_fds, 
-                                        fd_set*  write_fds, 
-                                        fd_set*  err_fds);
+/* this function is called to register with the looper the proxified
+ * connection sockets that are currently managed */
+extern void  proxy_manager_select_fill( IoLooper*  looper );
 
 /* this function is called to act on proxified connection sockets when network events arrive */
-extern void  proxy_manager_poll( fd_set*  read_fds, 
-                                 fd_set*  write_fds, 
-                                 fd_set*  err_fds );
+extern void  proxy_manager_poll( IoLooper*  looper );
 
 #endif /* END */
@@ -33,11 +33,14 @@ enum {
     PROXY_SELECT_ERROR = (1 << 2)
 };
 
+/* maximum number of sockets watched by a single connection */
+#define  PROXY_SELECT_MAX_FDS  2
+
 typedef struct {
-    int*     pcount;
-    fd_set*  reads;
-    fd_set*  writes;
-    fd_set*  errors;
+    IoLooper*  looper;
+    int        count;
+    int        fds[PROXY_SELECT_MAX_FDS];
+    unsigned   flags[PROXY_SELECT_MAX_FDS];
 } ProxySelect;
 
 extern void     proxy_select_set( ProxySelect*  sel,
@@ -82,6 +85,11 @@ struct ProxyConnection {
     int                 str_sent;    /* see proxy_connection_send() */
     int                 str_recv;    /* see proxy_connection_receive() */
 
+    /* sockets registered with the looper, see proxy_manager_select_fill() */
+    int                 sel_count;
+    int                 sel_fds[PROXY_SELECT_MAX_FDS];
+    unsigned            sel_flags[PROXY_SELECT_MAX_FDS];
+
     /* connection methods */
     ProxyConnectionFreeFunc    conn_free;
     ProxyConnectionSelectFunc  conn_select;
@@ -844,6 +844,12 @@ info_f(int argc, char **argv)
 
 	printf("cluster size: %s\n", s1);
 	printf("vm state offset: %s\n", s2);
+	if (bdi.l2_cache_hits + bdi.l2_cache_misses > 0) {
+		printf("l2 cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+			bdi.l2_cache_hits, bdi.l2_cache_misses);
+		printf("refcount cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+			bdi.refcount_cache_hits, bdi.refcount_cache_misses);
+	}
 
 	return 0;
 }
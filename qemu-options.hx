@@ -234,6 +234,17 @@ the raw disk image you use is not written back. You can however force
 the write back by pressing @key{C-a s} (@pxref{disk_images}).
 ETEXI
 
+DEF("metadata-cache-size", HAS_ARG, QEMU_OPTION_metadata_cache_size,
+    "-metadata-cache-size kb\n"
+    "                cache up to 'kb' KB of image metadata per disk image\n")
+STEXI
+@item -metadata-cache-size @var{kb}
+Cache up to @var{kb} kilobytes of metadata for each disk image. For qcow2
+images, this is the size of the L2 and refcount table caches. Larger
+caches avoid re-reading metadata during random I/O on large images. The
+default caches 1 MB of L2 tables.
+ETEXI
+
 DEF("m", HAS_ARG, QEMU_OPTION_m,
     "-m megs         set virtual RAM size to megs MB [default=%d]\n")
 STEXI
@@ -1392,6 +1403,40 @@ STEXI
 Start right away with a saved state (@code{loadvm} in monitor)
 ETEXI
 
+DEF("mapped-ram", 0, QEMU_OPTION_mapped_ram, \
+    "-mapped-ram     store snapshot RAM in files mapped lazily on restore\n")
+STEXI
+@item -mapped-ram
+Make @code{savevm} store guest RAM uncompressed in a separate file next to
+the snapshot image, and make @code{loadvm} map such files over guest RAM
+instead of reading them, so that pages are only loaded on first access.
+Guest RAM modified after the restore is then private to the emulator, and
+is no longer shared with other host processes.
+ETEXI
+
+DEF("mem-merge", 0, QEMU_OPTION_mem_merge, \
+    "-mem-merge      allocate guest RAM privately so that KSM can merge it\n")
+STEXI
+@item -mem-merge
+Allocate guest RAM as private memory registered for the kernel's same page
+merging (KSM), so that identical pages of emulators running on the same
+host are shared once KSM is enabled in @file{/sys/kernel/mm/ksm/run}.
+Guest RAM is then no longer shared with other host processes.
+ETEXI
+
+DEF("mem-dedup", HAS_ARG, QEMU_OPTION_mem_dedup, \
+    "-mem-dedup file share unmodified guest RAM pages through page store 'file'\n")
+STEXI
+@item -mem-dedup @var{file}
+Periodically look up guest RAM pages that have not been modified for a
+while in the page store @var{file}, which is created if needed, and map
+them from it. All emulators using the same store share a single copy of
+their identical pages, which is copied again if the guest modifies it.
+The store should be on a memory file system such as @file{/dev/shm}, and
+can be deleted once no emulator uses it. This implies @option{-mem-merge}.
+Use @code{info ramshare} in the monitor to see the number of shared pages.
+ETEXI
+
 #ifndef _WIN32
 DEF("daemonize", 0, QEMU_OPTION_daemonize, \
     "-daemonize      daemonize QEMU after initializing\n")
@@ -1542,6 +1587,16 @@ DEF("tb-size", HAS_ARG, QEMU_OPTION_tb_size, \
 STEXI
 ETEXI
 
+DEF("tlb-size", HAS_ARG, QEMU_OPTION_tlb_size, \
+    "-tlb-size n     set the number of TLB entries per MMU mode (256 to 4096)\n")
+STEXI
+@item -tlb-size @var{n}
+Set the number of entries of the software TLB used for each MMU mode, which
+must be a power of two between 256 and 4096. Larger TLBs need fewer guest
+page table walks for programs with a large working set, at the expense of
+slower TLB flushes. The default is 1024.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n")
 STEXI
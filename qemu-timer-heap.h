@@ -0,0 +1,119 @@
+/*
+ * QEMU timer heap
+ *
+ * Copyright (c) 2003-2008 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef QEMU_TIMER_HEAP_H
+#define QEMU_TIMER_HEAP_H
+
+/* The pending timers of each clock are kept in a binary min-heap ordered
+   by expiration time, so that adding, modifying or deleting a timer is
+   O(log n) and checking whether it is pending is O(1). Timers with the
+   same expiration time are ordered by 'seq'.
+
+   This is only included by vl-android.c and its unit test, which define
+   struct QEMUTimer with 'expire_time', 'seq' and 'heap_index' fields
+   first. */
+
+typedef struct QEMUTimerHeap {
+    QEMUTimer **timers;
+    int count;
+    int size;
+} QEMUTimerHeap;
+
+static inline int timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    if (a->expire_time != b->expire_time)
+        return a->expire_time < b->expire_time;
+    return a->seq < b->seq;
+}
+
+static inline void timer_heap_set(QEMUTimerHeap *h, int i, QEMUTimer *ts)
+{
+    h->timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_up(QEMUTimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!timer_before(ts, h->timers[parent]))
+            break;
+        timer_heap_set(h, i, h->timers[parent]);
+        i = parent;
+    }
+    timer_heap_set(h, i, ts);
+}
+
+static void timer_heap_down(QEMUTimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->timers[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= h->count)
+            break;
+        if (child + 1 < h->count &&
+            timer_before(h->timers[child + 1], h->timers[child]))
+            child++;
+        if (!timer_before(h->timers[child], ts))
+            break;
+        timer_heap_set(h, i, h->timers[child]);
+        i = child;
+    }
+    timer_heap_set(h, i, ts);
+}
+
+/* move a timer whose expire_time changed to its new place */
+static void timer_heap_update(QEMUTimerHeap *h, int i)
+{
+    if (i > 0 && timer_before(h->timers[i], h->timers[(i - 1) / 2]))
+        timer_heap_up(h, i);
+    else
+        timer_heap_down(h, i);
+}
+
+static void timer_heap_insert(QEMUTimerHeap *h, QEMUTimer *ts)
+{
+    if (h->count == h->size) {
+        h->size = h->size ? h->size * 2 : 16;
+        h->timers = qemu_realloc(h->timers, h->size * sizeof(QEMUTimer *));
+    }
+    timer_heap_set(h, h->count++, ts);
+    timer_heap_up(h, h->count - 1);
+}
+
+static void timer_heap_remove(QEMUTimerHeap *h, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last = h->timers[--h->count];
+
+    ts->heap_index = -1;
+    if (last != ts) {
+        timer_heap_set(h, i, last);
+        timer_heap_update(h, i);
+    }
+}
+
+#endif /* QEMU_TIMER_HEAP_H */
@@ -0,0 +1,184 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the timer heap of qemu-timer-heap.h against a brute-force model,
+ * then measure the cost of timer churn. run with 'make check'.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define qemu_realloc realloc
+
+typedef struct QEMUTimer QEMUTimer;
+
+struct QEMUTimer {
+    int64_t expire_time;
+    uint64_t seq;
+    int heap_index;
+    int pending;            /* model: what the heap should say */
+};
+
+#include "qemu-timer-heap.h"
+
+#define NB_TIMERS   200
+#define NB_OPS      200000
+
+static QEMUTimer timers[NB_TIMERS];
+static QEMUTimerHeap heap;
+static uint64_t seq;
+static uint32_t rand_state = 1;
+static int errors;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static void mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+    ts->expire_time = expire_time;
+    ts->seq = seq++;
+    if (ts->heap_index >= 0)
+        timer_heap_update(&heap, ts->heap_index);
+    else
+        timer_heap_insert(&heap, ts);
+    ts->pending = 1;
+}
+
+static void del_timer(QEMUTimer *ts)
+{
+    if (ts->heap_index >= 0)
+        timer_heap_remove(&heap, ts);
+    ts->pending = 0;
+}
+
+/* the pending timer that must expire first, by brute force */
+static QEMUTimer *model_head(void)
+{
+    QEMUTimer *head = NULL;
+    int i;
+
+    for (i = 0; i < NB_TIMERS; i++) {
+        QEMUTimer *ts = &timers[i];
+        if (ts->pending && (!head || timer_before(ts, head)))
+            head = ts;
+    }
+    return head;
+}
+
+static void check(int op)
+{
+    QEMUTimer *head = model_head();
+    int i, count = 0;
+
+    for (i = 0; i < NB_TIMERS; i++) {
+        QEMUTimer *ts = &timers[i];
+
+        count += ts->pending;
+        if (ts->pending != (ts->heap_index >= 0) ||
+            (ts->heap_index >= 0 && heap.timers[ts->heap_index] != ts)) {
+            fprintf(stderr, "op %d: timer %d has heap index %d\n",
+                    op, i, ts->heap_index);
+            errors++;
+        }
+    }
+    for (i = 1; i < heap.count; i++) {
+        if (timer_before(heap.timers[i], heap.timers[(i - 1) / 2])) {
+            fprintf(stderr, "op %d: heap order broken at %d\n", op, i);
+            errors++;
+        }
+    }
+    if (count != heap.count ||
+        (head ? heap.count == 0 || heap.timers[0] != head : heap.count != 0)) {
+        fprintf(stderr, "op %d: wrong head or count %d, expected %d\n",
+                op, heap.count, count);
+        errors++;
+    }
+}
+
+static void check_model(void)
+{
+    int64_t now = 0;
+    int op, i;
+
+    for (i = 0; i < NB_TIMERS; i++)
+        timers[i].heap_index = -1;
+
+    for (op = 0; op < NB_OPS && errors < 10; op++) {
+        QEMUTimer *ts = &timers[next_rand() % NB_TIMERS];
+        uint32_t r = next_rand() % 8;
+
+        if (r < 4) {
+            /* few distinct deadlines, so that many timers tie */
+            mod_timer(ts, now + next_rand() % 32);
+        } else if (r < 6) {
+            del_timer(ts);
+        } else {
+            /* run the expired timers, in order, like qemu_run_timers() */
+            now += next_rand() % 8;
+            while (heap.count > 0 && heap.timers[0]->expire_time <= now) {
+                QEMUTimer *head = model_head();
+                if (heap.timers[0] != head) {
+                    fprintf(stderr, "op %d: timers run out of order\n", op);
+                    errors++;
+                    break;
+                }
+                del_timer(head);
+            }
+        }
+        check(op);
+    }
+}
+
+/* many pending timers constantly re-armed, as with periodic device timers */
+static void bench_churn(void)
+{
+    static QEMUTimer churn[4096];
+    struct timeval t0, t1;
+    double secs;
+    int i, n;
+
+    for (i = 0; i < 4096; i++) {
+        churn[i].heap_index = -1;
+        mod_timer(&churn[i], next_rand() % 1000000);
+    }
+
+    gettimeofday(&t0, NULL);
+    for (n = 0; n < 4000000; n++) {
+        QEMUTimer *ts = &churn[next_rand() % 4096];
+        if (n % 4 == 3)
+            del_timer(ts);
+        else
+            mod_timer(ts, next_rand() % 1000000);
+    }
+    gettimeofday(&t1, NULL);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+    printf("timer_heap_test: %d mod/del ops on %d timers in %.3f s, "
+           "%.0f ns/op\n", n, 4096, secs, secs * 1e9 / n);
+}
+
+int main(void)
+{
+    check_model();
+    if (errors > 0) {
+        fprintf(stderr, "timer_heap_test: FAILED\n");
+        return 1;
+    }
+    printf("timer_heap_test: %d ops checked against the model: OK\n", NB_OPS);
+
+    bench_churn();
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Compressed chunks of guest RAM pages, for savevm and migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_RAM_CHUNK_H
+#define QEMU_RAM_CHUNK_H
+
+/* A RamChunk holds the index of up to RAM_CHUNK_PAGES pages, and the
+   zlib-compressed contents of those sent in full. The compression and
+   decompression run on a ThreadPool worker.
+
+   This is only included by vl-android.c and its unit test, which define
+   TARGET_PAGE_SIZE and include zlib.h and thread-pool.h first. */
+
+#define RAM_CHUNK_PAGES      256
+
+#define RAM_CHUNK_PAGE       0
+#define RAM_CHUNK_FILL       1
+#define RAM_CHUNK_DUP        2
+
+typedef struct RamChunk {
+    ThreadPoolJob job;
+    int npages;                         /* number of index entries */
+    uint64_t index[RAM_CHUNK_PAGES];    /* page address | RAM_CHUNK_XXX */
+    uint64_t arg[RAM_CHUNK_PAGES];      /* fill value or source address */
+    int ndata;                          /* number of RAM_CHUNK_PAGE pages */
+    uint8_t *data[RAM_CHUNK_PAGES];     /* and their host addresses */
+    uint8_t *buf;                       /* compressed data */
+    int buf_size;
+    int len;                            /* compressed size, -1 on error */
+} RamChunk;
+
+/* compute the hash of a page, and return 1 if it is filled with a single
+   byte value */
+static int ram_page_hash(const uint8_t *page, uint64_t *phash)
+{
+    const uint64_t *p = (const uint64_t *)page;
+    uint64_t first = p[0], diff = 0, h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / 8; i++) {
+        diff |= p[i] ^ first;
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    *phash = h ^ (h >> 29);
+
+    return diff == 0 && first == (uint8_t)first * 0x0101010101010101ULL;
+}
+
+/* runs on a worker thread */
+static void ram_chunk_compress(void *opaque)
+{
+    RamChunk *c = opaque;
+    z_stream zs;
+    int i, ret = Z_OK;
+
+    c->len = 0;
+    if (c->ndata == 0)
+        return;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK) {
+        c->len = -1;
+        return;
+    }
+
+    zs.next_out = c->buf;
+    zs.avail_out = c->buf_size;
+    for (i = 0; i < c->ndata; i++) {
+        zs.next_in = c->data[i];
+        zs.avail_in = TARGET_PAGE_SIZE;
+        ret = deflate(&zs, (i == c->ndata - 1) ? Z_FINISH : Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            break;
+    }
+
+    c->len = (ret == Z_STREAM_END) ? (int)zs.total_out : -1;
+    deflateEnd(&zs);
+}
+
+/* runs on a worker thread */
+static void ram_chunk_decompress(void *opaque)
+{
+    RamChunk *c = opaque;
+    z_stream zs;
+    int i, ret = Z_OK;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        c->len = -1;
+        return;
+    }
+
+    zs.next_in = c->buf;
+    zs.avail_in = c->len;
+    for (i = 0; i < c->ndata; i++) {
+        zs.next_out = c->data[i];
+        zs.avail_out = TARGET_PAGE_SIZE;
+        ret = inflate(&zs, Z_SYNC_FLUSH);
+        if ((ret != Z_OK && ret != Z_STREAM_END) || zs.avail_out != 0)
+            break;
+    }
+
+    if (ret != Z_STREAM_END || i != c->ndata)
+        c->len = -1;
+    inflateEnd(&zs);
+}
+
+#endif /* QEMU_RAM_CHUNK_H */
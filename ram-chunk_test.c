@@ -0,0 +1,520 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the ThreadPool, then save and restore synthetic guest RAM, made
+ * of zero, filled, duplicate, text-like and random pages, in the chunks
+ * of ram-chunk.h like ram_save_chunks() and ram_load_chunk() do, and in
+ * the version 3 format used before them. the stream is kept in memory,
+ * so that only the CPU cost of each format is measured, along with the
+ * size that would be written. run with 'make check'.
+ */
+#include "qemu-common.h"
+#include "thread-pool.h"
+#include <zlib.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#define TARGET_PAGE_BITS  10
+#define TARGET_PAGE_SIZE  (1 << TARGET_PAGE_BITS)
+#define TARGET_PAGE_MASK  ~(TARGET_PAGE_SIZE - 1)
+
+#include "ram-chunk.h"
+
+/* 128 MB of guest RAM */
+#define RAM_PAGES    (128 * 1024)
+#define RAM_SIZE     ((size_t)RAM_PAGES * TARGET_PAGE_SIZE)
+
+#define NB_JOBS      10000
+
+static uint32_t rand_state = 1;
+static int errors;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+void *qemu_malloc(size_t size)  { return malloc(size); }
+void *qemu_mallocz(size_t size) { return calloc(1, size); }
+void qemu_free(void *ptr)       { free(ptr); }
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** thread pool
+ **/
+
+typedef struct {
+    ThreadPoolJob job;
+    int input;
+    int output;
+} TestJob;
+
+static void test_job(void *opaque)
+{
+    TestJob *t = opaque;
+    int i;
+
+    t->output = t->input;
+    for (i = 0; i < t->input % 1000; i++)
+        t->output = t->output * 31 + i;
+}
+
+static int test_job_result(int input)
+{
+    int i, output = input;
+
+    for (i = 0; i < input % 1000; i++)
+        output = output * 31 + i;
+    return output;
+}
+
+static void check_pool(void)
+{
+    static TestJob jobs[NB_JOBS];
+    ThreadPool *pool = thread_pool_new(4);
+    ThreadPoolJob *job;
+    struct pollfd pfd;
+    int i, completed = 0;
+
+    if (thread_pool_get_size(pool) != 4) {
+        fprintf(stderr, "ram_chunk_test: pool has %d threads, expected 4\n",
+                thread_pool_get_size(pool));
+        errors++;
+    }
+
+    /* waiting for each job in submission order, like the chunk ring */
+    for (i = 0; i < NB_JOBS; i++) {
+        jobs[i].input = next_rand();
+        thread_pool_submit(pool, &jobs[i].job, test_job, &jobs[i]);
+    }
+    for (i = 0; i < NB_JOBS; i++) {
+        thread_pool_wait_job(pool, &jobs[i].job);
+        if (!jobs[i].job.done ||
+            jobs[i].output != test_job_result(jobs[i].input)) {
+            fprintf(stderr, "ram_chunk_test: job %d is wrong\n", i);
+            errors++;
+            break;
+        }
+    }
+
+    /* collecting completed jobs through the notification fd */
+    pfd.fd = thread_pool_get_notify_fd(pool);
+    pfd.events = POLLIN;
+    for (i = 0; i < NB_JOBS; i++) {
+        jobs[i].input = next_rand();
+        thread_pool_submit(pool, &jobs[i].job, test_job, &jobs[i]);
+    }
+    while (completed < NB_JOBS) {
+        uint64_t value;
+
+        if (poll(&pfd, 1, 5000) != 1) {
+            fprintf(stderr, "ram_chunk_test: no completion notified\n");
+            errors++;
+            break;
+        }
+        if (read(pfd.fd, &value, sizeof(value)) < 0)
+            break;
+        for (job = thread_pool_get_completed(pool); job; job = job->next) {
+            TestJob *t = (TestJob *)job;
+            if (!job->done || t->output != test_job_result(t->input))
+                errors++;
+            completed++;
+        }
+    }
+    if (completed != NB_JOBS) {
+        fprintf(stderr, "ram_chunk_test: %d of %d jobs completed\n",
+                completed, NB_JOBS);
+        errors++;
+    }
+
+    thread_pool_free(pool);
+}
+
+/** guest RAM
+ **/
+
+/* fill 'ram' with a mix of pages like those of a booted system: about
+   40% zero, 5% filled with another byte, 10% copies of an earlier page,
+   35% text-like and 10% random */
+static void make_ram(uint8_t *ram)
+{
+    static const char words[][8] = {
+        "the ", "and ", "data ", "init ", "system ", "0x0 ", "\n", "null ",
+        "java/", "lang/", "Object", "String", "; ", "libc.", "so ", "= ",
+    };
+    size_t n;
+
+    for (n = 0; n < RAM_PAGES; n++) {
+        uint8_t *p = ram + n * TARGET_PAGE_SIZE;
+        uint32_t kind = next_rand() % 100;
+        int i, len;
+
+        if (kind < 40) {
+            memset(p, 0, TARGET_PAGE_SIZE);
+        } else if (kind < 45) {
+            memset(p, next_rand(), TARGET_PAGE_SIZE);
+        } else if (kind < 55 && n > 0) {
+            memcpy(p, ram + (next_rand() % n) * TARGET_PAGE_SIZE,
+                   TARGET_PAGE_SIZE);
+        } else if (kind < 90) {
+            for (i = 0; i < TARGET_PAGE_SIZE; i += len) {
+                const char *w = words[next_rand() % 16];
+                len = strlen(w);
+                if (len > TARGET_PAGE_SIZE - i)
+                    len = TARGET_PAGE_SIZE - i;
+                memcpy(p + i, w, len);
+            }
+            for (i = 0; i < 16; i++)
+                p[next_rand() % TARGET_PAGE_SIZE] = next_rand();
+        } else {
+            for (i = 0; i < TARGET_PAGE_SIZE; i++)
+                p[i] = next_rand();
+        }
+    }
+}
+
+static uint8_t *stream_put(uint8_t *s, const void *data, size_t size)
+{
+    memcpy(s, data, size);
+    return s + size;
+}
+
+static const uint8_t *stream_get(const uint8_t *s, void *data, size_t size)
+{
+    memcpy(data, s, size);
+    return s + size;
+}
+
+/** version 3: one record per page
+ **/
+
+/* is_dup_page() of vl-android.c */
+static int is_dup_page(const uint8_t *page, uint8_t ch)
+{
+    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
+    const uint32_t *array = (const uint32_t *)page;
+    int i;
+
+    for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
+        if (array[i] != val)
+            return 0;
+    }
+    return 1;
+}
+
+static size_t save_v3(const uint8_t *ram, uint8_t *stream)
+{
+    uint8_t *s = stream;
+    uint64_t addr;
+
+    for (addr = 0; addr < RAM_SIZE; addr += TARGET_PAGE_SIZE) {
+        const uint8_t *p = ram + addr;
+        uint64_t v;
+
+        if (is_dup_page(p, *p)) {
+            v = addr | 0x02;
+            s = stream_put(s, &v, 8);
+            s = stream_put(s, p, 1);
+        } else {
+            v = addr | 0x08;
+            s = stream_put(s, &v, 8);
+            s = stream_put(s, p, TARGET_PAGE_SIZE);
+        }
+    }
+    return s - stream;
+}
+
+static void load_v3(uint8_t *ram, const uint8_t *stream, size_t size)
+{
+    const uint8_t *s = stream, *end = stream + size;
+
+    while (s < end) {
+        uint64_t v;
+
+        s = stream_get(s, &v, 8);
+        if (v & 0x02) {
+            memset(ram + (v & TARGET_PAGE_MASK), *s, TARGET_PAGE_SIZE);
+            s += 1;
+        } else {
+            s = stream_get(s, ram + (v & TARGET_PAGE_MASK), TARGET_PAGE_SIZE);
+        }
+    }
+}
+
+/** version 4: compressed chunks
+ **/
+
+typedef struct {
+    uint64_t hash;
+    uint64_t addr;
+    int used;
+} HashEntry;
+
+static ThreadPool *pool;
+static RamChunk *chunks;
+static int nchunks, chunk_first, chunk_count;
+
+static void chunks_init(int nthreads)
+{
+    int i;
+
+    pool = thread_pool_new(nthreads);
+    nchunks = 2 * thread_pool_get_size(pool);
+    chunks = qemu_mallocz(nchunks * sizeof(RamChunk));
+    for (i = 0; i < nchunks; i++) {
+        chunks[i].buf_size = compressBound(RAM_CHUNK_PAGES * TARGET_PAGE_SIZE);
+        chunks[i].buf = qemu_malloc(chunks[i].buf_size);
+    }
+    chunk_first = chunk_count = 0;
+}
+
+static void chunks_free(void)
+{
+    int i;
+
+    thread_pool_free(pool);
+    for (i = 0; i < nchunks; i++)
+        qemu_free(chunks[i].buf);
+    qemu_free(chunks);
+}
+
+static RamChunk *chunk_next(void)
+{
+    return &chunks[(chunk_first + chunk_count) % nchunks];
+}
+
+static RamChunk *chunk_retire(void)
+{
+    RamChunk *c = &chunks[chunk_first];
+
+    thread_pool_wait_job(pool, &c->job);
+    chunk_first = (chunk_first + 1) % nchunks;
+    chunk_count--;
+    return c;
+}
+
+/* ram_chunk_put() */
+static uint8_t *chunk_put(uint8_t *s, RamChunk *c)
+{
+    int i;
+
+    if (c->len < 0) {
+        fprintf(stderr, "ram_chunk_test: compression failed\n");
+        errors++;
+        return s;
+    }
+    s = stream_put(s, &c->npages, 4);
+    for (i = 0; i < c->npages; i++) {
+        s = stream_put(s, &c->index[i], 8);
+        switch (c->index[i] & ~TARGET_PAGE_MASK) {
+        case RAM_CHUNK_FILL:
+            s = stream_put(s, &c->arg[i], 1);
+            break;
+        case RAM_CHUNK_DUP:
+            s = stream_put(s, &c->arg[i], 8);
+            break;
+        }
+    }
+    s = stream_put(s, &c->len, 4);
+    return stream_put(s, c->buf, c->len);
+}
+
+/* ram_save_chunks(), with all pages dirty */
+static size_t save_chunks(uint8_t *ram, uint8_t *stream)
+{
+    static HashEntry hash_table[2 * RAM_PAGES];
+    uint8_t *s = stream;
+    uint64_t addr = 0;
+
+    memset(hash_table, 0, sizeof(hash_table));
+    while (addr < RAM_SIZE) {
+        RamChunk *c;
+
+        if (chunk_count == nchunks)
+            s = chunk_put(s, chunk_retire());
+
+        /* ram_chunk_collect() */
+        c = chunk_next();
+        c->npages = 0;
+        c->ndata = 0;
+        for (; addr < RAM_SIZE && c->npages < RAM_CHUNK_PAGES;
+             addr += TARGET_PAGE_SIZE) {
+            uint8_t *p = ram + addr;
+            int n = c->npages++;
+            uint64_t hash;
+            HashEntry *e;
+
+            if (ram_page_hash(p, &hash)) {
+                c->index[n] = addr | RAM_CHUNK_FILL;
+                c->arg[n] = *p;
+                continue;
+            }
+            e = &hash_table[hash % (2 * RAM_PAGES)];
+            if (e->used && e->hash == hash &&
+                memcmp(ram + e->addr, p, TARGET_PAGE_SIZE) == 0) {
+                c->index[n] = addr | RAM_CHUNK_DUP;
+                c->arg[n] = e->addr;
+                continue;
+            }
+            e->used = 1;
+            e->hash = hash;
+            e->addr = addr;
+            c->index[n] = addr | RAM_CHUNK_PAGE;
+            c->data[c->ndata++] = p;
+        }
+
+        chunk_count++;
+        thread_pool_submit(pool, &c->job, ram_chunk_compress, c);
+    }
+    while (chunk_count > 0)
+        s = chunk_put(s, chunk_retire());
+
+    return s - stream;
+}
+
+/* ram_load_chunk() and ram_load_flush() */
+static void load_chunks(uint8_t *ram, const uint8_t *stream, size_t size)
+{
+    static uint64_t dups[RAM_PAGES][2];
+    const uint8_t *s = stream, *end = stream + size;
+    int i, ndups = 0;
+
+    while (s < end) {
+        RamChunk *c;
+
+        if (chunk_count == nchunks && chunk_retire()->len < 0)
+            errors++;
+
+        c = chunk_next();
+        s = stream_get(s, &c->npages, 4);
+        c->ndata = 0;
+        for (i = 0; i < c->npages; i++) {
+            uint64_t v, arg = 0;
+            uint8_t *p;
+
+            s = stream_get(s, &v, 8);
+            p = ram + (v & TARGET_PAGE_MASK);
+            switch (v & ~TARGET_PAGE_MASK) {
+            case RAM_CHUNK_PAGE:
+                c->data[c->ndata++] = p;
+                break;
+            case RAM_CHUNK_FILL:
+                s = stream_get(s, &arg, 1);
+                memset(p, arg, TARGET_PAGE_SIZE);
+                break;
+            case RAM_CHUNK_DUP:
+                s = stream_get(s, &arg, 8);
+                dups[ndups][0] = v & TARGET_PAGE_MASK;
+                dups[ndups][1] = arg;
+                ndups++;
+                break;
+            }
+        }
+        s = stream_get(s, &c->len, 4);
+        s = stream_get(s, c->buf, c->len);
+
+        if (c->ndata > 0) {
+            chunk_count++;
+            thread_pool_submit(pool, &c->job, ram_chunk_decompress, c);
+        }
+    }
+    while (chunk_count > 0) {
+        if (chunk_retire()->len < 0) {
+            fprintf(stderr, "ram_chunk_test: decompression failed\n");
+            errors++;
+        }
+    }
+    for (i = 0; i < ndups; i++)
+        memcpy(ram + dups[i][0], ram + dups[i][1], TARGET_PAGE_SIZE);
+}
+
+/* save 'ram' and restore it in 'copy', with 'nthreads' workers, one per
+   host CPU if it is negative, or in the version 3 format if it is 0 */
+static void bench_format(uint8_t *ram, uint8_t *copy, uint8_t *stream,
+                         int nthreads)
+{
+    double t0, save, load;
+    size_t size;
+
+    memset(copy, 0x55, RAM_SIZE);
+    if (nthreads != 0)
+        chunks_init(nthreads);
+
+    t0 = now_secs();
+    size = nthreads ? save_chunks(ram, stream) : save_v3(ram, stream);
+    save = now_secs() - t0;
+
+    t0 = now_secs();
+    if (nthreads)
+        load_chunks(copy, stream, size);
+    else
+        load_v3(copy, stream, size);
+    load = now_secs() - t0;
+
+    if (nthreads != 0) {
+        nthreads = thread_pool_get_size(pool);
+        chunks_free();
+    }
+
+    if (memcmp(ram, copy, RAM_SIZE) != 0) {
+        fprintf(stderr, "ram_chunk_test: restored RAM differs\n");
+        errors++;
+    }
+
+    if (nthreads == 0)
+        printf("ram_chunk_test: version 3: ");
+    else
+        printf("ram_chunk_test: chunks, %d thread%s: ", nthreads,
+               nthreads > 1 ? "s" : "");
+    printf("%zu MB stored (%.2fx), save %.0f MB/s, load %.0f MB/s\n",
+           size >> 20, (double)RAM_SIZE / size,
+           RAM_SIZE / save / 1e6, RAM_SIZE / load / 1e6);
+}
+
+int main(void)
+{
+    uint8_t *ram, *copy, *stream;
+
+    check_pool();
+    if (errors > 0) {
+        fprintf(stderr, "ram_chunk_test: FAILED\n");
+        return 1;
+    }
+
+    ram = qemu_malloc(RAM_SIZE);
+    copy = qemu_malloc(RAM_SIZE);
+    stream = qemu_malloc(2 * RAM_SIZE);
+    make_ram(ram);
+
+    bench_format(ram, copy, stream, 0);
+    bench_format(ram, copy, stream, 1);
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+        bench_format(ram, copy, stream, -1);
+
+    qemu_free(stream);
+    qemu_free(copy);
+    qemu_free(ram);
+
+    if (errors > 0) {
+        fprintf(stderr, "ram_chunk_test: FAILED\n");
+        return 1;
+    }
+    printf("ram_chunk_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,474 @@
+/*
+ * Sharing of identical guest RAM pages between emulator instances
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "cpu.h"
+#include "monitor.h"
+#include "qemu-timer.h"
+#include "block.h"
+#include "sysemu.h"
+#include "ram-dedup.h"
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/file.h>
+
+/*
+ * Instances running the same system image hold many identical pages:
+ * kernel text, preloaded classes in the zygote heap, zero pages... The
+ * kernel's KSM can merge them when it is available, but it scans slowly
+ * and is often disabled on build servers. Instead, each instance hashes
+ * the pages of its own RAM that have not been written for a few scan
+ * passes, and looks them up in a page store: a file shared by all
+ * instances (typically in /dev/shm), made of a hash table of page
+ * contents. A page found in the store, or added to it, is replaced by a
+ * private mapping of the store page, so that all instances share a
+ * single copy of it in the host page cache. The kernel transparently
+ * makes a private copy of the page when the guest writes to it again.
+ *
+ * The dedicated DEDUP_DIRTY_FLAG tells which pages were written between
+ * two passes: clearing it makes the next guest write to the page go
+ * through the 'notdirty' slow path, which sets it again.
+ *
+ * Store slots are never freed: once written, the content of a slot is
+ * immutable, so it can be compared and mapped without any locking. Slots
+ * are claimed with atomic operations on their state.
+ */
+
+#define RAM_DEDUP_MAGIC         0x50444d52      /* "RMDP" */
+#define RAM_DEDUP_VERSION       1
+
+#define RAM_DEDUP_SCAN_PERIOD   100     /* ms between scan steps */
+#define RAM_DEDUP_SCAN_PAGES    2048    /* host pages examined per step */
+#define RAM_DEDUP_MIN_AGE       3       /* clean passes before merging */
+#define RAM_DEDUP_MAX_PROBES    16
+#define RAM_DEDUP_MIN_SLOTS     65536
+
+/* every merged page may add a few mappings to the process, stay well
+   below the default limit of 65530 */
+#define RAM_DEDUP_MAX_MAPPINGS  16384
+
+enum {
+    SLOT_EMPTY = 0,
+    SLOT_BUSY,          /* being written by an instance */
+    SLOT_READY,
+};
+
+typedef struct RamDedupHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t reserved;
+    uint64_t nb_slots;  /* power of 2 */
+} RamDedupHeader;
+
+typedef struct RamDedupSlot {
+    uint64_t hash;
+    uint32_t state;
+    uint32_t users;     /* number of instances mapping the page */
+} RamDedupSlot;
+
+/* per host page state */
+#define PAGE_AGE_MASK   0x7f
+#define PAGE_MAPPED     0x80    /* a store page was mapped there once */
+
+typedef struct RamDedupState {
+    int fd;
+    RamDedupHeader *header;
+    RamDedupSlot *slots;
+    size_t map_size;            /* size of the header and slot table */
+    uint64_t data_offset;       /* file offset of the first slot's page */
+    ram_addr_t page_size;
+    ram_addr_t nb_pages;
+    uint8_t *page_state;
+    uint32_t *page_slot;        /* slot index + 1, or 0 if not merged */
+    int nb_mappings;
+    ram_addr_t scan_pos;
+    uint8_t *buf;
+    QEMUTimer *timer;
+
+    /* statistics */
+    uint64_t merged_pages;      /* pages currently mapped from the store */
+    uint64_t inserted_pages;    /* pages added to the store by this instance */
+    uint64_t broken_pages;      /* merged pages later written by the guest */
+    uint64_t no_slot_pages;     /* pages not stored, for lack of a free slot */
+} RamDedupState;
+
+static RamDedupState *ram_dedup;
+
+static uint64_t page_hash(const uint8_t *p, size_t size)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = size;
+    size_t i;
+
+    for (i = 0; i < size / 8; i++) {
+        h ^= w[i];
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/* the header and slot table come first, followed by the page slots */
+static uint64_t store_data_offset(RamDedupState *s, uint64_t nb_slots)
+{
+    uint64_t size = sizeof(RamDedupHeader) + nb_slots * sizeof(RamDedupSlot);
+
+    return (size + s->page_size - 1) & ~(uint64_t)(s->page_size - 1);
+}
+
+static int ram_dedup_open_store(RamDedupState *s, const char *path)
+{
+    RamDedupHeader header;
+    struct stat st;
+    uint64_t nb_slots;
+    void *p;
+    int ret = 0;
+
+    s->fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0600);
+    if (s->fd < 0)
+        return -errno;
+
+    /* the first instance to get the lock initializes the store */
+    flock(s->fd, LOCK_EX);
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        goto out;
+    }
+    if (st.st_size == 0) {
+        for (nb_slots = RAM_DEDUP_MIN_SLOTS; nb_slots < 4 * s->nb_pages;
+             nb_slots <<= 1)
+            ;
+        memset(&header, 0, sizeof(header));
+        header.magic = RAM_DEDUP_MAGIC;
+        header.version = RAM_DEDUP_VERSION;
+        header.page_size = s->page_size;
+        header.nb_slots = nb_slots;
+        /* the file is sparse, only used slots take memory */
+        if (ftruncate(s->fd, store_data_offset(s, nb_slots) +
+                             nb_slots * s->page_size) < 0 ||
+            pwrite(s->fd, &header, sizeof(header), 0) != sizeof(header)) {
+            ret = -errno;
+            ftruncate(s->fd, 0);
+            goto out;
+        }
+    } else if (pread(s->fd, &header, sizeof(header), 0) != sizeof(header) ||
+               header.magic != RAM_DEDUP_MAGIC ||
+               header.version != RAM_DEDUP_VERSION ||
+               header.page_size != s->page_size ||
+               header.nb_slots == 0 ||
+               (header.nb_slots & (header.nb_slots - 1))) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->data_offset = store_data_offset(s, header.nb_slots);
+    s->map_size = s->data_offset;
+    p = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (p == MAP_FAILED) {
+        ret = -errno;
+        goto out;
+    }
+    s->header = p;
+    s->slots = (RamDedupSlot *)(s->header + 1);
+
+ out:
+    flock(s->fd, LOCK_UN);
+    if (ret < 0)
+        close(s->fd);
+    return ret;
+}
+
+static void ram_dedup_release(RamDedupState *s, ram_addr_t page)
+{
+    RamDedupSlot *slot = &s->slots[s->page_slot[page] - 1];
+
+    __sync_fetch_and_sub(&slot->users, 1);
+    s->page_slot[page] = 0;
+    s->merged_pages--;
+}
+
+static int ram_dedup_map(RamDedupState *s, ram_addr_t page, uint8_t *host,
+                         uint64_t index)
+{
+    void *p;
+
+    if (!(s->page_state[page] & PAGE_MAPPED)) {
+        if (s->nb_mappings >= RAM_DEDUP_MAX_MAPPINGS)
+            return -1;
+        s->nb_mappings++;
+    }
+
+    p = mmap(host, s->page_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, s->fd,
+             s->data_offset + index * s->page_size);
+    if (p == MAP_FAILED) {
+        /* guest RAM may already be unmapped at this point */
+        fprintf(stderr, "Failed to map shared RAM page: %s\n",
+                strerror(errno));
+        abort();
+    }
+
+    __sync_fetch_and_add(&s->slots[index].users, 1);
+    s->page_state[page] |= PAGE_MAPPED;
+    s->page_slot[page] = index + 1;
+    s->merged_pages++;
+    return 0;
+}
+
+static void ram_dedup_merge(RamDedupState *s, ram_addr_t page, uint8_t *host)
+{
+    uint64_t hash = page_hash(host, s->page_size);
+    uint64_t mask = s->header->nb_slots - 1;
+    uint64_t index, offset;
+    RamDedupSlot *slot;
+    int probe;
+
+    for (probe = 0; probe < RAM_DEDUP_MAX_PROBES; probe++) {
+        index = (hash + probe) & mask;
+        slot = &s->slots[index];
+        offset = s->data_offset + index * s->page_size;
+
+        if (slot->state == SLOT_EMPTY) {
+            if (!__sync_bool_compare_and_swap(&slot->state, SLOT_EMPTY,
+                                              SLOT_BUSY)) {
+                /* claimed by another instance, look at it again */
+                probe--;
+                continue;
+            }
+            slot->hash = hash;
+            if (pwrite(s->fd, host, s->page_size, offset) != s->page_size) {
+                slot->state = SLOT_EMPTY;
+                return;
+            }
+            __sync_synchronize();
+            slot->state = SLOT_READY;
+            s->inserted_pages++;
+            ram_dedup_map(s, page, host, index);
+            return;
+        }
+
+        if (slot->state == SLOT_READY && slot->hash == hash) {
+            if (pread(s->fd, s->buf, s->page_size, offset) == s->page_size &&
+                memcmp(s->buf, host, s->page_size) == 0) {
+                ram_dedup_map(s, page, host, index);
+                return;
+            }
+        }
+    }
+    s->no_slot_pages++;
+}
+
+/* examine the host pages in [start, end), which are contiguous in host
+   memory from 'host' */
+static void ram_dedup_scan_run(RamDedupState *s, ram_addr_t start,
+                               ram_addr_t end, uint8_t *host)
+{
+    ram_addr_t addr, page, a;
+    int dirty;
+
+    for (addr = start; addr < end; addr += s->page_size, host += s->page_size) {
+        page = addr / s->page_size;
+
+        dirty = 0;
+        for (a = addr; a < addr + s->page_size; a += TARGET_PAGE_SIZE) {
+            if (cpu_physical_memory_get_dirty(a, DEDUP_DIRTY_FLAG)) {
+                dirty = 1;
+                break;
+            }
+        }
+
+        if (dirty) {
+            /* written since the last pass, the kernel has made the page
+               private again if it was merged */
+            s->page_state[page] &= ~PAGE_AGE_MASK;
+            if (s->page_slot[page]) {
+                ram_dedup_release(s, page);
+                s->broken_pages++;
+            }
+            continue;
+        }
+
+        if ((s->page_state[page] & PAGE_AGE_MASK) < RAM_DEDUP_MIN_AGE) {
+            s->page_state[page]++;
+            continue;
+        }
+        if (!s->page_slot[page])
+            ram_dedup_merge(s, page, host);
+    }
+
+    cpu_physical_memory_reset_dirty(start, end, DEDUP_DIRTY_FLAG);
+}
+
+static void ram_dedup_scan(void *opaque)
+{
+    RamDedupState *s = opaque;
+    ram_addr_t start, end, limit;
+    uint8_t *host;
+
+    /* requests in flight may be writing to pages that look clean, their
+       completion marks them dirty */
+    qemu_aio_flush();
+
+    limit = s->scan_pos + RAM_DEDUP_SCAN_PAGES * s->page_size;
+    if (limit > last_ram_offset)
+        limit = last_ram_offset;
+
+    /* process runs of pages that are contiguous in host memory */
+    start = s->scan_pos;
+    while (start < limit) {
+        host = qemu_get_ram_ptr(start);
+        end = start + s->page_size;
+        while (end < limit && qemu_get_ram_ptr(end) == host + (end - start))
+            end += s->page_size;
+
+        if (((unsigned long)host & (s->page_size - 1)) == 0)
+            ram_dedup_scan_run(s, start, end, host);
+        start = end;
+    }
+
+    s->scan_pos = (limit >= last_ram_offset) ? 0 : limit;
+    qemu_mod_timer(s->timer,
+                   qemu_get_clock(rt_clock) + RAM_DEDUP_SCAN_PERIOD);
+}
+
+static void ram_dedup_exit(void)
+{
+    RamDedupState *s = ram_dedup;
+    ram_addr_t page;
+
+    for (page = 0; page < s->nb_pages; page++) {
+        if (s->page_slot[page])
+            ram_dedup_release(s, page);
+    }
+}
+
+int ram_dedup_init(const char *path)
+{
+    RamDedupState *s;
+    int ret;
+
+    if (qemu_real_host_page_size < TARGET_PAGE_SIZE ||
+        (last_ram_offset & (qemu_real_host_page_size - 1)))
+        return -ENOTSUP;
+
+    s = qemu_mallocz(sizeof(*s));
+    s->page_size = qemu_real_host_page_size;
+    s->nb_pages = last_ram_offset / s->page_size;
+
+    ret = ram_dedup_open_store(s, path);
+    if (ret < 0) {
+        qemu_free(s);
+        return ret;
+    }
+
+    s->page_state = qemu_mallocz(s->nb_pages);
+    s->page_slot = qemu_mallocz(s->nb_pages * sizeof(uint32_t));
+    s->buf = qemu_memalign(s->page_size, s->page_size);
+    s->timer = qemu_new_timer(rt_clock, ram_dedup_scan, s);
+    qemu_mod_timer(s->timer,
+                   qemu_get_clock(rt_clock) + RAM_DEDUP_SCAN_PERIOD);
+
+    ram_dedup = s;
+    atexit(ram_dedup_exit);
+    return 0;
+}
+
+void ram_dedup_reset(void)
+{
+    RamDedupState *s = ram_dedup;
+    ram_addr_t page;
+
+    if (!s)
+        return;
+
+    for (page = 0; page < s->nb_pages; page++) {
+        if (s->page_slot[page])
+            ram_dedup_release(s, page);
+        s->page_state[page] = 0;
+    }
+    s->nb_mappings = 0;
+}
+
+/* host-wide counters of the kernel's same page merging, or -1 */
+static long ksm_counter(const char *name)
+{
+    char path[64];
+    long value = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/kernel/mm/ksm/%s", name);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%ld", &value) != 1)
+            value = -1;
+        fclose(f);
+    }
+    return value;
+}
+
+void do_info_ramshare(Monitor *mon)
+{
+    RamDedupState *s = ram_dedup;
+    uint64_t shared = 0, used = 0, i;
+    ram_addr_t page;
+
+    if (mem_merge) {
+        if (ksm_counter("run") > 0)
+            monitor_printf(mon, "KSM: %ld pages shared by %ld (host-wide)\n",
+                           ksm_counter("pages_shared"),
+                           ksm_counter("pages_sharing"));
+        else
+            monitor_printf(mon, "KSM: not running on this host\n");
+    }
+
+    if (!s) {
+        monitor_printf(mon, "RAM page store: disabled\n");
+        return;
+    }
+
+    for (page = 0; page < s->nb_pages; page++) {
+        if (s->page_slot[page] &&
+            s->slots[s->page_slot[page] - 1].users > 1)
+            shared++;
+    }
+    for (i = 0; i < s->header->nb_slots; i++) {
+        if (s->slots[i].state == SLOT_READY)
+            used++;
+    }
+
+    monitor_printf(mon, "guest pages: %" PRIu64 " of %d KB\n",
+                   (uint64_t)s->nb_pages, (int)(s->page_size / 1024));
+    monitor_printf(mon, "shared pages: %" PRIu64 "\n", shared);
+    monitor_printf(mon, "unique pages: %" PRIu64 "\n",
+                   (uint64_t)s->nb_pages - shared);
+    monitor_printf(mon, "merged pages: %" PRIu64 " (%" PRIu64
+                   " added to the store, %" PRIu64 " written since)\n",
+                   s->merged_pages, s->inserted_pages, s->broken_pages);
+    monitor_printf(mon, "store slots: %" PRIu64 " used of %" PRIu64
+                   " (%" PRIu64 " lookups found no free slot)\n",
+                   used, s->header->nb_slots, s->no_slot_pages);
+}
+
+#else /* _WIN32 */
+
+int ram_dedup_init(const char *path)
+{
+    return -ENOTSUP;
+}
+
+void ram_dedup_reset(void)
+{
+}
+
+void do_info_ramshare(Monitor *mon)
+{
+    monitor_printf(mon, "RAM sharing is not supported on this host\n");
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,24 @@
+/*
+ * Sharing of identical guest RAM pages between emulator instances
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_RAM_DEDUP_H
+#define QEMU_RAM_DEDUP_H
+
+#include "qemu-common.h"
+
+/* Start scanning guest RAM for pages that have not been modified for a
+   while, and map them from the page store file at 'path', which is shared
+   by all instances using it. Guest RAM must have been allocated privately
+   (see -mem-merge). Returns 0 on success, or -errno. */
+int ram_dedup_init(const char *path);
+
+/* Forget about the pages mapped from the store, called when guest RAM
+   has been remapped from another file. */
+void ram_dedup_reset(void);
+
+void do_info_ramshare(Monitor *mon);
+
+#endif
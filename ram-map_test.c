@@ -0,0 +1,442 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* write synthetic guest RAM to a RAM file, like ram_save_file() does for
+ * -mapped-ram, check that qemu_ram_map_file() restores it and keeps the
+ * file unchanged when the guest writes, then restore it in several
+ * emulator processes at once, by reading the file like loadvm without
+ * -mapped-ram and by mapping it. for each, measure the time to restore,
+ * the time of the first accesses of the guest, and the resident and
+ * proportional memory of guest RAM per process. run with 'make check'.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "cpu.h"
+#include "exec-all.h"
+#include "qemu-common.h"
+#include "tcg.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "gles2emulator_utils.h"
+
+/* 128 MB of guest RAM, a third of which is zero pages, left as holes in
+   the file */
+#define RAM_SIZE        (128 << 20)
+#define HOST_PAGE       4096
+#define NB_HOST_PAGES   (RAM_SIZE / HOST_PAGE)
+
+#define NB_INSTANCES    4
+
+/* after the restore, the guest reads 1 page in 5 and writes 1 in 20 */
+#define READ_RATIO      5
+#define WRITE_RATIO     20
+
+static uint32_t rand_state = 1;
+static int errors;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/** the rest of the emulator
+ **/
+
+void*  qemu_malloc( size_t  size )                 { return malloc(size); }
+void*  qemu_mallocz( size_t  size )                { return calloc(1, size); }
+void*  qemu_realloc( void*  ptr, size_t  size )    { return realloc(ptr, size); }
+void   qemu_free( void*  ptr )                     { free(ptr); }
+void*  qemu_vmalloc( size_t  size )                { return qemu_memalign(4096, size); }
+
+void*
+qemu_memalign( size_t  alignment, size_t  size )
+{
+    void*  ptr;
+
+    if (posix_memalign(&ptr, alignment, size))
+        abort();
+    return ptr;
+}
+
+ram_addr_t  ram_size = RAM_SIZE;
+int         mem_merge;
+int         memcheck_instrument_mmu;
+int         tb_invalidated_flag;
+
+int  memcheck_is_checked( target_ulong  addr, uint32_t  size ) { return 0; }
+void ram_dedup_reset( void ) {}
+
+/* guest RAM, anonymous memory like the shared memory file of the
+   emulator before a restore */
+void gles2emulator_utils_create_sharedmemory_file( struct hostSharedMemoryStruct*  s ) {}
+
+void
+gles2emulator_utils_map_sharedmemory_file( struct hostSharedMemoryStruct*  s )
+{
+    int  flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_32BIT
+    flags |= MAP_32BIT;
+#endif
+    s->actualAddress = mmap(NULL, s->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (s->actualAddress == MAP_FAILED) {
+        fprintf(stderr, "ram_map_test: can't map guest RAM\n");
+        exit(1);
+    }
+}
+
+unsigned long code_gen_max_block_size( void ) { return 1024; }
+void cpu_gen_init( void ) {}
+int  cpu_gen_code( CPUState*  env, struct TranslationBlock*  tb,
+                   int*  gen_code_size_ptr ) { abort(); }
+int  cpu_restore_state( struct TranslationBlock*  tb, CPUState*  env,
+                        unsigned long  searched_pc, void*  puc ) { return 0; }
+void cpu_resume_from_signal( CPUState*  env1, void*  puc ) { abort(); }
+CPUARMState*  cpu_arm_init( const char*  cpu_model ) { abort(); }
+void cpu_dump_state( CPUState*  env, FILE*  f,
+                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...),
+                     int  flags ) {}
+target_phys_addr_t  cpu_get_phys_page_debug( CPUState*  env, target_ulong  addr ) { return -1; }
+void tcg_dump_info( FILE*  f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...) ) {}
+void tlb_fill( target_ulong  addr, int  is_write, int  mmu_idx, void*  retaddr ) { abort(); }
+
+void qemu_cpu_kick( void*  env ) {}
+int  qemu_cpu_self( void*  env ) { return 1; }
+
+int
+register_savevm( const char*  idstr, int  instance_id, int  version_id,
+                 SaveStateHandler*  save_state, LoadStateHandler*  load_state,
+                 void*  opaque )
+{
+    return 0;
+}
+
+void cpu_save( QEMUFile*  f, void*  opaque ) {}
+int  cpu_load( QEMUFile*  f, void*  opaque, int  version_id ) { return 0; }
+void qemu_put_be32( QEMUFile*  f, unsigned int  v ) {}
+unsigned int qemu_get_be32( QEMUFile*  f ) { return 0; }
+
+/** the RAM file
+ **/
+
+static uint8_t*  ram;
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+page_is_zero( int  page )
+{
+    return (page * 2654435761U) % 3 == 0;
+}
+
+/* the first word of each page that is not zero */
+static uint32_t
+page_word( int  page )
+{
+    return page * 4096 + 1;
+}
+
+/* write the file of the saved RAM, with each page at its RAM offset and
+   zero pages left as holes, like ram_save_file() */
+static int
+write_ram_file( void )
+{
+    FILE*     f = tmpfile();
+    uint32_t  buf[HOST_PAGE / 4];
+    int       page, nn;
+
+    if (f == NULL) {
+        perror("ram_map_test: tmpfile");
+        exit(1);
+    }
+    for (page = 0; page < NB_HOST_PAGES; page++) {
+        if (page_is_zero(page))
+            continue;
+        for (nn = 0; nn < HOST_PAGE / 4; nn++)
+            buf[nn] = page_word(page) + nn;
+        if (pwrite(fileno(f), buf, HOST_PAGE, (off_t)page * HOST_PAGE) !=
+            HOST_PAGE) {
+            perror("ram_map_test: pwrite");
+            exit(1);
+        }
+    }
+    if (ftruncate(fileno(f), RAM_SIZE) < 0) {
+        perror("ram_map_test: ftruncate");
+        exit(1);
+    }
+    return dup(fileno(f));
+}
+
+static void
+check_page( int  page, const uint32_t*  words )
+{
+    uint32_t  expected = page_is_zero(page) ? 0 : page_word(page);
+
+    if (words[0] != expected && errors++ < 10)
+        fprintf(stderr, "ram_map_test: page %d starts with 0x%08x instead "
+                "of 0x%08x\n", page, words[0], expected);
+}
+
+/* restore guest RAM from 'fd', by mapping it or by reading it in 1 MB
+   runs like ram_load_file() */
+static void
+restore( int  fd, int  mapped )
+{
+    ram_addr_t  addr;
+
+    if (mapped) {
+        if (qemu_ram_map_file(fd) < 0) {
+            fprintf(stderr, "ram_map_test: qemu_ram_map_file() failed\n");
+            exit(1);
+        }
+        return;
+    }
+    for (addr = 0; addr < RAM_SIZE; addr += 1 << 20) {
+        if (pread(fd, ram + addr, 1 << 20, addr) != 1 << 20) {
+            perror("ram_map_test: pread");
+            exit(1);
+        }
+    }
+}
+
+/* the first accesses of the guest after the restore */
+static void
+touch_ram( void )
+{
+    int  page;
+
+    for (page = 0; page < NB_HOST_PAGES; page++) {
+        uint32_t*  words = (uint32_t*)(ram + (size_t)page * HOST_PAGE);
+
+        if (page % READ_RATIO == 0)
+            check_page(page, words);
+        if (page % WRITE_RATIO == 0)
+            words[1] = ~words[1];
+    }
+}
+
+/* map the file, check all of guest RAM, write to some pages, and check
+   that the file did not change */
+static void
+check_restore( int  fd )
+{
+    uint32_t  buf[HOST_PAGE / 4];
+    int       page;
+
+    restore(fd, 1);
+    for (page = 0; page < NB_HOST_PAGES; page++)
+        check_page(page, (uint32_t*)(ram + (size_t)page * HOST_PAGE));
+    for (page = 0; page < NB_HOST_PAGES; page += 1 + next_rand() % 64)
+        memset(ram + (size_t)page * HOST_PAGE, 0x5a, HOST_PAGE);
+    for (page = 0; page < NB_HOST_PAGES; page++) {
+        if (pread(fd, buf, HOST_PAGE, (off_t)page * HOST_PAGE) != HOST_PAGE) {
+            perror("ram_map_test: pread");
+            exit(1);
+        }
+        check_page(page, buf);
+    }
+}
+
+/** the emulator processes
+ **/
+
+typedef struct {
+    double  restore;        /* seconds */
+    double  touch;
+    long    rss;            /* KB of guest RAM */
+    long    pss;
+    long    private_dirty;
+} Usage;
+
+/* the memory used by guest RAM, from the mappings of this process that
+   are part of it, or -1 if /proc/self/smaps can't be read */
+static int
+get_ram_usage( Usage*  u )
+{
+    FILE*          f = fopen("/proc/self/smaps", "r");
+    char           line[256];
+    unsigned long  start, end;
+    int            in_ram = 0;
+    long           kb;
+
+    if (f == NULL)
+        return -1;
+    u->rss = u->pss = u->private_dirty = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_ram = start < (unsigned long)ram + RAM_SIZE &&
+                     end > (unsigned long)ram;
+        } else if (in_ram) {
+            if (sscanf(line, "Rss: %ld kB", &kb) == 1)
+                u->rss += kb;
+            else if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+                u->pss += kb;
+            else if (sscanf(line, "Private_Dirty: %ld kB", &kb) == 1)
+                u->private_dirty += kb;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void
+do_write( int  fd, const void*  buf, size_t  size )
+{
+    if (write(fd, buf, size) != (ssize_t)size)
+        _exit(1);
+}
+
+static void
+do_read( int  fd, void*  buf, size_t  size )
+{
+    if (read(fd, buf, size) != (ssize_t)size)
+        _exit(1);
+}
+
+/* one emulator: restore, let the guest run, then wait for all others to
+   be at the same point before measuring memory, so that pages shared
+   with them count */
+static void
+run_instance( int  fd, int  mapped, int  ready_fd, int  go_fd,
+              int  result_fd )
+{
+    Usage   u;
+    double  t0;
+    char    c = 0;
+
+    t0 = now_secs();
+    restore(fd, mapped);
+    u.restore = now_secs() - t0;
+    t0 = now_secs();
+    touch_ram();
+    u.touch = now_secs() - t0;
+
+    do_write(ready_fd, &c, 1);
+    do_read(go_fd, &c, 1);
+    if (get_ram_usage(&u) < 0)
+        u.rss = -1;
+    do_write(result_fd, &u, sizeof(u));
+    _exit(errors > 0);
+}
+
+/* returns the average usage of NB_INSTANCES emulators restored at once */
+static void
+bench_restore( int  fd, int  mapped, Usage*  avg )
+{
+    int    ready[2], go[2], result[2];
+    int    nn, status;
+    char   c[NB_INSTANCES] = { 0 };
+    Usage  u;
+
+    if (pipe(ready) < 0 || pipe(go) < 0 || pipe(result) < 0) {
+        perror("ram_map_test: pipe");
+        exit(1);
+    }
+    for (nn = 0; nn < NB_INSTANCES; nn++) {
+        pid_t  pid = fork();
+
+        if (pid < 0) {
+            perror("ram_map_test: fork");
+            exit(1);
+        }
+        if (pid == 0)
+            run_instance(fd, mapped, ready[1], go[0], result[1]);
+    }
+    for (nn = 0; nn < NB_INSTANCES; nn++)
+        do_read(ready[0], c, 1);
+    do_write(go[1], c, NB_INSTANCES);
+
+    memset(avg, 0, sizeof(*avg));
+    for (nn = 0; nn < NB_INSTANCES; nn++) {
+        do_read(result[0], &u, sizeof(u));
+        avg->restore += u.restore / NB_INSTANCES;
+        avg->touch += u.touch / NB_INSTANCES;
+        if (u.rss < 0 || avg->rss < 0) {
+            avg->rss = -1;
+            continue;
+        }
+        avg->rss += u.rss / NB_INSTANCES;
+        avg->pss += u.pss / NB_INSTANCES;
+        avg->private_dirty += u.private_dirty / NB_INSTANCES;
+    }
+    for (nn = 0; nn < NB_INSTANCES; nn++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0)
+            errors++;
+    }
+    close(ready[0]); close(ready[1]);
+    close(go[0]); close(go[1]);
+    close(result[0]); close(result[1]);
+}
+
+static void
+print_usage( const char*  how, Usage*  u )
+{
+    printf("ram_map_test: %s: %7.2f ms to restore, %6.1f ms of first guest "
+           "accesses", how, u->restore * 1e3, u->touch * 1e3);
+    if (u->rss >= 0)
+        printf(", %4ld MB resident, %4ld MB proportional, %4ld MB private "
+               "dirty per instance", u->rss >> 10, u->pss >> 10,
+               u->private_dirty >> 10);
+    printf("\n");
+}
+
+int main(void)
+{
+    Usage  u_read, u_mapped;
+    int    fd, status;
+    pid_t  pid;
+
+    cpu_exec_init_all(0);
+    ram = qemu_get_ram_ptr(qemu_ram_alloc(RAM_SIZE));
+    fd = write_ram_file();
+
+    /* guest RAM is replaced by the restore, so each one is done in a
+       child process */
+    pid = fork();
+    if (pid == 0) {
+        check_restore(fd);
+        _exit(errors > 0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ram_map_test: FAILED\n");
+        return 1;
+    }
+
+    bench_restore(fd, 0, &u_read);
+    bench_restore(fd, 1, &u_mapped);
+    printf("ram_map_test: %d emulators restoring %d MB, with 1 page in %d "
+           "read and 1 in %d written by the guest\n", NB_INSTANCES,
+           RAM_SIZE >> 20, READ_RATIO, WRITE_RATIO);
+    print_usage("read  ", &u_read);
+    print_usage("mapped", &u_mapped);
+
+    if (errors > 0) {
+        fprintf(stderr, "ram_map_test: FAILED\n");
+        return 1;
+    }
+    printf("ram_map_test: OK\n");
+    return 0;
+}
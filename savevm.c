@@ -87,6 +87,7 @@
 #include "qemu-timer.h"
 #include "qemu-char.h"
 #include "block.h"
+#include "block_int.h"
 #include "audio/audio.h"
 #include "migration.h"
 #include "qemu_socket.h"
@@ -1009,7 +1010,9 @@ static int qemu_loadvm_state_v2(QEMUFile *f)
     return 0;
 }
 
-int qemu_loadvm_state(QEMUFile *f)
+/* load a VM state, or if 'live_only' is set, only the sections that are
+   saved live, such as RAM, which come before all others in the stream */
+static int qemu_loadvm_state_sections(QEMUFile *f, int live_only)
 {
     LoadStateEntry *first_le = NULL;
     uint8_t section_type;
@@ -1036,6 +1039,9 @@ int qemu_loadvm_state(QEMUFile *f)
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
+            if (section_type == QEMU_VM_SECTION_FULL && live_only)
+                goto done;
+
             /* Read section start */
             section_id = qemu_get_be32(f);
             len = qemu_get_byte(f);
@@ -1069,7 +1075,12 @@ int qemu_loadvm_state(QEMUFile *f)
             le->next = first_le;
             first_le = le;
 
-            le->se->load_state(f, le->se->opaque, le->version_id);
+            ret = le->se->load_state(f, le->se->opaque, le->version_id);
+            if (ret < 0 && section_type == QEMU_VM_SECTION_START) {
+                fprintf(stderr, "Error %d while loading savevm section '%s'\n",
+                        ret, idstr);
+                goto out;
+            }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
@@ -1082,7 +1093,12 @@ int qemu_loadvm_state(QEMUFile *f)
                 goto out;
             }
 
-            le->se->load_state(f, le->se->opaque, le->version_id);
+            ret = le->se->load_state(f, le->se->opaque, le->version_id);
+            if (ret < 0) {
+                fprintf(stderr, "Error %d while loading savevm section '%s'\n",
+                        ret, le->se->idstr);
+                goto out;
+            }
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
@@ -1091,6 +1107,7 @@ int qemu_loadvm_state(QEMUFile *f)
         }
     }
 
+done:
     ret = 0;
 
 out:
@@ -1106,6 +1123,11 @@ out:
     return ret;
 }
 
+int qemu_loadvm_state(QEMUFile *f)
+{
+    return qemu_loadvm_state_sections(f, 0);
+}
+
 /* device can contain snapshots */
 static int bdrv_can_snapshot(BlockDriverState *bs)
 {
@@ -1162,15 +1184,495 @@ static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
     return ret;
 }
 
+static void print_ram_stats(Monitor *mon, const char *what, int64_t start)
+{
+    RamStats stats;
+    uint64_t raw;
+
+    ram_stats_get(&stats);
+    raw = stats.raw_bytes;
+    monitor_printf(mon, "%s in %" PRId64 " ms: %" PRIu64 " KB of RAM"
+                   " stored as %" PRIu64 " KB", what,
+                   qemu_get_clock(rt_clock) - start,
+                   raw >> 10, stats.stored_bytes >> 10);
+    if (stats.stored_bytes > 0)
+        monitor_printf(mon, " (ratio %.1f)",
+                       (double)raw / stats.stored_bytes);
+    monitor_printf(mon, ", %" PRIu64 " filled and %" PRIu64
+                   " duplicate pages", stats.fill_pages, stats.dup_pages);
+    if (stats.free_pages > 0)
+        monitor_printf(mon, ", %" PRIu64 " free pages skipped",
+                       stats.free_pages);
+    if (stats.mapped_bytes > 0)
+        monitor_printf(mon, ", %" PRIu64 " KB mapped on demand",
+                       stats.mapped_bytes >> 10);
+    monitor_printf(mon, "\n");
+}
+
+/* with -mapped-ram, the RAM of a snapshot is stored in a file next to the
+   image, named after the snapshot. The name is relative to the image, so
+   that images can be moved along with their RAM files. */
+static void get_ram_file_name(BlockDriverState *bs, QEMUSnapshotInfo *sn,
+                              char *name, int name_size)
+{
+    const char *base = bs->filename;
+    const char *p;
+    int i, len;
+
+    p = strrchr(base, '/');
+#ifdef _WIN32
+    if (strrchr(base, '\\') > p)
+        p = strrchr(base, '\\');
+#endif
+    if (p)
+        base = p + 1;
+
+    len = snprintf(name, name_size, "%s.ram-", base);
+    if (len >= name_size)
+        len = name_size - 1;
+    if (sn->name[0])
+        pstrcat(name, name_size, sn->name);
+    else
+        snprintf(name + len, name_size - len, "%08x%08x",
+                 sn->date_sec, sn->date_nsec);
+
+    for (i = len; name[i]; i++) {
+        if (!qemu_isalnum(name[i]) && name[i] != '-' && name[i] != '.')
+            name[i] = '_';
+    }
+}
+
+static void set_ram_save_file(BlockDriverState *bs, QEMUSnapshotInfo *sn)
+{
+    char name[1024];
+
+    if (!mapped_ram) {
+        ram_set_save_file(NULL);
+        return;
+    }
+
+    get_ram_file_name(bs, sn, name, sizeof(name));
+    ram_set_file_base(bs->filename);
+    ram_set_save_file(name);
+}
+
+/* remove the RAM file of a deleted snapshot, if it has one */
+static void remove_ram_file(BlockDriverState *bs, QEMUSnapshotInfo *sn)
+{
+    char name[1024], path[1024];
+
+    get_ram_file_name(bs, sn, name, sizeof(name));
+    ram_set_file_base(bs->filename);
+    ram_get_file_path(path, sizeof(path), name);
+    if (unlink(path) < 0 && errno != ENOENT)
+        fprintf(stderr, "Could not remove RAM file '%s': %s\n",
+                path, strerror(errno));
+}
+
+/* A delta snapshot only stores the RAM modified since its parent was
+   saved or loaded. Chains are kept short to bound the cost of loading. */
+#define SNAPSHOT_MAX_DELTA_DEPTH  8
+
+static int snapshot_find_id(BlockDriverState *bs, const char *id,
+                            QEMUSnapshotInfo *sn_info)
+{
+    QEMUSnapshotInfo *sn_tab;
+    int i, nb_sns, ret = -ENOENT;
+
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    for (i = 0; i < nb_sns; i++) {
+        if (!strcmp(sn_tab[i].id_str, id)) {
+            *sn_info = sn_tab[i];
+            ret = 0;
+            break;
+        }
+    }
+    if (nb_sns > 0)
+        qemu_free(sn_tab);
+    return ret;
+}
+
+static int snapshot_has_children(BlockDriverState *bs, const char *id)
+{
+    QEMUSnapshotInfo *sn_tab;
+    int i, nb_sns, ret = 0;
+
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    for (i = 0; i < nb_sns; i++) {
+        if (!strcmp(sn_tab[i].parent_id, id))
+            ret = 1;
+    }
+    if (nb_sns > 0)
+        qemu_free(sn_tab);
+    return ret;
+}
+
+/* store the ancestors of 'sn' in 'chain', parent first, and return their
+   number, or -1 if one is missing or there are too many */
+static int snapshot_get_ancestors(BlockDriverState *bs, QEMUSnapshotInfo *sn,
+                                  QEMUSnapshotInfo *chain)
+{
+    const char *id = sn->parent_id;
+    int n = 0;
+
+    while (id[0] != '\0') {
+        if (n == SNAPSHOT_MAX_DELTA_DEPTH ||
+            snapshot_find_id(bs, id, &chain[n]) < 0)
+            return -1;
+        id = chain[n++].parent_id;
+    }
+    return n;
+}
+
+/* QEMUFile over a growable memory buffer */
+typedef struct QEMUFileMem {
+    uint8_t *buf;
+    int64_t size;
+    int64_t max_size;
+} QEMUFileMem;
+
+static int mem_put_buffer(void *opaque, const uint8_t *buf, int64_t pos,
+                          int size)
+{
+    QEMUFileMem *m = opaque;
+
+    if (pos + size > m->max_size) {
+        while (pos + size > m->max_size)
+            m->max_size = m->max_size ? 2 * m->max_size : 65536;
+        m->buf = qemu_realloc(m->buf, m->max_size);
+    }
+    memcpy(m->buf + pos, buf, size);
+    if (pos + size > m->size)
+        m->size = pos + size;
+    return size;
+}
+
+static int mem_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileMem *m = opaque;
+
+    if (pos >= m->size)
+        return 0;
+    if (size > m->size - pos)
+        size = m->size - pos;
+    memcpy(buf, m->buf + pos, size);
+    return size;
+}
+
+static int mem_fclose(void *opaque)
+{
+    return 0;
+}
+
+/* the buffer is kept when the file is closed, writing starts at its start */
+static QEMUFile *qemu_fopen_mem(QEMUFileMem *m, int is_writable)
+{
+    if (is_writable) {
+        m->size = 0;
+        return qemu_fopen_ops(m, mem_put_buffer, NULL, mem_fclose, NULL, NULL);
+    }
+    return qemu_fopen_ops(m, NULL, mem_get_buffer, mem_fclose, NULL, NULL);
+}
+
+/* header of a section of a VM state, see qemu_savevm_state_begin() */
+typedef struct VMStateSection {
+    int type;
+    uint32_t section_id;
+    char idstr[256];
+    uint32_t instance_id;
+    uint32_t version_id;
+} VMStateSection;
+
+static int vmstate_get_section(QEMUFile *f, VMStateSection *sec)
+{
+    int len;
+
+    sec->type = qemu_get_byte(f);
+    sec->idstr[0] = '\0';
+    switch (sec->type) {
+    case QEMU_VM_SECTION_START:
+    case QEMU_VM_SECTION_FULL:
+        sec->section_id = qemu_get_be32(f);
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)sec->idstr, len);
+        sec->idstr[len] = '\0';
+        sec->instance_id = qemu_get_be32(f);
+        sec->version_id = qemu_get_be32(f);
+        break;
+    case QEMU_VM_SECTION_PART:
+    case QEMU_VM_SECTION_END:
+        sec->section_id = qemu_get_be32(f);
+        break;
+    }
+    return qemu_file_has_error(f) ? -EIO : sec->type;
+}
+
+static void vmstate_put_section(QEMUFile *f, const VMStateSection *sec)
+{
+    int len = strlen(sec->idstr);
+
+    qemu_put_byte(f, sec->type);
+    qemu_put_be32(f, sec->section_id);
+    if (sec->type == QEMU_VM_SECTION_START ||
+        sec->type == QEMU_VM_SECTION_FULL) {
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)sec->idstr, len);
+        qemu_put_be32(f, sec->instance_id);
+        qemu_put_be32(f, sec->version_id);
+    }
+}
+
+/* Copy the RAM sections at the start of a VM state to 'out', and return
+   their number. RAM is the only live section, so it comes first. */
+static int vmstate_copy_ram(QEMUFile *f, QEMUFile *out, RamSectionCopy *rc)
+{
+    VMStateSection sec;
+    uint32_t ram_id = 0;
+    int n = 0, ret;
+
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    for (;;) {
+        ret = vmstate_get_section(f, &sec);
+        if (ret < 0)
+            return ret;
+        if (sec.type == QEMU_VM_SECTION_START && !strcmp(sec.idstr, "ram"))
+            ram_id = sec.section_id;
+        else if ((sec.type != QEMU_VM_SECTION_PART &&
+                  sec.type != QEMU_VM_SECTION_END) ||
+                 sec.section_id != ram_id || n == 0)
+            return n;
+        ret = ram_copy_section(f, out, rc);
+        if (ret < 0)
+            return ret;
+        n++;
+    }
+}
+
+/* Write to 'out' the VM state of a child snapshot read from 'f', with the
+   'n' RAM sections of its parent, saved in 'parent_ram', inserted before
+   its own RAM. Since each RAM section is loaded separately, the parent
+   pages are all in place before the child pages overwrite some of them. */
+static int vmstate_merge_parent_ram(QEMUFile *f, QEMUFile *out,
+                                    QEMUFileMem *parent_ram, int n,
+                                    const char *ram_file, int64_t size)
+{
+    VMStateSection sec, part;
+    RamSectionCopy rc;
+    QEMUFile *pf;
+    uint8_t buf[4096];
+    int i, len, ret = 0;
+
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+    qemu_put_be32(out, QEMU_VM_FILE_MAGIC);
+    qemu_put_be32(out, QEMU_VM_FILE_VERSION);
+
+    if (vmstate_get_section(f, &sec) != QEMU_VM_SECTION_START ||
+        strcmp(sec.idstr, "ram") != 0)
+        return -EINVAL;
+    memset(&part, 0, sizeof(part));
+    part.type = QEMU_VM_SECTION_PART;
+    part.section_id = sec.section_id;
+
+    pf = qemu_fopen_mem(parent_ram, 0);
+    for (i = 0; i < n && ret == 0; i++) {
+        vmstate_put_section(out, i == 0 ? &sec : &part);
+        memset(&rc, 0, sizeof(rc));
+        rc.new_file = ram_file;
+        ret = ram_copy_section(pf, out, &rc);
+    }
+    qemu_fclose(pf);
+    if (ret < 0)
+        return ret;
+
+    /* then the RAM of the child, without the record naming its parent,
+       and the rest of its VM state as it is */
+    vmstate_put_section(out, &part);
+    memset(&rc, 0, sizeof(rc));
+    rc.drop_parent = 1;
+    ret = ram_copy_section(f, out, &rc);
+    if (ret < 0)
+        return ret;
+
+    while (qemu_ftell(f) < size) {
+        len = size - qemu_ftell(f);
+        if (len > sizeof(buf))
+            len = sizeof(buf);
+        if (qemu_get_buffer(f, buf, len) != len)
+            return -EIO;
+        qemu_put_buffer(out, buf, len);
+    }
+    return qemu_file_has_error(out) ? -EIO : 0;
+}
+
+/* give 'sn' a copy of RAM file 'from', named after 'sn' in 'name' */
+static int copy_ram_file(BlockDriverState *bs, const char *from,
+                         QEMUSnapshotInfo *sn, char *name, int name_size)
+{
+    char src[1024], dst[1024], buf[65536];
+    int in, out, len, ret = 0;
+
+    get_ram_file_name(bs, sn, name, name_size);
+    ram_set_file_base(bs->filename);
+    ram_get_file_path(src, sizeof(src), from);
+    ram_get_file_path(dst, sizeof(dst), name);
+    unlink(dst);
+#ifndef _WIN32
+    /* the parent file is removed or replaced, never modified */
+    if (link(src, dst) == 0)
+        return 0;
+#endif
+
+    in = open(src, O_RDONLY | O_BINARY);
+    if (in < 0)
+        return -errno;
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (out < 0) {
+        ret = -errno;
+        close(in);
+        return ret;
+    }
+    while ((len = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, len) != len) {
+            ret = -EIO;
+            break;
+        }
+    }
+    if (len < 0)
+        ret = -errno;
+    close(in);
+    close(out);
+    if (ret < 0)
+        unlink(dst);
+    return ret;
+}
+
+/* Before snapshot 'parent' is deleted or replaced, make its direct
+   children independent of it: the RAM of the parent is inserted in front
+   of the RAM of each child, which is then based on the parent of
+   'parent', if any. VM states are only accessible through the active
+   image, so the current disk state is kept in a temporary snapshot while
+   each snapshot involved is made active in turn. */
+static int snapshot_compact(Monitor *mon, BlockDriverState *bs,
+                            QEMUSnapshotInfo *parent)
+{
+    QEMUSnapshotInfo *sn_tab, sn, tmp;
+    QEMUFileMem parent_ram, child_vm;
+    BlockDriverInfo bdi;
+    RamSectionCopy rc;
+    QEMUFile *f, *out;
+    char file[1024];
+    int i, nb_sns, n, count = 0, ret;
+    int64_t start_time;
+
+    if (!snapshot_has_children(bs, parent->id_str))
+        return 0;
+    if (bdrv_get_info(bs, &bdi) < 0 || bdi.vm_state_offset <= 0)
+        return -ENOTSUP;
+
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    if (nb_sns <= 0)
+        return nb_sns;
+
+    start_time = qemu_get_clock(rt_clock);
+    memset(&parent_ram, 0, sizeof(parent_ram));
+    memset(&child_vm, 0, sizeof(child_vm));
+    memset(&tmp, 0, sizeof(tmp));
+    pstrcpy(tmp.name, sizeof(tmp.name), "compaction-in-progress");
+    ret = bdrv_snapshot_create(bs, &tmp);
+    if (ret < 0)
+        goto out_free;
+
+    ret = bdrv_snapshot_goto(bs, parent->id_str);
+    if (ret >= 0) {
+        memset(&rc, 0, sizeof(rc));
+        f = qemu_fopen_bdrv(bs, bdi.vm_state_offset, 0);
+        out = qemu_fopen_mem(&parent_ram, 1);
+        ret = n = vmstate_copy_ram(f, out, &rc);
+        qemu_fclose(out);
+        qemu_fclose(f);
+    }
+
+    for (i = 0; i < nb_sns && ret >= 0; i++) {
+        sn = sn_tab[i];
+        if (strcmp(sn.parent_id, parent->id_str) != 0)
+            continue;
+
+        ret = bdrv_snapshot_goto(bs, sn.id_str);
+        if (ret < 0)
+            break;
+        /* with -mapped-ram, the child gets its own copy of the parent
+           RAM file, which is going away */
+        if (rc.file[0]) {
+            ret = copy_ram_file(bs, rc.file, &sn, file, sizeof(file));
+            if (ret < 0)
+                break;
+        }
+
+        f = qemu_fopen_bdrv(bs, bdi.vm_state_offset, 0);
+        out = qemu_fopen_mem(&child_vm, 1);
+        ret = vmstate_merge_parent_ram(f, out, &parent_ram, n,
+                                       rc.file[0] ? file : NULL,
+                                       sn.vm_state_size);
+        qemu_fclose(out);
+        qemu_fclose(f);
+        if (ret < 0)
+            break;
+
+        f = qemu_fopen_bdrv(bs, bdi.vm_state_offset, 1);
+        qemu_put_buffer(f, child_vm.buf, child_vm.size);
+        qemu_fclose(f);
+
+        /* the child keeps its id, which its own children refer to */
+        sn.vm_state_size = child_vm.size;
+        pstrcpy(sn.parent_id, sizeof(sn.parent_id), parent->parent_id);
+        ret = bdrv_snapshot_delete(bs, sn.id_str);
+        if (ret >= 0) {
+            ret = bdrv_snapshot_create(bs, &sn);
+            if (ret < 0)
+                monitor_printf(mon, "Error %d while rewriting snapshot '%s', "
+                               "it is lost\n", ret, sn.id_str);
+        }
+        count++;
+    }
+
+    /* back to the current disk state */
+    if (bdrv_snapshot_goto(bs, tmp.id_str) < 0) {
+        monitor_printf(mon, "Could not restore the disk state saved in "
+                       "snapshot '%s'\n", tmp.id_str);
+        ret = -EIO;
+    } else {
+        bdrv_snapshot_delete(bs, tmp.id_str);
+    }
+
+    if (ret >= 0)
+        monitor_printf(mon, "%d snapshot(s) based on '%s' made independent "
+                       "in %" PRId64 " ms\n", count, parent->id_str,
+                       qemu_get_clock(rt_clock) - start_time);
+
+out_free:
+    qemu_free(parent_ram.buf);
+    qemu_free(child_vm.buf);
+    qemu_free(sn_tab);
+    return ret;
+}
+
 void do_savevm(Monitor *mon, const char *name)
 {
     BlockDriverState *bs, *bs1;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int must_delete, ret, i;
+    QEMUSnapshotInfo parent_sn, chain[SNAPSHOT_MAX_DELTA_DEPTH];
+    const char *parent;
+    int must_delete, ret, i, depth, created = 0, old_deleted = 0;
     BlockDriverInfo bdi1, *bdi = &bdi1;
     QEMUFile *f;
     int saved_vm_running;
     uint32_t vm_state_size;
+    int64_t start_time;
 #ifdef _WIN32
     struct _timeb tb;
 #else
@@ -1223,19 +1725,42 @@ void do_savevm(Monitor *mon, const char *name)
         goto the_end;
     }
 
+    /* the delta snapshots based on the old one must not depend on it */
+    if (must_delete && snapshot_compact(mon, bs, old_sn) < 0) {
+        monitor_printf(mon, "Could not rewrite the snapshots based on '%s', "
+                       "not replacing it\n", name);
+        goto the_end;
+    }
+
+    /* save a delta if RAM is tracked against a snapshot which is not
+       being replaced, and whose chain is not too long yet */
+    parent = ram_get_base();
+    if (parent && !(must_delete && !strcmp(parent, old_sn->id_str)) &&
+        snapshot_find_id(bs, parent, &parent_sn) == 0) {
+        depth = snapshot_get_ancestors(bs, &parent_sn, chain);
+        if (depth >= 0 && depth < SNAPSHOT_MAX_DELTA_DEPTH)
+            pstrcpy(sn->parent_id, sizeof(sn->parent_id), parent);
+    }
+
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, bdi->vm_state_offset, 1);
     if (!f) {
         monitor_printf(mon, "Could not open VM state file\n");
         goto the_end;
     }
+    start_time = qemu_get_clock(rt_clock);
+    ram_stats_reset();
+    set_ram_save_file(bs, sn);
+    ram_set_save_parent(sn->parent_id[0] ? sn->parent_id : NULL);
     ret = qemu_savevm_state(f);
+    ram_set_save_parent(NULL);
     vm_state_size = qemu_ftell(f);
     qemu_fclose(f);
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
         goto the_end;
     }
+    print_ram_stats(mon, "VM state saved", start_time);
 
     /* create the snapshots */
 
@@ -1248,6 +1773,8 @@ void do_savevm(Monitor *mon, const char *name)
                     monitor_printf(mon,
                                    "Error while deleting snapshot on '%s'\n",
                                    bdrv_get_device_name(bs1));
+                } else if (bs1 == bs) {
+                    old_deleted = 1;
                 }
             }
             /* Write VM state size only to the image that contains the state */
@@ -1256,11 +1783,21 @@ void do_savevm(Monitor *mon, const char *name)
             if (ret < 0) {
                 monitor_printf(mon, "Error while creating snapshot on '%s'\n",
                                bdrv_get_device_name(bs1));
+            } else if (bs1 == bs) {
+                created = 1;
             }
         }
     }
 
+    /* the next snapshot can be a delta based on this one */
+    if (created)
+        ram_set_base(sn->id_str);
+
  the_end:
+    /* the new RAM file, if any, replaces the old one only now */
+    if (old_deleted)
+        remove_ram_file(bs, old_sn);
+    ram_commit_save_file(created);
     if (saved_vm_running)
         vm_start();
 }
@@ -1269,10 +1806,11 @@ void do_loadvm(Monitor *mon, const char *name)
 {
     BlockDriverState *bs, *bs1;
     BlockDriverInfo bdi1, *bdi = &bdi1;
-    QEMUSnapshotInfo sn;
+    QEMUSnapshotInfo sn, chain[SNAPSHOT_MAX_DELTA_DEPTH];
     QEMUFile *f;
-    int i, ret;
+    int i, n, ret;
     int saved_vm_running;
+    int64_t start_time;
 
     bs = get_bs_snapshots();
     if (!bs) {
@@ -1286,6 +1824,48 @@ void do_loadvm(Monitor *mon, const char *name)
     saved_vm_running = vm_running;
     vm_stop(0);
 
+    if (bdrv_get_info(bs, bdi) < 0 || bdi->vm_state_offset <= 0) {
+        monitor_printf(mon, "Device %s does not support VM state snapshots\n",
+                       bdrv_get_device_name(bs));
+        goto the_end;
+    }
+
+    start_time = qemu_get_clock(rt_clock);
+    ram_stats_reset();
+    ram_set_base(NULL);
+    ram_set_file_base(bs->filename);
+
+    /* a delta snapshot only contains the RAM modified since its parent,
+       so first load the RAM of its ancestors, starting with the oldest */
+    if (bdrv_snapshot_find(bs, &sn, name) >= 0 && sn.parent_id[0] != '\0') {
+        n = snapshot_get_ancestors(bs, &sn, chain);
+        if (n < 0) {
+            monitor_printf(mon, "Snapshot '%s' is based on a missing "
+                           "snapshot\n", name);
+            goto the_end;
+        }
+        while (n-- > 0) {
+            ret = bdrv_snapshot_goto(bs, chain[n].id_str);
+            if (ret >= 0) {
+                f = qemu_fopen_bdrv(bs, bdi->vm_state_offset, 0);
+                ret = f ? qemu_loadvm_state_sections(f, 1) : -EIO;
+                if (f)
+                    qemu_fclose(f);
+            }
+            if (ret < 0) {
+                /* guest RAM and the disk now hold part of an older state,
+                   the VM must not run until a snapshot is fully loaded */
+                monitor_printf(mon, "Error %d while loading RAM of snapshot "
+                               "'%s', VM left stopped\n", ret,
+                               chain[n].id_str);
+                ram_set_base(NULL);
+                saved_vm_running = 0;
+                goto the_end;
+            }
+            ram_set_base(chain[n].id_str);
+        }
+    }
+
     for(i = 0; i <= nb_drives; i++) {
         bs1 = drives_table[i].bdrv;
         if (bdrv_has_snapshot(bs1)) {
@@ -1316,12 +1896,6 @@ void do_loadvm(Monitor *mon, const char *name)
         }
     }
 
-    if (bdrv_get_info(bs, bdi) < 0 || bdi->vm_state_offset <= 0) {
-        monitor_printf(mon, "Device %s does not support VM state snapshots\n",
-                       bdrv_get_device_name(bs));
-        return;
-    }
-
     /* Don't even try to load empty VM states */
     ret = bdrv_snapshot_find(bs, &sn, name);
     if ((ret >= 0) && (sn.vm_state_size == 0))
@@ -1337,6 +1911,9 @@ void do_loadvm(Monitor *mon, const char *name)
     qemu_fclose(f);
     if (ret < 0) {
         monitor_printf(mon, "Error %d while loading VM state\n", ret);
+    } else {
+        print_ram_stats(mon, "VM state loaded", start_time);
+        ram_set_base(sn.id_str);
     }
  the_end:
     if (saved_vm_running)
@@ -1346,7 +1923,9 @@ void do_loadvm(Monitor *mon, const char *name)
 void do_delvm(Monitor *mon, const char *name)
 {
     BlockDriverState *bs, *bs1;
-    int i, ret;
+    QEMUSnapshotInfo sn;
+    int i, ret, found;
+    int saved_vm_running;
 
     bs = get_bs_snapshots();
     if (!bs) {
@@ -1354,6 +1933,19 @@ void do_delvm(Monitor *mon, const char *name)
         return;
     }
 
+    /* rewriting the delta snapshots based on this one switches the
+       active image, the VM must not run meanwhile */
+    qemu_aio_flush();
+    saved_vm_running = vm_running;
+    vm_stop(0);
+
+    found = bdrv_snapshot_find(bs, &sn, name) >= 0;
+    if (found && snapshot_compact(mon, bs, &sn) < 0) {
+        monitor_printf(mon, "Could not rewrite the snapshots based on '%s', "
+                       "not deleting it\n", name);
+        goto the_end;
+    }
+
     for(i = 0; i <= nb_drives; i++) {
         bs1 = drives_table[i].bdrv;
         if (bdrv_has_snapshot(bs1)) {
@@ -1366,9 +1958,15 @@ void do_delvm(Monitor *mon, const char *name)
                 else
                     monitor_printf(mon, "Error %d while deleting snapshot on "
                                    "'%s'\n", ret, bdrv_get_device_name(bs1));
+            } else if (bs1 == bs && found) {
+                remove_ram_file(bs, &sn);
             }
         }
     }
+
+ the_end:
+    if (saved_vm_running)
+        vm_start();
 }
 
 void do_info_snapshots(Monitor *mon)
@@ -12,6 +12,7 @@
 #include "shaper.h"
 #include "qemu-common.h"
 #include "qemu-timer.h"
+#include "timer-wheel.h"
 #include <stdlib.h>
 
 #define  SHAPER_CLOCK        rt_clock
@@ -54,57 +55,56 @@ _packet_is_internal( const uint8_t*  data, size_t  size )
 typedef struct QueuedPacketRec_ {
     int64_t                    expiration;
     struct QueuedPacketRec_*   next;
-    size_t                     size;
+    NetBuf                     buf;
     void*                      opaque;
-    void*                      data;
 } QueuedPacketRec, *QueuedPacket;
 
 
+/* takes ownership of the caller's reference to 'buf' */
 static QueuedPacket
-queued_packet_create( const void*   data,
-                      size_t        size,
-                      void*         opaque,
-                      int           do_copy )
+queued_packet_create( NetBuf  buf,
+                      void*   opaque )
 {
     QueuedPacket   packet;
-    size_t         packet_size = sizeof(*packet);
 
-    if (do_copy)
-        packet_size += size;
-
-    packet = qemu_malloc(packet_size);
+    packet = qemu_malloc(sizeof(*packet));
     packet->next       = NULL;
     packet->expiration = 0;
-    packet->size       = (size_t)size;
+    packet->buf        = buf;
     packet->opaque     = opaque;
 
-    if (do_copy) {
-        packet->data = (void*)(packet+1);
-        memcpy( (char*)packet->data, (char*)data, packet->size );
-    } else {
-        packet->data = (void*)data;
-    }
     return packet;
 }
 
+/* hand the packet's buffer to 'send_func' */
+static void
+queued_packet_send( QueuedPacket  packet, NetShaperSendFunc  send_func )
+{
+    NetBuf  buf = packet->buf;
+
+    packet->buf = NULL;
+    send_func( buf, packet->opaque );
+}
+
 static void
 queued_packet_free( QueuedPacket  packet )
 {
     if (packet) {
+        netbuf_unref( packet->buf );
         qemu_free( packet );
     }
 }
 
 typedef struct NetShaperRec_ {
     QueuedPacket   packets;   /* list of queued packets, ordered by expiration date */
+    QueuedPacket*  ptail;     /* end of 'packets', where new ones are appended */
     int            num_packets;
     int            active;    /* is this shaper active ? */
-    int64_t        block_until;
+    double         block_until; /* in ms, not rounded to keep the rate exact */
     double         max_rate;  /* max rate expressed in bytes/second */
     double         inv_rate;  /* inverse of max rate                */
     QEMUTimer*     timer;     /* QEMU timer */
 
-    int                do_copy;
     NetShaperSendFunc  send_func;
 
 } NetShaperRec;
@@ -122,6 +122,7 @@ netshaper_destroy( NetShaper  shaper )
             packet->next    = NULL;
             queued_packet_free(packet);
         }
+        shaper->ptail = &shaper->packets;
 
         qemu_del_timer(shaper->timer);
         qemu_free_timer(shaper->timer);
@@ -130,42 +131,43 @@ netshaper_destroy( NetShaper  shaper )
     }
 }
 
-/* this function is called when the shaper's timer expires */
+/* this function is called when the shaper's timer expires, and sends
+ * all packets that are due in a single batch */
 static void
 netshaper_expires( NetShaper  shaper )
 {
     QueuedPacket  packet;
+    int64_t       now = qemu_get_clock( SHAPER_CLOCK );
 
     while ((packet = shaper->packets) != NULL) {
-        int64_t   now = qemu_get_clock( SHAPER_CLOCK );
-
-       if (packet->expiration > now)
-           break;
-
-       shaper->packets = packet->next;
-       shaper->send_func( packet->data, packet->size, packet->opaque );
-       queued_packet_free(packet);
-       shaper->num_packets--;
-   }
-
-   /* reprogram timer if needed */
-   if (shaper->packets) {
-       shaper->block_until = shaper->packets->expiration;
-       qemu_mod_timer( shaper->timer, shaper->block_until );
-   } else {
-       shaper->block_until = -1;
-   }
+        if (packet->expiration > now)
+            break;
+
+        shaper->packets = packet->next;
+        if (shaper->packets == NULL)
+            shaper->ptail = &shaper->packets;
+
+        queued_packet_send(packet, shaper->send_func);
+        queued_packet_free(packet);
+        shaper->num_packets--;
+    }
+
+    /* reprogram timer if needed. block_until is left alone: it is the
+     * time at which the last queued packet will be done, and moving it
+     * back would let new packets overtake queued ones */
+    if (shaper->packets)
+        qemu_mod_timer( shaper->timer, shaper->packets->expiration );
 }
 
 
 NetShaper
-netshaper_create( int                do_copy,
-                  NetShaperSendFunc  send_func )
+netshaper_create( NetShaperSendFunc  send_func )
 {
     NetShaper  shaper = qemu_malloc(sizeof(*shaper));
 
     shaper->active = 0;
     shaper->packets = NULL;
+    shaper->ptail   = &shaper->packets;
     shaper->num_packets = 0;
     shaper->timer   = qemu_new_timer( SHAPER_CLOCK,
                                       (QEMUTimerCB*) netshaper_expires,
@@ -187,10 +189,11 @@ netshaper_set_rate( NetShaper  shaper,
     while (shaper->packets) {
         QueuedPacket  packet = shaper->packets;
         shaper->packets = packet->next;
-        shaper->send_func(packet->data, packet->size, packet->opaque);
-        qemu_free(packet);
+        queued_packet_send(packet, shaper->send_func);
+        queued_packet_free(packet);
         shaper->num_packets = 0;
     }
+    shaper->ptail = &shaper->packets;
 
     shaper->max_rate = rate;
     if (rate > 1.) {
@@ -205,49 +208,40 @@ netshaper_set_rate( NetShaper  shaper,
 
 void
 netshaper_send_aux( NetShaper  shaper,
-                    void*      data,
-                    size_t     size,
+                    NetBuf     buf,
                     void*      opaque )
 {
     int64_t   now;
+    size_t    size = buf->size;
 
-    if (!shaper->active || _packet_is_internal(data, size)) {
-        shaper->send_func( data, size, opaque );
+    if (!shaper->active || _packet_is_internal(buf->data, size)) {
+        shaper->send_func( buf, opaque );
         return;
     }
 
     now = qemu_get_clock( SHAPER_CLOCK );
-    if (now >= shaper->block_until) {
-        shaper->send_func( data, size, opaque );
+    if (now >= shaper->block_until && shaper->packets == NULL) {
+        shaper->send_func( buf, opaque );
         shaper->block_until = now + size*shaper->inv_rate;
         //fprintf(stderr, "NETSHAPER: block for %.2fms\n", (shaper->block_until - now)*1.0 );
         return;
     }
 
-    /* create new packet, add it to the queue */
+    /* create new packet, add it to the queue. expiration dates only
+     * increase, so the queue stays sorted by appending to it */
     {
         QueuedPacket   packet;
 
-        packet = queued_packet_create( data, size, opaque, shaper->do_copy );
+        packet = queued_packet_create( buf, opaque );
 
         packet->expiration = shaper->block_until;
 
-        {
-            QueuedPacket  *pnode, node;
-
-            pnode = &shaper->packets;
-            for (;;) {
-                node = *pnode;
-                if (node == NULL || node->expiration > packet->expiration )
-                    break;
-                pnode = &node->next;
-            }
-            packet->next = *pnode;
-            *pnode       = packet;
+        *shaper->ptail = packet;
+        shaper->ptail  = &packet->next;
+
+        if (packet == shaper->packets)
+            qemu_mod_timer( shaper->timer, packet->expiration );
 
-            if (packet == shaper->packets)
-                qemu_mod_timer( shaper->timer, packet->expiration );
-        }
         shaper->num_packets += 1;
     }
     shaper->block_until += size*shaper->inv_rate;
@@ -256,10 +250,9 @@ netshaper_send_aux( NetShaper  shaper,
 
 void
 netshaper_send( NetShaper  shaper,
-                void*      data,
-                size_t     size )
+                NetBuf     buf )
 {
-    netshaper_send_aux(shaper, data, size, NULL);
+    netshaper_send_aux(shaper, buf, NULL);
 }
 
 
@@ -287,8 +280,8 @@ netshaper_can_send( NetShaper  shaper )
  * if session->packet is != NULL, then the connection is delayed
  */
 typedef struct SessionRec_ {
-    int64_t               expiration;
-    struct SessionRec_*   next;
+    WheelEntryRec         wheel;   /* must be first, holds the expiration date */
+    struct SessionRec_*   next;    /* next session in hash bucket */
     unsigned              src_ip;
     unsigned              dst_ip;
     unsigned short        src_port;
@@ -301,6 +294,8 @@ typedef struct SessionRec_ {
 #define  _PROTOCOL_TCP   6
 #define  _PROTOCOL_UDP   17
 
+#define  SESSION_HASH_SIZE  256
+
 
 
 static void
@@ -382,22 +377,37 @@ _packet_SYN_flags( const void*  _data, size_t   size, Session  info )
 
 typedef struct NetDelayRec_
 {
-    Session     sessions;
-    int         num_sessions;
-    QEMUTimer*  timer;
-    int         active;
-    int         min_ms;
-    int         max_ms;
+    Session        sessions[SESSION_HASH_SIZE];
+    int            num_sessions;
+    TimerWheelRec  wheel;     /* sessions with a delayed packet, by expiration */
+    QEMUTimer*     timer;
+    int            active;
+    int            min_ms;
+    int            max_ms;
 
     NetShaperSendFunc  send_func;
 
 } NetDelayRec;
 
 
+static unsigned
+session_hash( Session  info )
+{
+    unsigned  h;
+
+    h  = info->src_ip * 31 + info->dst_ip;
+    h  = h * 31 + (((unsigned)info->src_port << 16) | info->dst_port);
+    h  = h * 31 + info->protocol;
+    h ^= h >> 16;
+    h ^= h >> 8;
+
+    return h & (SESSION_HASH_SIZE - 1);
+}
+
 static Session*
 netdelay_lookup_session( NetDelay  delay, Session  info )
 {
-    Session*  pnode = &delay->sessions;
+    Session*  pnode = &delay->sessions[session_hash(info)];
     Session   node;
 
     for (;;) {
@@ -417,55 +427,56 @@ netdelay_lookup_session( NetDelay  delay, Session  info )
     return pnode;
 }
 
+static void
+netdelay_rearm( NetDelay  delay )
+{
+    int64_t  next = timer_wheel_next( &delay->wheel );
 
+    if (next >= 0)
+        qemu_mod_timer( delay->timer, next );
+    else
+        qemu_del_timer( delay->timer );
+}
 
-/* called by the delay's timer on expiration */
+
+/* called by the delay's timer on expiration. all packets due at this
+ * time are sent in a single batch */
 static void
 netdelay_expires( NetDelay  delay )
 {
-    Session  session;
-    int64_t  now = qemu_get_clock( SHAPER_CLOCK );
-    int      rearm = 0;
-    int64_t  rearm_time = 0;
+    WheelEntry  expired = NULL;
+    int64_t     now     = qemu_get_clock( SHAPER_CLOCK );
 
-    for (session = delay->sessions; session != NULL; session = session->next)
-    {
-        QueuedPacket  packet = session->packet;
+    timer_wheel_expire( &delay->wheel, now, &expired );
 
-        if (packet == NULL)
-            continue;
+    while (expired != NULL) {
+        Session       session = (Session) expired;
+        QueuedPacket  packet  = session->packet;
 
-        if (session->expiration <= now) {
-            /* send the SYN packet now */
-                    //fprintf(stderr, "NetDelay:RST: sending creation for %s\n", session_to_string(session) );
-            delay->send_func( packet->data, packet->size, packet->opaque );
-            session->packet = NULL;
-            queued_packet_free( packet );
-        } else {
-            if (!rearm) {
-                rearm      = 1;
-                rearm_time = session->expiration;
-            }
-            else if ( session->expiration < rearm_time )
-                rearm_time = session->expiration;
-        }
+        wheel_entry_unlink( expired );
+
+        /* send the SYN packet now */
+        //fprintf(stderr, "NetDelay:RST: sending creation for %s\n", session_to_string(session) );
+        session->packet = NULL;
+        queued_packet_send( packet, delay->send_func );
+        queued_packet_free( packet );
     }
 
-    if (rearm)
-        qemu_mod_timer( delay->timer, rearm_time );
+    netdelay_rearm( delay );
 }
 
 
 NetDelay
 netdelay_create( NetShaperSendFunc  send_func )
 {
-    NetDelay  delay = qemu_malloc(sizeof(*delay));
+    NetDelay  delay = qemu_mallocz(sizeof(*delay));
 
-    delay->sessions     = NULL;
     delay->num_sessions = 0;
     delay->timer        = qemu_new_timer( SHAPER_CLOCK,
                                           (QEMUTimerCB*) netdelay_expires,
                                           delay );
+    timer_wheel_init( &delay->wheel, qemu_get_clock( SHAPER_CLOCK ) );
+
     delay->active = 0;
     delay->min_ms = 0;
     delay->max_ms = 0;
@@ -479,18 +490,23 @@ netdelay_create( NetShaperSendFunc  send_func )
 void
 netdelay_set_latency( NetDelay  delay, int  min_ms, int  max_ms )
 {
+    int  nn;
+
     /* when changing the latency, accept all sessions */
-    while (delay->sessions) {
-        Session  session = delay->sessions;
-        delay->sessions = session->next;
-        session->next = NULL;
-        if (session->packet) {
-            QueuedPacket  packet = session->packet;
-            delay->send_func( packet->data, packet->size, packet->opaque );
+    for (nn = 0; nn < SESSION_HASH_SIZE; nn++) {
+        while (delay->sessions[nn]) {
+            Session  session = delay->sessions[nn];
+            delay->sessions[nn] = session->next;
+            session->next = NULL;
+            if (session->packet) {
+                timer_wheel_remove( &delay->wheel, &session->wheel );
+                queued_packet_send( session->packet, delay->send_func );
+            }
+            session_free(session);
+            delay->num_sessions--;
         }
-        session_free(session);
-        delay->num_sessions--;
     }
+    qemu_del_timer( delay->timer );
 
     delay->min_ms = min_ms;
     delay->max_ms = max_ms;
@@ -498,20 +514,20 @@ netdelay_set_latency( NetDelay  delay, int  min_ms, int  max_ms )
 }
 
 void
-netdelay_send( NetDelay  delay, const void*  data, size_t  size )
+netdelay_send( NetDelay  delay, NetBuf  buf )
 {
-    netdelay_send_aux(delay, data, size, NULL);
+    netdelay_send_aux(delay, buf, NULL);
 }
 
 
 void
-netdelay_send_aux( NetDelay  delay, const void*  data, size_t  size, void* opaque )
+netdelay_send_aux( NetDelay  delay, NetBuf  buf, void* opaque )
 {
-    if (delay->active && !_packet_is_internal(data, size)) {
+    if (delay->active && !_packet_is_internal(buf->data, buf->size)) {
         SessionRec  info[1];
         int         flags;
 
-        flags = _packet_SYN_flags( data, size, info );
+        flags = _packet_SYN_flags( buf->data, buf->size, info );
         if ((flags & 0x05) != 0)
         {  /* FIN or RST: drop connection */
             Session*  lookup  = netdelay_lookup_session( delay, info );
@@ -520,6 +536,8 @@ netdelay_send_aux( NetDelay  delay, const void*  data, size_t  size, void* opaqu
                 //fprintf(stderr, "NetDelay:RST: dropping %s\n", session_to_string(info) );
 
                 *lookup = session->next;
+                if (session->packet)
+                    timer_wheel_remove( &delay->wheel, &session->wheel );
                 session_free( session );
                 delay->num_sessions -= 1;
             }
@@ -536,24 +554,26 @@ netdelay_send_aux( NetDelay  delay, const void*  data, size_t  size, void* opaqu
                     * send the original SYN packet yet, just eat this one
                     */
                     //fprintf(stderr, "NetDelay:RST: swallow SYN re-send for %s\n", session_to_string(info) );
+                    netbuf_unref( buf );
                     return;
                 }
             } else {
                 /* establish a new session slightly in the future */
-                int   latency = delay->min_ms;
-                int   range   = delay->max_ms - delay->min_ms;
+                int      latency = delay->min_ms;
+                int      range   = delay->max_ms - delay->min_ms;
+                int64_t  now     = qemu_get_clock( SHAPER_CLOCK );
 
                  if (range > 0)
                     latency += rand() % range;
 
                     //fprintf(stderr, "NetDelay:RST: delay creation for %s\n", session_to_string(info) );
-                session = qemu_malloc( sizeof(*session) );
+                session = qemu_mallocz( sizeof(*session) );
 
-                session->next        = delay->sessions;
-                delay->sessions      = session;
+                session->next        = *lookup;
+                *lookup              = session;
                 delay->num_sessions += 1;
 
-                session->expiration = qemu_get_clock( SHAPER_CLOCK ) + latency;
+                session->wheel.expiration = now + latency;
 
                 session->src_ip   = info->src_ip;
                 session->dst_ip   = info->dst_ip;
@@ -561,15 +581,16 @@ netdelay_send_aux( NetDelay  delay, const void*  data, size_t  size, void* opaqu
                 session->dst_port = info->dst_port;
                 session->protocol = info->protocol;
 
-                session->packet = queued_packet_create( data, size, opaque, 1 );
+                session->packet = queued_packet_create( buf, opaque );
 
-                netdelay_expires(delay);
+                timer_wheel_add( &delay->wheel, &session->wheel, now );
+                netdelay_rearm( delay );
                 return;
             }
         }
     }
 
-    delay->send_func( (void*)data, size, opaque );
+    delay->send_func( buf, opaque );
 }
 
 
@@ -577,14 +598,19 @@ void
 netdelay_destroy( NetDelay  delay )
 {
     if (delay) {
-        while (delay->sessions) {
-            Session  session = delay->sessions;
-            delay->sessions = session->next;
-            session_free(session);
-            delay->num_sessions -= 1;
+        int  nn;
+
+        for (nn = 0; nn < SESSION_HASH_SIZE; nn++) {
+            while (delay->sessions[nn]) {
+                Session  session = delay->sessions[nn];
+                delay->sessions[nn] = session->next;
+                session_free(session);
+                delay->num_sessions -= 1;
+            }
         }
         delay->active = 0;
+        qemu_del_timer( delay->timer );
+        qemu_free_timer( delay->timer );
         qemu_free( delay );
     }
 }
-
@@ -13,21 +13,26 @@
 #define _SLIRP_SHAPER_H_
 
 #include <stddef.h>
+#include "netbuf.h"
 
 /* a NetShaper object is used to limit the throughput of data packets
  * at a fixed rate expressed in bits/seconds
+ *
+ * packets are passed as NetBufs. netshaper_send() takes ownership of
+ * the caller's reference, and queued packets are kept by reference
+ * rather than copied. the send function receives that reference and
+ * must release it.
  */
 typedef struct NetShaperRec_*  NetShaper;
-typedef void (*NetShaperSendFunc)( void*  data, size_t  size, void*  opaque);
+typedef void (*NetShaperSendFunc)( NetBuf  buf, void*  opaque );
 
-NetShaper   netshaper_create  ( int                do_copy,
-                                NetShaperSendFunc  send_func );
+NetShaper   netshaper_create  ( NetShaperSendFunc  send_func );
 
 void        netshaper_set_rate(NetShaper  shaper, double  rate );
 
-void        netshaper_send( NetShaper  shaper, void* data, size_t  size );
+void        netshaper_send( NetShaper  shaper, NetBuf  buf );
 
-void        netshaper_send_aux( NetShaper  shaper, void* data, size_t  size, void*  opaque );
+void        netshaper_send_aux( NetShaper  shaper, NetBuf  buf, void*  opaque );
 
 int         netshaper_can_send( NetShaper  shaper );
 
@@ -38,8 +43,8 @@ typedef struct NetDelayRec_*  NetDelay;
 
 NetDelay   netdelay_create( NetShaperSendFunc  send_func );
 void       netdelay_set_latency( NetDelay  delay, int  min_ms, int  max_ms );
-void       netdelay_send( NetDelay  delay, const void*  data, size_t  size );
-void       netdelay_send_aux( NetDelay  delay, const void*  data, size_t  size, void*  opaque );
+void       netdelay_send( NetDelay  delay, NetBuf  buf );
+void       netdelay_send_aux( NetDelay  delay, NetBuf  buf, void*  opaque );
 void       netdelay_destroy( NetDelay  delay );
 
 /** in vl.c */
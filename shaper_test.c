@@ -0,0 +1,463 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the timing wheel of timer-wheel.h against a brute-force model,
+ * check the latencies and rates applied by the network delayer and
+ * shaper, then measure their cost at the GPRS, EDGE and UMTS profiles.
+ * the shaper runs on a simulated clock, provided below in place of the
+ * QEMU timers. run with 'make check'.
+ */
+#include "shaper.h"
+#include "timer-wheel.h"
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include <sys/time.h>
+
+static int       errors;
+static uint32_t  rand_state = 1;
+
+static uint32_t
+next_rand( void )
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/** memory and simulated timers, for shaper.c and netbuf.c
+ **/
+
+void*  qemu_malloc( size_t  size )  { return malloc(size); }
+void*  qemu_mallocz( size_t  size ) { return calloc(1, size); }
+void   qemu_free( void*  ptr )      { free(ptr); }
+
+struct QEMUTimer {
+    QEMUTimerCB*  cb;
+    void*         opaque;
+    int64_t       expire_time;
+    int           pending;
+};
+
+#define  MAX_TIMERS  4
+
+static QEMUTimer  timers[MAX_TIMERS];
+static int        num_timers;
+static int64_t    sim_now;      /* in ms, like rt_clock */
+QEMUClock*        rt_clock;
+
+int64_t
+qemu_get_clock( QEMUClock*  clock )
+{
+    return sim_now;
+}
+
+QEMUTimer*
+qemu_new_timer( QEMUClock*  clock, QEMUTimerCB*  cb, void*  opaque )
+{
+    QEMUTimer*  ts = &timers[num_timers++];
+
+    ts->cb      = cb;
+    ts->opaque  = opaque;
+    ts->pending = 0;
+    return ts;
+}
+
+void
+qemu_free_timer( QEMUTimer*  ts )
+{
+    ts->pending = 0;
+}
+
+void
+qemu_del_timer( QEMUTimer*  ts )
+{
+    ts->pending = 0;
+}
+
+void
+qemu_mod_timer( QEMUTimer*  ts, int64_t  expire_time )
+{
+    ts->expire_time = expire_time;
+    ts->pending     = 1;
+}
+
+/* advance the simulated clock to 'until', running the timers that
+ * expire on the way at their expiration time, as the main loop would */
+static void
+run_timers( int64_t  until )
+{
+    for (;;) {
+        QEMUTimer*  next = NULL;
+        int         nn;
+
+        for (nn = 0; nn < num_timers; nn++) {
+            QEMUTimer*  ts = &timers[nn];
+            if (ts->pending && ts->expire_time <= until &&
+                (!next || ts->expire_time < next->expire_time))
+                next = ts;
+        }
+        if (next == NULL)
+            break;
+
+        if (sim_now < next->expire_time)
+            sim_now = next->expire_time;
+        next->pending = 0;
+        next->cb(next->opaque);
+    }
+    sim_now = until;
+}
+
+static void
+reset_timers( void )
+{
+    num_timers = 0;
+    sim_now    = 0;
+}
+
+/** timing wheel model
+ **/
+
+#define  NB_ENTRIES  512
+#define  NB_OPS      200000
+
+typedef struct {
+    WheelEntryRec  entry;     /* must be first */
+    int            pending;   /* model: is it in the wheel ? */
+    int64_t        due;       /* model: first tick at which it expires */
+} ModelEntry;
+
+static void
+check_wheel( void )
+{
+    static ModelEntry  entries[NB_ENTRIES];
+    TimerWheelRec      wheel[1];
+    int64_t            now = 1000;
+    int                op, nn;
+
+    timer_wheel_init(wheel, now);
+
+    for (op = 0; op < NB_OPS && errors < 10; op++) {
+        ModelEntry*  e = &entries[next_rand() % NB_ENTRIES];
+        uint32_t     r = next_rand() % 8;
+
+        if (r < 4) {
+            if (e->pending) {
+                timer_wheel_remove(wheel, &e->entry);
+                e->pending = 0;
+            }
+            /* mostly near deadlines, some for each wheel level and the
+             * overflow list, and a few already in the past */
+            switch (next_rand() % 4) {
+            case 0:  e->entry.expiration = now + next_rand() % 256; break;
+            case 1:  e->entry.expiration = now + next_rand() % 16384; break;
+            case 2:  e->entry.expiration = now + next_rand() % 100000; break;
+            default: e->entry.expiration = now - next_rand() % 16; break;
+            }
+            timer_wheel_add(wheel, &e->entry, now);
+            e->pending = 1;
+            /* an entry that is already due expires at the next tick
+             * that was not reported yet */
+            e->due = e->entry.expiration;
+            if (e->due < wheel->current)
+                e->due = wheel->current;
+        } else if (r < 5) {
+            if (e->pending) {
+                timer_wheel_remove(wheel, &e->entry);
+                e->pending = 0;
+            }
+        } else {
+            WheelEntry  expired = NULL;
+            int64_t     next    = timer_wheel_next(wheel);
+            int64_t     first   = -1;
+            int         count   = 0;
+
+            for (nn = 0; nn < NB_ENTRIES; nn++) {
+                if (entries[nn].pending) {
+                    count++;
+                    if (first < 0 || entries[nn].due < first)
+                        first = entries[nn].due;
+                }
+            }
+            if (count != wheel->count ||
+                (count == 0) != (next < 0) || next > first) {
+                fprintf(stderr, "op %d: wheel has %d entries, next %lld, "
+                        "expected %d entries, first %lld\n", op, wheel->count,
+                        (long long)next, count, (long long)first);
+                errors++;
+            }
+
+            /* mostly short steps, sometimes a long idle period */
+            now += (next_rand() % 16 == 0) ? next_rand() % 20000
+                                            : next_rand() % 64;
+            timer_wheel_expire(wheel, now, &expired);
+
+            while (expired != NULL) {
+                ModelEntry*  x = (ModelEntry*) expired;
+
+                wheel_entry_unlink(expired);
+                if (!x->pending || x->due > now) {
+                    fprintf(stderr, "op %d: entry %d expired at %lld, "
+                            "due at %lld\n", op, (int)(x - entries),
+                            (long long)now, (long long)x->due);
+                    errors++;
+                }
+                x->pending = 0;
+            }
+            for (nn = 0; nn < NB_ENTRIES; nn++) {
+                if (entries[nn].pending && entries[nn].due <= now) {
+                    fprintf(stderr, "op %d: entry %d due at %lld not "
+                            "expired at %lld\n", op, nn,
+                            (long long)entries[nn].due, (long long)now);
+                    errors++;
+                }
+            }
+        }
+    }
+
+    if (errors == 0)
+        printf("shaper_test: timing wheel: %d ops checked against the "
+               "model: OK\n", NB_OPS);
+}
+
+/** synthetic traffic
+ **/
+
+#define  PACKET_SYN   0x02
+#define  PACKET_FIN   0x01
+#define  PACKET_ACK   0x10
+
+/* what the sinks know about each packet sent */
+typedef struct {
+    int64_t  sent;
+    int      seq;
+} PacketInfo;
+
+/* build an Ethernet/IPv4/TCP packet from the guest to a remote host */
+static NetBuf
+make_packet( int  session, int  flags, int  size )
+{
+    NetBuf    buf = netbuf_alloc(size);
+    uint8_t*  p   = buf->data;
+
+    memset(p, 0, size);
+    p[12] = 0x08;                       /* IPv4 */
+    p += 14;
+    p[0]  = 0x45;                       /* version 4, 5 words */
+    p[8]  = 64;                         /* TTL */
+    p[9]  = 6;                          /* TCP */
+    p[12] = 10; p[13] = 0; p[14] = 2; p[15] = 15;
+    p[16] = 74; p[17] = 125; p[18] = (uint8_t)(session >> 16); p[19] = 1;
+    p += 20;
+    p[0]  = (uint8_t)(session >> 8);
+    p[1]  = (uint8_t) session;
+    p[2]  = 0; p[3] = 80;
+    p[13] = (uint8_t) flags;
+    return buf;
+}
+
+typedef struct {
+    const char*  name;
+    int          rate;      /* download speed, bits/s, from net-android.c */
+    int          min_ms;    /* latency, from net-android.c */
+    int          max_ms;
+} Profile;
+
+static const Profile  profiles[] = {
+    { "gprs",  80000,   150, 550 },
+    { "edge",  236800,  80,  400 },
+    { "umts",  1920000, 35,  200 },
+};
+
+static int      delay_min, delay_max;
+static int      delivered_syns;
+static int      delivered_data;
+static int      last_seq;
+static int64_t  delivered_bytes;
+
+static void
+delay_sink( NetBuf  buf, void*  opaque )
+{
+    PacketInfo*  info = opaque;
+
+    /* FIN and data packets are not delayed */
+    if (info != NULL) {
+        int64_t  latency = sim_now - info->sent;
+
+        if (latency < delay_min || latency > delay_max) {
+            fprintf(stderr, "shaper_test: SYN delayed by %lld ms, "
+                    "expected %d to %d\n", (long long)latency,
+                    delay_min, delay_max);
+            errors++;
+        }
+        delivered_syns += 1;
+    }
+    netbuf_unref(buf);
+}
+
+static void
+shaper_sink( NetBuf  buf, void*  opaque )
+{
+    PacketInfo*  info = opaque;
+
+    if (info->seq != last_seq + 1) {
+        fprintf(stderr, "shaper_test: packet %d delivered after %d\n",
+                info->seq, last_seq);
+        errors++;
+    }
+    last_seq = info->seq;
+    delivered_data  += 1;
+    delivered_bytes += buf->size;
+    netbuf_unref(buf);
+}
+
+#define  NB_SESSIONS   16384   /* sessions kept open at a time */
+#define  SYNS_PER_MS   10      /* new sessions per simulated ms */
+#define  DELAY_SECONDS 60
+
+/* open SYNS_PER_MS sessions per ms, each one closing the oldest, so
+ * that thousands of SYN packets wait in the delayer at any time.
+ * returns the number of packets sent */
+static int
+run_delay( const Profile*  prof )
+{
+    static PacketInfo  syn_info[NB_SESSIONS];
+    NetDelay           delay;
+    int                sent_syns = 0;
+    int64_t            end;
+
+    reset_timers();
+    delay = netdelay_create(delay_sink);
+    netdelay_set_latency(delay, prof->min_ms, prof->max_ms);
+    delay_min      = prof->min_ms;
+    delay_max      = prof->max_ms;
+    delivered_syns = 0;
+
+    end = sim_now + DELAY_SECONDS*1000;
+    while (sim_now < end) {
+        int  nn;
+
+        for (nn = 0; nn < SYNS_PER_MS; nn++) {
+            int  slot = sent_syns % NB_SESSIONS;
+
+            if (sent_syns >= NB_SESSIONS)
+                netdelay_send(delay, make_packet(slot, PACKET_FIN, 58));
+
+            syn_info[slot].sent = sim_now;
+            netdelay_send_aux(delay, make_packet(slot, PACKET_SYN, 58),
+                              &syn_info[slot]);
+            sent_syns++;
+        }
+        run_timers(sim_now + 1);
+    }
+
+    /* sessions are closed long after their SYN is due, so all of them
+     * must have been delivered, except the ones sent last */
+    if (sent_syns - delivered_syns > prof->max_ms * SYNS_PER_MS) {
+        fprintf(stderr, "shaper_test: %s: %d SYNs sent, %d delivered\n",
+                prof->name, sent_syns, delivered_syns);
+        errors++;
+    }
+    netdelay_destroy(delay);
+
+    /* the FINs count as packets, too */
+    return sent_syns * 2 - NB_SESSIONS;
+}
+
+#define  MAX_QUEUED     1000    /* packets waiting in the shaper */
+#define  DATA_SIZE      600
+#define  SHAPE_SECONDS  600
+
+/* keep MAX_QUEUED packets in the shaper, which must deliver them in
+ * order and at its rate. returns the number of packets sent */
+static int
+run_shaper( const Profile*  prof )
+{
+    static PacketInfo  data_info[MAX_QUEUED];
+    NetShaper          shaper;
+    int                sent_data = 0;
+    int64_t            end;
+    double             rate;
+
+    reset_timers();
+    shaper = netshaper_create(shaper_sink);
+    netshaper_set_rate(shaper, prof->rate);
+    delivered_data  = 0;
+    delivered_bytes = 0;
+    last_seq        = -1;
+
+    end = sim_now + SHAPE_SECONDS*1000;
+    while (sim_now < end) {
+        while (sent_data - delivered_data < MAX_QUEUED) {
+            PacketInfo*  info = &data_info[sent_data % MAX_QUEUED];
+
+            info->sent = sim_now;
+            info->seq  = sent_data++;
+            netshaper_send_aux(shaper,
+                               make_packet(0, PACKET_ACK, DATA_SIZE), info);
+        }
+        run_timers(sim_now + 1);
+    }
+
+    rate = delivered_bytes * 8. / SHAPE_SECONDS;
+    if (rate < prof->rate * 0.99 || rate > prof->rate * 1.01) {
+        fprintf(stderr, "shaper_test: %s: delivered %.0f bits/s, "
+                "expected %d\n", prof->name, rate, prof->rate);
+        errors++;
+    }
+    netshaper_destroy(shaper);
+
+    return sent_data;
+}
+
+static void
+bench_profiles( void )
+{
+    int  nn;
+
+    for (nn = 0; nn < (int)(sizeof(profiles)/sizeof(profiles[0])); nn++) {
+        const Profile*  prof = &profiles[nn];
+        struct timeval  t0, t1, t2;
+        double          secs;
+        int             packets;
+
+        gettimeofday(&t0, NULL);
+        packets = run_delay(prof);
+        gettimeofday(&t1, NULL);
+
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+        printf("shaper_test: %s: delayer: %d packets over %d simulated s "
+               "in %.3f s, %.0f ns/packet\n", prof->name, packets,
+               DELAY_SECONDS, secs, secs * 1e9 / packets);
+
+        packets = run_shaper(prof);
+        gettimeofday(&t2, NULL);
+
+        secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+        printf("shaper_test: %s: shaper: %d packets over %d simulated s "
+               "in %.3f s, %.0f ns/packet\n", prof->name, packets,
+               SHAPE_SECONDS, secs, secs * 1e9 / packets);
+    }
+}
+
+int
+main( void )
+{
+    check_wheel();
+    if (errors == 0)
+        bench_profiles();
+
+    if (errors > 0) {
+        fprintf(stderr, "shaper_test: FAILED\n");
+        return 1;
+    }
+    printf("shaper_test: OK\n");
+    return 0;
+}
@@ -194,6 +194,7 @@ diddit:
 
 	if (so) {
 		/* Update *_queued */
+		so_mark_dirty(so);
 		so->so_queued++;
 		so->so_nqueued++;
 		/*
@@ -225,6 +226,29 @@ diddit:
 #endif
 }
 
+/*
+ * Forget about a socket that is being freed while some of its packets
+ * are still queued, so that if_start() doesn't update it.
+ */
+void
+if_forget_so(struct socket *so)
+{
+	struct mbuf *queues[2] = { &if_fastq, &if_batchq };
+	struct mbuf *ifq, *ifm;
+	int n;
+
+	for (n = 0; n < 2; n++) {
+		for (ifq = queues[n]->ifq_next; ifq != queues[n]; ifq = ifq->ifq_next) {
+			ifm = ifq;
+			do {
+				if (ifm->ifq_so == so)
+					ifm->ifq_so = NULL;
+				ifm = ifm->ifs_next;
+			} while (ifm != ifq);
+		}
+	}
+}
+
 /*
  * Send a packet
  * We choose a packet based on it's position in the output queues;
@@ -281,6 +305,7 @@ if_start(void)
 
 	/* Update so_queued */
 	if (ifm->ifq_so) {
+		so_mark_dirty(ifm->ifq_so);
 		if (--ifm->ifq_so->so_queued == 0)
 		   /* If there's no more queued, reset nqueued */
 		   ifm->ifq_so->so_nqueued = 0;
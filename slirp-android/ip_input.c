@@ -270,7 +270,7 @@ ip_reass(register struct ip *ip, register struct ipq *fp)
 	register struct mbuf *m = dtom(ip);
 	register struct ipasfrag *q;
 	int hlen = ip->ip_hl << 2;
-	int i, next;
+	int i, next, qoff;
 
 	DEBUG_CALL("ip_reass");
 	DEBUG_ARG("ip = %lx", (long)ip);
@@ -367,6 +367,7 @@ insert:
 	 */
     q = fp->frag_link.next;
 	m = dtom(q);
+	qoff = (char *)q - m->m_data;
 
 	q = (struct ipasfrag *) q->ipf_next;
 	while (q != (struct ipasfrag*)&fp->frag_link) {
@@ -381,19 +382,14 @@ insert:
 	 * dequeue and discard fragment reassembly header.
 	 * Make header visible.
 	 */
-	q = fp->frag_link.next;
-
 	/*
 	 * If the fragments concatenated to an mbuf that's
-	 * bigger than the total size of the fragment, then and
-	 * m_ext buffer was alloced. But fp->ipq_next points to
-	 * the old buffer (in the mbuf), so we must point ip
-	 * into the new buffer.
+	 * bigger than the total size of the fragment, then
+	 * its data was moved to a new buffer. But fp->ipq_next
+	 * points to the old buffer, so we must point ip into
+	 * the new one, at the same offset from m_data.
 	 */
-	if (m->m_flags & M_EXT) {
-	  int delta = (char *)q - m->m_dat;
-	  q = (struct ipasfrag *)(m->m_ext + delta);
-	}
+	q = (struct ipasfrag *)(m->m_data + qoff);
 
 	/* DEBUG_ARG("ip = %lx", (long)ip);
 	 * ip=(struct ipasfrag *)m->m_data; */
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include "sockets.h"
+#include "iolooper.h"
+#include "netbuf.h"
 #ifdef _WIN32
 #  define WIN32_LEAN_AND_MEAN
 #  define socket_close  winsock2_socket_close3
@@ -21,16 +23,25 @@ char*  inet_iptostr(uint32_t  ip);
 
 void slirp_init(int restricted, const char *special_ip);
 
-void slirp_select_fill(int *pnfds,
-                       fd_set *readfds, fd_set *writefds, fd_set *xfds);
+/* register the slirp sockets that need to be watched with 'looper'.
+ * registrations are persistent, so this only touches sockets whose
+ * state changed since the previous call. */
+void slirp_select_fill(IoLooper *looper);
 
-void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds);
+/* act on the slirp sockets reported ready by the last wait on 'looper' */
+void slirp_select_poll(IoLooper *looper);
 
 void slirp_input(const uint8_t *pkt, int pkt_len);
 
+/* same as slirp_input(), but takes over the caller's reference to 'buf'.
+ * the packet is not copied if no one else holds the buffer. */
+void slirp_input_netbuf(NetBuf buf);
+
 /* you must provide the following functions: */
 int slirp_can_output(void);
 void slirp_output(const uint8_t *pkt, int pkt_len);
+/* same as slirp_output(), but takes over the caller's reference to 'buf' */
+void slirp_output_netbuf(NetBuf buf);
 
 void slirp_redir_loop(void (*func)(void *opaque, int is_udp,
                                    const SockAddress *laddr,
@@ -9,6 +9,8 @@
 #include <sys/select.h>
 #endif
 
+#include "iolooper.h"
+
 #define TOWRITEMAX 512
 
 extern struct timeval tt;
@@ -34,7 +36,8 @@ extern int slirp_restrict;
 extern char *slirp_tty;
 extern char *exec_shell;
 extern u_int curtime;
-extern fd_set *global_readfds, *global_writefds, *global_xfds;
+extern IoLooper *slirp_looper;
+extern IoLooper *global_looper;
 extern uint32_t ctl_addr_ip;
 extern uint32_t special_addr_ip;
 extern uint32_t alias_addr_ip;
@@ -19,7 +19,6 @@
 
 int mbuf_alloced = 0;
 struct mbuf m_freelist, m_usedlist;
-#define MBUF_THRESH 30
 int mbuf_max = 0;
 
 /*
@@ -28,19 +27,54 @@ int mbuf_max = 0;
  */
 #define SLIRP_MSIZE (IF_MTU + IF_MAXLINKHDR + sizeof(struct m_hdr ) + 6)
 
+/*
+ * Pool mbufs are carved out of slabs of MBUF_SLAB_COUNT fixed-size
+ * buffers. Slabs are never released, so a pool mbuf always goes back
+ * to m_freelist. Once MBUF_SLAB_MAX slabs are in use, we fall back to
+ * malloc()ing single M_DOFREE mbufs so that a burst doesn't pin an
+ * unbounded amount of memory.
+ */
+#define MBUF_SLAB_COUNT  64
+#define MBUF_SLAB_MAX    32
+
+static int mbuf_slabs = 0;
+
+static int
+m_slab_grow(void)
+{
+	char *slab;
+	int   n;
+
+	if (mbuf_slabs >= MBUF_SLAB_MAX)
+		return -1;
+
+	slab = malloc(MBUF_SLAB_COUNT * SLIRP_MSIZE);
+	if (slab == NULL)
+		return -1;
+
+	mbuf_slabs++;
+	for (n = 0; n < MBUF_SLAB_COUNT; n++) {
+		struct mbuf *m = (struct mbuf *)(slab + n * SLIRP_MSIZE);
+		m->m_flags = M_FREELIST;
+		insque(m, &m_freelist);
+	}
+	return 0;
+}
+
 void
 m_init(void)
 {
 	m_freelist.m_next = m_freelist.m_prev = &m_freelist;
 	m_usedlist.m_next = m_usedlist.m_prev = &m_usedlist;
+	m_slab_grow();
 }
 
 /*
  * Get an mbuf from the free list, if there are none
- * malloc one
+ * grow the pool by one slab, or malloc one if the pool
+ * has reached its maximum size
  *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
+ * mbufs malloc'ed outside of the pool are marked M_DOFREE,
  * which tells m_free to actually free() it
  */
 struct mbuf *
@@ -51,18 +85,21 @@ m_get(void)
 
 	DEBUG_CALL("m_get");
 
+	if (m_freelist.m_next == &m_freelist)
+		m_slab_grow();
+
 	if (m_freelist.m_next == &m_freelist) {
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
+		flags = M_DOFREE;
 		mbuf_alloced++;
-		if (mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
-		if (mbuf_alloced > mbuf_max)
-			mbuf_max = mbuf_alloced;
 	} else {
 		m = m_freelist.m_next;
 		remque(m);
+		mbuf_alloced++;
 	}
+	if (mbuf_alloced > mbuf_max)
+		mbuf_max = mbuf_alloced;
 
 	/* Insert it in the used list */
 	insque(m,&m_usedlist);
@@ -92,7 +129,9 @@ m_free(struct mbuf *m)
 	   remque(m);
 
 	/* If it's M_EXT, free() it */
-	if (m->m_flags & M_EXT)
+	if (m->m_flags & M_NETBUF)
+	   netbuf_unref(netbuf_from_storage(m->m_ext));
+	else if (m->m_flags & M_EXT)
 	   free(m->m_ext);
 
 	/*
@@ -104,6 +143,7 @@ m_free(struct mbuf *m)
 	} else if ((m->m_flags & M_FREELIST) == 0) {
 		insque(m,&m_freelist);
 		m->m_flags = M_FREELIST; /* Clobber other flags */
+		mbuf_alloced--;
 	}
   } /* if(m) */
 }
@@ -138,7 +178,18 @@ m_inc(struct mbuf *m, int size)
 	/* some compiles throw up on gotos.  This one we can fake. */
         if(m->m_size>size) return;
 
-        if (m->m_flags & M_EXT) {
+        if (m->m_flags & M_NETBUF) {
+	  /* the NetBuf can't be resized, switch to a private buffer */
+	  char *dat;
+	  datasize = m->m_data - m->m_ext;
+	  dat = (char *)malloc(size);
+	  memcpy(dat, m->m_ext, m->m_size);
+	  netbuf_unref(netbuf_from_storage(m->m_ext));
+
+	  m->m_ext = dat;
+	  m->m_data = m->m_ext + datasize;
+	  m->m_flags &= ~M_NETBUF;
+        } else if (m->m_flags & M_EXT) {
 	  datasize = m->m_data - m->m_ext;
 	  m->m_ext = (char *)realloc(m->m_ext,size);
 /*		if (m->m_ext == NULL)
@@ -182,6 +233,22 @@ m_adj(struct mbuf *m, int len)
 }
 
 
+/*
+ * Make m use the storage of a NetBuf rather than its own, so that
+ * the packet it holds doesn't have to be copied. This takes over the
+ * caller's reference to buf, which must not be shared since slirp
+ * modifies packets in place.
+ */
+void
+m_attach_netbuf(struct mbuf *m, NetBuf buf)
+{
+	m->m_ext = (char *)buf->storage;
+	m->m_size = buf->capacity;
+	m->m_data = (char *)buf->data;
+	m->m_len = buf->size;
+	m->m_flags |= M_EXT | M_NETBUF;
+}
+
 /*
  * Copy len bytes from m, starting off bytes into n
  */
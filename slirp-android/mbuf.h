@@ -33,6 +33,8 @@
 #ifndef _MBUF_H_
 #define _MBUF_H_
 
+#include "netbuf.h"
+
 #define m_freem m_free
 
 
@@ -115,6 +117,8 @@ struct mbuf {
 #define M_USEDLIST		0x04	/* XXX mbuf is on used list (for dtom()) */
 #define M_DOFREE		0x08	/* when m_free is called on the mbuf, free()
 					 * it rather than putting it on the free list */
+#define M_NETBUF		0x10	/* m_ext is the storage of a NetBuf, which
+					 * m_free releases instead of free()ing */
 
 /*
  * Mbuf statistics. XXX
@@ -136,6 +140,7 @@ void m_free _P((struct mbuf *));
 void m_cat _P((register struct mbuf *, register struct mbuf *));
 void m_inc _P((struct mbuf *, int));
 void m_adj _P((struct mbuf *, int));
+void m_attach_netbuf _P((struct mbuf *, NetBuf));
 int m_copy _P((struct mbuf *, struct mbuf *, int, int));
 struct mbuf * dtom _P((void *));
 
@@ -68,8 +68,10 @@ struct timeval tt;
 FILE *lfd;
 struct ex_list *exec_list;
 
-/* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
+/* the looper our sockets are registered with */
+IoLooper *slirp_looper;
+/* same as slirp_looper, but only set while in slirp_select_poll() */
+IoLooper *global_looper;
 
 char slirp_hostname[33];
 
@@ -263,7 +265,6 @@ void slirp_init(int restricted, const char *special_ip)
 
 #define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
-#define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
 /*
  * curtime kept to an accuracy of 1ms
@@ -290,126 +291,152 @@ static void updtime(void)
 }
 #endif
 
-void slirp_select_fill(int *pnfds,
-                       fd_set *readfds, fd_set *writefds, fd_set *xfds)
+/*
+ * Recompute the events a TCP socket waits for
+ */
+static void slirp_update_tcp(struct socket *so)
 {
-    struct socket *so, *so_next;
-    struct timeval timeout;
-    int nfds;
-    int tmp_time;
+	int events = 0;
 
-    /* fail safe */
-    global_readfds = NULL;
-    global_writefds = NULL;
-    global_xfds = NULL;
+	/*
+	 * See if we need a tcp_fasttimo
+	 */
+	if (time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK)
+	   time_fasttimo = curtime; /* Flag when we want a fasttimo */
 
-    nfds = *pnfds;
 	/*
-	 * First, TCP sockets
+	 * NOFDREF can include still connecting to local-host,
+	 * newly socreated() sockets etc. Don't want to select these.
 	 */
-	do_slowtimo = 0;
-	if (link_up) {
-		/*
-		 * *_slowtimo needs calling if there are IP fragments
-		 * in the fragment queue, or there are TCP connections active
-		 */
-		do_slowtimo = ((tcb.so_next != &tcb) ||
-                (&ipq.ip_link != ipq.ip_link.next));
+	if (so->so_state & SS_NOFDREF || so->s == -1)
+	   goto set_tcp_events;
 
-		for (so = tcb.so_next; so != &tcb; so = so_next) {
-			so_next = so->so_next;
+	/*
+	 * don't register proxified socked connections here
+	 */
+	if ((so->so_state & SS_PROXIFIED) != 0)
+	   goto set_tcp_events;
 
-			/*
-			 * See if we need a tcp_fasttimo
-			 */
-			if (time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK)
-			   time_fasttimo = curtime; /* Flag when we want a fasttimo */
+	/*
+	 * Set for reading sockets which are accepting
+	 */
+	if (so->so_state & SS_FACCEPTCONN) {
+		events = IOLOOPER_READ;
+		goto set_tcp_events;
+	}
 
-			/*
-			 * NOFDREF can include still connecting to local-host,
-			 * newly socreated() sockets etc. Don't want to select these.
-	 		 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-            /*
-             * don't register proxified socked connections here
-             */
-            if ((so->so_state & SS_PROXIFIED) != 0)
-	            continue;
+	/*
+	 * Set for writing sockets which are connecting
+	 */
+	if (so->so_state & SS_ISFCONNECTING) {
+		events = IOLOOPER_WRITE;
+		goto set_tcp_events;
+	}
 
-			/*
-			 * Set for reading sockets which are accepting
-			 */
-			if (so->so_state & SS_FACCEPTCONN) {
-                                FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-				continue;
-			}
+	/*
+	 * Set for writing if we are connected, can send more, and
+	 * we have something to send
+	 */
+	if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+		events |= IOLOOPER_WRITE;
+	}
 
-			/*
-			 * Set for writing sockets which are connecting
-			 */
-			if (so->so_state & SS_ISFCONNECTING) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-				continue;
-			}
+	/*
+	 * Set for reading (and urgent data) if we are connected, can
+	 * receive more, and we have room for it XXX /2 ?
+	 */
+	if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+		events |= IOLOOPER_READ | IOLOOPER_EXCEPT;
+	}
+set_tcp_events:
+	so_set_events(so, events);
+}
 
-			/*
-			 * Set for writing if we are connected, can send more, and
-			 * we have something to send
-			 */
-			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-			}
+/*
+ * Recompute the events a UDP (or ICMP) socket waits for
+ */
+static void slirp_update_udp(struct socket *so)
+{
+	int events = 0;
 
-			/*
-			 * Set for reading (and urgent data) if we are connected, can
-			 * receive more, and we have room for it XXX /2 ?
-			 */
-			if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-				FD_SET(so->s, readfds);
-				FD_SET(so->s, xfds);
-				UPD_NFDS(so->s);
-			}
-		}
+	if ((so->so_state & SS_PROXIFIED) != 0) {
+		so_set_events(so, 0);
+		return;
+	}
 
-		/*
-		 * UDP sockets
-		 */
-		for (so = udb.so_next; so != &udb; so = so_next) {
-			so_next = so->so_next;
+	/*
+	 * When UDP packets are received from over the
+	 * link, they're sendto()'d straight away, so
+	 * no need for setting for writing
+	 * Limit the number of packets queued by this session
+	 * to 4.  Note that even though we try and limit this
+	 * to 4 packets, the session could have more queued
+	 * if the packets needed to be fragmented
+	 * (XXX <= 4 ?)
+	 */
+	if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
+		events = IOLOOPER_READ;
+	}
+	so_set_events(so, events);
+}
 
-            if ((so->so_state & SS_PROXIFIED) != 0)
-                continue;
+/*
+ * Detach the UDP sockets that timed out, called with the slow timers
+ */
+static void slirp_expire_udp(void)
+{
+	struct socket *so, *so_next;
 
-			/*
-			 * See if it's timed out
-			 */
-			if (so->so_expire) {
-				if (so->so_expire <= curtime) {
-					udp_detach(so);
-					continue;
-				} else
-					do_slowtimo = 1; /* Let socket expire */
-			}
+	for (so = udb.so_next; so != &udb; so = so_next) {
+		so_next = so->so_next;
 
-			/*
-			 * When UDP packets are received from over the
-			 * link, they're sendto()'d straight away, so
-			 * no need for setting for writing
-			 * Limit the number of packets queued by this session
-			 * to 4.  Note that even though we try and limit this
-			 * to 4 packets, the session could have more queued
-			 * if the packets needed to be fragmented
-			 * (XXX <= 4 ?)
-			 */
-			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-				FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-			}
+		if (so->so_expire && so->so_expire <= curtime)
+			udp_detach(so);
+	}
+}
+
+void slirp_select_fill(IoLooper *looper)
+{
+    struct socket *so;
+    struct timeval timeout;
+    int tmp_time;
+
+    if (slirp_looper != looper) {
+        /* our registrations were made with another looper, if any */
+        for (so = tcb.so_next; so != &tcb; so = so->so_next) {
+            so->so_looper_events = 0;
+            so_mark_dirty(so);
+        }
+        for (so = udb.so_next; so != &udb; so = so->so_next) {
+            so->so_looper_events = 0;
+            so_mark_dirty(so);
+        }
+        slirp_looper = looper;
+    }
+
+    /* fail safe */
+    global_looper = NULL;
+
+	do_slowtimo = 0;
+	if (link_up) {
+		/*
+		 * *_slowtimo needs calling if there are IP fragments
+		 * in the fragment queue, TCP connections active, or
+		 * UDP sockets that may expire
+		 */
+		do_slowtimo = ((tcb.so_next != &tcb) ||
+                (udb.so_next != &udb) ||
+                (&ipq.ip_link != ipq.ip_link.next));
+
+		/*
+		 * Only the sockets whose state may have changed since the
+		 * last call need new events, the others stay registered
+		 */
+		while ((so = so_dirty_get()) != NULL) {
+			if (so->so_tcpcb != NULL)
+				slirp_update_tcp(so);
+			else
+				slirp_update_udp(so);
 		}
 	}
 
@@ -449,79 +476,32 @@ void slirp_select_fill(int *pnfds,
     /*
      * now, the proxified sockets
      */
-    proxy_manager_select_fill(&nfds, readfds, writefds, xfds);
-
-        *pnfds = nfds;
+    proxy_manager_select_fill(looper);
 }
 
-void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
+static void slirp_poll_tcp(IoLooper *looper, struct socket *so)
 {
-    struct socket *so, *so_next;
     int ret;
 
-    global_readfds = readfds;
-    global_writefds = writefds;
-    global_xfds = xfds;
-
-	/* Update time */
-	updtime();
-
-	/*
-	 * See if anything has timed out
-	 */
-	if (link_up) {
-		if (time_fasttimo && ((curtime - time_fasttimo) >= 2)) {
-			tcp_fasttimo();
-			time_fasttimo = 0;
-		}
-		if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
-			ip_slowtimo();
-			tcp_slowtimo();
-			last_slowtimo = curtime;
-		}
-	}
-
-	/*
-	 * Check sockets
-	 */
-	if (link_up) {
-		/*
-		 * Check TCP sockets
-		 */
-		for (so = tcb.so_next; so != &tcb; so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * FD_ISSET is meaningless on these sockets
-			 * (and they can crash the program)
-			 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-            /*
-             * proxified sockets are polled later in this
-             * function.
-             */
-            if ((so->so_state & SS_PROXIFIED) != 0)
-                continue;
+    so_mark_dirty(so);
 
 			/*
 			 * Check for URG data
 			 * This will soread as well, so no need to
 			 * test for readfds below if this succeeds
 			 */
-			if (FD_ISSET(so->s, xfds))
+			if (iolooper_get_ready(looper, so->s) & IOLOOPER_EXCEPT)
 			   sorecvoob(so);
 			/*
 			 * Check sockets for reading
 			 */
-			else if (FD_ISSET(so->s, readfds)) {
+			else if (iolooper_is_read(looper, so->s)) {
 				/*
 				 * Check for incoming connections
 				 */
 				if (so->so_state & SS_FACCEPTCONN) {
 					tcp_connect(so);
-					continue;
+					return;
 				} /* else */
 				ret = soread(so);
 
@@ -533,7 +513,7 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 			/*
 			 * Check sockets for writing
 			 */
-			if (FD_ISSET(so->s, writefds)) {
+			if (iolooper_is_write(looper, so->s)) {
 			  /*
 			   * Check for non-blocking, still-connecting sockets
 			   */
@@ -546,7 +526,7 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 			      /* XXXXX Must fix, zero bytes is a NOP */
 			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
 				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
+				return;
 
 			      /* else failed */
 			      so->so_state = SS_NOFDREF;
@@ -580,7 +560,7 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 			    /* XXX */
 			    if (errno == EAGAIN || errno == EWOULDBLOCK ||
 				errno == EINPROGRESS || errno == ENOTCONN)
-			      continue; /* Still connecting, continue */
+			      return; /* Still connecting, continue */
 
 			    /* else failed */
 			    so->so_state = SS_NOFDREF;
@@ -592,7 +572,7 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 			      /* XXX */
 			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
 				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
+				return;
 			      /* else failed */
 			      so->so_state = SS_NOFDREF;
 			    } else
@@ -602,29 +582,72 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 			  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
 			} /* SS_ISFCONNECTING */
 #endif
-		}
+}
 
-		/*
-		 * Now UDP sockets.
-		 * Incoming packets are sent straight away, they're not buffered.
-		 * Incoming UDP data isn't buffered either.
-		 */
-		for (so = udb.so_next; so != &udb; so = so_next) {
-			so_next = so->so_next;
+void slirp_select_poll(IoLooper *looper)
+{
+    struct socket *so;
+    int iter, fd;
 
-            if ((so->so_state & SS_PROXIFIED) != 0)
-                continue;
+    global_looper = looper;
 
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                            sorecvfrom(so);
-                        }
+	/* Update time */
+	updtime();
+
+	/*
+	 * See if anything has timed out
+	 */
+	if (link_up) {
+		if (time_fasttimo && ((curtime - time_fasttimo) >= 2)) {
+			tcp_fasttimo();
+			time_fasttimo = 0;
+		}
+		if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
+			ip_slowtimo();
+			tcp_slowtimo();
+			slirp_expire_udp();
+			last_slowtimo = curtime;
+		}
+	}
+
+	/*
+	 * Check sockets. Only those reported ready by the looper are
+	 * looked at; a socket freed while handling another one is
+	 * removed from the descriptor map, so so_fd_lookup() won't
+	 * return it.
+	 */
+	if (link_up) {
+		for (iter = 0; (fd = iolooper_next_ready(looper, &iter)) >= 0; ) {
+			so = so_fd_lookup(fd);
+
+			/*
+			 * Not one of ours, or the ready state of these
+			 * is meaningless (and they can crash the program)
+			 */
+			if (so == NULL || so->s != fd ||
+			    (so->so_state & SS_PROXIFIED) != 0)
+			    continue;
+
+			if (so->so_tcpcb != NULL) {
+				if (so->so_state & SS_NOFDREF)
+				    continue;
+				slirp_poll_tcp(looper, so);
+			} else {
+				/*
+				 * UDP sockets.
+				 * Incoming packets are sent straight away, they're not buffered.
+				 * Incoming UDP data isn't buffered either.
+				 */
+				if (iolooper_is_read(looper, so->s))
+					sorecvfrom(so);
+			}
 		}
 	}
 
     /*
      * Now the proxified sockets
      */
-    proxy_manager_poll(readfds, writefds, xfds);
+    proxy_manager_poll(looper);
 
 	/*
 	 * See if we can start outputting
@@ -632,14 +655,9 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 	if (if_queued && link_up)
 	   if_start();
 
-	/* clear global file descriptor sets.
-	 * these reside on the stack in vl.c
-	 * so they're unusable if we're not in
-	 * slirp_select_fill or slirp_select_poll.
-	 */
-	 global_readfds = NULL;
-	 global_writefds = NULL;
-	 global_xfds = NULL;
+	/* the looper's results are only meaningful until
+	 * the end of slirp_select_poll */
+	 global_looper = NULL;
 }
 
 #define ETH_ALEN 6
@@ -768,13 +786,36 @@ void slirp_input(const uint8_t *pkt, int pkt_len)
     }
 }
 
+void slirp_input_netbuf(NetBuf buf)
+{
+    struct mbuf *m;
+
+    /* slirp modifies IP packets in place, so only use the buffer
+     * directly if we are its sole owner */
+    if (netbuf_is_shared(buf) || buf->size < ETH_HLEN ||
+        ntohs(*(uint16_t *)(buf->data + 12)) != ETH_P_IP) {
+        slirp_input(buf->data, buf->size);
+        netbuf_unref(buf);
+        return;
+    }
+
+    m = m_get();
+    if (!m) {
+        netbuf_unref(buf);
+        return;
+    }
+    m_attach_netbuf(m, buf);
+
+    m->m_data += ETH_HLEN;
+    m->m_len -= ETH_HLEN;
+
+    ip_input(m);
+}
+
 /* output the IP packet to the ethernet device */
 void if_encap(const uint8_t *ip_data, int ip_data_len)
 {
-    uint8_t buf[1600];
-    struct ethhdr *eh = (struct ethhdr *)buf;
-
-    if (ip_data_len + ETH_HLEN > sizeof(buf))
+    if (ip_data_len + ETH_HLEN > 1600)
         return;
 
     if (!memcmp(client_ethaddr, zero_ethaddr, ETH_ALEN)) {
@@ -809,13 +850,18 @@ void if_encap(const uint8_t *ip_data, int ip_data_len)
         client_ip   = iph->ip_dst;
         slirp_output(arp_req, sizeof(arp_req));
     } else {
+        /* build the frame directly in a NetBuf, which is then passed
+         * by reference to the shaper and the NIC */
+        NetBuf buf = netbuf_alloc(ip_data_len + ETH_HLEN);
+        struct ethhdr *eh = (struct ethhdr *)buf->data;
+
         memcpy(eh->h_dest, client_ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 1);
         /* XXX: not correct */
         eh->h_source[5] = CTL_ALIAS;
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ip_data, ip_data_len);
-        slirp_output(buf, ip_data_len + ETH_HLEN);
+        memcpy(buf->data + sizeof(struct ethhdr), ip_data, ip_data_len);
+        slirp_output_netbuf(buf);
     }
 }
 
@@ -1132,6 +1178,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     so->so_laddr_ip = qemu_get_be32(f);
     so->so_faddr_port = qemu_get_be16(f);
     so->so_laddr_port = qemu_get_be16(f);
+    so_hash(so, &tcb);
     so->so_iptos = qemu_get_byte(f);
     so->so_emu = qemu_get_byte(f);
     so->so_type = qemu_get_byte(f);
@@ -229,6 +229,7 @@ int cksum(struct mbuf *m, int len);
 /* if.c */
 void if_init _P((void));
 void if_output _P((struct socket *, struct mbuf *));
+void if_forget_so _P((struct socket *));
 
 /* ip_input.c */
 void ip_init _P((void));
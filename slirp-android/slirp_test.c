@@ -0,0 +1,617 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* measure the cost of TCP connection churn through slirp. the test plays
+ * the guest: it opens connections to 10.0.2.2, i.e. the host loopback,
+ * where an echo server runs in a thread. each connection sends a message,
+ * checks its echo and is closed, with 16 of them in flight at a time.
+ * this is measured with few other connections, then with 1000 of them
+ * kept open, and so are messages sent over random kept connections.
+ * before sockets were hashed, a segment for a new or an old connection
+ * walked the whole socket list. no mbuf may be left in use at the end.
+ * run with 'make check'.
+ */
+#include "libslirp.h"
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "qemu-thread.h"
+#include "monitor.h"
+#include "hw/hw.h"
+#include "proxy/proxy_common.h"
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define  GUEST_IP      0x0a00020f   /* 10.0.2.15 */
+#define  HOST_IP       0x0a000202   /* 10.0.2.2, the host loopback */
+#define  PORT_BASE     10000        /* of the guest ports */
+#define  NB_KEPT       1000
+#define  NB_CHURN      5000
+#define  NB_MESSAGES   20000
+#define  NB_IN_FLIGHT  16
+#define  MSG_SIZE      100
+
+#define  TH_FIN   0x01
+#define  TH_SYN   0x02
+#define  TH_RST   0x04
+#define  TH_PUSH  0x08
+#define  TH_ACK   0x10
+
+/* mbuf.c */
+extern int  mbuf_alloced, mbuf_max;
+
+static int  errors;
+
+static uint32_t  rand_state = 1;
+
+static uint32_t
+next_rand( void )
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/** what slirp needs from the rest of the emulator
+ **/
+
+unsigned long  android_verbose;
+Monitor*       cur_mon;
+
+void*  qemu_malloc( size_t  size )  { return malloc(size); }
+void*  qemu_mallocz( size_t  size ) { return calloc(1, size); }
+void*  qemu_realloc( void*  ptr, size_t  size ) { return realloc(ptr, size); }
+void   qemu_free( void*  ptr )      { free(ptr); }
+
+void  monitor_vprintf( Monitor*  mon, const char*  fmt, va_list  ap ) {}
+int   qemu_chr_write( CharDriverState*  s, const uint8_t*  buf, int  len ) { return len; }
+
+/* no proxy is configured, and slirp doesn't use them for 10.0.2.2 */
+int   proxy_manager_add( SockAddress*  address, SocketType  sock_type,
+                         ProxyEventFunc  ev_func, void*  ev_opaque ) { return -1; }
+void  proxy_manager_del( void*  ev_opaque ) {}
+void  proxy_manager_select_fill( IoLooper*  looper ) {}
+void  proxy_manager_poll( IoLooper*  looper ) {}
+
+/* slirp's state is never saved here */
+int  register_savevm( const char*  idstr, int  instance_id, int  version_id,
+                      SaveStateHandler*  save_state,
+                      LoadStateHandler*  load_state, void*  opaque ) { return 0; }
+
+void          qemu_put_buffer( QEMUFile*  f, const uint8_t*  buf, int  size ) {}
+void          qemu_put_byte( QEMUFile*  f, int  v ) {}
+void          qemu_put_be16( QEMUFile*  f, unsigned int  v ) {}
+void          qemu_put_be32( QEMUFile*  f, unsigned int  v ) {}
+int           qemu_get_buffer( QEMUFile*  f, uint8_t*  buf, int  size ) { return 0; }
+int           qemu_get_byte( QEMUFile*  f ) { return 0; }
+unsigned int  qemu_get_be16( QEMUFile*  f ) { return 0; }
+unsigned int  qemu_get_be32( QEMUFile*  f ) { return 0; }
+
+/** the host: an echo server
+ **/
+
+static int  echo_fd;
+
+static void*
+echo_thread( void*  arg )
+{
+    IoLooper*  looper = iolooper_new();
+    char       buf[4096];
+
+    iolooper_modify(looper, echo_fd, 0, IOLOOPER_READ);
+    for (;;) {
+        int  iter = 0, fd;
+
+        iolooper_wait(looper, -1);
+        while ((fd = iolooper_next_ready(looper, &iter)) >= 0) {
+            int  n;
+
+            if (fd == echo_fd) {
+                while ((fd = socket_accept_any(echo_fd)) >= 0)
+                    iolooper_modify(looper, fd, 0, IOLOOPER_READ);
+                continue;
+            }
+            n = socket_recv(fd, buf, sizeof(buf));
+            if (n > 0) {
+                /* messages are small enough to be sent at once */
+                socket_send(fd, buf, n);
+            } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                iolooper_modify(looper, fd, IOLOOPER_READ, 0);
+                socket_close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+/** the guest: a minimal TCP client
+ **/
+
+enum {
+    CONN_FREE = 0,
+    CONN_SYN_SENT,
+    CONN_IDLE,      /* established, nothing in flight */
+    CONN_ECHO,      /* message sent, waiting for its echo */
+    CONN_FIN_WAIT,  /* FIN sent, waiting for the host's */
+    CONN_DONE
+};
+
+typedef struct {
+    int       state;
+    int       keep;     /* kept open between messages */
+    uint16_t  port;
+    uint32_t  snd_nxt;
+    uint32_t  rcv_nxt;
+    int       echoed;
+} Conn;
+
+static Conn       conns[NB_KEPT + 2*NB_CHURN];
+static int        num_conns;
+static Conn*      kept[NB_KEPT];
+static int        num_kept;
+static int        in_flight;
+static int        num_done;
+static int        echo_port;
+static IoLooper*  looper;
+
+static const uint8_t  guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+static const uint8_t  host_mac[6]  = { 0x52, 0x54, 0x00, 0x12, 0x35, 0x02 };
+
+static void
+put16( uint8_t*  p, unsigned  v )
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void
+put32( uint8_t*  p, uint32_t  v )
+{
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+static unsigned
+get16( const uint8_t*  p )
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t
+get32( const uint8_t*  p )
+{
+    return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+static uint32_t
+cksum_add( uint32_t  sum, const uint8_t*  p, int  len )
+{
+    for ( ; len > 1; p += 2, len -= 2)
+        sum += get16(p);
+    if (len > 0)
+        sum += p[0] << 8;
+    return sum;
+}
+
+static unsigned
+cksum_fold( uint32_t  sum )
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum & 0xffff;
+}
+
+/* the byte 'n' of the message of a connection */
+static uint8_t
+msg_byte( Conn*  c, int  n )
+{
+    return (uint8_t)(c->port*7 + n);
+}
+
+static void
+guest_send( Conn*  c, int  flags, int  len )
+{
+    uint8_t   frame[14 + 20 + 20 + MSG_SIZE];
+    uint8_t*  ip  = frame + 14;
+    uint8_t*  tcp = ip + 20;
+    uint8_t   pseudo[12];
+    uint32_t  sum;
+    int       nn;
+
+    memset(frame, 0, sizeof(frame));
+    memcpy(frame, host_mac, 6);
+    memcpy(frame + 6, guest_mac, 6);
+    put16(frame + 12, 0x0800);
+
+    ip[0] = 0x45;
+    put16(ip + 2, 20 + 20 + len);
+    ip[8] = 64;
+    ip[9] = 6;
+    put32(ip + 12, GUEST_IP);
+    put32(ip + 16, HOST_IP);
+    put16(ip + 10, cksum_fold(cksum_add(0, ip, 20)));
+
+    put16(tcp, c->port);
+    put16(tcp + 2, echo_port);
+    put32(tcp + 4, c->snd_nxt);
+    put32(tcp + 8, c->rcv_nxt);
+    tcp[12] = 5 << 4;
+    tcp[13] = (uint8_t)flags;
+    put16(tcp + 14, 0xffff);
+    for (nn = 0; nn < len; nn++)
+        tcp[20 + nn] = msg_byte(c, nn);
+
+    memcpy(pseudo, ip + 12, 8);
+    pseudo[8] = 0;
+    pseudo[9] = 6;
+    put16(pseudo + 10, 20 + len);
+    sum = cksum_add(cksum_add(0, pseudo, 12), tcp, 20 + len);
+    put16(tcp + 16, cksum_fold(sum));
+
+    slirp_input(frame, 14 + 20 + 20 + len);
+}
+
+static void
+conn_open( int  keep )
+{
+    Conn*  c = &conns[num_conns];
+
+    c->port    = PORT_BASE + num_conns;
+    c->keep    = keep;
+    c->snd_nxt = c->port * 1000;
+    c->rcv_nxt = 0;
+    c->state   = CONN_SYN_SENT;
+    num_conns++;
+    in_flight++;
+
+    guest_send(c, TH_SYN, 0);
+    c->snd_nxt++;
+}
+
+static void
+conn_send( Conn*  c )
+{
+    guest_send(c, TH_ACK | TH_PUSH, MSG_SIZE);
+    c->snd_nxt += MSG_SIZE;
+    c->state = CONN_ECHO;
+}
+
+static void
+conn_close( Conn*  c )
+{
+    guest_send(c, TH_FIN | TH_ACK, 0);
+    c->snd_nxt++;
+    c->state = CONN_FIN_WAIT;
+}
+
+static void
+conn_error( Conn*  c, const char*  what )
+{
+    if (errors++ < 10)
+        fprintf(stderr, "slirp_test: connection %d: %s\n",
+                c->port - PORT_BASE, what);
+}
+
+/* handle a frame sent by slirp to the guest */
+static void
+guest_input( const uint8_t*  frame, int  size )
+{
+    const uint8_t*  ip  = frame + 14;
+    const uint8_t*  tcp;
+    const uint8_t*  data;
+    Conn*           c;
+    int             port, flags, len, nn;
+    uint32_t        seq, ack;
+
+    /* ignore the ARP replies */
+    if (size < 14 + 40 || get16(frame + 12) != 0x0800 || ip[9] != 6)
+        return;
+
+    tcp   = ip + (ip[0] & 15)*4;
+    data  = tcp + (tcp[12] >> 4)*4;
+    len   = get16(ip + 2) - (data - ip);
+    port  = get16(tcp + 2);
+    seq   = get32(tcp + 4);
+    ack   = get32(tcp + 8);
+    flags = tcp[13];
+
+    if (port < PORT_BASE || port >= PORT_BASE + num_conns) {
+        if (errors++ < 10)
+            fprintf(stderr, "slirp_test: segment for unknown port %d\n", port);
+        return;
+    }
+    c = &conns[port - PORT_BASE];
+
+    if (flags & TH_RST) {
+        conn_error(c, "reset by slirp");
+        c->state = CONN_DONE;
+        in_flight--;
+        return;
+    }
+
+    if (c->state == CONN_SYN_SENT) {
+        if ((flags & (TH_SYN | TH_ACK)) != (TH_SYN | TH_ACK) ||
+            ack != c->snd_nxt) {
+            conn_error(c, "bad SYN-ACK");
+            return;
+        }
+        c->rcv_nxt = seq + 1;
+        if (c->keep) {
+            guest_send(c, TH_ACK, 0);
+            c->state = CONN_IDLE;
+            kept[num_kept++] = c;
+            in_flight--;
+        } else {
+            conn_send(c);
+        }
+        return;
+    }
+
+    if (c->state == CONN_FREE || c->state == CONN_DONE) {
+        conn_error(c, "segment after close");
+        return;
+    }
+
+    if (len > 0) {
+        if (seq != c->rcv_nxt || c->echoed + len > MSG_SIZE) {
+            conn_error(c, "unexpected data");
+            return;
+        }
+        for (nn = 0; nn < len; nn++) {
+            if (data[nn] != msg_byte(c, c->echoed + nn)) {
+                conn_error(c, "bad echo");
+                return;
+            }
+        }
+        c->echoed  += len;
+        c->rcv_nxt += len;
+    }
+
+    if (flags & TH_FIN) {
+        c->rcv_nxt++;
+        guest_send(c, TH_ACK, 0);
+        if (c->state != CONN_FIN_WAIT)
+            conn_error(c, "closed by the host");
+        if (c->echoed != (c->keep ? 0 : MSG_SIZE))
+            conn_error(c, "incomplete echo");
+        c->state = CONN_DONE;
+        in_flight--;
+        num_done++;
+    } else if (len > 0) {
+        if (c->state == CONN_ECHO && c->echoed == MSG_SIZE && !c->keep) {
+            conn_close(c);
+        } else {
+            guest_send(c, TH_ACK, 0);
+            if (c->state == CONN_ECHO && c->echoed == MSG_SIZE) {
+                c->state  = CONN_IDLE;
+                c->echoed = 0;
+                in_flight--;
+            }
+        }
+    }
+}
+
+/* frames are queued, and only handled outside of slirp's calls */
+static NetBuf*  out_queue;
+static int      out_count;
+static int      out_max;
+
+int
+slirp_can_output( void )
+{
+    return 1;
+}
+
+void
+slirp_output_netbuf( NetBuf  buf )
+{
+    if (out_count == out_max) {
+        out_max   = out_max ? 2*out_max : 64;
+        out_queue = realloc(out_queue, out_max * sizeof(NetBuf));
+    }
+    out_queue[out_count++] = buf;
+}
+
+void
+slirp_output( const uint8_t*  pkt, int  pkt_len )
+{
+    slirp_output_netbuf(netbuf_copy(pkt, pkt_len));
+}
+
+static void
+flush_output( void )
+{
+    while (out_count > 0) {
+        NetBuf  buf = out_queue[0];
+
+        memmove(out_queue, out_queue + 1, --out_count * sizeof(NetBuf));
+        guest_input(buf->data, buf->size);
+        netbuf_unref(buf);
+    }
+}
+
+/** main loop
+ **/
+
+static double
+now_secs( void )
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* the processor time used by the main loop, without the echo server's */
+static double
+cpu_secs( void )
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum {
+    RUN_CHURN,      /* open, echo and close connections */
+    RUN_KEEP,       /* open connections to keep */
+    RUN_MESSAGES    /* echo messages over random kept connections */
+};
+
+/* run the main loop until nothing is in flight, starting 'count'
+ * operations of the given kind on the way. returns the processor time
+ * used, or -1 */
+static double
+run( int  count, int  kind )
+{
+    double  t0 = now_secs();
+    double  c0 = cpu_secs();
+    int     started = 0;
+
+    while (started < count || in_flight > 0) {
+        while (started < count && in_flight < NB_IN_FLIGHT) {
+            if (kind == RUN_MESSAGES) {
+                Conn*  c = kept[next_rand() % num_kept];
+                if (c->state != CONN_IDLE)
+                    continue;
+                conn_send(c);
+                in_flight++;
+            } else {
+                conn_open(kind == RUN_KEEP);
+            }
+            started++;
+        }
+        flush_output();
+
+        slirp_select_fill(looper);
+        iolooper_wait(looper, 1);
+        slirp_select_poll(looper);
+        flush_output();
+
+        if (errors > 0 || now_secs() - t0 > 60) {
+            fprintf(stderr, "slirp_test: %d connections still in flight\n",
+                    in_flight);
+            errors++;
+            return -1;
+        }
+    }
+    return cpu_secs() - c0;
+}
+
+/* open the echo server, and raise the descriptor limit, since each
+ * connection uses two descriptors */
+static int
+setup_host( void )
+{
+    struct rlimit  rl;
+    SockAddress    addr;
+    QemuThread     thread;
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < 2*NB_KEPT + 4*NB_IN_FLIGHT + 64) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* socket_loopback_server() has a backlog of 4, which the connections
+     * in flight would overflow, making the host retry them after 1 s */
+    echo_fd = socket_create_inet(SOCKET_STREAM);
+    sock_address_init_inet(&addr, SOCK_ADDRESS_INET_LOOPBACK, 0);
+    if (echo_fd < 0 || socket_bind(echo_fd, &addr) < 0 ||
+        socket_listen(echo_fd, 4*NB_IN_FLIGHT) < 0 ||
+        socket_get_address(echo_fd, &addr) < 0) {
+        fprintf(stderr, "slirp_test: can't open the echo server: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    socket_set_nonblock(echo_fd);
+    echo_port = sock_address_get_port(&addr);
+    qemu_thread_create(&thread, echo_thread, NULL);
+    return 0;
+}
+
+int
+main( void )
+{
+    double  churn_few, churn_many, messages_few, messages_many;
+    int     nn;
+
+    if (setup_host() < 0) {
+        fprintf(stderr, "slirp_test: FAILED\n");
+        return 1;
+    }
+
+    slirp_init(0, NULL);
+    looper = iolooper_new();
+
+    /* make slirp learn the guest's MAC address, like the guest's first
+     * ARP request for its gateway does */
+    {
+        uint8_t  arp[14 + 28];
+
+        memset(arp, 0, sizeof(arp));
+        memset(arp, 0xff, 6);
+        memcpy(arp + 6, guest_mac, 6);
+        put16(arp + 12, 0x0806);
+        put16(arp + 14, 1);
+        put16(arp + 16, 0x0800);
+        arp[18] = 6;
+        arp[19] = 4;
+        put16(arp + 20, 1);
+        memcpy(arp + 22, guest_mac, 6);
+        put32(arp + 28, GUEST_IP);
+        put32(arp + 38, HOST_IP);
+        slirp_input(arp, sizeof(arp));
+        flush_output();
+    }
+
+    /* first with only NB_IN_FLIGHT connections kept open, then NB_KEPT */
+    run(NB_IN_FLIGHT, RUN_KEEP);
+    churn_few    = run(NB_CHURN, RUN_CHURN);
+    messages_few = run(NB_MESSAGES, RUN_MESSAGES);
+
+    run(NB_KEPT - NB_IN_FLIGHT, RUN_KEEP);
+    churn_many    = run(NB_CHURN, RUN_CHURN);
+    messages_many = run(NB_MESSAGES, RUN_MESSAGES);
+
+    for (nn = 0; nn < num_kept && errors == 0; nn++) {
+        conn_close(kept[nn]);
+        in_flight++;
+    }
+    run(0, RUN_CHURN);
+
+    if (errors == 0 && num_done != num_conns) {
+        fprintf(stderr, "slirp_test: %d of %d connections closed\n",
+                num_done, num_conns);
+        errors++;
+    }
+    if (errors == 0 && mbuf_alloced != 0) {
+        fprintf(stderr, "slirp_test: %d mbufs leaked\n", mbuf_alloced);
+        errors++;
+    }
+
+    if (errors > 0) {
+        fprintf(stderr, "slirp_test: FAILED\n");
+        return 1;
+    }
+    printf("slirp_test: main loop time per connection: %.1f us with %d "
+           "others open, %.1f us with %d (%.2fx)\n", churn_few * 1e6 / NB_CHURN,
+           NB_IN_FLIGHT, churn_many * 1e6 / NB_CHURN, NB_KEPT,
+           churn_many / churn_few);
+    printf("slirp_test: main loop time per message: %.1f us over %d "
+           "connections, %.1f us over %d (%.2fx)\n",
+           messages_few * 1e6 / NB_MESSAGES, NB_IN_FLIGHT,
+           messages_many * 1e6 / NB_MESSAGES, NB_KEPT,
+           messages_many / messages_few);
+    printf("slirp_test: %d mbufs in use at most\n", mbuf_max);
+    printf("slirp_test: OK\n");
+    return 0;
+}
@@ -28,12 +28,81 @@ so_init()
 }
 #endif
 
+static struct socket *tcb_hash[SO_HASH_SIZE];
+static struct socket *udb_hash[SO_HASH_SIZE];
+
+static inline unsigned
+so_hash_key(uint32_t laddr, u_int lport, uint32_t faddr, u_int fport)
+{
+	uint32_t h = laddr ^ (faddr * 0x9e3779b1U);
+
+	h ^= (lport << 16) | (fport & 0xffff);
+	h *= 0x85ebca6bU;
+	return (h ^ (h >> 16)) & (SO_HASH_SIZE - 1);
+}
+
+static struct socket **
+so_hash_bucket(struct socket *head, struct socket *so)
+{
+	if (head == &tcb)
+		return &tcb_hash[so_hash_key(so->so_laddr_ip, so->so_laddr_port,
+		                             so->so_faddr_ip, so->so_faddr_port)];
+	return &udb_hash[so_hash_key(so->so_laddr_ip, so->so_laddr_port, 0, 0)];
+}
+
+/*
+ * (Re-)insert a socket into the hash table of the list 'head'.
+ * Must be called after the socket's addresses have been set up,
+ * and again each time they change.
+ */
+void
+so_hash(struct socket *so, struct socket *head)
+{
+	struct socket **bucket;
+
+	so_unhash(so);
+
+	bucket = so_hash_bucket(head, so);
+	so->so_hhead = head;
+	so->so_hnext = *bucket;
+	if (so->so_hnext)
+		so->so_hnext->so_hprev = &so->so_hnext;
+	so->so_hprev = bucket;
+	*bucket = so;
+}
+
+void
+so_unhash(struct socket *so)
+{
+	if (so->so_hprev == NULL)
+		return;
+
+	*so->so_hprev = so->so_hnext;
+	if (so->so_hnext)
+		so->so_hnext->so_hprev = so->so_hprev;
+	so->so_hnext = NULL;
+	so->so_hprev = NULL;
+	so->so_hhead = NULL;
+}
+
 struct socket *
 solookup(struct socket *head, uint32_t laddr, u_int lport,
          uint32_t faddr, u_int fport)
 {
 	struct socket *so;
 
+	if (head == &tcb) {
+		so = tcb_hash[so_hash_key(laddr, lport, faddr, fport)];
+		for ( ; so != NULL; so = so->so_hnext) {
+			if (so->so_laddr_port == lport &&
+			    so->so_laddr_ip   == laddr &&
+			    so->so_faddr_ip   == faddr &&
+			    so->so_faddr_port == fport)
+				return so;
+		}
+		return NULL;
+	}
+
 	for (so = head->so_next; so != head; so = so->so_next) {
 		if (so->so_laddr_port == lport &&
 		    so->so_laddr_ip   == laddr &&
@@ -48,6 +117,133 @@ solookup(struct socket *head, uint32_t laddr, u_int lport,
 
 }
 
+/*
+ * Find a socket of the udb list by its guest-side address only.
+ */
+struct socket *
+solookup_local(struct socket *head, uint32_t laddr, u_int lport)
+{
+	struct socket *so;
+
+	so = udb_hash[so_hash_key(laddr, lport, 0, 0)];
+	for ( ; so != NULL; so = so->so_hnext) {
+		if (so->so_hhead == head &&
+		    so->so_laddr_port == lport &&
+		    so->so_laddr_ip   == laddr)
+			return so;
+	}
+	return NULL;
+}
+
+/*
+ * Descriptors are registered with slirp_looper persistently, and
+ * so_fd_map maps a registered descriptor back to its socket when it
+ * is reported ready.
+ */
+static struct socket **so_fd_map;
+static int so_fd_map_size;
+
+struct socket *
+so_fd_lookup(int fd)
+{
+	if (fd < 0 || fd >= so_fd_map_size)
+		return NULL;
+	return so_fd_map[fd];
+}
+
+static void
+so_fd_map_set(int fd, struct socket *so)
+{
+	if (fd >= so_fd_map_size) {
+		int size = so_fd_map_size ? so_fd_map_size : 64;
+
+		while (size <= fd)
+			size *= 2;
+		so_fd_map = qemu_realloc(so_fd_map, size * sizeof(*so_fd_map));
+		memset(so_fd_map + so_fd_map_size, 0,
+		       (size - so_fd_map_size) * sizeof(*so_fd_map));
+		so_fd_map_size = size;
+	}
+	so_fd_map[fd] = so;
+}
+
+/*
+ * The events a socket is registered for only change when its state or
+ * its buffers do. Sockets are put in the dirty list when that may have
+ * happened, and slirp_select_fill() only recomputes the events of the
+ * sockets in that list. A socket must be in tcb or udb to be marked.
+ */
+static struct socket *so_dirty_list;
+
+void
+so_mark_dirty(struct socket *so)
+{
+	if (so->so_dprev != NULL)
+		return;
+
+	so->so_dnext = so_dirty_list;
+	if (so_dirty_list != NULL)
+		so_dirty_list->so_dprev = &so->so_dnext;
+	so->so_dprev = &so_dirty_list;
+	so_dirty_list = so;
+}
+
+static void
+so_unmark_dirty(struct socket *so)
+{
+	if (so->so_dprev == NULL)
+		return;
+
+	*so->so_dprev = so->so_dnext;
+	if (so->so_dnext != NULL)
+		so->so_dnext->so_dprev = so->so_dprev;
+	so->so_dnext = NULL;
+	so->so_dprev = NULL;
+}
+
+/*
+ * Remove the first socket of the dirty list and return it, or NULL if
+ * the list is empty.
+ */
+struct socket *
+so_dirty_get(void)
+{
+	struct socket *so = so_dirty_list;
+
+	if (so != NULL)
+		so_unmark_dirty(so);
+	return so;
+}
+
+/*
+ * Change the IOLOOPER_XXX events watched for a socket's descriptor.
+ * This must be called with 0 before the descriptor is closed.
+ */
+void
+so_set_events(struct socket *so, int events)
+{
+	if (so->so_looper_fd != so->s) {
+		/* the previous descriptor has been closed, or was
+		 * never registered; either way it's gone from the looper */
+		if (so_fd_lookup(so->so_looper_fd) == so)
+			so_fd_map[so->so_looper_fd] = NULL;
+		so->so_looper_fd = so->s;
+		so->so_looper_events = 0;
+	}
+
+	if (so->s < 0 || events == so->so_looper_events)
+		return;
+
+	if (slirp_looper)
+		iolooper_modify(slirp_looper, so->s, so->so_looper_events, events);
+
+	so->so_looper_events = events;
+	if (events)
+		so_fd_map_set(so->s, so);
+	else if (so_fd_lookup(so->s) == so)
+		so_fd_map[so->s] = NULL;
+}
+
 /*
  * Create a new socket, initialise the fields
  * It is the responsibility of the caller to
@@ -63,6 +259,7 @@ socreate(void)
     memset(so, 0, sizeof(struct socket));
     so->so_state = SS_NOFDREF;
     so->s = -1;
+    so->so_looper_fd = -1;
   }
   return(so);
 }
@@ -87,6 +284,12 @@ sofree(struct socket *so)
 
   m_free(so->so_m);
 
+  so_unhash(so);
+  so_set_events(so, 0);
+  so_unmark_dirty(so);
+  if (so->so_queued > 0)
+    if_forget_so(so);
+
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
@@ -169,6 +372,8 @@ soread(struct socket *so)
 	DEBUG_CALL("soread");
 	DEBUG_ARG("so = %lx", (long )so);
 
+	so_mark_dirty(so);
+
 	/*
 	 * No need to check if there's enough room to read.
 	 * soread wouldn't have been called if there weren't
@@ -277,6 +482,8 @@ sorecvoob(struct socket *so)
 	DEBUG_CALL("sorecvoob");
 	DEBUG_ARG("so = %lx", (long)so);
 
+	so_mark_dirty(so);
+
 	/*
 	 * We take a guess at how much urgent data has arrived.
 	 * In most situations, when urgent data arrives, the next
@@ -306,6 +513,8 @@ sosendoob(struct socket *so)
 
 	DEBUG_CALL("sosendoob");
 	DEBUG_ARG("so = %lx", (long)so);
+
+	so_mark_dirty(so);
 	DEBUG_ARG("sb->sb_cc = %d", sb->sb_cc);
 
 	if (so->so_urgc > 2048)
@@ -365,6 +574,8 @@ sowrite(struct socket *so)
 	DEBUG_CALL("sowrite");
 	DEBUG_ARG("so = %lx", (long)so);
 
+	so_mark_dirty(so);
+
 	if (so->so_urgc) {
 		sosendoob(so);
 		if (sb->sb_cc == 0)
@@ -456,6 +667,8 @@ sorecvfrom(struct socket *so)
 	DEBUG_CALL("sorecvfrom");
 	DEBUG_ARG("so = %lx", (long)so);
 
+	so_mark_dirty(so);
+
 	if (so->so_type == IPPROTO_ICMP) {   /* This is a "ping" reply */
 	  char buff[256];
 	  int len;
@@ -555,6 +768,8 @@ sosendto(struct socket *so, struct mbuf *m)
 
 	DEBUG_CALL("sosendto");
 	DEBUG_ARG("so = %lx", (long)so);
+
+	so_mark_dirty(so);
 	DEBUG_ARG("m = %lx", (long)m);
 
 	if ((so->so_faddr_ip & 0xffffff00) == special_addr_ip) {
@@ -644,7 +859,10 @@ solisten(u_int port, u_int32_t laddr, u_int lport, int flags)
     else
         so->so_faddr_ip = addr_ip;
 
+    so_hash(so, &tcb);
+
 	so->s = s;
+	so_mark_dirty(so);
 	return so;
 }
 
@@ -666,6 +884,7 @@ sounlisten(u_int  port)
 
     sofcantrcvmore( so );
     sofcantsendmore( so );
+    so_set_events( so, 0 );
     close( so->s );
     so->s = -1;
     sofree( so );
@@ -709,6 +928,7 @@ sowwakeup(so)
 void
 soisfconnecting(struct socket *so)
 {
+	so_mark_dirty(so);
 	so->so_state &= ~(SS_NOFDREF|SS_ISFCONNECTED|SS_FCANTRCVMORE|
 			  SS_FCANTSENDMORE|SS_FWDRAIN);
 	so->so_state |= SS_ISFCONNECTING; /* Clobber other states */
@@ -717,6 +937,7 @@ soisfconnecting(struct socket *so)
 void
 soisfconnected(struct socket *so)
 {
+	so_mark_dirty(so);
 	so->so_state &= ~(SS_ISFCONNECTING|SS_FWDRAIN|SS_NOFDREF);
 	so->so_state |= SS_ISFCONNECTED; /* Clobber other states */
 }
@@ -724,10 +945,11 @@ soisfconnected(struct socket *so)
 static void
 sofcantrcvmore(struct socket *so)
 {
+	so_mark_dirty(so);
 	if ((so->so_state & SS_NOFDREF) == 0) {
 		shutdown(so->s,0);
-		if(global_writefds) {
-		  FD_CLR(so->s,global_writefds);
+		if (global_looper) {
+		  iolooper_clear_ready(global_looper, so->s, IOLOOPER_WRITE);
 		}
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
@@ -740,13 +962,12 @@ sofcantrcvmore(struct socket *so)
 static void
 sofcantsendmore(struct socket *so)
 {
+	so_mark_dirty(so);
 	if ((so->so_state & SS_NOFDREF) == 0) {
             shutdown(so->s,1);           /* send FIN to fhost */
-            if (global_readfds) {
-                FD_CLR(so->s,global_readfds);
-            }
-            if (global_xfds) {
-                FD_CLR(so->s,global_xfds);
+            if (global_looper) {
+                iolooper_clear_ready(global_looper, so->s,
+                                     IOLOOPER_READ|IOLOOPER_EXCEPT);
             }
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
@@ -774,6 +995,7 @@ soisfdisconnected(struct socket *so)
 void
 sofwdrain(struct socket *so)
 {
+	so_mark_dirty(so);
 	if (so->so_rcv.sb_cc)
 		so->so_state |= SS_FWDRAIN;
 	else
@@ -19,8 +19,15 @@
 
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  struct socket *so_hnext;              /* Next socket in the same hash bucket */
+  struct socket **so_hprev;             /* Back-pointer to our hash bucket link */
+  struct socket *so_hhead;              /* List (tcb or udb) we are hashed for */
 
   int s;                           /* The actual socket */
+  int so_looper_fd;                /* Descriptor registered with slirp_looper */
+  int so_looper_events;            /* IOLOOPER_XXX events registered for it */
+  struct socket *so_dnext;         /* Next socket in the dirty list */
+  struct socket **so_dprev;        /* Back-pointer to our dirty list link */
 
 			/* XXX union these with not-yet-used sbuf params */
   struct mbuf *so_m;	           /* Pointer to the original SYN packet,
@@ -76,8 +83,27 @@ struct socket {
 
 extern struct socket tcb;
 
+/*
+ * Sockets are also kept in a hash table so that inbound segments
+ * don't have to walk the whole tcb/udb list. TCP sockets are keyed
+ * on the full 4-tuple, UDP (and ICMP) sockets only on the guest-side
+ * address and port, since udp_input() rewrites the foreign end.
+ *
+ * so_hash() must be called again whenever one of the keyed fields
+ * of a socket changes.
+ */
+#define SO_HASH_BITS   10
+#define SO_HASH_SIZE   (1 << SO_HASH_BITS)
+
 void so_init _P((void));
+void so_hash _P((struct socket *, struct socket *));
+void so_unhash _P((struct socket *));
 struct socket * solookup _P((struct socket *, uint32_t, u_int, uint32_t, u_int));
+struct socket * solookup_local _P((struct socket *, uint32_t, u_int));
+void so_set_events _P((struct socket *, int));
+void so_mark_dirty _P((struct socket *));
+struct socket * so_dirty_get _P((void));
+struct socket * so_fd_lookup _P((int));
 struct socket * socreate _P((void));
 void sofree _P((struct socket *));
 int soread _P((struct socket *));
@@ -257,6 +257,7 @@ tcp_input(struct mbuf *m, int iphlen, struct socket *inso)
 	 */
 	if (m == NULL) {
 		so = inso;
+		so_mark_dirty(so);
 
 		/* Re-set a few variables */
 		tp = sototcpcb(so);
@@ -388,6 +389,10 @@ findso:
 			STAT(tcpstat.tcps_socachemiss++);
 		}
     }
+	/* the segment will probably change the socket's state */
+	if (so != NULL)
+		so_mark_dirty(so);
+
 	/*
 	 * If the state is CLOSED (i.e., TCB does not exist) then
 	 * all data in the incoming segment is discarded.
@@ -422,6 +427,7 @@ findso:
 	  so->so_laddr_port = port_geth(ti->ti_sport);
 	  so->so_faddr_ip   = ip_geth(ti->ti_dst);
 	  so->so_faddr_port = port_geth(ti->ti_dport);
+	  so_hash(so, &tcb);
 
 	  if ((so->so_iptos = tcp_tos(so)) == 0)
 	    so->so_iptos = ((struct ip *)ti)->ip_tos;
@@ -280,6 +280,7 @@ tcp_close(struct tcpcb *tp)
 	/* clobber input socket cache if we're closing the cached connection */
 	if (so == tcp_last_so)
 		tcp_last_so = &tcb;
+	so_set_events(so, 0);
 	socket_close(so->s);
 	sbfree(&so->so_rcv);
 	sbfree(&so->so_snd);
@@ -512,8 +513,11 @@ tcp_connect(struct socket *inso)
 	if (addr_ip == 0 || addr_ip == loopback_addr_ip)
 	   so->so_faddr_ip = alias_addr_ip;
 
+	so_hash(so, &tcb);
+
 	/* Close the accept() socket, set right state */
 	if (inso->so_state & SS_FACCEPTONCE) {
+		so_set_events(so, 0);
 		socket_close(so->s); /* If we only accept once, close the accept() socket */
 		so->so_state = SS_NOFDREF; /* Don't select it yet, even though we have an FD */
 					   /* if it's not FACCEPTONCE, it's already NOFDREF */
@@ -552,6 +556,7 @@ tcp_attach(struct socket *so)
 	   return -1;
 
 	insque(so, &tcb);
+	so_mark_dirty(so);
 
 	return 0;
 }
@@ -170,20 +170,9 @@ udp_input(register struct mbuf *m, int iphlen)
 	so = udp_last_so;
 	if (so->so_laddr_port != port_geth(uh->uh_sport) ||
 	    so->so_laddr_ip   != ip_geth(ip->ip_src)) {
-		struct socket *tmp;
-
-		for (tmp = udb.so_next; tmp != &udb; tmp = tmp->so_next) {
-			if (tmp->so_laddr_port == port_geth(uh->uh_sport) &&
-			    tmp->so_laddr_ip   == ip_geth(ip->ip_src)) {
-				tmp->so_faddr_ip   = ip_geth(ip->ip_dst);
-				tmp->so_faddr_port = port_geth(uh->uh_dport);
-				so = tmp;
-				break;
-			}
-		}
-		if (tmp == &udb) {
-		  so = NULL;
-		} else {
+		so = solookup_local(&udb, ip_geth(ip->ip_src),
+		                    port_geth(uh->uh_sport));
+		if (so) {
 		  STAT(udpstat.udpps_pcbcachemiss++);
 		  udp_last_so = so;
 		}
@@ -208,6 +197,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	  /* udp_last_so = so; */
 	  so->so_laddr_ip   = ip_geth(ip->ip_src);
 	  so->so_laddr_port = port_geth(uh->uh_sport);
+	  so_hash(so, &udb);
 
 	  if ((so->so_iptos = udp_tos(so)) == 0)
 	    so->so_iptos = ip->ip_tos;
@@ -344,6 +334,7 @@ udp_attach(struct socket *so)
       /* success, insert in queue */
       so->so_expire = curtime + SO_EXPIRE;
       insque(so,&udb);
+      so_mark_dirty(so);
   }
   return(so->s);
 }
@@ -351,6 +342,7 @@ udp_attach(struct socket *so)
 void
 udp_detach(struct socket *so)
 {
+	so_set_events(so, 0);
 	socket_close(so->s);
 	/* if (so->so_m) m_free(so->so_m);    done by sofree */
 
@@ -442,6 +434,7 @@ udp_listen(u_int port, u_int32_t laddr, u_int lport, int flags)
 	so->so_expire = curtime + SO_EXPIRE;
     so->so_haddr_port = port;
 	insque(so,&udb);
+	so_mark_dirty(so);
 
 	if (so->s < 0) {
 		udp_detach(so);
@@ -460,6 +453,7 @@ udp_listen(u_int port, u_int32_t laddr, u_int lport, int flags)
 
 	so->so_laddr_port = lport;
 	so->so_laddr_ip   = laddr;
+	so_hash(so, &udb);
 	if (flags != SS_FACCEPTONCE)
 	   so->so_expire = 0;
 
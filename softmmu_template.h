@@ -69,6 +69,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr,
 {
     DATA_TYPE res;
     int index;
+    IOMemDispatch *d;
     index = (physaddr >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     env->mem_io_pc = (unsigned long)retaddr;
@@ -78,6 +79,17 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr,
     }
 
     env->mem_io_vaddr = addr;
+    d = &io_mem_dispatch[index];
+    d->stats.reads++;
+    if (d->posted_pending)
+        cpu_io_memory_flush_posted();
+#if SHIFT == 2
+    if (physaddr < 4 * IO_MEM_FAST_REGS && (physaddr & 3) == 0 &&
+        (d->shadow_mask & (1U << (physaddr >> 2)))) {
+        d->stats.shadow_reads++;
+        return d->shadow[physaddr >> 2];
+    }
+#endif
 #if SHIFT <= 2
     res = io_mem_read[index][SHIFT](io_mem_opaque[index], physaddr);
 #else
@@ -107,7 +119,7 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
 
     /* test if there is match for unaligned or IO access */
     /* XXX: could done more in memory macro in a non portable way */
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
@@ -164,7 +176,7 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
              * will invoke _ld/_st_mmu. */
             env->tlb_table[mmu_idx][index].addr_read ^= TARGET_PAGE_MASK;
             env->tlb_table[mmu_idx][index].addr_write ^= TARGET_PAGE_MASK;
-            if ((invalidate_cache == 2) && (index < CPU_TLB_SIZE)) {
+            if ((invalidate_cache == 2) && (index < env->tlb_size)) {
                 // Read crossed page boundaris. Invalidate second cache too.
                 env->tlb_table[mmu_idx][index + 1].addr_read ^= TARGET_PAGE_MASK;
                 env->tlb_table[mmu_idx][index + 1].addr_write ^= TARGET_PAGE_MASK;
@@ -178,7 +190,9 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_lookup(env, mmu_idx, index, addr,
+                               offsetof(CPUTLBEntry, ADDR_READ)))
+            tlb_fill(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
         goto redo;
     }
     return res;
@@ -194,7 +208,7 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
     target_phys_addr_t addend;
     target_ulong tlb_addr, addr1, addr2;
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
@@ -228,7 +242,9 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_lookup(env, mmu_idx, index, addr,
+                               offsetof(CPUTLBEntry, ADDR_READ)))
+            tlb_fill(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
         goto redo;
     }
     return res;
@@ -247,6 +263,7 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr,
                                           void *retaddr)
 {
     int index;
+    IOMemDispatch *d;
     index = (physaddr >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (index > (IO_MEM_NOTDIRTY >> IO_MEM_SHIFT)
@@ -256,6 +273,17 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr,
 
     env->mem_io_vaddr = addr;
     env->mem_io_pc = (unsigned long)retaddr;
+    d = &io_mem_dispatch[index];
+    d->stats.writes++;
+#if SHIFT <= 2
+    if (physaddr < 4 * IO_MEM_FAST_REGS && (physaddr & 3) == 0 &&
+        (d->posted_mask & (1U << (physaddr >> 2)))) {
+        cpu_io_memory_post_write(index, physaddr, val, SHIFT);
+        return;
+    }
+#endif
+    if (d->posted_pending)
+        cpu_io_memory_flush_posted();
 #if SHIFT <= 2
     io_mem_write[index][SHIFT](io_mem_opaque[index], physaddr, val);
 #else
@@ -281,7 +309,7 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
     int invalidate_cache = 0;
 #endif  // CONFIG_MEMCHECK_MMU
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
@@ -339,7 +367,7 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
              * will invoke _ld/_st_mmu. */
             env->tlb_table[mmu_idx][index].addr_read ^= TARGET_PAGE_MASK;
             env->tlb_table[mmu_idx][index].addr_write ^= TARGET_PAGE_MASK;
-            if ((invalidate_cache == 2) && (index < CPU_TLB_SIZE)) {
+            if ((invalidate_cache == 2) && (index < env->tlb_size)) {
                 // Write crossed page boundaris. Invalidate second cache too.
                 env->tlb_table[mmu_idx][index + 1].addr_read ^= TARGET_PAGE_MASK;
                 env->tlb_table[mmu_idx][index + 1].addr_write ^= TARGET_PAGE_MASK;
@@ -353,7 +381,9 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_lookup(env, mmu_idx, index, addr,
+                               offsetof(CPUTLBEntry, addr_write)))
+            tlb_fill(addr, 1, mmu_idx, retaddr);
         goto redo;
     }
 }
@@ -368,7 +398,7 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
     target_ulong tlb_addr;
     int index, i;
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
@@ -399,7 +429,9 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_lookup(env, mmu_idx, index, addr,
+                               offsetof(CPUTLBEntry, addr_write)))
+            tlb_fill(addr, 1, mmu_idx, retaddr);
         goto redo;
     }
 }
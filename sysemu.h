@@ -40,6 +40,52 @@ uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 
+/* statistics about the RAM pages saved or loaded since the last reset */
+typedef struct RamStats {
+    uint64_t raw_bytes;     /* size of the RAM pages saved or loaded */
+    uint64_t fill_pages;    /* pages filled with a single byte value */
+    uint64_t free_pages;    /* zero pages discarded by the guest */
+    uint64_t dup_pages;     /* pages identical to another page */
+    uint64_t stored_bytes;  /* size of the RAM data in the stream */
+    uint64_t mapped_bytes;  /* size of the RAM mapped from a file on load */
+} RamStats;
+
+void ram_stats_reset(void);
+void ram_stats_get(RamStats *stats);
+
+/* RAM file names are relative to the directory of 'image', the image
+   which holds the VM state */
+void ram_set_file_base(const char *image);
+void ram_get_file_path(char *path, int path_size, const char *name);
+
+/* make the next savevm store guest RAM in file 'name', or in the VM state
+   itself if 'name' is NULL. The file only replaces any previous one with
+   the same name once committed with 'keep' set, and is removed otherwise */
+void ram_set_save_file(const char *name);
+void ram_commit_save_file(int keep);
+
+/* make the next savevm only store the RAM pages modified since snapshot
+   'id' was saved or loaded, if 'id' is the current base */
+void ram_set_save_parent(const char *id);
+
+/* return the id of the snapshot that current RAM is tracked against, or
+   NULL, and set it after a snapshot was saved or loaded */
+const char *ram_get_base(void);
+void ram_set_base(const char *id);
+
+/* copy the records of one RAM section of a VM state from 'f' to 'out', up
+   to its end of section, without decoding the pages. Used by snapshot
+   compaction to merge the RAM of a snapshot into the VM state of its
+   children. */
+typedef struct RamSectionCopy {
+    int drop_parent;            /* don't copy the parent snapshot record */
+    const char *new_file;       /* if not NULL, replaces the RAM file name */
+    char parent_id[128];        /* set to the parent snapshot id, if any */
+    char file[1024];            /* set to the RAM file name, if any */
+} RamSectionCopy;
+
+int ram_copy_section(QEMUFile *f, QEMUFile *out, RamSectionCopy *rc);
+
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
 void cpu_disable_ticks(void);
@@ -68,6 +114,7 @@ void do_info_snapshots(Monitor *mon);
 void qemu_announce_self(void);
 
 void main_loop_wait(int timeout);
+void do_info_idle(Monitor *mon);
 
 int qemu_savevm_state_begin(QEMUFile *f);
 int qemu_savevm_state_iterate(QEMUFile *f);
@@ -138,6 +185,8 @@ extern int cursor_hide;
 extern int graphic_rotate;
 extern int no_quit;
 extern int semihosting_enabled;
+extern int mapped_ram;
+extern int mem_merge;
 extern int old_param;
 
 #ifdef CONFIG_KQEMU
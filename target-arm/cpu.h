@@ -62,6 +62,9 @@ struct arm_boot_info;
 
 #define NB_MMU_MODES 2
 
+/* Number of entries of the page table descriptor cache.  */
+#define ARM_DESC_CACHE_SIZE 128
+
 /* We currently assume float and double are IEEE single and double
    precision respectively.
    Doing runtime conversions is tricky because VFP registers may contain
@@ -195,6 +198,17 @@ typedef struct CPUARMState {
         uint32_t cregs[16];
     } iwmmxt;
 
+#if !defined(CONFIG_USER_ONLY)
+    /* Recently used page table descriptors, indexed by their physical
+       address, valid while phys_ram_pgtable_gen[page] == gen.  */
+    struct {
+        uint32_t addr;
+        uint32_t desc;
+        uint32_t page;
+        uint32_t gen;
+    } desc_cache[ARM_DESC_CACHE_SIZE];
+#endif
+
 #if defined(CONFIG_USER_ONLY)
     /* For usermode syscall translation.  */
     int eabi;
@@ -417,6 +431,14 @@ static inline int cpu_mmu_index (CPUState *env)
     return (env->uncached_cpsr & CPSR_M) == ARM_CPU_MODE_USR ? 1 : 0;
 }
 
+/* Identifier of the address space for the softmmu TLB, the ASID.  The
+   permissions of TLB entries also depend on the domain access control
+   register, their domain is kept as their PAGE_TAG().  */
+static inline uint64_t arm_tlb_asid(uint32_t context)
+{
+    return context & 0xff;
+}
+
 static inline int is_cpu_user (CPUState *env)
 {
 #ifdef CONFIG_USER_ONLY
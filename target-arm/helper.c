@@ -173,6 +173,10 @@ void cpu_reset(CPUARMState *env)
 
     id = env->cp15.c0_cpuid;
     memset(env, 0, offsetof(CPUARMState, breakpoints));
+#if !defined(CONFIG_USER_ONLY)
+    /* descriptors are word aligned, this never matches */
+    memset(env->desc_cache, 0xff, sizeof(env->desc_cache));
+#endif
     if (id)
         cpu_reset_model_id(env, id);
 #if defined (CONFIG_USER_ONLY)
@@ -936,6 +940,37 @@ static inline int check_ap(CPUState *env, int ap, int domain, int access_type,
   }
 }
 
+/* Load a page table descriptor. Descriptors in RAM are cached, which
+   saves the physical memory lookup of ldl_phys() on most TLB misses.
+   The pages they come from are write-tracked with PGTABLE_DIRTY_FLAG,
+   like code pages, and an entry is stale as soon as the generation of
+   its page has changed.  */
+static uint32_t arm_ldl_desc(CPUState *env, uint32_t addr)
+{
+    unsigned int i = (addr >> 2) & (ARM_DESC_CACHE_SIZE - 1);
+    ram_addr_t pd, ram_addr;
+    uint32_t desc;
+
+    if (env->desc_cache[i].addr == addr &&
+        env->desc_cache[i].gen == phys_ram_pgtable_gen[env->desc_cache[i].page])
+        return env->desc_cache[i].desc;
+
+    pd = cpu_get_physical_page_desc(addr);
+    if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
+        return ldl_phys(addr);
+
+    ram_addr = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
+    desc = ldl_p(qemu_get_ram_ptr(ram_addr));
+    ram_addr &= TARGET_PAGE_MASK;
+    if (cpu_physical_memory_get_dirty(ram_addr, PGTABLE_DIRTY_FLAG))
+        cpu_physical_memory_reset_dirty_page(ram_addr, PGTABLE_DIRTY_FLAG);
+    env->desc_cache[i].addr = addr;
+    env->desc_cache[i].desc = desc;
+    env->desc_cache[i].page = ram_addr >> TARGET_PAGE_BITS;
+    env->desc_cache[i].gen = phys_ram_pgtable_gen[ram_addr >> TARGET_PAGE_BITS];
+    return desc;
+}
+
 static uint32_t get_level1_table_address(CPUState *env, uint32_t address)
 {
     uint32_t table;
@@ -950,22 +985,24 @@ static uint32_t get_level1_table_address(CPUState *env, uint32_t address)
 }
 
 static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
-			    int is_user, uint32_t *phys_ptr, int *prot)
+			    int is_user, uint32_t *phys_ptr, int *prot,
+                            target_ulong *page_size)
 {
     int code;
     uint32_t table;
     uint32_t desc;
     int type;
     int ap;
-    int domain;
+    int domain, dom;
     uint32_t phys_addr;
 
     /* Pagetable walk.  */
     /* Lookup l1 descriptor.  */
     table = get_level1_table_address(env, address);
-    desc = ldl_phys(table);
+    desc = arm_ldl_desc(env, table);
     type = (desc & 3);
-    domain = (env->cp15.c3 >> ((desc >> 4) & 0x1e)) & 3;
+    dom = (desc >> 5) & 0xf;
+    domain = (env->cp15.c3 >> (dom * 2)) & 3;
     if (type == 0) {
         /* Section translation fault.  */
         code = 5;
@@ -983,6 +1020,7 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
         phys_addr = (desc & 0xfff00000) | (address & 0x000fffff);
         ap = (desc >> 10) & 3;
         code = 13;
+        *page_size = 1024 * 1024;
     } else {
         /* Lookup l2 entry.  */
 	if (type == 1) {
@@ -992,7 +1030,7 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
 	    /* Fine pagetable.  */
 	    table = (desc & 0xfffff000) | ((address >> 8) & 0xffc);
 	}
-        desc = ldl_phys(table);
+        desc = arm_ldl_desc(env, table);
         switch (desc & 3) {
         case 0: /* Page translation fault.  */
             code = 7;
@@ -1000,15 +1038,18 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
         case 1: /* 64k page.  */
             phys_addr = (desc & 0xffff0000) | (address & 0xffff);
             ap = (desc >> (4 + ((address >> 13) & 6))) & 3;
+            *page_size = 0x10000;
             break;
         case 2: /* 4k page.  */
             phys_addr = (desc & 0xfffff000) | (address & 0xfff);
             ap = (desc >> (4 + ((address >> 13) & 6))) & 3;
+            *page_size = 0x1000;
             break;
         case 3: /* 1k page.  */
 	    if (type == 1) {
 		if (arm_feature(env, ARM_FEATURE_XSCALE)) {
 		    phys_addr = (desc & 0xfffff000) | (address & 0xfff);
+		    *page_size = 0x1000;
 		} else {
 		    /* Page translation fault.  */
 		    code = 7;
@@ -1016,6 +1057,7 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
 		}
 	    } else {
 		phys_addr = (desc & 0xfffffc00) | (address & 0x3ff);
+		*page_size = 0x400;
 	    }
             ap = (desc >> 4) & 3;
             break;
@@ -1030,6 +1072,7 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
         /* Access permission fault.  */
         goto do_fault;
     }
+    *prot |= PAGE_TAG(dom);
     *phys_ptr = phys_addr;
     return 0;
 do_fault:
@@ -1037,21 +1080,23 @@ do_fault:
 }
 
 static int get_phys_addr_v6(CPUState *env, uint32_t address, int access_type,
-			    int is_user, uint32_t *phys_ptr, int *prot)
+			    int is_user, uint32_t *phys_ptr, int *prot,
+                            target_ulong *page_size)
 {
     int code;
     uint32_t table;
     uint32_t desc;
     uint32_t xn;
+    uint32_t ng;
     int type;
     int ap;
-    int domain;
+    int domain, dom;
     uint32_t phys_addr;
 
     /* Pagetable walk.  */
     /* Lookup l1 descriptor.  */
     table = get_level1_table_address(env, address);
-    desc = ldl_phys(table);
+    desc = arm_ldl_desc(env, table);
     type = (desc & 3);
     if (type == 0) {
         /* Section translation fault.  */
@@ -1060,12 +1105,12 @@ static int get_phys_addr_v6(CPUState *env, uint32_t address, int access_type,
         goto do_fault;
     } else if (type == 2 && (desc & (1 << 18))) {
         /* Supersection.  */
-        domain = 0;
+        dom = 0;
     } else {
         /* Section or page.  */
-        domain = (desc >> 4) & 0x1e;
+        dom = (desc >> 5) & 0xf;
     }
-    domain = (env->cp15.c3 >> domain) & 3;
+    domain = (env->cp15.c3 >> (dom * 2)) & 3;
     if (domain == 0 || domain == 2) {
         if (type == 2)
             code = 9; /* Section domain fault.  */
@@ -1077,17 +1122,20 @@ static int get_phys_addr_v6(CPUState *env, uint32_t address, int access_type,
         if (desc & (1 << 18)) {
             /* Supersection.  */
             phys_addr = (desc & 0xff000000) | (address & 0x00ffffff);
+            *page_size = 0x1000000;
         } else {
             /* Section.  */
             phys_addr = (desc & 0xfff00000) | (address & 0x000fffff);
+            *page_size = 0x100000;
         }
         ap = ((desc >> 10) & 3) | ((desc >> 13) & 4);
         xn = desc & (1 << 4);
+        ng = desc & (1 << 17);
         code = 13;
     } else {
         /* Lookup l2 entry.  */
         table = (desc & 0xfffffc00) | ((address >> 10) & 0x3fc);
-        desc = ldl_phys(table);
+        desc = arm_ldl_desc(env, table);
         ap = ((desc >> 4) & 3) | ((desc >> 7) & 4);
         switch (desc & 3) {
         case 0: /* Page translation fault.  */
@@ -1096,15 +1144,18 @@ static int get_phys_addr_v6(CPUState *env, uint32_t address, int access_type,
         case 1: /* 64k page.  */
             phys_addr = (desc & 0xffff0000) | (address & 0xffff);
             xn = desc & (1 << 15);
+            *page_size = 0x10000;
             break;
         case 2: case 3: /* 4k page.  */
             phys_addr = (desc & 0xfffff000) | (address & 0xfff);
             xn = desc & 1;
+            *page_size = 0x1000;
             break;
         default:
             /* Never happens, but compiler isn't smart enough to tell.  */
             abort();
         }
+        ng = desc & (1 << 11);
         code = 15;
     }
     if (xn && access_type == 2)
@@ -1121,6 +1172,9 @@ static int get_phys_addr_v6(CPUState *env, uint32_t address, int access_type,
         /* Access permission fault.  */
         goto do_fault;
     }
+    *prot |= PAGE_TAG(dom);
+    if (!ng)
+        *prot |= PAGE_GLOBAL;
     *phys_ptr = phys_addr;
     return 0;
 do_fault:
@@ -1128,13 +1182,15 @@ do_fault:
 }
 
 static int get_phys_addr_mpu(CPUState *env, uint32_t address, int access_type,
-			     int is_user, uint32_t *phys_ptr, int *prot)
+			     int is_user, uint32_t *phys_ptr, int *prot,
+                             target_ulong *page_size)
 {
     int n;
     uint32_t mask;
     uint32_t base;
 
     *phys_ptr = address;
+    *page_size = TARGET_PAGE_SIZE;
     for (n = 7; n >= 0; n--) {
 	base = env->cp15.c6_region[n];
 	if ((base & 1) == 0)
@@ -1186,9 +1242,29 @@ static int get_phys_addr_mpu(CPUState *env, uint32_t address, int access_type,
     return 0;
 }
 
+/* Returns the mask of the domains whose access is reduced when the
+   domain access control register changes from 'old' to 'val'. The TLB
+   entries of the other domains remain valid: those of a domain that
+   gains access are more restrictive than needed, and are refilled on
+   the first access they don't allow.  */
+static unsigned int arm_dacr_narrowed(uint32_t old, uint32_t val)
+{
+    /* no access, client, reserved, manager */
+    static const uint8_t level[4] = { 0, 1, 0, 2 };
+    unsigned int mask = 0;
+    int n;
+
+    for (n = 0; n < 16; n++) {
+        if (level[(val >> (n * 2)) & 3] < level[(old >> (n * 2)) & 3])
+            mask |= 1 << n;
+    }
+    return mask;
+}
+
 static inline int get_phys_addr(CPUState *env, uint32_t address,
                                 int access_type, int is_user,
-                                uint32_t *phys_ptr, int *prot)
+                                uint32_t *phys_ptr, int *prot,
+                                target_ulong *page_size)
 {
     /* Fast Context Switch Extension.  */
     if (address < 0x02000000)
@@ -1198,16 +1274,52 @@ static inline int get_phys_addr(CPUState *env, uint32_t address,
         /* MMU/MPU disabled.  */
         *phys_ptr = address;
         *prot = PAGE_READ | PAGE_WRITE;
+        *page_size = TARGET_PAGE_SIZE;
         return 0;
     } else if (arm_feature(env, ARM_FEATURE_MPU)) {
 	return get_phys_addr_mpu(env, address, access_type, is_user, phys_ptr,
-				 prot);
+				 prot, page_size);
     } else if (env->cp15.c1_sys & (1 << 23)) {
         return get_phys_addr_v6(env, address, access_type, is_user, phys_ptr,
-                                prot);
+                                prot, page_size);
     } else {
         return get_phys_addr_v5(env, address, access_type, is_user, phys_ptr,
-                                prot);
+                                prot, page_size);
+    }
+}
+
+/* On a TLB miss, the entries of the neighbouring pages in the same
+   ARM_TLB_PREFETCH_SIZE block are filled as well. Their descriptors are
+   in the same second level table, or section, and thus usually in the
+   descriptor cache.  */
+#define ARM_TLB_PREFETCH_SIZE 0x4000
+
+static void arm_tlb_prefetch(CPUState *env, uint32_t address, int mmu_idx)
+{
+    uint32_t start = address & ~(ARM_TLB_PREFETCH_SIZE - 1);
+    uint32_t addr, phys_addr;
+    target_ulong page_size;
+    int prot, index;
+    int is_user = mmu_idx == MMU_USER_IDX;
+
+    for (addr = start; addr - start < ARM_TLB_PREFETCH_SIZE;
+         addr += TARGET_PAGE_SIZE) {
+        if (addr == address)
+            continue;
+        /* only fill free entries: the entry may be in use for another
+           page, which is more likely to be accessed again than this one */
+        index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+        if (!(env->tlb_table[mmu_idx][index].addr_read & TLB_INVALID_MASK) ||
+            !(env->tlb_table[mmu_idx][index].addr_write & TLB_INVALID_MASK))
+            continue;
+        /* fill the entry as a read access would, faults are ignored */
+        if (get_phys_addr(env, addr, 0, is_user, &phys_addr, &prot,
+                          &page_size) != 0)
+            continue;
+        if (page_size <= 0x1000)
+            page_size = TARGET_PAGE_SIZE;
+        tlb_set_page(env, addr, phys_addr & ~(uint32_t)0x3ff, prot, mmu_idx,
+                     0, page_size);
     }
 }
 
@@ -1215,17 +1327,27 @@ int cpu_arm_handle_mmu_fault (CPUState *env, target_ulong address,
                               int access_type, int mmu_idx, int is_softmmu)
 {
     uint32_t phys_addr;
+    target_ulong page_size;
     int prot;
     int ret, is_user;
 
     is_user = mmu_idx == MMU_USER_IDX;
-    ret = get_phys_addr(env, address, access_type, is_user, &phys_addr, &prot);
+    ret = get_phys_addr(env, address, access_type, is_user, &phys_addr, &prot,
+                        &page_size);
     if (ret == 0) {
         /* Map a single [sub]page.  */
         phys_addr &= ~(uint32_t)0x3ff;
         address &= ~(uint32_t)0x3ff;
-        return tlb_set_page (env, address, phys_addr, prot, mmu_idx,
-                             is_softmmu);
+        /* TLB maintenance operations by MVA always invalidate a whole
+           4K page, see cp15 register 8 below.  */
+        if (page_size <= 0x1000)
+            page_size = TARGET_PAGE_SIZE;
+        ret = tlb_set_page (env, address, phys_addr, prot, mmu_idx,
+                            is_softmmu, page_size);
+        if (is_softmmu && (env->cp15.c1_sys & 1) &&
+            !arm_feature(env, ARM_FEATURE_MPU))
+            arm_tlb_prefetch(env, address, mmu_idx);
+        return ret;
     }
 
     if (access_type == 2) {
@@ -1245,10 +1367,11 @@ int cpu_arm_handle_mmu_fault (CPUState *env, target_ulong address,
 target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr)
 {
     uint32_t phys_addr;
+    target_ulong page_size;
     int prot;
     int ret;
 
-    ret = get_phys_addr(env, addr, 0, 0, &phys_addr, &prot);
+    ret = get_phys_addr(env, addr, 0, 0, &phys_addr, &prot, &page_size);
 
     if (ret != 0)
         return -1;
@@ -1256,6 +1379,88 @@ target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr)
     return phys_addr;
 }
 
+/* Kernels that do not use WFI wait for work by polling a flag in RAM,
+   e.g. "1: ldr r3, [r2]; tst r3, #1; beq 1b". Such a loop only loads
+   from RAM and sets the condition flags, so nothing changes until an
+   interrupt or a device writes to guest memory. */
+#define ARM_IDLE_LOOP_MAX_INSNS  8
+
+int cpu_is_idle_loop(CPUState *env, TranslationBlock *tb)
+{
+    uint32_t load_addr[ARM_IDLE_LOOP_MAX_INSNS];
+    int load_base[ARM_IDLE_LOOP_MAX_INSNS];
+    int nb_loads = 0, mmu_idx, index, n;
+    uint32_t written = 0, pc, end, insn, offset;
+    target_phys_addr_t code;
+
+    if (tb->idle_loop == TB_IDLE_NONE)
+        return 0;
+    if (env->thumb || tb->page_addr[1] != -1 ||
+        tb->size > ARM_IDLE_LOOP_MAX_INSNS * 4)
+        goto not_idle;
+
+    code = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK) - tb->pc;
+    end = tb->pc + tb->size - 4;
+    for (pc = tb->pc; pc < end; pc += 4) {
+        insn = ldl_phys(code + pc);
+        if ((insn >> 28) == 0xf)
+            goto not_idle;
+        if ((insn & 0x0f300000) == 0x05100000) {
+            /* LDR, LDRB with an immediate offset and no writeback */
+            offset = insn & 0xfff;
+        } else if ((insn & 0x0f700090) == 0x01500090 && (insn & 0x60)) {
+            /* LDRH, LDRSB, LDRSH with an immediate offset */
+            offset = ((insn >> 4) & 0xf0) | (insn & 0xf);
+        } else if ((insn & 0x0d900000) == 0x01100000 &&
+                   (insn & 0x02000090) != 0x00000090) {
+            /* TST, TEQ, CMP, CMN */
+            continue;
+        } else if ((insn & 0x0ffffffe) == 0x0320f000) {
+            /* NOP, YIELD */
+            continue;
+        } else {
+            goto not_idle;
+        }
+        if (((insn >> 12) & 0xf) == 15)
+            goto not_idle;
+        written |= 1 << ((insn >> 12) & 0xf);
+        load_base[nb_loads] = (insn >> 16) & 0xf;
+        load_addr[nb_loads] = (insn & (1 << 23)) ? offset : -offset;
+        if (load_base[nb_loads] == 15)
+            load_addr[nb_loads] += pc + 8;
+        nb_loads++;
+    }
+    /* the loop ends with a branch back to its start */
+    insn = ldl_phys(code + end);
+    if ((insn >> 28) == 0xf || (insn & 0x0f000000) != 0x0a000000 ||
+        end + 8 + ((int32_t)(insn << 8) >> 6) != tb->pc)
+        goto not_idle;
+    for (n = 0; n < nb_loads; n++) {
+        if (written & (1 << load_base[n]))
+            goto not_idle;
+    }
+    tb->idle_loop = TB_IDLE_LOOP;
+
+    /* device registers can change at any time, only accept loads that
+       hit RAM through the TLB */
+    mmu_idx = cpu_mmu_index(env);
+    for (n = 0; n < nb_loads; n++) {
+        uint32_t addr = load_addr[n];
+
+        if (load_base[n] != 15)
+            addr += env->regs[load_base[n]];
+        index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+        if (env->tlb_table[mmu_idx][index].addr_read !=
+            (addr & TARGET_PAGE_MASK))
+            return 0;
+    }
+    return 1;
+
+not_idle:
+    tb->idle_loop = TB_IDLE_NONE;
+    return 0;
+}
+
 /* Not really implemented.  Need to figure out a sane way of doing this.
    Maybe add generic watchpoint support and use that.  */
 
@@ -1414,8 +1619,9 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
         }
         break;
     case 3: /* MMU Domain access control / MPU write buffer control.  */
+        if (env->cp15.c3 != val)
+            tlb_flush_tag(env, arm_dacr_narrowed(env->cp15.c3, val));
         env->cp15.c3 = val;
-        tlb_flush(env, 1); /* Flush TLB as domain not tracked in TLB */
         break;
     case 4: /* Reserved.  */
         goto bad_reg;
@@ -1477,28 +1683,22 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
     case 8: /* MMU TLB control.  */
         switch (op2) {
         case 0: /* Invalidate all.  */
-            tlb_flush(env, 0);
+            tlb_flush(env, 1);
             break;
         case 1: /* Invalidate single TLB entry.  */
-#if 0
-            /* ??? This is wrong for large pages and sections.  */
-            /* As an ugly hack to make linux work we always flush a 4K
-               pages.  */
+        case 3: /* Invalidate single entry on MVA.  */
+            /* Entries are flushed from all address spaces, which is
+               what case 3 does and is harmless for case 1. Pages are
+               cached with a size of at least 4K, larger pages and
+               sections are handled by tlb_flush_page().  */
             val &= 0xfffff000;
             tlb_flush_page(env, val);
             tlb_flush_page(env, val + 0x400);
             tlb_flush_page(env, val + 0x800);
             tlb_flush_page(env, val + 0xc00);
-#else
-            tlb_flush(env, 1);
-#endif
             break;
         case 2: /* Invalidate on ASID.  */
-            tlb_flush(env, val == 0);
-            break;
-        case 3: /* Invalidate single entry on MVA.  */
-            /* ??? This is like case 1, but ignores ASID.  */
-            tlb_flush(env, 1);
+            tlb_flush_asid(env, val & 0xff, 0xff);
             break;
         default:
             goto bad_reg;
@@ -1552,10 +1752,11 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
             env->cp15.c13_fcse = val;
             break;
         case 1:
-            /* This changes the ASID, so do a TLB flush.  */
-            if (env->cp15.c13_context != val
+            /* This changes the ASID. Entries of the previous one are
+               kept aside, and global entries remain valid.  */
+            if ((env->cp15.c13_context ^ val) & 0xff
                 && !arm_feature(env, ARM_FEATURE_MPU))
-              tlb_flush(env, 0);
+              tlb_switch_asid(env, arm_tlb_asid(val), 1);
             env->cp15.c13_context = val;
             break;
         case 2:
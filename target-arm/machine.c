@@ -187,5 +187,7 @@ int cpu_load(QEMUFile *f, void *opaque, int version_id)
         env->v7m.exception = qemu_get_be32(f);
     }
 
+    tlb_flush(env, 1);
+    env->tlb_asid = arm_tlb_asid(env->cp15.c13_context);
     return 0;
 }
@@ -0,0 +1,611 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the ARMv6 page table walker of helper.c, with its descriptor
+ * cache and its TLB prefetch, against a model of the guest mappings, then
+ * measure a guest process that maps memory, touches it and unmaps it
+ * again, like the allocators of Android apps do. the guest kernel is
+ * modelled too: it maps pages on demand in its fault handler and writes
+ * the page tables through its linear mapping, so these writes take the
+ * notdirty path that drops stale cached descriptors. every word of guest
+ * RAM holds its own physical address, so each load checks its
+ * translation. run with 'make check'.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "cpu.h"
+#include "exec-all.h"
+#include "softmmu_defs.h"
+#include "qemu-common.h"
+#include "tcg.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "gdbstub.h"
+#include "gles2emulator_utils.h"
+
+#define RAM_SIZE        (64 << 20)
+
+/* physical memory: first level tables, then second level tables, then
+   4 KB pages */
+#define L1_TABLES_BASE  0x00100000
+#define L2_TABLES_BASE  0x00400000
+#define PAGES_BASE      0x01000000
+#define NB_PAGES        4096
+
+/* the kernel maps all RAM with sections at KERNEL_BASE. the user area
+   straddles a 1 MB boundary, to use two second level tables */
+#define KERNEL_BASE     0xc0000000
+#define USER_BASE       0x400c0000
+#define KVA(pa)         (KERNEL_BASE + (pa))
+
+#define DOMAIN_USER     0
+#define DOMAIN_KERNEL   1
+
+#define MMU_KERNEL_IDX  0
+
+#define MAX_PROCS       2
+#define MAX_USER_PAGES  1024
+#define CHECK_PAGES     64
+
+#define NB_OPS          200000
+
+static uint32_t rand_state = 1;
+static int errors;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/** the rest of the emulator
+ **/
+
+void*  qemu_malloc( size_t  size )                 { return malloc(size); }
+void*  qemu_mallocz( size_t  size )                { return calloc(1, size); }
+void*  qemu_realloc( void*  ptr, size_t  size )    { return realloc(ptr, size); }
+void   qemu_free( void*  ptr )                     { free(ptr); }
+void*  qemu_vmalloc( size_t  size )                { return qemu_memalign(4096, size); }
+
+void*
+qemu_memalign( size_t  alignment, size_t  size )
+{
+    void*  ptr;
+
+    if (posix_memalign(&ptr, alignment, size))
+        abort();
+    return ptr;
+}
+
+ram_addr_t  ram_size = RAM_SIZE;
+int         mem_merge;
+int         memcheck_instrument_mmu;
+int         tb_invalidated_flag;
+int         semihosting_enabled;
+int         tracing;
+uint64_t    sim_time;
+
+int  memcheck_is_checked( target_ulong  addr, uint32_t  size ) { return 0; }
+void memcheck_on_call( target_ulong  pc, target_ulong  ret ) {}
+void memcheck_on_ret( target_ulong  pc ) {}
+void ram_dedup_reset( void ) {}
+
+/* guest RAM. the TLB addends are only 32 bits wide, as
+   TARGET_PHYS_ADDR_BITS is 32, so it must be below 4 GB */
+void gles2emulator_utils_create_sharedmemory_file( struct hostSharedMemoryStruct*  s ) {}
+
+void
+gles2emulator_utils_map_sharedmemory_file( struct hostSharedMemoryStruct*  s )
+{
+    int  flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_32BIT
+    flags |= MAP_32BIT;
+#endif
+    s->actualAddress = mmap(NULL, s->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (s->actualAddress == MAP_FAILED) {
+        fprintf(stderr, "mmu_test: can't map guest RAM\n");
+        exit(1);
+    }
+}
+
+unsigned long code_gen_max_block_size( void ) { return 1024; }
+void cpu_gen_init( void ) {}
+int  cpu_gen_code( CPUState*  env, struct TranslationBlock*  tb,
+                   int*  gen_code_size_ptr ) { abort(); }
+int  cpu_restore_state( struct TranslationBlock*  tb, CPUState*  env,
+                        unsigned long  searched_pc, void*  puc ) { return 0; }
+void cpu_resume_from_signal( CPUState*  env1, void*  puc ) { abort(); }
+void arm_translate_init( void ) {}
+void cpu_dump_state( CPUState*  env, FILE*  f,
+                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...),
+                     int  flags ) {}
+void tcg_dump_info( FILE*  f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...) ) {}
+
+void qemu_init_vcpu( void*  env ) {}
+void qemu_cpu_kick( void*  env ) {}
+int  qemu_cpu_self( void*  env ) { return 1; }
+
+void gdb_register_coprocessor( CPUState*  env,
+                               gdb_reg_cb  get_reg, gdb_reg_cb  set_reg,
+                               int  num_regs, const char*  xml, int  g_pos ) {}
+
+void armv7m_nvic_set_pending( void*  opaque, int  irq ) { abort(); }
+int  armv7m_nvic_acknowledge_irq( void*  opaque ) { abort(); }
+void armv7m_nvic_complete_irq( void*  opaque, int  irq ) { abort(); }
+uint32_t do_arm_semihosting( CPUState*  env ) { abort(); }
+
+void trace_exception( uint32_t  pc ) {}
+void trace_insn_helper( void ) {}
+void trace_bb_helper( uint64_t  bb_num, TranslationBlock*  tb ) {}
+
+int
+register_savevm( const char*  idstr, int  instance_id, int  version_id,
+                 SaveStateHandler*  save_state, LoadStateHandler*  load_state,
+                 void*  opaque )
+{
+    return 0;
+}
+
+void cpu_save( QEMUFile*  f, void*  opaque ) {}
+int  cpu_load( QEMUFile*  f, void*  opaque, int  version_id ) { return 0; }
+void qemu_put_be32( QEMUFile*  f, unsigned int  v ) {}
+unsigned int qemu_get_be32( QEMUFile*  f ) { return 0; }
+
+void helper_set_cp15( CPUState*  env, uint32_t  insn, uint32_t  val );
+
+/* the encoding of MCR p15, 'op1', Rd, 'crn', 'crm', 'op2' */
+#define CP15(crn, op1, crm, op2) \
+    (((crn) << 16) | ((op1) << 21) | (crm) | ((op2) << 5))
+
+#define CP15_TTBR0      CP15(2, 0, 0, 0)
+#define CP15_TLBIALL    CP15(8, 0, 7, 0)
+#define CP15_TLBIMVA    CP15(8, 0, 7, 1)
+#define CP15_TLBIASID   CP15(8, 0, 7, 2)
+#define CP15_CONTEXTIDR CP15(13, 0, 0, 1)
+
+/** the emulated CPU
+ **/
+
+static CPUState*  env;
+static int        use_cache = 1;    /* 0 to measure walks without it */
+static int64_t    num_fills;        /* calls to tlb_fill() */
+static int64_t    num_faults;
+
+/* a guest load, like the generated code: compare the TLB entry inline
+   and take the helper on a mismatch */
+static inline uint32_t
+guest_ldl( target_ulong  addr, int  mmu_idx )
+{
+    int          index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+    CPUTLBEntry* te = &env->tlb_table[mmu_idx][index];
+
+    if (likely((addr & TARGET_PAGE_MASK) == te->addr_code))
+        return *(uint32_t*)(unsigned long)(addr + te->addend);
+    return __ldl_cmmu(addr, mmu_idx);
+}
+
+/* a guest store, like __stl_mmu() of softmmu_template.h. stores to pages
+   that are write-tracked, like those holding cached descriptors, go to
+   the notdirty handlers of exec.c */
+static inline void
+guest_stl( target_ulong  addr, uint32_t  val, int  mmu_idx )
+{
+    int          index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+    CPUTLBEntry* te = &env->tlb_table[mmu_idx][index];
+    target_ulong tlb_addr;
+
+    for (;;) {
+        tlb_addr = te->addr_write;
+        if ((addr & TARGET_PAGE_MASK) ==
+            (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK)))
+            break;
+        if (!tlb_victim_lookup(env, mmu_idx, index, addr,
+                               offsetof(CPUTLBEntry, addr_write)))
+            tlb_fill(addr, 1, mmu_idx, NULL);
+    }
+    if (tlb_addr & ~TARGET_PAGE_MASK) {
+        target_phys_addr_t  physaddr = env->iotlb[mmu_idx][index];
+        int                 io_index;
+
+        io_index = (physaddr >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
+        physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
+        env->mem_io_vaddr = addr;
+        io_mem_write[io_index][2](io_mem_opaque[io_index], physaddr, val);
+    } else {
+        *(uint32_t*)(unsigned long)(addr + te->addend) = val;
+    }
+}
+
+static void
+cp15_write( uint32_t  insn, uint32_t  val )
+{
+    helper_set_cp15(env, insn, val);
+}
+
+/** the guest kernel
+ **/
+
+typedef struct {
+    uint32_t  asid;
+    uint32_t  l1;       /* physical address of the first level table */
+    uint32_t  pages[MAX_USER_PAGES];    /* model: physical page, or 0 */
+} Proc;
+
+static Proc      procs[MAX_PROCS];
+static Proc*     cur_proc;
+static uint32_t  next_l2 = L2_TABLES_BASE;
+
+/* free pages, in FIFO order, so that a page unmapped then mapped again
+   usually gets another physical page, which a stale descriptor would
+   not give */
+static uint32_t  free_pages[NB_PAGES];
+static uint32_t  free_head, free_count;
+
+static uint32_t
+peek_page( void )
+{
+    if (free_count == 0) {
+        fprintf(stderr, "mmu_test: out of guest RAM\n");
+        abort();
+    }
+    return free_pages[free_head % NB_PAGES];
+}
+
+static uint32_t
+alloc_page( void )
+{
+    uint32_t  pa = peek_page();
+
+    free_head++;
+    free_count--;
+    return pa;
+}
+
+static void
+free_page( uint32_t  pa )
+{
+    free_pages[(free_head + free_count++) % NB_PAGES] = pa;
+}
+
+static uint32_t
+user_va( int  page )
+{
+    return USER_BASE + (page << 12);
+}
+
+/* physical address of 'va' in the model of 'p', or -1 */
+static uint32_t
+model_pa( Proc*  p, uint32_t  va )
+{
+    uint32_t  page = (va - USER_BASE) >> 12;
+
+    if (page >= MAX_USER_PAGES || p->pages[page] == 0)
+        return -1;
+    return p->pages[page] | (va & 0xfff);
+}
+
+/* the address of the second level descriptor of 'va' in 'p', through
+   the linear mapping, creating the table if needed */
+static uint32_t
+pte_kva( Proc*  p, uint32_t  va )
+{
+    uint32_t  l1e = KVA(p->l1 + ((va >> 20) << 2));
+    uint32_t  desc = guest_ldl(l1e, MMU_KERNEL_IDX);
+
+    if (desc != ldl_phys(p->l1 + ((va >> 20) << 2)) && errors++ < 10)
+        fprintf(stderr, "mmu_test: kernel loads 0x%08x from 0x%08x\n",
+                desc, l1e);
+    if ((desc & 3) == 0) {
+        desc = next_l2 | (DOMAIN_USER << 5) | 1;
+        next_l2 += 0x400;
+        guest_stl(l1e, desc, MMU_KERNEL_IDX);
+    }
+    return KVA((desc & 0xfffffc00) + (((va >> 12) & 0xff) << 2));
+}
+
+/* the fault handler of the kernel: map a new page at 'va' in the
+   current process. like clear_page(), the page is initialized through
+   the linear mapping of the host kernel, here with its addresses */
+static void
+map_page( uint32_t  va )
+{
+    uint32_t   pa = alloc_page();
+    uint32_t*  words = qemu_get_ram_ptr(pa);
+    int        nn;
+
+    for (nn = 0; nn < 1024; nn++)
+        words[nn] = pa + nn * 4;
+    /* user read/write (AP=3), not global, small page */
+    guest_stl(pte_kva(cur_proc, va), pa | (3 << 4) | (1 << 11) | 2,
+              MMU_KERNEL_IDX);
+    cur_proc->pages[(va - USER_BASE) >> 12] = pa;
+}
+
+/* munmap() of the page at 'va' of 'p' */
+static void
+unmap_page( Proc*  p, uint32_t  va )
+{
+    uint32_t  page = (va - USER_BASE) >> 12;
+
+    guest_stl(pte_kva(p, va), 0, MMU_KERNEL_IDX);
+    cp15_write(CP15_TLBIMVA, va | p->asid);
+    free_page(p->pages[page]);
+    p->pages[page] = 0;
+}
+
+static void
+switch_proc( Proc*  p )
+{
+    cur_proc = p;
+    cp15_write(CP15_TTBR0, p->l1);
+    cp15_write(CP15_CONTEXTIDR, p->asid);
+}
+
+/* forget the cached descriptors of 'addr', for the walks without the
+   cache */
+static void
+forget_descs( uint32_t  addr )
+{
+    uint32_t  table = (env->cp15.c2_base0 & 0xffffc000) |
+                      ((addr >> 18) & 0x3ffc);
+    uint32_t  desc = ldl_p(qemu_get_ram_ptr(table));
+
+    env->desc_cache[(table >> 2) & (ARM_DESC_CACHE_SIZE - 1)].addr = -1;
+    if ((desc & 3) == 1) {
+        table = (desc & 0xfffffc00) | ((addr >> 10) & 0x3fc);
+        env->desc_cache[(table >> 2) & (ARM_DESC_CACHE_SIZE - 1)].addr = -1;
+    }
+}
+
+/* called on a TLB miss, like tlb_fill() of op_helper.c. user faults go
+   to the fault handler of the kernel, and the walk is checked against
+   the model */
+void
+tlb_fill( target_ulong  addr, int  is_write, int  mmu_idx, void*  retaddr )
+{
+    int  ret;
+
+    num_fills++;
+    if (!use_cache)
+        forget_descs(addr);
+    ret = cpu_arm_handle_mmu_fault(env, addr, is_write, mmu_idx, use_cache);
+    if (mmu_idx == MMU_KERNEL_IDX) {
+        if (ret != 0) {
+            fprintf(stderr, "mmu_test: kernel fault at 0x%08x\n", addr);
+            abort();
+        }
+        return;
+    }
+    if (ret == 0) {
+        if (model_pa(cur_proc, addr) == (uint32_t)-1 && errors++ < 10)
+            fprintf(stderr, "mmu_test: 0x%08x of ASID %d is unmapped but "
+                    "was walked\n", addr, cur_proc->asid);
+        return;
+    }
+    num_faults++;
+    if (model_pa(cur_proc, addr) != (uint32_t)-1) {
+        fprintf(stderr, "mmu_test: 0x%08x of ASID %d is mapped but "
+                "faulted\n", addr, cur_proc->asid);
+        fprintf(stderr, "mmu_test: FAILED\n");
+        exit(1);
+    }
+    map_page(addr & ~0xfff);
+    if (cpu_arm_handle_mmu_fault(env, addr, is_write, mmu_idx,
+                                 use_cache) != 0) {
+        fprintf(stderr, "mmu_test: 0x%08x faults after its mapping\n", addr);
+        abort();
+    }
+}
+
+static void
+init_cpu( void )
+{
+    env = cpu_arm_init("cortex-a8");
+    cpu_single_env = env;
+    /* MMU on, with ARMv6 descriptors, and all domains are clients */
+    env->cp15.c1_sys |= 1 | (1 << 23);
+    env->cp15.c3 = 0x55555555;
+}
+
+/* create the processes, whose first level tables map all RAM with
+   sections at KERNEL_BASE, like the linear mapping of Linux */
+static void
+setup_procs( void )
+{
+    uint32_t  pa;
+    int       nn;
+
+    tlb_flush(env, 1);
+    memset(env->desc_cache, 0xff, sizeof(env->desc_cache));
+    next_l2 = L2_TABLES_BASE;
+    memset(qemu_get_ram_ptr(L2_TABLES_BASE), 0, PAGES_BASE - L2_TABLES_BASE);
+    free_head = free_count = 0;
+    for (nn = 0; nn < NB_PAGES; nn++)
+        free_page(PAGES_BASE + nn * 0x1000);
+
+    for (nn = 0; nn < MAX_PROCS; nn++) {
+        Proc*  p = &procs[nn];
+
+        memset(p, 0, sizeof(*p));
+        p->asid = nn + 1;
+        p->l1 = L1_TABLES_BASE + nn * 0x4000;
+        memset(qemu_get_ram_ptr(p->l1), 0, 0x4000);
+        /* kernel read/write (AP=1), global sections */
+        for (pa = 0; pa < RAM_SIZE; pa += 0x100000)
+            stl_phys(p->l1 + (KVA(pa) >> 20) * 4,
+                     pa | (1 << 10) | (DOMAIN_KERNEL << 5) | 2);
+    }
+    switch_proc(&procs[0]);
+}
+
+/* a user load of 'va', checked against the model */
+static void
+check_ldl( uint32_t  va )
+{
+    uint32_t  val = guest_ldl(va, MMU_USER_IDX);
+    uint32_t  pa = model_pa(cur_proc, va);
+
+    if (val != pa && errors++ < 10)
+        fprintf(stderr, "mmu_test: 0x%08x of ASID %d loads 0x%08x instead of "
+                "0x%08x\n", va, cur_proc->asid, val, pa);
+}
+
+/* a user store of 'va', which writes the address it is expected to go
+   to. a store through a stale translation thus breaks the page it goes
+   to, which a later load finds */
+static void
+check_stl( uint32_t  va )
+{
+    uint32_t  pa = model_pa(cur_proc, va);
+
+    if (pa == (uint32_t)-1)
+        pa = peek_page() | (va & 0xfff);
+    guest_stl(va, pa, MMU_USER_IDX);
+}
+
+/* random loads, stores, unmaps and switches of two processes, each
+   load checked against the model */
+static void
+check_model( void )
+{
+    int  op, nn;
+
+    setup_procs();
+
+    for (op = 0; op < NB_OPS && errors < 10; op++) {
+        uint32_t  r = next_rand() % 100;
+        uint32_t  va = user_va(next_rand() % CHECK_PAGES) +
+                       (next_rand() % 1024) * 4;
+        Proc*     p = &procs[next_rand() % MAX_PROCS];
+
+        if (r < 40) {
+            check_ldl(va);
+        } else if (r < 70) {
+            check_stl(va);
+        } else if (r < 85) {
+            if (model_pa(p, va) != (uint32_t)-1)
+                unmap_page(p, va & ~0xfff);
+        } else if (r < 92) {
+            /* unmap and touch again at once, which maps another page at
+               the same descriptor */
+            if (model_pa(cur_proc, va) != (uint32_t)-1)
+                unmap_page(cur_proc, va & ~0xfff);
+            if (r & 1)
+                check_stl(va);
+            check_ldl(va);
+        } else if (r < 97) {
+            switch_proc(p);
+        } else if (r < 99) {
+            /* exit() of a process */
+            for (nn = 0; nn < CHECK_PAGES; nn++) {
+                if (p->pages[nn]) {
+                    guest_stl(pte_kva(p, user_va(nn)), 0, MMU_KERNEL_IDX);
+                    free_page(p->pages[nn]);
+                    p->pages[nn] = 0;
+                }
+            }
+            cp15_write(CP15_TLBIASID, p->asid);
+        } else {
+            cp15_write(CP15_TLBIALL, 0);
+        }
+    }
+}
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* one process maps 'npages' 4 KB pages, touches each of them, which
+   faults, reads each of their 1 KB target pages, then unmaps them.
+   returns the time per page, in seconds, and the fills per page in
+   'fills' */
+static double
+bench_cycle( int  npages, double*  fills )
+{
+    double   t0, t;
+    int64_t  pages = 0;
+    int      nn, off;
+
+    setup_procs();
+    num_fills = 0;
+    t0 = now_secs();
+    do {
+        for (nn = 0; nn < npages; nn++)
+            check_stl(user_va(nn));
+        for (nn = 0; nn < npages; nn++)
+            for (off = 0; off < 0x1000; off += TARGET_PAGE_SIZE)
+                check_ldl(user_va(nn) + off + 4 * (nn & 0xff));
+        for (nn = 0; nn < npages; nn++)
+            unmap_page(cur_proc, user_va(nn));
+        pages += npages;
+    } while ((t = now_secs() - t0) < 0.2);
+
+    *fills = (double)num_fills / pages;
+    return t / pages;
+}
+
+static void
+bench_mmap( int  npages )
+{
+    double  t_cache, t_walk, f_cache, f_walk;
+
+    use_cache = 0;
+    t_walk = bench_cycle(npages, &f_walk);
+    use_cache = 1;
+    t_cache = bench_cycle(npages, &f_cache);
+
+    printf("mmu_test: mmap/touch/munmap of %4d pages: %.0f ns/page, "
+           "%.2f fills/page with the descriptor cache and prefetch, "
+           "%.0f ns/page, %.2f fills/page without\n", npages,
+           t_cache * 1e9, f_cache, t_walk * 1e9, f_walk);
+}
+
+int main(void)
+{
+    ram_addr_t  offset;
+    uint32_t*   words;
+    uint32_t    nn;
+
+    cpu_exec_init_all(0);
+    offset = qemu_ram_alloc(RAM_SIZE);
+    cpu_register_physical_memory(0, RAM_SIZE, offset | IO_MEM_RAM);
+    words = qemu_get_ram_ptr(offset);
+    for (nn = 0; nn < RAM_SIZE / 4; nn++)
+        words[nn] = nn * 4;
+
+    init_cpu();
+    check_model();
+    if (errors > 0) {
+        fprintf(stderr, "mmu_test: FAILED\n");
+        return 1;
+    }
+
+    bench_mmap(16);
+    bench_mmap(64);
+    bench_mmap(256);
+    bench_mmap(1024);
+
+    if (errors > 0) {
+        fprintf(stderr, "mmu_test: FAILED\n");
+        return 1;
+    }
+    printf("mmu_test: OK\n");
+    return 0;
+}
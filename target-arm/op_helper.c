@@ -132,15 +132,26 @@ void tlb_fill (target_ulong addr, int is_write, int mmu_idx, void *retaddr)
 /* copy a string from the simulated virtual space to a buffer in QEMU */
 void vstrcpy(target_ulong ptr, char *buf, int max)
 {
-    int  index;
+    CPUDMA  dma;
+    int     index, len, n, end;
 
     if (buf == NULL) return;
 
-    for (index = 0; index < max; index += 1) {
-        cpu_physical_memory_read(ptr + index, buf + index, 1);
-        if (buf[index] == 0)
+    /* 'ptr' is a guest physical address */
+    len = cpu_dma_map_phys(&dma, ptr, max);
+    for (index = 0; index < len; index = end) {
+        n = len - index;
+        if (n > 64)
+            n = 64;
+        cpu_dma_rw(&dma, index, (uint8_t *)buf + index, n, 0);
+        for (end = index + n; index < end; index += 1) {
+            if (buf[index] == 0)
+                break;
+        }
+        if (index < end)
             break;
     }
+    cpu_dma_unmap(&dma);
 }
 #endif
 
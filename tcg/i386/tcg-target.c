@@ -486,16 +486,15 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_modrm(s, 0x81, 4, r0); /* andl $x, r0 */
     tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
     
-    tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
-    tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
+    /* andl tlb_mask(%ebp), r1 */
+    tcg_out_modrm_offset(s, 0x23, r1, TCG_AREG0, offsetof(CPUState, tlb_mask));
 
-    tcg_out_opc(s, 0x8d); /* lea offset(r1, %ebp), r1 */
-    tcg_out8(s, 0x80 | (r1 << 3) | 0x04);
-    tcg_out8(s, (5 << 3) | r1);
-    tcg_out32(s, offsetof(CPUState, tlb_table[mem_index][0].addr_read));
+    /* addl tlb_table[mem_index](%ebp), r1 */
+    tcg_out_modrm_offset(s, 0x03, r1, TCG_AREG0,
+                         offsetof(CPUState, tlb_table[mem_index]));
 
-    /* cmp 0(r1), r0 */
-    tcg_out_modrm_offset(s, 0x3b, r0, r1, 0);
+    /* cmp addr_read(r1), r0 */
+    tcg_out_modrm_offset(s, 0x3b, r0, r1, offsetof(CPUTLBEntry, addr_read));
     
     tcg_out_mov(s, r0, addr_reg);
     
@@ -510,8 +509,9 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     label3_ptr = s->code_ptr;
     s->code_ptr++;
     
-    /* cmp 4(r1), addr_reg2 */
-    tcg_out_modrm_offset(s, 0x3b, addr_reg2, r1, 4);
+    /* cmp addr_read+4(r1), addr_reg2 */
+    tcg_out_modrm_offset(s, 0x3b, addr_reg2, r1,
+                         offsetof(CPUTLBEntry, addr_read) + 4);
 
     /* je label1 */
     tcg_out8(s, 0x70 + JCC_JE);
@@ -574,8 +574,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     *label1_ptr = s->code_ptr - label1_ptr - 1;
 
     /* add x(r1), r0 */
-    tcg_out_modrm_offset(s, 0x03, r0, r1, offsetof(CPUTLBEntry, addend) - 
-                         offsetof(CPUTLBEntry, addr_read));
+    tcg_out_modrm_offset(s, 0x03, r0, r1, offsetof(CPUTLBEntry, addend));
 #else
     r0 = addr_reg;
 #endif
@@ -698,16 +697,15 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_modrm(s, 0x81, 4, r0); /* andl $x, r0 */
     tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
     
-    tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
-    tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
+    /* andl tlb_mask(%ebp), r1 */
+    tcg_out_modrm_offset(s, 0x23, r1, TCG_AREG0, offsetof(CPUState, tlb_mask));
 
-    tcg_out_opc(s, 0x8d); /* lea offset(r1, %ebp), r1 */
-    tcg_out8(s, 0x80 | (r1 << 3) | 0x04);
-    tcg_out8(s, (5 << 3) | r1);
-    tcg_out32(s, offsetof(CPUState, tlb_table[mem_index][0].addr_write));
+    /* addl tlb_table[mem_index](%ebp), r1 */
+    tcg_out_modrm_offset(s, 0x03, r1, TCG_AREG0,
+                         offsetof(CPUState, tlb_table[mem_index]));
 
-    /* cmp 0(r1), r0 */
-    tcg_out_modrm_offset(s, 0x3b, r0, r1, 0);
+    /* cmp addr_write(r1), r0 */
+    tcg_out_modrm_offset(s, 0x3b, r0, r1, offsetof(CPUTLBEntry, addr_write));
     
     tcg_out_mov(s, r0, addr_reg);
     
@@ -722,8 +720,9 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     label3_ptr = s->code_ptr;
     s->code_ptr++;
     
-    /* cmp 4(r1), addr_reg2 */
-    tcg_out_modrm_offset(s, 0x3b, addr_reg2, r1, 4);
+    /* cmp addr_write+4(r1), addr_reg2 */
+    tcg_out_modrm_offset(s, 0x3b, addr_reg2, r1,
+                         offsetof(CPUTLBEntry, addr_write) + 4);
 
     /* je label1 */
     tcg_out8(s, 0x70 + JCC_JE);
@@ -808,8 +807,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     *label1_ptr = s->code_ptr - label1_ptr - 1;
 
     /* add x(r1), r0 */
-    tcg_out_modrm_offset(s, 0x03, r0, r1, offsetof(CPUTLBEntry, addend) - 
-                         offsetof(CPUTLBEntry, addr_write));
+    tcg_out_modrm_offset(s, 0x03, r0, r1, offsetof(CPUTLBEntry, addend));
 #else
     r0 = addr_reg;
 #endif
@@ -315,45 +315,6 @@ static inline void tcg_out_modrm_offset(TCGContext *s, int opc, int r, int rm,
     }
 }
 
-#if defined(CONFIG_SOFTMMU)
-/* XXX: incomplete. index must be different from ESP */
-static void tcg_out_modrm_offset2(TCGContext *s, int opc, int r, int rm, 
-                                  int index, int shift,
-                                  tcg_target_long offset)
-{
-    int mod;
-    if (rm == -1)
-        tcg_abort();
-    if (offset == 0 && (rm & 7) != TCG_REG_RBP) {
-        mod = 0;
-    } else if (offset == (int8_t)offset) {
-        mod = 0x40;
-    } else if (offset == (int32_t)offset) {
-        mod = 0x80;
-    } else {
-        tcg_abort();
-    }
-    if (index == -1) {
-        tcg_out_opc(s, opc, r, rm, 0);
-        if ((rm & 7) == TCG_REG_RSP) {
-            tcg_out8(s, mod | ((r & 7) << 3) | 0x04);
-            tcg_out8(s, 0x04 | (rm & 7));
-        } else {
-            tcg_out8(s, mod | ((r & 7) << 3) | (rm & 7));
-        }
-    } else {
-        tcg_out_opc(s, opc, r, rm, index);
-        tcg_out8(s, mod | ((r & 7) << 3) | 0x04);
-        tcg_out8(s, (shift << 6) | ((index & 7) << 3) | (rm & 7));
-    }
-    if (mod == 0x40) {
-        tcg_out8(s, offset);
-    } else if (mod == 0x80) {
-        tcg_out32(s, offset);
-    }
-}
-#endif
-
 static inline void tcg_out_mov(TCGContext *s, int ret, int arg)
 {
     tcg_out_modrm(s, 0x8b | P_REXW, ret, arg);
@@ -589,15 +550,16 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_modrm(s, 0x81 | rexw, 4, r0); /* andl $x, r0 */
     tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
     
-    tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
-    tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
+    /* andl tlb_mask(env), r1 */
+    tcg_out_modrm_offset(s, 0x23, r1, TCG_AREG0, offsetof(CPUState, tlb_mask));
 
-    /* lea offset(r1, env), r1 */
-    tcg_out_modrm_offset2(s, 0x8d | P_REXW, r1, r1, TCG_AREG0, 0,
-                          offsetof(CPUState, tlb_table[mem_index][0].addr_read));
+    /* addq tlb_table[mem_index](env), r1 */
+    tcg_out_modrm_offset(s, 0x03 | P_REXW, r1, TCG_AREG0,
+                         offsetof(CPUState, tlb_table[mem_index]));
 
-    /* cmp 0(r1), r0 */
-    tcg_out_modrm_offset(s, 0x3b | rexw, r0, r1, 0);
+    /* cmp addr_read(r1), r0 */
+    tcg_out_modrm_offset(s, 0x3b | rexw, r0, r1,
+                         offsetof(CPUTLBEntry, addr_read));
     
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
@@ -651,8 +613,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     *label1_ptr = s->code_ptr - label1_ptr - 1;
 
     /* add x(r1), r0 */
-    tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1, offsetof(CPUTLBEntry, addend) - 
-                         offsetof(CPUTLBEntry, addr_read));
+    tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1,
+                         offsetof(CPUTLBEntry, addend));
     offset = 0;
 #else
     if (GUEST_BASE == (int32_t)GUEST_BASE) {
@@ -784,15 +746,16 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_modrm(s, 0x81 | rexw, 4, r0); /* andl $x, r0 */
     tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
     
-    tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
-    tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
+    /* andl tlb_mask(env), r1 */
+    tcg_out_modrm_offset(s, 0x23, r1, TCG_AREG0, offsetof(CPUState, tlb_mask));
 
-    /* lea offset(r1, env), r1 */
-    tcg_out_modrm_offset2(s, 0x8d | P_REXW, r1, r1, TCG_AREG0, 0,
-                          offsetof(CPUState, tlb_table[mem_index][0].addr_write));
+    /* addq tlb_table[mem_index](env), r1 */
+    tcg_out_modrm_offset(s, 0x03 | P_REXW, r1, TCG_AREG0,
+                         offsetof(CPUState, tlb_table[mem_index]));
 
-    /* cmp 0(r1), r0 */
-    tcg_out_modrm_offset(s, 0x3b | rexw, r0, r1, 0);
+    /* cmp addr_write(r1), r0 */
+    tcg_out_modrm_offset(s, 0x3b | rexw, r0, r1,
+                         offsetof(CPUTLBEntry, addr_write));
     
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
@@ -833,8 +796,8 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     *label1_ptr = s->code_ptr - label1_ptr - 1;
 
     /* add x(r1), r0 */
-    tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1, offsetof(CPUTLBEntry, addend) - 
-                         offsetof(CPUTLBEntry, addr_write));
+    tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1,
+                         offsetof(CPUTLBEntry, addend));
     offset = 0;
 #else
     if (GUEST_BASE == (int32_t)GUEST_BASE) {
@@ -0,0 +1,286 @@
+/*
+ * Simple pool of worker threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "thread-pool.h"
+
+#ifdef __linux__
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef CONFIG_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#include "qemu-thread.h"
+
+#define THREAD_POOL_MAX_THREADS  16
+
+struct ThreadPool {
+    QemuMutex lock;
+    QemuCond job_cond;      /* signalled when a job is queued, or on exit */
+    QemuCond done_cond;     /* signalled when a job completes */
+    ThreadPoolJob *head;    /* queued jobs, in submission order */
+    ThreadPoolJob **ptail;
+    int pending;            /* queued or running jobs */
+    int exiting;
+    int notify_rfd;         /* -1 unless thread_pool_get_notify_fd() was called */
+    int notify_wfd;
+    ThreadPoolJob *completed; /* most recently completed first */
+    int nthreads;
+    QemuThread threads[THREAD_POOL_MAX_THREADS];
+};
+
+static void thread_pool_notify(ThreadPool *pool)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(pool->notify_wfd, &value, sizeof(value));
+    } while (ret < 0 && errno == EINTR);
+}
+
+static void *thread_pool_worker(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    sigset_t set;
+
+    /* leave all signals (timers, SIGIO) to the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        ThreadPoolJob *job;
+
+        while (pool->head == NULL && !pool->exiting)
+            qemu_cond_wait(&pool->job_cond, &pool->lock);
+
+        job = pool->head;
+        if (job == NULL)
+            break;
+
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->ptail = &pool->head;
+        qemu_mutex_unlock(&pool->lock);
+
+        job->func(job->opaque);
+
+        qemu_mutex_lock(&pool->lock);
+        job->done = 1;
+        pool->pending--;
+        if (pool->notify_wfd >= 0) {
+            /* only wake up the reader if the list was empty */
+            if (pool->completed == NULL)
+                thread_pool_notify(pool);
+            job->next = pool->completed;
+            pool->completed = job;
+        }
+        qemu_cond_broadcast(&pool->done_cond);
+    }
+    qemu_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool *thread_pool_new(int nthreads)
+{
+    ThreadPool *pool = qemu_mallocz(sizeof(*pool));
+    int i;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+    if (nthreads > THREAD_POOL_MAX_THREADS)
+        nthreads = THREAD_POOL_MAX_THREADS;
+
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->job_cond);
+    qemu_cond_init(&pool->done_cond);
+    pool->ptail = &pool->head;
+    pool->nthreads = nthreads;
+    pool->notify_rfd = pool->notify_wfd = -1;
+
+    for (i = 0; i < nthreads; i++)
+        qemu_thread_create(&pool->threads[i], thread_pool_worker, pool);
+
+    return pool;
+}
+
+void thread_pool_free(ThreadPool *pool)
+{
+    int i;
+
+    thread_pool_wait_all(pool);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->exiting = 1;
+    qemu_cond_broadcast(&pool->job_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i].thread, NULL);
+
+    if (pool->notify_rfd >= 0) {
+        close(pool->notify_rfd);
+        if (pool->notify_wfd != pool->notify_rfd)
+            close(pool->notify_wfd);
+    }
+    qemu_free(pool);
+}
+
+int thread_pool_get_size(ThreadPool *pool)
+{
+    return pool->nthreads;
+}
+
+void thread_pool_submit(ThreadPool *pool, ThreadPoolJob *job,
+                        ThreadPoolFunc *func, void *opaque)
+{
+    job->func = func;
+    job->opaque = opaque;
+    job->done = 0;
+    job->next = NULL;
+
+    qemu_mutex_lock(&pool->lock);
+    *pool->ptail = job;
+    pool->ptail = &job->next;
+    pool->pending++;
+    qemu_cond_signal(&pool->job_cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait_job(ThreadPool *pool, ThreadPoolJob *job)
+{
+    qemu_mutex_lock(&pool->lock);
+    while (!job->done)
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait_all(ThreadPool *pool)
+{
+    qemu_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+int thread_pool_get_notify_fd(ThreadPool *pool)
+{
+    int fds[2];
+
+    if (pool->notify_rfd >= 0)
+        return pool->notify_rfd;
+
+#ifdef CONFIG_EVENTFD
+    fds[0] = fds[1] = eventfd(0, 0);
+    if (fds[0] < 0)
+#endif
+    if (pipe(fds) < 0)
+        return -1;
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->notify_rfd = fds[0];
+    pool->notify_wfd = fds[1];
+    qemu_mutex_unlock(&pool->lock);
+    return fds[0];
+}
+
+ThreadPoolJob *thread_pool_get_completed(ThreadPool *pool)
+{
+    ThreadPoolJob *job, *next, *list = NULL;
+    uint64_t value;
+
+    /* drain the descriptor before taking the list, so that no wakeup is
+       lost for jobs completing after that */
+    for (;;) {
+        ssize_t len = read(pool->notify_rfd, &value, sizeof(value));
+        if (len > 0 || (len < 0 && errno == EINTR))
+            continue;
+        break;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    job = pool->completed;
+    pool->completed = NULL;
+    qemu_mutex_unlock(&pool->lock);
+
+    /* reverse the list */
+    for (; job != NULL; job = next) {
+        next = job->next;
+        job->next = list;
+        list = job;
+    }
+    return list;
+}
+
+#else /* !__linux__ */
+
+/* no worker threads, run jobs synchronously */
+
+struct ThreadPool {
+    ThreadPoolJob *completed;
+    ThreadPoolJob **ptail;
+};
+
+ThreadPool *thread_pool_new(int nthreads)
+{
+    ThreadPool *pool = qemu_mallocz(sizeof(ThreadPool));
+
+    pool->ptail = &pool->completed;
+    return pool;
+}
+
+void thread_pool_free(ThreadPool *pool)
+{
+    qemu_free(pool);
+}
+
+int thread_pool_get_size(ThreadPool *pool)
+{
+    return 1;
+}
+
+void thread_pool_submit(ThreadPool *pool, ThreadPoolJob *job,
+                        ThreadPoolFunc *func, void *opaque)
+{
+    job->func = func;
+    job->opaque = opaque;
+    job->next = NULL;
+    func(opaque);
+    job->done = 1;
+    *pool->ptail = job;
+    pool->ptail = &job->next;
+}
+
+void thread_pool_wait_job(ThreadPool *pool, ThreadPoolJob *job)
+{
+}
+
+void thread_pool_wait_all(ThreadPool *pool)
+{
+}
+
+int thread_pool_get_notify_fd(ThreadPool *pool)
+{
+    return -1;
+}
+
+ThreadPoolJob *thread_pool_get_completed(ThreadPool *pool)
+{
+    ThreadPoolJob *list = pool->completed;
+
+    pool->completed = NULL;
+    pool->ptail = &pool->completed;
+    return list;
+}
+
+#endif /* !__linux__ */
@@ -0,0 +1,63 @@
+/*
+ * Simple pool of worker threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_THREAD_POOL_H
+#define QEMU_THREAD_POOL_H
+
+/* A ThreadPool runs CPU-bound jobs (e.g. compression) on a fixed set of
+ * worker threads. Jobs are described by a ThreadPoolJob that the caller
+ * allocates and must keep alive until it has completed. Workers must not
+ * call back into the rest of the emulator, which is not thread-safe.
+ *
+ * On hosts without thread support, jobs run synchronously from
+ * thread_pool_submit(), so callers need no special casing.
+ */
+typedef struct ThreadPool ThreadPool;
+typedef struct ThreadPoolJob ThreadPoolJob;
+
+typedef void ThreadPoolFunc(void *opaque);
+
+struct ThreadPoolJob {
+    ThreadPoolFunc *func;
+    void *opaque;
+    int done;
+    ThreadPoolJob *next;
+};
+
+/* create a pool of 'nthreads' workers, or one per host CPU if 'nthreads'
+   is 0 or less */
+ThreadPool *thread_pool_new(int nthreads);
+
+/* wait for all pending jobs, then stop the workers and free the pool */
+void thread_pool_free(ThreadPool *pool);
+
+/* return the number of worker threads, or 1 if jobs run synchronously */
+int thread_pool_get_size(ThreadPool *pool);
+
+/* queue 'job' to run func(opaque) on a worker thread */
+void thread_pool_submit(ThreadPool *pool, ThreadPoolJob *job,
+                        ThreadPoolFunc *func, void *opaque);
+
+/* wait until 'job' has completed */
+void thread_pool_wait_job(ThreadPool *pool, ThreadPoolJob *job);
+
+/* wait until all submitted jobs have completed */
+void thread_pool_wait_all(ThreadPool *pool);
+
+/* Ask the pool to report completed jobs through thread_pool_get_completed(),
+ * and return a file descriptor that becomes readable when there are some,
+ * e.g. for qemu_aio_set_fd_handler(). Returns -1 if jobs run synchronously,
+ * in which case thread_pool_get_completed() must be called after each
+ * thread_pool_submit().
+ */
+int thread_pool_get_notify_fd(ThreadPool *pool);
+
+/* Return the jobs completed since the last call, in completion order and
+ * linked through their 'next' field. The pool no longer accesses them, so
+ * they can be freed. */
+ThreadPoolJob *thread_pool_get_completed(ThreadPool *pool);
+
+#endif /* QEMU_THREAD_POOL_H */
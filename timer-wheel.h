@@ -0,0 +1,183 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* a two-level timing wheel, used by shaper.c to track the expiration
+ * dates of delayed packets. level 0 has one slot per clock tick for the
+ * next WHEEL0_SIZE ticks, level 1 has one slot per WHEEL0_SIZE ticks for
+ * the next WHEEL1_SIZE of those, and anything further away goes to an
+ * overflow list. entries move down one level when the wheel reaches
+ * their slot, so adding, removing and expiring an entry costs O(1),
+ * whatever the number of pending entries.
+ */
+#define  WHEEL0_BITS   8
+#define  WHEEL1_BITS   6
+#define  WHEEL0_SIZE   (1 << WHEEL0_BITS)
+#define  WHEEL1_SIZE   (1 << WHEEL1_BITS)
+#define  WHEEL0_MASK   (WHEEL0_SIZE - 1)
+#define  WHEEL1_MASK   (WHEEL1_SIZE - 1)
+
+typedef struct WheelEntryRec_ {
+    struct WheelEntryRec_*   next;
+    struct WheelEntryRec_**  pprev;
+    int64_t                  expiration;
+} WheelEntryRec, *WheelEntry;
+
+typedef struct TimerWheelRec_ {
+    int64_t     current;   /* entries expiring before this tick were reported */
+    int         count;
+    WheelEntry  level0[WHEEL0_SIZE];
+    WheelEntry  level1[WHEEL1_SIZE];
+    WheelEntry  overflow;
+} TimerWheelRec, *TimerWheel;
+
+
+static void
+wheel_entry_link( WheelEntry*  plist, WheelEntry  entry )
+{
+    entry->next  = *plist;
+    entry->pprev = plist;
+    if (entry->next)
+        entry->next->pprev = &entry->next;
+    *plist = entry;
+}
+
+static void
+wheel_entry_unlink( WheelEntry  entry )
+{
+    if (entry->pprev) {
+        *entry->pprev = entry->next;
+        if (entry->next)
+            entry->next->pprev = entry->pprev;
+        entry->next  = NULL;
+        entry->pprev = NULL;
+    }
+}
+
+static void
+timer_wheel_init( TimerWheel  wheel, int64_t  now )
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current = now;
+}
+
+/* put an entry in the slot matching its expiration date */
+static void
+timer_wheel_place( TimerWheel  wheel, WheelEntry  entry )
+{
+    int64_t  expiration = entry->expiration;
+    int64_t  delta;
+
+    if (expiration < wheel->current)
+        expiration = wheel->current;
+
+    delta = expiration - wheel->current;
+    if (delta < WHEEL0_SIZE)
+        wheel_entry_link(&wheel->level0[expiration & WHEEL0_MASK], entry);
+    else if (delta < WHEEL0_SIZE*WHEEL1_SIZE)
+        wheel_entry_link(&wheel->level1[(expiration >> WHEEL0_BITS) & WHEEL1_MASK], entry);
+    else
+        wheel_entry_link(&wheel->overflow, entry);
+}
+
+static void
+timer_wheel_add( TimerWheel  wheel, WheelEntry  entry, int64_t  now )
+{
+    /* don't make the next expiration walk through a long idle period */
+    if (wheel->count == 0 && wheel->current < now)
+        wheel->current = now;
+
+    timer_wheel_place(wheel, entry);
+    wheel->count += 1;
+}
+
+static void
+timer_wheel_remove( TimerWheel  wheel, WheelEntry  entry )
+{
+    wheel_entry_unlink(entry);
+    wheel->count -= 1;
+}
+
+/* move all entries of a higher-level slot to their new place */
+static void
+timer_wheel_cascade( TimerWheel  wheel, WheelEntry*  plist )
+{
+    WheelEntry  list = *plist;
+
+    *plist = NULL;
+    while (list != NULL) {
+        WheelEntry  entry = list;
+        list = entry->next;
+        timer_wheel_place(wheel, entry);
+    }
+}
+
+/* move all entries that expire at or before 'now' to the '*pexpired' list */
+static void
+timer_wheel_expire( TimerWheel  wheel, int64_t  now, WheelEntry*  pexpired )
+{
+    while (wheel->current <= now) {
+        int  index = (int)(wheel->current & WHEEL0_MASK);
+
+        if (wheel->count == 0) {
+            wheel->current = now + 1;
+            break;
+        }
+
+        if (index == 0) {
+            int  index1 = (int)((wheel->current >> WHEEL0_BITS) & WHEEL1_MASK);
+
+            if (index1 == 0)
+                timer_wheel_cascade(wheel, &wheel->overflow);
+
+            timer_wheel_cascade(wheel, &wheel->level1[index1]);
+        }
+
+        while (wheel->level0[index] != NULL) {
+            WheelEntry  entry = wheel->level0[index];
+
+            timer_wheel_remove(wheel, entry);
+            wheel_entry_link(pexpired, entry);
+        }
+        wheel->current += 1;
+    }
+}
+
+/* return the next tick at which timer_wheel_expire() must be called,
+ * or -1 if the wheel is empty */
+static int64_t
+timer_wheel_next( TimerWheel  wheel )
+{
+    int  nn;
+
+    if (wheel->count == 0)
+        return -1;
+
+    for (nn = 0; nn < WHEEL0_SIZE; nn++) {
+        int64_t  tick = wheel->current + nn;
+
+        /* higher-level slots must be cascaded at level 0 boundaries */
+        if ((tick & WHEEL0_MASK) == 0)
+            return tick;
+
+        if (wheel->level0[tick & WHEEL0_MASK] != NULL)
+            return tick;
+    }
+    return wheel->current + WHEEL0_SIZE;
+}
+
+#endif /* _TIMER_WHEEL_H_ */
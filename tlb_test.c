@@ -0,0 +1,635 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* check the softmmu TLB of exec.c against a walk of guest page tables,
+ * for each TLB size and with its victim TLB, then measure the page table
+ * walks and the time per access of guest processes that are switched in
+ * turn, and of working sets of increasing size. the accesses take the path of
+ * the generated code: the TLB entry is compared inline, and misses go
+ * to the helpers of exec.c, which call tlb_fill() below. it walks ARMv6
+ * short descriptor tables in guest RAM, like get_phys_addr_v6(). every
+ * word of guest RAM holds its own physical address, so each load checks
+ * its translation. run with 'make check'.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "cpu.h"
+#include "exec-all.h"
+#include "softmmu_defs.h"
+#include "qemu-common.h"
+#include "tcg.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "gles2emulator_utils.h"
+
+#define RAM_SIZE        (64 << 20)
+
+/* physical memory: first level tables, then second level tables, then
+   4 KB pages */
+#define L1_TABLES_BASE  0x00100000
+#define L2_TABLES_BASE  0x00400000
+#define PAGES_BASE      0x01000000
+
+#define KERNEL_BASE     0xc0000000
+#define USER_BASE       0x00008000
+
+#define DOMAIN_USER     0
+#define DOMAIN_KERNEL   1
+
+#define MAX_PROCS       32
+
+#define NB_OPS          200000
+
+static uint32_t rand_state = 1;
+static int errors;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/** the rest of the emulator
+ **/
+
+void*  qemu_malloc( size_t  size )                 { return malloc(size); }
+void*  qemu_mallocz( size_t  size )                { return calloc(1, size); }
+void*  qemu_realloc( void*  ptr, size_t  size )    { return realloc(ptr, size); }
+void   qemu_free( void*  ptr )                     { free(ptr); }
+void*  qemu_vmalloc( size_t  size )                { return qemu_memalign(4096, size); }
+
+void*
+qemu_memalign( size_t  alignment, size_t  size )
+{
+    void*  ptr;
+
+    if (posix_memalign(&ptr, alignment, size))
+        abort();
+    return ptr;
+}
+
+ram_addr_t  ram_size = RAM_SIZE;
+int         mem_merge;
+int         memcheck_instrument_mmu;
+int         tb_invalidated_flag;
+
+int  memcheck_is_checked( target_ulong  addr, uint32_t  size ) { return 0; }
+void ram_dedup_reset( void ) {}
+
+/* guest RAM. the TLB addends are only 32 bits wide, as
+   TARGET_PHYS_ADDR_BITS is 32, so it must be below 4 GB */
+void gles2emulator_utils_create_sharedmemory_file( struct hostSharedMemoryStruct*  s ) {}
+
+void
+gles2emulator_utils_map_sharedmemory_file( struct hostSharedMemoryStruct*  s )
+{
+    int  flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_32BIT
+    flags |= MAP_32BIT;
+#endif
+    s->actualAddress = mmap(NULL, s->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (s->actualAddress == MAP_FAILED) {
+        fprintf(stderr, "tlb_test: can't map guest RAM\n");
+        exit(1);
+    }
+}
+
+unsigned long code_gen_max_block_size( void ) { return 1024; }
+void cpu_gen_init( void ) {}
+int  cpu_gen_code( CPUState*  env, struct TranslationBlock*  tb,
+                   int*  gen_code_size_ptr ) { abort(); }
+int  cpu_restore_state( struct TranslationBlock*  tb, CPUState*  env,
+                        unsigned long  searched_pc, void*  puc ) { return 0; }
+void cpu_resume_from_signal( CPUState*  env1, void*  puc ) { abort(); }
+CPUARMState*  cpu_arm_init( const char*  cpu_model ) { abort(); }
+void cpu_dump_state( CPUState*  env, FILE*  f,
+                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...),
+                     int  flags ) {}
+target_phys_addr_t  cpu_get_phys_page_debug( CPUState*  env, target_ulong  addr ) { return -1; }
+void tcg_dump_info( FILE*  f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...) ) {}
+
+void qemu_cpu_kick( void*  env ) {}
+int  qemu_cpu_self( void*  env ) { return 1; }
+
+int
+register_savevm( const char*  idstr, int  instance_id, int  version_id,
+                 SaveStateHandler*  save_state, LoadStateHandler*  load_state,
+                 void*  opaque )
+{
+    return 0;
+}
+
+void cpu_save( QEMUFile*  f, void*  opaque ) {}
+int  cpu_load( QEMUFile*  f, void*  opaque, int  version_id ) { return 0; }
+void qemu_put_be32( QEMUFile*  f, unsigned int  v ) {}
+unsigned int qemu_get_be32( QEMUFile*  f ) { return 0; }
+
+/** guest page tables
+ **/
+
+typedef struct {
+    uint32_t  asid;
+    uint32_t  l1;       /* physical address of the first level table */
+} Proc;
+
+static Proc      procs[MAX_PROCS];
+static uint32_t  kernel_l1;
+static uint32_t  next_l1 = L1_TABLES_BASE;
+static uint32_t  next_l2 = L2_TABLES_BASE;
+static uint32_t  next_page = PAGES_BASE;
+
+static uint32_t  cur_l1;            /* the TTBR */
+static int64_t   num_walks;         /* calls to tlb_fill() */
+
+static uint32_t
+alloc_l1( void )
+{
+    uint32_t  l1 = next_l1;
+
+    next_l1 += 0x4000;
+    return l1;
+}
+
+static uint32_t
+alloc_page( void )
+{
+    uint32_t  pa = next_page;
+
+    next_page += 0x1000;
+    if (next_page > RAM_SIZE) {
+        fprintf(stderr, "tlb_test: out of guest RAM\n");
+        abort();
+    }
+    return pa;
+}
+
+/* map the 4 KB page at 'va' to 'pa' in the tables of 'l1' */
+static void
+map_page( uint32_t  l1, uint32_t  va, uint32_t  pa, int  global, int  domain )
+{
+    uint32_t  l1_desc = ldl_phys(l1 + ((va >> 20) << 2));
+    uint32_t  l2;
+
+    if ((l1_desc & 3) == 0) {
+        l2 = next_l2;
+        next_l2 += 0x400;
+        l1_desc = l2 | (domain << 5) | 1;
+        stl_phys(l1 + ((va >> 20) << 2), l1_desc);
+    }
+    l2 = l1_desc & 0xfffffc00;
+    stl_phys(l2 + (((va >> 12) & 0xff) << 2),
+             pa | (global ? 0 : (1 << 11)) | 2);
+}
+
+/* walk the tables of 'l1' for 'va', return the physical address, or -1
+   if it is not mapped */
+static uint32_t
+walk( uint32_t  l1, uint32_t  va, int*  prot )
+{
+    uint32_t  desc = ldl_phys(l1 + ((va >> 20) << 2));
+    int       domain = (desc >> 5) & 0xf;
+
+    if ((desc & 3) != 1)
+        return -1;
+    desc = ldl_phys((desc & 0xfffffc00) + (((va >> 12) & 0xff) << 2));
+    if ((desc & 3) == 0)
+        return -1;
+    *prot = PAGE_READ | PAGE_WRITE | PAGE_TAG(domain);
+    if (!(desc & (1 << 11)))
+        *prot |= PAGE_GLOBAL;
+    return (desc & 0xfffff000) | (va & 0xfff);
+}
+
+void
+tlb_fill( target_ulong  addr, int  is_write, int  mmu_idx, void*  retaddr )
+{
+    uint32_t  pa;
+    int       prot;
+
+    num_walks++;
+    pa = walk(cur_l1, addr, &prot);
+    if (pa == (uint32_t)-1) {
+        fprintf(stderr, "tlb_test: no mapping for 0x%08x\n", addr);
+        abort();
+    }
+    tlb_set_page(cpu_single_env, addr & TARGET_PAGE_MASK,
+                 pa & TARGET_PAGE_MASK, prot, mmu_idx, 1, TARGET_PAGE_SIZE);
+}
+
+/* create the processes, each mapping 'user_pages' 4 KB pages of its own
+   at USER_BASE, above 'kernel_pages' global pages at KERNEL_BASE */
+static void
+setup_procs( int  nprocs, int  user_pages, int  kernel_pages )
+{
+    int  nn, ii;
+
+    next_l1   = L1_TABLES_BASE;
+    next_l2   = L2_TABLES_BASE;
+    next_page = PAGES_BASE;
+
+    kernel_l1 = alloc_l1();
+    memset(qemu_get_ram_ptr(kernel_l1), 0, 0x4000);
+    for (ii = 0; ii < kernel_pages; ii++)
+        map_page(kernel_l1, KERNEL_BASE + (ii << 12), alloc_page(), 1,
+                 DOMAIN_KERNEL);
+
+    for (nn = 0; nn < nprocs; nn++) {
+        Proc*  p = &procs[nn];
+
+        p->asid = nn + 1;
+        p->l1   = alloc_l1();
+        memcpy(qemu_get_ram_ptr(p->l1), qemu_get_ram_ptr(kernel_l1), 0x4000);
+        for (ii = 0; ii < user_pages; ii++)
+            map_page(p->l1, USER_BASE + (ii << 12), alloc_page(), 0,
+                     DOMAIN_USER);
+    }
+}
+
+/** the emulated CPU
+ **/
+
+static int64_t  num_misses;
+
+/* a guest load, like the generated code: compare the TLB entry inline
+   and take the helper on a mismatch */
+static inline uint32_t
+guest_ldl( target_ulong  addr, int  mmu_idx )
+{
+    CPUState*    env = cpu_single_env;
+    int          index = (addr >> TARGET_PAGE_BITS) & (env->tlb_size - 1);
+    CPUTLBEntry* te = &env->tlb_table[mmu_idx][index];
+
+    if (likely((addr & TARGET_PAGE_MASK) == te->addr_code))
+        return *(uint32_t*)(unsigned long)(addr + te->addend);
+    num_misses++;
+    return __ldl_cmmu(addr, mmu_idx);
+}
+
+static void
+check_ldl( target_ulong  addr, int  mmu_idx )
+{
+    uint32_t  val = guest_ldl(addr, mmu_idx);
+    int       prot;
+    uint32_t  pa = walk(cur_l1, addr, &prot);
+
+    if (val != pa && errors++ < 10)
+        fprintf(stderr, "tlb_test: 0x%08x loads from 0x%08x instead of "
+                "0x%08x\n", addr, val, pa);
+}
+
+/* create a CPU with 1 << tlb_bits TLB entries per MMU mode, like
+   -tlb-size does */
+static CPUState*
+new_cpu( int  tlb_bits )
+{
+    CPUState*  env = qemu_mallocz(sizeof(CPUState));
+
+    cpu_tlb_bits = tlb_bits;
+    cpu_exec_init(env);
+    cpu_single_env = env;
+    tlb_flush(env, 1);      /* like cpu_reset() */
+    return env;
+}
+
+/* switch to process 'p', like a write to CONTEXTIDR after the TTBR */
+static void
+switch_proc( CPUState*  env, Proc*  p, int  use_asid )
+{
+    cur_l1 = p->l1;
+    if (use_asid)
+        tlb_switch_asid(env, p->asid, 1);
+    else
+        tlb_flush(env, 1);  /* what each switch did before ASIDs */
+}
+
+/* random switches, loads and TLB maintenance, with more processes than
+   TLB sets. each load is checked against a walk of the current tables. */
+static void
+check_asid( int  tlb_bits )
+{
+    CPUState*  env = new_cpu(tlb_bits);
+    int        nprocs = 20, user_pages = 16, kernel_pages = 16;
+    Proc*      cur;
+    Proc       fresh;
+    int64_t    walks;
+    uint32_t   off;
+    int        op, nn;
+
+    setup_procs(nprocs, user_pages, kernel_pages);
+    cur = &procs[0];
+    switch_proc(env, cur, 1);
+
+    for (op = 0; op < NB_OPS && errors < 10; op++) {
+        uint32_t  r = next_rand() % 100;
+
+        off = (next_rand() % (user_pages << 12)) & ~3;
+
+        if (r < 5) {
+            cur = &procs[next_rand() % nprocs];
+            switch_proc(env, cur, 1);
+        } else if (r < 7) {
+            /* remap a user page of any process, then invalidate it by
+               MVA, which is done in all address spaces */
+            Proc*     p  = &procs[next_rand() % nprocs];
+            uint32_t  va = USER_BASE + (off & ~0xfff);
+            map_page(p->l1, va, alloc_page(), 0, DOMAIN_USER);
+            if (next_page > RAM_SIZE - 0x10000)
+                next_page = PAGES_BASE;
+            tlb_flush_page(env, va);
+            tlb_flush_page(env, va + 0x400);
+            tlb_flush_page(env, va + 0x800);
+            tlb_flush_page(env, va + 0xc00);
+        } else if (r < 8) {
+            /* remap all user pages of a process, then invalidate its
+               address space, like the kernel does on ASID rollover */
+            Proc*  p = &procs[next_rand() % nprocs];
+            for (nn = 0; nn < user_pages; nn++)
+                map_page(p->l1, USER_BASE + (nn << 12), alloc_page(), 0,
+                         DOMAIN_USER);
+            if (next_page > RAM_SIZE - 0x10000)
+                next_page = PAGES_BASE;
+            tlb_flush_asid(env, p->asid, 0xff);
+        } else if (r < 9) {
+            tlb_flush_tag(env, 1 << DOMAIN_USER);
+        } else if (r < 55) {
+            check_ldl(USER_BASE + off, 1);
+        } else {
+            check_ldl(KERNEL_BASE + (off % (kernel_pages << 12)), 0);
+        }
+    }
+
+    /* switching back to a recent process must not walk its tables, and
+       a new address space must keep the global entries */
+    for (nn = 0; nn < 2; nn++) {
+        cur = &procs[nn];
+        switch_proc(env, cur, 1);
+        for (off = 0; off < user_pages << 12; off += TARGET_PAGE_SIZE)
+            check_ldl(USER_BASE + off, 1);
+        for (off = 0; off < kernel_pages << 12; off += TARGET_PAGE_SIZE)
+            check_ldl(KERNEL_BASE + off, 0);
+    }
+    walks = num_walks;
+    for (nn = 0; nn < 2; nn++) {
+        cur = &procs[nn];
+        switch_proc(env, cur, 1);
+        for (off = 0; off < user_pages << 12; off += TARGET_PAGE_SIZE)
+            check_ldl(USER_BASE + off, 1);
+    }
+    fresh.asid = 100;
+    fresh.l1   = procs[2].l1;
+    switch_proc(env, &fresh, 1);
+    for (off = 0; off < kernel_pages << 12; off += TARGET_PAGE_SIZE)
+        check_ldl(KERNEL_BASE + off, 0);
+    if (num_walks != walks) {
+        fprintf(stderr, "tlb_test: %lld walks after switching back\n",
+                (long long)(num_walks - walks));
+        errors++;
+    }
+}
+
+/* the span of virtual addresses covered by the TLB of 'env': pages this
+   far apart use the same entry */
+#define TLB_SPAN(env)  ((env)->tlb_size * TARGET_PAGE_SIZE)
+
+/* pages that use the same TLB entry must stay cached in the victim TLB,
+   which must honor invalidations like the main one */
+static void
+check_victim( void )
+{
+    CPUState*  env = new_cpu(CPU_TLB_MIN_BITS);
+    int        nb_pages = CPU_VTLB_SIZE / 2;
+    int64_t    walks;
+    int        round, nn;
+
+    setup_procs(1, 0, 0);
+    cur_l1 = procs[0].l1;
+    tlb_switch_asid(env, procs[0].asid, 1);
+    for (nn = 0; nn < nb_pages; nn++)
+        map_page(cur_l1, USER_BASE + nn * TLB_SPAN(env), alloc_page(), 0,
+                 DOMAIN_USER);
+
+    for (round = 0; round < 3; round++) {
+        if (round == 1)
+            walks = num_walks;
+        for (nn = 0; nn < nb_pages; nn++)
+            check_ldl(USER_BASE + nn * TLB_SPAN(env), 1);
+    }
+    if (num_walks != walks) {
+        fprintf(stderr, "tlb_test: %lld walks for %d pages in the victim "
+                "TLB\n", (long long)(num_walks - walks), nb_pages);
+        errors++;
+    }
+
+    /* remapped and flushed pages must not be found in the victim TLB */
+    map_page(cur_l1, USER_BASE, alloc_page(), 0, DOMAIN_USER);
+    tlb_flush_page(env, USER_BASE);
+    check_ldl(USER_BASE + 4, 1);
+    for (nn = 0; nn < nb_pages; nn++)
+        map_page(cur_l1, USER_BASE + nn * TLB_SPAN(env), alloc_page(), 0,
+                 DOMAIN_USER);
+    tlb_flush_asid(env, procs[0].asid, 0xff);
+    for (nn = 0; nn < nb_pages; nn++)
+        check_ldl(USER_BASE + nn * TLB_SPAN(env) + 8, 1);
+    for (nn = 0; nn < nb_pages; nn++)
+        map_page(cur_l1, USER_BASE + nn * TLB_SPAN(env), alloc_page(), 0,
+                 DOMAIN_USER);
+    tlb_flush(env, 1);
+    for (nn = 0; nn < nb_pages; nn++)
+        check_ldl(USER_BASE + nn * TLB_SPAN(env) + 12, 1);
+
+    /* a switch to a new address space must not keep them either */
+    procs[1] = procs[0];
+    procs[1].asid = 2;
+    for (nn = 0; nn < nb_pages; nn++)
+        map_page(cur_l1, USER_BASE + nn * TLB_SPAN(env), alloc_page(), 0,
+                 DOMAIN_USER);
+    tlb_switch_asid(env, procs[1].asid, 1);
+    for (nn = 0; nn < nb_pages; nn++)
+        check_ldl(USER_BASE + nn * TLB_SPAN(env) + 16, 1);
+}
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#define NB_SLICES        4000
+#define SLICE_ACCESSES   1000
+#define USER_WS          128     /* TARGET_PAGE_SIZE pages per process */
+#define KERNEL_WS        64
+
+/* round robin over 'nprocs' processes. each time slice touches some
+   kernel pages, then the working set of the process. */
+static void
+bench_switch( int  nprocs )
+{
+    double   secs[2];
+    int64_t  walks[2], misses[2];
+    int      use_asid;
+
+    for (use_asid = 0; use_asid < 2; use_asid++) {
+        CPUState*  env = new_cpu(CPU_TLB_DEFAULT_BITS);
+        double     t0;
+        int        slice, nn;
+
+        setup_procs(nprocs, USER_WS / 4, KERNEL_WS / 4);
+        num_walks  = 0;
+        num_misses = 0;
+        rand_state = 1;
+        t0 = now_secs();
+        for (slice = 0; slice < NB_SLICES; slice++) {
+            Proc*  p = &procs[slice % nprocs];
+
+            switch_proc(env, p, use_asid);
+            for (nn = 0; nn < SLICE_ACCESSES / 8; nn++)
+                guest_ldl(KERNEL_BASE +
+                          (next_rand() % KERNEL_WS) * TARGET_PAGE_SIZE, 0);
+            for (; nn < SLICE_ACCESSES; nn++)
+                guest_ldl(USER_BASE +
+                          (next_rand() % USER_WS) * TARGET_PAGE_SIZE, 1);
+        }
+        secs[use_asid]   = now_secs() - t0;
+        walks[use_asid]  = num_walks;
+        misses[use_asid] = num_misses;
+    }
+    printf("tlb_test: %2d processes, per switch: %5.1f walks, %4.1f%% misses, "
+           "%4.1f ns/access with ASIDs; %5.1f walks, %4.1f%% misses, "
+           "%4.1f ns/access with flushes\n", nprocs,
+           (double)walks[1] / NB_SLICES,
+           misses[1] * 100.0 / (NB_SLICES * SLICE_ACCESSES),
+           secs[1] * 1e9 / (NB_SLICES * SLICE_ACCESSES),
+           (double)walks[0] / NB_SLICES,
+           misses[0] * 100.0 / (NB_SLICES * SLICE_ACCESSES),
+           secs[0] * 1e9 / (NB_SLICES * SLICE_ACCESSES));
+}
+
+#define NB_ACCESSES  2000000
+
+/* random accesses over 'ws' pages of one process, for each TLB size,
+   with and without the victim TLB. the memory checker bypasses the
+   victim TLB, which is used here to measure without it. */
+static void
+bench_working_set( int  ws )
+{
+    int  tlb_bits, victim;
+
+    printf("tlb_test: %4d KB working set:", ws * TARGET_PAGE_SIZE / 1024);
+    for (tlb_bits = CPU_TLB_MIN_BITS; tlb_bits <= CPU_TLB_MAX_BITS;
+         tlb_bits += 2) {
+        for (victim = 1; victim >= 0; victim--) {
+            CPUState*  env = new_cpu(tlb_bits);
+            double     t0, secs;
+            int        nn;
+
+            setup_procs(1, ws / 4, 0);
+            switch_proc(env, &procs[0], 1);
+            memcheck_instrument_mmu = !victim;
+            num_walks  = 0;
+            num_misses = 0;
+            rand_state = 1;
+            t0 = now_secs();
+            for (nn = 0; nn < NB_ACCESSES; nn++)
+                guest_ldl(USER_BASE + (next_rand() % ws) * TARGET_PAGE_SIZE, 1);
+            secs = now_secs() - t0;
+            memcheck_instrument_mmu = 0;
+            if (victim)
+                printf(" %4d: %4.1f%% walks, %4.1f%% victim hits, %4.1f ns;",
+                       1 << tlb_bits, num_walks * 100.0 / NB_ACCESSES,
+                       (num_misses - num_walks) * 100.0 / NB_ACCESSES,
+                       secs * 1e9 / NB_ACCESSES);
+            else
+                printf(" %4.1f ns without%s", secs * 1e9 / NB_ACCESSES,
+                       tlb_bits + 2 <= CPU_TLB_MAX_BITS ? ";" : "\n");
+        }
+    }
+}
+
+/* four streams whose pages use the same TLB entry, like a loop copying
+   between buffers whose distance is a multiple of the TLB span, with
+   its code and stack. each page is accessed 64 times before the streams
+   move to their next page. */
+static void
+bench_aliased( void )
+{
+    int64_t  walks[2];
+    double   secs[2];
+    int      victim;
+
+    for (victim = 0; victim < 2; victim++) {
+        CPUState*  env = new_cpu(CPU_TLB_DEFAULT_BITS);
+        double     t0;
+        int        nn;
+
+        setup_procs(1, 0, 0);
+        for (nn = 0; nn < 4 * 16; nn++)
+            map_page(procs[0].l1, USER_BASE + (nn / 16) * (16 << 20) +
+                     (nn % 16) * 0x1000, alloc_page(), 0, DOMAIN_USER);
+        switch_proc(env, &procs[0], 1);
+        memcheck_instrument_mmu = !victim;
+        num_walks = 0;
+        t0 = now_secs();
+        for (nn = 0; nn < NB_ACCESSES; nn++)
+            guest_ldl(USER_BASE + (nn % 4) * (16 << 20) +
+                      ((nn / 256) % 64) * TARGET_PAGE_SIZE, 1);
+        secs[victim]  = now_secs() - t0;
+        walks[victim] = num_walks;
+        memcheck_instrument_mmu = 0;
+    }
+    printf("tlb_test: 4 aliased streams: %4.1f%% walks, %4.1f ns/access with "
+           "the victim TLB, %4.1f%% walks, %4.1f ns/access without\n",
+           walks[1] * 100.0 / NB_ACCESSES, secs[1] * 1e9 / NB_ACCESSES,
+           walks[0] * 100.0 / NB_ACCESSES, secs[0] * 1e9 / NB_ACCESSES);
+}
+
+int main(void)
+{
+    ram_addr_t  offset;
+    uint32_t*   words;
+    uint32_t    nn;
+
+    cpu_exec_init_all(0);
+    offset = qemu_ram_alloc(RAM_SIZE);
+    cpu_register_physical_memory(0, RAM_SIZE, offset | IO_MEM_RAM);
+    words = qemu_get_ram_ptr(offset);
+    for (nn = 0; nn < RAM_SIZE / 4; nn++)
+        words[nn] = nn * 4;
+
+    check_asid(CPU_TLB_MIN_BITS);
+    check_asid(CPU_TLB_DEFAULT_BITS);
+    check_asid(CPU_TLB_MAX_BITS);
+    check_victim();
+    if (errors > 0) {
+        fprintf(stderr, "tlb_test: FAILED\n");
+        return 1;
+    }
+
+    bench_switch(2);
+    bench_switch(8);
+    bench_switch(16);
+    bench_switch(32);
+
+    bench_working_set(128);
+    bench_working_set(512);
+    bench_working_set(2048);
+    bench_working_set(8192);
+    bench_aliased();
+
+    printf("tlb_test: OK\n");
+    return 0;
+}
@@ -55,6 +55,8 @@
 #include "android/hw-kmsg.h"
 #include "android/charmap.h"
 #include "targphys.h"
+#include "iolooper.h"
+#include "thread-pool.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -114,6 +116,9 @@
 
 #include <linux/ppdev.h>
 #include <linux/parport.h>
+#ifdef CONFIG_TIMERFD
+#include <sys/timerfd.h>
+#endif
 #endif
 #ifdef __sun__
 #include <sys/stat.h>
@@ -183,6 +188,7 @@
 #include "migration.h"
 #include "kvm.h"
 #include "balloon.h"
+#include "ram-dedup.h"
 
 #ifdef CONFIG_STANDALONE_CORE
 /* Verbose value used by the standalone emulator core (without UI) */
@@ -298,6 +304,9 @@ int watchdog_action = WDT_RESET;
 const char *option_rom[MAX_OPTION_ROMS];
 int nb_option_roms;
 int semihosting_enabled = 0;
+int mapped_ram = 0;
+int mem_merge = 0;
+static const char *mem_dedup_file;
 #ifdef TARGET_ARM
 int old_param = 0;
 #endif
@@ -851,9 +860,12 @@ struct QEMUTimer {
     int64_t expire_time;
     QEMUTimerCB *cb;
     void *opaque;
-    struct QEMUTimer *next;
+    uint64_t seq;           /* orders timers with the same expire_time */
+    int heap_index;         /* position in the clock's heap, -1 if not pending */
 };
 
+#include "qemu-timer-heap.h"
+
 struct qemu_alarm_timer {
     char const *name;
     unsigned int flags;
@@ -913,6 +925,12 @@ static void hpet_stop_timer(struct qemu_alarm_timer *t);
 static int rtc_start_timer(struct qemu_alarm_timer *t);
 static void rtc_stop_timer(struct qemu_alarm_timer *t);
 
+#ifdef CONFIG_TIMERFD
+static int timerfd_start_timer(struct qemu_alarm_timer *t);
+static void timerfd_stop_timer(struct qemu_alarm_timer *t);
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t);
+#endif
+
 #endif /* __linux__ */
 
 #endif /* _WIN32 */
@@ -985,6 +1003,11 @@ static void init_icount_adjust(void)
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
 #ifdef __linux__
+#ifdef CONFIG_TIMERFD
+    /* signal-less, preferred with -icount, refuses to start otherwise */
+    {"timerfd", ALARM_FLAG_DYNTICKS, timerfd_start_timer,
+     timerfd_stop_timer, timerfd_rearm_timer, NULL},
+#endif
     {"dynticks", ALARM_FLAG_DYNTICKS, dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer, NULL},
     /* HPET - if available - is preferred */
@@ -1072,7 +1095,21 @@ QEMUClock *rt_clock;
 QEMUClock *vm_clock;
 QEMUClock *host_clock;
 
+/* active_timers[] always points to the root of each heap (see
+   qemu-timer-heap.h), i.e. the next timer to expire. It is updated with a
+   single pointer store, and is the only thing the alarm signal handler
+   looks at, so the heaps can be modified (and reallocated) while a
+   signal is pending. */
+static QEMUTimerHeap timer_heaps[QEMU_NUM_CLOCKS];
 static QEMUTimer *active_timers[QEMU_NUM_CLOCKS];
+static uint64_t timer_seq;
+
+static inline void timer_heap_sync_head(int type)
+{
+    QEMUTimerHeap *h = &timer_heaps[type];
+
+    active_timers[type] = h->count ? h->timers[0] : NULL;
+}
 
 static QEMUClock *qemu_new_clock(int type)
 {
@@ -1090,6 +1127,7 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
     ts->clock = clock;
     ts->cb = cb;
     ts->opaque = opaque;
+    ts->heap_index = -1;
     return ts;
 }
 
@@ -1101,49 +1139,37 @@ void qemu_free_timer(QEMUTimer *ts)
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    int type = ts->clock->type;
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
-    }
+    if (ts->heap_index < 0)
+        return;
+
+    /* NOTE: qemu_timer_expired() can be called from a signal, but it
+       only looks at active_timers[], which is updated last. */
+    timer_heap_remove(&timer_heaps[type], ts);
+    timer_heap_sync_head(type);
 }
 
 /* modify the current timer so that it will be fired when current_time
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
+    int type = ts->clock->type;
+    QEMUTimerHeap *h = &timer_heaps[type];
 
-    qemu_del_timer(ts);
-
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t->expire_time > expire_time)
-            break;
-        pt = &t->next;
-    }
+    /* timers with the same expire_time fire in the order they were set */
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_seq++;
+
+    if (ts->heap_index >= 0)
+        timer_heap_update(h, ts->heap_index);
+    else
+        timer_heap_insert(h, ts);
+
+    timer_heap_sync_head(type);
 
     /* Rearm if necessary  */
-    if (pt == &active_timers[ts->clock->type]) {
+    if (active_timers[type] == ts) {
         if ((alarm_timer->flags & ALARM_FLAG_EXPIRED) == 0) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -1155,12 +1181,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 int qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
-    }
-    return 0;
+    return ts->heap_index >= 0;
 }
 
 int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -1170,19 +1191,18 @@ int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
     return (timer_head->expire_time <= current_time);
 }
 
-static void qemu_run_timers(QEMUTimer **ptimer_head, int64_t current_time)
+static void qemu_run_timers(QEMUClock *clock, int64_t current_time)
 {
     QEMUTimer *ts;
 
     for(;;) {
-        ts = *ptimer_head;
+        ts = active_timers[clock->type];
         if (!ts || ts->expire_time > current_time)
             break;
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        qemu_del_timer(ts);
 
-        /* run the callback (the timer list can be modified) */
+        /* run the callback (the timers can be modified) */
         ts->cb(ts->opaque);
     }
 }
@@ -1590,6 +1610,97 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     }
 }
 
+#ifdef CONFIG_TIMERFD
+
+/* The timerfd alarm doesn't use a signal: its descriptor is watched by
+   the main loop like any other, which avoids interrupting system calls
+   and lets an idle emulator sleep until the next deadline.
+
+   Nothing stops a running vCPU when it expires though, so it is only
+   usable with -icount, where cpu_exec() returns by itself at the next
+   virtual clock deadline. Without -icount the vCPU must be kicked from
+   its own thread: a timerfd can't raise SIGIO, and cpu_exit() can't be
+   called from a helper thread since cpu_unlink_tb() isn't SMP safe, so
+   the signal based timers are used instead. */
+static void timerfd_alarm_read(void *opaque)
+{
+    struct qemu_alarm_timer *t = opaque;
+    int fd = (long)t->priv;
+    uint64_t expirations;
+    ssize_t len;
+
+    do {
+        len = read(fd, &expirations, sizeof(expirations));
+    } while (len < 0 && errno == EINTR);
+
+    host_alarm_handler(0);
+}
+
+static int timerfd_start_timer(struct qemu_alarm_timer *t)
+{
+    int fd;
+
+    if (!use_icount)
+        return -1;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (fd < 0)
+        return -1;
+
+    fcntl_setfl(fd, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    t->priv = (void *)(long)fd;
+    qemu_set_fd_handler(fd, timerfd_alarm_read, NULL, t);
+
+    return 0;
+}
+
+static void timerfd_stop_timer(struct qemu_alarm_timer *t)
+{
+    int fd = (long)t->priv;
+
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    close(fd);
+}
+
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t)
+{
+    int fd = (long)t->priv;
+    struct itimerspec timeout;
+    int64_t nearest_delta_us;
+    int64_t current_us;
+
+    if (!active_timers[QEMU_CLOCK_REALTIME] &&
+        !active_timers[QEMU_CLOCK_VIRTUAL] &&
+        !active_timers[QEMU_CLOCK_HOST])
+        return;
+
+    nearest_delta_us = qemu_next_deadline_dyntick();
+
+    /* check whether a timer is already running */
+    if (timerfd_gettime(fd, &timeout)) {
+        perror("timerfd_gettime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+    current_us = timeout.it_value.tv_sec * 1000000 + timeout.it_value.tv_nsec/1000;
+    if (current_us && current_us <= nearest_delta_us)
+        return;
+
+    timeout.it_interval.tv_sec = 0;
+    timeout.it_interval.tv_nsec = 0; /* 0 for one-shot timer */
+    timeout.it_value.tv_sec =  nearest_delta_us / 1000000;
+    timeout.it_value.tv_nsec = (nearest_delta_us % 1000000) * 1000;
+    if (timerfd_settime(fd, 0 /* RELATIVE */, &timeout, NULL)) {
+        perror("timerfd_settime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+}
+
+#endif /* CONFIG_TIMERFD */
+
 #endif /* defined(__linux__) */
 
 static int unix_start_timer(struct qemu_alarm_timer *t)
@@ -2870,12 +2981,63 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_write;
     int deleted;
     void *opaque;
-    /* temporary data */
-    struct pollfd *ufd;
+    /* IOLOOPER_XXX events registered with main_looper */
+    int looper_flags;
     struct IOHandlerRecord *next;
+    /* next handler whose fd_read_poll must be called before each wait */
+    struct IOHandlerRecord *poll_next;
+    int in_poll_list;
 } IOHandlerRecord;
 
 static IOHandlerRecord *first_io_handler;
+static IOHandlerRecord *first_poll_handler;
+static int io_handlers_deleted;
+
+/* The looper used by main_loop_wait(). File descriptors stay registered
+ * with it across iterations, and are only modified when the set of
+ * events we are interested in changes. */
+static IoLooper *main_looper;
+
+/* map descriptors reported by main_looper to their handler */
+static IOHandlerRecord **io_handler_map;
+static int io_handler_map_size;
+
+static IoLooper *get_main_looper(void)
+{
+    if (main_looper == NULL)
+        main_looper = iolooper_new();
+    return main_looper;
+}
+
+static void io_handler_map_set(int fd, IOHandlerRecord *ioh)
+{
+    if (fd >= io_handler_map_size) {
+        int new_size = io_handler_map_size ? io_handler_map_size : 64;
+
+        while (new_size <= fd)
+            new_size *= 2;
+        io_handler_map = qemu_realloc(io_handler_map,
+                                      new_size * sizeof(*io_handler_map));
+        memset(io_handler_map + io_handler_map_size, 0,
+               (new_size - io_handler_map_size) * sizeof(*io_handler_map));
+        io_handler_map_size = new_size;
+    }
+    io_handler_map[fd] = ioh;
+}
+
+static IOHandlerRecord *io_handler_lookup(int fd)
+{
+    if (fd < 0 || fd >= io_handler_map_size)
+        return NULL;
+    return io_handler_map[fd];
+}
+
+/* update the events registered for a handler */
+static void io_handler_set_events(IOHandlerRecord *ioh, int flags)
+{
+    iolooper_modify(get_main_looper(), ioh->fd, ioh->looper_flags, flags);
+    ioh->looper_flags = flags;
+}
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -2895,6 +3057,9 @@ int qemu_set_fd_handler2(int fd,
                 break;
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+                io_handlers_deleted = 1;
+                /* the caller is likely to close the descriptor next */
+                io_handler_set_events(ioh, 0);
                 break;
             }
             pioh = &ioh->next;
@@ -2914,6 +3079,21 @@ int qemu_set_fd_handler2(int fd,
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+        io_handler_map_set(fd, ioh);
+
+        if (fd_read_poll) {
+            /* the read events depend on fd_read_poll, which is called
+             * before each wait */
+            if (!ioh->in_poll_list) {
+                ioh->poll_next = first_poll_handler;
+                first_poll_handler = ioh;
+                ioh->in_poll_list = 1;
+            }
+            io_handler_set_events(ioh, fd_write ? IOLOOPER_WRITE : 0);
+        } else {
+            io_handler_set_events(ioh, (fd_read  ? IOLOOPER_READ  : 0) |
+                                       (fd_write ? IOLOOPER_WRITE : 0));
+        }
     }
     return 0;
 }
@@ -3104,69 +3284,472 @@ static void ram_decompress_close(RamDecompressState *s)
 #define RAM_SAVE_FLAG_MEM_SIZE	0x04
 #define RAM_SAVE_FLAG_PAGE	0x08
 #define RAM_SAVE_FLAG_EOS	0x10
+#define RAM_SAVE_FLAG_CHUNK	0x20
+#define RAM_SAVE_FLAG_FILE	0x40
+#define RAM_SAVE_FLAG_PARENT	0x80
+
+/* Since version 4, RAM is sent in chunks of up to RAM_CHUNK_PAGES dirty
+ * pages. A chunk starts with an index that has one entry per page, made
+ * of the page address and a RAM_CHUNK_XXX kind in its low bits, followed
+ * by the zlib-compressed contents of all RAM_CHUNK_PAGE pages:
+ *
+ *   be64  RAM_SAVE_FLAG_CHUNK
+ *   be32  number of index entries
+ *   ...   index entries:
+ *           be64  addr | RAM_CHUNK_PAGE
+ *           be64  addr | RAM_CHUNK_FILL, byte fill value
+ *           be64  addr | RAM_CHUNK_DUP, be64 address of an identical page
+ *   be32  compressed size
+ *   ...   compressed data
+ *
+ * A RAM_CHUNK_DUP page refers to a page sent earlier during the same
+ * ram_save_live() call, found through a hash of the page contents.
+ *
+ * Chunks are compressed on save, and decompressed on load, by a pool of
+ * worker threads, while the main thread scans RAM and does the I/O.
+ */
+#include "ram-chunk.h"
 
-static int is_dup_page(uint8_t *page, uint8_t ch)
+/* chunks in flight, used as a ring to keep them in stream order */
+static ThreadPool *ram_pool;
+static RamChunk *ram_chunks;
+static int ram_nchunks;
+static int ram_chunk_first;
+static int ram_chunk_count;
+
+static RamStats ram_stats;
+
+static void ram_chunks_init(void)
 {
-    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
-    uint32_t *array = (uint32_t *)page;
     int i;
 
-    for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
-        if (array[i] != val)
-            return 0;
+    if (ram_pool)
+        return;
+
+    ram_pool = thread_pool_new(0);
+    ram_nchunks = 2 * thread_pool_get_size(ram_pool);
+    ram_chunks = qemu_mallocz(ram_nchunks * sizeof(RamChunk));
+    for (i = 0; i < ram_nchunks; i++) {
+        RamChunk *c = &ram_chunks[i];
+
+        c->buf_size = compressBound(RAM_CHUNK_PAGES * TARGET_PAGE_SIZE);
+        c->buf = qemu_malloc(c->buf_size);
     }
+}
 
-    return 1;
+static RamChunk *ram_chunk_next(void)
+{
+    return &ram_chunks[(ram_chunk_first + ram_chunk_count) % ram_nchunks];
 }
 
-static int ram_save_block(QEMUFile *f)
+static RamChunk *ram_chunk_retire(void)
+{
+    RamChunk *c = &ram_chunks[ram_chunk_first];
+
+    thread_pool_wait_job(ram_pool, &c->job);
+    ram_chunk_first = (ram_chunk_first + 1) % ram_nchunks;
+    ram_chunk_count--;
+    return c;
+}
+
+void ram_stats_reset(void)
+{
+    memset(&ram_stats, 0, sizeof(ram_stats));
+}
+
+void ram_stats_get(RamStats *stats)
+{
+    *stats = ram_stats;
+}
+
+/* Page hashes used to find duplicate pages during a ram_save_live()
+ * call. The table is direct-mapped: a collision simply loses a chance
+ * to deduplicate. Entries from previous calls are ignored thanks to the
+ * generation number. */
+typedef struct RamHashEntry {
+    uint64_t hash;
+    ram_addr_t addr;
+    unsigned gen;
+} RamHashEntry;
+
+static RamHashEntry *ram_hash;
+static ram_addr_t ram_hash_size;
+static unsigned ram_hash_gen;
+
+static void ram_hash_begin(void)
+{
+    ram_addr_t size = 1;
+
+    while (size < 2 * (last_ram_offset >> TARGET_PAGE_BITS))
+        size <<= 1;
+
+    if (size != ram_hash_size) {
+        qemu_free(ram_hash);
+        ram_hash = qemu_mallocz(size * sizeof(RamHashEntry));
+        ram_hash_size = size;
+        ram_hash_gen = 0;
+    }
+    if (++ram_hash_gen == 0) {
+        memset(ram_hash, 0, ram_hash_size * sizeof(RamHashEntry));
+        ram_hash_gen = 1;
+    }
+}
+
+/* add up to RAM_CHUNK_PAGES dirty pages to 'c', starting where the
+   previous call stopped, and return the number of pages added */
+static int ram_chunk_collect(RamChunk *c)
 {
     static ram_addr_t current_addr = 0;
-    ram_addr_t saved_addr = current_addr;
-    ram_addr_t addr = 0;
-    int found = 0;
 
-    while (addr < last_ram_offset) {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
+    c->npages = 0;
+    c->ndata = 0;
+
+    while (c->npages < RAM_CHUNK_PAGES) {
+        ram_addr_t addr;
+        uint64_t hash;
+        RamHashEntry *e;
+        uint8_t *p;
+        int n = c->npages;
+
+        if (current_addr >= last_ram_offset)
+            current_addr = 0;
+
+        addr = cpu_physical_memory_find_dirty(current_addr, last_ram_offset,
+                                              MIGRATION_DIRTY_FLAG);
+        if (addr == last_ram_offset) {
+            addr = cpu_physical_memory_find_dirty(0, current_addr,
+                                                  MIGRATION_DIRTY_FLAG);
+            if (addr == current_addr)
+                break;
+        }
 
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
+        cpu_physical_memory_reset_dirty(addr,
+                                        addr + TARGET_PAGE_SIZE,
+                                        MIGRATION_DIRTY_FLAG);
+        current_addr = addr + TARGET_PAGE_SIZE;
+        c->npages++;
+
+        if (!cpu_physical_memory_get_dirty(addr, FREE_PAGE_DIRTY_FLAG)) {
+            /* discarded by the guest, don't fault it in to read zeroes */
+            c->index[n] = addr | RAM_CHUNK_FILL;
+            c->arg[n] = 0;
+            ram_stats.fill_pages++;
+            ram_stats.free_pages++;
+            continue;
+        }
 
-            p = qemu_get_ram_ptr(current_addr);
+        p = qemu_get_ram_ptr(addr);
+        if (ram_page_hash(p, &hash)) {
+            c->index[n] = addr | RAM_CHUNK_FILL;
+            c->arg[n] = *p;
+            ram_stats.fill_pages++;
+            continue;
+        }
 
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-            } else {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-            }
+        e = &ram_hash[hash & (ram_hash_size - 1)];
+        if (e->gen == ram_hash_gen && e->hash == hash &&
+            memcmp(qemu_get_ram_ptr(e->addr), p, TARGET_PAGE_SIZE) == 0) {
+            c->index[n] = addr | RAM_CHUNK_DUP;
+            c->arg[n] = e->addr;
+            ram_stats.dup_pages++;
+            continue;
+        }
 
-            found = 1;
+        e->gen = ram_hash_gen;
+        e->hash = hash;
+        e->addr = addr;
+
+        c->index[n] = addr | RAM_CHUNK_PAGE;
+        c->data[c->ndata++] = p;
+    }
+
+    ram_stats.raw_bytes += (uint64_t)c->npages * TARGET_PAGE_SIZE;
+    return c->npages;
+}
+
+static void ram_chunk_put(QEMUFile *f, RamChunk *c)
+{
+    uint64_t stored = 8 + 4 + 4;
+    int i;
+
+    if (c->len < 0) {
+        qemu_file_set_error(f);
+        return;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHUNK);
+    qemu_put_be32(f, c->npages);
+    for (i = 0; i < c->npages; i++) {
+        qemu_put_be64(f, c->index[i]);
+        stored += 8;
+        switch (c->index[i] & ~TARGET_PAGE_MASK) {
+        case RAM_CHUNK_FILL:
+            qemu_put_byte(f, c->arg[i]);
+            stored += 1;
+            break;
+        case RAM_CHUNK_DUP:
+            qemu_put_be64(f, c->arg[i]);
+            stored += 8;
             break;
         }
-        addr += TARGET_PAGE_SIZE;
-        current_addr = (saved_addr + addr) % last_ram_offset;
     }
+    qemu_put_be32(f, c->len);
+    qemu_put_buffer(f, c->buf, c->len);
 
-    return found;
+    ram_stats.stored_bytes += stored + c->len;
 }
 
-static uint64_t bytes_transferred = 0;
+/* send dirty pages until there are none left, or until the rate limit
+   is reached if 'rate_limited' is set. Return the number of pages sent. */
+static ram_addr_t ram_save_chunks(QEMUFile *f, int rate_limited)
+{
+    ram_addr_t pages = 0;
 
-static ram_addr_t ram_save_remaining(void)
+    ram_chunks_init();
+    ram_hash_begin();
+
+    for (;;) {
+        RamChunk *c;
+
+        if (rate_limited && qemu_file_rate_limit(f))
+            break;
+
+        if (ram_chunk_count == ram_nchunks)
+            ram_chunk_put(f, ram_chunk_retire());
+
+        c = ram_chunk_next();
+        if (ram_chunk_collect(c) == 0)
+            break;
+
+        pages += c->npages;
+        ram_chunk_count++;
+        thread_pool_submit(ram_pool, &c->job, ram_chunk_compress, c);
+    }
+
+    while (ram_chunk_count > 0)
+        ram_chunk_put(f, ram_chunk_retire());
+
+    return pages;
+}
+
+/* With -mapped-ram, savevm stores guest RAM in a separate file, where
+ * the page at ram offset 'addr' is at file offset 'addr', and the stream
+ * only records the name of this file, relative to the snapshot image:
+ *
+ *   be64  RAM_SAVE_FLAG_FILE
+ *   be32  length of name
+ *   ...   name
+ *   be64  RAM size
+ *
+ * On restore, the file is mapped over guest RAM, so pages are only read
+ * when the guest first touches them, and clean pages are shared through
+ * the host page cache between emulators restored from the same file.
+ *
+ * The file is first written under a temporary name, and only renamed
+ * by ram_commit_save_file() once the snapshot exists, so that a failed
+ * savevm never replaces the RAM of an older snapshot with the same name.
+ */
+static char *ram_file_base;
+static char *ram_save_name;
+
+void ram_set_file_base(const char *image)
 {
-    ram_addr_t addr;
-    ram_addr_t count = 0;
+    qemu_free(ram_file_base);
+    ram_file_base = image ? qemu_strdup(image) : NULL;
+}
+
+void ram_get_file_path(char *path, int path_size, const char *name)
+{
+    path_combine(path, path_size, ram_file_base ? ram_file_base : "", name);
+}
+
+void ram_set_save_file(const char *name)
+{
+    qemu_free(ram_save_name);
+    ram_save_name = name ? qemu_strdup(name) : NULL;
+}
+
+void ram_commit_save_file(int keep)
+{
+    char path[1024], tmp[1024 + 4];
+
+    if (!ram_save_name)
+        return;
 
-    for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
-        if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-            count++;
+    ram_get_file_path(path, sizeof(path), ram_save_name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!keep) {
+        unlink(tmp);
+    } else if (rename(tmp, path) < 0 && errno != ENOENT) {
+        fprintf(stderr, "Could not rename RAM file '%s': %s\n",
+                path, strerror(errno));
+        unlink(tmp);
     }
+    ram_set_save_file(NULL);
+}
+
+static int ram_page_is_zero(const uint8_t *page)
+{
+    const unsigned long *p = (const unsigned long *)page;
+    int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(unsigned long); i++) {
+        if (p[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* return the length of the run of RAM starting at 'addr' which is
+   contiguous in host memory, optionally stopping at the first zero page */
+static ram_addr_t ram_host_run(ram_addr_t addr, int stop_at_zero)
+{
+    uint8_t *start = qemu_get_ram_ptr(addr);
+    ram_addr_t len = 0;
+
+    while (addr + len < last_ram_offset &&
+           qemu_get_ram_ptr(addr + len) == start + len) {
+        if (stop_at_zero) {
+            /* pages discarded by the guest are known to be zero */
+            if (!cpu_physical_memory_get_dirty(addr + len,
+                                               FREE_PAGE_DIRTY_FLAG))
+                break;
+            if (ram_page_is_zero(start + len))
+                break;
+        }
+        len += TARGET_PAGE_SIZE;
+    }
+
+    return len;
+}
 
-    return count;
+static int ram_file_io(int fd, uint8_t *buf, ram_addr_t len, ram_addr_t pos,
+                       int is_write)
+{
+    if (lseek(fd, pos, SEEK_SET) == (off_t)-1)
+        return -errno;
+
+    while (len > 0) {
+        ssize_t ret = is_write ? write(fd, buf, len) : read(fd, buf, len);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (ret == 0) {
+            if (is_write)
+                return -EIO;
+            /* past the end of the file */
+            memset(buf, 0, len);
+            break;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Write all guest RAM to the temporary file for 'name', leaving holes
+   for zero pages. The emulator whose RAM is mapped from an older file
+   with the same name keeps its view of that file once it is replaced. */
+static int ram_save_file(QEMUFile *f, const char *name)
+{
+    char path[1024], tmp[1024 + 4];
+    ram_addr_t addr, len;
+    int fd, ret = 0;
+
+    ram_get_file_path(path, sizeof(path), name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    for (addr = 0; addr < last_ram_offset && ret == 0; addr += len) {
+        len = ram_host_run(addr, 1);
+        if (len == 0) {
+            len = TARGET_PAGE_SIZE;
+            continue;
+        }
+        ret = ram_file_io(fd, qemu_get_ram_ptr(addr), len, addr, 1);
+        ram_stats.stored_bytes += len;
+    }
+    if (ret == 0 && ftruncate(fd, last_ram_offset) < 0)
+        ret = -errno;
+    close(fd);
+    if (ret < 0)
+        goto fail;
+
+    for (addr = 0; addr < last_ram_offset; addr += len) {
+        len = ram_host_run(addr, 0);
+        cpu_physical_memory_reset_dirty(addr, addr + len,
+                                        MIGRATION_DIRTY_FLAG);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_FILE);
+    qemu_put_be32(f, strlen(name));
+    qemu_put_buffer(f, (const uint8_t *)name, strlen(name));
+    qemu_put_be64(f, last_ram_offset);
+
+    ram_stats.raw_bytes += last_ram_offset;
+    return 0;
+
+fail:
+    fprintf(stderr, "Could not write RAM file '%s': %s\n",
+            path, strerror(-ret));
+    unlink(tmp);
+    return ret;
+}
+
+/* Delta snapshots (version 6) only contain the pages modified since the
+ * snapshot they are based on, which must be loaded first. Their stream
+ * starts with:
+ *
+ *   be64  RAM_SAVE_FLAG_PARENT
+ *   be32  length of parent id
+ *   ...   parent snapshot id
+ *
+ * ram_base_id is the id of the snapshot whose RAM only differs from the
+ * current one by the pages with MIGRATION_DIRTY_FLAG set. It is set by
+ * savevm and loadvm, and cleared by any other save since that resets
+ * the dirty flags.
+ */
+static char ram_base_id[128];
+static char ram_save_parent_id[128];
+
+void ram_set_save_parent(const char *id)
+{
+    pstrcpy(ram_save_parent_id, sizeof(ram_save_parent_id), id ? id : "");
+}
+
+const char *ram_get_base(void)
+{
+    return ram_base_id[0] ? ram_base_id : NULL;
+}
+
+void ram_set_base(const char *id)
+{
+    ram_addr_t addr, len;
+
+    pstrcpy(ram_base_id, sizeof(ram_base_id), id ? id : "");
+    if (!id)
+        return;
+
+    /* only track changes made from now on */
+    for (addr = 0; addr < last_ram_offset; addr += len) {
+        len = ram_host_run(addr, 0);
+        cpu_physical_memory_reset_dirty(addr, addr + len,
+                                        MIGRATION_DIRTY_FLAG);
+    }
+}
+
+static uint64_t bytes_transferred = 0;
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return cpu_physical_memory_count_dirty(MIGRATION_DIRTY_FLAG);
 }
 
 uint64_t ram_bytes_remaining(void)
@@ -3194,8 +3777,15 @@ static int ram_save_live(QEMUFile *f, int stage, void *opaque)
     cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX);
 
     if (stage == 1) {
-        /* Make sure all dirty bits are set */
-        for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
+        int delta = ram_save_parent_id[0] != '\0' &&
+                    !strcmp(ram_save_parent_id, ram_base_id);
+
+        ram_base_id[0] = '\0';
+
+        /* Make sure all dirty bits are set, unless only the pages
+           modified since the parent snapshot must be saved */
+        for (addr = 0; !delta && addr < last_ram_offset;
+             addr += TARGET_PAGE_SIZE) {
             if (!cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
                 cpu_physical_memory_set_dirty(addr);
         }
@@ -3204,19 +3794,24 @@ static int ram_save_live(QEMUFile *f, int stage, void *opaque)
         cpu_physical_memory_set_dirty_tracking(1);
 
         qemu_put_be64(f, last_ram_offset | RAM_SAVE_FLAG_MEM_SIZE);
+
+        if (delta) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_PARENT);
+            qemu_put_be32(f, strlen(ram_save_parent_id));
+            qemu_put_buffer(f, (uint8_t *)ram_save_parent_id,
+                            strlen(ram_save_parent_id));
+        } else if (ram_save_name) {
+            if (ram_save_file(f, ram_save_name) < 0)
+                qemu_file_set_error(f);
+            else
+                bytes_transferred += last_ram_offset;
+        }
     }
 
     bytes_transferred_last = bytes_transferred;
     bwidth = get_clock();
 
-    while (!qemu_file_rate_limit(f)) {
-        int ret;
-
-        ret = ram_save_block(f);
-        bytes_transferred += ret * TARGET_PAGE_SIZE;
-        if (ret == 0) /* no more blocks */
-            break;
-    }
+    bytes_transferred += ram_save_chunks(f, 1) * TARGET_PAGE_SIZE;
 
     bwidth = get_clock() - bwidth;
     bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
@@ -3231,9 +3826,7 @@ static int ram_save_live(QEMUFile *f, int stage, void *opaque)
     if (stage == 3) {
 
         /* flush all remaining blocks regardless of rate limiting */
-        while (ram_save_block(f) != 0) {
-            bytes_transferred += TARGET_PAGE_SIZE;
-        }
+        bytes_transferred += ram_save_chunks(f, 0) * TARGET_PAGE_SIZE;
         cpu_physical_memory_set_dirty_tracking(0);
     }
 
@@ -3274,11 +3867,292 @@ static int ram_load_dead(QEMUFile *f, void *opaque)
     return 0;
 }
 
+/* RAM_CHUNK_DUP pages are copied once all chunks received by the current
+   ram_load() call have been decompressed */
+typedef struct RamDupPage {
+    uint8_t *dst;
+    uint8_t *src;
+} RamDupPage;
+
+static RamDupPage *ram_dup_pages;
+static int ram_dup_count;
+static int ram_dup_max;
+
+/* wait for all chunks being decompressed, then copy duplicate pages */
+static int ram_load_flush(void)
+{
+    int i, ret = 0;
+
+    while (ram_chunk_count > 0) {
+        if (ram_chunk_retire()->len < 0)
+            ret = -EINVAL;
+    }
+
+    if (ret == 0) {
+        for (i = 0; i < ram_dup_count; i++)
+            memcpy(ram_dup_pages[i].dst, ram_dup_pages[i].src,
+                   TARGET_PAGE_SIZE);
+    }
+    ram_dup_count = 0;
+
+    return ret;
+}
+
+static int ram_load_chunk(QEMUFile *f)
+{
+    RamChunk *c;
+    uint64_t stored = 8 + 4 + 4;
+    int i, n, len;
+
+    ram_chunks_init();
+
+    if (ram_chunk_count == ram_nchunks && ram_chunk_retire()->len < 0)
+        return -EINVAL;
+
+    c = ram_chunk_next();
+    n = qemu_get_be32(f);
+    if (n < 0 || n > RAM_CHUNK_PAGES)
+        return -EINVAL;
+
+    c->npages = n;
+    c->ndata = 0;
+    for (i = 0; i < n; i++) {
+        uint64_t v = qemu_get_be64(f);
+        ram_addr_t addr = v & TARGET_PAGE_MASK;
+        ram_addr_t src;
+        uint8_t *p;
+
+        if (addr >= last_ram_offset)
+            return -EINVAL;
+        p = qemu_get_ram_ptr(addr);
+        stored += 8;
+
+        switch (v & ~TARGET_PAGE_MASK) {
+        case RAM_CHUNK_PAGE:
+            c->data[c->ndata++] = p;
+            break;
+        case RAM_CHUNK_FILL:
+            memset(p, qemu_get_byte(f), TARGET_PAGE_SIZE);
+            stored += 1;
+            ram_stats.fill_pages++;
+            break;
+        case RAM_CHUNK_DUP:
+            src = qemu_get_be64(f);
+            stored += 8;
+            if (src >= last_ram_offset || (src & ~TARGET_PAGE_MASK))
+                return -EINVAL;
+            if (ram_dup_count == ram_dup_max) {
+                ram_dup_max = ram_dup_max ? 2 * ram_dup_max : 256;
+                ram_dup_pages = qemu_realloc(ram_dup_pages,
+                                             ram_dup_max * sizeof(RamDupPage));
+            }
+            ram_dup_pages[ram_dup_count].dst = p;
+            ram_dup_pages[ram_dup_count].src = qemu_get_ram_ptr(src);
+            ram_dup_count++;
+            ram_stats.dup_pages++;
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    len = qemu_get_be32(f);
+    if (len < 0 || len > c->buf_size)
+        return -EINVAL;
+    qemu_get_buffer(f, c->buf, len);
+    c->len = len;
+
+    ram_stats.raw_bytes += (uint64_t)n * TARGET_PAGE_SIZE;
+    ram_stats.stored_bytes += stored + len;
+
+    if (c->ndata > 0) {
+        ram_chunk_count++;
+        thread_pool_submit(ram_pool, &c->job, ram_chunk_decompress, c);
+    }
+    return 0;
+}
+
+static int ram_load_file(QEMUFile *f)
+{
+    char name[1024], path[1024];
+    ram_addr_t addr, len;
+    int fd, ret = -ENOTSUP;
+
+    len = qemu_get_be32(f);
+    if (len == 0 || len >= sizeof(name))
+        return -EINVAL;
+    qemu_get_buffer(f, (uint8_t *)name, len);
+    name[len] = 0;
+
+    if (qemu_get_be64(f) != last_ram_offset)
+        return -EINVAL;
+
+    ram_get_file_path(path, sizeof(path), name);
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        ret = -errno;
+        fprintf(stderr, "Could not open RAM file '%s': %s\n",
+                path, strerror(errno));
+        return ret;
+    }
+
+    if (mapped_ram) {
+        ret = qemu_ram_map_file(fd);
+        if (ret == 0)
+            ram_stats.mapped_bytes += last_ram_offset;
+    }
+    if (ret < 0) {
+        /* not mapped, guest RAM was left untouched */
+        ret = 0;
+        for (addr = 0; addr < last_ram_offset && ret == 0; addr += len) {
+            len = ram_host_run(addr, 0);
+            ret = ram_file_io(fd, qemu_get_ram_ptr(addr), len, addr, 0);
+        }
+    }
+    close(fd);
+
+    ram_stats.raw_bytes += last_ram_offset;
+    return ret;
+}
+
+static int ram_load_parent(QEMUFile *f)
+{
+    char id[128];
+    int len;
+
+    len = qemu_get_be32(f);
+    if (len <= 0 || len >= sizeof(id))
+        return -EINVAL;
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = '\0';
+
+    /* the RAM of the parent snapshot must have been loaded just before */
+    if (strcmp(id, ram_base_id) != 0) {
+        fprintf(stderr, "RAM of parent snapshot '%s' is not loaded\n", id);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int ram_copy_bytes(QEMUFile *f, QEMUFile *out, int64_t len)
+{
+    uint8_t buf[4096];
+
+    while (len > 0) {
+        int n = len > sizeof(buf) ? (int)sizeof(buf) : (int)len;
+
+        if (qemu_get_buffer(f, buf, n) != n)
+            return -EIO;
+        qemu_put_buffer(out, buf, n);
+        len -= n;
+    }
+    return 0;
+}
+
+static int ram_copy_chunk(QEMUFile *f, QEMUFile *out)
+{
+    int i, n, len;
+
+    n = qemu_get_be32(f);
+    if (n < 0 || n > RAM_CHUNK_PAGES)
+        return -EINVAL;
+    qemu_put_be32(out, n);
+    for (i = 0; i < n; i++) {
+        uint64_t v = qemu_get_be64(f);
+
+        qemu_put_be64(out, v);
+        switch (v & ~TARGET_PAGE_MASK) {
+        case RAM_CHUNK_PAGE:
+            break;
+        case RAM_CHUNK_FILL:
+            qemu_put_byte(out, qemu_get_byte(f));
+            break;
+        case RAM_CHUNK_DUP:
+            qemu_put_be64(out, qemu_get_be64(f));
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    len = qemu_get_be32(f);
+    if (len < 0 || len > compressBound(RAM_CHUNK_PAGES * TARGET_PAGE_SIZE))
+        return -EINVAL;
+    qemu_put_be32(out, len);
+    return ram_copy_bytes(f, out, len);
+}
+
+int ram_copy_section(QEMUFile *f, QEMUFile *out, RamSectionCopy *rc)
+{
+    uint64_t v;
+    int flags, len, ret = 0;
+
+    do {
+        v = qemu_get_be64(f);
+        if (qemu_file_has_error(f))
+            return -EIO;
+        flags = v & ~TARGET_PAGE_MASK;
+
+        /* the old format has no record boundaries */
+        if (flags & RAM_SAVE_FLAG_FULL)
+            return -ENOTSUP;
+
+        if (!(flags == RAM_SAVE_FLAG_PARENT && rc->drop_parent))
+            qemu_put_be64(out, v);
+
+        if (flags & RAM_SAVE_FLAG_PARENT) {
+            len = qemu_get_be32(f);
+            if (len <= 0 || len >= sizeof(rc->parent_id))
+                return -EINVAL;
+            qemu_get_buffer(f, (uint8_t *)rc->parent_id, len);
+            rc->parent_id[len] = '\0';
+            if (!rc->drop_parent) {
+                qemu_put_be32(out, len);
+                qemu_put_buffer(out, (uint8_t *)rc->parent_id, len);
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_FILE) {
+            const char *name;
+
+            len = qemu_get_be32(f);
+            if (len <= 0 || len >= sizeof(rc->file))
+                return -EINVAL;
+            qemu_get_buffer(f, (uint8_t *)rc->file, len);
+            rc->file[len] = '\0';
+            name = rc->new_file ? rc->new_file : rc->file;
+            qemu_put_be32(out, strlen(name));
+            qemu_put_buffer(out, (const uint8_t *)name, strlen(name));
+            qemu_put_be64(out, qemu_get_be64(f));
+        }
+
+        if (flags & RAM_SAVE_FLAG_CHUNK)
+            ret = ram_copy_chunk(f, out);
+        else if (flags & RAM_SAVE_FLAG_COMPRESS)
+            qemu_put_byte(out, qemu_get_byte(f));
+        else if (flags & RAM_SAVE_FLAG_PAGE)
+            ret = ram_copy_bytes(f, out, TARGET_PAGE_SIZE);
+        if (ret < 0)
+            return ret;
+    } while (!(flags & RAM_SAVE_FLAG_EOS));
+
+    if (qemu_file_has_error(f) || qemu_file_has_error(out))
+        return -EIO;
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
     int flags;
 
+    /* RAM is written directly below, so pages discarded by the guest
+       must not be assumed to contain zeroes anymore, and cached page
+       table descriptors must be dropped */
+    for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE)
+        cpu_physical_memory_set_dirty_flags(addr, FREE_PAGE_DIRTY_FLAG |
+                                                  PGTABLE_DIRTY_FLAG);
+
     if (version_id == 1)
         return ram_load_v1(f, opaque);
 
@@ -3288,7 +4162,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         return ram_load_dead(f, opaque);
     }
 
-    if (version_id != 3)
+    if (version_id < 3 || version_id > 6)
         return -EINVAL;
 
     do {
@@ -3299,22 +4173,39 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
             if (addr != last_ram_offset)
-                return -EINVAL;
+                goto error;
         }
 
         if (flags & RAM_SAVE_FLAG_FULL) {
             if (ram_load_dead(f, opaque) < 0)
-                return -EINVAL;
+                goto error;
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        if (flags & RAM_SAVE_FLAG_PARENT) {
+            if (version_id < 6 || ram_load_parent(f) < 0)
+                goto error;
+        }
+
+        if (flags & RAM_SAVE_FLAG_FILE) {
+            if (version_id < 5 || ram_load_file(f) < 0)
+                goto error;
+        }
+
+        if (flags & RAM_SAVE_FLAG_CHUNK) {
+            if (version_id < 4 || ram_load_chunk(f) < 0)
+                goto error;
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
             uint8_t ch = qemu_get_byte(f);
             memset(qemu_get_ram_ptr(addr), ch, TARGET_PAGE_SIZE);
         } else if (flags & RAM_SAVE_FLAG_PAGE)
             qemu_get_buffer(f, qemu_get_ram_ptr(addr), TARGET_PAGE_SIZE);
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
-    return 0;
+    return ram_load_flush();
+
+error:
+    ram_load_flush();
+    return -EINVAL;
 }
 
 void qemu_service_io(void)
@@ -3466,14 +4357,131 @@ static QEMUMachine *find_default_machine(void)
     return NULL;
 }
 
+/***********************************************************/
+/* guest idle accounting */
+
+/* The guest is idle while all CPUs are halted, either by WFI or in an
+   idle loop (see cpu_is_idle_loop()). The main loop then sleeps until
+   the next timer deadline or I/O event. */
+
+/* percentage of idle time above which periodic refreshes slow down */
+#define GUEST_IDLE_PERCENT  95
+
+typedef struct IdleSample {
+    int64_t time;
+    int64_t idle_time;
+} IdleSample;
+
+static int64_t idle_start;      /* when the guest became idle, or 0 */
+static int64_t idle_cpu_start;  /* host CPU time used at idle_start */
+static int64_t idle_time;       /* total time spent idle */
+static int64_t idle_cpu_time;   /* host CPU time used while idle */
+static uint64_t idle_wakeups;   /* main loop iterations while idle */
+static uint64_t idle_loops;     /* idle loops halted */
+static int64_t idle_stats_time;
+static int64_t idle_stats_cpu_time;
+
+/* host CPU time used by all threads of the process, in ns */
+static int64_t get_process_cpu_time(void)
+{
+#ifdef _WIN32
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time,
+                         &kernel_time, &user_time))
+        return 0;
+    return ((((int64_t)kernel_time.dwHighDateTime << 32) |
+             kernel_time.dwLowDateTime) +
+            (((int64_t)user_time.dwHighDateTime << 32) |
+             user_time.dwLowDateTime)) * 100;
+#else
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return 0;
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+#endif
+}
+
+static void guest_idle_init(void)
+{
+    idle_stats_time = get_clock();
+    idle_stats_cpu_time = get_process_cpu_time();
+}
+
+/* Called by the main loop before each wait */
+static void guest_idle_update(int idle)
+{
+    if (idle) {
+        if (!idle_start) {
+            idle_start = get_clock();
+            idle_cpu_start = get_process_cpu_time();
+        }
+        idle_wakeups++;
+    } else if (idle_start) {
+        idle_time += get_clock() - idle_start;
+        idle_cpu_time += get_process_cpu_time() - idle_cpu_start;
+        idle_start = 0;
+    }
+}
+
+/* Returns nonzero if the guest was idle most of the time since the
+   previous call with the same sample, which is then updated. */
+static int guest_idle_since(IdleSample *s)
+{
+    int64_t now = get_clock();
+    int64_t total = idle_time;
+    int ret;
+
+    if (idle_start)
+        total += now - idle_start;
+    ret = (total - s->idle_time) * 100 >= (now - s->time) * GUEST_IDLE_PERCENT;
+    s->time = now;
+    s->idle_time = total;
+    return ret;
+}
+
+/* x / y, in tenths of percent */
+static int idle_permille(int64_t x, int64_t y)
+{
+    return y > 0 ? (int)(x * 1000 / y) : 0;
+}
+
+void do_info_idle(Monitor *mon)
+{
+    int64_t now = get_clock();
+    int64_t cpu = get_process_cpu_time();
+    int64_t total = now - idle_stats_time;
+    int64_t idle = idle_time, idle_cpu = idle_cpu_time;
+    int p;
+
+    if (idle_start) {
+        idle += now - idle_start;
+        idle_cpu += cpu - idle_cpu_start;
+    }
+    p = idle_permille(idle, total);
+    monitor_printf(mon, "guest idle: %" PRId64 " ms of %" PRId64 " ms (%d.%d%%)\n",
+                   idle / 1000000, total / 1000000, p / 10, p % 10);
+    p = idle_permille(idle_cpu, idle);
+    monitor_printf(mon, "host CPU while idle: %d.%d%%, %" PRIu64 " wakeups "
+                   "(%" PRId64 "/s)\n", p / 10, p % 10, idle_wakeups,
+                   idle > 0 ? (int64_t)(idle_wakeups * 1000000000ULL / idle) : 0);
+    p = idle_permille(cpu - idle_stats_cpu_time, total);
+    monitor_printf(mon, "host CPU overall: %d.%d%%\n", p / 10, p % 10);
+    monitor_printf(mon, "idle loops halted: %" PRIu64 "\n", idle_loops);
+}
+
 /***********************************************************/
 /* main execution loop */
 
 static void gui_update(void *opaque)
 {
+    static IdleSample gui_idle;
     uint64_t interval = GUI_REFRESH_INTERVAL;
     DisplayState *ds = opaque;
     DisplayChangeListener *dcl = ds->listeners;
+    int idle = guest_idle_since(&gui_idle);
 
     dpy_refresh(ds);
 
@@ -3481,15 +4489,23 @@ static void gui_update(void *opaque)
         if (dcl->gui_timer_interval &&
             dcl->gui_timer_interval < interval)
             interval = dcl->gui_timer_interval;
+        idle &= dcl->idle;
         dcl = dcl->next;
     }
+    /* the framebuffer does not change while the guest is idle, only
+       listeners that poll for input need frequent refreshes then */
+    if (idle)
+        interval = GUI_IDLE_REFRESH_INTERVAL;
     qemu_mod_timer(ds->gui_timer, interval + qemu_get_clock(rt_clock));
 }
 
 static void nographic_update(void *opaque)
 {
+    static IdleSample nographic_idle;
     uint64_t interval = GUI_REFRESH_INTERVAL;
 
+    if (guest_idle_since(&nographic_idle))
+        interval = GUI_IDLE_REFRESH_INTERVAL;
     qemu_mod_timer(nographic_timer, interval + qemu_get_clock(rt_clock));
 }
 
@@ -4201,67 +5217,89 @@ static void host_main_loop_wait(int *timeout)
 
 void main_loop_wait(int timeout)
 {
-    IOHandlerRecord *ioh;
-    fd_set rfds, wfds, xfds;
-    int ret, nfds;
-    struct timeval tv;
+    IOHandlerRecord **pioh, *ioh;
+    int ret;
+
+    /* handle the I/O writes queued since the CPU last ran */
+    cpu_io_memory_flush_posted();
 
     qemu_bh_update_timeout(&timeout);
 
     host_main_loop_wait(&timeout);
 
-    /* poll any events */
-    /* XXX: separate device handlers from system ones */
-    nfds = -1;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&xfds);
-    for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
-        if (ioh->deleted)
+    get_main_looper();
+
+    /* only the handlers with a fd_read_poll callback can change the
+     * events they wait for on their own, the others are registered by
+     * qemu_set_fd_handler2() */
+    pioh = &first_poll_handler;
+    while ((ioh = *pioh) != NULL) {
+        int flags = 0;
+
+        if (ioh->deleted || !ioh->fd_read_poll) {
+            *pioh = ioh->poll_next;
+            ioh->in_poll_list = 0;
             continue;
-        if (ioh->fd_read &&
-            (!ioh->fd_read_poll ||
-             ioh->fd_read_poll(ioh->opaque) != 0)) {
-            FD_SET(ioh->fd, &rfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
+        }
+        if (ioh->fd_read && ioh->fd_read_poll(ioh->opaque) != 0) {
+            flags |= IOLOOPER_READ;
         }
         if (ioh->fd_write) {
-            FD_SET(ioh->fd, &wfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
+            flags |= IOLOOPER_WRITE;
         }
+        io_handler_set_events(ioh, flags);
+        pioh = &ioh->poll_next;
     }
 
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
-
 #if defined(CONFIG_SLIRP)
     if (slirp_is_inited()) {
-        slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+        slirp_select_fill(main_looper);
     }
 #endif
     qemu_mutex_unlock_iothread();
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    ret = iolooper_wait(main_looper, timeout);
     qemu_mutex_lock_iothread();
     if (ret > 0) {
-        IOHandlerRecord **pioh;
+        int iter, fd;
 
-        for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
-            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, &rfds)) {
+        /* only look at the descriptors reported ready, slirp's ones are
+         * not in the map. a handler deleted by a callback is only freed
+         * below, so its record stays valid here */
+        for (iter = 0; (fd = iolooper_next_ready(main_looper, &iter)) >= 0; ) {
+            ioh = io_handler_lookup(fd);
+            if (ioh == NULL)
+                continue;
+            if (!ioh->deleted && ioh->fd_read &&
+                iolooper_is_read(main_looper, ioh->fd)) {
                 ioh->fd_read(ioh->opaque);
             }
-            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, &wfds)) {
+            if (!ioh->deleted && ioh->fd_write &&
+                iolooper_is_write(main_looper, ioh->fd)) {
                 ioh->fd_write(ioh->opaque);
             }
         }
+    }
 
-	/* remove deleted IO handlers */
-	pioh = &first_io_handler;
-	while (*pioh) {
+    /* remove deleted IO handlers */
+    if (io_handlers_deleted) {
+        io_handlers_deleted = 0;
+
+        pioh = &first_poll_handler;
+        while ((ioh = *pioh) != NULL) {
+            if (ioh->deleted) {
+                *pioh = ioh->poll_next;
+                ioh->in_poll_list = 0;
+            } else
+                pioh = &ioh->poll_next;
+        }
+
+        pioh = &first_io_handler;
+        while (*pioh) {
             ioh = *pioh;
             if (ioh->deleted) {
                 *pioh = ioh->next;
+                if (io_handler_lookup(ioh->fd) == ioh)
+                    io_handler_map[ioh->fd] = NULL;
                 qemu_free(ioh);
             } else
                 pioh = &ioh->next;
@@ -4269,12 +5307,7 @@ void main_loop_wait(int timeout)
     }
 #if defined(CONFIG_SLIRP)
     if (slirp_is_inited()) {
-        if (ret < 0) {
-            FD_ZERO(&rfds);
-            FD_ZERO(&wfds);
-            FD_ZERO(&xfds);
-        }
-        slirp_select_poll(&rfds, &wfds, &xfds);
+        slirp_select_poll(main_looper);
     }
 #endif
     charpipe_poll();
@@ -4288,16 +5321,13 @@ void main_loop_wait(int timeout)
     /* vm time timers */
     if (vm_running) {
         if (!cur_cpu || likely(!(cur_cpu->singlestep_enabled & SSTEP_NOTIMER)))
-            qemu_run_timers(&active_timers[QEMU_CLOCK_VIRTUAL],
-                qemu_get_clock(vm_clock));
+            qemu_run_timers(vm_clock, qemu_get_clock(vm_clock));
     }
 
     /* real time timers */
-    qemu_run_timers(&active_timers[QEMU_CLOCK_REALTIME],
-                    qemu_get_clock(rt_clock));
+    qemu_run_timers(rt_clock, qemu_get_clock(rt_clock));
 
-    qemu_run_timers(&active_timers[QEMU_CLOCK_HOST],
-                    qemu_get_clock(host_clock));
+    qemu_run_timers(host_clock, qemu_get_clock(host_clock));
 
     /* Check bottom-halves last in case any of the earlier events triggered
        them.  */
@@ -4369,6 +5399,13 @@ static void tcg_cpu_exec(void)
             timer_alarm_pending = 0;
             break;
         }
+        if (env->idle_loop) {
+            /* the events that may end the idle loop have been handled,
+               let the CPU poll again */
+            env->idle_loop = 0;
+            env->halted = 0;
+            idle_loops++;
+        }
         if (cpu_can_run(env))
             ret = qemu_cpu_exec(env);
         if (ret == EXCP_DEBUG) {
@@ -4402,6 +5439,29 @@ static int tcg_has_work(void)
     return 0;
 }
 
+/* Returns the time until the next timer deadline of any clock, in ms,
+   which is how long the main loop can sleep when all CPUs are halted.
+
+   A CPU halted in an idle loop doesn't need an earlier wakeup even if it
+   polls memory that a device writes without raising an interrupt: device
+   code only runs from the main loop after it woke up (the AIO threads
+   signal their completions through a descriptor), and tcg_cpu_exec()
+   resumes every idle loop after each wakeup. */
+static int qemu_idle_timeout(void)
+{
+    int64_t delta = qemu_next_deadline();
+
+    if (active_timers[QEMU_CLOCK_REALTIME]) {
+        int64_t rtdelta = (active_timers[QEMU_CLOCK_REALTIME]->expire_time -
+                           qemu_get_clock(rt_clock)) * 1000000;
+        if (rtdelta < delta)
+            delta = rtdelta;
+    }
+    if (delta < 0)
+        delta = 0;
+    return (delta + 999999) / 1000000;
+}
+
 static int qemu_calculate_timeout(void)
 {
 #ifndef CONFIG_IOTHREAD
@@ -4412,7 +5472,7 @@ static int qemu_calculate_timeout(void)
     else if (tcg_has_work())
         timeout = 0;
     else if (!use_icount)
-        timeout = 5000;
+        timeout = qemu_idle_timeout();
     else {
      /* XXX: use timeout computed from timers */
         int64_t add;
@@ -4488,6 +5548,7 @@ static void main_loop(void)
 #ifdef CONFIG_PROFILER
             ti = profile_getclock();
 #endif
+            guest_idle_update(vm_running && !tcg_has_work());
             main_loop_wait(qemu_calculate_timeout());
 #ifdef CONFIG_PROFILER
             dev_time += profile_getclock() - ti;
@@ -5499,6 +6560,23 @@ int main(int argc, char **argv, char **envp)
 	    case QEMU_OPTION_loadvm:
 		loadvm = optarg;
 		break;
+            case QEMU_OPTION_mapped_ram:
+                mapped_ram = 1;
+                break;
+            case QEMU_OPTION_mem_merge:
+                mem_merge = 1;
+                break;
+            case QEMU_OPTION_mem_dedup:
+                mem_dedup_file = optarg;
+                mem_merge = 1;
+                break;
+            case QEMU_OPTION_metadata_cache_size:
+                bdrv_metadata_cache_size = (int64_t)atoi(optarg) * 1024;
+                if (bdrv_metadata_cache_size <= 0) {
+                    fprintf(stderr, "Invalid metadata cache size\n");
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_full_screen:
                 full_screen = 1;
                 break;
@@ -5687,6 +6765,22 @@ int main(int argc, char **argv, char **envp)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_tlb_size:
+                {
+                    long n = strtol(optarg, NULL, 0);
+
+                    for (cpu_tlb_bits = CPU_TLB_MIN_BITS;
+                         cpu_tlb_bits < CPU_TLB_MAX_BITS &&
+                         (1L << cpu_tlb_bits) < n; cpu_tlb_bits++)
+                        ;
+                    if (n != (1L << cpu_tlb_bits)) {
+                        fprintf(stderr, "qemu: invalid TLB size '%s', must be "
+                                "a power of 2 between %d and %d\n", optarg,
+                                1 << CPU_TLB_MIN_BITS, 1 << CPU_TLB_MAX_BITS);
+                        exit(1);
+                    }
+                }
+                break;
             case QEMU_OPTION_icount:
                 use_icount = 1;
                 if (strcmp(optarg, "auto") == 0) {
@@ -6012,7 +7106,7 @@ int main(int argc, char **argv, char **envp)
 	    exit(1);
 
     register_savevm("timer", 0, 2, timer_save, timer_load, NULL);
-    register_savevm_live("ram", 0, 3, ram_save_live, NULL, ram_load, NULL);
+    register_savevm_live("ram", 0, 6, ram_save_live, NULL, ram_load, NULL);
 
 #ifndef _WIN32
     /* must be after terminal init, SDL library changes signal handlers */
@@ -6285,6 +7379,15 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    if (mem_dedup_file) {
+        int ret = ram_dedup_init(mem_dedup_file);
+        if (ret < 0) {
+            fprintf(stderr, "qemu: could not use RAM page store '%s': %s\n",
+                    mem_dedup_file, strerror(-ret));
+            exit(1);
+        }
+    }
+
     if (loadvm)
         do_loadvm(cur_mon, loadvm);
 
@@ -6364,7 +7467,9 @@ int main(int argc, char **argv, char **envp)
     }
 #endif
 
+    guest_idle_init();
     main_loop();
+    bdrv_close_all();
     quit_timers();
     net_cleanup();
     android_emulation_teardown();